@@ -48,6 +48,8 @@ CDevice9::CDevice9(C9* Instance, UINT Adapter, D3DDEVTYPE DeviceType, HWND hFocu
 	mCommandStreamManager = mInstance->mCommandStreamManager;
 	mInstanceId = mInstance->mId;
 
+	mShadowState.SetDefaults();
+
 	if (!mPresentationParameters.Windowed)
 	{
 		DEVMODE newSettings = {};
@@ -85,6 +87,16 @@ CDevice9::~CDevice9()
 	}
 }
 
+DeviceState& CDevice9::GetShadowState()
+{
+	if (mIsRecording)
+	{
+		return mRecordingState;
+	}
+
+	return mShadowState;
+}
+
 HRESULT STDMETHODCALLTYPE CDevice9::Clear(DWORD Count, const D3DRECT *pRects, DWORD Flags, D3DCOLOR Color, float Z, DWORD Stencil)
 {
 	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this);
@@ -178,6 +190,9 @@ ULONG STDMETHODCALLTYPE CDevice9::Release(void)
 
 HRESULT STDMETHODCALLTYPE CDevice9::BeginStateBlock()
 {
+	mRecordingState = DeviceState();
+	mIsRecording = true;
+
 	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this);
 	workItem->WorkItemType = WorkItemType::Device_BeginStateBlock;
 	workItem->Id = mId;
@@ -289,8 +304,8 @@ HRESULT STDMETHODCALLTYPE CDevice9::CreatePixelShader(const DWORD *pFunction, ID
 	workItem->WorkItemType = WorkItemType::Shader_Create;
 	workItem->Argument1 = (void*)obj->mFunction;
 	workItem->Argument2 = (void*)false;
-	workItem->Argument3 = (void*)&obj->mSize;
-	obj->mId = this->mCommandStreamManager->RequestWorkAndWait(workItem);
+	workItem->Argument3 = (void*)obj->mSize;
+	obj->mId = this->mCommandStreamManager->RequestWork(workItem); //Translation finishes in the background.
 
 	(*ppShader) = (IDirect3DPixelShader9*)obj;
 
@@ -337,11 +352,14 @@ HRESULT STDMETHODCALLTYPE CDevice9::CreateStateBlock(D3DSTATEBLOCKTYPE Type, IDi
 	CStateBlock9* obj = new CStateBlock9(this, Type);
 
 	obj->mCommandStreamManager = this->mCommandStreamManager;
+	obj->mId = this->mId;
+	MergeState(mShadowState, obj->mShadowState, Type, false); //A state block captures the device state even if another block is being recorded.
+
 	WorkItem* workItem = this->mCommandStreamManager->GetWorkItem(this);
 	workItem->Id = this->mId;
 	workItem->WorkItemType = WorkItemType::StateBlock_Create;
 	workItem->Argument1 = (void*)obj;
-	obj->mId = this->mCommandStreamManager->RequestWorkAndWait(workItem);
+	this->mCommandStreamManager->RequestWorkAndWait(workItem);
 
 	(*ppSB) = (IDirect3DStateBlock9*)obj;
 
@@ -412,8 +430,8 @@ HRESULT STDMETHODCALLTYPE CDevice9::CreateVertexShader(const DWORD *pFunction, I
 	workItem->WorkItemType = WorkItemType::Shader_Create;
 	workItem->Argument1 = (void*)obj->mFunction;
 	workItem->Argument2 = (void*)true;
-	workItem->Argument3 = (void*)&obj->mSize;
-	obj->mId = mCommandStreamManager->RequestWorkAndWait(workItem);
+	workItem->Argument3 = (void*)obj->mSize;
+	obj->mId = mCommandStreamManager->RequestWork(workItem); //Translation finishes in the background.
 
 	(*ppShader) = (IDirect3DVertexShader9*)obj;
 
@@ -533,6 +551,10 @@ HRESULT STDMETHODCALLTYPE CDevice9::EndStateBlock(IDirect3DStateBlock9** ppSB)
 	workItem->Argument1 = bit_cast<void*>(ppSB);
 	mCommandStreamManager->RequestWorkAndWait(workItem);
 
+	((CStateBlock9*)(*ppSB))->mShadowState = mRecordingState;
+	mRecordingState = DeviceState();
+	mIsRecording = false;
+
 	return S_OK;
 }
 
@@ -654,11 +676,7 @@ HRESULT STDMETHODCALLTYPE CDevice9::GetFrontBufferData(UINT  iSwapChain, IDirect
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetFVF(DWORD *pFVF)
 {
-	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this);
-	workItem->WorkItemType = WorkItemType::Device_GetFVF;
-	workItem->Id = mId;
-	workItem->Argument1 = bit_cast<void*>(pFVF);
-	mCommandStreamManager->RequestWorkAndWait(workItem);
+	(*pFVF) = GetShadowState().mFVF;
 
 	return S_OK;
 }
@@ -684,50 +702,42 @@ HRESULT STDMETHODCALLTYPE CDevice9::GetIndices(IDirect3DIndexBuffer9 **ppIndexDa
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetLight(DWORD Index, D3DLIGHT9 *pLight)
 {
-	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this);
-	workItem->WorkItemType = WorkItemType::Device_GetLight;
-	workItem->Id = mId;
-	workItem->Argument1 = bit_cast<void*>(Index);
-	workItem->Argument2 = bit_cast<void*>(pLight);
-	mCommandStreamManager->RequestWorkAndWait(workItem);
+	DeviceState& state = GetShadowState();
+
+	if (Index >= state.mLights.size())
+	{
+		return D3DERR_INVALIDCALL;
+	}
+
+	state.GetLight(Index, pLight);
 
 	return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetLightEnable(DWORD Index, BOOL *pEnable)
 {
-	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this);
-	workItem->WorkItemType = WorkItemType::Device_GetLightEnable;
-	workItem->Id = mId;
-	workItem->Argument1 = bit_cast<void*>(Index);
-	workItem->Argument2 = bit_cast<void*>(pEnable);
-	mCommandStreamManager->RequestWorkAndWait(workItem);
+	DeviceState& state = GetShadowState();
+
+	if (Index >= state.mLights.size())
+	{
+		return D3DERR_INVALIDCALL;
+	}
+
+	(*pEnable) = state.mLights[Index].IsEnabled;
 
 	return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetMaterial(D3DMATERIAL9 *pMaterial)
 {
-	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this);
-	workItem->WorkItemType = WorkItemType::Device_GetMaterial;
-	workItem->Id = mId;
-	workItem->Argument1 = bit_cast<void*>(pMaterial);
-	mCommandStreamManager->RequestWorkAndWait(workItem);
+	(*pMaterial) = GetShadowState().mMaterial;
 
 	return S_OK;
 }
 
 FLOAT STDMETHODCALLTYPE CDevice9::GetNPatchMode()
 {
-	FLOAT output;
-
-	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this);
-	workItem->WorkItemType = WorkItemType::Device_GetMaterial;
-	workItem->Id = mId;
-	workItem->Argument1 = bit_cast<void*>(&output);
-	mCommandStreamManager->RequestWorkAndWait(workItem);
-
-	return output;
+	return GetShadowState().mNSegments;
 }
 
 UINT STDMETHODCALLTYPE CDevice9::GetNumberOfSwapChains()
@@ -750,50 +760,28 @@ HRESULT STDMETHODCALLTYPE CDevice9::GetPaletteEntries(UINT PaletteNumber, PALETT
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetPixelShader(IDirect3DPixelShader9 **ppShader)
 {
-	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this);
-	workItem->WorkItemType = WorkItemType::Device_GetPixelShader;
-	workItem->Id = mId;
-	workItem->Argument1 = bit_cast<void*>(ppShader);
-	mCommandStreamManager->RequestWorkAndWait(workItem);
+	(*ppShader) = (IDirect3DPixelShader9*)GetShadowState().mPixelShader;
 
 	return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetPixelShaderConstantB(UINT StartRegister, BOOL *pConstantData, UINT BoolCount)
 {
-	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this);
-	workItem->WorkItemType = WorkItemType::Device_GetPixelShaderConstantB;
-	workItem->Id = mId;
-	workItem->Argument1 = bit_cast<void*>(StartRegister);
-	workItem->Argument2 = bit_cast<void*>(pConstantData);
-	workItem->Argument3 = bit_cast<void*>(BoolCount);
-	mCommandStreamManager->RequestWorkAndWait(workItem);
+	GetShadowState().GetPixelShaderConstantB(StartRegister, pConstantData, BoolCount);
 
 	return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetPixelShaderConstantF(UINT StartRegister, float *pConstantData, UINT Vector4fCount)
 {
-	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this);
-	workItem->WorkItemType = WorkItemType::Device_GetPixelShaderConstantF;
-	workItem->Id = mId;
-	workItem->Argument1 = bit_cast<void*>(StartRegister);
-	workItem->Argument2 = bit_cast<void*>(pConstantData);
-	workItem->Argument3 = bit_cast<void*>(Vector4fCount);
-	mCommandStreamManager->RequestWorkAndWait(workItem);
+	GetShadowState().GetPixelShaderConstantF(StartRegister, pConstantData, Vector4fCount);
 
 	return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetPixelShaderConstantI(UINT StartRegister, int *pConstantData, UINT Vector4iCount)
 {
-	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this);
-	workItem->WorkItemType = WorkItemType::Device_GetPixelShaderConstantI;
-	workItem->Id = mId;
-	workItem->Argument1 = bit_cast<void*>(StartRegister);
-	workItem->Argument2 = bit_cast<void*>(pConstantData);
-	workItem->Argument3 = bit_cast<void*>(Vector4iCount);
-	mCommandStreamManager->RequestWorkAndWait(workItem);
+	GetShadowState().GetPixelShaderConstantI(StartRegister, pConstantData, Vector4iCount);
 
 	return S_OK;
 }
@@ -809,12 +797,7 @@ HRESULT STDMETHODCALLTYPE CDevice9::GetRasterStatus(UINT  iSwapChain, D3DRASTER_
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetRenderState(D3DRENDERSTATETYPE State, DWORD* pValue)
 {
-	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this);
-	workItem->WorkItemType = WorkItemType::Device_GetRenderState;
-	workItem->Id = mId;
-	workItem->Argument1 = bit_cast<void*>(State);
-	workItem->Argument2 = bit_cast<void*>(pValue);
-	mCommandStreamManager->RequestWorkAndWait(workItem);
+	GetShadowState().GetRenderState(State, pValue);
 
 	return S_OK;
 }
@@ -837,24 +820,26 @@ HRESULT STDMETHODCALLTYPE CDevice9::GetRenderTargetData(IDirect3DSurface9 *pRend
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetSamplerState(DWORD Sampler, D3DSAMPLERSTATETYPE Type, DWORD* pValue)
 {
-	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this);
-	workItem->WorkItemType = WorkItemType::Device_GetSamplerState;
-	workItem->Id = mId;
-	workItem->Argument1 = bit_cast<void*>(Sampler);
-	workItem->Argument2 = bit_cast<void*>(Type);
-	workItem->Argument3 = bit_cast<void*>(pValue);
-	mCommandStreamManager->RequestWorkAndWait(workItem);
+	DeviceState& state = GetShadowState();
+
+	(*pValue) = 0;
+
+	auto samplerStates = state.mSamplerStates.find(Sampler);
+	if (samplerStates != state.mSamplerStates.end())
+	{
+		auto it = samplerStates->second.find(Type);
+		if (it != samplerStates->second.end())
+		{
+			(*pValue) = it->second;
+		}
+	}
 
 	return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetScissorRect(RECT* pRect)
 {
-	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this);
-	workItem->WorkItemType = WorkItemType::Device_GetScissorRect;
-	workItem->Id = mId;
-	workItem->Argument1 = bit_cast<void*>(pRect);
-	mCommandStreamManager->RequestWorkAndWait(workItem);
+	(*pRect) = GetShadowState().m9Scissor;
 
 	return S_OK;
 }
@@ -870,14 +855,27 @@ BOOL STDMETHODCALLTYPE CDevice9::GetSoftwareVertexProcessing()
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetStreamSource(UINT StreamNumber, IDirect3DVertexBuffer9** ppStreamData, UINT* pOffsetInBytes, UINT* pStride)
 {
-	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this);
-	workItem->WorkItemType = WorkItemType::Device_GetStreamSource;
-	workItem->Id = mId;
-	workItem->Argument1 = bit_cast<void*>(StreamNumber);
-	workItem->Argument2 = bit_cast<void*>(ppStreamData);
-	workItem->Argument3 = bit_cast<void*>(pOffsetInBytes);
-	workItem->Argument4 = bit_cast<void*>(pStride);
-	mCommandStreamManager->RequestWorkAndWait(workItem);
+	DeviceState& state = GetShadowState();
+
+	auto it = state.mStreamSources.find(StreamNumber);
+	if (it == state.mStreamSources.end())
+	{
+		(*ppStreamData) = nullptr;
+		(*pOffsetInBytes) = 0;
+		(*pStride) = 0;
+
+		return S_OK;
+	}
+
+	const StreamSource& value = it->second;
+
+	(*ppStreamData) = (IDirect3DVertexBuffer9*)value.StreamData;
+	/*
+	Vulkan wants 64bit uint but d3d9 uses 32bit uint. This cast just keeps compiler from complaining.
+	This should be safe because only 32bit can be set and d3d9 is x86 only so endianness issues shouldn't come into play.
+	*/
+	(*pOffsetInBytes) = (UINT)value.OffsetInBytes;
+	(*pStride) = value.Stride;
 
 	return S_OK;
 }
@@ -900,115 +898,86 @@ HRESULT STDMETHODCALLTYPE CDevice9::GetSwapChain(UINT iSwapChain, IDirect3DSwapC
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetTexture(DWORD Stage, IDirect3DBaseTexture9** ppTexture)
 {
-	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this);
-	workItem->WorkItemType = WorkItemType::Device_GetStreamSource;
-	workItem->Id = mId;
-	workItem->Argument1 = bit_cast<void*>(Stage);
-	workItem->Argument2 = bit_cast<void*>(ppTexture);
-	mCommandStreamManager->RequestWorkAndWait(workItem);
+	DeviceState& state = GetShadowState();
+
+	auto it = state.mTextures.find(Stage);
+	if (it != state.mTextures.end())
+	{
+		(*ppTexture) = it->second;
+	}
+	else
+	{
+		(*ppTexture) = nullptr;
+	}
 
 	return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetTextureStageState(DWORD Stage, D3DTEXTURESTAGESTATETYPE Type, DWORD* pValue)
 {
-	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this);
-	workItem->WorkItemType = WorkItemType::Device_GetTextureStageState;
-	workItem->Id = mId;
-	workItem->Argument1 = bit_cast<void*>(Stage);
-	workItem->Argument2 = bit_cast<void*>(Type);
-	workItem->Argument3 = bit_cast<void*>(pValue);
-	mCommandStreamManager->RequestWorkAndWait(workItem);
+	GetShadowState().GetTextureStageState(Stage, Type, pValue);
 
 	return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetTransform(D3DTRANSFORMSTATETYPE State, D3DMATRIX* pMatrix)
 {
-	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this);
-	workItem->WorkItemType = WorkItemType::Device_GetTransform;
-	workItem->Id = mId;
-	workItem->Argument1 = bit_cast<void*>(State);
-	workItem->Argument2 = bit_cast<void*>(pMatrix);
-	mCommandStreamManager->RequestWorkAndWait(workItem);
+	GetShadowState().GetTransform(State, pMatrix);
 
 	return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetVertexDeclaration(IDirect3DVertexDeclaration9** ppDecl)
 {
-	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this);
-	workItem->WorkItemType = WorkItemType::Device_GetVertexDeclaration;
-	workItem->Id = mId;
-	workItem->Argument1 = bit_cast<void*>(ppDecl);
-	mCommandStreamManager->RequestWorkAndWait(workItem);
+	(*ppDecl) = (IDirect3DVertexDeclaration9*)GetShadowState().mVertexDeclaration;
 
 	return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetVertexShader(IDirect3DVertexShader9** ppShader)
 {
-	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this);
-	workItem->WorkItemType = WorkItemType::Device_GetVertexShader;
-	workItem->Id = mId;
-	workItem->Argument1 = bit_cast<void*>(ppShader);
-	mCommandStreamManager->RequestWorkAndWait(workItem);
+	(*ppShader) = (IDirect3DVertexShader9*)GetShadowState().mVertexShader;
 
 	return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetVertexShaderConstantB(UINT StartRegister, BOOL* pConstantData, UINT BoolCount)
 {
-	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this);
-	workItem->WorkItemType = WorkItemType::Device_GetVertexShaderConstantB;
-	workItem->Id = mId;
-	workItem->Argument1 = bit_cast<void*>(StartRegister);
-	workItem->Argument2 = bit_cast<void*>(pConstantData);
-	workItem->Argument3 = bit_cast<void*>(BoolCount);
-	mCommandStreamManager->RequestWorkAndWait(workItem);
+	GetShadowState().GetVertexShaderConstantB(StartRegister, pConstantData, BoolCount);
 
 	return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetVertexShaderConstantF(UINT StartRegister, float* pConstantData, UINT Vector4fCount)
 {
-	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this);
-	workItem->WorkItemType = WorkItemType::Device_GetVertexShaderConstantF;
-	workItem->Id = mId;
-	workItem->Argument1 = bit_cast<void*>(StartRegister);
-	workItem->Argument2 = bit_cast<void*>(pConstantData);
-	workItem->Argument3 = bit_cast<void*>(Vector4fCount);
-	mCommandStreamManager->RequestWorkAndWait(workItem);
+	GetShadowState().GetVertexShaderConstantF(StartRegister, pConstantData, Vector4fCount);
 
 	return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetVertexShaderConstantI(UINT StartRegister, int* pConstantData, UINT Vector4iCount)
 {
-	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this);
-	workItem->WorkItemType = WorkItemType::Device_GetVertexShaderConstantI;
-	workItem->Id = mId;
-	workItem->Argument1 = bit_cast<void*>(StartRegister);
-	workItem->Argument2 = bit_cast<void*>(pConstantData);
-	workItem->Argument3 = bit_cast<void*>(Vector4iCount);
-	mCommandStreamManager->RequestWorkAndWait(workItem);
+	GetShadowState().GetVertexShaderConstantI(StartRegister, pConstantData, Vector4iCount);
 
 	return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetViewport(D3DVIEWPORT9* pViewport)
 {
-	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this);
-	workItem->WorkItemType = WorkItemType::Device_GetViewport;
-	workItem->Id = mId;
-	workItem->Argument1 = bit_cast<void*>(pViewport);
-	mCommandStreamManager->RequestWorkAndWait(workItem);
+	(*pViewport) = GetShadowState().m9Viewport;
 
 	return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::LightEnable(DWORD LightIndex, BOOL bEnable)
 {
+	DeviceState& state = GetShadowState();
+	if (LightIndex > state.mLights.size())
+	{
+		return D3DERR_INVALIDCALL;
+	}
+	state.LightEnable(LightIndex, bEnable);
+
 	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this);
 	workItem->WorkItemType = WorkItemType::Device_LightEnable;
 	workItem->Id = mId;
@@ -1021,11 +990,28 @@ HRESULT STDMETHODCALLTYPE CDevice9::LightEnable(DWORD LightIndex, BOOL bEnable)
 
 HRESULT STDMETHODCALLTYPE CDevice9::MultiplyTransform(D3DTRANSFORMSTATETYPE State, const D3DMATRIX *pMatrix)
 {
-	//TODO: Implement.
+	if (pMatrix == nullptr)
+	{
+		return D3DERR_INVALIDCALL;
+	}
+
+	/*
+	The shadow state already knows the current matrix so the product is worked out here and queued as a plain SetTransform.
+	https://msdn.microsoft.com/en-us/library/windows/desktop/bb174414(v=vs.85).aspx (pMatrix * current)
+	*/
+	D3DMATRIX current;
+	D3DMATRIX result;
+	GetShadowState().GetTransform(State, &current);
 
-	BOOST_LOG_TRIVIAL(warning) << "CDevice9::MultiplyTransform is not implemented!";
+	for (size_t i = 0; i < 4; i++)
+	{
+		for (size_t j = 0; j < 4; j++)
+		{
+			result.m[i][j] = pMatrix->m[i][0] * current.m[0][j] + pMatrix->m[i][1] * current.m[1][j] + pMatrix->m[i][2] * current.m[2][j] + pMatrix->m[i][3] * current.m[3][j];
+		}
+	}
 
-	return E_NOTIMPL;
+	return SetTransform(State, &result);
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::ProcessVertices(UINT SrcStartIndex, UINT DestIndex, UINT VertexCount, IDirect3DVertexBuffer9 *pDestBuffer, IDirect3DVertexDeclaration9 *pVertexDecl, DWORD Flags)
@@ -1111,11 +1097,13 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetDialogBoxMode(BOOL bEnableDialogs)
 
 HRESULT STDMETHODCALLTYPE CDevice9::SetFVF(DWORD FVF)
 {
+	GetShadowState().SetFVF(FVF);
+
 	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this);
 	workItem->WorkItemType = WorkItemType::Device_SetFVF;
 	workItem->Id = mId;
 	workItem->Argument1 = bit_cast<void*>(FVF);
-	mCommandStreamManager->RequestWorkAndWait(workItem);
+	mCommandStreamManager->RequestWork(workItem);
 
 	return S_OK;
 }
@@ -1140,34 +1128,53 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetIndices(IDirect3DIndexBuffer9* pIndexData
 
 HRESULT STDMETHODCALLTYPE CDevice9::SetLight(DWORD Index, const D3DLIGHT9* pLight)
 {
-	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this);
+	DeviceState& state = GetShadowState();
+	if (pLight == nullptr || Index > state.mLights.size())
+	{
+		return D3DERR_INVALIDCALL;
+	}
+	state.SetLight(Index, pLight);
+
+	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this, sizeof(D3DLIGHT9));
 	workItem->WorkItemType = WorkItemType::Device_SetLight;
 	workItem->Id = mId;
 	workItem->Argument1 = bit_cast<void*>(Index);
-	workItem->Argument2 = bit_cast<void*>(pLight);
-	mCommandStreamManager->RequestWorkAndWait(workItem);
+	workItem->Argument2 = workItem->CopyPayload(pLight, sizeof(D3DLIGHT9));
+	mCommandStreamManager->RequestWork(workItem);
 
 	return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::SetMaterial(const D3DMATERIAL9* pMaterial)
 {
-	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this);
+	if (pMaterial == nullptr)
+	{
+		return D3DERR_INVALIDCALL;
+	}
+	GetShadowState().SetMaterial(pMaterial);
+
+	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this, sizeof(D3DMATERIAL9));
 	workItem->WorkItemType = WorkItemType::Device_SetMaterial;
 	workItem->Id = mId;
-	workItem->Argument1 = bit_cast<void*>(pMaterial);
-	mCommandStreamManager->RequestWorkAndWait(workItem);
+	workItem->Argument1 = workItem->CopyPayload(pMaterial, sizeof(D3DMATERIAL9));
+	mCommandStreamManager->RequestWork(workItem);
 
 	return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::SetNPatchMode(float nSegments)
 {
+	if (nSegments > 0.0f)
+	{
+		BOOST_LOG_TRIVIAL(warning) << "CDevice9::SetNPatchMode nPatch greater than zero not supported.";
+	}
+	GetShadowState().SetNPatchMode(nSegments);
+
 	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this);
 	workItem->WorkItemType = WorkItemType::Device_SetNPatchMode;
 	workItem->Id = mId;
 	workItem->Argument1 = bit_cast<void*>(nSegments);
-	mCommandStreamManager->RequestWorkAndWait(workItem);
+	mCommandStreamManager->RequestWork(workItem);
 
 	return S_OK;
 }
@@ -1183,62 +1190,90 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetPaletteEntries(UINT PaletteNumber, const
 
 HRESULT STDMETHODCALLTYPE CDevice9::SetPixelShader(IDirect3DPixelShader9* pShader)
 {
+	GetShadowState().SetPixelShader((CPixelShader9*)pShader);
+
+	//The command stream releases this reference when the shader is replaced.
+	if (pShader != nullptr)
+	{
+		pShader->AddRef();
+	}
+
 	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this);
 	workItem->WorkItemType = WorkItemType::Device_SetPixelShader;
 	workItem->Id = mId;
 	workItem->Argument1 = bit_cast<void*>(pShader);
-	mCommandStreamManager->RequestWorkAndWait(workItem);
+	mCommandStreamManager->RequestWork(workItem);
 
 	return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::SetPixelShaderConstantB(UINT StartRegister, const BOOL* pConstantData, UINT BoolCount)
 {
-	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this);
+	if (pConstantData == nullptr)
+	{
+		return D3DERR_INVALIDCALL;
+	}
+	GetShadowState().SetPixelShaderConstantB(StartRegister, pConstantData, BoolCount);
+
+	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this, sizeof(BOOL) * BoolCount);
 	workItem->WorkItemType = WorkItemType::Device_SetPixelShaderConstantB;
 	workItem->Id = mId;
 	workItem->Argument1 = bit_cast<void*>(StartRegister);
-	workItem->Argument2 = bit_cast<void*>(pConstantData);
+	workItem->Argument2 = workItem->CopyPayload(pConstantData, sizeof(BOOL) * BoolCount);
 	workItem->Argument3 = bit_cast<void*>(BoolCount);
-	mCommandStreamManager->RequestWorkAndWait(workItem);
+	mCommandStreamManager->RequestWork(workItem);
 
 	return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::SetPixelShaderConstantF(UINT StartRegister, const float *pConstantData, UINT Vector4fCount)
 {
-	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this);
+	if (pConstantData == nullptr)
+	{
+		return D3DERR_INVALIDCALL;
+	}
+	GetShadowState().SetPixelShaderConstantF(StartRegister, pConstantData, Vector4fCount);
+
+	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this, sizeof(float) * 4 * Vector4fCount);
 	workItem->WorkItemType = WorkItemType::Device_SetPixelShaderConstantF;
 	workItem->Id = mId;
 	workItem->Argument1 = bit_cast<void*>(StartRegister);
-	workItem->Argument2 = bit_cast<void*>(pConstantData);
+	workItem->Argument2 = workItem->CopyPayload(pConstantData, sizeof(float) * 4 * Vector4fCount);
 	workItem->Argument3 = bit_cast<void*>(Vector4fCount);
-	mCommandStreamManager->RequestWorkAndWait(workItem);
+	mCommandStreamManager->RequestWork(workItem);
 
 	return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::SetPixelShaderConstantI(UINT StartRegister, const int *pConstantData, UINT Vector4iCount)
 {
-	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this);
+	if (pConstantData == nullptr)
+	{
+		return D3DERR_INVALIDCALL;
+	}
+	GetShadowState().SetPixelShaderConstantI(StartRegister, pConstantData, Vector4iCount);
+
+	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this, sizeof(int) * 4 * Vector4iCount);
 	workItem->WorkItemType = WorkItemType::Device_SetPixelShaderConstantI;
 	workItem->Id = mId;
 	workItem->Argument1 = bit_cast<void*>(StartRegister);
-	workItem->Argument2 = bit_cast<void*>(pConstantData);
+	workItem->Argument2 = workItem->CopyPayload(pConstantData, sizeof(int) * 4 * Vector4iCount);
 	workItem->Argument3 = bit_cast<void*>(Vector4iCount);
-	mCommandStreamManager->RequestWorkAndWait(workItem);
+	mCommandStreamManager->RequestWork(workItem);
 
 	return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::SetRenderState(D3DRENDERSTATETYPE State, DWORD Value)
 {
+	GetShadowState().SetRenderState(State, Value);
+
 	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this);
 	workItem->WorkItemType = WorkItemType::Device_SetRenderState;
 	workItem->Id = mId;
 	workItem->Argument1 = bit_cast<void*>(State);
 	workItem->Argument2 = bit_cast<void*>(Value);
-	mCommandStreamManager->RequestWorkAndWait(workItem);
+	mCommandStreamManager->RequestWork(workItem);
 
 	return S_OK;
 }
@@ -1252,24 +1287,32 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetRenderTarget(DWORD RenderTargetIndex, IDi
 
 HRESULT STDMETHODCALLTYPE CDevice9::SetSamplerState(DWORD Sampler, D3DSAMPLERSTATETYPE Type, DWORD Value)
 {
+	GetShadowState().SetSamplerState(Sampler, Type, Value);
+
 	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this);
 	workItem->WorkItemType = WorkItemType::Device_SetSamplerState;
 	workItem->Id = mId;
 	workItem->Argument1 = bit_cast<void*>(Sampler);
 	workItem->Argument2 = bit_cast<void*>(Type);
 	workItem->Argument3 = bit_cast<void*>(Value);
-	mCommandStreamManager->RequestWorkAndWait(workItem);
+	mCommandStreamManager->RequestWork(workItem);
 
 	return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::SetScissorRect(const RECT* pRect)
 {
-	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this);
+	if (pRect == nullptr)
+	{
+		return D3DERR_INVALIDCALL;
+	}
+	GetShadowState().SetScissorRect(pRect);
+
+	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this, sizeof(RECT));
 	workItem->WorkItemType = WorkItemType::Device_SetScissorRect;
 	workItem->Id = mId;
-	workItem->Argument1 = bit_cast<void*>(pRect);
-	mCommandStreamManager->RequestWorkAndWait(workItem);
+	workItem->Argument1 = workItem->CopyPayload(pRect, sizeof(RECT));
+	mCommandStreamManager->RequestWork(workItem);
 
 	return S_OK;
 }
@@ -1285,6 +1328,14 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetSoftwareVertexProcessing(BOOL bSoftware)
 
 HRESULT STDMETHODCALLTYPE CDevice9::SetStreamSource(UINT StreamNumber, IDirect3DVertexBuffer9* pStreamData, UINT OffsetInBytes, UINT Stride)
 {
+	GetShadowState().SetStreamSource(StreamNumber, (CVertexBuffer9*)pStreamData, OffsetInBytes, Stride);
+
+	//The command stream releases this reference once the call has been processed.
+	if (pStreamData != nullptr)
+	{
+		pStreamData->AddRef();
+	}
+
 	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this);
 	workItem->WorkItemType = WorkItemType::Device_SetStreamSource;
 	workItem->Id = mId;
@@ -1292,7 +1343,7 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetStreamSource(UINT StreamNumber, IDirect3D
 	workItem->Argument2 = bit_cast<void*>(pStreamData);
 	workItem->Argument3 = bit_cast<void*>(OffsetInBytes);
 	workItem->Argument4 = bit_cast<void*>(Stride);
-	mCommandStreamManager->RequestWorkAndWait(workItem);
+	mCommandStreamManager->RequestWork(workItem);
 
 	return S_OK;
 }
@@ -1308,12 +1359,20 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetStreamSourceFreq(UINT StreamNumber, UINT
 
 HRESULT STDMETHODCALLTYPE CDevice9::SetTexture(DWORD Sampler, IDirect3DBaseTexture9* pTexture)
 {
+	GetShadowState().SetTexture(Sampler, pTexture);
+
+	//The command stream releases this reference once the call has been processed.
+	if (pTexture != nullptr)
+	{
+		pTexture->AddRef();
+	}
+
 	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this);
 	workItem->WorkItemType = WorkItemType::Device_SetTexture;
 	workItem->Id = mId;
 	workItem->Argument1 = bit_cast<void*>(Sampler);
 	workItem->Argument2 = bit_cast<void*>(pTexture);
-	mCommandStreamManager->RequestWorkAndWait(workItem);
+	mCommandStreamManager->RequestWork(workItem);
 
 	if (pTexture!= nullptr)
 	{
@@ -1338,97 +1397,145 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetTexture(DWORD Sampler, IDirect3DBaseTextu
 
 HRESULT STDMETHODCALLTYPE CDevice9::SetTextureStageState(DWORD Stage, D3DTEXTURESTAGESTATETYPE Type, DWORD Value)
 {
+	GetShadowState().SetTextureStageState(Stage, Type, Value);
+
 	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this);
 	workItem->WorkItemType = WorkItemType::Device_SetTextureStageState;
 	workItem->Id = mId;
 	workItem->Argument1 = bit_cast<void*>(Stage);
 	workItem->Argument2 = bit_cast<void*>(Type);
 	workItem->Argument3 = bit_cast<void*>(Value);
-	mCommandStreamManager->RequestWorkAndWait(workItem);
+	mCommandStreamManager->RequestWork(workItem);
 
 	return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::SetTransform(D3DTRANSFORMSTATETYPE State, const D3DMATRIX* pMatrix)
 {
-	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this);
+	if (pMatrix == nullptr)
+	{
+		return D3DERR_INVALIDCALL;
+	}
+	GetShadowState().SetTransform(State, pMatrix);
+
+	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this, sizeof(D3DMATRIX));
 	workItem->WorkItemType = WorkItemType::Device_SetTransform;
 	workItem->Id = mId;
 	workItem->Argument1 = bit_cast<void*>(State);
-	workItem->Argument2 = bit_cast<void*>(pMatrix);
-	mCommandStreamManager->RequestWorkAndWait(workItem);
+	workItem->Argument2 = workItem->CopyPayload(pMatrix, sizeof(D3DMATRIX));
+	mCommandStreamManager->RequestWork(workItem);
 
 	return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::SetVertexDeclaration(IDirect3DVertexDeclaration9* pDecl)
 {
+	GetShadowState().SetVertexDeclaration((CVertexDeclaration9*)pDecl);
+
+	//The command stream releases this reference once the call has been processed.
+	if (pDecl != nullptr)
+	{
+		pDecl->AddRef();
+	}
+
 	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this);
 	workItem->WorkItemType = WorkItemType::Device_SetVertexDeclaration;
 	workItem->Id = mId;
 	workItem->Argument1 = bit_cast<void*>(pDecl);
-	mCommandStreamManager->RequestWorkAndWait(workItem);
+	mCommandStreamManager->RequestWork(workItem);
 
 	return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::SetVertexShader(IDirect3DVertexShader9* pShader)
 {
+	GetShadowState().SetVertexShader((CVertexShader9*)pShader);
+
+	//The command stream releases this reference when the shader is replaced.
+	if (pShader != nullptr)
+	{
+		pShader->AddRef();
+	}
+
 	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this);
 	workItem->WorkItemType = WorkItemType::Device_SetVertexShader;
 	workItem->Id = mId;
 	workItem->Argument1 = bit_cast<void*>(pShader);
-	mCommandStreamManager->RequestWorkAndWait(workItem);
+	mCommandStreamManager->RequestWork(workItem);
 
 	return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::SetVertexShaderConstantB(UINT StartRegister, const BOOL* pConstantData, UINT BoolCount)
 {
-	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this);
+	if (pConstantData == nullptr)
+	{
+		return D3DERR_INVALIDCALL;
+	}
+	GetShadowState().SetVertexShaderConstantB(StartRegister, pConstantData, BoolCount);
+
+	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this, sizeof(BOOL) * BoolCount);
 	workItem->WorkItemType = WorkItemType::Device_SetVertexShaderConstantB;
 	workItem->Id = mId;
 	workItem->Argument1 = bit_cast<void*>(StartRegister);
-	workItem->Argument2 = bit_cast<void*>(pConstantData);
+	workItem->Argument2 = workItem->CopyPayload(pConstantData, sizeof(BOOL) * BoolCount);
 	workItem->Argument3 = bit_cast<void*>(BoolCount);
-	mCommandStreamManager->RequestWorkAndWait(workItem);
+	mCommandStreamManager->RequestWork(workItem);
 
 	return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::SetVertexShaderConstantF(UINT StartRegister, const float* pConstantData, UINT Vector4fCount)
 {
-	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this);
+	if (pConstantData == nullptr)
+	{
+		return D3DERR_INVALIDCALL;
+	}
+	GetShadowState().SetVertexShaderConstantF(StartRegister, pConstantData, Vector4fCount, true);
+
+	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this, sizeof(float) * 4 * Vector4fCount);
 	workItem->WorkItemType = WorkItemType::Device_SetVertexShaderConstantF;
 	workItem->Id = mId;
 	workItem->Argument1 = bit_cast<void*>(StartRegister);
-	workItem->Argument2 = bit_cast<void*>(pConstantData);
+	workItem->Argument2 = workItem->CopyPayload(pConstantData, sizeof(float) * 4 * Vector4fCount);
 	workItem->Argument3 = bit_cast<void*>(Vector4fCount);
-	mCommandStreamManager->RequestWorkAndWait(workItem);
+	mCommandStreamManager->RequestWork(workItem);
 
 	return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::SetVertexShaderConstantI(UINT StartRegister, const int* pConstantData, UINT Vector4iCount)
 {
-	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this);
+	if (pConstantData == nullptr)
+	{
+		return D3DERR_INVALIDCALL;
+	}
+	GetShadowState().SetVertexShaderConstantI(StartRegister, pConstantData, Vector4iCount);
+
+	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this, sizeof(int) * 4 * Vector4iCount);
 	workItem->WorkItemType = WorkItemType::Device_SetVertexShaderConstantI;
 	workItem->Id = mId;
 	workItem->Argument1 = bit_cast<void*>(StartRegister);
-	workItem->Argument2 = bit_cast<void*>(pConstantData);
+	workItem->Argument2 = workItem->CopyPayload(pConstantData, sizeof(int) * 4 * Vector4iCount);
 	workItem->Argument3 = bit_cast<void*>(Vector4iCount);
-	mCommandStreamManager->RequestWorkAndWait(workItem);
+	mCommandStreamManager->RequestWork(workItem);
 
 	return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::SetViewport(const D3DVIEWPORT9* pViewport)
 {
-	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this);
+	if (pViewport == nullptr)
+	{
+		return D3DERR_INVALIDCALL;
+	}
+	GetShadowState().SetViewport(pViewport);
+
+	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this, sizeof(D3DVIEWPORT9));
 	workItem->WorkItemType = WorkItemType::Device_SetViewport;
 	workItem->Id = mId;
-	workItem->Argument1 = bit_cast<void*>(pViewport);
-	mCommandStreamManager->RequestWorkAndWait(workItem);
+	workItem->Argument1 = workItem->CopyPayload(pViewport, sizeof(D3DVIEWPORT9));
+	mCommandStreamManager->RequestWork(workItem);
 
 	return S_OK;
 }
@@ -75,6 +75,16 @@ public:
 	
 	PAINTSTRUCT* mPaintInformation = {};
 
+	/*
+	Copy of the device state on the application thread so Set* can return without waiting on the command stream and Get* can be answered directly.
+	While a state block is being recorded the calls land in mRecordingState just like the command stream writes them to the recording block.
+	*/
+	DeviceState mShadowState = {};
+	DeviceState mRecordingState = {};
+	BOOL mIsRecording = false;
+
+	DeviceState& GetShadowState();
+
 	
 
 public:
@@ -24,10 +24,14 @@ misrepresented as being the original software.
 #include "Utilities.h"
 
 CPixelShader9::CPixelShader9(CDevice9* device,const DWORD* pFunction)
-	: mDevice(device),
-	mFunction((DWORD*)pFunction)
+	: mDevice(device)
 {
 	BOOST_LOG_TRIVIAL(info) << "CPixelShader9::CPixelShader9";
+
+	//The application can free its bytecode once the create returns and translation happens later so keep a copy.
+	mSize = GetTokenCount((const uint32_t*)pFunction) * sizeof(DWORD);
+	mFunction = new DWORD[mSize / sizeof(DWORD)];
+	memcpy(mFunction, pFunction, mSize);
 }
 
 CPixelShader9::~CPixelShader9()
@@ -37,6 +41,7 @@ CPixelShader9::~CPixelShader9()
 	WorkItem* workItem = mCommandStreamManager->GetWorkItem(nullptr);
 	workItem->WorkItemType = WorkItemType::Shader_Destroy;
 	workItem->Id = mId;
+	workItem->Argument1 = (void*)mFunction; //The command stream frees the copy once it's done with it.
 	mCommandStreamManager->RequestWork(workItem);
 }
 
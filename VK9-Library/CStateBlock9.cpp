@@ -93,22 +93,26 @@ ULONG STDMETHODCALLTYPE CStateBlock9::Release(void)
 
 HRESULT STDMETHODCALLTYPE CStateBlock9::Capture()
 {
+	MergeState(mDevice->mShadowState, mShadowState, mType, true);
+
 	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this);
 	workItem->Id = this->mId;
 	workItem->WorkItemType = WorkItemType::StateBlock_Capture;
 	workItem->Argument1 = this;
-	mCommandStreamManager->RequestWorkAndWait(workItem);
+	mCommandStreamManager->RequestWork(workItem);
 
 	return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CStateBlock9::Apply()
 {
+	MergeState(mShadowState, mDevice->mShadowState, mType);
+
 	WorkItem* workItem = mCommandStreamManager->GetWorkItem(this);
 	workItem->Id = this->mId;
 	workItem->WorkItemType = WorkItemType::StateBlock_Apply;
 	workItem->Argument1 = this;
-	mCommandStreamManager->RequestWorkAndWait(workItem);
+	mCommandStreamManager->RequestWork(workItem);
 
 	return S_OK;
 }
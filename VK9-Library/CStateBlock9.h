@@ -45,6 +45,7 @@ public:
 	//Device State
 	D3DSTATEBLOCKTYPE mType = D3DSBT_ALL;
 	DeviceState mDeviceState = {};
+	DeviceState mShadowState = {}; //Mirror of mDeviceState kept by the application thread for CDevice9's shadow state.
 
 public:
 
@@ -21,6 +21,7 @@ misrepresented as being the original software.
 #include "CTypes.h"
 
 #include "CVertexBuffer9.h"
+#include "Utilities.h"
 
 StreamSource::StreamSource()
 	: StreamSource(0, nullptr, 0, 0)
@@ -58,3 +59,2281 @@ StreamSource::~StreamSource()
 
 }
 
+void DeviceState::SetDefaults()
+{
+	for (int32_t i = 0; i < 16; i++)
+	{
+		mSamplerStates[i][D3DSAMP_ADDRESSU] = D3DTADDRESS_WRAP;
+		mSamplerStates[i][D3DSAMP_ADDRESSV] = D3DTADDRESS_WRAP;
+		mSamplerStates[i][D3DSAMP_ADDRESSW] = D3DTADDRESS_WRAP;
+		mSamplerStates[i][D3DSAMP_BORDERCOLOR] = 0;
+		mSamplerStates[i][D3DSAMP_MAGFILTER] = D3DTEXF_POINT;
+		mSamplerStates[i][D3DSAMP_MINFILTER] = D3DTEXF_POINT;
+		mSamplerStates[i][D3DSAMP_MIPFILTER] = D3DTEXF_NONE;
+		mSamplerStates[i][D3DSAMP_MIPMAPLODBIAS] = 0;
+		mSamplerStates[i][D3DSAMP_MAXMIPLEVEL] = 0;
+		mSamplerStates[i][D3DSAMP_MAXANISOTROPY] = 1;
+		mSamplerStates[i][D3DSAMP_SRGBTEXTURE] = 0;
+		mSamplerStates[i][D3DSAMP_ELEMENTINDEX] = 0;
+		mSamplerStates[i][D3DSAMP_DMAPOFFSET] = 0;
+	}
+
+	//Changed default state because -1 is used to indicate that it has not been set but actual state should be defaulted.
+	mFVF = D3DFVF_XYZ | D3DFVF_DIFFUSE;
+
+	Light light = {};
+	mLights.push_back(light);
+}
+
+void DeviceState::LightEnable(DWORD LightIndex, BOOL bEnable)
+{
+	Light light = {};
+
+	if (mLights.size() == LightIndex)
+	{
+		light.IsEnabled = bEnable;
+		mLights.push_back(light);
+		mAreLightsDirty = true;
+	}
+	else
+	{
+		mLights[LightIndex].IsEnabled = bEnable;
+		mAreLightsDirty = true;
+	}
+}
+
+void DeviceState::SetFVF(DWORD FVF)
+{
+	mFVF = FVF;
+	mHasFVF = true;
+	mHasVertexDeclaration = false;
+}
+
+void DeviceState::SetLight(DWORD Index, const D3DLIGHT9* pLight)
+{
+	Light light = {};
+
+	light.Type = pLight->Type;
+	light.Diffuse[0] = pLight->Diffuse.r;
+	light.Diffuse[1] = pLight->Diffuse.g;
+	light.Diffuse[2] = pLight->Diffuse.b;
+	light.Diffuse[3] = pLight->Diffuse.a;
+
+	light.Specular[0] = pLight->Specular.r;
+	light.Specular[1] = pLight->Specular.g;
+	light.Specular[2] = pLight->Specular.b;
+	light.Specular[3] = pLight->Specular.a;
+
+	light.Ambient[0] = pLight->Ambient.r;
+	light.Ambient[1] = pLight->Ambient.g;
+	light.Ambient[2] = pLight->Ambient.b;
+	light.Ambient[3] = pLight->Ambient.a;
+
+	light.Position[0] = pLight->Position.x;
+	light.Position[1] = pLight->Position.y;
+	light.Position[2] = pLight->Position.z;
+	//No need to set [3] because structure is init with {} so it's already 0.
+
+	light.Direction[0] = pLight->Direction.x;
+	light.Direction[1] = pLight->Direction.y;
+	light.Direction[2] = pLight->Direction.z;
+	//No need to set [3] because structure is init with {} so it's already 0.
+
+	light.Range = pLight->Range;
+	light.Falloff = pLight->Falloff;
+	light.Attenuation0 = pLight->Attenuation0;
+	light.Attenuation1 = pLight->Attenuation1;
+	light.Attenuation2 = pLight->Attenuation2;
+	light.Theta = pLight->Theta;
+	light.Phi = pLight->Phi;
+
+	if (mLights.size() == Index)
+	{
+		mLights.push_back(light);
+		mAreLightsDirty = true;
+	}
+	else
+	{
+		light.IsEnabled = mLights[Index].IsEnabled;
+
+		mLights[Index] = light;
+		mAreLightsDirty = true;
+	}
+}
+
+void DeviceState::SetMaterial(const D3DMATERIAL9* pMaterial)
+{
+	mMaterial = (*pMaterial);
+	mIsMaterialDirty = true;
+}
+
+void DeviceState::SetNPatchMode(float nSegments)
+{
+	mNSegments = nSegments;
+}
+
+void DeviceState::SetPixelShader(CPixelShader9* pShader)
+{
+	mPixelShader = pShader;
+	mHasPixelShader = true;
+}
+
+void DeviceState::SetPixelShaderConstantB(UINT StartRegister, const BOOL* pConstantData, UINT BoolCount)
+{
+	auto& slots = mPixelShaderConstantSlots;
+	for (size_t i = 0; i < BoolCount; i++)
+	{
+		SetHashedState(mPixelShaderConstantSlotsHash, &slots, slots.BooleanConstants[StartRegister + i], pConstantData[i]);
+	}
+
+	MarkShaderConstantsDirty(mArePixelShaderConstantsDirty, mPixelShaderConstantsSize, slots, &slots.BooleanConstants[StartRegister + BoolCount]);
+}
+
+void DeviceState::SetPixelShaderConstantF(UINT StartRegister, const float* pConstantData, UINT Vector4fCount)
+{
+	auto& slots = mPixelShaderConstantSlots;
+	uint32_t startIndex = (StartRegister * 4);
+	uint32_t length = (Vector4fCount * 4);
+	for (size_t i = 0; i < length; i++)
+	{
+		SetHashedState(mPixelShaderConstantSlotsHash, &slots, slots.FloatConstants[startIndex + i], pConstantData[i]);
+	}
+
+	MarkShaderConstantsDirty(mArePixelShaderConstantsDirty, mPixelShaderConstantsSize, slots, &slots.FloatConstants[startIndex + length]);
+}
+
+void DeviceState::SetPixelShaderConstantI(UINT StartRegister, const int* pConstantData, UINT Vector4iCount)
+{
+	auto& slots = mPixelShaderConstantSlots;
+	uint32_t startIndex = (StartRegister * 4);
+	uint32_t length = (Vector4iCount * 4);
+	for (size_t i = 0; i < length; i++)
+	{
+		SetHashedState(mPixelShaderConstantSlotsHash, &slots, slots.IntegerConstants[startIndex + i], pConstantData[i]);
+	}
+
+	MarkShaderConstantsDirty(mArePixelShaderConstantsDirty, mPixelShaderConstantsSize, slots, &slots.IntegerConstants[startIndex + length]);
+}
+
+void DeviceState::SetRenderState(D3DRENDERSTATETYPE State, DWORD Value)
+{
+	switch (State)
+	{
+	case D3DRS_ZENABLE:
+		SetSpecializationConstant(*this, mSpecializationConstants.zEnable, Value);
+		hasZEnable = true;
+		break;
+	case D3DRS_FILLMODE:
+		SetSpecializationConstant(*this, mSpecializationConstants.fillMode, Value);
+		hasFillMode = true;
+		break;
+	case D3DRS_SHADEMODE:
+		SetSpecializationConstant(*this, mSpecializationConstants.shadeMode, Value);
+		hasShadeMode = true;
+		break;
+	case D3DRS_ZWRITEENABLE:
+		SetSpecializationConstant(*this, mSpecializationConstants.zWriteEnable, Value);
+		hasZWriteEnable = true;
+		break;
+	case D3DRS_ALPHATESTENABLE:
+		SetSpecializationConstant(*this, mSpecializationConstants.alphaTestEnable, Value);
+		hasAlphaTestEnable = true;
+		break;
+	case D3DRS_LASTPIXEL:
+		SetSpecializationConstant(*this, mSpecializationConstants.lastPixel, Value);
+		hasLastPixel = true;
+		break;
+	case D3DRS_SRCBLEND:
+		SetSpecializationConstant(*this, mSpecializationConstants.sourceBlend, Value);
+		hasSourceBlend = true;
+		break;
+	case D3DRS_DESTBLEND:
+		SetSpecializationConstant(*this, mSpecializationConstants.destinationBlend, Value);
+		hasDestinationBlend = true;
+		break;
+	case D3DRS_CULLMODE:
+		SetSpecializationConstant(*this, mSpecializationConstants.cullMode, Value);
+		hasCullMode = true;
+		break;
+	case D3DRS_ZFUNC:
+		SetSpecializationConstant(*this, mSpecializationConstants.zFunction, Value);
+		hasZFunction = true;
+		break;
+	case D3DRS_ALPHAREF:
+		SetRenderStateConstant(*this, mRenderStateConstants.alphaReference, Value);
+		hasAlphaReference = true;
+		break;
+	case D3DRS_ALPHAFUNC:
+		SetSpecializationConstant(*this, mSpecializationConstants.alphaFunction, Value);
+		hasAlphaFunction = true;
+		break;
+	case D3DRS_DITHERENABLE:
+		SetSpecializationConstant(*this, mSpecializationConstants.ditherEnable, Value);
+		hasDitherEnable = true;
+		break;
+	case D3DRS_ALPHABLENDENABLE:
+		SetSpecializationConstant(*this, mSpecializationConstants.alphaBlendEnable, Value);
+		hasAlphaBlendEnable = true;
+		break;
+	case D3DRS_FOGENABLE:
+		SetSpecializationConstant(*this, mSpecializationConstants.fogEnable, Value);
+		hasFogEnable = true;
+		break;
+	case D3DRS_SPECULARENABLE:
+		SetSpecializationConstant(*this, mSpecializationConstants.specularEnable, Value);
+		hasSpecularEnable = true;
+		break;
+	case D3DRS_FOGCOLOR:
+		SetRenderStateConstant(*this, mRenderStateConstants.fogColor, Value);
+		hasFogColor = true;
+		break;
+	case D3DRS_FOGTABLEMODE:
+		SetSpecializationConstant(*this, mSpecializationConstants.fogTableMode, Value);
+		hasFogTableMode = true;
+		break;
+	case D3DRS_FOGSTART:
+		SetRenderStateConstant(*this, mRenderStateConstants.fogStart, bit_cast(Value));
+		hasFogStart = true;
+		break;
+	case D3DRS_FOGEND:
+		SetRenderStateConstant(*this, mRenderStateConstants.fogEnd, bit_cast(Value));
+		hasFogEnd = true;
+		break;
+	case D3DRS_FOGDENSITY:
+		SetRenderStateConstant(*this, mRenderStateConstants.fogDensity, bit_cast(Value));
+		hasFogDensity = true;
+		break;
+	case D3DRS_RANGEFOGENABLE:
+		SetSpecializationConstant(*this, mSpecializationConstants.rangeFogEnable, Value);
+		hasRangeFogEnable = true;
+		break;
+	case D3DRS_STENCILENABLE:
+		SetSpecializationConstant(*this, mSpecializationConstants.stencilEnable, Value);
+		hasStencilEnable = true;
+		break;
+	case D3DRS_STENCILFAIL:
+		SetSpecializationConstant(*this, mSpecializationConstants.stencilFail, Value);
+		hasStencilFail = true;
+		break;
+	case D3DRS_STENCILZFAIL:
+		SetSpecializationConstant(*this, mSpecializationConstants.stencilZFail, Value);
+		hasStencilZFail = true;
+		break;
+	case D3DRS_STENCILPASS:
+		SetSpecializationConstant(*this, mSpecializationConstants.stencilPass, Value);
+		hasStencilPass = true;
+		break;
+	case D3DRS_STENCILFUNC:
+		SetSpecializationConstant(*this, mSpecializationConstants.stencilFunction, Value);
+		hasStencilFunction = true;
+		break;
+	case D3DRS_STENCILREF:
+		SetSpecializationConstant(*this, mSpecializationConstants.stencilReference, Value);
+		hasStencilReference = true;
+		break;
+	case D3DRS_STENCILMASK:
+		SetSpecializationConstant(*this, mSpecializationConstants.stencilMask, Value);
+		hasStencilMask = true;
+		break;
+	case D3DRS_STENCILWRITEMASK:
+		SetSpecializationConstant(*this, mSpecializationConstants.stencilWriteMask, Value);
+		hasStencilWriteMask = true;
+		break;
+	case D3DRS_TEXTUREFACTOR:
+		SetRenderStateConstant(*this, mRenderStateConstants.textureFactor, Value);
+		hasTextureFactor = true;
+		break;
+	case D3DRS_WRAP0:
+		SetSpecializationConstant(*this, mSpecializationConstants.wrap0, Value);
+		hasWrap0 = true;
+		break;
+	case D3DRS_WRAP1:
+		SetSpecializationConstant(*this, mSpecializationConstants.wrap1, Value);
+		hasWrap1 = true;
+		break;
+	case D3DRS_WRAP2:
+		SetSpecializationConstant(*this, mSpecializationConstants.wrap2, Value);
+		hasWrap2 = true;
+		break;
+	case D3DRS_WRAP3:
+		SetSpecializationConstant(*this, mSpecializationConstants.wrap3, Value);
+		hasWrap3 = true;
+		break;
+	case D3DRS_WRAP4:
+		SetSpecializationConstant(*this, mSpecializationConstants.wrap4, Value);
+		hasWrap4 = true;
+		break;
+	case D3DRS_WRAP5:
+		SetSpecializationConstant(*this, mSpecializationConstants.wrap5, Value);
+		hasWrap5 = true;
+		break;
+	case D3DRS_WRAP6:
+		SetSpecializationConstant(*this, mSpecializationConstants.wrap6, Value);
+		hasWrap6 = true;
+		break;
+	case D3DRS_WRAP7:
+		SetSpecializationConstant(*this, mSpecializationConstants.wrap7, Value);
+		hasWrap7 = true;
+		break;
+	case D3DRS_CLIPPING:
+		SetSpecializationConstant(*this, mSpecializationConstants.clipping, Value);
+		hasClipping = true;
+		break;
+	case D3DRS_LIGHTING:
+		SetSpecializationConstant(*this, mSpecializationConstants.lighting, Value);
+		hasLighting = true;
+		break;
+	case D3DRS_AMBIENT:
+		SetRenderStateConstant(*this, mRenderStateConstants.ambient, Value);
+		hasAmbient = true;
+		break;
+	case D3DRS_FOGVERTEXMODE:
+		SetSpecializationConstant(*this, mSpecializationConstants.fogVertexMode, Value);
+		hasFogVertexMode = true;
+		break;
+	case D3DRS_COLORVERTEX:
+		SetSpecializationConstant(*this, mSpecializationConstants.colorVertex, Value);
+		hasColorVertex = true;
+		break;
+	case D3DRS_LOCALVIEWER:
+		SetSpecializationConstant(*this, mSpecializationConstants.localViewer, Value);
+		hasLocalViewer = true;
+		break;
+	case D3DRS_NORMALIZENORMALS:
+		SetSpecializationConstant(*this, mSpecializationConstants.normalizeNormals, Value);
+		hasNormalizeNormals = true;
+		break;
+	case D3DRS_DIFFUSEMATERIALSOURCE:
+		SetSpecializationConstant(*this, mSpecializationConstants.diffuseMaterialSource, Value);
+		hasDiffuseMaterialSource = true;
+		break;
+	case D3DRS_SPECULARMATERIALSOURCE:
+		SetSpecializationConstant(*this, mSpecializationConstants.specularMaterialSource, Value);
+		hasSpecularMaterialSource = true;
+		break;
+	case D3DRS_AMBIENTMATERIALSOURCE:
+		SetSpecializationConstant(*this, mSpecializationConstants.ambientMaterialSource, Value);
+		hasAmbientMaterialSource = true;
+		break;
+	case D3DRS_EMISSIVEMATERIALSOURCE:
+		SetSpecializationConstant(*this, mSpecializationConstants.emissiveMaterialSource, Value);
+		hasEmissiveMaterialSource = true;
+		break;
+	case D3DRS_VERTEXBLEND:
+		SetSpecializationConstant(*this, mSpecializationConstants.vertexBlend, Value);
+		hasVertexBlend = true;
+		break;
+	case D3DRS_CLIPPLANEENABLE:
+		SetSpecializationConstant(*this, mSpecializationConstants.clipPlaneEnable, Value);
+		hasClipPlaneEnable = true;
+		break;
+	case D3DRS_POINTSIZE:
+		SetRenderStateConstant(*this, mRenderStateConstants.pointSize, Value);
+		hasPointSize = true;
+		break;
+	case D3DRS_POINTSIZE_MIN:
+		SetRenderStateConstant(*this, mRenderStateConstants.pointSizeMinimum, bit_cast(Value));
+		hasPointSizeMinimum = true;
+		break;
+	case D3DRS_POINTSPRITEENABLE:
+		SetSpecializationConstant(*this, mSpecializationConstants.pointSpriteEnable, Value);
+		hasPointSpriteEnable = true;
+		break;
+	case D3DRS_POINTSCALEENABLE:
+		SetSpecializationConstant(*this, mSpecializationConstants.pointScaleEnable, Value);
+		hasPointScaleEnable = true;
+		break;
+	case D3DRS_POINTSCALE_A:
+		SetRenderStateConstant(*this, mRenderStateConstants.pointScaleA, bit_cast(Value));
+		hasPointScaleA = true;
+		break;
+	case D3DRS_POINTSCALE_B:
+		SetRenderStateConstant(*this, mRenderStateConstants.pointScaleB, bit_cast(Value));
+		hasPointScaleB = true;
+		break;
+	case D3DRS_POINTSCALE_C:
+		SetRenderStateConstant(*this, mRenderStateConstants.pointScaleC, bit_cast(Value));
+		hasPointScaleC = true;
+		break;
+	case D3DRS_MULTISAMPLEANTIALIAS:
+		SetSpecializationConstant(*this, mSpecializationConstants.multisampleAntiAlias, Value);
+		hasMultisampleAntiAlias = true;
+		break;
+	case D3DRS_MULTISAMPLEMASK:
+		SetSpecializationConstant(*this, mSpecializationConstants.multisampleMask, Value);
+		hasMultisampleMask = true;
+		break;
+	case D3DRS_PATCHEDGESTYLE:
+		SetSpecializationConstant(*this, mSpecializationConstants.patchEdgeStyle, Value);
+		hasPatchEdgeStyle = true;
+		break;
+	case D3DRS_DEBUGMONITORTOKEN:
+		SetSpecializationConstant(*this, mSpecializationConstants.debugMonitorToken, Value);
+		hasDebugMonitorToken = true;
+		break;
+	case D3DRS_POINTSIZE_MAX:
+		SetRenderStateConstant(*this, mRenderStateConstants.pointSizeMaximum, bit_cast(Value));
+		hasPointSizeMaximum = true;
+		break;
+	case D3DRS_INDEXEDVERTEXBLENDENABLE:
+		SetSpecializationConstant(*this, mSpecializationConstants.indexedVertexBlendEnable, Value);
+		hasIndexedVertexBlendEnable = true;
+		break;
+	case D3DRS_COLORWRITEENABLE:
+		SetSpecializationConstant(*this, mSpecializationConstants.colorWriteEnable, Value);
+		hasColorWriteEnable = true;
+		break;
+	case D3DRS_TWEENFACTOR:
+		SetRenderStateConstant(*this, mRenderStateConstants.tweenFactor, bit_cast(Value));
+		hasTweenFactor = true;
+		break;
+	case D3DRS_BLENDOP:
+		SetSpecializationConstant(*this, mSpecializationConstants.blendOperation, Value);
+		hasBlendOperation = true;
+		break;
+	case D3DRS_POSITIONDEGREE:
+		SetSpecializationConstant(*this, mSpecializationConstants.positionDegree, Value);
+		hasPositionDegree = true;
+		break;
+	case D3DRS_NORMALDEGREE:
+		SetSpecializationConstant(*this, mSpecializationConstants.normalDegree, Value);
+		hasNormalDegree = true;
+		break;
+	case D3DRS_SCISSORTESTENABLE:
+		SetSpecializationConstant(*this, mSpecializationConstants.scissorTestEnable, Value);
+		hasScissorTestEnable = true;
+		break;
+	case D3DRS_SLOPESCALEDEPTHBIAS:
+		SetRenderStateConstant(*this, mRenderStateConstants.slopeScaleDepthBias, bit_cast(Value));
+		hasSlopeScaleDepthBias = true;
+		break;
+	case D3DRS_ANTIALIASEDLINEENABLE:
+		SetSpecializationConstant(*this, mSpecializationConstants.antiAliasedLineEnable, Value);
+		hasAntiAliasedLineEnable = true;
+		break;
+	case D3DRS_MINTESSELLATIONLEVEL:
+		SetSpecializationConstant(*this, mSpecializationConstants.minimumTessellationLevel, bit_cast(Value));
+		hasMinimumTessellationLevel = true;
+		break;
+	case D3DRS_MAXTESSELLATIONLEVEL:
+		SetSpecializationConstant(*this, mSpecializationConstants.maximumTessellationLevel, bit_cast(Value));
+		hasMaximumTessellationLevel = true;
+		break;
+	case D3DRS_ADAPTIVETESS_X:
+		SetSpecializationConstant(*this, mSpecializationConstants.adaptivetessX, bit_cast(Value));
+		hasAdaptivetessX = true;
+		break;
+	case D3DRS_ADAPTIVETESS_Y:
+		SetSpecializationConstant(*this, mSpecializationConstants.adaptivetessY, bit_cast(Value));
+		hasAdaptivetessY = true;
+		break;
+	case D3DRS_ADAPTIVETESS_Z:
+		SetSpecializationConstant(*this, mSpecializationConstants.adaptivetessZ, bit_cast(Value));
+		hasAdaptivetessZ = true;
+		break;
+	case D3DRS_ADAPTIVETESS_W:
+		SetSpecializationConstant(*this, mSpecializationConstants.adaptivetessW, bit_cast(Value));
+		hasAdaptivetessW = true;
+		break;
+	case D3DRS_ENABLEADAPTIVETESSELLATION:
+		SetSpecializationConstant(*this, mSpecializationConstants.enableAdaptiveTessellation, Value);
+		hasEnableAdaptiveTessellation = true;
+		break;
+	case D3DRS_TWOSIDEDSTENCILMODE:
+		SetSpecializationConstant(*this, mSpecializationConstants.twoSidedStencilMode, Value);
+		hasTwoSidedStencilMode = true;
+		break;
+	case D3DRS_CCW_STENCILFAIL:
+		SetSpecializationConstant(*this, mSpecializationConstants.ccwStencilFail, Value);
+		hasCcwStencilFail = true;
+		break;
+	case D3DRS_CCW_STENCILZFAIL:
+		SetSpecializationConstant(*this, mSpecializationConstants.ccwStencilZFail, Value);
+		hasCcwStencilZFail = true;
+		break;
+	case D3DRS_CCW_STENCILPASS:
+		SetSpecializationConstant(*this, mSpecializationConstants.ccwStencilPass, Value);
+		hasCcwStencilPass = true;
+		break;
+	case D3DRS_CCW_STENCILFUNC:
+		SetSpecializationConstant(*this, mSpecializationConstants.ccwStencilFunction, Value);
+		hasCcwStencilFunction = true;
+		break;
+	case D3DRS_COLORWRITEENABLE1:
+		SetSpecializationConstant(*this, mSpecializationConstants.colorWriteEnable1, Value);
+		hasColorWriteEnable1 = true;
+		break;
+	case D3DRS_COLORWRITEENABLE2:
+		SetSpecializationConstant(*this, mSpecializationConstants.colorWriteEnable2, Value);
+		hasColorWriteEnable2 = true;
+		break;
+	case D3DRS_COLORWRITEENABLE3:
+		SetSpecializationConstant(*this, mSpecializationConstants.colorWriteEnable3, Value);
+		hasColorWriteEnable3 = true;
+		break;
+	case D3DRS_BLENDFACTOR:
+		SetSpecializationConstant(*this, mSpecializationConstants.blendFactor, Value);
+		hasBlendFactor = true;
+		break;
+	case D3DRS_SRGBWRITEENABLE:
+		SetSpecializationConstant(*this, mSpecializationConstants.srgbWriteEnable, Value);
+		hasSrgbWriteEnable = true;
+		break;
+	case D3DRS_DEPTHBIAS:
+		SetRenderStateConstant(*this, mRenderStateConstants.depthBias, bit_cast(Value));
+		hasDepthBias = true;
+		break;
+	case D3DRS_WRAP8:
+		SetSpecializationConstant(*this, mSpecializationConstants.wrap8, Value);
+		hasWrap8 = true;
+		break;
+	case D3DRS_WRAP9:
+		SetSpecializationConstant(*this, mSpecializationConstants.wrap9, Value);
+		hasWrap9 = true;
+		break;
+	case D3DRS_WRAP10:
+		SetSpecializationConstant(*this, mSpecializationConstants.wrap10, Value);
+		hasWrap10 = true;
+		break;
+	case D3DRS_WRAP11:
+		SetSpecializationConstant(*this, mSpecializationConstants.wrap11, Value);
+		hasWrap11 = true;
+		break;
+	case D3DRS_WRAP12:
+		SetSpecializationConstant(*this, mSpecializationConstants.wrap12, Value);
+		hasWrap12 = true;
+		break;
+	case D3DRS_WRAP13:
+		SetSpecializationConstant(*this, mSpecializationConstants.wrap13, Value);
+		hasWrap13 = true;
+		break;
+	case D3DRS_WRAP14:
+		SetSpecializationConstant(*this, mSpecializationConstants.wrap14, Value);
+		hasWrap14 = true;
+		break;
+	case D3DRS_WRAP15:
+		SetSpecializationConstant(*this, mSpecializationConstants.wrap15, Value);
+		hasWrap15 = true;
+		break;
+	case D3DRS_SEPARATEALPHABLENDENABLE:
+		SetSpecializationConstant(*this, mSpecializationConstants.separateAlphaBlendEnable, Value);
+		hasSeparateAlphaBlendEnable = true;
+		break;
+	case D3DRS_SRCBLENDALPHA:
+		SetSpecializationConstant(*this, mSpecializationConstants.sourceBlendAlpha, Value);
+		hasSourceBlendAlpha = true;
+		break;
+	case D3DRS_DESTBLENDALPHA:
+		SetSpecializationConstant(*this, mSpecializationConstants.destinationBlendAlpha, Value);
+		hasDestinationBlendAlpha = true;
+		break;
+	case D3DRS_BLENDOPALPHA:
+		SetSpecializationConstant(*this, mSpecializationConstants.blendOperationAlpha, Value);
+		hasBlendOperationAlpha = true;
+		break;
+	default:
+		BOOST_LOG_TRIVIAL(warning) << "DeviceState::SetRenderState unknown state! " << State;
+		break;
+	}
+}
+
+void DeviceState::SetSamplerState(DWORD Sampler, D3DSAMPLERSTATETYPE Type, DWORD Value)
+{
+	mSamplerStates[Sampler][Type] = Value;
+
+	if (Sampler < 32)
+	{
+		mSamplerStateDirtyMask |= (1 << Sampler);
+	}
+}
+
+void DeviceState::SetScissorRect(const RECT* pRect)
+{
+	m9Scissor = (*pRect);
+
+	mScissor.extent.width = m9Scissor.right;
+	mScissor.extent.height = m9Scissor.bottom;
+	mScissor.offset.x = m9Scissor.left;
+	mScissor.offset.y = m9Scissor.top;
+}
+
+void DeviceState::SetStreamSource(UINT StreamNumber, CVertexBuffer9* pStreamData, UINT OffsetInBytes, UINT Stride)
+{
+	mStreamSources[StreamNumber] = StreamSource(StreamNumber, pStreamData, OffsetInBytes, Stride);
+}
+
+void DeviceState::SetTexture(DWORD Sampler, IDirect3DBaseTexture9* pTexture)
+{
+	if (pTexture == nullptr)
+	{
+		auto it = mTextures.find(Sampler);
+		if (it != mTextures.end())
+		{
+			mTextures.erase(it);
+		}
+	}
+	else
+	{
+		mTextures[Sampler] = pTexture;
+		//texture->AddRef();
+	}
+}
+
+void DeviceState::SetTextureStageState(DWORD Stage, D3DTEXTURESTAGESTATETYPE Type, DWORD Value)
+{
+	switch (Type)
+	{
+	case D3DTSS_COLOROP:
+		switch (Stage)
+		{
+		case 0:
+			SetSpecializationConstant(*this, mSpecializationConstants.colorOperation_0, Value);
+			break;
+		case 1:
+			SetSpecializationConstant(*this, mSpecializationConstants.colorOperation_1, Value);
+			break;
+		case 2:
+			SetSpecializationConstant(*this, mSpecializationConstants.colorOperation_2, Value);
+			break;
+		case 3:
+			SetSpecializationConstant(*this, mSpecializationConstants.colorOperation_3, Value);
+			break;
+		case 4:
+			SetSpecializationConstant(*this, mSpecializationConstants.colorOperation_4, Value);
+			break;
+		case 5:
+			SetSpecializationConstant(*this, mSpecializationConstants.colorOperation_5, Value);
+			break;
+		case 6:
+			SetSpecializationConstant(*this, mSpecializationConstants.colorOperation_6, Value);
+			break;
+		case 7:
+			SetSpecializationConstant(*this, mSpecializationConstants.colorOperation_7, Value);
+			break;
+		default:
+			break;
+		}
+		break;
+	case D3DTSS_COLORARG1:
+		switch (Stage)
+		{
+		case 0:
+			SetSpecializationConstant(*this, mSpecializationConstants.colorArgument1_0, Value);
+			break;
+		case 1:
+			SetSpecializationConstant(*this, mSpecializationConstants.colorArgument1_1, Value);
+			break;
+		case 2:
+			SetSpecializationConstant(*this, mSpecializationConstants.colorArgument1_2, Value);
+			break;
+		case 3:
+			SetSpecializationConstant(*this, mSpecializationConstants.colorArgument1_3, Value);
+			break;
+		case 4:
+			SetSpecializationConstant(*this, mSpecializationConstants.colorArgument1_4, Value);
+			break;
+		case 5:
+			SetSpecializationConstant(*this, mSpecializationConstants.colorArgument1_5, Value);
+			break;
+		case 6:
+			SetSpecializationConstant(*this, mSpecializationConstants.colorArgument1_6, Value);
+			break;
+		case 7:
+			SetSpecializationConstant(*this, mSpecializationConstants.colorArgument1_7, Value);
+			break;
+		default:
+			break;
+		}
+		break;
+	case D3DTSS_COLORARG2:
+		switch (Stage)
+		{
+		case 0:
+			SetSpecializationConstant(*this, mSpecializationConstants.colorArgument2_0, Value);
+			break;
+		case 1:
+			SetSpecializationConstant(*this, mSpecializationConstants.colorArgument2_1, Value);
+			break;
+		case 2:
+			SetSpecializationConstant(*this, mSpecializationConstants.colorArgument2_2, Value);
+			break;
+		case 3:
+			SetSpecializationConstant(*this, mSpecializationConstants.colorArgument2_3, Value);
+			break;
+		case 4:
+			SetSpecializationConstant(*this, mSpecializationConstants.colorArgument2_4, Value);
+			break;
+		case 5:
+			SetSpecializationConstant(*this, mSpecializationConstants.colorArgument2_5, Value);
+			break;
+		case 6:
+			SetSpecializationConstant(*this, mSpecializationConstants.colorArgument2_6, Value);
+			break;
+		case 7:
+			SetSpecializationConstant(*this, mSpecializationConstants.colorArgument2_7, Value);
+			break;
+		default:
+			break;
+		}
+		break;
+	case D3DTSS_ALPHAOP:
+		switch (Stage)
+		{
+		case 0:
+			SetSpecializationConstant(*this, mSpecializationConstants.alphaOperation_0, Value);
+			break;
+		case 1:
+			SetSpecializationConstant(*this, mSpecializationConstants.alphaOperation_1, Value);
+			break;
+		case 2:
+			SetSpecializationConstant(*this, mSpecializationConstants.alphaOperation_2, Value);
+			break;
+		case 3:
+			SetSpecializationConstant(*this, mSpecializationConstants.alphaOperation_3, Value);
+			break;
+		case 4:
+			SetSpecializationConstant(*this, mSpecializationConstants.alphaOperation_4, Value);
+			break;
+		case 5:
+			SetSpecializationConstant(*this, mSpecializationConstants.alphaOperation_5, Value);
+			break;
+		case 6:
+			SetSpecializationConstant(*this, mSpecializationConstants.alphaOperation_6, Value);
+			break;
+		case 7:
+			SetSpecializationConstant(*this, mSpecializationConstants.alphaOperation_7, Value);
+			break;
+		default:
+			break;
+		}
+		break;
+	case D3DTSS_ALPHAARG1:
+		switch (Stage)
+		{
+		case 0:
+			SetSpecializationConstant(*this, mSpecializationConstants.alphaArgument1_0, Value);
+			break;
+		case 1:
+			SetSpecializationConstant(*this, mSpecializationConstants.alphaArgument1_1, Value);
+			break;
+		case 2:
+			SetSpecializationConstant(*this, mSpecializationConstants.alphaArgument1_2, Value);
+			break;
+		case 3:
+			SetSpecializationConstant(*this, mSpecializationConstants.alphaArgument1_3, Value);
+			break;
+		case 4:
+			SetSpecializationConstant(*this, mSpecializationConstants.alphaArgument1_4, Value);
+			break;
+		case 5:
+			SetSpecializationConstant(*this, mSpecializationConstants.alphaArgument1_5, Value);
+			break;
+		case 6:
+			SetSpecializationConstant(*this, mSpecializationConstants.alphaArgument1_6, Value);
+			break;
+		case 7:
+			SetSpecializationConstant(*this, mSpecializationConstants.alphaArgument1_7, Value);
+			break;
+		default:
+			break;
+		}
+		break;
+	case D3DTSS_ALPHAARG2:
+		switch (Stage)
+		{
+		case 0:
+			SetSpecializationConstant(*this, mSpecializationConstants.alphaArgument2_0, Value);
+			break;
+		case 1:
+			SetSpecializationConstant(*this, mSpecializationConstants.alphaArgument2_1, Value);
+			break;
+		case 2:
+			SetSpecializationConstant(*this, mSpecializationConstants.alphaArgument2_2, Value);
+			break;
+		case 3:
+			SetSpecializationConstant(*this, mSpecializationConstants.alphaArgument2_3, Value);
+			break;
+		case 4:
+			SetSpecializationConstant(*this, mSpecializationConstants.alphaArgument2_4, Value);
+			break;
+		case 5:
+			SetSpecializationConstant(*this, mSpecializationConstants.alphaArgument2_5, Value);
+			break;
+		case 6:
+			SetSpecializationConstant(*this, mSpecializationConstants.alphaArgument2_6, Value);
+			break;
+		case 7:
+			SetSpecializationConstant(*this, mSpecializationConstants.alphaArgument2_7, Value);
+			break;
+		default:
+			break;
+		}
+		break;
+	case D3DTSS_BUMPENVMAT00:
+		switch (Stage)
+		{
+		case 0:
+			SetRenderStateConstant(*this, mRenderStateConstants.bumpMapMatrix00_0, bit_cast(Value));
+			break;
+		case 1:
+			SetRenderStateConstant(*this, mRenderStateConstants.bumpMapMatrix00_1, bit_cast(Value));
+			break;
+		case 2:
+			SetRenderStateConstant(*this, mRenderStateConstants.bumpMapMatrix00_2, bit_cast(Value));
+			break;
+		case 3:
+			SetRenderStateConstant(*this, mRenderStateConstants.bumpMapMatrix00_3, bit_cast(Value));
+			break;
+		case 4:
+			SetRenderStateConstant(*this, mRenderStateConstants.bumpMapMatrix00_4, bit_cast(Value));
+			break;
+		case 5:
+			SetRenderStateConstant(*this, mRenderStateConstants.bumpMapMatrix00_5, bit_cast(Value));
+			break;
+		case 6:
+			SetRenderStateConstant(*this, mRenderStateConstants.bumpMapMatrix00_6, bit_cast(Value));
+			break;
+		case 7:
+			SetRenderStateConstant(*this, mRenderStateConstants.bumpMapMatrix00_7, bit_cast(Value));
+			break;
+		default:
+			break;
+		}
+		break;
+	case D3DTSS_BUMPENVMAT01:
+		switch (Stage)
+		{
+		case 0:
+			SetRenderStateConstant(*this, mRenderStateConstants.bumpMapMatrix01_0, bit_cast(Value));
+			break;
+		case 1:
+			SetRenderStateConstant(*this, mRenderStateConstants.bumpMapMatrix01_1, bit_cast(Value));
+			break;
+		case 2:
+			SetRenderStateConstant(*this, mRenderStateConstants.bumpMapMatrix01_2, bit_cast(Value));
+			break;
+		case 3:
+			SetRenderStateConstant(*this, mRenderStateConstants.bumpMapMatrix01_3, bit_cast(Value));
+			break;
+		case 4:
+			SetRenderStateConstant(*this, mRenderStateConstants.bumpMapMatrix01_4, bit_cast(Value));
+			break;
+		case 5:
+			SetRenderStateConstant(*this, mRenderStateConstants.bumpMapMatrix01_5, bit_cast(Value));
+			break;
+		case 6:
+			SetRenderStateConstant(*this, mRenderStateConstants.bumpMapMatrix01_6, bit_cast(Value));
+			break;
+		case 7:
+			SetRenderStateConstant(*this, mRenderStateConstants.bumpMapMatrix01_7, bit_cast(Value));
+			break;
+		default:
+			break;
+		}
+		break;
+	case D3DTSS_BUMPENVMAT10:
+		switch (Stage)
+		{
+		case 0:
+			SetRenderStateConstant(*this, mRenderStateConstants.bumpMapMatrix10_0, bit_cast(Value));
+			break;
+		case 1:
+			SetRenderStateConstant(*this, mRenderStateConstants.bumpMapMatrix10_1, bit_cast(Value));
+			break;
+		case 2:
+			SetRenderStateConstant(*this, mRenderStateConstants.bumpMapMatrix10_2, bit_cast(Value));
+			break;
+		case 3:
+			SetRenderStateConstant(*this, mRenderStateConstants.bumpMapMatrix10_3, bit_cast(Value));
+			break;
+		case 4:
+			SetRenderStateConstant(*this, mRenderStateConstants.bumpMapMatrix10_4, bit_cast(Value));
+			break;
+		case 5:
+			SetRenderStateConstant(*this, mRenderStateConstants.bumpMapMatrix10_5, bit_cast(Value));
+			break;
+		case 6:
+			SetRenderStateConstant(*this, mRenderStateConstants.bumpMapMatrix10_6, bit_cast(Value));
+			break;
+		case 7:
+			SetRenderStateConstant(*this, mRenderStateConstants.bumpMapMatrix10_7, bit_cast(Value));
+			break;
+		default:
+			break;
+		}
+		break;
+	case D3DTSS_BUMPENVMAT11:
+		switch (Stage)
+		{
+		case 0:
+			SetRenderStateConstant(*this, mRenderStateConstants.bumpMapMatrix11_0, bit_cast(Value));
+			break;
+		case 1:
+			SetRenderStateConstant(*this, mRenderStateConstants.bumpMapMatrix11_1, bit_cast(Value));
+			break;
+		case 2:
+			SetRenderStateConstant(*this, mRenderStateConstants.bumpMapMatrix11_2, bit_cast(Value));
+			break;
+		case 3:
+			SetRenderStateConstant(*this, mRenderStateConstants.bumpMapMatrix11_3, bit_cast(Value));
+			break;
+		case 4:
+			SetRenderStateConstant(*this, mRenderStateConstants.bumpMapMatrix11_4, bit_cast(Value));
+			break;
+		case 5:
+			SetRenderStateConstant(*this, mRenderStateConstants.bumpMapMatrix11_5, bit_cast(Value));
+			break;
+		case 6:
+			SetRenderStateConstant(*this, mRenderStateConstants.bumpMapMatrix11_6, bit_cast(Value));
+			break;
+		case 7:
+			SetRenderStateConstant(*this, mRenderStateConstants.bumpMapMatrix11_7, bit_cast(Value));
+			break;
+		default:
+			break;
+		}
+		break;
+	case D3DTSS_TEXCOORDINDEX:
+		switch (Stage)
+		{
+		case 0:
+			SetSpecializationConstant(*this, mSpecializationConstants.texureCoordinateIndex_0, Value);
+			break;
+		case 1:
+			SetSpecializationConstant(*this, mSpecializationConstants.texureCoordinateIndex_1, Value);
+			break;
+		case 2:
+			SetSpecializationConstant(*this, mSpecializationConstants.texureCoordinateIndex_2, Value);
+			break;
+		case 3:
+			SetSpecializationConstant(*this, mSpecializationConstants.texureCoordinateIndex_3, Value);
+			break;
+		case 4:
+			SetSpecializationConstant(*this, mSpecializationConstants.texureCoordinateIndex_4, Value);
+			break;
+		case 5:
+			SetSpecializationConstant(*this, mSpecializationConstants.texureCoordinateIndex_5, Value);
+			break;
+		case 6:
+			SetSpecializationConstant(*this, mSpecializationConstants.texureCoordinateIndex_6, Value);
+			break;
+		case 7:
+			SetSpecializationConstant(*this, mSpecializationConstants.texureCoordinateIndex_7, Value);
+			break;
+		default:
+			break;
+		}
+		break;
+	case D3DTSS_BUMPENVLSCALE:
+		switch (Stage)
+		{
+		case 0:
+			SetRenderStateConstant(*this, mRenderStateConstants.bumpMapScale_0, bit_cast(Value));
+			break;
+		case 1:
+			SetRenderStateConstant(*this, mRenderStateConstants.bumpMapScale_1, bit_cast(Value));
+			break;
+		case 2:
+			SetRenderStateConstant(*this, mRenderStateConstants.bumpMapScale_2, bit_cast(Value));
+			break;
+		case 3:
+			SetRenderStateConstant(*this, mRenderStateConstants.bumpMapScale_3, bit_cast(Value));
+			break;
+		case 4:
+			SetRenderStateConstant(*this, mRenderStateConstants.bumpMapScale_4, bit_cast(Value));
+			break;
+		case 5:
+			SetRenderStateConstant(*this, mRenderStateConstants.bumpMapScale_5, bit_cast(Value));
+			break;
+		case 6:
+			SetRenderStateConstant(*this, mRenderStateConstants.bumpMapScale_6, bit_cast(Value));
+			break;
+		case 7:
+			SetRenderStateConstant(*this, mRenderStateConstants.bumpMapScale_7, bit_cast(Value));
+			break;
+		default:
+			break;
+		}
+		break;
+	case D3DTSS_BUMPENVLOFFSET:
+		switch (Stage)
+		{
+		case 0:
+			SetRenderStateConstant(*this, mRenderStateConstants.bumpMapOffset_0, bit_cast(Value));
+			break;
+		case 1:
+			SetRenderStateConstant(*this, mRenderStateConstants.bumpMapOffset_1, bit_cast(Value));
+			break;
+		case 2:
+			SetRenderStateConstant(*this, mRenderStateConstants.bumpMapOffset_2, bit_cast(Value));
+			break;
+		case 3:
+			SetRenderStateConstant(*this, mRenderStateConstants.bumpMapOffset_3, bit_cast(Value));
+			break;
+		case 4:
+			SetRenderStateConstant(*this, mRenderStateConstants.bumpMapOffset_4, bit_cast(Value));
+			break;
+		case 5:
+			SetRenderStateConstant(*this, mRenderStateConstants.bumpMapOffset_5, bit_cast(Value));
+			break;
+		case 6:
+			SetRenderStateConstant(*this, mRenderStateConstants.bumpMapOffset_6, bit_cast(Value));
+			break;
+		case 7:
+			SetRenderStateConstant(*this, mRenderStateConstants.bumpMapOffset_7, bit_cast(Value));
+			break;
+		default:
+			break;
+		}
+		break;
+	case D3DTSS_TEXTURETRANSFORMFLAGS:
+		switch (Stage)
+		{
+		case 0:
+			SetSpecializationConstant(*this, mSpecializationConstants.textureTransformationFlags_0, Value);
+			break;
+		case 1:
+			SetSpecializationConstant(*this, mSpecializationConstants.textureTransformationFlags_1, Value);
+			break;
+		case 2:
+			SetSpecializationConstant(*this, mSpecializationConstants.textureTransformationFlags_2, Value);
+			break;
+		case 3:
+			SetSpecializationConstant(*this, mSpecializationConstants.textureTransformationFlags_3, Value);
+			break;
+		case 4:
+			SetSpecializationConstant(*this, mSpecializationConstants.textureTransformationFlags_4, Value);
+			break;
+		case 5:
+			SetSpecializationConstant(*this, mSpecializationConstants.textureTransformationFlags_5, Value);
+			break;
+		case 6:
+			SetSpecializationConstant(*this, mSpecializationConstants.textureTransformationFlags_6, Value);
+			break;
+		case 7:
+			SetSpecializationConstant(*this, mSpecializationConstants.textureTransformationFlags_7, Value);
+			break;
+		default:
+			break;
+		}
+		break;
+	case D3DTSS_COLORARG0:
+		switch (Stage)
+		{
+		case 0:
+			SetSpecializationConstant(*this, mSpecializationConstants.colorArgument0_0, Value);
+			break;
+		case 1:
+			SetSpecializationConstant(*this, mSpecializationConstants.colorArgument0_1, Value);
+			break;
+		case 2:
+			SetSpecializationConstant(*this, mSpecializationConstants.colorArgument0_2, Value);
+			break;
+		case 3:
+			SetSpecializationConstant(*this, mSpecializationConstants.colorArgument0_3, Value);
+			break;
+		case 4:
+			SetSpecializationConstant(*this, mSpecializationConstants.colorArgument0_4, Value);
+			break;
+		case 5:
+			SetSpecializationConstant(*this, mSpecializationConstants.colorArgument0_5, Value);
+			break;
+		case 6:
+			SetSpecializationConstant(*this, mSpecializationConstants.colorArgument0_6, Value);
+			break;
+		case 7:
+			SetSpecializationConstant(*this, mSpecializationConstants.colorArgument0_7, Value);
+			break;
+		default:
+			break;
+		}
+		break;
+	case D3DTSS_ALPHAARG0:
+		switch (Stage)
+		{
+		case 0:
+			SetSpecializationConstant(*this, mSpecializationConstants.alphaArgument0_0, Value);
+			break;
+		case 1:
+			SetSpecializationConstant(*this, mSpecializationConstants.alphaArgument0_1, Value);
+			break;
+		case 2:
+			SetSpecializationConstant(*this, mSpecializationConstants.alphaArgument0_2, Value);
+			break;
+		case 3:
+			SetSpecializationConstant(*this, mSpecializationConstants.alphaArgument0_3, Value);
+			break;
+		case 4:
+			SetSpecializationConstant(*this, mSpecializationConstants.alphaArgument0_4, Value);
+			break;
+		case 5:
+			SetSpecializationConstant(*this, mSpecializationConstants.alphaArgument0_5, Value);
+			break;
+		case 6:
+			SetSpecializationConstant(*this, mSpecializationConstants.alphaArgument0_6, Value);
+			break;
+		case 7:
+			SetSpecializationConstant(*this, mSpecializationConstants.alphaArgument0_7, Value);
+			break;
+		default:
+			break;
+		}
+		break;
+	case D3DTSS_RESULTARG:
+		switch (Stage)
+		{
+		case 0:
+			SetSpecializationConstant(*this, mSpecializationConstants.Result_0, Value);
+			break;
+		case 1:
+			SetSpecializationConstant(*this, mSpecializationConstants.Result_1, Value);
+			break;
+		case 2:
+			SetSpecializationConstant(*this, mSpecializationConstants.Result_2, Value);
+			break;
+		case 3:
+			SetSpecializationConstant(*this, mSpecializationConstants.Result_3, Value);
+			break;
+		case 4:
+			SetSpecializationConstant(*this, mSpecializationConstants.Result_4, Value);
+			break;
+		case 5:
+			SetSpecializationConstant(*this, mSpecializationConstants.Result_5, Value);
+			break;
+		case 6:
+			SetSpecializationConstant(*this, mSpecializationConstants.Result_6, Value);
+			break;
+		case 7:
+			SetSpecializationConstant(*this, mSpecializationConstants.Result_7, Value);
+			break;
+		default:
+			break;
+		}
+		break;
+	case D3DTSS_CONSTANT:
+		switch (Stage)
+		{
+		case 0:
+			SetRenderStateConstant(*this, mRenderStateConstants.Constant_0, Value);
+			break;
+		case 1:
+			SetRenderStateConstant(*this, mRenderStateConstants.Constant_1, Value);
+			break;
+		case 2:
+			SetRenderStateConstant(*this, mRenderStateConstants.Constant_2, Value);
+			break;
+		case 3:
+			SetRenderStateConstant(*this, mRenderStateConstants.Constant_3, Value);
+			break;
+		case 4:
+			SetRenderStateConstant(*this, mRenderStateConstants.Constant_4, Value);
+			break;
+		case 5:
+			SetRenderStateConstant(*this, mRenderStateConstants.Constant_5, Value);
+			break;
+		case 6:
+			SetRenderStateConstant(*this, mRenderStateConstants.Constant_6, Value);
+			break;
+		case 7:
+			SetRenderStateConstant(*this, mRenderStateConstants.Constant_7, Value);
+			break;
+		default:
+			break;
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+void DeviceState::SetTransform(D3DTRANSFORMSTATETYPE State, const D3DMATRIX* pMatrix)
+{
+	if (State >= TRANSFORM_COUNT)
+	{
+		return;
+	}
+
+	mTransforms[State] = (*pMatrix);
+	mHasTransforms[State] = true;
+
+	switch (State)
+	{
+	case D3DTS_WORLD:
+		mChangedTransforms |= TRANSFORM_CHANGED_WORLD;
+		break;
+	case D3DTS_VIEW:
+		mChangedTransforms |= TRANSFORM_CHANGED_VIEW;
+		break;
+	case D3DTS_PROJECTION:
+		mChangedTransforms |= TRANSFORM_CHANGED_PROJECTION;
+		break;
+	default:
+		break;
+	}
+}
+
+void DeviceState::SetVertexDeclaration(CVertexDeclaration9* pDecl)
+{
+	mVertexDeclaration = pDecl;
+
+	mHasVertexDeclaration = true;
+	mHasFVF = false;
+}
+
+void DeviceState::SetVertexShader(CVertexShader9* pShader)
+{
+	mVertexShader = pShader;
+	mHasVertexShader = true;
+}
+
+void DeviceState::SetVertexShaderConstantB(UINT StartRegister, const BOOL* pConstantData, UINT BoolCount)
+{
+	auto& slots = mVertexShaderConstantSlots;
+	for (size_t i = 0; i < BoolCount; i++)
+	{
+		SetHashedState(mVertexShaderConstantSlotsHash, &slots, slots.BooleanConstants[StartRegister + i], pConstantData[i]);
+	}
+
+	MarkShaderConstantsDirty(mAreVertexShaderConstantsDirty, mVertexShaderConstantsSize, slots, &slots.BooleanConstants[StartRegister + BoolCount]);
+}
+
+void DeviceState::SetVertexShaderConstantF(UINT StartRegister, const float* pConstantData, UINT Vector4fCount, bool useConstantBuffer)
+{
+	auto& slots = mVertexShaderConstantSlots;
+	const uint32_t pushConstantCount = sizeof(mPushConstants) / sizeof(float);
+	uint32_t startIndex = (StartRegister * 4);
+	uint32_t length = (Vector4fCount * 4);
+	for (size_t i = 0; i < length; i++)
+	{
+		if ((startIndex + i) < pushConstantCount)
+		{
+			mPushConstants[startIndex + i] = pConstantData[i];
+		}
+
+		//The constant ring holds every register so the shader can read past what is pushed.
+		if ((startIndex + i) >= pushConstantCount || useConstantBuffer)
+		{
+			SetHashedState(mVertexShaderConstantSlotsHash, &slots, slots.FloatConstants[startIndex + i], pConstantData[i]);
+		}
+	}
+
+	MarkShaderConstantsDirty(mAreVertexShaderConstantsDirty, mVertexShaderConstantsSize, slots, &slots.FloatConstants[startIndex + length]);
+}
+
+void DeviceState::SetVertexShaderConstantI(UINT StartRegister, const int* pConstantData, UINT Vector4iCount)
+{
+	auto& slots = mVertexShaderConstantSlots;
+	uint32_t startIndex = (StartRegister * 4);
+	uint32_t length = (Vector4iCount * 4);
+	for (size_t i = 0; i < length; i++)
+	{
+		SetHashedState(mVertexShaderConstantSlotsHash, &slots, slots.IntegerConstants[startIndex + i], pConstantData[i]);
+	}
+
+	MarkShaderConstantsDirty(mAreVertexShaderConstantsDirty, mVertexShaderConstantsSize, slots, &slots.IntegerConstants[startIndex + length]);
+}
+
+void DeviceState::SetViewport(const D3DVIEWPORT9* pViewport)
+{
+	m9Viewport = (*pViewport);
+
+	mViewport.y = (float)m9Viewport.Height;
+	mViewport.width = (float)m9Viewport.Width;
+	mViewport.height = -(float)m9Viewport.Height;
+	mViewport.minDepth = m9Viewport.MinZ;
+	mViewport.maxDepth = m9Viewport.MaxZ;
+}
+
+void DeviceState::GetLight(DWORD Index, D3DLIGHT9* pLight) const
+{
+	auto& light = mLights[Index];
+
+	pLight->Type = (D3DLIGHTTYPE)light.Type;
+	pLight->Diffuse = (*(D3DCOLORVALUE*)light.Diffuse);
+	pLight->Specular = (*(D3DCOLORVALUE*)light.Specular);
+	pLight->Ambient = (*(D3DCOLORVALUE*)light.Ambient);
+
+	pLight->Position = (*(D3DVECTOR*)light.Position);
+	pLight->Direction = (*(D3DVECTOR*)light.Direction);
+
+	pLight->Range = light.Range;
+	pLight->Falloff = light.Falloff;
+	pLight->Attenuation0 = light.Attenuation0;
+	pLight->Attenuation1 = light.Attenuation1;
+	pLight->Attenuation2 = light.Attenuation2;
+	pLight->Theta = light.Theta;
+	pLight->Phi = light.Phi;
+}
+
+void DeviceState::GetPixelShaderConstantB(UINT StartRegister, BOOL* pConstantData, UINT BoolCount) const
+{
+	auto& slots = mPixelShaderConstantSlots;
+	for (size_t i = 0; i < BoolCount; i++)
+	{
+		pConstantData[i] = slots.BooleanConstants[StartRegister + i];
+	}
+}
+
+void DeviceState::GetPixelShaderConstantF(UINT StartRegister, float* pConstantData, UINT Vector4fCount) const
+{
+	auto& slots = mPixelShaderConstantSlots;
+	uint32_t startIndex = (StartRegister * 4);
+	uint32_t length = (Vector4fCount * 4);
+	for (size_t i = 0; i < length; i++)
+	{
+		pConstantData[i] = slots.FloatConstants[startIndex + i];
+	}
+}
+
+void DeviceState::GetPixelShaderConstantI(UINT StartRegister, int* pConstantData, UINT Vector4iCount) const
+{
+	auto& slots = mPixelShaderConstantSlots;
+	uint32_t startIndex = (StartRegister * 4);
+	uint32_t length = (Vector4iCount * 4);
+	for (size_t i = 0; i < length; i++)
+	{
+		pConstantData[i] = slots.IntegerConstants[startIndex + i];
+	}
+}
+
+void DeviceState::GetRenderState(D3DRENDERSTATETYPE State, DWORD* pValue) const
+{
+	switch (State)
+	{
+	case D3DRS_ZENABLE:
+		(*pValue) = mSpecializationConstants.zEnable;
+		break;
+	case D3DRS_FILLMODE:
+		(*pValue) = mSpecializationConstants.fillMode;
+		break;
+	case D3DRS_SHADEMODE:
+		(*pValue) = mSpecializationConstants.shadeMode;
+		break;
+	case D3DRS_ZWRITEENABLE:
+		(*pValue) = mSpecializationConstants.zWriteEnable;
+		break;
+	case D3DRS_ALPHATESTENABLE:
+		(*pValue) = mSpecializationConstants.alphaTestEnable;
+		break;
+	case D3DRS_LASTPIXEL:
+		(*pValue) = mSpecializationConstants.lastPixel;
+		break;
+	case D3DRS_SRCBLEND:
+		(*pValue) = mSpecializationConstants.sourceBlend;
+		break;
+	case D3DRS_DESTBLEND:
+		(*pValue) = mSpecializationConstants.destinationBlend;
+		break;
+	case D3DRS_CULLMODE:
+		(*pValue) = mSpecializationConstants.cullMode;
+		break;
+	case D3DRS_ZFUNC:
+		(*pValue) = mSpecializationConstants.zFunction;
+		break;
+	case D3DRS_ALPHAREF:
+		(*pValue) = mRenderStateConstants.alphaReference;
+		break;
+	case D3DRS_ALPHAFUNC:
+		(*pValue) = mSpecializationConstants.alphaFunction;
+		break;
+	case D3DRS_DITHERENABLE:
+		(*pValue) = mSpecializationConstants.ditherEnable;
+		break;
+	case D3DRS_ALPHABLENDENABLE:
+		(*pValue) = mSpecializationConstants.alphaBlendEnable;
+		break;
+	case D3DRS_FOGENABLE:
+		(*pValue) = mSpecializationConstants.fogEnable;
+		break;
+	case D3DRS_SPECULARENABLE:
+		(*pValue) = mSpecializationConstants.specularEnable;
+		break;
+	case D3DRS_FOGCOLOR:
+		(*pValue) = mRenderStateConstants.fogColor;
+		break;
+	case D3DRS_FOGTABLEMODE:
+		(*pValue) = mSpecializationConstants.fogTableMode;
+		break;
+	case D3DRS_FOGSTART:
+		(*pValue) = bit_cast(mRenderStateConstants.fogStart);
+		break;
+	case D3DRS_FOGEND:
+		(*pValue) = bit_cast(mRenderStateConstants.fogEnd);
+		break;
+	case D3DRS_FOGDENSITY:
+		(*pValue) = bit_cast(mRenderStateConstants.fogDensity);
+		break;
+	case D3DRS_RANGEFOGENABLE:
+		(*pValue) = mSpecializationConstants.rangeFogEnable;
+		break;
+	case D3DRS_STENCILENABLE:
+		(*pValue) = mSpecializationConstants.stencilEnable;
+		break;
+	case D3DRS_STENCILFAIL:
+		(*pValue) = mSpecializationConstants.stencilFail;
+		break;
+	case D3DRS_STENCILZFAIL:
+		(*pValue) = mSpecializationConstants.stencilZFail;
+		break;
+	case D3DRS_STENCILPASS:
+		(*pValue) = mSpecializationConstants.stencilPass;
+		break;
+	case D3DRS_STENCILFUNC:
+		(*pValue) = mSpecializationConstants.stencilFunction;
+		break;
+	case D3DRS_STENCILREF:
+		(*pValue) = mSpecializationConstants.stencilReference;
+		break;
+	case D3DRS_STENCILMASK:
+		(*pValue) = mSpecializationConstants.stencilMask;
+		break;
+	case D3DRS_STENCILWRITEMASK:
+		(*pValue) = mSpecializationConstants.stencilWriteMask;
+		break;
+	case D3DRS_TEXTUREFACTOR:
+		(*pValue) = mRenderStateConstants.textureFactor;
+		break;
+	case D3DRS_WRAP0:
+		(*pValue) = mSpecializationConstants.wrap0;
+		break;
+	case D3DRS_WRAP1:
+		(*pValue) = mSpecializationConstants.wrap1;
+		break;
+	case D3DRS_WRAP2:
+		(*pValue) = mSpecializationConstants.wrap2;
+		break;
+	case D3DRS_WRAP3:
+		(*pValue) = mSpecializationConstants.wrap3;
+		break;
+	case D3DRS_WRAP4:
+		(*pValue) = mSpecializationConstants.wrap4;
+		break;
+	case D3DRS_WRAP5:
+		(*pValue) = mSpecializationConstants.wrap5;
+		break;
+	case D3DRS_WRAP6:
+		(*pValue) = mSpecializationConstants.wrap6;
+		break;
+	case D3DRS_WRAP7:
+		(*pValue) = mSpecializationConstants.wrap7;
+		break;
+	case D3DRS_CLIPPING:
+		(*pValue) = mSpecializationConstants.clipping;
+		break;
+	case D3DRS_LIGHTING:
+		(*pValue) = mSpecializationConstants.lighting;
+		break;
+	case D3DRS_AMBIENT:
+		(*pValue) = mRenderStateConstants.ambient;
+		break;
+	case D3DRS_FOGVERTEXMODE:
+		(*pValue) = mSpecializationConstants.fogVertexMode;
+		break;
+	case D3DRS_COLORVERTEX:
+		(*pValue) = mSpecializationConstants.colorVertex;
+		break;
+	case D3DRS_LOCALVIEWER:
+		(*pValue) = mSpecializationConstants.localViewer;
+		break;
+	case D3DRS_NORMALIZENORMALS:
+		(*pValue) = mSpecializationConstants.normalizeNormals;
+		break;
+	case D3DRS_DIFFUSEMATERIALSOURCE:
+		(*pValue) = mSpecializationConstants.diffuseMaterialSource;
+		break;
+	case D3DRS_SPECULARMATERIALSOURCE:
+		(*pValue) = mSpecializationConstants.specularMaterialSource;
+		break;
+	case D3DRS_AMBIENTMATERIALSOURCE:
+		(*pValue) = mSpecializationConstants.ambientMaterialSource;
+		break;
+	case D3DRS_EMISSIVEMATERIALSOURCE:
+		(*pValue) = mSpecializationConstants.emissiveMaterialSource;
+		break;
+	case D3DRS_VERTEXBLEND:
+		(*pValue) = mSpecializationConstants.vertexBlend;
+		break;
+	case D3DRS_CLIPPLANEENABLE:
+		(*pValue) = mSpecializationConstants.clipPlaneEnable;
+		break;
+	case D3DRS_POINTSIZE:
+		(*pValue) = mRenderStateConstants.pointSize;
+		break;
+	case D3DRS_POINTSIZE_MIN:
+		(*pValue) = bit_cast(mRenderStateConstants.pointSizeMinimum);
+		break;
+	case D3DRS_POINTSPRITEENABLE:
+		(*pValue) = mSpecializationConstants.pointSpriteEnable;
+		break;
+	case D3DRS_POINTSCALEENABLE:
+		(*pValue) = mSpecializationConstants.pointScaleEnable;
+		break;
+	case D3DRS_POINTSCALE_A:
+		(*pValue) = bit_cast(mRenderStateConstants.pointScaleA);
+		break;
+	case D3DRS_POINTSCALE_B:
+		(*pValue) = bit_cast(mRenderStateConstants.pointScaleB);
+		break;
+	case D3DRS_POINTSCALE_C:
+		(*pValue) = bit_cast(mRenderStateConstants.pointScaleC);
+		break;
+	case D3DRS_MULTISAMPLEANTIALIAS:
+		(*pValue) = mSpecializationConstants.multisampleAntiAlias;
+		break;
+	case D3DRS_MULTISAMPLEMASK:
+		(*pValue) = mSpecializationConstants.multisampleMask;
+		break;
+	case D3DRS_PATCHEDGESTYLE:
+		(*pValue) = mSpecializationConstants.patchEdgeStyle;
+		break;
+	case D3DRS_DEBUGMONITORTOKEN:
+		(*pValue) = mSpecializationConstants.debugMonitorToken;
+		break;
+	case D3DRS_POINTSIZE_MAX:
+		(*pValue) = bit_cast(mRenderStateConstants.pointSizeMaximum);
+		break;
+	case D3DRS_INDEXEDVERTEXBLENDENABLE:
+		(*pValue) = mSpecializationConstants.indexedVertexBlendEnable;
+		break;
+	case D3DRS_COLORWRITEENABLE:
+		(*pValue) = mSpecializationConstants.colorWriteEnable;
+		break;
+	case D3DRS_TWEENFACTOR:
+		(*pValue) = bit_cast(mRenderStateConstants.tweenFactor);
+		break;
+	case D3DRS_BLENDOP:
+		(*pValue) = mSpecializationConstants.blendOperation;
+		break;
+	case D3DRS_POSITIONDEGREE:
+		(*pValue) = mSpecializationConstants.positionDegree;
+		break;
+	case D3DRS_NORMALDEGREE:
+		(*pValue) = mSpecializationConstants.normalDegree;
+		break;
+	case D3DRS_SCISSORTESTENABLE:
+		(*pValue) = mSpecializationConstants.scissorTestEnable;
+		break;
+	case D3DRS_SLOPESCALEDEPTHBIAS:
+		(*pValue) = bit_cast(mRenderStateConstants.slopeScaleDepthBias);
+		break;
+	case D3DRS_ANTIALIASEDLINEENABLE:
+		(*pValue) = mSpecializationConstants.antiAliasedLineEnable;
+		break;
+	case D3DRS_MINTESSELLATIONLEVEL:
+		(*pValue) = bit_cast(mSpecializationConstants.minimumTessellationLevel);
+		break;
+	case D3DRS_MAXTESSELLATIONLEVEL:
+		(*pValue) = bit_cast(mSpecializationConstants.maximumTessellationLevel);
+		break;
+	case D3DRS_ADAPTIVETESS_X:
+		(*pValue) = bit_cast(mSpecializationConstants.adaptivetessX);
+		break;
+	case D3DRS_ADAPTIVETESS_Y:
+		(*pValue) = bit_cast(mSpecializationConstants.adaptivetessY);
+		break;
+	case D3DRS_ADAPTIVETESS_Z:
+		(*pValue) = bit_cast(mSpecializationConstants.adaptivetessZ);
+		break;
+	case D3DRS_ADAPTIVETESS_W:
+		(*pValue) = bit_cast(mSpecializationConstants.adaptivetessW);
+		break;
+	case D3DRS_ENABLEADAPTIVETESSELLATION:
+		(*pValue) = mSpecializationConstants.enableAdaptiveTessellation;
+		break;
+	case D3DRS_TWOSIDEDSTENCILMODE:
+		(*pValue) = mSpecializationConstants.twoSidedStencilMode;
+		break;
+	case D3DRS_CCW_STENCILFAIL:
+		(*pValue) = mSpecializationConstants.ccwStencilFail;
+		break;
+	case D3DRS_CCW_STENCILZFAIL:
+		(*pValue) = mSpecializationConstants.ccwStencilZFail;
+		break;
+	case D3DRS_CCW_STENCILPASS:
+		(*pValue) = mSpecializationConstants.ccwStencilPass;
+		break;
+	case D3DRS_CCW_STENCILFUNC:
+		(*pValue) = mSpecializationConstants.ccwStencilFunction;
+		break;
+	case D3DRS_COLORWRITEENABLE1:
+		(*pValue) = mSpecializationConstants.colorWriteEnable1;
+		break;
+	case D3DRS_COLORWRITEENABLE2:
+		(*pValue) = mSpecializationConstants.colorWriteEnable2;
+		break;
+	case D3DRS_COLORWRITEENABLE3:
+		(*pValue) = mSpecializationConstants.colorWriteEnable3;
+		break;
+	case D3DRS_BLENDFACTOR:
+		(*pValue) = mSpecializationConstants.blendFactor;
+		break;
+	case D3DRS_SRGBWRITEENABLE:
+		(*pValue) = mSpecializationConstants.srgbWriteEnable;
+		break;
+	case D3DRS_DEPTHBIAS:
+		(*pValue) = bit_cast(mRenderStateConstants.depthBias);
+		break;
+	case D3DRS_WRAP8:
+		(*pValue) = mSpecializationConstants.wrap8;
+		break;
+	case D3DRS_WRAP9:
+		(*pValue) = mSpecializationConstants.wrap9;
+		break;
+	case D3DRS_WRAP10:
+		(*pValue) = mSpecializationConstants.wrap10;
+		break;
+	case D3DRS_WRAP11:
+		(*pValue) = mSpecializationConstants.wrap11;
+		break;
+	case D3DRS_WRAP12:
+		(*pValue) = mSpecializationConstants.wrap12;
+		break;
+	case D3DRS_WRAP13:
+		(*pValue) = mSpecializationConstants.wrap13;
+		break;
+	case D3DRS_WRAP14:
+		(*pValue) = mSpecializationConstants.wrap14;
+		break;
+	case D3DRS_WRAP15:
+		(*pValue) = mSpecializationConstants.wrap15;
+		break;
+	case D3DRS_SEPARATEALPHABLENDENABLE:
+		(*pValue) = mSpecializationConstants.separateAlphaBlendEnable;
+		break;
+	case D3DRS_SRCBLENDALPHA:
+		(*pValue) = mSpecializationConstants.sourceBlendAlpha;
+		break;
+	case D3DRS_DESTBLENDALPHA:
+		(*pValue) = mSpecializationConstants.destinationBlendAlpha;
+		break;
+	case D3DRS_BLENDOPALPHA:
+		(*pValue) = mSpecializationConstants.blendOperationAlpha;
+		break;
+	default:
+		BOOST_LOG_TRIVIAL(warning) << "DeviceState::GetRenderState unknown state! " << State;
+		break;
+	}
+}
+
+void DeviceState::GetTextureStageState(DWORD Stage, D3DTEXTURESTAGESTATETYPE Type, DWORD* pValue) const
+{
+	switch (Type)
+	{
+	case D3DTSS_COLOROP:
+		switch (Stage)
+		{
+		case 0:
+			(*pValue) = mSpecializationConstants.colorOperation_0;
+			break;
+		case 1:
+			(*pValue) = mSpecializationConstants.colorOperation_1;
+			break;
+		case 2:
+			(*pValue) = mSpecializationConstants.colorOperation_2;
+			break;
+		case 3:
+			(*pValue) = mSpecializationConstants.colorOperation_3;
+			break;
+		case 4:
+			(*pValue) = mSpecializationConstants.colorOperation_4;
+			break;
+		case 5:
+			(*pValue) = mSpecializationConstants.colorOperation_5;
+			break;
+		case 6:
+			(*pValue) = mSpecializationConstants.colorOperation_6;
+			break;
+		case 7:
+			(*pValue) = mSpecializationConstants.colorOperation_7;
+			break;
+		default:
+			break;
+		}
+		break;
+	case D3DTSS_COLORARG1:
+		switch (Stage)
+		{
+		case 0:
+			(*pValue) = mSpecializationConstants.colorArgument1_0;
+			break;
+		case 1:
+			(*pValue) = mSpecializationConstants.colorArgument1_1;
+			break;
+		case 2:
+			(*pValue) = mSpecializationConstants.colorArgument1_2;
+			break;
+		case 3:
+			(*pValue) = mSpecializationConstants.colorArgument1_3;
+			break;
+		case 4:
+			(*pValue) = mSpecializationConstants.colorArgument1_4;
+			break;
+		case 5:
+			(*pValue) = mSpecializationConstants.colorArgument1_5;
+			break;
+		case 6:
+			(*pValue) = mSpecializationConstants.colorArgument1_6;
+			break;
+		case 7:
+			(*pValue) = mSpecializationConstants.colorArgument1_7;
+			break;
+		default:
+			break;
+		}
+		break;
+	case D3DTSS_COLORARG2:
+		switch (Stage)
+		{
+		case 0:
+			(*pValue) = mSpecializationConstants.colorArgument2_0;
+			break;
+		case 1:
+			(*pValue) = mSpecializationConstants.colorArgument2_1;
+			break;
+		case 2:
+			(*pValue) = mSpecializationConstants.colorArgument2_2;
+			break;
+		case 3:
+			(*pValue) = mSpecializationConstants.colorArgument2_3;
+			break;
+		case 4:
+			(*pValue) = mSpecializationConstants.colorArgument2_4;
+			break;
+		case 5:
+			(*pValue) = mSpecializationConstants.colorArgument2_5;
+			break;
+		case 6:
+			(*pValue) = mSpecializationConstants.colorArgument2_6;
+			break;
+		case 7:
+			(*pValue) = mSpecializationConstants.colorArgument2_7;
+			break;
+		default:
+			break;
+		}
+		break;
+	case D3DTSS_ALPHAOP:
+		switch (Stage)
+		{
+		case 0:
+			(*pValue) = mSpecializationConstants.alphaOperation_0;
+			break;
+		case 1:
+			(*pValue) = mSpecializationConstants.alphaOperation_1;
+			break;
+		case 2:
+			(*pValue) = mSpecializationConstants.alphaOperation_2;
+			break;
+		case 3:
+			(*pValue) = mSpecializationConstants.alphaOperation_3;
+			break;
+		case 4:
+			(*pValue) = mSpecializationConstants.alphaOperation_4;
+			break;
+		case 5:
+			(*pValue) = mSpecializationConstants.alphaOperation_5;
+			break;
+		case 6:
+			(*pValue) = mSpecializationConstants.alphaOperation_6;
+			break;
+		case 7:
+			(*pValue) = mSpecializationConstants.alphaOperation_7;
+			break;
+		default:
+			break;
+		}
+		break;
+	case D3DTSS_ALPHAARG1:
+		switch (Stage)
+		{
+		case 0:
+			(*pValue) = mSpecializationConstants.alphaArgument1_0;
+			break;
+		case 1:
+			(*pValue) = mSpecializationConstants.alphaArgument1_1;
+			break;
+		case 2:
+			(*pValue) = mSpecializationConstants.alphaArgument1_2;
+			break;
+		case 3:
+			(*pValue) = mSpecializationConstants.alphaArgument1_3;
+			break;
+		case 4:
+			(*pValue) = mSpecializationConstants.alphaArgument1_4;
+			break;
+		case 5:
+			(*pValue) = mSpecializationConstants.alphaArgument1_5;
+			break;
+		case 6:
+			(*pValue) = mSpecializationConstants.alphaArgument1_6;
+			break;
+		case 7:
+			(*pValue) = mSpecializationConstants.alphaArgument1_7;
+			break;
+		default:
+			break;
+		}
+		break;
+	case D3DTSS_ALPHAARG2:
+		switch (Stage)
+		{
+		case 0:
+			(*pValue) = mSpecializationConstants.alphaArgument2_0;
+			break;
+		case 1:
+			(*pValue) = mSpecializationConstants.alphaArgument2_1;
+			break;
+		case 2:
+			(*pValue) = mSpecializationConstants.alphaArgument2_2;
+			break;
+		case 3:
+			(*pValue) = mSpecializationConstants.alphaArgument2_3;
+			break;
+		case 4:
+			(*pValue) = mSpecializationConstants.alphaArgument2_4;
+			break;
+		case 5:
+			(*pValue) = mSpecializationConstants.alphaArgument2_5;
+			break;
+		case 6:
+			(*pValue) = mSpecializationConstants.alphaArgument2_6;
+			break;
+		case 7:
+			(*pValue) = mSpecializationConstants.alphaArgument2_7;
+			break;
+		default:
+			break;
+		}
+		break;
+	case D3DTSS_BUMPENVMAT00:
+		switch (Stage)
+		{
+		case 0:
+			(*pValue) = bit_cast(mRenderStateConstants.bumpMapMatrix00_0);
+			break;
+		case 1:
+			(*pValue) = bit_cast(mRenderStateConstants.bumpMapMatrix00_1);
+			break;
+		case 2:
+			(*pValue) = bit_cast(mRenderStateConstants.bumpMapMatrix00_2);
+			break;
+		case 3:
+			(*pValue) = bit_cast(mRenderStateConstants.bumpMapMatrix00_3);
+			break;
+		case 4:
+			(*pValue) = bit_cast(mRenderStateConstants.bumpMapMatrix00_4);
+			break;
+		case 5:
+			(*pValue) = bit_cast(mRenderStateConstants.bumpMapMatrix00_5);
+			break;
+		case 6:
+			(*pValue) = bit_cast(mRenderStateConstants.bumpMapMatrix00_6);
+			break;
+		case 7:
+			(*pValue) = bit_cast(mRenderStateConstants.bumpMapMatrix00_7);
+			break;
+		default:
+			break;
+		}
+		break;
+	case D3DTSS_BUMPENVMAT01:
+		switch (Stage)
+		{
+		case 0:
+			(*pValue) = bit_cast(mRenderStateConstants.bumpMapMatrix01_0);
+			break;
+		case 1:
+			(*pValue) = bit_cast(mRenderStateConstants.bumpMapMatrix01_1);
+			break;
+		case 2:
+			(*pValue) = bit_cast(mRenderStateConstants.bumpMapMatrix01_2);
+			break;
+		case 3:
+			(*pValue) = bit_cast(mRenderStateConstants.bumpMapMatrix01_3);
+			break;
+		case 4:
+			(*pValue) = bit_cast(mRenderStateConstants.bumpMapMatrix01_4);
+			break;
+		case 5:
+			(*pValue) = bit_cast(mRenderStateConstants.bumpMapMatrix01_5);
+			break;
+		case 6:
+			(*pValue) = bit_cast(mRenderStateConstants.bumpMapMatrix01_6);
+			break;
+		case 7:
+			(*pValue) = bit_cast(mRenderStateConstants.bumpMapMatrix01_7);
+			break;
+		default:
+			break;
+		}
+		break;
+	case D3DTSS_BUMPENVMAT10:
+		switch (Stage)
+		{
+		case 0:
+			(*pValue) = bit_cast(mRenderStateConstants.bumpMapMatrix10_0);
+			break;
+		case 1:
+			(*pValue) = bit_cast(mRenderStateConstants.bumpMapMatrix10_1);
+			break;
+		case 2:
+			(*pValue) = bit_cast(mRenderStateConstants.bumpMapMatrix10_2);
+			break;
+		case 3:
+			(*pValue) = bit_cast(mRenderStateConstants.bumpMapMatrix10_3);
+			break;
+		case 4:
+			(*pValue) = bit_cast(mRenderStateConstants.bumpMapMatrix10_4);
+			break;
+		case 5:
+			(*pValue) = bit_cast(mRenderStateConstants.bumpMapMatrix10_5);
+			break;
+		case 6:
+			(*pValue) = bit_cast(mRenderStateConstants.bumpMapMatrix10_6);
+			break;
+		case 7:
+			(*pValue) = bit_cast(mRenderStateConstants.bumpMapMatrix10_7);
+			break;
+		default:
+			break;
+		}
+		break;
+	case D3DTSS_BUMPENVMAT11:
+		switch (Stage)
+		{
+		case 0:
+			(*pValue) = bit_cast(mRenderStateConstants.bumpMapMatrix11_0);
+			break;
+		case 1:
+			(*pValue) = bit_cast(mRenderStateConstants.bumpMapMatrix11_1);
+			break;
+		case 2:
+			(*pValue) = bit_cast(mRenderStateConstants.bumpMapMatrix11_2);
+			break;
+		case 3:
+			(*pValue) = bit_cast(mRenderStateConstants.bumpMapMatrix11_3);
+			break;
+		case 4:
+			(*pValue) = bit_cast(mRenderStateConstants.bumpMapMatrix11_4);
+			break;
+		case 5:
+			(*pValue) = bit_cast(mRenderStateConstants.bumpMapMatrix11_5);
+			break;
+		case 6:
+			(*pValue) = bit_cast(mRenderStateConstants.bumpMapMatrix11_6);
+			break;
+		case 7:
+			(*pValue) = bit_cast(mRenderStateConstants.bumpMapMatrix11_7);
+			break;
+		default:
+			break;
+		}
+		break;
+	case D3DTSS_TEXCOORDINDEX:
+		switch (Stage)
+		{
+		case 0:
+			(*pValue) = mSpecializationConstants.texureCoordinateIndex_0;
+			break;
+		case 1:
+			(*pValue) = mSpecializationConstants.texureCoordinateIndex_1;
+			break;
+		case 2:
+			(*pValue) = mSpecializationConstants.texureCoordinateIndex_2;
+			break;
+		case 3:
+			(*pValue) = mSpecializationConstants.texureCoordinateIndex_3;
+			break;
+		case 4:
+			(*pValue) = mSpecializationConstants.texureCoordinateIndex_4;
+			break;
+		case 5:
+			(*pValue) = mSpecializationConstants.texureCoordinateIndex_5;
+			break;
+		case 6:
+			(*pValue) = mSpecializationConstants.texureCoordinateIndex_6;
+			break;
+		case 7:
+			(*pValue) = mSpecializationConstants.texureCoordinateIndex_7;
+			break;
+		default:
+			break;
+		}
+		break;
+	case D3DTSS_BUMPENVLSCALE:
+		switch (Stage)
+		{
+		case 0:
+			(*pValue) = bit_cast(mRenderStateConstants.bumpMapScale_0);
+			break;
+		case 1:
+			(*pValue) = bit_cast(mRenderStateConstants.bumpMapScale_1);
+			break;
+		case 2:
+			(*pValue) = bit_cast(mRenderStateConstants.bumpMapScale_2);
+			break;
+		case 3:
+			(*pValue) = bit_cast(mRenderStateConstants.bumpMapScale_3);
+			break;
+		case 4:
+			(*pValue) = bit_cast(mRenderStateConstants.bumpMapScale_4);
+			break;
+		case 5:
+			(*pValue) = bit_cast(mRenderStateConstants.bumpMapScale_5);
+			break;
+		case 6:
+			(*pValue) = bit_cast(mRenderStateConstants.bumpMapScale_6);
+			break;
+		case 7:
+			(*pValue) = bit_cast(mRenderStateConstants.bumpMapScale_7);
+			break;
+		default:
+			break;
+		}
+		break;
+	case D3DTSS_BUMPENVLOFFSET:
+		switch (Stage)
+		{
+		case 0:
+			(*pValue) = bit_cast(mRenderStateConstants.bumpMapOffset_0);
+			break;
+		case 1:
+			(*pValue) = bit_cast(mRenderStateConstants.bumpMapOffset_1);
+			break;
+		case 2:
+			(*pValue) = bit_cast(mRenderStateConstants.bumpMapOffset_2);
+			break;
+		case 3:
+			(*pValue) = bit_cast(mRenderStateConstants.bumpMapOffset_3);
+			break;
+		case 4:
+			(*pValue) = bit_cast(mRenderStateConstants.bumpMapOffset_4);
+			break;
+		case 5:
+			(*pValue) = bit_cast(mRenderStateConstants.bumpMapOffset_5);
+			break;
+		case 6:
+			(*pValue) = bit_cast(mRenderStateConstants.bumpMapOffset_6);
+			break;
+		case 7:
+			(*pValue) = bit_cast(mRenderStateConstants.bumpMapOffset_7);
+			break;
+		default:
+			break;
+		}
+		break;
+	case D3DTSS_TEXTURETRANSFORMFLAGS:
+		switch (Stage)
+		{
+		case 0:
+			(*pValue) = mSpecializationConstants.textureTransformationFlags_0;
+			break;
+		case 1:
+			(*pValue) = mSpecializationConstants.textureTransformationFlags_1;
+			break;
+		case 2:
+			(*pValue) = mSpecializationConstants.textureTransformationFlags_2;
+			break;
+		case 3:
+			(*pValue) = mSpecializationConstants.textureTransformationFlags_3;
+			break;
+		case 4:
+			(*pValue) = mSpecializationConstants.textureTransformationFlags_4;
+			break;
+		case 5:
+			(*pValue) = mSpecializationConstants.textureTransformationFlags_5;
+			break;
+		case 6:
+			(*pValue) = mSpecializationConstants.textureTransformationFlags_6;
+			break;
+		case 7:
+			(*pValue) = mSpecializationConstants.textureTransformationFlags_7;
+			break;
+		default:
+			break;
+		}
+		break;
+	case D3DTSS_COLORARG0:
+		switch (Stage)
+		{
+		case 0:
+			(*pValue) = mSpecializationConstants.colorArgument0_0;
+			break;
+		case 1:
+			(*pValue) = mSpecializationConstants.colorArgument0_1;
+			break;
+		case 2:
+			(*pValue) = mSpecializationConstants.colorArgument0_2;
+			break;
+		case 3:
+			(*pValue) = mSpecializationConstants.colorArgument0_3;
+			break;
+		case 4:
+			(*pValue) = mSpecializationConstants.colorArgument0_4;
+			break;
+		case 5:
+			(*pValue) = mSpecializationConstants.colorArgument0_5;
+			break;
+		case 6:
+			(*pValue) = mSpecializationConstants.colorArgument0_6;
+			break;
+		case 7:
+			(*pValue) = mSpecializationConstants.colorArgument0_7;
+			break;
+		default:
+			break;
+		}
+		break;
+	case D3DTSS_ALPHAARG0:
+		switch (Stage)
+		{
+		case 0:
+			(*pValue) = mSpecializationConstants.alphaArgument0_0;
+			break;
+		case 1:
+			(*pValue) = mSpecializationConstants.alphaArgument0_1;
+			break;
+		case 2:
+			(*pValue) = mSpecializationConstants.alphaArgument0_2;
+			break;
+		case 3:
+			(*pValue) = mSpecializationConstants.alphaArgument0_3;
+			break;
+		case 4:
+			(*pValue) = mSpecializationConstants.alphaArgument0_4;
+			break;
+		case 5:
+			(*pValue) = mSpecializationConstants.alphaArgument0_5;
+			break;
+		case 6:
+			(*pValue) = mSpecializationConstants.alphaArgument0_6;
+			break;
+		case 7:
+			(*pValue) = mSpecializationConstants.alphaArgument0_7;
+			break;
+		default:
+			break;
+		}
+		break;
+	case D3DTSS_RESULTARG:
+		switch (Stage)
+		{
+		case 0:
+			(*pValue) = mSpecializationConstants.Result_0;
+			break;
+		case 1:
+			(*pValue) = mSpecializationConstants.Result_1;
+			break;
+		case 2:
+			(*pValue) = mSpecializationConstants.Result_2;
+			break;
+		case 3:
+			(*pValue) = mSpecializationConstants.Result_3;
+			break;
+		case 4:
+			(*pValue) = mSpecializationConstants.Result_4;
+			break;
+		case 5:
+			(*pValue) = mSpecializationConstants.Result_5;
+			break;
+		case 6:
+			(*pValue) = mSpecializationConstants.Result_6;
+			break;
+		case 7:
+			(*pValue) = mSpecializationConstants.Result_7;
+			break;
+		default:
+			break;
+		}
+		break;
+	case D3DTSS_CONSTANT:
+		switch (Stage)
+		{
+		case 0:
+			(*pValue) = mRenderStateConstants.Constant_0;
+			break;
+		case 1:
+			(*pValue) = mRenderStateConstants.Constant_1;
+			break;
+		case 2:
+			(*pValue) = mRenderStateConstants.Constant_2;
+			break;
+		case 3:
+			(*pValue) = mRenderStateConstants.Constant_3;
+			break;
+		case 4:
+			(*pValue) = mRenderStateConstants.Constant_4;
+			break;
+		case 5:
+			(*pValue) = mRenderStateConstants.Constant_5;
+			break;
+		case 6:
+			(*pValue) = mRenderStateConstants.Constant_6;
+			break;
+		case 7:
+			(*pValue) = mRenderStateConstants.Constant_7;
+			break;
+		default:
+			break;
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+void DeviceState::GetTransform(D3DTRANSFORMSTATETYPE State, D3DMATRIX* pMatrix) const
+{
+	if (State < TRANSFORM_COUNT && mHasTransforms[State])
+	{
+		(*pMatrix) = mTransforms[State];
+	}
+	else
+	{
+		//Every transform starts out as identity.
+		(*pMatrix) = {};
+		pMatrix->_11 = 1.0f;
+		pMatrix->_22 = 1.0f;
+		pMatrix->_33 = 1.0f;
+		pMatrix->_44 = 1.0f;
+	}
+}
+
+void DeviceState::GetVertexShaderConstantB(UINT StartRegister, BOOL* pConstantData, UINT BoolCount) const
+{
+	auto& slots = mVertexShaderConstantSlots;
+	for (size_t i = 0; i < BoolCount; i++)
+	{
+		pConstantData[i] = slots.BooleanConstants[StartRegister + i];
+	}
+}
+
+void DeviceState::GetVertexShaderConstantF(UINT StartRegister, float* pConstantData, UINT Vector4fCount) const
+{
+	auto& slots = mVertexShaderConstantSlots;
+	const uint32_t pushConstantCount = sizeof(mPushConstants) / sizeof(float);
+	uint32_t startIndex = (StartRegister * 4);
+	uint32_t length = (Vector4fCount * 4);
+	for (size_t i = 0; i < length; i++)
+	{
+		if ((startIndex + i) < pushConstantCount)
+		{
+			pConstantData[i] = mPushConstants[startIndex + i];
+		}
+		else
+		{
+			pConstantData[i] = slots.FloatConstants[startIndex + i];
+		}
+	}
+}
+
+void DeviceState::GetVertexShaderConstantI(UINT StartRegister, int* pConstantData, UINT Vector4iCount) const
+{
+	auto& slots = mVertexShaderConstantSlots;
+	uint32_t startIndex = (StartRegister * 4);
+	uint32_t length = (Vector4iCount * 4);
+	for (size_t i = 0; i < length; i++)
+	{
+		pConstantData[i] = slots.IntegerConstants[startIndex + i];
+	}
+}
@@ -28,11 +28,20 @@ misrepresented as being the original software.
 #include <vulkan/vulkan.hpp>
 
 #include <vector>
+#include <bitset>
 #include <boost/container/small_vector.hpp>
 #include <boost/container/flat_map.hpp>
 
 #include <Eigen/Dense>
 
+#define TRANSFORM_COUNT 512 //D3DTS_WORLDMATRIX(255) is the highest transform state.
+
+//Bits in DeviceState::mChangedTransforms
+#define TRANSFORM_CHANGED_WORLD 1
+#define TRANSFORM_CHANGED_VIEW 2
+#define TRANSFORM_CHANGED_PROJECTION 4
+#define TRANSFORM_CHANGED_ALL 7
+
 class CVertexBuffer9;
 class CVertexDeclaration9;
 class CIndexBuffer9;
@@ -102,6 +111,7 @@ public:
 	~StreamSource();
 };
 
+//The layout matches the uniform block from ShaderConverter::GenerateConstantBuffer so it can be copied into the constant ring as is.
 struct ShaderConstantSlots
 {
 	uint32_t IntegerConstants[16 * 4]; //= { 1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1 };
@@ -119,7 +129,6 @@ struct SpecializationConstants
 	int textureCount = 1;
 
 	//Texture Stage _0
-	int Constant_0 = 0;
 	int Result_0 = D3DTA_CURRENT;
 	int textureTransformationFlags_0 = D3DTTFF_DISABLE;
 	int texureCoordinateIndex_0 = 0;
@@ -131,15 +140,8 @@ struct SpecializationConstants
 	int alphaArgument0_0 = D3DTA_CURRENT;
 	int alphaArgument1_0 = D3DTA_TEXTURE;
 	int alphaArgument2_0 = D3DTA_CURRENT;
-	float bumpMapMatrix00_0 = 0.0f;
-	float bumpMapMatrix01_0 = 0.0f;
-	float bumpMapMatrix10_0 = 0.0f;
-	float bumpMapMatrix11_0 = 0.0f;
-	float bumpMapScale_0 = 0.0f;
-	float bumpMapOffset_0 = 0.0f;
 
 	//Texture Stage _1
-	int Constant_1 = 0;
 	int Result_1 = D3DTA_CURRENT;
 	int textureTransformationFlags_1 = D3DTTFF_DISABLE;
 	int texureCoordinateIndex_1 = 1;
@@ -151,15 +153,8 @@ struct SpecializationConstants
 	int alphaArgument0_1 = D3DTA_CURRENT;
 	int alphaArgument1_1 = D3DTA_TEXTURE;
 	int alphaArgument2_1 = D3DTA_CURRENT;
-	float bumpMapMatrix00_1 = 0.0f;
-	float bumpMapMatrix01_1 = 0.0f;
-	float bumpMapMatrix10_1 = 0.0f;
-	float bumpMapMatrix11_1 = 0.0f;
-	float bumpMapScale_1 = 0.0f;
-	float bumpMapOffset_1 = 0.0f;
 
 	//Texture Stage _2
-	int Constant_2 = 0;
 	int Result_2 = D3DTA_CURRENT;
 	int textureTransformationFlags_2 = D3DTTFF_DISABLE;
 	int texureCoordinateIndex_2 = 2;
@@ -171,15 +166,8 @@ struct SpecializationConstants
 	int alphaArgument0_2 = D3DTA_CURRENT;
 	int alphaArgument1_2 = D3DTA_TEXTURE;
 	int alphaArgument2_2 = D3DTA_CURRENT;
-	float bumpMapMatrix00_2 = 0.0f;
-	float bumpMapMatrix01_2 = 0.0f;
-	float bumpMapMatrix10_2 = 0.0f;
-	float bumpMapMatrix11_2 = 0.0f;
-	float bumpMapScale_2 = 0.0f;
-	float bumpMapOffset_2 = 0.0f;
 
 	//Texture Stage _3
-	int Constant_3 = 0;
 	int Result_3 = D3DTA_CURRENT;
 	int textureTransformationFlags_3 = D3DTTFF_DISABLE;
 	int texureCoordinateIndex_3 = 3;
@@ -191,15 +179,8 @@ struct SpecializationConstants
 	int alphaArgument0_3 = D3DTA_CURRENT;
 	int alphaArgument1_3 = D3DTA_TEXTURE;
 	int alphaArgument2_3 = D3DTA_CURRENT;
-	float bumpMapMatrix00_3 = 0.0f;
-	float bumpMapMatrix01_3 = 0.0f;
-	float bumpMapMatrix10_3 = 0.0f;
-	float bumpMapMatrix11_3 = 0.0f;
-	float bumpMapScale_3 = 0.0f;
-	float bumpMapOffset_3 = 0.0f;
 
 	//Texture Stage _4
-	int Constant_4 = 0;
 	int Result_4 = D3DTA_CURRENT;
 	int textureTransformationFlags_4 = D3DTTFF_DISABLE;
 	int texureCoordinateIndex_4 = 4;
@@ -211,15 +192,8 @@ struct SpecializationConstants
 	int alphaArgument0_4 = D3DTA_CURRENT;
 	int alphaArgument1_4 = D3DTA_TEXTURE;
 	int alphaArgument2_4 = D3DTA_CURRENT;
-	float bumpMapMatrix00_4 = 0.0f;
-	float bumpMapMatrix01_4 = 0.0f;
-	float bumpMapMatrix10_4 = 0.0f;
-	float bumpMapMatrix11_4 = 0.0f;
-	float bumpMapScale_4 = 0.0f;
-	float bumpMapOffset_4 = 0.0f;
 
 	//Texture Stage _5
-	int Constant_5 = 0;
 	int Result_5 = D3DTA_CURRENT;
 	int textureTransformationFlags_5 = D3DTTFF_DISABLE;
 	int texureCoordinateIndex_5 = 5;
@@ -231,15 +205,8 @@ struct SpecializationConstants
 	int alphaArgument0_5 = D3DTA_CURRENT;
 	int alphaArgument1_5 = D3DTA_TEXTURE;
 	int alphaArgument2_5 = D3DTA_CURRENT;
-	float bumpMapMatrix00_5 = 0.0f;
-	float bumpMapMatrix01_5 = 0.0f;
-	float bumpMapMatrix10_5 = 0.0f;
-	float bumpMapMatrix11_5 = 0.0f;
-	float bumpMapScale_5 = 0.0f;
-	float bumpMapOffset_5 = 0.0f;
 
 	//Texture Stage _6
-	int Constant_6 = 0;
 	int Result_6 = D3DTA_CURRENT;
 	int textureTransformationFlags_6 = D3DTTFF_DISABLE;
 	int texureCoordinateIndex_6 = 6;
@@ -251,15 +218,8 @@ struct SpecializationConstants
 	int alphaArgument0_6 = D3DTA_CURRENT;
 	int alphaArgument1_6 = D3DTA_TEXTURE;
 	int alphaArgument2_6 = D3DTA_CURRENT;
-	float bumpMapMatrix00_6 = 0.0f;
-	float bumpMapMatrix01_6 = 0.0f;
-	float bumpMapMatrix10_6 = 0.0f;
-	float bumpMapMatrix11_6 = 0.0f;
-	float bumpMapScale_6 = 0.0f;
-	float bumpMapOffset_6 = 0.0f;
 
 	//Texture Stage _7
-	int Constant_7 = 0;
 	int Result_7 = D3DTA_CURRENT;
 	int textureTransformationFlags_7 = D3DTTFF_DISABLE;
 	int texureCoordinateIndex_7 = 7;
@@ -271,12 +231,6 @@ struct SpecializationConstants
 	int alphaArgument0_7 = D3DTA_CURRENT;
 	int alphaArgument1_7 = D3DTA_TEXTURE;
 	int alphaArgument2_7 = D3DTA_CURRENT;
-	float bumpMapMatrix00_7 = 0.0f;
-	float bumpMapMatrix01_7 = 0.0f;
-	float bumpMapMatrix10_7 = 0.0f;
-	float bumpMapMatrix11_7 = 0.0f;
-	float bumpMapScale_7 = 0.0f;
-	float bumpMapOffset_7 = 0.0f;
 
 	//Render State
 	int zEnable = D3DZB_TRUE;
@@ -289,17 +243,12 @@ struct SpecializationConstants
 	int destinationBlend = D3DBLEND_ZERO;
 	int cullMode = D3DCULL_CCW; // D3DCULL_CW;
 	int zFunction = D3DCMP_LESSEQUAL;
-	int alphaReference = 0;
 	int alphaFunction = D3DCMP_ALWAYS;
 	int ditherEnable = false;
 	int alphaBlendEnable = false;
 	int fogEnable = false;
 	int specularEnable = false;
-	uint32_t fogColor = 0;
 	int fogTableMode = D3DFOG_NONE;
-	float fogStart = 0.0f;
-	float fogEnd = 1.0f;
-	float fogDensity = 1.0f;
 	int rangeFogEnable = false;
 	int stencilEnable = false;
 	int stencilFail = D3DSTENCILOP_KEEP;
@@ -309,7 +258,6 @@ struct SpecializationConstants
 	int stencilReference = 0;
 	uint32_t stencilMask = 0xFFFFFFFF;
 	uint32_t stencilWriteMask = 0xFFFFFFFF;
-	uint32_t textureFactor = 0xFFFFFFFF;
 	int wrap0 = 0;
 	int wrap1 = 0;
 	int wrap2 = 0;
@@ -320,7 +268,6 @@ struct SpecializationConstants
 	int wrap7 = 0;
 	int clipping = true;
 	int lighting = true;
-	uint32_t ambient = 0;
 	int fogVertexMode = D3DFOG_NONE;
 	int colorVertex = true;
 	int localViewer = true;
@@ -331,26 +278,18 @@ struct SpecializationConstants
 	int emissiveMaterialSource = D3DMCS_MATERIAL;
 	int vertexBlend = D3DVBF_DISABLE;
 	int clipPlaneEnable = 0;
-	int pointSize = 64;
-	float pointSizeMinimum = 1.0f;
 	int pointSpriteEnable = false;
 	int pointScaleEnable = false;
-	float pointScaleA = 1.0f;
-	float pointScaleB = 0.0f;
-	float pointScaleC = 0.0f;
 	int multisampleAntiAlias = true;
 	uint32_t multisampleMask = 0xFFFFFFFF;
 	int patchEdgeStyle = D3DPATCHEDGE_DISCRETE;
 	int debugMonitorToken = D3DDMT_ENABLE;
-	float pointSizeMaximum = 64.0f;
 	int indexedVertexBlendEnable = false;
 	int colorWriteEnable = 0x0000000F;
-	float tweenFactor = 0.0f;
 	int blendOperation = D3DBLENDOP_ADD;
 	int positionDegree = D3DDEGREE_CUBIC;
 	int normalDegree = D3DDEGREE_LINEAR;
 	int scissorTestEnable = false;
-	float slopeScaleDepthBias = 0.00f;
 	int antiAliasedLineEnable = false;
 	float minimumTessellationLevel = 1.0f;
 	float maximumTessellationLevel = 1.0f;
@@ -369,7 +308,6 @@ struct SpecializationConstants
 	int colorWriteEnable3 = 0x0000000f;
 	uint32_t blendFactor = 0xffffffff;
 	int srgbWriteEnable = 0;
-	float depthBias = 0.00f;
 	int wrap8 = 0;
 	int wrap9 = 0;
 	int wrap10 = 0;
@@ -384,6 +322,104 @@ struct SpecializationConstants
 	int blendOperationAlpha = D3DBLENDOP_ADD;
 };
 
+/*
+Render & texture stage state that changes from draw to draw without changing which code the fixed function shaders run.
+It is copied into the fixed function arena and read through the render state block (binding 3) so changing it never needs a new pipeline.
+The layout has to match RenderStateBlock in Shaders/Constants. (std140 packs these scalars back to back)
+*/
+struct RenderStateConstants
+{
+	//Texture Stage _0
+	int Constant_0 = 0;
+	float bumpMapMatrix00_0 = 0.0f;
+	float bumpMapMatrix01_0 = 0.0f;
+	float bumpMapMatrix10_0 = 0.0f;
+	float bumpMapMatrix11_0 = 0.0f;
+	float bumpMapScale_0 = 0.0f;
+	float bumpMapOffset_0 = 0.0f;
+
+	//Texture Stage _1
+	int Constant_1 = 0;
+	float bumpMapMatrix00_1 = 0.0f;
+	float bumpMapMatrix01_1 = 0.0f;
+	float bumpMapMatrix10_1 = 0.0f;
+	float bumpMapMatrix11_1 = 0.0f;
+	float bumpMapScale_1 = 0.0f;
+	float bumpMapOffset_1 = 0.0f;
+
+	//Texture Stage _2
+	int Constant_2 = 0;
+	float bumpMapMatrix00_2 = 0.0f;
+	float bumpMapMatrix01_2 = 0.0f;
+	float bumpMapMatrix10_2 = 0.0f;
+	float bumpMapMatrix11_2 = 0.0f;
+	float bumpMapScale_2 = 0.0f;
+	float bumpMapOffset_2 = 0.0f;
+
+	//Texture Stage _3
+	int Constant_3 = 0;
+	float bumpMapMatrix00_3 = 0.0f;
+	float bumpMapMatrix01_3 = 0.0f;
+	float bumpMapMatrix10_3 = 0.0f;
+	float bumpMapMatrix11_3 = 0.0f;
+	float bumpMapScale_3 = 0.0f;
+	float bumpMapOffset_3 = 0.0f;
+
+	//Texture Stage _4
+	int Constant_4 = 0;
+	float bumpMapMatrix00_4 = 0.0f;
+	float bumpMapMatrix01_4 = 0.0f;
+	float bumpMapMatrix10_4 = 0.0f;
+	float bumpMapMatrix11_4 = 0.0f;
+	float bumpMapScale_4 = 0.0f;
+	float bumpMapOffset_4 = 0.0f;
+
+	//Texture Stage _5
+	int Constant_5 = 0;
+	float bumpMapMatrix00_5 = 0.0f;
+	float bumpMapMatrix01_5 = 0.0f;
+	float bumpMapMatrix10_5 = 0.0f;
+	float bumpMapMatrix11_5 = 0.0f;
+	float bumpMapScale_5 = 0.0f;
+	float bumpMapOffset_5 = 0.0f;
+
+	//Texture Stage _6
+	int Constant_6 = 0;
+	float bumpMapMatrix00_6 = 0.0f;
+	float bumpMapMatrix01_6 = 0.0f;
+	float bumpMapMatrix10_6 = 0.0f;
+	float bumpMapMatrix11_6 = 0.0f;
+	float bumpMapScale_6 = 0.0f;
+	float bumpMapOffset_6 = 0.0f;
+
+	//Texture Stage _7
+	int Constant_7 = 0;
+	float bumpMapMatrix00_7 = 0.0f;
+	float bumpMapMatrix01_7 = 0.0f;
+	float bumpMapMatrix10_7 = 0.0f;
+	float bumpMapMatrix11_7 = 0.0f;
+	float bumpMapScale_7 = 0.0f;
+	float bumpMapOffset_7 = 0.0f;
+
+	//Render State
+	int alphaReference = 0;
+	uint32_t fogColor = 0;
+	float fogStart = 0.0f;
+	float fogEnd = 1.0f;
+	float fogDensity = 1.0f;
+	uint32_t textureFactor = 0xFFFFFFFF;
+	uint32_t ambient = 0;
+	int pointSize = 64;
+	float pointSizeMinimum = 1.0f;
+	float pointSizeMaximum = 64.0f;
+	float pointScaleA = 1.0f;
+	float pointScaleB = 0.0f;
+	float pointScaleC = 0.0f;
+	float tweenFactor = 0.0f;
+	float slopeScaleDepthBias = 0.00f;
+	float depthBias = 0.0f;
+};
+
 struct RealIndexBuffer;
 
 struct DeviceState
@@ -527,6 +563,8 @@ struct DeviceState
 
 	//IDirect3DDevice9::SetSamplerState
 	boost::container::flat_map<DWORD, boost::container::flat_map<D3DSAMPLERSTATETYPE, DWORD> > mSamplerStates;
+	uint32_t mSamplerStateDirtyMask = 0xFFFFFFFF; //One bit per stage, cleared when the stage's packed sampler state is rebuilt.
+	uint64_t mSamplerStateKeys[16] = {}; //See SamplerRequest::GetStateKey
 
 	//IDirect3DDevice9::SetScissorRect
 	RECT m9Scissor = {};
@@ -544,8 +582,9 @@ struct DeviceState
 	//boost::container::flat_map<DWORD, boost::container::flat_map<D3DTEXTURESTAGESTATETYPE, DWORD> > mTextureStageStates;
 
 	//IDirect3DDevice9::SetTransform
-	boost::container::flat_map<D3DTRANSFORMSTATETYPE, D3DMATRIX> mTransforms;
-	BOOL mHasTransformsChanged = true;
+	D3DMATRIX mTransforms[TRANSFORM_COUNT] = {}; //Indexed by D3DTRANSFORMSTATETYPE. Only the ones set in mHasTransforms are valid, the rest are identity.
+	std::bitset<TRANSFORM_COUNT> mHasTransforms;
+	uint32_t mChangedTransforms = TRANSFORM_CHANGED_ALL; //The fixed function matrices that have to be reloaded before the next draw.
 
 	//IDirect3DDevice9::SetViewport
 	D3DVIEWPORT9 m9Viewport = {};
@@ -565,14 +604,75 @@ struct DeviceState
 
 	//Used for shader specialization.
 	SpecializationConstants mSpecializationConstants = {};
+	RenderStateConstants mRenderStateConstants = {};
 
 	float mPushConstants[64] = {};
 	ShaderConstantSlots mVertexShaderConstantSlots;
 	ShaderConstantSlots mPixelShaderConstantSlots;
 
+	/*
+	Running hashes of the state above that goes into pipeline creation.
+	The set handlers patch these one word at a time so a draw only has to probe the pipeline cache.
+	If the state is replaced wholesale (state blocks) set the dirty flag and the next draw will rebuild them.
+	*/
+	uint64_t mSpecializationConstantsHash = 0;
+	uint64_t mVertexShaderConstantSlotsHash = 0;
+	uint64_t mPixelShaderConstantSlotsHash = 0;
+	BOOL mArePipelineHashesDirty = true;
+
+	//Set when anything in mRenderStateConstants changes so the next fixed function draw writes a new render state block.
+	BOOL mIsRenderStateDirty = true;
+
+	/*
+	When shader constants come from the constant ring the set handlers only flag the block as dirty and grow the written size.
+	Only the first mXShaderConstantsSize bytes of a block are copied into the ring because nothing past that has ever been set.
+	*/
+	BOOL mAreVertexShaderConstantsDirty = true;
+	BOOL mArePixelShaderConstantsDirty = true;
+	uint32_t mVertexShaderConstantsSize = 0;
+	uint32_t mPixelShaderConstantsSize = 0;
+
 	//ConvertedShader mConvertedVertexShader = {};
 	//ConvertedShader mConvertedPixelShader = {};
 
+	/*
+	The command stream applies D3D9 calls to the window state through these and CDevice9 applies the same calls to its shadow copy.
+	Anything that needs a Vulkan object (index buffers, shader AddRef/Release) stays in the command stream handlers.
+	*/
+	void SetDefaults();
+	void LightEnable(DWORD LightIndex, BOOL bEnable);
+	void SetFVF(DWORD FVF);
+	void SetLight(DWORD Index, const D3DLIGHT9* pLight);
+	void SetMaterial(const D3DMATERIAL9* pMaterial);
+	void SetNPatchMode(float nSegments);
+	void SetPixelShader(CPixelShader9* pShader);
+	void SetPixelShaderConstantB(UINT StartRegister, const BOOL* pConstantData, UINT BoolCount);
+	void SetPixelShaderConstantF(UINT StartRegister, const float* pConstantData, UINT Vector4fCount);
+	void SetPixelShaderConstantI(UINT StartRegister, const int* pConstantData, UINT Vector4iCount);
+	void SetRenderState(D3DRENDERSTATETYPE State, DWORD Value);
+	void SetSamplerState(DWORD Sampler, D3DSAMPLERSTATETYPE Type, DWORD Value);
+	void SetScissorRect(const RECT* pRect);
+	void SetStreamSource(UINT StreamNumber, CVertexBuffer9* pStreamData, UINT OffsetInBytes, UINT Stride);
+	void SetTexture(DWORD Sampler, IDirect3DBaseTexture9* pTexture);
+	void SetTextureStageState(DWORD Stage, D3DTEXTURESTAGESTATETYPE Type, DWORD Value);
+	void SetTransform(D3DTRANSFORMSTATETYPE State, const D3DMATRIX* pMatrix);
+	void SetVertexDeclaration(CVertexDeclaration9* pDecl);
+	void SetVertexShader(CVertexShader9* pShader);
+	void SetVertexShaderConstantB(UINT StartRegister, const BOOL* pConstantData, UINT BoolCount);
+	void SetVertexShaderConstantF(UINT StartRegister, const float* pConstantData, UINT Vector4fCount, bool useConstantBuffer);
+	void SetVertexShaderConstantI(UINT StartRegister, const int* pConstantData, UINT Vector4iCount);
+	void SetViewport(const D3DVIEWPORT9* pViewport);
+
+	void GetLight(DWORD Index, D3DLIGHT9* pLight) const;
+	void GetPixelShaderConstantB(UINT StartRegister, BOOL* pConstantData, UINT BoolCount) const;
+	void GetPixelShaderConstantF(UINT StartRegister, float* pConstantData, UINT Vector4fCount) const;
+	void GetPixelShaderConstantI(UINT StartRegister, int* pConstantData, UINT Vector4iCount) const;
+	void GetRenderState(D3DRENDERSTATETYPE State, DWORD* pValue) const;
+	void GetTextureStageState(DWORD Stage, D3DTEXTURESTAGESTATETYPE Type, DWORD* pValue) const;
+	void GetTransform(D3DTRANSFORMSTATETYPE State, D3DMATRIX* pMatrix) const;
+	void GetVertexShaderConstantB(UINT StartRegister, BOOL* pConstantData, UINT BoolCount) const;
+	void GetVertexShaderConstantF(UINT StartRegister, float* pConstantData, UINT Vector4fCount) const;
+	void GetVertexShaderConstantI(UINT StartRegister, int* pConstantData, UINT Vector4iCount) const;
 };
 
 struct color_A8R8G8B8
@@ -0,0 +1,151 @@
+/*
+Copyright(c) 2018 Christopher Joseph Dean Schaefer
+
+This software is provided 'as-is', without any express or implied
+warranty.In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions :
+
+1. The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software.If you use this software
+in a product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include "Perf_CommandRing.h"
+
+#include <malloc.h>
+
+#include <boost/log/core.hpp>
+#include <boost/log/trivial.hpp>
+
+CommandRing::~CommandRing()
+{
+	if (mBuffer != nullptr)
+	{
+		_aligned_free(mBuffer);
+		mBuffer = nullptr;
+	}
+}
+
+void CommandRing::Allocate(size_t size)
+{
+	//Kept big enough that a full set of float constants never has to take the heap path in GetWorkItem.
+	size_t ringSize = 65536;
+	while (ringSize < size)
+	{
+		ringSize <<= 1;
+	}
+
+	mBuffer = (char*)_aligned_malloc(ringSize, 64);
+	if (mBuffer == nullptr)
+	{
+		BOOST_LOG_TRIVIAL(fatal) << "CommandRing::Allocate failed to allocate " << ringSize << " bytes.";
+		return;
+	}
+
+	mSize = ringSize;
+	mMask = ringSize - 1;
+
+	BOOST_LOG_TRIVIAL(info) << "CommandRing::Allocate using " << ringSize << " bytes.";
+}
+
+size_t CommandRing::GetCommandSize(size_t size) const
+{
+	return (sizeof(CommandHeader) + size + alignof(CommandHeader) - 1) & ~(alignof(CommandHeader) - 1);
+}
+
+/*
+A command is only guaranteed to fit once the ring drains if it can't be pushed past the end by padding.
+That holds for anything up to half the ring, bigger commands can wait forever depending on where the write position is.
+*/
+bool CommandRing::IsOversized(size_t size) const
+{
+	return GetCommandSize(size) > mSize / 2;
+}
+
+void* CommandRing::Reserve(size_t size)
+{
+	size_t commandSize = GetCommandSize(size);
+	size_t offset = mWritePosition & mMask;
+	size_t padding = (offset + commandSize > mSize) ? (mSize - offset) : 0;
+
+	if (mWritePosition + padding + commandSize - mCachedReadPosition > mSize)
+	{
+		mCachedReadPosition = mReadPosition.load(std::memory_order_acquire);
+		if (mWritePosition + padding + commandSize - mCachedReadPosition > mSize)
+		{
+			return nullptr;
+		}
+	}
+
+	if (padding)
+	{
+		CommandHeader* paddingHeader = (CommandHeader*)(mBuffer + offset);
+		paddingHeader->Size = (uint32_t)padding;
+		paddingHeader->IsPadding = 1;
+		mWritePosition += padding;
+		offset = 0;
+	}
+
+	CommandHeader* header = (CommandHeader*)(mBuffer + offset);
+	header->Size = (uint32_t)commandSize;
+	header->IsPadding = 0;
+	mWritePosition += commandSize;
+
+	return header + 1;
+}
+
+bool CommandRing::Publish()
+{
+	if (mPublishedPosition.load(std::memory_order_relaxed) == mWritePosition)
+	{
+		return false;
+	}
+
+	mPublishedPosition.store(mWritePosition, std::memory_order_release);
+
+	return true;
+}
+
+void* CommandRing::Peek()
+{
+	for (;;)
+	{
+		if (mConsumerPosition == mCachedPublishedPosition)
+		{
+			mCachedPublishedPosition = mPublishedPosition.load(std::memory_order_acquire);
+			if (mConsumerPosition == mCachedPublishedPosition)
+			{
+				return nullptr;
+			}
+		}
+
+		CommandHeader* header = (CommandHeader*)(mBuffer + (mConsumerPosition & mMask));
+		if (!header->IsPadding)
+		{
+			return header + 1;
+		}
+
+		mConsumerPosition += header->Size;
+		mReadPosition.store(mConsumerPosition, std::memory_order_release);
+	}
+}
+
+void CommandRing::Pop()
+{
+	CommandHeader* header = (CommandHeader*)(mBuffer + (mConsumerPosition & mMask));
+	mConsumerPosition += header->Size;
+	mReadPosition.store(mConsumerPosition, std::memory_order_release);
+}
+
+bool CommandRing::IsEmpty() const
+{
+	return mConsumerPosition == mPublishedPosition.load(std::memory_order_acquire);
+}
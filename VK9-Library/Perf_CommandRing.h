@@ -0,0 +1,85 @@
+/*
+Copyright(c) 2018 Christopher Joseph Dean Schaefer
+
+This software is provided 'as-is', without any express or implied
+warranty.In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions :
+
+1. The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software.If you use this software
+in a product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include <atomic>
+#include <mutex>
+#include <cstdint>
+#include <cstddef>
+
+#ifndef COMMANDRING_H
+#define COMMANDRING_H
+
+/*
+Every command starts on a header boundary so whatever is placed after the header is suitably aligned.
+A command that would run past the end of the buffer is preceded by a padding command that fills the rest of it.
+*/
+struct alignas(16) CommandHeader
+{
+	uint32_t Size = 0; //Includes the header.
+	uint32_t IsPadding = 0;
+};
+
+/*
+Single consumer ring of variable sized commands.
+The producer reserves commands in place and they only become visible to the consumer when it publishes.
+Reserve & Publish aren't thread safe so any thread that produces holds mProducerMutex from Reserve until the command is filled and published.
+The consumer reads commands straight out of the buffer and hands the space back one command at a time.
+Positions only ever grow and are masked into the buffer so they can wrap without any special handling.
+*/
+struct CommandRing
+{
+	char* mBuffer = nullptr;
+	size_t mSize = 0; //Always a power of two.
+	size_t mMask = 0;
+
+	//Producer side.
+	std::recursive_mutex mProducerMutex;
+	alignas(64) size_t mWritePosition = 0;
+	size_t mCachedReadPosition = 0; //Only refreshed when the ring looks full.
+
+	//Consumer side.
+	alignas(64) size_t mConsumerPosition = 0;
+	size_t mCachedPublishedPosition = 0; //Only refreshed when the ring looks empty.
+
+	//Shared, kept on their own cache lines so each side only pulls in the other's line when it has to.
+	alignas(64) std::atomic_size_t mPublishedPosition = 0;
+	alignas(64) std::atomic_size_t mReadPosition = 0;
+
+	CommandRing() = default;
+	~CommandRing();
+
+	CommandRing(const CommandRing&) = delete;
+	CommandRing& operator=(const CommandRing&) = delete;
+
+	void Allocate(size_t size);
+	size_t GetCommandSize(size_t size) const;
+	bool IsOversized(size_t size) const;
+
+	//Producer
+	void* Reserve(size_t size);
+	bool Publish();
+
+	//Consumer
+	void* Peek();
+	void Pop();
+	bool IsEmpty() const;
+};
+
+#endif // COMMANDRING_H
@@ -39,14 +39,41 @@ misrepresented as being the original software.
 #include "CCubeTexture9.h"
 #include "CSurface9.h"
 
+WorkerWaitStrategy ConvertWorkerWaitStrategy(const std::string& strategy)
+{
+	if (strategy == "Spin")
+	{
+		return WorkerWaitStrategy_Spin;
+	}
+	else if (strategy == "Yield")
+	{
+		return WorkerWaitStrategy_Yield;
+	}
+	else if (strategy == "Park")
+	{
+		return WorkerWaitStrategy_Park;
+	}
+
+	BOOST_LOG_TRIVIAL(warning) << "ConvertWorkerWaitStrategy unknown strategy " << strategy << " using Park instead.";
+	return WorkerWaitStrategy_Park;
+}
+
 void ProcessQueue(CommandStreamManager* commandStreamManager)
 {
-	Sleep(100);
-	while (commandStreamManager->IsRunning)
+	for (;;)
 	{
-		WorkItem* workItem = nullptr;
+		WorkItem* workItem = commandStreamManager->GetNextWorkItem();
 
-		if (commandStreamManager->mWorkItems.try_dequeue(workItem))
+		if (workItem == nullptr)
+		{
+			//Whatever was published before shutdown is drained first so destroy requests aren't lost.
+			if (!commandStreamManager->IsRunning)
+			{
+				break;
+			}
+			commandStreamManager->WaitForWork();
+		}
+		else
 		{
 			//try
 			//{
@@ -130,6 +157,7 @@ void ProcessQueue(CommandStreamManager* commandStreamManager)
 				case Shader_Destroy:
 				{
 					commandStreamManager->mRenderManager.mStateManager.DestroyShader(workItem->Id);
+					delete[] (DWORD*)workItem->Argument1; //Freed here because the create may still have been queued when the shader was released.
 				}
 				break;
 				case Device_Clear:
@@ -226,2559 +254,277 @@ void ProcessQueue(CommandStreamManager* commandStreamManager)
 					}
 				}
 				break;
-				case Device_GetFVF:
+				case Device_LightEnable:
 				{
-					DWORD* pFVF = bit_cast<DWORD*>(workItem->Argument1);
 					auto& realWindow = (*commandStreamManager->mRenderManager.mStateManager.mWindows[workItem->Id]);
+					DWORD LightIndex = bit_cast<DWORD>(workItem->Argument1);
+					BOOL bEnable = bit_cast<BOOL>(workItem->Argument2);
 
-					(*pFVF) = realWindow.mDeviceState.mFVF;
+					if (realWindow.mCurrentStateRecording != nullptr)
+					{
+						realWindow.mCurrentStateRecording->mDeviceState.LightEnable(LightIndex, bEnable);
+					}
+					else
+					{
+						realWindow.mDeviceState.LightEnable(LightIndex, bEnable);
+						realWindow.mBindings.DirtyFlags |= BINDING_FLAG(BindingType_Descriptors);
+					}
 				}
 				break;
-				case Device_GetLight:
+				case Device_SetFVF:
 				{
 					auto& realWindow = (*commandStreamManager->mRenderManager.mStateManager.mWindows[workItem->Id]);
-					DWORD Index = bit_cast<DWORD>(workItem->Argument1);
-					D3DLIGHT9* pLight = bit_cast<D3DLIGHT9*>(workItem->Argument2);
-					auto& light = realWindow.mDeviceState.mLights[Index];
-
-					pLight->Type = (*(D3DLIGHTTYPE*)light.Type);
-					pLight->Diffuse = (*(D3DCOLORVALUE*)light.Diffuse);
-					pLight->Specular = (*(D3DCOLORVALUE*)light.Specular);
-					pLight->Ambient = (*(D3DCOLORVALUE*)light.Ambient);
+					DWORD FVF = bit_cast<DWORD>(workItem->Argument1);
 
-					pLight->Position = (*(D3DVECTOR*)light.Position);
-					pLight->Direction = (*(D3DVECTOR*)light.Direction);
+					if (realWindow.mCurrentStateRecording != nullptr)
+					{
+						realWindow.mCurrentStateRecording->mDeviceState.SetFVF(FVF);
+					}
+					else
+					{
+						realWindow.mDeviceState.SetFVF(FVF);
+					}
+				}
+				break;
+				case Device_SetIndices:
+				{
+					auto& realWindow = (*commandStreamManager->mRenderManager.mStateManager.mWindows[workItem->Id]);
+					IDirect3DIndexBuffer9* pIndexData = bit_cast<IDirect3DIndexBuffer9*>(workItem->Argument1);
+					DeviceState* state = nullptr;
+					if (realWindow.mCurrentStateRecording != nullptr)
+					{
+						state = &realWindow.mCurrentStateRecording->mDeviceState;
+					}
+					else
+					{
+						state = &realWindow.mDeviceState;
+						realWindow.mBindings.DirtyFlags |= BINDING_FLAG(BindingType_IndexBuffer);
+					}
+					
+					if (pIndexData!=nullptr)
+					{
+						auto realIndex = commandStreamManager->mRenderManager.mStateManager.mIndexBuffers[((CIndexBuffer9*)pIndexData)->mId];
 
-					pLight->Range = light.Range;
-					pLight->Falloff = light.Falloff;
-					pLight->Attenuation0 = light.Attenuation0;
-					pLight->Attenuation1 = light.Attenuation1;
-					pLight->Attenuation2 = light.Attenuation2;
-					pLight->Theta = light.Theta;
-					pLight->Phi = light.Phi;
+						state->mIndexBuffer = realIndex.get();
+						state->mHasIndexBuffer = true;
+					}
+					else
+					{
+						state->mIndexBuffer = nullptr;
+						state->mHasIndexBuffer = false;
+					}
 				}
 				break;
-				case Device_GetLightEnable:
+				case Device_SetLight:
 				{
 					auto& realWindow = (*commandStreamManager->mRenderManager.mStateManager.mWindows[workItem->Id]);
 					DWORD Index = bit_cast<DWORD>(workItem->Argument1);
-					BOOL* pEnable = bit_cast<BOOL*>(workItem->Argument2);
+					D3DLIGHT9* pLight = bit_cast<D3DLIGHT9*>(workItem->Argument2);
 
-					(*pEnable) = realWindow.mDeviceState.mLights[Index].IsEnabled;
+					if (realWindow.mCurrentStateRecording != nullptr)
+					{
+						realWindow.mCurrentStateRecording->mDeviceState.SetLight(Index, pLight);
+					}
+					else
+					{
+						realWindow.mDeviceState.SetLight(Index, pLight);
+						realWindow.mBindings.DirtyFlags |= BINDING_FLAG(BindingType_Descriptors);
+					}
 				}
 				break;
-				case Device_GetMaterial:
+				case Device_SetMaterial:
 				{
 					auto& realWindow = (*commandStreamManager->mRenderManager.mStateManager.mWindows[workItem->Id]);
 					D3DMATERIAL9* pMaterial = bit_cast<D3DMATERIAL9*>(workItem->Argument1);
 
-					(*pMaterial) = realWindow.mDeviceState.mMaterial;
+					if (realWindow.mCurrentStateRecording != nullptr)
+					{
+						realWindow.mCurrentStateRecording->mDeviceState.SetMaterial(pMaterial);
+					}
+					else
+					{
+						realWindow.mDeviceState.SetMaterial(pMaterial);
+					}
 				}
 				break;
-				case Device_GetNPatchMode:
+				case Device_SetNPatchMode:
 				{
 					auto& realWindow = (*commandStreamManager->mRenderManager.mStateManager.mWindows[workItem->Id]);
-					FLOAT* output = bit_cast<FLOAT*>(workItem->Argument1);
+					float nSegments = bit_cast<float>(workItem->Argument1);
 
-					(*output) = realWindow.mDeviceState.mNSegments;
+					if (realWindow.mCurrentStateRecording != nullptr)
+					{
+						realWindow.mCurrentStateRecording->mDeviceState.SetNPatchMode(nSegments);
+					}
+					else
+					{
+						realWindow.mDeviceState.SetNPatchMode(nSegments);
+					}
 				}
 				break;
-				case Device_GetPixelShader:
+				case Device_SetPixelShader:
 				{
 					auto& realWindow = (*commandStreamManager->mRenderManager.mStateManager.mWindows[workItem->Id]);
-					IDirect3DPixelShader9** ppShader = bit_cast<IDirect3DPixelShader9**>(workItem->Argument1);
+					IDirect3DPixelShader9* pShader = bit_cast<IDirect3DPixelShader9*>(workItem->Argument1);
+
+					//The reference was added by CDevice9::SetPixelShader so the shader can't go away while the call is queued.
+					if (realWindow.mCurrentStateRecording != nullptr)
+					{
+						realWindow.mCurrentStateRecording->mDeviceState.SetPixelShader((CPixelShader9*)pShader);
+					}
+					else
+					{
+						if (realWindow.mDeviceState.mPixelShader != nullptr)
+						{
+							realWindow.mDeviceState.mPixelShader->Release();
+						}
 
-					(*ppShader) = (IDirect3DPixelShader9*)realWindow.mDeviceState.mPixelShader;
+						realWindow.mDeviceState.SetPixelShader((CPixelShader9*)pShader);
+					}
 				}
 				break;
-				case Device_GetPixelShaderConstantB:
+				case Device_SetPixelShaderConstantB:
 				{
 					auto& realWindow = (*commandStreamManager->mRenderManager.mStateManager.mWindows[workItem->Id]);
 					UINT StartRegister = bit_cast<UINT>(workItem->Argument1);
 					BOOL* pConstantData = bit_cast<BOOL*>(workItem->Argument2);
 					UINT BoolCount = bit_cast<UINT>(workItem->Argument3);
 
-					auto& slots = realWindow.mDeviceState.mPixelShaderConstantSlots;
-					for (size_t i = 0; i < BoolCount; i++)
-					{
-						pConstantData[i] = slots.BooleanConstants[StartRegister + i];
-					}
+					realWindow.mDeviceState.SetPixelShaderConstantB(StartRegister, pConstantData, BoolCount);
 				}
 				break;
-				case Device_GetPixelShaderConstantF:
+				case Device_SetPixelShaderConstantF:
 				{
 					auto& realWindow = (*commandStreamManager->mRenderManager.mStateManager.mWindows[workItem->Id]);
 					UINT StartRegister = bit_cast<UINT>(workItem->Argument1);
 					float* pConstantData = bit_cast<float*>(workItem->Argument2);
 					UINT Vector4fCount = bit_cast<UINT>(workItem->Argument3);
 
-					auto& slots = realWindow.mDeviceState.mPixelShaderConstantSlots;
-					uint32_t startIndex = (StartRegister * 4);
-					uint32_t length = (Vector4fCount * 4);
-					for (size_t i = 0; i < length; i++)
-					{
-						pConstantData[i] = slots.FloatConstants[startIndex + i];
-					}
+					realWindow.mDeviceState.SetPixelShaderConstantF(StartRegister, pConstantData, Vector4fCount);
 				}
 				break;
-				case Device_GetPixelShaderConstantI:
+				case Device_SetPixelShaderConstantI:
 				{
 					auto& realWindow = (*commandStreamManager->mRenderManager.mStateManager.mWindows[workItem->Id]);
 					UINT StartRegister = bit_cast<UINT>(workItem->Argument1);
 					int* pConstantData = bit_cast<int*>(workItem->Argument2);
 					UINT Vector4iCount = bit_cast<UINT>(workItem->Argument3);
 
-					auto& slots = realWindow.mDeviceState.mPixelShaderConstantSlots;
-					uint32_t startIndex = (StartRegister * 4);
-					uint32_t length = (Vector4iCount * 4);
-					for (size_t i = 0; i < length; i++)
-					{
-						pConstantData[i] = slots.IntegerConstants[startIndex + i];
-					}
+					realWindow.mDeviceState.SetPixelShaderConstantI(StartRegister, pConstantData, Vector4iCount);
 				}
 				break;
-				case Device_GetRenderState:
+				case Device_SetRenderState:
 				{
 					auto& realWindow = (*commandStreamManager->mRenderManager.mStateManager.mWindows[workItem->Id]);
 					D3DRENDERSTATETYPE State = bit_cast<D3DRENDERSTATETYPE>(workItem->Argument1);
-					DWORD* pValue = bit_cast<DWORD*>(workItem->Argument2);
-
-					SpecializationConstants* constants = nullptr;
+					DWORD Value = bit_cast<DWORD>(workItem->Argument2);
 
 					if (realWindow.mCurrentStateRecording != nullptr)
 					{
-						constants = &realWindow.mCurrentStateRecording->mDeviceState.mSpecializationConstants;
+						realWindow.mCurrentStateRecording->mDeviceState.SetRenderState(State, Value);
 					}
 					else
 					{
-						constants = &realWindow.mDeviceState.mSpecializationConstants;
-					}
-
-					switch (State)
-					{
-					case D3DRS_ZENABLE:
-						(*pValue) = constants->zEnable;
-						break;
-					case D3DRS_FILLMODE:
-						(*pValue) = constants->fillMode;
-						break;
-					case D3DRS_SHADEMODE:
-						(*pValue) = constants->shadeMode;
-						break;
-					case D3DRS_ZWRITEENABLE:
-						(*pValue) = constants->zWriteEnable;
-						break;
-					case D3DRS_ALPHATESTENABLE:
-						(*pValue) = constants->alphaTestEnable;
-						break;
-					case D3DRS_LASTPIXEL:
-						(*pValue) = constants->lastPixel;
-						break;
-					case D3DRS_SRCBLEND:
-						(*pValue) = constants->sourceBlend;
-						break;
-					case D3DRS_DESTBLEND:
-						(*pValue) = constants->destinationBlend;
-						break;
-					case D3DRS_CULLMODE:
-						(*pValue) = constants->cullMode;
-						break;
-					case D3DRS_ZFUNC:
-						(*pValue) = constants->zFunction;
-						break;
-					case D3DRS_ALPHAREF:
-						(*pValue) = constants->alphaReference;
-						break;
-					case D3DRS_ALPHAFUNC:
-						(*pValue) = constants->alphaFunction;
-						break;
-					case D3DRS_DITHERENABLE:
-						(*pValue) = constants->ditherEnable;
-						break;
-					case D3DRS_ALPHABLENDENABLE:
-						(*pValue) = constants->alphaBlendEnable;
-						break;
-					case D3DRS_FOGENABLE:
-						(*pValue) = constants->fogEnable;
-						break;
-					case D3DRS_SPECULARENABLE:
-						(*pValue) = constants->specularEnable;
-						break;
-					case D3DRS_FOGCOLOR:
-						(*pValue) = constants->fogColor;
-						break;
-					case D3DRS_FOGTABLEMODE:
-						(*pValue) = constants->fogTableMode;
-						break;
-					case D3DRS_FOGSTART:
-						(*pValue) = bit_cast(constants->fogStart);
-						break;
-					case D3DRS_FOGEND:
-						(*pValue) = bit_cast(constants->fogEnd);
-						break;
-					case D3DRS_FOGDENSITY:
-						(*pValue) = bit_cast(constants->fogDensity);
-						break;
-					case D3DRS_RANGEFOGENABLE:
-						(*pValue) = constants->rangeFogEnable;
-						break;
-					case D3DRS_STENCILENABLE:
-						(*pValue) = constants->stencilEnable;
-						break;
-					case D3DRS_STENCILFAIL:
-						(*pValue) = constants->stencilFail;
-						break;
-					case D3DRS_STENCILZFAIL:
-						(*pValue) = constants->stencilZFail;
-						break;
-					case D3DRS_STENCILPASS:
-						(*pValue) = constants->stencilPass;
-						break;
-					case D3DRS_STENCILFUNC:
-						(*pValue) = constants->stencilFunction;
-						break;
-					case D3DRS_STENCILREF:
-						(*pValue) = constants->stencilReference;
-						break;
-					case D3DRS_STENCILMASK:
-						(*pValue) = constants->stencilMask;
-						break;
-					case D3DRS_STENCILWRITEMASK:
-						(*pValue) = constants->stencilWriteMask;
-						break;
-					case D3DRS_TEXTUREFACTOR:
-						(*pValue) = constants->textureFactor;
-						break;
-					case D3DRS_WRAP0:
-						(*pValue) = constants->wrap0;
-						break;
-					case D3DRS_WRAP1:
-						(*pValue) = constants->wrap1;
-						break;
-					case D3DRS_WRAP2:
-						(*pValue) = constants->wrap2;
-						break;
-					case D3DRS_WRAP3:
-						(*pValue) = constants->wrap3;
-						break;
-					case D3DRS_WRAP4:
-						(*pValue) = constants->wrap4;
-						break;
-					case D3DRS_WRAP5:
-						(*pValue) = constants->wrap5;
-						break;
-					case D3DRS_WRAP6:
-						(*pValue) = constants->wrap6;
-						break;
-					case D3DRS_WRAP7:
-						(*pValue) = constants->wrap7;
-						break;
-					case D3DRS_CLIPPING:
-						(*pValue) = constants->clipping;
-						break;
-					case D3DRS_LIGHTING:
-						(*pValue) = constants->lighting;
-						break;
-					case D3DRS_AMBIENT:
-						(*pValue) = constants->ambient;
-						break;
-					case D3DRS_FOGVERTEXMODE:
-						(*pValue) = constants->fogVertexMode;
-						break;
-					case D3DRS_COLORVERTEX:
-						(*pValue) = constants->colorVertex;
-						break;
-					case D3DRS_LOCALVIEWER:
-						(*pValue) = constants->localViewer;
-						break;
-					case D3DRS_NORMALIZENORMALS:
-						(*pValue) = constants->normalizeNormals;
-						break;
-					case D3DRS_DIFFUSEMATERIALSOURCE:
-						(*pValue) = constants->diffuseMaterialSource;
-						break;
-					case D3DRS_SPECULARMATERIALSOURCE:
-						(*pValue) = constants->specularMaterialSource;
-						break;
-					case D3DRS_AMBIENTMATERIALSOURCE:
-						(*pValue) = constants->ambientMaterialSource;
-						break;
-					case D3DRS_EMISSIVEMATERIALSOURCE:
-						(*pValue) = constants->emissiveMaterialSource;
-						break;
-					case D3DRS_VERTEXBLEND:
-						(*pValue) = constants->vertexBlend;
-						break;
-					case D3DRS_CLIPPLANEENABLE:
-						(*pValue) = constants->clipPlaneEnable;
-						break;
-					case D3DRS_POINTSIZE:
-						(*pValue) = constants->pointSize;
-						break;
-					case D3DRS_POINTSIZE_MIN:
-						(*pValue) = bit_cast(constants->pointSizeMinimum);
-						break;
-					case D3DRS_POINTSPRITEENABLE:
-						(*pValue) = constants->pointSpriteEnable;
-						break;
-					case D3DRS_POINTSCALEENABLE:
-						(*pValue) = constants->pointScaleEnable;
-						break;
-					case D3DRS_POINTSCALE_A:
-						(*pValue) = bit_cast(constants->pointScaleA);
-						break;
-					case D3DRS_POINTSCALE_B:
-						(*pValue) = bit_cast(constants->pointScaleB);
-						break;
-					case D3DRS_POINTSCALE_C:
-						(*pValue) = bit_cast(constants->pointScaleC);
-						break;
-					case D3DRS_MULTISAMPLEANTIALIAS:
-						(*pValue) = constants->multisampleAntiAlias;
-						break;
-					case D3DRS_MULTISAMPLEMASK:
-						(*pValue) = constants->multisampleMask;
-						break;
-					case D3DRS_PATCHEDGESTYLE:
-						(*pValue) = constants->patchEdgeStyle;
-						break;
-					case D3DRS_DEBUGMONITORTOKEN:
-						(*pValue) = constants->debugMonitorToken;
-						break;
-					case D3DRS_POINTSIZE_MAX:
-						(*pValue) = bit_cast(constants->pointSizeMaximum);
-						break;
-					case D3DRS_INDEXEDVERTEXBLENDENABLE:
-						(*pValue) = constants->indexedVertexBlendEnable;
-						break;
-					case D3DRS_COLORWRITEENABLE:
-						(*pValue) = constants->colorWriteEnable;
-						break;
-					case D3DRS_TWEENFACTOR:
-						(*pValue) = bit_cast(constants->tweenFactor);
-						break;
-					case D3DRS_BLENDOP:
-						(*pValue) = constants->blendOperation;
-						break;
-					case D3DRS_POSITIONDEGREE:
-						(*pValue) = constants->positionDegree;
-						break;
-					case D3DRS_NORMALDEGREE:
-						(*pValue) = constants->normalDegree;
-						break;
-					case D3DRS_SCISSORTESTENABLE:
-						(*pValue) = constants->scissorTestEnable;
-						break;
-					case D3DRS_SLOPESCALEDEPTHBIAS:
-						(*pValue) = bit_cast(constants->slopeScaleDepthBias);
-						break;
-					case D3DRS_ANTIALIASEDLINEENABLE:
-						(*pValue) = constants->antiAliasedLineEnable;
-						break;
-					case D3DRS_MINTESSELLATIONLEVEL:
-						(*pValue) = bit_cast(constants->minimumTessellationLevel);
-						break;
-					case D3DRS_MAXTESSELLATIONLEVEL:
-						(*pValue) = bit_cast(constants->maximumTessellationLevel);
-						break;
-					case D3DRS_ADAPTIVETESS_X:
-						(*pValue) = bit_cast(constants->adaptivetessX);
-						break;
-					case D3DRS_ADAPTIVETESS_Y:
-						(*pValue) = bit_cast(constants->adaptivetessY);
-						break;
-					case D3DRS_ADAPTIVETESS_Z:
-						(*pValue) = bit_cast(constants->adaptivetessZ);
-						break;
-					case D3DRS_ADAPTIVETESS_W:
-						(*pValue) = bit_cast(constants->adaptivetessW);
-						break;
-					case D3DRS_ENABLEADAPTIVETESSELLATION:
-						(*pValue) = constants->enableAdaptiveTessellation;
-						break;
-					case D3DRS_TWOSIDEDSTENCILMODE:
-						(*pValue) = constants->twoSidedStencilMode;
-						break;
-					case D3DRS_CCW_STENCILFAIL:
-						(*pValue) = constants->ccwStencilFail;
-						break;
-					case D3DRS_CCW_STENCILZFAIL:
-						(*pValue) = constants->ccwStencilZFail;
-						break;
-					case D3DRS_CCW_STENCILPASS:
-						(*pValue) = constants->ccwStencilPass;
-						break;
-					case D3DRS_CCW_STENCILFUNC:
-						(*pValue) = constants->ccwStencilFunction;
-						break;
-					case D3DRS_COLORWRITEENABLE1:
-						(*pValue) = constants->colorWriteEnable1;
-						break;
-					case D3DRS_COLORWRITEENABLE2:
-						(*pValue) = constants->colorWriteEnable2;
-						break;
-					case D3DRS_COLORWRITEENABLE3:
-						(*pValue) = constants->colorWriteEnable3;
-						break;
-					case D3DRS_BLENDFACTOR:
-						(*pValue) = constants->blendFactor;
-						break;
-					case D3DRS_SRGBWRITEENABLE:
-						(*pValue) = constants->srgbWriteEnable;
-						break;
-					case D3DRS_DEPTHBIAS:
-						(*pValue) = bit_cast(constants->depthBias);
-						break;
-					case D3DRS_WRAP8:
-						(*pValue) = constants->wrap8;
-						break;
-					case D3DRS_WRAP9:
-						(*pValue) = constants->wrap9;
-						break;
-					case D3DRS_WRAP10:
-						(*pValue) = constants->wrap10;
-						break;
-					case D3DRS_WRAP11:
-						(*pValue) = constants->wrap11;
-						break;
-					case D3DRS_WRAP12:
-						(*pValue) = constants->wrap12;
-						break;
-					case D3DRS_WRAP13:
-						(*pValue) = constants->wrap13;
-						break;
-					case D3DRS_WRAP14:
-						(*pValue) = constants->wrap14;
-						break;
-					case D3DRS_WRAP15:
-						(*pValue) = constants->wrap15;
-						break;
-					case D3DRS_SEPARATEALPHABLENDENABLE:
-						(*pValue) = constants->separateAlphaBlendEnable;
-						break;
-					case D3DRS_SRCBLENDALPHA:
-						(*pValue) = constants->sourceBlendAlpha;
-						break;
-					case D3DRS_DESTBLENDALPHA:
-						(*pValue) = constants->destinationBlendAlpha;
-						break;
-					case D3DRS_BLENDOPALPHA:
-						(*pValue) = constants->blendOperationAlpha;
-						break;
-					default:
-						BOOST_LOG_TRIVIAL(warning) << "ProcessQueue unknown state! " << State;
-						break;
+						realWindow.mDeviceState.SetRenderState(State, Value);
 					}
 				}
 				break;
-				case Device_GetSamplerState:
+				case Device_SetSamplerState:
 				{
 					auto& realWindow = (*commandStreamManager->mRenderManager.mStateManager.mWindows[workItem->Id]);
-					DWORD Sampler = bit_cast<D3DRENDERSTATETYPE>(workItem->Argument1);
+					DWORD Sampler = bit_cast<DWORD>(workItem->Argument1);
 					D3DSAMPLERSTATETYPE Type = bit_cast<D3DSAMPLERSTATETYPE>(workItem->Argument2);
-					DWORD* pValue = bit_cast<DWORD*>(workItem->Argument3);
-
-					(*pValue) = realWindow.mDeviceState.mSamplerStates[Sampler][Type];
-				}
-				break;
-				case Device_GetScissorRect:
-				{
-					auto& realWindow = (*commandStreamManager->mRenderManager.mStateManager.mWindows[workItem->Id]);
-					RECT* pRect = bit_cast<RECT*>(workItem->Argument1);
-
-					(*pRect) = realWindow.mDeviceState.m9Scissor;
-				}
-				break;
-				case Device_GetStreamSource:
-				{
-					auto& realWindow = (*commandStreamManager->mRenderManager.mStateManager.mWindows[workItem->Id]);
-					UINT StreamNumber = bit_cast<UINT>(workItem->Argument1);
-					IDirect3DVertexBuffer9** ppStreamData = bit_cast<IDirect3DVertexBuffer9**>(workItem->Argument2);
-					UINT* pOffsetInBytes = bit_cast<UINT*>(workItem->Argument3);
-					UINT* pStride = bit_cast<UINT*>(workItem->Argument4);
-
-					StreamSource& value = realWindow.mDeviceState.mStreamSources[StreamNumber];
-
-					(*ppStreamData) = (IDirect3DVertexBuffer9*)value.StreamData;
-					/*
-					Vulkan wants 64bit uint but d3d9 uses 32bit uint. This cast just keeps compiler from complaining.
-					This should be safe because only 32bit can be set and d3d9 is x86 only so endianness issues shouldn't come into play.
-					*/
-					(*pOffsetInBytes) = (UINT)value.OffsetInBytes;
-					(*pStride) = value.Stride;
-				}
-				break;
-				case Device_GetTexture:
-				{
-					auto& realWindow = (*commandStreamManager->mRenderManager.mStateManager.mWindows[workItem->Id]);
-					DWORD Stage = bit_cast<DWORD>(workItem->Argument1);
-					IDirect3DBaseTexture9** ppTexture = bit_cast<IDirect3DBaseTexture9**>(workItem->Argument2);
-
-					DeviceState* state = NULL;
+					DWORD Value = bit_cast<DWORD>(workItem->Argument3);
 
 					if (realWindow.mCurrentStateRecording != nullptr)
 					{
-						state = &realWindow.mCurrentStateRecording->mDeviceState;
+						realWindow.mCurrentStateRecording->mDeviceState.SetSamplerState(Sampler, Type, Value);
 					}
 					else
 					{
-						state = &realWindow.mDeviceState;
+						realWindow.mDeviceState.SetSamplerState(Sampler, Type, Value);
+						realWindow.mBindings.DirtyFlags |= BINDING_FLAG(BindingType_Descriptors);
 					}
+				}
+				break;
+				case Device_SetScissorRect:
+				{
+					auto& realWindow = (*commandStreamManager->mRenderManager.mStateManager.mWindows[workItem->Id]);
+					RECT* pRect = bit_cast<RECT*>(workItem->Argument1);
 
-					auto it = state->mTextures.find(Stage);
-					if (it != state->mTextures.end())
+					if (realWindow.mCurrentStateRecording != nullptr)
 					{
-						(*ppTexture) = it->second;
+						realWindow.mCurrentStateRecording->mDeviceState.SetScissorRect(pRect);
 					}
 					else
 					{
-						(*ppTexture) = nullptr;
+						realWindow.mDeviceState.SetScissorRect(pRect);
+						realWindow.mBindings.DirtyFlags |= BINDING_FLAG(BindingType_Scissor);
 					}
 				}
 				break;
-				case Device_GetTextureStageState:
-				{
-					auto& realWindow = (*commandStreamManager->mRenderManager.mStateManager.mWindows[workItem->Id]);
-					DWORD Stage = bit_cast<DWORD>(workItem->Argument1);
-					D3DTEXTURESTAGESTATETYPE Type = bit_cast<D3DTEXTURESTAGESTATETYPE>(workItem->Argument2);
-					DWORD* pValue = bit_cast<DWORD*>(workItem->Argument3);
-
-					DeviceState* state = nullptr;
-
-					if (realWindow.mCurrentStateRecording != nullptr)
-					{
-						state = &realWindow.mCurrentStateRecording->mDeviceState;
-					}
-					else
-					{
-						state = &realWindow.mDeviceState;
-					}
-
-					switch (Type)
-					{
-					case D3DTSS_COLOROP:
-						switch (Stage)
-						{
-						case 0:
-							(*pValue) = state->mSpecializationConstants.colorOperation_0;
-							break;
-						case 1:
-							(*pValue) = state->mSpecializationConstants.colorOperation_1;
-							break;
-						case 2:
-							(*pValue) = state->mSpecializationConstants.colorOperation_2;
-							break;
-						case 3:
-							(*pValue) = state->mSpecializationConstants.colorOperation_3;
-							break;
-						case 4:
-							(*pValue) = state->mSpecializationConstants.colorOperation_4;
-							break;
-						case 5:
-							(*pValue) = state->mSpecializationConstants.colorOperation_5;
-							break;
-						case 6:
-							(*pValue) = state->mSpecializationConstants.colorOperation_6;
-							break;
-						case 7:
-							(*pValue) = state->mSpecializationConstants.colorOperation_7;
-							break;
-						default:
-							break;
-						}
-						break;
-					case D3DTSS_COLORARG1:
-						switch (Stage)
-						{
-						case 0:
-							(*pValue) = state->mSpecializationConstants.colorArgument1_0;
-							break;
-						case 1:
-							(*pValue) = state->mSpecializationConstants.colorArgument1_1;
-							break;
-						case 2:
-							(*pValue) = state->mSpecializationConstants.colorArgument1_2;
-							break;
-						case 3:
-							(*pValue) = state->mSpecializationConstants.colorArgument1_3;
-							break;
-						case 4:
-							(*pValue) = state->mSpecializationConstants.colorArgument1_4;
-							break;
-						case 5:
-							(*pValue) = state->mSpecializationConstants.colorArgument1_5;
-							break;
-						case 6:
-							(*pValue) = state->mSpecializationConstants.colorArgument1_6;
-							break;
-						case 7:
-							(*pValue) = state->mSpecializationConstants.colorArgument1_7;
-							break;
-						default:
-							break;
-						}
-						break;
-					case D3DTSS_COLORARG2:
-						switch (Stage)
-						{
-						case 0:
-							(*pValue) = state->mSpecializationConstants.colorArgument2_0;
-							break;
-						case 1:
-							(*pValue) = state->mSpecializationConstants.colorArgument2_1;
-							break;
-						case 2:
-							(*pValue) = state->mSpecializationConstants.colorArgument2_2;
-							break;
-						case 3:
-							(*pValue) = state->mSpecializationConstants.colorArgument2_3;
-							break;
-						case 4:
-							(*pValue) = state->mSpecializationConstants.colorArgument2_4;
-							break;
-						case 5:
-							(*pValue) = state->mSpecializationConstants.colorArgument2_5;
-							break;
-						case 6:
-							(*pValue) = state->mSpecializationConstants.colorArgument2_6;
-							break;
-						case 7:
-							(*pValue) = state->mSpecializationConstants.colorArgument2_7;
-							break;
-						default:
-							break;
-						}
-						break;
-					case D3DTSS_ALPHAOP:
-						switch (Stage)
-						{
-						case 0:
-							(*pValue) = state->mSpecializationConstants.alphaOperation_0;
-							break;
-						case 1:
-							(*pValue) = state->mSpecializationConstants.alphaOperation_1;
-							break;
-						case 2:
-							(*pValue) = state->mSpecializationConstants.alphaOperation_2;
-							break;
-						case 3:
-							(*pValue) = state->mSpecializationConstants.alphaOperation_3;
-							break;
-						case 4:
-							(*pValue) = state->mSpecializationConstants.alphaOperation_4;
-							break;
-						case 5:
-							(*pValue) = state->mSpecializationConstants.alphaOperation_5;
-							break;
-						case 6:
-							(*pValue) = state->mSpecializationConstants.alphaOperation_6;
-							break;
-						case 7:
-							(*pValue) = state->mSpecializationConstants.alphaOperation_7;
-							break;
-						default:
-							break;
-						}
-						break;
-					case D3DTSS_ALPHAARG1:
-						switch (Stage)
-						{
-						case 0:
-							(*pValue) = state->mSpecializationConstants.alphaArgument1_0;
-							break;
-						case 1:
-							(*pValue) = state->mSpecializationConstants.alphaArgument1_1;
-							break;
-						case 2:
-							(*pValue) = state->mSpecializationConstants.alphaArgument1_2;
-							break;
-						case 3:
-							(*pValue) = state->mSpecializationConstants.alphaArgument1_3;
-							break;
-						case 4:
-							(*pValue) = state->mSpecializationConstants.alphaArgument1_4;
-							break;
-						case 5:
-							(*pValue) = state->mSpecializationConstants.alphaArgument1_5;
-							break;
-						case 6:
-							(*pValue) = state->mSpecializationConstants.alphaArgument1_6;
-							break;
-						case 7:
-							(*pValue) = state->mSpecializationConstants.alphaArgument1_7;
-							break;
-						default:
-							break;
-						}
-						break;
-					case D3DTSS_ALPHAARG2:
-						switch (Stage)
-						{
-						case 0:
-							(*pValue) = state->mSpecializationConstants.alphaArgument2_0;
-							break;
-						case 1:
-							(*pValue) = state->mSpecializationConstants.alphaArgument2_1;
-							break;
-						case 2:
-							(*pValue) = state->mSpecializationConstants.alphaArgument2_2;
-							break;
-						case 3:
-							(*pValue) = state->mSpecializationConstants.alphaArgument2_3;
-							break;
-						case 4:
-							(*pValue) = state->mSpecializationConstants.alphaArgument2_4;
-							break;
-						case 5:
-							(*pValue) = state->mSpecializationConstants.alphaArgument2_5;
-							break;
-						case 6:
-							(*pValue) = state->mSpecializationConstants.alphaArgument2_6;
-							break;
-						case 7:
-							(*pValue) = state->mSpecializationConstants.alphaArgument2_7;
-							break;
-						default:
-							break;
-						}
-						break;
-					case D3DTSS_BUMPENVMAT00:
-						switch (Stage)
-						{
-						case 0:
-							(*pValue) = bit_cast(state->mSpecializationConstants.bumpMapMatrix00_0);
-							break;
-						case 1:
-							(*pValue) = bit_cast(state->mSpecializationConstants.bumpMapMatrix00_1);
-							break;
-						case 2:
-							(*pValue) = bit_cast(state->mSpecializationConstants.bumpMapMatrix00_2);
-							break;
-						case 3:
-							(*pValue) = bit_cast(state->mSpecializationConstants.bumpMapMatrix00_3);
-							break;
-						case 4:
-							(*pValue) = bit_cast(state->mSpecializationConstants.bumpMapMatrix00_4);
-							break;
-						case 5:
-							(*pValue) = bit_cast(state->mSpecializationConstants.bumpMapMatrix00_5);
-							break;
-						case 6:
-							(*pValue) = bit_cast(state->mSpecializationConstants.bumpMapMatrix00_6);
-							break;
-						case 7:
-							(*pValue) = bit_cast(state->mSpecializationConstants.bumpMapMatrix00_7);
-							break;
-						default:
-							break;
-						}
-						break;
-					case D3DTSS_BUMPENVMAT01:
-						switch (Stage)
-						{
-						case 0:
-							(*pValue) = bit_cast(state->mSpecializationConstants.bumpMapMatrix01_0);
-							break;
-						case 1:
-							(*pValue) = bit_cast(state->mSpecializationConstants.bumpMapMatrix01_1);
-							break;
-						case 2:
-							(*pValue) = bit_cast(state->mSpecializationConstants.bumpMapMatrix01_2);
-							break;
-						case 3:
-							(*pValue) = bit_cast(state->mSpecializationConstants.bumpMapMatrix01_3);
-							break;
-						case 4:
-							(*pValue) = bit_cast(state->mSpecializationConstants.bumpMapMatrix01_4);
-							break;
-						case 5:
-							(*pValue) = bit_cast(state->mSpecializationConstants.bumpMapMatrix01_5);
-							break;
-						case 6:
-							(*pValue) = bit_cast(state->mSpecializationConstants.bumpMapMatrix01_6);
-							break;
-						case 7:
-							(*pValue) = bit_cast(state->mSpecializationConstants.bumpMapMatrix01_7);
-							break;
-						default:
-							break;
-						}
-						break;
-					case D3DTSS_BUMPENVMAT10:
-						switch (Stage)
-						{
-						case 0:
-							(*pValue) = bit_cast(state->mSpecializationConstants.bumpMapMatrix10_0);
-							break;
-						case 1:
-							(*pValue) = bit_cast(state->mSpecializationConstants.bumpMapMatrix10_1);
-							break;
-						case 2:
-							(*pValue) = bit_cast(state->mSpecializationConstants.bumpMapMatrix10_2);
-							break;
-						case 3:
-							(*pValue) = bit_cast(state->mSpecializationConstants.bumpMapMatrix10_3);
-							break;
-						case 4:
-							(*pValue) = bit_cast(state->mSpecializationConstants.bumpMapMatrix10_4);
-							break;
-						case 5:
-							(*pValue) = bit_cast(state->mSpecializationConstants.bumpMapMatrix10_5);
-							break;
-						case 6:
-							(*pValue) = bit_cast(state->mSpecializationConstants.bumpMapMatrix10_6);
-							break;
-						case 7:
-							(*pValue) = bit_cast(state->mSpecializationConstants.bumpMapMatrix10_7);
-							break;
-						default:
-							break;
-						}
-						break;
-					case D3DTSS_BUMPENVMAT11:
-						switch (Stage)
-						{
-						case 0:
-							(*pValue) = bit_cast(state->mSpecializationConstants.bumpMapMatrix11_0);
-							break;
-						case 1:
-							(*pValue) = bit_cast(state->mSpecializationConstants.bumpMapMatrix11_1);
-							break;
-						case 2:
-							(*pValue) = bit_cast(state->mSpecializationConstants.bumpMapMatrix11_2);
-							break;
-						case 3:
-							(*pValue) = bit_cast(state->mSpecializationConstants.bumpMapMatrix11_3);
-							break;
-						case 4:
-							(*pValue) = bit_cast(state->mSpecializationConstants.bumpMapMatrix11_4);
-							break;
-						case 5:
-							(*pValue) = bit_cast(state->mSpecializationConstants.bumpMapMatrix11_5);
-							break;
-						case 6:
-							(*pValue) = bit_cast(state->mSpecializationConstants.bumpMapMatrix11_6);
-							break;
-						case 7:
-							(*pValue) = bit_cast(state->mSpecializationConstants.bumpMapMatrix11_7);
-							break;
-						default:
-							break;
-						}
-						break;
-					case D3DTSS_TEXCOORDINDEX:
-						switch (Stage)
-						{
-						case 0:
-							(*pValue) = state->mSpecializationConstants.texureCoordinateIndex_0;
-							break;
-						case 1:
-							(*pValue) = state->mSpecializationConstants.texureCoordinateIndex_1;
-							break;
-						case 2:
-							(*pValue) = state->mSpecializationConstants.texureCoordinateIndex_2;
-							break;
-						case 3:
-							(*pValue) = state->mSpecializationConstants.texureCoordinateIndex_3;
-							break;
-						case 4:
-							(*pValue) = state->mSpecializationConstants.texureCoordinateIndex_4;
-							break;
-						case 5:
-							(*pValue) = state->mSpecializationConstants.texureCoordinateIndex_5;
-							break;
-						case 6:
-							(*pValue) = state->mSpecializationConstants.texureCoordinateIndex_6;
-							break;
-						case 7:
-							(*pValue) = state->mSpecializationConstants.texureCoordinateIndex_7;
-							break;
-						default:
-							break;
-						}
-						break;
-					case D3DTSS_BUMPENVLSCALE:
-						switch (Stage)
-						{
-						case 0:
-							(*pValue) = bit_cast(state->mSpecializationConstants.bumpMapScale_0);
-							break;
-						case 1:
-							(*pValue) = bit_cast(state->mSpecializationConstants.bumpMapScale_1);
-							break;
-						case 2:
-							(*pValue) = bit_cast(state->mSpecializationConstants.bumpMapScale_2);
-							break;
-						case 3:
-							(*pValue) = bit_cast(state->mSpecializationConstants.bumpMapScale_3);
-							break;
-						case 4:
-							(*pValue) = bit_cast(state->mSpecializationConstants.bumpMapScale_4);
-							break;
-						case 5:
-							(*pValue) = bit_cast(state->mSpecializationConstants.bumpMapScale_5);
-							break;
-						case 6:
-							(*pValue) = bit_cast(state->mSpecializationConstants.bumpMapScale_6);
-							break;
-						case 7:
-							(*pValue) = bit_cast(state->mSpecializationConstants.bumpMapScale_7);
-							break;
-						default:
-							break;
-						}
-						break;
-					case D3DTSS_BUMPENVLOFFSET:
-						switch (Stage)
-						{
-						case 0:
-							(*pValue) = bit_cast(state->mSpecializationConstants.bumpMapOffset_0);
-							break;
-						case 1:
-							(*pValue) = bit_cast(state->mSpecializationConstants.bumpMapOffset_1);
-							break;
-						case 2:
-							(*pValue) = bit_cast(state->mSpecializationConstants.bumpMapOffset_2);
-							break;
-						case 3:
-							(*pValue) = bit_cast(state->mSpecializationConstants.bumpMapOffset_3);
-							break;
-						case 4:
-							(*pValue) = bit_cast(state->mSpecializationConstants.bumpMapOffset_4);
-							break;
-						case 5:
-							(*pValue) = bit_cast(state->mSpecializationConstants.bumpMapOffset_5);
-							break;
-						case 6:
-							(*pValue) = bit_cast(state->mSpecializationConstants.bumpMapOffset_6);
-							break;
-						case 7:
-							(*pValue) = bit_cast(state->mSpecializationConstants.bumpMapOffset_7);
-							break;
-						default:
-							break;
-						}
-						break;
-					case D3DTSS_TEXTURETRANSFORMFLAGS:
-						switch (Stage)
-						{
-						case 0:
-							(*pValue) = state->mSpecializationConstants.textureTransformationFlags_0;
-							break;
-						case 1:
-							(*pValue) = state->mSpecializationConstants.textureTransformationFlags_1;
-							break;
-						case 2:
-							(*pValue) = state->mSpecializationConstants.textureTransformationFlags_2;
-							break;
-						case 3:
-							(*pValue) = state->mSpecializationConstants.textureTransformationFlags_3;
-							break;
-						case 4:
-							(*pValue) = state->mSpecializationConstants.textureTransformationFlags_4;
-							break;
-						case 5:
-							(*pValue) = state->mSpecializationConstants.textureTransformationFlags_5;
-							break;
-						case 6:
-							(*pValue) = state->mSpecializationConstants.textureTransformationFlags_6;
-							break;
-						case 7:
-							(*pValue) = state->mSpecializationConstants.textureTransformationFlags_7;
-							break;
-						default:
-							break;
-						}
-						break;
-					case D3DTSS_COLORARG0:
-						switch (Stage)
-						{
-						case 0:
-							(*pValue) = state->mSpecializationConstants.colorArgument0_0;
-							break;
-						case 1:
-							(*pValue) = state->mSpecializationConstants.colorArgument0_1;
-							break;
-						case 2:
-							(*pValue) = state->mSpecializationConstants.colorArgument0_2;
-							break;
-						case 3:
-							(*pValue) = state->mSpecializationConstants.colorArgument0_3;
-							break;
-						case 4:
-							(*pValue) = state->mSpecializationConstants.colorArgument0_4;
-							break;
-						case 5:
-							(*pValue) = state->mSpecializationConstants.colorArgument0_5;
-							break;
-						case 6:
-							(*pValue) = state->mSpecializationConstants.colorArgument0_6;
-							break;
-						case 7:
-							(*pValue) = state->mSpecializationConstants.colorArgument0_7;
-							break;
-						default:
-							break;
-						}
-						break;
-					case D3DTSS_ALPHAARG0:
-						switch (Stage)
-						{
-						case 0:
-							(*pValue) = state->mSpecializationConstants.alphaArgument0_0;
-							break;
-						case 1:
-							(*pValue) = state->mSpecializationConstants.alphaArgument0_1;
-							break;
-						case 2:
-							(*pValue) = state->mSpecializationConstants.alphaArgument0_2;
-							break;
-						case 3:
-							(*pValue) = state->mSpecializationConstants.alphaArgument0_3;
-							break;
-						case 4:
-							(*pValue) = state->mSpecializationConstants.alphaArgument0_4;
-							break;
-						case 5:
-							(*pValue) = state->mSpecializationConstants.alphaArgument0_5;
-							break;
-						case 6:
-							(*pValue) = state->mSpecializationConstants.alphaArgument0_6;
-							break;
-						case 7:
-							(*pValue) = state->mSpecializationConstants.alphaArgument0_7;
-							break;
-						default:
-							break;
-						}
-						break;
-					case D3DTSS_RESULTARG:
-						switch (Stage)
-						{
-						case 0:
-							(*pValue) = state->mSpecializationConstants.Result_0;
-							break;
-						case 1:
-							(*pValue) = state->mSpecializationConstants.Result_1;
-							break;
-						case 2:
-							(*pValue) = state->mSpecializationConstants.Result_2;
-							break;
-						case 3:
-							(*pValue) = state->mSpecializationConstants.Result_3;
-							break;
-						case 4:
-							(*pValue) = state->mSpecializationConstants.Result_4;
-							break;
-						case 5:
-							(*pValue) = state->mSpecializationConstants.Result_5;
-							break;
-						case 6:
-							(*pValue) = state->mSpecializationConstants.Result_6;
-							break;
-						case 7:
-							(*pValue) = state->mSpecializationConstants.Result_7;
-							break;
-						default:
-							break;
-						}
-						break;
-					case D3DTSS_CONSTANT:
-						switch (Stage)
-						{
-						case 0:
-							(*pValue) = state->mSpecializationConstants.Constant_0;
-							break;
-						case 1:
-							(*pValue) = state->mSpecializationConstants.Constant_1;
-							break;
-						case 2:
-							(*pValue) = state->mSpecializationConstants.Constant_2;
-							break;
-						case 3:
-							(*pValue) = state->mSpecializationConstants.Constant_3;
-							break;
-						case 4:
-							(*pValue) = state->mSpecializationConstants.Constant_4;
-							break;
-						case 5:
-							(*pValue) = state->mSpecializationConstants.Constant_5;
-							break;
-						case 6:
-							(*pValue) = state->mSpecializationConstants.Constant_6;
-							break;
-						case 7:
-							(*pValue) = state->mSpecializationConstants.Constant_7;
-							break;
-						default:
-							break;
-						}
-						break;
-					default:
-						break;
-					}
-				}
-				break;
-				case Device_GetTransform:
-				{
-					auto& realWindow = (*commandStreamManager->mRenderManager.mStateManager.mWindows[workItem->Id]);
-					D3DTRANSFORMSTATETYPE State = bit_cast<D3DTRANSFORMSTATETYPE>(workItem->Argument1);
-					D3DMATRIX* pMatrix = bit_cast<D3DMATRIX*>(workItem->Argument2);
-
-					(*pMatrix) = realWindow.mDeviceState.mTransforms[State];
-				}
-				break;
-				case Device_GetVertexDeclaration:
-				{
-					auto& realWindow = (*commandStreamManager->mRenderManager.mStateManager.mWindows[workItem->Id]);
-					IDirect3DVertexDeclaration9** ppDecl = bit_cast<IDirect3DVertexDeclaration9**>(workItem->Argument1);
-
-					(*ppDecl) = (IDirect3DVertexDeclaration9*)realWindow.mDeviceState.mVertexDeclaration;
-				}
-				break;
-				case Device_GetVertexShader:
-				{
-					auto& realWindow = (*commandStreamManager->mRenderManager.mStateManager.mWindows[workItem->Id]);
-					IDirect3DVertexShader9** ppShader = bit_cast<IDirect3DVertexShader9**>(workItem->Argument1);
-
-					(*ppShader) = (IDirect3DVertexShader9*)realWindow.mDeviceState.mVertexShader;
-				}
-				break;
-				case Device_GetVertexShaderConstantB:
-				{
-					auto& realWindow = (*commandStreamManager->mRenderManager.mStateManager.mWindows[workItem->Id]);
-					UINT StartRegister = bit_cast<UINT>(workItem->Argument1);
-					BOOL* pConstantData = bit_cast<BOOL*>(workItem->Argument2);
-					UINT BoolCount = bit_cast<UINT>(workItem->Argument3);
-
-					auto& slots = realWindow.mDeviceState.mVertexShaderConstantSlots;
-					for (size_t i = 0; i < BoolCount; i++)
-					{
-						pConstantData[i] = slots.BooleanConstants[StartRegister + i];
-					}
-				}
-				break;
-				case Device_GetVertexShaderConstantF:
-				{
-					auto& realWindow = (*commandStreamManager->mRenderManager.mStateManager.mWindows[workItem->Id]);
-					UINT StartRegister = bit_cast<UINT>(workItem->Argument1);
-					float* pConstantData = bit_cast<float*>(workItem->Argument2);
-					UINT Vector4fCount = bit_cast<UINT>(workItem->Argument3);
-
-					auto& slots = realWindow.mDeviceState.mVertexShaderConstantSlots;
-					uint32_t startIndex = (StartRegister * 4);
-					uint32_t length = (Vector4fCount * 4);
-					for (size_t i = 0; i < length; i++)
-					{
-						if ((startIndex + i) < 128)
-						{
-							pConstantData[i] = realWindow.mDeviceState.mPushConstants[startIndex + i];
-						}
-						else
-						{
-							pConstantData[i] = slots.FloatConstants[startIndex + i];
-						}
-					}
-				}
-				break;
-				case Device_GetVertexShaderConstantI:
-				{
-					auto& realWindow = (*commandStreamManager->mRenderManager.mStateManager.mWindows[workItem->Id]);
-					UINT StartRegister = bit_cast<UINT>(workItem->Argument1);
-					int* pConstantData = bit_cast<int*>(workItem->Argument2);
-					UINT Vector4iCount = bit_cast<UINT>(workItem->Argument3);
-
-					auto& slots = realWindow.mDeviceState.mVertexShaderConstantSlots;
-					uint32_t startIndex = (StartRegister * 4);
-					uint32_t length = (Vector4iCount * 4);
-					for (size_t i = 0; i < length; i++)
-					{
-						pConstantData[i] = slots.IntegerConstants[startIndex + i];
-					}
-				}
-				break;
-				case Device_GetViewport:
-				{
-					auto& realWindow = (*commandStreamManager->mRenderManager.mStateManager.mWindows[workItem->Id]);
-					D3DVIEWPORT9* pViewport = bit_cast<D3DVIEWPORT9*>(workItem->Argument1);
-
-					(*pViewport) = realWindow.mDeviceState.m9Viewport;
-				}
-				break;
-				case Device_LightEnable:
-				{
-					auto& realWindow = (*commandStreamManager->mRenderManager.mStateManager.mWindows[workItem->Id]);
-					DWORD LightIndex = bit_cast<DWORD>(workItem->Argument1);
-					BOOL bEnable = bit_cast<BOOL>(workItem->Argument2);
-
-					DeviceState* state = nullptr;
-
-					if (realWindow.mCurrentStateRecording != nullptr)
-					{
-						state = &realWindow.mCurrentStateRecording->mDeviceState;
-					}
-					else
-					{
-						state = &realWindow.mDeviceState;
-					}
-
-					Light light = {};
-
-					if (state->mLights.size() == LightIndex)
-					{
-						light.IsEnabled = bEnable;
-						state->mLights.push_back(light);
-						state->mAreLightsDirty = true;
-					}
-					else
-					{
-						state->mLights[LightIndex].IsEnabled = bEnable;
-						state->mAreLightsDirty = true;
-					}
-				}
-				break;
-				case Device_SetFVF:
-				{
-					auto& realWindow = (*commandStreamManager->mRenderManager.mStateManager.mWindows[workItem->Id]);
-					DWORD FVF = bit_cast<DWORD>(workItem->Argument1);
-
-					if (realWindow.mCurrentStateRecording != nullptr)
-					{
-						realWindow.mCurrentStateRecording->mDeviceState.mFVF = FVF;
-						realWindow.mCurrentStateRecording->mDeviceState.mHasFVF = true;
-						realWindow.mCurrentStateRecording->mDeviceState.mHasVertexDeclaration = false;
-					}
-					else
-					{
-						realWindow.mDeviceState.mFVF = FVF;
-						realWindow.mDeviceState.mHasFVF = true;
-						realWindow.mDeviceState.mHasVertexDeclaration = false;
-					}
-				}
-				break;
-				case Device_SetIndices:
-				{
-					auto& realWindow = (*commandStreamManager->mRenderManager.mStateManager.mWindows[workItem->Id]);
-					IDirect3DIndexBuffer9* pIndexData = bit_cast<IDirect3DIndexBuffer9*>(workItem->Argument1);
-					DeviceState* state = nullptr;
-					if (realWindow.mCurrentStateRecording != nullptr)
-					{
-						state = &realWindow.mCurrentStateRecording->mDeviceState;
-					}
-					else
-					{
-						state = &realWindow.mDeviceState;
-					}
-					
-					if (pIndexData!=nullptr)
-					{
-						auto realIndex = commandStreamManager->mRenderManager.mStateManager.mIndexBuffers[((CIndexBuffer9*)pIndexData)->mId];
-
-						state->mIndexBuffer = realIndex.get();
-						state->mHasIndexBuffer = true;
-					}
-					else
-					{
-						state->mIndexBuffer = nullptr;
-						state->mHasIndexBuffer = false;
-					}
-				}
-				break;
-				case Device_SetLight:
-				{
-					auto& realWindow = (*commandStreamManager->mRenderManager.mStateManager.mWindows[workItem->Id]);
-					DWORD Index = bit_cast<DWORD>(workItem->Argument1);
-					D3DLIGHT9* pLight = bit_cast<D3DLIGHT9*>(workItem->Argument2);
-
-					DeviceState* state = nullptr;
-
-					if (realWindow.mCurrentStateRecording != nullptr)
-					{
-						state = &realWindow.mCurrentStateRecording->mDeviceState;
-					}
-					else
-					{
-						state = &realWindow.mDeviceState;
-					}
-
-					Light light = {};
-
-					light.Type = pLight->Type;
-					light.Diffuse[0] = pLight->Diffuse.r;
-					light.Diffuse[1] = pLight->Diffuse.g;
-					light.Diffuse[2] = pLight->Diffuse.b;
-					light.Diffuse[3] = pLight->Diffuse.a;
-
-					light.Specular[0] = pLight->Specular.r;
-					light.Specular[1] = pLight->Specular.g;
-					light.Specular[2] = pLight->Specular.b;
-					light.Specular[3] = pLight->Specular.a;
-
-					light.Ambient[0] = pLight->Ambient.r;
-					light.Ambient[1] = pLight->Ambient.g;
-					light.Ambient[2] = pLight->Ambient.b;
-					light.Ambient[3] = pLight->Ambient.a;
-
-					light.Position[0] = pLight->Position.x;
-					light.Position[1] = pLight->Position.y;
-					light.Position[2] = pLight->Position.z;
-					//No need to set [3] because structure is init with {} so it's already 0.
-
-					light.Direction[0] = pLight->Direction.x;
-					light.Direction[1] = pLight->Direction.y;
-					light.Direction[2] = pLight->Direction.z;
-					//No need to set [3] because structure is init with {} so it's already 0.
-
-					light.Range = pLight->Range;
-					light.Falloff = pLight->Falloff;
-					light.Attenuation0 = pLight->Attenuation0;
-					light.Attenuation1 = pLight->Attenuation1;
-					light.Attenuation2 = pLight->Attenuation2;
-					light.Theta = pLight->Theta;
-					light.Phi = pLight->Phi;
-
-					if (state->mLights.size() == Index)
-					{
-						state->mLights.push_back(light);
-						state->mAreLightsDirty = true;
-					}
-					else
-					{
-						light.IsEnabled = state->mLights[Index].IsEnabled;
-
-						state->mLights[Index] = light;
-						state->mAreLightsDirty = true;
-					}
-				}
-				break;
-				case Device_SetMaterial:
-				{
-					auto& realWindow = (*commandStreamManager->mRenderManager.mStateManager.mWindows[workItem->Id]);
-					D3DMATERIAL9* pMaterial = bit_cast<D3DMATERIAL9*>(workItem->Argument1);
-
-					if (realWindow.mCurrentStateRecording != nullptr)
-					{
-						realWindow.mCurrentStateRecording->mDeviceState.mMaterial = (*pMaterial);
-						realWindow.mCurrentStateRecording->mDeviceState.mIsMaterialDirty = true;
-					}
-					else
-					{
-						realWindow.mDeviceState.mMaterial = (*pMaterial);
-						realWindow.mDeviceState.mIsMaterialDirty = true;
-					}
-				}
-				break;
-				case Device_SetNPatchMode:
-				{
-					auto& realWindow = (*commandStreamManager->mRenderManager.mStateManager.mWindows[workItem->Id]);
-					float nSegments = bit_cast<float>(workItem->Argument1);
-
-					if (nSegments > 0.0f)
-					{
-						BOOST_LOG_TRIVIAL(warning) << "ProcessQueue nPatch greater than zero not supported.";
-					}
-
-					if (realWindow.mCurrentStateRecording != nullptr)
-					{
-						realWindow.mCurrentStateRecording->mDeviceState.mNSegments = nSegments;
-					}
-					else
-					{
-						realWindow.mDeviceState.mNSegments = nSegments;
-					}
-				}
-				break;
-				case Device_SetPixelShader:
-				{
-					auto& realWindow = (*commandStreamManager->mRenderManager.mStateManager.mWindows[workItem->Id]);
-					IDirect3DPixelShader9* pShader = bit_cast<IDirect3DPixelShader9*>(workItem->Argument1);
-
-					if (pShader != nullptr)
-					{
-						pShader->AddRef();
-					}
-
-					if (realWindow.mCurrentStateRecording != nullptr)
-					{
-						realWindow.mCurrentStateRecording->mDeviceState.mPixelShader = (CPixelShader9*)pShader;
-						realWindow.mCurrentStateRecording->mDeviceState.mHasPixelShader = true;
-					}
-					else
-					{
-						if (realWindow.mDeviceState.mPixelShader != nullptr)
-						{
-							realWindow.mDeviceState.mPixelShader->Release();
-						}
-
-						realWindow.mDeviceState.mPixelShader = (CPixelShader9*)pShader;
-						realWindow.mDeviceState.mHasPixelShader = true;
-					}
-				}
-				break;
-				case Device_SetPixelShaderConstantB:
-				{
-					auto& realWindow = (*commandStreamManager->mRenderManager.mStateManager.mWindows[workItem->Id]);
-					UINT StartRegister = bit_cast<UINT>(workItem->Argument1);
-					BOOL* pConstantData = bit_cast<BOOL*>(workItem->Argument2);
-					UINT BoolCount = bit_cast<UINT>(workItem->Argument3);
-
-					auto& slots = realWindow.mDeviceState.mPixelShaderConstantSlots;
-					for (size_t i = 0; i < BoolCount; i++)
-					{
-						slots.BooleanConstants[StartRegister + i] = pConstantData[i];
-					}
-				}
-				break;
-				case Device_SetPixelShaderConstantF:
-				{
-					auto& realWindow = (*commandStreamManager->mRenderManager.mStateManager.mWindows[workItem->Id]);
-					UINT StartRegister = bit_cast<UINT>(workItem->Argument1);
-					float* pConstantData = bit_cast<float*>(workItem->Argument2);
-					UINT Vector4fCount = bit_cast<UINT>(workItem->Argument3);
-
-					auto& slots = realWindow.mDeviceState.mPixelShaderConstantSlots;
-					uint32_t startIndex = (StartRegister * 4);
-					uint32_t length = (Vector4fCount * 4);
-					for (size_t i = 0; i < length; i++)
-					{
-						slots.FloatConstants[startIndex + i] = pConstantData[i];
-					}
-				}
-				break;
-				case Device_SetPixelShaderConstantI:
-				{
-					auto& realWindow = (*commandStreamManager->mRenderManager.mStateManager.mWindows[workItem->Id]);
-					UINT StartRegister = bit_cast<UINT>(workItem->Argument1);
-					int* pConstantData = bit_cast<int*>(workItem->Argument2);
-					UINT Vector4iCount = bit_cast<UINT>(workItem->Argument3);
-
-					auto& slots = realWindow.mDeviceState.mPixelShaderConstantSlots;
-					uint32_t startIndex = (StartRegister * 4);
-					uint32_t length = (Vector4iCount * 4);
-					for (size_t i = 0; i < length; i++)
-					{
-						slots.IntegerConstants[startIndex + i] = pConstantData[i];
-					}
-				}
-				break;
-				case Device_SetRenderState:
-				{
-					auto& realWindow = (*commandStreamManager->mRenderManager.mStateManager.mWindows[workItem->Id]);
-					D3DRENDERSTATETYPE State = bit_cast<D3DRENDERSTATETYPE>(workItem->Argument1);
-					DWORD Value = bit_cast<DWORD>(workItem->Argument2);
-
-					SpecializationConstants* constants = nullptr;
-					DeviceState* state = NULL;
-
-					if (realWindow.mCurrentStateRecording != nullptr)
-					{
-						constants = &realWindow.mCurrentStateRecording->mDeviceState.mSpecializationConstants;
-						state = &realWindow.mCurrentStateRecording->mDeviceState;
-					}
-					else
-					{
-						constants = &realWindow.mDeviceState.mSpecializationConstants;
-						state = &realWindow.mDeviceState;
-					}
-
-					switch (State)
-					{
-					case D3DRS_ZENABLE:
-						constants->zEnable = Value;
-						state->hasZEnable = true;
-						break;
-					case D3DRS_FILLMODE:
-						constants->fillMode = Value;
-						state->hasFillMode = true;
-						break;
-					case D3DRS_SHADEMODE:
-						constants->shadeMode = Value;
-						state->hasShadeMode = true;
-						break;
-					case D3DRS_ZWRITEENABLE:
-						constants->zWriteEnable = Value;
-						state->hasZWriteEnable = true;
-						break;
-					case D3DRS_ALPHATESTENABLE:
-						constants->alphaTestEnable = Value;
-						state->hasAlphaTestEnable = true;
-						break;
-					case D3DRS_LASTPIXEL:
-						constants->lastPixel = Value;
-						state->hasLastPixel = true;
-						break;
-					case D3DRS_SRCBLEND:
-						constants->sourceBlend = Value;
-						state->hasSourceBlend = true;
-						break;
-					case D3DRS_DESTBLEND:
-						constants->destinationBlend = Value;
-						state->hasDestinationBlend = true;
-						break;
-					case D3DRS_CULLMODE:
-						constants->cullMode = Value;
-						state->hasCullMode = true;
-						break;
-					case D3DRS_ZFUNC:
-						constants->zFunction = Value;
-						state->hasZFunction = true;
-						break;
-					case D3DRS_ALPHAREF:
-						constants->alphaReference = Value;
-						state->hasAlphaReference = true;
-						break;
-					case D3DRS_ALPHAFUNC:
-						constants->alphaFunction = Value;
-						state->hasAlphaFunction = true;
-						break;
-					case D3DRS_DITHERENABLE:
-						constants->ditherEnable = Value;
-						state->hasDitherEnable = true;
-						break;
-					case D3DRS_ALPHABLENDENABLE:
-						constants->alphaBlendEnable = Value;
-						state->hasAlphaBlendEnable = true;
-						break;
-					case D3DRS_FOGENABLE:
-						constants->fogEnable = Value;
-						state->hasFogEnable = true;
-						break;
-					case D3DRS_SPECULARENABLE:
-						constants->specularEnable = Value;
-						state->hasSpecularEnable = true;
-						break;
-					case D3DRS_FOGCOLOR:
-						constants->fogColor = Value;
-						state->hasFogColor = true;
-						break;
-					case D3DRS_FOGTABLEMODE:
-						constants->fogTableMode = Value;
-						state->hasFogTableMode = true;
-						break;
-					case D3DRS_FOGSTART:
-						constants->fogStart = bit_cast(Value);
-						state->hasFogStart = true;
-						break;
-					case D3DRS_FOGEND:
-						constants->fogEnd = bit_cast(Value);
-						state->hasFogEnd = true;
-						break;
-					case D3DRS_FOGDENSITY:
-						constants->fogDensity = bit_cast(Value);
-						state->hasFogDensity = true;
-						break;
-					case D3DRS_RANGEFOGENABLE:
-						constants->rangeFogEnable = Value;
-						state->hasRangeFogEnable = true;
-						break;
-					case D3DRS_STENCILENABLE:
-						constants->stencilEnable = Value;
-						state->hasStencilEnable = true;
-						break;
-					case D3DRS_STENCILFAIL:
-						constants->stencilFail = Value;
-						state->hasStencilFail = true;
-						break;
-					case D3DRS_STENCILZFAIL:
-						constants->stencilZFail = Value;
-						state->hasStencilZFail = true;
-						break;
-					case D3DRS_STENCILPASS:
-						constants->stencilPass = Value;
-						state->hasStencilPass = true;
-						break;
-					case D3DRS_STENCILFUNC:
-						constants->stencilFunction = Value;
-						state->hasStencilFunction = true;
-						break;
-					case D3DRS_STENCILREF:
-						constants->stencilReference = Value;
-						state->hasStencilReference = true;
-						break;
-					case D3DRS_STENCILMASK:
-						constants->stencilMask = Value;
-						state->hasStencilMask = true;
-						break;
-					case D3DRS_STENCILWRITEMASK:
-						constants->stencilWriteMask = Value;
-						state->hasStencilWriteMask = true;
-						break;
-					case D3DRS_TEXTUREFACTOR:
-						constants->textureFactor = Value;
-						state->hasTextureFactor = true;
-						break;
-					case D3DRS_WRAP0:
-						constants->wrap0 = Value;
-						state->hasWrap0 = true;
-						break;
-					case D3DRS_WRAP1:
-						constants->wrap1 = Value;
-						state->hasWrap1 = true;
-						break;
-					case D3DRS_WRAP2:
-						constants->wrap2 = Value;
-						state->hasWrap2 = true;
-						break;
-					case D3DRS_WRAP3:
-						constants->wrap3 = Value;
-						state->hasWrap3 = true;
-						break;
-					case D3DRS_WRAP4:
-						constants->wrap4 = Value;
-						state->hasWrap4 = true;
-						break;
-					case D3DRS_WRAP5:
-						constants->wrap5 = Value;
-						state->hasWrap5 = true;
-						break;
-					case D3DRS_WRAP6:
-						constants->wrap6 = Value;
-						state->hasWrap6 = true;
-						break;
-					case D3DRS_WRAP7:
-						constants->wrap7 = Value;
-						state->hasWrap7 = true;
-						break;
-					case D3DRS_CLIPPING:
-						constants->clipping = Value;
-						state->hasClipping = true;
-						break;
-					case D3DRS_LIGHTING:
-						constants->lighting = Value;
-						state->hasLighting = true;
-						break;
-					case D3DRS_AMBIENT:
-						constants->ambient = Value;
-						state->hasAmbient = true;
-						break;
-					case D3DRS_FOGVERTEXMODE:
-						constants->fogVertexMode = Value;
-						state->hasFogVertexMode = true;
-						break;
-					case D3DRS_COLORVERTEX:
-						constants->colorVertex = Value;
-						state->hasColorVertex = true;
-						break;
-					case D3DRS_LOCALVIEWER:
-						constants->localViewer = Value;
-						state->hasLocalViewer = true;
-						break;
-					case D3DRS_NORMALIZENORMALS:
-						constants->normalizeNormals = Value;
-						state->hasNormalizeNormals = true;
-						break;
-					case D3DRS_DIFFUSEMATERIALSOURCE:
-						constants->diffuseMaterialSource = Value;
-						state->hasDiffuseMaterialSource = true;
-						break;
-					case D3DRS_SPECULARMATERIALSOURCE:
-						constants->specularMaterialSource = Value;
-						state->hasSpecularMaterialSource = true;
-						break;
-					case D3DRS_AMBIENTMATERIALSOURCE:
-						constants->ambientMaterialSource = Value;
-						state->hasAmbientMaterialSource = true;
-						break;
-					case D3DRS_EMISSIVEMATERIALSOURCE:
-						constants->emissiveMaterialSource = Value;
-						state->hasEmissiveMaterialSource = true;
-						break;
-					case D3DRS_VERTEXBLEND:
-						constants->vertexBlend = Value;
-						state->hasVertexBlend = true;
-						break;
-					case D3DRS_CLIPPLANEENABLE:
-						constants->clipPlaneEnable = Value;
-						state->hasClipPlaneEnable = true;
-						break;
-					case D3DRS_POINTSIZE:
-						constants->pointSize = Value;
-						state->hasPointSize = true;
-						break;
-					case D3DRS_POINTSIZE_MIN:
-						constants->pointSizeMinimum = bit_cast(Value);
-						state->hasPointSizeMinimum = true;
-						break;
-					case D3DRS_POINTSPRITEENABLE:
-						constants->pointSpriteEnable = Value;
-						state->hasPointSpriteEnable = true;
-						break;
-					case D3DRS_POINTSCALEENABLE:
-						constants->pointScaleEnable = Value;
-						state->hasPointScaleEnable = true;
-						break;
-					case D3DRS_POINTSCALE_A:
-						constants->pointScaleA = bit_cast(Value);
-						state->hasPointScaleA = true;
-						break;
-					case D3DRS_POINTSCALE_B:
-						constants->pointScaleB = bit_cast(Value);
-						state->hasPointScaleB = true;
-						break;
-					case D3DRS_POINTSCALE_C:
-						constants->pointScaleC = bit_cast(Value);
-						state->hasPointScaleC = true;
-						break;
-					case D3DRS_MULTISAMPLEANTIALIAS:
-						constants->multisampleAntiAlias = Value;
-						state->hasMultisampleAntiAlias = true;
-						break;
-					case D3DRS_MULTISAMPLEMASK:
-						constants->multisampleMask = Value;
-						state->hasMultisampleMask = true;
-						break;
-					case D3DRS_PATCHEDGESTYLE:
-						constants->patchEdgeStyle = Value;
-						state->hasPatchEdgeStyle = true;
-						break;
-					case D3DRS_DEBUGMONITORTOKEN:
-						constants->debugMonitorToken = Value;
-						state->hasDebugMonitorToken = true;
-						break;
-					case D3DRS_POINTSIZE_MAX:
-						constants->pointSizeMaximum = bit_cast(Value);
-						state->hasPointSizeMaximum = true;
-						break;
-					case D3DRS_INDEXEDVERTEXBLENDENABLE:
-						constants->indexedVertexBlendEnable = Value;
-						state->hasIndexedVertexBlendEnable = true;
-						break;
-					case D3DRS_COLORWRITEENABLE:
-						constants->colorWriteEnable = Value;
-						state->hasColorWriteEnable = true;
-						break;
-					case D3DRS_TWEENFACTOR:
-						constants->tweenFactor = bit_cast(Value);
-						state->hasTweenFactor = true;
-						break;
-					case D3DRS_BLENDOP:
-						constants->blendOperation = Value;
-						state->hasBlendOperation = true;
-						break;
-					case D3DRS_POSITIONDEGREE:
-						constants->positionDegree = Value;
-						state->hasPositionDegree = true;
-						break;
-					case D3DRS_NORMALDEGREE:
-						constants->normalDegree = Value;
-						state->hasNormalDegree = true;
-						break;
-					case D3DRS_SCISSORTESTENABLE:
-						constants->scissorTestEnable = Value;
-						state->hasScissorTestEnable = true;
-						break;
-					case D3DRS_SLOPESCALEDEPTHBIAS:
-						constants->slopeScaleDepthBias = bit_cast(Value);
-						state->hasSlopeScaleDepthBias = true;
-						break;
-					case D3DRS_ANTIALIASEDLINEENABLE:
-						constants->antiAliasedLineEnable = Value;
-						state->hasAntiAliasedLineEnable = true;
-						break;
-					case D3DRS_MINTESSELLATIONLEVEL:
-						constants->minimumTessellationLevel = bit_cast(Value);
-						state->hasMinimumTessellationLevel = true;
-						break;
-					case D3DRS_MAXTESSELLATIONLEVEL:
-						constants->maximumTessellationLevel = bit_cast(Value);
-						state->hasMaximumTessellationLevel = true;
-						break;
-					case D3DRS_ADAPTIVETESS_X:
-						constants->adaptivetessX = bit_cast(Value);
-						state->hasAdaptivetessX = true;
-						break;
-					case D3DRS_ADAPTIVETESS_Y:
-						constants->adaptivetessY = bit_cast(Value);
-						state->hasAdaptivetessY = true;
-						break;
-					case D3DRS_ADAPTIVETESS_Z:
-						constants->adaptivetessZ = bit_cast(Value);
-						state->hasAdaptivetessZ = true;
-						break;
-					case D3DRS_ADAPTIVETESS_W:
-						constants->adaptivetessW = bit_cast(Value);
-						state->hasAdaptivetessW = true;
-						break;
-					case D3DRS_ENABLEADAPTIVETESSELLATION:
-						constants->enableAdaptiveTessellation = Value;
-						state->hasEnableAdaptiveTessellation = true;
-						break;
-					case D3DRS_TWOSIDEDSTENCILMODE:
-						constants->twoSidedStencilMode = Value;
-						state->hasTwoSidedStencilMode = true;
-						break;
-					case D3DRS_CCW_STENCILFAIL:
-						constants->ccwStencilFail = Value;
-						state->hasCcwStencilFail = true;
-						break;
-					case D3DRS_CCW_STENCILZFAIL:
-						constants->ccwStencilZFail = Value;
-						state->hasCcwStencilZFail = true;
-						break;
-					case D3DRS_CCW_STENCILPASS:
-						constants->ccwStencilPass = Value;
-						state->hasCcwStencilPass = true;
-						break;
-					case D3DRS_CCW_STENCILFUNC:
-						constants->ccwStencilFunction = Value;
-						state->hasCcwStencilFunction = true;
-						break;
-					case D3DRS_COLORWRITEENABLE1:
-						constants->colorWriteEnable1 = Value;
-						state->hasColorWriteEnable1 = true;
-						break;
-					case D3DRS_COLORWRITEENABLE2:
-						constants->colorWriteEnable2 = Value;
-						state->hasColorWriteEnable2 = true;
-						break;
-					case D3DRS_COLORWRITEENABLE3:
-						constants->colorWriteEnable3 = Value;
-						state->hasColorWriteEnable3 = true;
-						break;
-					case D3DRS_BLENDFACTOR:
-						constants->blendFactor = Value;
-						state->hasBlendFactor = true;
-						break;
-					case D3DRS_SRGBWRITEENABLE:
-						constants->srgbWriteEnable = Value;
-						state->hasSrgbWriteEnable = true;
-						break;
-					case D3DRS_DEPTHBIAS:
-						constants->depthBias = bit_cast(Value);
-						state->hasDepthBias = true;
-						break;
-					case D3DRS_WRAP8:
-						constants->wrap8 = Value;
-						state->hasWrap8 = true;
-						break;
-					case D3DRS_WRAP9:
-						constants->wrap9 = Value;
-						state->hasWrap9 = true;
-						break;
-					case D3DRS_WRAP10:
-						constants->wrap10 = Value;
-						state->hasWrap10 = true;
-						break;
-					case D3DRS_WRAP11:
-						constants->wrap11 = Value;
-						state->hasWrap11 = true;
-						break;
-					case D3DRS_WRAP12:
-						constants->wrap12 = Value;
-						state->hasWrap12 = true;
-						break;
-					case D3DRS_WRAP13:
-						constants->wrap13 = Value;
-						state->hasWrap13 = true;
-						break;
-					case D3DRS_WRAP14:
-						constants->wrap14 = Value;
-						state->hasWrap14 = true;
-						break;
-					case D3DRS_WRAP15:
-						constants->wrap15 = Value;
-						state->hasWrap15 = true;
-						break;
-					case D3DRS_SEPARATEALPHABLENDENABLE:
-						constants->separateAlphaBlendEnable = Value;
-						state->hasSeparateAlphaBlendEnable = true;
-						break;
-					case D3DRS_SRCBLENDALPHA:
-						constants->sourceBlendAlpha = Value;
-						state->hasSourceBlendAlpha = true;
-						break;
-					case D3DRS_DESTBLENDALPHA:
-						constants->destinationBlendAlpha = Value;
-						state->hasDestinationBlendAlpha = true;
-						break;
-					case D3DRS_BLENDOPALPHA:
-						constants->blendOperationAlpha = Value;
-						state->hasBlendOperationAlpha = true;
-						break;
-					default:
-						BOOST_LOG_TRIVIAL(warning) << "ProcessQueue unknown state! " << State;
-						break;
-					}
-				}
-				break;
-				case Device_SetSamplerState:
-				{
-					auto& realWindow = (*commandStreamManager->mRenderManager.mStateManager.mWindows[workItem->Id]);
-					DWORD Sampler = bit_cast<DWORD>(workItem->Argument1);
-					D3DSAMPLERSTATETYPE Type = bit_cast<D3DSAMPLERSTATETYPE>(workItem->Argument2);
-					DWORD Value = bit_cast<DWORD>(workItem->Argument3);
-
-					DeviceState* state = NULL;
-
-					if (realWindow.mCurrentStateRecording != nullptr)
-					{
-						state = &realWindow.mCurrentStateRecording->mDeviceState;
-					}
-					else
-					{
-						state = &realWindow.mDeviceState;
-					}
-
-					state->mSamplerStates[Sampler][Type] = Value;
-				}
-				break;
-				case Device_SetScissorRect:
-				{
-					auto& realWindow = (*commandStreamManager->mRenderManager.mStateManager.mWindows[workItem->Id]);
-					RECT* pRect = bit_cast<RECT*>(workItem->Argument1);
-
-					if (realWindow.mCurrentStateRecording != nullptr)
-					{
-						realWindow.mCurrentStateRecording->mDeviceState.m9Scissor = (*pRect);
-
-						realWindow.mCurrentStateRecording->mDeviceState.mScissor.extent.width = realWindow.mCurrentStateRecording->mDeviceState.m9Scissor.right;
-						realWindow.mCurrentStateRecording->mDeviceState.mScissor.extent.height = realWindow.mCurrentStateRecording->mDeviceState.m9Scissor.bottom;
-						realWindow.mCurrentStateRecording->mDeviceState.mScissor.offset.x = realWindow.mCurrentStateRecording->mDeviceState.m9Scissor.left;
-						realWindow.mCurrentStateRecording->mDeviceState.mScissor.offset.y = realWindow.mCurrentStateRecording->mDeviceState.m9Scissor.top;
-					}
-					else
-					{
-						realWindow.mDeviceState.m9Scissor = (*pRect);
-
-						realWindow.mDeviceState.mScissor.extent.width = realWindow.mDeviceState.m9Scissor.right;
-						realWindow.mDeviceState.mScissor.extent.height = realWindow.mDeviceState.m9Scissor.bottom;
-						realWindow.mDeviceState.mScissor.offset.x = realWindow.mDeviceState.m9Scissor.left;
-						realWindow.mDeviceState.mScissor.offset.y = realWindow.mDeviceState.m9Scissor.top;
-					}
-				}
-				break;
-				case Device_SetStreamSource:
+				case Device_SetStreamSource:
 				{
 					auto& realWindow = (*commandStreamManager->mRenderManager.mStateManager.mWindows[workItem->Id]);
 					UINT StreamNumber = bit_cast<UINT>(workItem->Argument1);
-					IDirect3DVertexBuffer9* pStreamData = bit_cast<IDirect3DVertexBuffer9*>(workItem->Argument2);
-					UINT OffsetInBytes = bit_cast<UINT>(workItem->Argument3);
-					UINT Stride = bit_cast<UINT>(workItem->Argument4);
-
-					CVertexBuffer9* streamData = (CVertexBuffer9*)pStreamData;
-
-					if (realWindow.mCurrentStateRecording != nullptr)
-					{
-						realWindow.mCurrentStateRecording->mDeviceState.mStreamSources[StreamNumber] = StreamSource(StreamNumber, streamData, OffsetInBytes, Stride);
-					}
-					else
-					{
-						realWindow.mDeviceState.mStreamSources[StreamNumber] = StreamSource(StreamNumber, streamData, OffsetInBytes, Stride);
-					}
-				}
-				break;
-				case Device_SetTexture:
-				{
-					auto& realWindow = (*commandStreamManager->mRenderManager.mStateManager.mWindows[workItem->Id]);
-					DWORD Sampler = bit_cast<DWORD>(workItem->Argument1);
-					IDirect3DBaseTexture9* pTexture = bit_cast<IDirect3DBaseTexture9*>(workItem->Argument2);
-
-					DeviceState* state = NULL;
-
-					if (realWindow.mCurrentStateRecording != nullptr)
-					{
-						state = &realWindow.mCurrentStateRecording->mDeviceState;
-					}
-					else
-					{
-						state = &realWindow.mDeviceState;
-					}
-
-					if (pTexture == nullptr)
-					{
-						auto it = state->mTextures.find(Sampler);
-						if (it != state->mTextures.end())
-						{
-							state->mTextures.erase(it);
-						}
-					}
-					else
-					{
-						state->mTextures[Sampler] = pTexture;
-						//texture->AddRef();
-					}
-				}
-				break;
-				case Device_SetTextureStageState:
-				{
-					auto& realWindow = (*commandStreamManager->mRenderManager.mStateManager.mWindows[workItem->Id]);
-					DWORD Stage = bit_cast<DWORD>(workItem->Argument1);
-					D3DTEXTURESTAGESTATETYPE Type = bit_cast<D3DTEXTURESTAGESTATETYPE>(workItem->Argument2);
-					DWORD Value = bit_cast<DWORD>(workItem->Argument3);
-
-					DeviceState* state = nullptr;
-
-					if (realWindow.mCurrentStateRecording != nullptr)
-					{
-						state = &realWindow.mCurrentStateRecording->mDeviceState;
-					}
-					else
-					{
-						state = &realWindow.mDeviceState;
-					}
-
-					switch (Type)
-					{
-					case D3DTSS_COLOROP:
-						switch (Stage)
-						{
-						case 0:
-							state->mSpecializationConstants.colorOperation_0 = Value;
-							break;
-						case 1:
-							state->mSpecializationConstants.colorOperation_1 = Value;
-							break;
-						case 2:
-							state->mSpecializationConstants.colorOperation_2 = Value;
-							break;
-						case 3:
-							state->mSpecializationConstants.colorOperation_3 = Value;
-							break;
-						case 4:
-							state->mSpecializationConstants.colorOperation_4 = Value;
-							break;
-						case 5:
-							state->mSpecializationConstants.colorOperation_5 = Value;
-							break;
-						case 6:
-							state->mSpecializationConstants.colorOperation_6 = Value;
-							break;
-						case 7:
-							state->mSpecializationConstants.colorOperation_7 = Value;
-							break;
-						default:
-							break;
-						}
-						break;
-					case D3DTSS_COLORARG1:
-						switch (Stage)
-						{
-						case 0:
-							state->mSpecializationConstants.colorArgument1_0 = Value;
-							break;
-						case 1:
-							state->mSpecializationConstants.colorArgument1_1 = Value;
-							break;
-						case 2:
-							state->mSpecializationConstants.colorArgument1_2 = Value;
-							break;
-						case 3:
-							state->mSpecializationConstants.colorArgument1_3 = Value;
-							break;
-						case 4:
-							state->mSpecializationConstants.colorArgument1_4 = Value;
-							break;
-						case 5:
-							state->mSpecializationConstants.colorArgument1_5 = Value;
-							break;
-						case 6:
-							state->mSpecializationConstants.colorArgument1_6 = Value;
-							break;
-						case 7:
-							state->mSpecializationConstants.colorArgument1_7 = Value;
-							break;
-						default:
-							break;
-						}
-						break;
-					case D3DTSS_COLORARG2:
-						switch (Stage)
-						{
-						case 0:
-							state->mSpecializationConstants.colorArgument2_0 = Value;
-							break;
-						case 1:
-							state->mSpecializationConstants.colorArgument2_1 = Value;
-							break;
-						case 2:
-							state->mSpecializationConstants.colorArgument2_2 = Value;
-							break;
-						case 3:
-							state->mSpecializationConstants.colorArgument2_3 = Value;
-							break;
-						case 4:
-							state->mSpecializationConstants.colorArgument2_4 = Value;
-							break;
-						case 5:
-							state->mSpecializationConstants.colorArgument2_5 = Value;
-							break;
-						case 6:
-							state->mSpecializationConstants.colorArgument2_6 = Value;
-							break;
-						case 7:
-							state->mSpecializationConstants.colorArgument2_7 = Value;
-							break;
-						default:
-							break;
-						}
-						break;
-					case D3DTSS_ALPHAOP:
-						switch (Stage)
-						{
-						case 0:
-							state->mSpecializationConstants.alphaOperation_0 = Value;
-							break;
-						case 1:
-							state->mSpecializationConstants.alphaOperation_1 = Value;
-							break;
-						case 2:
-							state->mSpecializationConstants.alphaOperation_2 = Value;
-							break;
-						case 3:
-							state->mSpecializationConstants.alphaOperation_3 = Value;
-							break;
-						case 4:
-							state->mSpecializationConstants.alphaOperation_4 = Value;
-							break;
-						case 5:
-							state->mSpecializationConstants.alphaOperation_5 = Value;
-							break;
-						case 6:
-							state->mSpecializationConstants.alphaOperation_6 = Value;
-							break;
-						case 7:
-							state->mSpecializationConstants.alphaOperation_7 = Value;
-							break;
-						default:
-							break;
-						}
-						break;
-					case D3DTSS_ALPHAARG1:
-						switch (Stage)
-						{
-						case 0:
-							state->mSpecializationConstants.alphaArgument1_0 = Value;
-							break;
-						case 1:
-							state->mSpecializationConstants.alphaArgument1_1 = Value;
-							break;
-						case 2:
-							state->mSpecializationConstants.alphaArgument1_2 = Value;
-							break;
-						case 3:
-							state->mSpecializationConstants.alphaArgument1_3 = Value;
-							break;
-						case 4:
-							state->mSpecializationConstants.alphaArgument1_4 = Value;
-							break;
-						case 5:
-							state->mSpecializationConstants.alphaArgument1_5 = Value;
-							break;
-						case 6:
-							state->mSpecializationConstants.alphaArgument1_6 = Value;
-							break;
-						case 7:
-							state->mSpecializationConstants.alphaArgument1_7 = Value;
-							break;
-						default:
-							break;
-						}
-						break;
-					case D3DTSS_ALPHAARG2:
-						switch (Stage)
-						{
-						case 0:
-							state->mSpecializationConstants.alphaArgument2_0 = Value;
-							break;
-						case 1:
-							state->mSpecializationConstants.alphaArgument2_1 = Value;
-							break;
-						case 2:
-							state->mSpecializationConstants.alphaArgument2_2 = Value;
-							break;
-						case 3:
-							state->mSpecializationConstants.alphaArgument2_3 = Value;
-							break;
-						case 4:
-							state->mSpecializationConstants.alphaArgument2_4 = Value;
-							break;
-						case 5:
-							state->mSpecializationConstants.alphaArgument2_5 = Value;
-							break;
-						case 6:
-							state->mSpecializationConstants.alphaArgument2_6 = Value;
-							break;
-						case 7:
-							state->mSpecializationConstants.alphaArgument2_7 = Value;
-							break;
-						default:
-							break;
-						}
-						break;
-					case D3DTSS_BUMPENVMAT00:
-						switch (Stage)
-						{
-						case 0:
-							state->mSpecializationConstants.bumpMapMatrix00_0 = bit_cast(Value);
-							break;
-						case 1:
-							state->mSpecializationConstants.bumpMapMatrix00_1 = bit_cast(Value);
-							break;
-						case 2:
-							state->mSpecializationConstants.bumpMapMatrix00_2 = bit_cast(Value);
-							break;
-						case 3:
-							state->mSpecializationConstants.bumpMapMatrix00_3 = bit_cast(Value);
-							break;
-						case 4:
-							state->mSpecializationConstants.bumpMapMatrix00_4 = bit_cast(Value);
-							break;
-						case 5:
-							state->mSpecializationConstants.bumpMapMatrix00_5 = bit_cast(Value);
-							break;
-						case 6:
-							state->mSpecializationConstants.bumpMapMatrix00_6 = bit_cast(Value);
-							break;
-						case 7:
-							state->mSpecializationConstants.bumpMapMatrix00_7 = bit_cast(Value);
-							break;
-						default:
-							break;
-						}
-						break;
-					case D3DTSS_BUMPENVMAT01:
-						switch (Stage)
-						{
-						case 0:
-							state->mSpecializationConstants.bumpMapMatrix01_0 = bit_cast(Value);
-							break;
-						case 1:
-							state->mSpecializationConstants.bumpMapMatrix01_1 = bit_cast(Value);
-							break;
-						case 2:
-							state->mSpecializationConstants.bumpMapMatrix01_2 = bit_cast(Value);
-							break;
-						case 3:
-							state->mSpecializationConstants.bumpMapMatrix01_3 = bit_cast(Value);
-							break;
-						case 4:
-							state->mSpecializationConstants.bumpMapMatrix01_4 = bit_cast(Value);
-							break;
-						case 5:
-							state->mSpecializationConstants.bumpMapMatrix01_5 = bit_cast(Value);
-							break;
-						case 6:
-							state->mSpecializationConstants.bumpMapMatrix01_6 = bit_cast(Value);
-							break;
-						case 7:
-							state->mSpecializationConstants.bumpMapMatrix01_7 = bit_cast(Value);
-							break;
-						default:
-							break;
-						}
-						break;
-					case D3DTSS_BUMPENVMAT10:
-						switch (Stage)
-						{
-						case 0:
-							state->mSpecializationConstants.bumpMapMatrix10_0 = bit_cast(Value);
-							break;
-						case 1:
-							state->mSpecializationConstants.bumpMapMatrix10_1 = bit_cast(Value);
-							break;
-						case 2:
-							state->mSpecializationConstants.bumpMapMatrix10_2 = bit_cast(Value);
-							break;
-						case 3:
-							state->mSpecializationConstants.bumpMapMatrix10_3 = bit_cast(Value);
-							break;
-						case 4:
-							state->mSpecializationConstants.bumpMapMatrix10_4 = bit_cast(Value);
-							break;
-						case 5:
-							state->mSpecializationConstants.bumpMapMatrix10_5 = bit_cast(Value);
-							break;
-						case 6:
-							state->mSpecializationConstants.bumpMapMatrix10_6 = bit_cast(Value);
-							break;
-						case 7:
-							state->mSpecializationConstants.bumpMapMatrix10_7 = bit_cast(Value);
-							break;
-						default:
-							break;
-						}
-						break;
-					case D3DTSS_BUMPENVMAT11:
-						switch (Stage)
-						{
-						case 0:
-							state->mSpecializationConstants.bumpMapMatrix11_0 = bit_cast(Value);
-							break;
-						case 1:
-							state->mSpecializationConstants.bumpMapMatrix11_1 = bit_cast(Value);
-							break;
-						case 2:
-							state->mSpecializationConstants.bumpMapMatrix11_2 = bit_cast(Value);
-							break;
-						case 3:
-							state->mSpecializationConstants.bumpMapMatrix11_3 = bit_cast(Value);
-							break;
-						case 4:
-							state->mSpecializationConstants.bumpMapMatrix11_4 = bit_cast(Value);
-							break;
-						case 5:
-							state->mSpecializationConstants.bumpMapMatrix11_5 = bit_cast(Value);
-							break;
-						case 6:
-							state->mSpecializationConstants.bumpMapMatrix11_6 = bit_cast(Value);
-							break;
-						case 7:
-							state->mSpecializationConstants.bumpMapMatrix11_7 = bit_cast(Value);
-							break;
-						default:
-							break;
-						}
-						break;
-					case D3DTSS_TEXCOORDINDEX:
-						switch (Stage)
-						{
-						case 0:
-							state->mSpecializationConstants.texureCoordinateIndex_0 = Value;
-							break;
-						case 1:
-							state->mSpecializationConstants.texureCoordinateIndex_1 = Value;
-							break;
-						case 2:
-							state->mSpecializationConstants.texureCoordinateIndex_2 = Value;
-							break;
-						case 3:
-							state->mSpecializationConstants.texureCoordinateIndex_3 = Value;
-							break;
-						case 4:
-							state->mSpecializationConstants.texureCoordinateIndex_4 = Value;
-							break;
-						case 5:
-							state->mSpecializationConstants.texureCoordinateIndex_5 = Value;
-							break;
-						case 6:
-							state->mSpecializationConstants.texureCoordinateIndex_6 = Value;
-							break;
-						case 7:
-							state->mSpecializationConstants.texureCoordinateIndex_7 = Value;
-							break;
-						default:
-							break;
-						}
-						break;
-					case D3DTSS_BUMPENVLSCALE:
-						switch (Stage)
-						{
-						case 0:
-							state->mSpecializationConstants.bumpMapScale_0 = bit_cast(Value);
-							break;
-						case 1:
-							state->mSpecializationConstants.bumpMapScale_1 = bit_cast(Value);
-							break;
-						case 2:
-							state->mSpecializationConstants.bumpMapScale_2 = bit_cast(Value);
-							break;
-						case 3:
-							state->mSpecializationConstants.bumpMapScale_3 = bit_cast(Value);
-							break;
-						case 4:
-							state->mSpecializationConstants.bumpMapScale_4 = bit_cast(Value);
-							break;
-						case 5:
-							state->mSpecializationConstants.bumpMapScale_5 = bit_cast(Value);
-							break;
-						case 6:
-							state->mSpecializationConstants.bumpMapScale_6 = bit_cast(Value);
-							break;
-						case 7:
-							state->mSpecializationConstants.bumpMapScale_7 = bit_cast(Value);
-							break;
-						default:
-							break;
-						}
-						break;
-					case D3DTSS_BUMPENVLOFFSET:
-						switch (Stage)
-						{
-						case 0:
-							state->mSpecializationConstants.bumpMapOffset_0 = bit_cast(Value);
-							break;
-						case 1:
-							state->mSpecializationConstants.bumpMapOffset_1 = bit_cast(Value);
-							break;
-						case 2:
-							state->mSpecializationConstants.bumpMapOffset_2 = bit_cast(Value);
-							break;
-						case 3:
-							state->mSpecializationConstants.bumpMapOffset_3 = bit_cast(Value);
-							break;
-						case 4:
-							state->mSpecializationConstants.bumpMapOffset_4 = bit_cast(Value);
-							break;
-						case 5:
-							state->mSpecializationConstants.bumpMapOffset_5 = bit_cast(Value);
-							break;
-						case 6:
-							state->mSpecializationConstants.bumpMapOffset_6 = bit_cast(Value);
-							break;
-						case 7:
-							state->mSpecializationConstants.bumpMapOffset_7 = bit_cast(Value);
-							break;
-						default:
-							break;
-						}
-						break;
-					case D3DTSS_TEXTURETRANSFORMFLAGS:
-						switch (Stage)
-						{
-						case 0:
-							state->mSpecializationConstants.textureTransformationFlags_0 = Value;
-							break;
-						case 1:
-							state->mSpecializationConstants.textureTransformationFlags_1 = Value;
-							break;
-						case 2:
-							state->mSpecializationConstants.textureTransformationFlags_2 = Value;
-							break;
-						case 3:
-							state->mSpecializationConstants.textureTransformationFlags_3 = Value;
-							break;
-						case 4:
-							state->mSpecializationConstants.textureTransformationFlags_4 = Value;
-							break;
-						case 5:
-							state->mSpecializationConstants.textureTransformationFlags_5 = Value;
-							break;
-						case 6:
-							state->mSpecializationConstants.textureTransformationFlags_6 = Value;
-							break;
-						case 7:
-							state->mSpecializationConstants.textureTransformationFlags_7 = Value;
-							break;
-						default:
-							break;
-						}
-						break;
-					case D3DTSS_COLORARG0:
-						switch (Stage)
-						{
-						case 0:
-							state->mSpecializationConstants.colorArgument0_0 = Value;
-							break;
-						case 1:
-							state->mSpecializationConstants.colorArgument0_1 = Value;
-							break;
-						case 2:
-							state->mSpecializationConstants.colorArgument0_2 = Value;
-							break;
-						case 3:
-							state->mSpecializationConstants.colorArgument0_3 = Value;
-							break;
-						case 4:
-							state->mSpecializationConstants.colorArgument0_4 = Value;
-							break;
-						case 5:
-							state->mSpecializationConstants.colorArgument0_5 = Value;
-							break;
-						case 6:
-							state->mSpecializationConstants.colorArgument0_6 = Value;
-							break;
-						case 7:
-							state->mSpecializationConstants.colorArgument0_7 = Value;
-							break;
-						default:
-							break;
-						}
-						break;
-					case D3DTSS_ALPHAARG0:
-						switch (Stage)
-						{
-						case 0:
-							state->mSpecializationConstants.alphaArgument0_0 = Value;
-							break;
-						case 1:
-							state->mSpecializationConstants.alphaArgument0_1 = Value;
-							break;
-						case 2:
-							state->mSpecializationConstants.alphaArgument0_2 = Value;
-							break;
-						case 3:
-							state->mSpecializationConstants.alphaArgument0_3 = Value;
-							break;
-						case 4:
-							state->mSpecializationConstants.alphaArgument0_4 = Value;
-							break;
-						case 5:
-							state->mSpecializationConstants.alphaArgument0_5 = Value;
-							break;
-						case 6:
-							state->mSpecializationConstants.alphaArgument0_6 = Value;
-							break;
-						case 7:
-							state->mSpecializationConstants.alphaArgument0_7 = Value;
-							break;
-						default:
-							break;
-						}
-						break;
-					case D3DTSS_RESULTARG:
-						switch (Stage)
-						{
-						case 0:
-							state->mSpecializationConstants.Result_0 = Value;
-							break;
-						case 1:
-							state->mSpecializationConstants.Result_1 = Value;
-							break;
-						case 2:
-							state->mSpecializationConstants.Result_2 = Value;
-							break;
-						case 3:
-							state->mSpecializationConstants.Result_3 = Value;
-							break;
-						case 4:
-							state->mSpecializationConstants.Result_4 = Value;
-							break;
-						case 5:
-							state->mSpecializationConstants.Result_5 = Value;
-							break;
-						case 6:
-							state->mSpecializationConstants.Result_6 = Value;
-							break;
-						case 7:
-							state->mSpecializationConstants.Result_7 = Value;
-							break;
-						default:
-							break;
-						}
-						break;
-					case D3DTSS_CONSTANT:
-						switch (Stage)
-						{
-						case 0:
-							state->mSpecializationConstants.Constant_0 = Value;
-							break;
-						case 1:
-							state->mSpecializationConstants.Constant_1 = Value;
-							break;
-						case 2:
-							state->mSpecializationConstants.Constant_2 = Value;
-							break;
-						case 3:
-							state->mSpecializationConstants.Constant_3 = Value;
-							break;
-						case 4:
-							state->mSpecializationConstants.Constant_4 = Value;
-							break;
-						case 5:
-							state->mSpecializationConstants.Constant_5 = Value;
-							break;
-						case 6:
-							state->mSpecializationConstants.Constant_6 = Value;
-							break;
-						case 7:
-							state->mSpecializationConstants.Constant_7 = Value;
-							break;
-						default:
-							break;
-						}
-						break;
-					default:
-						break;
+					IDirect3DVertexBuffer9* pStreamData = bit_cast<IDirect3DVertexBuffer9*>(workItem->Argument2);
+					UINT OffsetInBytes = bit_cast<UINT>(workItem->Argument3);
+					UINT Stride = bit_cast<UINT>(workItem->Argument4);
+
+					if (realWindow.mCurrentStateRecording != nullptr)
+					{
+						realWindow.mCurrentStateRecording->mDeviceState.SetStreamSource(StreamNumber, (CVertexBuffer9*)pStreamData, OffsetInBytes, Stride);
+					}
+					else
+					{
+						realWindow.mDeviceState.SetStreamSource(StreamNumber, (CVertexBuffer9*)pStreamData, OffsetInBytes, Stride);
+						realWindow.mBindings.DirtyFlags |= BINDING_FLAG(BindingType_VertexBuffers);
+					}
+
+					//The reference was added by CDevice9::SetStreamSource so the buffer couldn't go away while the call was queued.
+					if (pStreamData != nullptr)
+					{
+						pStreamData->Release();
+					}
+				}
+				break;
+				case Device_SetTexture:
+				{
+					auto& realWindow = (*commandStreamManager->mRenderManager.mStateManager.mWindows[workItem->Id]);
+					DWORD Sampler = bit_cast<DWORD>(workItem->Argument1);
+					IDirect3DBaseTexture9* pTexture = bit_cast<IDirect3DBaseTexture9*>(workItem->Argument2);
+
+					if (realWindow.mCurrentStateRecording != nullptr)
+					{
+						realWindow.mCurrentStateRecording->mDeviceState.SetTexture(Sampler, pTexture);
+					}
+					else
+					{
+						realWindow.mDeviceState.SetTexture(Sampler, pTexture);
+						realWindow.mBindings.DirtyFlags |= BINDING_FLAG(BindingType_Descriptors);
+					}
+
+					//The reference was added by CDevice9::SetTexture so the texture couldn't go away while the call was queued.
+					if (pTexture != nullptr)
+					{
+						pTexture->Release();
+					}
+				}
+				break;
+				case Device_SetTextureStageState:
+				{
+					auto& realWindow = (*commandStreamManager->mRenderManager.mStateManager.mWindows[workItem->Id]);
+					DWORD Stage = bit_cast<DWORD>(workItem->Argument1);
+					D3DTEXTURESTAGESTATETYPE Type = bit_cast<D3DTEXTURESTAGESTATETYPE>(workItem->Argument2);
+					DWORD Value = bit_cast<DWORD>(workItem->Argument3);
+
+					if (realWindow.mCurrentStateRecording != nullptr)
+					{
+						realWindow.mCurrentStateRecording->mDeviceState.SetTextureStageState(Stage, Type, Value);
+					}
+					else
+					{
+						realWindow.mDeviceState.SetTextureStageState(Stage, Type, Value);
 					}
 				}
 				break;
@@ -2790,13 +536,12 @@ void ProcessQueue(CommandStreamManager* commandStreamManager)
 
 					if (realWindow.mCurrentStateRecording != nullptr)
 					{
-						realWindow.mCurrentStateRecording->mDeviceState.mTransforms[State] = (*pMatrix);
-						realWindow.mCurrentStateRecording->mDeviceState.mHasTransformsChanged = true;
+						realWindow.mCurrentStateRecording->mDeviceState.SetTransform(State, pMatrix);
 					}
 					else
 					{
-						realWindow.mDeviceState.mTransforms[State] = (*pMatrix);
-						realWindow.mDeviceState.mHasTransformsChanged = true;
+						realWindow.mDeviceState.SetTransform(State, pMatrix);
+						realWindow.mBindings.DirtyFlags |= BINDING_FLAG(BindingType_PushConstants);
 					}
 				}
 				break;
@@ -2807,17 +552,17 @@ void ProcessQueue(CommandStreamManager* commandStreamManager)
 
 					if (realWindow.mCurrentStateRecording != nullptr)
 					{
-						realWindow.mCurrentStateRecording->mDeviceState.mVertexDeclaration = (CVertexDeclaration9*)pDecl;
-
-						realWindow.mCurrentStateRecording->mDeviceState.mHasVertexDeclaration = true;
-						realWindow.mCurrentStateRecording->mDeviceState.mHasFVF = false;
+						realWindow.mCurrentStateRecording->mDeviceState.SetVertexDeclaration((CVertexDeclaration9*)pDecl);
 					}
 					else
 					{
-						realWindow.mDeviceState.mVertexDeclaration = (CVertexDeclaration9*)pDecl;
+						realWindow.mDeviceState.SetVertexDeclaration((CVertexDeclaration9*)pDecl);
+					}
 
-						realWindow.mDeviceState.mHasVertexDeclaration = true;
-						realWindow.mDeviceState.mHasFVF = false;
+					//The reference was added by CDevice9::SetVertexDeclaration so the declaration couldn't go away while the call was queued.
+					if (pDecl != nullptr)
+					{
+						pDecl->Release();
 					}
 				}
 				break;
@@ -2826,16 +571,11 @@ void ProcessQueue(CommandStreamManager* commandStreamManager)
 					auto& realWindow = (*commandStreamManager->mRenderManager.mStateManager.mWindows[workItem->Id]);
 					IDirect3DVertexShader9* pShader = bit_cast<IDirect3DVertexShader9*>(workItem->Argument1);
 
-					if (pShader != nullptr)
-					{
-						pShader->AddRef();
-					}
-
+					//The reference was added by CDevice9::SetVertexShader so the shader can't go away while the call is queued.
 					if (realWindow.mCurrentStateRecording != nullptr)
 					{
 						//BOOST_LOG_TRIVIAL(info) << "Recorded VertexShader";
-						realWindow.mCurrentStateRecording->mDeviceState.mVertexShader = (CVertexShader9*)pShader;
-						realWindow.mCurrentStateRecording->mDeviceState.mHasVertexShader = true;
+						realWindow.mCurrentStateRecording->mDeviceState.SetVertexShader((CVertexShader9*)pShader);
 					}
 					else
 					{
@@ -2844,8 +584,7 @@ void ProcessQueue(CommandStreamManager* commandStreamManager)
 							realWindow.mDeviceState.mVertexShader->Release();
 						}
 
-						realWindow.mDeviceState.mVertexShader = (CVertexShader9*)pShader;
-						realWindow.mDeviceState.mHasVertexShader = true;
+						realWindow.mDeviceState.SetVertexShader((CVertexShader9*)pShader);
 					}
 				}
 				break;
@@ -2856,11 +595,7 @@ void ProcessQueue(CommandStreamManager* commandStreamManager)
 					BOOL* pConstantData = bit_cast<BOOL*>(workItem->Argument2);
 					UINT BoolCount = bit_cast<UINT>(workItem->Argument3);
 
-					auto& slots = realWindow.mDeviceState.mVertexShaderConstantSlots;
-					for (size_t i = 0; i < BoolCount; i++)
-					{
-						slots.BooleanConstants[StartRegister + i] = pConstantData[i];
-					}
+					realWindow.mDeviceState.SetVertexShaderConstantB(StartRegister, pConstantData, BoolCount);
 				}
 				break;
 				case Device_SetVertexShaderConstantF:
@@ -2870,20 +605,8 @@ void ProcessQueue(CommandStreamManager* commandStreamManager)
 					float* pConstantData = bit_cast<float*>(workItem->Argument2);
 					UINT Vector4fCount = bit_cast<UINT>(workItem->Argument3);
 
-					auto& slots = realWindow.mDeviceState.mVertexShaderConstantSlots;
-					uint32_t startIndex = (StartRegister * 4);
-					uint32_t length = (Vector4fCount * 4);
-					for (size_t i = 0; i < length; i++)
-					{
-						if ((startIndex + i) < 128)
-						{
-							realWindow.mDeviceState.mPushConstants[startIndex + i] = pConstantData[i];
-						}
-						else
-						{
-							slots.FloatConstants[startIndex + i] = pConstantData[i];
-						}
-					}
+					realWindow.mDeviceState.SetVertexShaderConstantF(StartRegister, pConstantData, Vector4fCount, commandStreamManager->mRenderManager.mStateManager.mUseShaderConstantBuffer);
+					realWindow.mBindings.DirtyFlags |= BINDING_FLAG(BindingType_PushConstants);
 				}
 				break;
 				case Device_SetVertexShaderConstantI:
@@ -2893,13 +616,7 @@ void ProcessQueue(CommandStreamManager* commandStreamManager)
 					int* pConstantData = bit_cast<int*>(workItem->Argument2);
 					UINT Vector4iCount = bit_cast<UINT>(workItem->Argument3);
 
-					auto& slots = realWindow.mDeviceState.mVertexShaderConstantSlots;
-					uint32_t startIndex = (StartRegister * 4);
-					uint32_t length = (Vector4iCount * 4);
-					for (size_t i = 0; i < length; i++)
-					{
-						slots.IntegerConstants[startIndex + i] = pConstantData[i];
-					}
+					realWindow.mDeviceState.SetVertexShaderConstantI(StartRegister, pConstantData, Vector4iCount);
 				}
 				break;
 				case Device_SetViewport:
@@ -2909,24 +626,12 @@ void ProcessQueue(CommandStreamManager* commandStreamManager)
 
 					if (realWindow.mCurrentStateRecording != nullptr)
 					{
-						realWindow.mCurrentStateRecording->mDeviceState.m9Viewport = (*pViewport);
-
-						//realWindow.mCurrentStateRecording->mDeviceState.mViewport.y = (float)mDeviceState.m9Viewport.Height;
-						realWindow.mCurrentStateRecording->mDeviceState.mViewport.width = (float)realWindow.mDeviceState.m9Viewport.Width;
-						//realWindow.mCurrentStateRecording->mDeviceState.mViewport.height = -(float)mDeviceState.m9Viewport.Height;
-						realWindow.mCurrentStateRecording->mDeviceState.mViewport.height = (float)realWindow.mDeviceState.m9Viewport.Height;
-						realWindow.mCurrentStateRecording->mDeviceState.mViewport.minDepth = realWindow.mDeviceState.m9Viewport.MinZ;
-						realWindow.mCurrentStateRecording->mDeviceState.mViewport.maxDepth = realWindow.mDeviceState.m9Viewport.MaxZ;
+						realWindow.mCurrentStateRecording->mDeviceState.SetViewport(pViewport);
 					}
 					else
 					{
-						realWindow.mDeviceState.m9Viewport = (*pViewport);
-
-						realWindow.mDeviceState.mViewport.y = (float)realWindow.mDeviceState.m9Viewport.Height;
-						realWindow.mDeviceState.mViewport.width = (float)realWindow.mDeviceState.m9Viewport.Width;
-						realWindow.mDeviceState.mViewport.height = -(float)realWindow.mDeviceState.m9Viewport.Height;
-						realWindow.mDeviceState.mViewport.minDepth = realWindow.mDeviceState.m9Viewport.MinZ;
-						realWindow.mDeviceState.mViewport.maxDepth = realWindow.mDeviceState.m9Viewport.MaxZ;
+						realWindow.mDeviceState.SetViewport(pViewport);
+						realWindow.mBindings.DirtyFlags |= BINDING_FLAG(BindingType_Viewport);
 					}
 				}
 				break;
@@ -3070,9 +775,30 @@ void ProcessQueue(CommandStreamManager* commandStreamManager)
 					VOID** ppbData = bit_cast<VOID**>(workItem->Argument3);
 					DWORD Flags = bit_cast<DWORD>(workItem->Argument4);
 
+					/*
+					DISCARD means the old contents are no longer needed so if the GPU may still be reading them the buffer gets a new backing store instead of waiting.
+					NOOVERWRITE promises not to touch anything a pending draw uses so no synchronization is needed.
+					Anything else expects the GPU to be done with the buffer before it writes to it.
+					*/
+					auto& realWindow = (*realVertexBuffer.mRealWindow);
+					bool isInUse = (realVertexBuffer.mLastUsedFrame > realWindow.mCompletedFrameNumber);
+					if ((Flags & D3DLOCK_DISCARD) == D3DLOCK_DISCARD)
+					{
+						if (isInUse && realWindow.RenameBuffer(realVertexBuffer.mBufferCreateInfo, realVertexBuffer.mBuffer, realVertexBuffer.mAllocation, realVertexBuffer.mLastUsedFrame, realVertexBuffer.mRetiredVersions))
+						{
+							realVertexBuffer.mData = nullptr;
+							realWindow.mBindings.DirtyFlags |= BINDING_FLAG(BindingType_VertexBuffers); //The bound handle is the old backing store.
+							commandStreamManager->mRenameCount++;
+						}
+					}
+					else if ((Flags & D3DLOCK_NOOVERWRITE) != D3DLOCK_NOOVERWRITE && isInUse)
+					{
+						realWindow.WaitForFrames();
+					}
+
 					if (realVertexBuffer.mData == nullptr)
 					{
-						realVertexBuffer.mData = realVertexBuffer.mRealWindow->mRealDevice->mDevice.mapMemory(realVertexBuffer.mMemory, 0, realVertexBuffer.mMemoryRequirements.size, vk::MemoryMapFlags()).value;
+						realVertexBuffer.mData = realVertexBuffer.mAllocation.Data; //Host visible memory stays mapped for the life of the buffer.
 						if (realVertexBuffer.mData == nullptr)
 						{
 							*ppbData = nullptr;
@@ -3092,11 +818,7 @@ void ProcessQueue(CommandStreamManager* commandStreamManager)
 				{
 					auto& realVertexBuffer = (*commandStreamManager->mRenderManager.mStateManager.mVertexBuffers[workItem->Id]);
 
-					if (realVertexBuffer.mData != nullptr)
-					{
-						realVertexBuffer.mRealWindow->mRealDevice->mDevice.unmapMemory(realVertexBuffer.mMemory);
-						realVertexBuffer.mData = nullptr;
-					}
+					realVertexBuffer.mData = nullptr;
 				}
 				break;
 				case IndexBuffer_Lock:
@@ -3107,9 +829,30 @@ void ProcessQueue(CommandStreamManager* commandStreamManager)
 					VOID** ppbData = bit_cast<VOID**>(workItem->Argument3);
 					DWORD Flags = bit_cast<DWORD>(workItem->Argument4);
 
+					/*
+					DISCARD means the old contents are no longer needed so if the GPU may still be reading them the buffer gets a new backing store instead of waiting.
+					NOOVERWRITE promises not to touch anything a pending draw uses so no synchronization is needed.
+					Anything else expects the GPU to be done with the buffer before it writes to it.
+					*/
+					auto& realWindow = (*realIndexBuffer.mRealWindow);
+					bool isInUse = (realIndexBuffer.mLastUsedFrame > realWindow.mCompletedFrameNumber);
+					if ((Flags & D3DLOCK_DISCARD) == D3DLOCK_DISCARD)
+					{
+						if (isInUse && realWindow.RenameBuffer(realIndexBuffer.mBufferCreateInfo, realIndexBuffer.mBuffer, realIndexBuffer.mAllocation, realIndexBuffer.mLastUsedFrame, realIndexBuffer.mRetiredVersions))
+						{
+							realIndexBuffer.mData = nullptr;
+							realWindow.mBindings.DirtyFlags |= BINDING_FLAG(BindingType_IndexBuffer); //The bound handle is the old backing store.
+							commandStreamManager->mRenameCount++;
+						}
+					}
+					else if ((Flags & D3DLOCK_NOOVERWRITE) != D3DLOCK_NOOVERWRITE && isInUse)
+					{
+						realWindow.WaitForFrames();
+					}
+
 					if (realIndexBuffer.mData == nullptr)
 					{
-						realIndexBuffer.mData = realIndexBuffer.mRealWindow->mRealDevice->mDevice.mapMemory(realIndexBuffer.mMemory, 0, realIndexBuffer.mMemoryRequirements.size, vk::MemoryMapFlags()).value;
+						realIndexBuffer.mData = realIndexBuffer.mAllocation.Data; //Host visible memory stays mapped for the life of the buffer.
 						if (realIndexBuffer.mData == nullptr)
 						{
 							(*ppbData) = nullptr;
@@ -3129,11 +872,7 @@ void ProcessQueue(CommandStreamManager* commandStreamManager)
 				{
 					auto& realIndexBuffer = (*commandStreamManager->mRenderManager.mStateManager.mIndexBuffers[workItem->Id]);
 
-					if (realIndexBuffer.mData != nullptr)
-					{
-						realIndexBuffer.mRealWindow->mRealDevice->mDevice.unmapMemory(realIndexBuffer.mMemory);
-						realIndexBuffer.mData = nullptr;
-					}
+					realIndexBuffer.mData = nullptr;
 				}
 				break;
 				case StateBlock_Create:
@@ -3162,10 +901,17 @@ void ProcessQueue(CommandStreamManager* commandStreamManager)
 					CStateBlock9* stateBlock = bit_cast<CStateBlock9*>(workItem->Argument1);
 
 					MergeState(stateBlock->mDeviceState, realWindow.mDeviceState, stateBlock->mType);
+					realWindow.mDeviceState.mArePipelineHashesDirty = true;
+					realWindow.mDeviceState.mIsRenderStateDirty = true;
+					realWindow.mDeviceState.mAreVertexShaderConstantsDirty = true;
+					realWindow.mDeviceState.mArePixelShaderConstantsDirty = true;
+					realWindow.mDeviceState.mVertexShaderConstantsSize = sizeof(ShaderConstantSlots);
+					realWindow.mDeviceState.mPixelShaderConstantsSize = sizeof(ShaderConstantSlots);
+					realWindow.mBindings.DirtyFlags = BINDING_FLAG_ALL;
 
 					if (stateBlock->mType == D3DSBT_ALL)
 					{
-						realWindow.mDeviceState.mHasTransformsChanged = true;
+						realWindow.mDeviceState.mChangedTransforms = TRANSFORM_CHANGED_ALL;
 					}
 				}
 				break;
@@ -3174,45 +920,12 @@ void ProcessQueue(CommandStreamManager* commandStreamManager)
 					auto& texture = (*commandStreamManager->mRenderManager.mStateManager.mTextures[workItem->Id]);
 					auto& realWindow = (*texture.mRealWindow);
 					CTexture9* texture9 = bit_cast<CTexture9*>(workItem->Argument1);
-					auto& device = realWindow.mRealDevice->mDevice;
 
-					vk::Result result;
 					vk::PipelineStageFlags sourceStages = vk::PipelineStageFlagBits::eTopOfPipe;
 					vk::PipelineStageFlags destinationStages = vk::PipelineStageFlagBits::eTopOfPipe;
-					vk::CommandBuffer commandBuffer;
+					vk::CommandBuffer commandBuffer = realWindow.mUploadManager->GetCommandBuffer(); //Runs ahead of the next frame along with the other uploads.
 					vk::Filter realFilter = ConvertFilter(texture9->mMipFilter);
 
-					vk::CommandBufferAllocateInfo commandBufferInfo;
-					commandBufferInfo.commandPool = realWindow.mCommandPool;
-					commandBufferInfo.level = vk::CommandBufferLevel::ePrimary;
-					commandBufferInfo.commandBufferCount = 1;
-
-					result = device.allocateCommandBuffers(&commandBufferInfo, &commandBuffer);
-					if (result != vk::Result::eSuccess)
-					{
-						BOOST_LOG_TRIVIAL(fatal) << "ProcessQueue vkAllocateCommandBuffers failed with return code of " << GetResultString((VkResult)result);
-						break;
-					}
-
-					vk::CommandBufferInheritanceInfo commandBufferInheritanceInfo;
-					commandBufferInheritanceInfo.renderPass = nullptr;
-					commandBufferInheritanceInfo.subpass = 0;
-					commandBufferInheritanceInfo.framebuffer = nullptr;
-					commandBufferInheritanceInfo.occlusionQueryEnable = VK_FALSE;
-					//commandBufferInheritanceInfo.queryFlags = 0;
-					//commandBufferInheritanceInfo.pipelineStatistics = 0;
-
-					vk::CommandBufferBeginInfo commandBufferBeginInfo;
-					//commandBufferBeginInfo.flags = 0;
-					commandBufferBeginInfo.pInheritanceInfo = &commandBufferInheritanceInfo;
-
-					result = commandBuffer.begin(&commandBufferBeginInfo);
-					if (result != vk::Result::eSuccess)
-					{
-						BOOST_LOG_TRIVIAL(fatal) << "ProcessQueue vkBeginCommandBuffer failed with return code of " << GetResultString((VkResult)result);
-						break;
-					}
-
 					vk::ImageMemoryBarrier imageMemoryBarrier;
 					//imageMemoryBarrier.srcAccessMask = 0;
 					//imageMemoryBarrier.dstAccessMask = 0;
@@ -3268,30 +981,7 @@ void ProcessQueue(CommandStreamManager* commandStreamManager)
 						commandBuffer.blitImage(texture.mImage, vk::ImageLayout::eTransferSrcOptimal, texture.mImage, vk::ImageLayout::eTransferDstOptimal, 1, &imageBlit, vk::Filter::eLinear);
 					}
 
-					commandBuffer.end();
-
-					vk::CommandBuffer commandBuffers[] = { commandBuffer };
-					vk::Fence nullFence;
-					vk::SubmitInfo submitInfo;
-					submitInfo.waitSemaphoreCount = 0;
-					submitInfo.pWaitSemaphores = nullptr;
-					submitInfo.pWaitDstStageMask = nullptr;
-					submitInfo.commandBufferCount = 1;
-					submitInfo.pCommandBuffers = commandBuffers;
-					submitInfo.signalSemaphoreCount = 0;
-					submitInfo.pSignalSemaphores = nullptr;
-
-					result = realWindow.mQueue.submit(1, &submitInfo, nullFence);
-					if (result != vk::Result::eSuccess)
-					{
-						BOOST_LOG_TRIVIAL(fatal) << "ProcessQueue vkQueueSubmit failed with return code of " << GetResultString((VkResult)result);
-						break;
-					}
-
-					realWindow.mQueue.waitIdle();
-
-					device.freeCommandBuffers(realWindow.mCommandPool, 1, commandBuffers);
-					commandBuffer = VK_NULL_HANDLE;
+					texture.mUploadSerial = realWindow.mUploadManager->mSerial;
 				}
 				break;
 				case CubeTexture_GenerateMipSubLevels:
@@ -3299,45 +989,12 @@ void ProcessQueue(CommandStreamManager* commandStreamManager)
 					auto& texture = (*commandStreamManager->mRenderManager.mStateManager.mTextures[workItem->Id]);
 					auto& realWindow = (*texture.mRealWindow);
 					CCubeTexture9* texture9 = bit_cast<CCubeTexture9*>(workItem->Argument1);
-					auto& device = realWindow.mRealDevice->mDevice;
 
-					vk::Result result;
 					vk::PipelineStageFlags sourceStages = vk::PipelineStageFlagBits::eTopOfPipe;
 					vk::PipelineStageFlags destinationStages = vk::PipelineStageFlagBits::eTopOfPipe;
-					vk::CommandBuffer commandBuffer;
+					vk::CommandBuffer commandBuffer = realWindow.mUploadManager->GetCommandBuffer(); //Runs ahead of the next frame along with the other uploads.
 					vk::Filter realFilter = ConvertFilter(texture9->mMipFilter);
 
-					vk::CommandBufferAllocateInfo commandBufferInfo;
-					commandBufferInfo.commandPool = realWindow.mCommandPool;
-					commandBufferInfo.level = vk::CommandBufferLevel::ePrimary;
-					commandBufferInfo.commandBufferCount = 1;
-
-					result = device.allocateCommandBuffers(&commandBufferInfo, &commandBuffer);
-					if (result != vk::Result::eSuccess)
-					{
-						BOOST_LOG_TRIVIAL(fatal) << "ProcessQueue vkAllocateCommandBuffers failed with return code of " << GetResultString((VkResult)result);
-						break;
-					}
-
-					vk::CommandBufferInheritanceInfo commandBufferInheritanceInfo;
-					commandBufferInheritanceInfo.renderPass = nullptr;
-					commandBufferInheritanceInfo.subpass = 0;
-					commandBufferInheritanceInfo.framebuffer = nullptr;
-					commandBufferInheritanceInfo.occlusionQueryEnable = VK_FALSE;
-					//commandBufferInheritanceInfo.queryFlags = 0;
-					//commandBufferInheritanceInfo.pipelineStatistics = 0;
-
-					vk::CommandBufferBeginInfo commandBufferBeginInfo;
-					//commandBufferBeginInfo.flags = 0;
-					commandBufferBeginInfo.pInheritanceInfo = &commandBufferInheritanceInfo;
-
-					result = commandBuffer.begin(&commandBufferBeginInfo);
-					if (result != vk::Result::eSuccess)
-					{
-						BOOST_LOG_TRIVIAL(fatal) << "ProcessQueue vkBeginCommandBuffer failed with return code of " << GetResultString((VkResult)result);
-						break;
-					}
-
 					vk::ImageMemoryBarrier imageMemoryBarrier;
 					//imageMemoryBarrier.srcAccessMask = 0;
 					//imageMemoryBarrier.dstAccessMask = 0;
@@ -3393,30 +1050,7 @@ void ProcessQueue(CommandStreamManager* commandStreamManager)
 						commandBuffer.blitImage(texture.mImage, vk::ImageLayout::eTransferSrcOptimal, texture.mImage, vk::ImageLayout::eTransferDstOptimal, 1, &imageBlit, vk::Filter::eLinear);
 					}
 
-					commandBuffer.end();
-
-					vk::CommandBuffer commandBuffers[] = { commandBuffer };
-					vk::Fence nullFence;
-					vk::SubmitInfo submitInfo;
-					submitInfo.waitSemaphoreCount = 0;
-					submitInfo.pWaitSemaphores = nullptr;
-					submitInfo.pWaitDstStageMask = nullptr;
-					submitInfo.commandBufferCount = 1;
-					submitInfo.pCommandBuffers = commandBuffers;
-					submitInfo.signalSemaphoreCount = 0;
-					submitInfo.pSignalSemaphores = nullptr;
-
-					result = realWindow.mQueue.submit(1, &submitInfo, nullFence);
-					if (result != vk::Result::eSuccess)
-					{
-						BOOST_LOG_TRIVIAL(fatal) << "ProcessQueue vkQueueSubmit failed with return code of " << GetResultString((VkResult)result);
-						break;
-					}
-
-					realWindow.mQueue.waitIdle();
-
-					device.freeCommandBuffers(realWindow.mCommandPool, 1, commandBuffers);
-					commandBuffer = VK_NULL_HANDLE;
+					texture.mUploadSerial = realWindow.mUploadManager->mSerial;
 				}
 				break;
 				case Surface_LockRect:
@@ -3424,28 +1058,16 @@ void ProcessQueue(CommandStreamManager* commandStreamManager)
 					auto& surface = (*commandStreamManager->mRenderManager.mStateManager.mSurfaces[workItem->Id]);
 					auto& realWindow = (*surface.mRealWindow);
 					//CSurface9* surface9 = bit_cast<CSurface9*>(workItem->Argument1);
-					auto& device = realWindow.mRealDevice->mDevice;
 
 					D3DLOCKED_RECT* pLockedRect = bit_cast<D3DLOCKED_RECT*>(workItem->Argument1);
 					RECT* pRect = bit_cast<RECT*>(workItem->Argument2);
 					DWORD Flags = bit_cast<DWORD>(workItem->Argument3);
 
-					vk::Result result;
 					char* bytes = nullptr;
 
 					if (surface.mData == nullptr)
 					{
-						if (surface.mIsFlushed)
-						{
-							realWindow.SetImageLayout(surface.mStagingImage, vk::ImageAspectFlags(), vk::ImageLayout::eTransferSrcOptimal, vk::ImageLayout::eGeneral); //VK_IMAGE_LAYOUT_PREINITIALIZED			
-						}
-
-						result = device.mapMemory(surface.mStagingDeviceMemory, 0, surface.mMemoryAllocateInfo.allocationSize, vk::MemoryMapFlags(), &surface.mData);
-						if (result != vk::Result::eSuccess)
-						{
-							BOOST_LOG_TRIVIAL(fatal) << "ProcessQueue vkMapMemory failed with return code of " << GetResultString((VkResult)result);
-							break;
-						}
+						surface.mData = surface.mStagingAllocation.Data; //Staging memory stays mapped for the life of the surface and flushes copy out of it on the CPU so the GPU never touches it.
 					}
 
 					bytes = (char*)surface.mData;
@@ -3472,7 +1094,6 @@ void ProcessQueue(CommandStreamManager* commandStreamManager)
 					auto& surface = (*commandStreamManager->mRenderManager.mStateManager.mSurfaces[workItem->Id]);
 					auto& realWindow = (*surface.mRealWindow);
 					CSurface9* surface9 = bit_cast<CSurface9*>(workItem->Argument1);
-					auto& device = realWindow.mRealDevice->mDevice;
 
 					if (surface.mData != nullptr)
 					{
@@ -3481,7 +1102,6 @@ void ProcessQueue(CommandStreamManager* commandStreamManager)
 							SetAlpha((char*)surface.mData, surface9->mHeight, surface9->mWidth, surface.mLayouts[0].rowPitch);
 						}
 
-						device.unmapMemory(surface.mStagingDeviceMemory);
 						surface.mData = nullptr;
 					}
 
@@ -3500,71 +1120,60 @@ void ProcessQueue(CommandStreamManager* commandStreamManager)
 					auto& realWindow = (*surface.mRealWindow);
 					CSurface9* surface9 = bit_cast<CSurface9*>(workItem->Argument1);
 					auto& texture = (*commandStreamManager->mRenderManager.mStateManager.mTextures[surface9->mTextureId]);
-					auto& device = realWindow.mRealDevice->mDevice;
-
-					vk::CommandBuffer commandBuffer;
-					vk::Result result;
+					auto& uploadManager = (*realWindow.mUploadManager);
 
-					vk::CommandBufferAllocateInfo commandBufferInfo;
-					commandBufferInfo.commandPool = realWindow.mCommandPool;
-					commandBufferInfo.level = vk::CommandBufferLevel::ePrimary;
-					commandBufferInfo.commandBufferCount = 1;
-
-					result = device.allocateCommandBuffers(&commandBufferInfo, &commandBuffer);
-					if (result != vk::Result::eSuccess)
+					/*
+					The surface is copied into the staging ring so the application can lock it again right away while the GPU copy waits for the next frame.
+					*/
+					uint32_t texelSize = GetFormatSize(surface.mRealFormat);
+					if (!texelSize)
 					{
-						BOOST_LOG_TRIVIAL(fatal) << "ProcessQueue vkAllocateCommandBuffers failed with return code of " << GetResultString((VkResult)result);
+						BOOST_LOG_TRIVIAL(error) << "ProcessQueue unable to flush a surface with format " << (VkFormat)surface.mRealFormat;
 						break;
 					}
 
-					vk::CommandBufferInheritanceInfo commandBufferInheritanceInfo;
-					commandBufferInheritanceInfo.renderPass = nullptr;
-					commandBufferInheritanceInfo.subpass = 0;
-					commandBufferInheritanceInfo.framebuffer = nullptr;
-					commandBufferInheritanceInfo.occlusionQueryEnable = VK_FALSE;
-					//commandBufferInheritanceInfo.queryFlags = 0;
-					//commandBufferInheritanceInfo.pipelineStatistics = 0;
-
-					vk::CommandBufferBeginInfo commandBufferBeginInfo;
-					//commandBufferBeginInfo.flags = 0;
-					commandBufferBeginInfo.pInheritanceInfo = &commandBufferInheritanceInfo;
+					vk::DeviceSize rowSize = surface9->mWidth * texelSize;
+					vk::DeviceSize rowPitch = surface.mLayouts[0].rowPitch;
+					vk::Buffer buffer;
+					vk::DeviceSize offset = 0;
 
-					result = commandBuffer.begin(&commandBufferBeginInfo);
-					if (result != vk::Result::eSuccess)
+					//Buffer offsets have to be a multiple of 4 and the texel size.
+					char* destination = uploadManager.Allocate(rowSize * surface9->mHeight, (texelSize == 3) ? 12 : 16, buffer, offset);
+					if (destination == nullptr)
 					{
-						BOOST_LOG_TRIVIAL(fatal) << "ProcessQueue vkBeginCommandBuffer failed with return code of " << GetResultString((VkResult)result);
 						break;
 					}
 
-					ReallySetImageLayout(commandBuffer, surface.mStagingImage, vk::ImageAspectFlags(), vk::ImageLayout::eUndefined, vk::ImageLayout::eTransferSrcOptimal, 1, 0, 1);
-					ReallySetImageLayout(commandBuffer, texture.mImage, vk::ImageAspectFlags(), vk::ImageLayout::eUndefined, vk::ImageLayout::eTransferDstOptimal, 1, surface9->mMipIndex, surface9->mTargetLayer + 1);
-					ReallyCopyImage(commandBuffer, surface.mStagingImage, texture.mImage, 0, 0, surface9->mWidth, surface9->mHeight, 0, surface9->mMipIndex, 0, surface9->mTargetLayer);
-					ReallySetImageLayout(commandBuffer, texture.mImage, vk::ImageAspectFlags(), vk::ImageLayout::eTransferDstOptimal, vk::ImageLayout::eShaderReadOnlyOptimal, 1, surface9->mMipIndex, surface9->mTargetLayer + 1);
-
-					commandBuffer.end();
-
-					vk::CommandBuffer commandBuffers[] = { commandBuffer };
-					vk::Fence nullFence;
-					vk::SubmitInfo submitInfo;
-					submitInfo.waitSemaphoreCount = 0;
-					submitInfo.pWaitSemaphores = nullptr;
-					submitInfo.pWaitDstStageMask = nullptr;
-					submitInfo.commandBufferCount = 1;
-					submitInfo.pCommandBuffers = commandBuffers;
-					submitInfo.signalSemaphoreCount = 0;
-					submitInfo.pSignalSemaphores = nullptr;
-
-					result = realWindow.mQueue.submit(1, &submitInfo, nullFence);
-					if (result != vk::Result::eSuccess)
+					const char* source = surface.mStagingAllocation.Data + surface.mLayouts[0].offset;
+					if (rowPitch == rowSize)
 					{
-						BOOST_LOG_TRIVIAL(fatal) << "ProcessQueue vkQueueSubmit failed with return code of " << GetResultString((VkResult)result);
-						break;
+						memcpy(destination, source, (size_t)(rowSize * surface9->mHeight));
+					}
+					else
+					{
+						for (uint32_t y = 0; y < surface9->mHeight; y++)
+						{
+							memcpy(destination + (rowSize * y), source + (rowPitch * y), (size_t)rowSize);
+						}
 					}
 
-					realWindow.mQueue.waitIdle();
+					vk::BufferImageCopy region;
+					region.bufferOffset = offset;
+					region.imageSubresource.aspectMask = vk::ImageAspectFlagBits::eColor;
+					region.imageSubresource.mipLevel = surface9->mMipIndex;
+					region.imageSubresource.baseArrayLayer = surface9->mTargetLayer;
+					region.imageSubresource.layerCount = 1;
+					region.imageExtent.width = surface9->mWidth;
+					region.imageExtent.height = surface9->mHeight;
+					region.imageExtent.depth = 1;
+
+					vk::CommandBuffer commandBuffer = uploadManager.GetCommandBuffer();
 
-					device.freeCommandBuffers(realWindow.mCommandPool, 1, commandBuffers);
+					ReallySetImageLayout(commandBuffer, texture.mImage, vk::ImageAspectFlags(), vk::ImageLayout::eUndefined, vk::ImageLayout::eTransferDstOptimal, 1, surface9->mMipIndex, surface9->mTargetLayer + 1);
+					commandBuffer.copyBufferToImage(buffer, texture.mImage, vk::ImageLayout::eTransferDstOptimal, 1, &region);
+					ReallySetImageLayout(commandBuffer, texture.mImage, vk::ImageAspectFlags(), vk::ImageLayout::eTransferDstOptimal, vk::ImageLayout::eShaderReadOnlyOptimal, 1, surface9->mMipIndex, surface9->mTargetLayer + 1);
 
+					texture.mUploadSerial = uploadManager.mSerial;
 					surface.mIsFlushed = true;
 				}
 				break;
@@ -3584,7 +1193,7 @@ void ProcessQueue(CommandStreamManager* commandStreamManager)
 			//	BOOST_LOG_TRIVIAL(warning) << "ProcessQueue - " << workItem->WorkItemType;
 			//}
 
-			workItem->HasBeenProcessed = true;
+			commandStreamManager->SignalWorkProcessed(workItem);
 
 			if (workItem->Caller != nullptr)
 			{
@@ -3592,27 +1201,48 @@ void ProcessQueue(CommandStreamManager* commandStreamManager)
 				workItem->Caller = nullptr;
 			}
 
-			//TODO: I'll need to revisit this later. I feel like if it's deleted too soon the application will crash. because of an access violation on the waiting thread. This might be a good spot for GC.
-
-			//Waiting on this causes a deadlock so I'll just delete.
-			if (!commandStreamManager->mUnusedWorkItems.try_enqueue(workItem))
-			{
-				delete workItem;
-			}
+			//Waiting callers watch a flag of their own so the ring space can be reused as soon as the item is done.
+			commandStreamManager->ReleaseWorkItem(workItem);
 		}
 	}
 }
 
 CommandStreamManager::CommandStreamManager()
-	: mWorkerThread(ProcessQueue, this)
 {
 	//Setup configuration & logging.
 	mOptionDescriptions.add_options()
-		("LogFile", boost::program_options::value<std::string>(), "The location of the log file.");
+		("LogFile", boost::program_options::value<std::string>(), "The location of the log file.")
+		("FramesInFlight", boost::program_options::value<uint32_t>()->default_value(2), "The number of frames the CPU can record ahead of the GPU.")
+		("ShaderConstantBuffer", boost::program_options::value<bool>()->default_value(true), "Read shader constants from a uniform buffer instead of baking them into each pipeline.")
+		("ShaderConstantRingSize", boost::program_options::value<uint32_t>()->default_value(1024), "The number of shader constant blocks that can be written per frame.")
+		("FixedFunctionArenaSize", boost::program_options::value<uint32_t>()->default_value(262144), "The number of bytes of light & material data that can be written per frame.")
+		("PipelineCacheFile", boost::program_options::value<std::string>()->default_value("VK9.cache"), "The location of the pipeline cache file. (empty to disable)")
+		("PipelineCacheSaveInterval", boost::program_options::value<uint32_t>()->default_value(60), "The number of seconds between pipeline cache saves while new pipelines are being created. (0 only saves on exit)")
+		("ShaderCacheFile", boost::program_options::value<std::string>()->default_value("VK9.shaders"), "The location of the converted shader cache file. (empty to disable)")
+		("ShaderCacheSize", boost::program_options::value<uint32_t>()->default_value(67108864), "The number of bytes the converted shader cache file can grow to before the least recently used shaders are dropped.")
+		("ShaderTranslationThreads", boost::program_options::value<uint32_t>()->default_value(4), "The number of threads converting shaders in the background. (0 converts on the command stream thread)")
+		("OptimizeShaders", boost::program_options::value<bool>()->default_value(false), "Clean up redundant loads, swizzles, and math in converted shaders before they are handed to the driver. (off until the output has been validated against more shaders)")
+		("PipelineCompileThreads", boost::program_options::value<uint32_t>()->default_value(2), "The number of threads compiling pipelines in the background. (0 compiles on the command stream thread)")
+		("PipelineCompilePolicy", boost::program_options::value<std::string>()->default_value("Fallback"), "What a draw does while its pipeline is compiling. (Wait, Skip, or Fallback)")
+		("PipelineLibraries", boost::program_options::value<bool>()->default_value(true), "Link pipelines from shared vertex input, shader and output libraries when VK_EXT_graphics_pipeline_library is available.")
+		("OptimizeLinkedPipelines", boost::program_options::value<bool>()->default_value(true), "Build an optimized copy of each linked pipeline in the background and switch to it once ready. (needs PipelineCompileThreads)")
+		("WorkerWaitStrategy", boost::program_options::value<std::string>()->default_value("Park"), "How the command stream thread and its callers wait for each other. (Spin, Yield, or Park)")
+		("WorkerSpinCount", boost::program_options::value<uint32_t>()->default_value(4000), "The number of polls before yielding or parking.")
+		("WorkerAffinityMask", boost::program_options::value<uint64_t>()->default_value(0), "The cores the command stream thread may run on. (0 leaves it to the scheduler)")
+		("WorkerPriority", boost::program_options::value<int32_t>()->default_value(0), "The command stream thread priority from -2 (lowest) to 2 (highest).")
+		("CommandRingSize", boost::program_options::value<uint32_t>()->default_value(4194304), "The number of bytes of work the command stream can fall behind by. (rounded up to a power of two)")
+		("CommandBatchSize", boost::program_options::value<uint32_t>()->default_value(64), "The number of work items recorded before they are handed to the command stream thread. (calls that wait and Present always hand them over)")
+		("MemoryBlockSize", boost::program_options::value<uint32_t>()->default_value(67108864), "The number of bytes allocated from the driver at a time and split between resources. (rounded up to a power of two, anything over half a block gets its own allocation)")
+		("UploadRingSize", boost::program_options::value<uint32_t>()->default_value(16777216), "The number of bytes of texture data that can be staged before uploads have to wait on the GPU. (anything over half the ring gets its own buffer)")
+		("SamplerCacheSize", boost::program_options::value<uint32_t>()->default_value(256), "The number of samplers to keep around before the least recently used ones are destroyed.");
 
 	boost::program_options::store(boost::program_options::parse_config_file<char>("VK9.conf", mOptionDescriptions), mOptions);
 	boost::program_options::notify(mOptions);
 
+	mRenderManager.mStateManager.mOptions = &mOptions;
+	mRenderManager.mStateManager.mUseShaderConstantBuffer = mOptions["ShaderConstantBuffer"].as<bool>();
+	mRenderManager.mStateManager.mOptimizeShaders = mOptions["OptimizeShaders"].as<bool>();
+
 	if (mOptions.count("LogFile"))
 	{
 		boost::log::add_file_log(
@@ -3635,13 +1265,52 @@ CommandStreamManager::CommandStreamManager()
 #endif
 
 	BOOST_LOG_TRIVIAL(info) << "CommandStreamManager::CommandStreamManager";
+
+	mWaitStrategy = ConvertWorkerWaitStrategy(mOptions["WorkerWaitStrategy"].as<std::string>());
+	mSpinCount = mOptions["WorkerSpinCount"].as<uint32_t>();
+
+	mCommandRing.Allocate(mOptions["CommandRingSize"].as<uint32_t>());
+	mBatchSize = mOptions["CommandBatchSize"].as<uint32_t>();
+	if (!mBatchSize)
+	{
+		mBatchSize = 1;
+	}
+
+	//The worker is started last so it never sees a half configured manager.
+	mWorkerThread = std::thread(ProcessQueue, this);
+
+	uint64_t affinityMask = mOptions["WorkerAffinityMask"].as<uint64_t>();
+	if (affinityMask && !SetThreadAffinityMask(mWorkerThread.native_handle(), (DWORD_PTR)affinityMask))
+	{
+		BOOST_LOG_TRIVIAL(warning) << "CommandStreamManager::CommandStreamManager SetThreadAffinityMask failed with error code " << GetLastError();
+	}
+
+	int32_t priority = mOptions["WorkerPriority"].as<int32_t>();
+	if (priority && !SetThreadPriority(mWorkerThread.native_handle(), priority))
+	{
+		BOOST_LOG_TRIVIAL(warning) << "CommandStreamManager::CommandStreamManager SetThreadPriority failed with error code " << GetLastError();
+	}
 }
 
 CommandStreamManager::~CommandStreamManager()
 {
+	Flush();
+
 	IsRunning = 0;
+
+	{
+		std::lock_guard<std::mutex> lock(mWorkAvailableMutex);
+	}
+	mWorkAvailable.notify_one();
+
 	mWorkerThread.join();
-	BOOST_LOG_TRIVIAL(info) << "CommandStreamManager::~CommandStreamManager";
+
+	BOOST_LOG_TRIVIAL(info) << "CommandStreamManager::~CommandStreamManager recorded " << mRecordedCount
+		<< " work items (" << mRecordedBytes << " bytes)"
+		<< " in " << mPublishCount << " batches"
+		<< " full ring stalls " << mFullCount
+		<< " heap payloads " << mHeapPayloadCount
+		<< " buffer renames " << mRenameCount;
 }
 
 size_t CommandStreamManager::RequestWork(WorkItem* workItem)
@@ -3651,7 +1320,21 @@ size_t CommandStreamManager::RequestWork(WorkItem* workItem)
 		workItem->Caller->AddRef();
 	}
 
-	while (!mWorkItems.try_enqueue(workItem)) {}
+	if (IsWorkerThread())
+	{
+		mWorkerWorkItems.push_back(workItem);
+	}
+	else
+	{
+		mRecordedCount++;
+		if (++mUnpublishedCount >= mBatchSize || workItem->WorkItemType == WorkItemType::Device_Present)
+		{
+			Flush();
+		}
+
+		//Taken in GetWorkItem, the item is complete now so other threads can record.
+		mCommandRing.mProducerMutex.unlock();
+	}
 
 	size_t key = 0;
 
@@ -3691,29 +1374,213 @@ size_t CommandStreamManager::RequestWork(WorkItem* workItem)
 
 size_t CommandStreamManager::RequestWorkAndWait(WorkItem* workItem)
 {
+	//The worker can't wait on itself so its requests just run after the current item.
+	if (IsWorkerThread())
+	{
+		return this->RequestWork(workItem);
+	}
+
+	//The work item can't be touched once it is published because its ring space may already belong to another thread's item.
+	std::atomic_bool isProcessed(false);
+	workItem->IsProcessed = &isProcessed;
+
 	size_t result = this->RequestWork(workItem);
 
-	while (!workItem->HasBeenProcessed){}
+	Flush();
+
+	if (mWaitStrategy == WorkerWaitStrategy_Spin)
+	{
+		while (!isProcessed) { YieldProcessor(); }
+		return result;
+	}
+
+	for (uint32_t i = 0; i < mSpinCount && !isProcessed; i++)
+	{
+		YieldProcessor();
+	}
 
-	/*while (mWorkItems.size_approx() > 0 || IsBusy){}*/
+	if (mWaitStrategy == WorkerWaitStrategy_Yield)
+	{
+		while (!isProcessed) { std::this_thread::yield(); }
+	}
+	else if (!isProcessed)
+	{
+		std::unique_lock<std::mutex> lock(mWorkProcessedMutex);
+		mParkedWaiters++;
+		mWorkProcessed.wait(lock, [&isProcessed] { return (bool)isProcessed; });
+		mParkedWaiters--;
+	}
 
 	return result;
 }
 
-WorkItem* CommandStreamManager::GetWorkItem(IUnknown* caller)
+void CommandStreamManager::Flush()
+{
+	std::lock_guard<std::recursive_mutex> lock(mCommandRing.mProducerMutex);
+
+	mUnpublishedCount = 0;
+
+	if (!mCommandRing.Publish())
+	{
+		return;
+	}
+
+	mPublishCount++;
+
+	/*
+	Pairs with the fence in WaitForWork. Either the worker sees the new items before parking or we see that it parked and wake it.
+	*/
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (mIsWorkerParked)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mWorkAvailableMutex);
+		}
+		mWorkAvailable.notify_one();
+	}
+}
+
+void* CommandStreamManager::WaitForSpace(size_t size)
+{
+	//The worker can only make room for what it can see.
+	Flush();
+	mFullCount++;
+
+	uint32_t spinCount = 0;
+	for (;;)
+	{
+		void* command = mCommandRing.Reserve(size);
+		if (command != nullptr)
+		{
+			return command;
+		}
+
+		if (mWaitStrategy == WorkerWaitStrategy_Spin || spinCount < mSpinCount)
+		{
+			spinCount++;
+			YieldProcessor();
+		}
+		else
+		{
+			std::this_thread::yield();
+		}
+	}
+}
+
+void CommandStreamManager::WaitForWork()
+{
+	if (mWaitStrategy == WorkerWaitStrategy_Spin)
+	{
+		return;
+	}
+
+	for (uint32_t i = 0; i < mSpinCount; i++)
+	{
+		if (!mCommandRing.IsEmpty() || !IsRunning)
+		{
+			return;
+		}
+		YieldProcessor();
+	}
+
+	if (mWaitStrategy == WorkerWaitStrategy_Yield)
+	{
+		std::this_thread::yield();
+		return;
+	}
+
+	std::unique_lock<std::mutex> lock(mWorkAvailableMutex);
+	mIsWorkerParked = true;
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	mWorkAvailable.wait(lock, [this] { return !mCommandRing.IsEmpty() || !IsRunning; });
+	mIsWorkerParked = false;
+}
+
+void CommandStreamManager::SignalWorkProcessed(WorkItem* workItem)
+{
+	if (workItem->IsProcessed == nullptr)
+	{
+		return;
+	}
+
+	*workItem->IsProcessed = true;
+	workItem->IsProcessed = nullptr;
+
+	//Only pay for the lock & wake when a caller actually went to sleep.
+	if (mParkedWaiters)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mWorkProcessedMutex);
+		}
+		mWorkProcessed.notify_all();
+	}
+}
+
+WorkItem* CommandStreamManager::GetWorkItem(IUnknown* caller, size_t payloadSize)
 {
-	WorkItem* returnValue = nullptr;
+	size_t size = sizeof(WorkItem) + payloadSize;
+	void* memory = nullptr;
+	void* heapPayload = nullptr;
 
-	if (!mUnusedWorkItems.try_dequeue(returnValue))
+	if (IsWorkerThread())
 	{
-		returnValue = new WorkItem();
+		memory = ::operator new(size);
 	}
 	else
 	{
-		returnValue->HasBeenProcessed = false;
+		//Released by RequestWork once the caller has filled in the item.
+		mCommandRing.mProducerMutex.lock();
+
+		//Payload sizes come from the caller's counts and a command that can never fit would leave WaitForSpace spinning forever.
+		if (mCommandRing.IsOversized(size))
+		{
+			heapPayload = ::operator new(payloadSize);
+			size = sizeof(WorkItem);
+			mHeapPayloadCount++;
+		}
+
+		memory = mCommandRing.Reserve(size);
+		if (memory == nullptr)
+		{
+			memory = WaitForSpace(size);
+		}
+		mRecordedBytes += mCommandRing.GetCommandSize(size);
 	}
 
+	WorkItem* returnValue = new (memory) WorkItem();
 	returnValue->Caller = caller;
+	returnValue->Payload = (heapPayload != nullptr) ? heapPayload : (returnValue + 1);
+	returnValue->IsPayloadOnHeap = (heapPayload != nullptr);
 
 	return returnValue;
+}
+
+WorkItem* CommandStreamManager::GetNextWorkItem()
+{
+	if (!mWorkerWorkItems.empty())
+	{
+		return mWorkerWorkItems.front();
+	}
+
+	return (WorkItem*)mCommandRing.Peek();
+}
+
+void CommandStreamManager::ReleaseWorkItem(WorkItem* workItem)
+{
+	workItem->~WorkItem();
+
+	if (!mWorkerWorkItems.empty() && mWorkerWorkItems.front() == workItem)
+	{
+		mWorkerWorkItems.pop_front();
+		::operator delete(workItem);
+	}
+	else
+	{
+		mCommandRing.Pop();
+	}
+}
+
+bool CommandStreamManager::IsWorkerThread() const
+{
+	return std::this_thread::get_id() == mWorkerThread.get_id();
 }
\ No newline at end of file
@@ -25,13 +25,14 @@ misrepresented as being the original software.
 #include <mutex>
 #include <condition_variable>
 #include <queue>
+#include <deque>
+#include <cstring>
 #include <boost/lockfree/queue.hpp>
 #include <boost/program_options.hpp>
 #include <boost/program_options/parsers.hpp>
 
 #include "Perf_RenderManager.h"
-
-#include "readerwriterqueue.h"
+#include "Perf_CommandRing.h"
 
 #include "d3d9.h"
 
@@ -54,28 +55,6 @@ enum WorkItemType
 	,Device_DrawPrimitive
 	,Device_EndStateBlock
 	,Device_GetDisplayMode
-	,Device_GetFVF
-	,Device_GetLight
-	,Device_GetLightEnable
-	,Device_GetMaterial
-	,Device_GetNPatchMode
-	,Device_GetPixelShader
-	,Device_GetPixelShaderConstantB
-	,Device_GetPixelShaderConstantF
-	,Device_GetPixelShaderConstantI
-	,Device_GetRenderState
-	,Device_GetSamplerState
-	,Device_GetScissorRect
-	,Device_GetStreamSource
-	,Device_GetTexture
-	,Device_GetTextureStageState
-	,Device_GetTransform
-	,Device_GetVertexDeclaration
-	,Device_GetVertexShader
-	,Device_GetVertexShaderConstantB
-	,Device_GetVertexShaderConstantF
-	,Device_GetVertexShaderConstantI
-	,Device_GetViewport
 	,Device_LightEnable
 	,Device_SetFVF
 	,Device_SetIndices
@@ -140,9 +119,44 @@ struct WorkItem
 
 	IUnknown* Caller = nullptr;
 
-	std::atomic_bool HasBeenProcessed = false;
+	//Set by RequestWorkAndWait to a flag on the caller's stack because the item's ring space can be reused before the caller sees it was processed.
+	std::atomic_bool* IsProcessed = nullptr;
+
+	//Stored right after the work item unless it was too big for the ring.
+	void* Payload = nullptr;
+	bool IsPayloadOnHeap = false;
+
+	~WorkItem()
+	{
+		if (IsPayloadOnHeap)
+		{
+			::operator delete(Payload);
+		}
+	}
+
+	/*
+	Copy of whatever the caller pointed at so calls that don't wait can return before the command stream gets to them.
+	The size has to be reserved up front with GetWorkItem.
+	*/
+	void* CopyPayload(const void* data, size_t size)
+	{
+		memcpy(Payload, data, size);
+		return Payload;
+	}
+};
+
+/*
+How the worker waits for work and how callers wait for the worker.
+*/
+enum WorkerWaitStrategy
+{
+	WorkerWaitStrategy_Spin, //Never give up the core. (lowest latency, burns a core per thread even when idle)
+	WorkerWaitStrategy_Yield, //Spin for a while and then yield the rest of the time slice.
+	WorkerWaitStrategy_Park //Spin for a while and then sleep on a condition variable until signaled.
 };
 
+WorkerWaitStrategy ConvertWorkerWaitStrategy(const std::string& strategy);
+
 struct CommandStreamManager;
 
 void ProcessQueue(CommandStreamManager* commandStreamManager);
@@ -153,23 +167,53 @@ struct CommandStreamManager
 	boost::program_options::options_description mOptionDescriptions;
 	std::thread mWorkerThread;
 	RenderManager mRenderManager;
-	//boost::lockfree::queue<WorkItem*> mWorkItems;
-	//boost::lockfree::queue<WorkItem*> mUnusedWorkItems;
 
-	//std::mutex mWorkItemMutex;
-	//std::mutex mUnusedWorkItemMutex;
-	moodycamel::ReaderWriterQueue<WorkItem*> mWorkItems;
-	moodycamel::ReaderWriterQueue<WorkItem*> mUnusedWorkItems;
+	/*
+	Work items are recorded straight into the ring along with their payload and handed to the worker in batches.
+	Any app thread can record so the ring's producer mutex is taken in GetWorkItem and only released once RequestWork is done with the item.
+	Anything requested by the worker itself (usually a destructor run by a release) can't go into the ring so it is kept aside until the current item is done.
+	*/
+	CommandRing mCommandRing;
+	std::deque<WorkItem*> mWorkerWorkItems;
+	uint32_t mBatchSize = 1; //Work items recorded before they are published to the worker.
+	uint32_t mUnpublishedCount = 0;
+
+	//Counters only touched while holding the ring's producer mutex.
+	size_t mRecordedCount = 0;
+	size_t mRecordedBytes = 0;
+	size_t mPublishCount = 0;
+	size_t mFullCount = 0;
+	size_t mHeapPayloadCount = 0; //Payloads too big for the ring.
+
+	//Counters only touched by the worker thread.
+	size_t mRenameCount = 0; //Discard locks that moved a buffer to a new backing store.
 
 	std::atomic_bool IsRunning = 1;
 	std::atomic_bool IsBusy = 0;
 
+	//Waiting
+	WorkerWaitStrategy mWaitStrategy = WorkerWaitStrategy_Park;
+	uint32_t mSpinCount = 0; //Polls before yielding or parking.
+	std::mutex mWorkAvailableMutex;
+	std::condition_variable mWorkAvailable;
+	std::atomic_bool mIsWorkerParked = 0;
+	std::mutex mWorkProcessedMutex;
+	std::condition_variable mWorkProcessed;
+	std::atomic_size_t mParkedWaiters = 0;
+
 	CommandStreamManager();
 	~CommandStreamManager();
 
 	size_t RequestWork(WorkItem* workItem);
 	size_t RequestWorkAndWait(WorkItem* workItem);
-	WorkItem* GetWorkItem(IUnknown* caller);
+	WorkItem* GetWorkItem(IUnknown* caller, size_t payloadSize = 0);
+	WorkItem* GetNextWorkItem();
+	void ReleaseWorkItem(WorkItem* workItem);
+	void Flush();
+	void* WaitForSpace(size_t size);
+	void WaitForWork();
+	void SignalWorkProcessed(WorkItem* workItem);
+	bool IsWorkerThread() const;
 };
 
 #endif // COMMANDSTREAMMANAGER_H
\ No newline at end of file
@@ -0,0 +1,372 @@
+/*
+Copyright(c) 2018 Christopher Joseph Dean Schaefer
+
+This software is provided 'as-is', without any express or implied
+warranty.In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions :
+
+1. The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software.If you use this software
+in a product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include "Perf_MemoryAllocator.h"
+
+#include <boost/log/core.hpp>
+#include <boost/log/trivial.hpp>
+
+#include "Utilities.h"
+
+MemoryAllocator::MemoryAllocator(vk::Device& device, const vk::PhysicalDeviceMemoryProperties& memoryProperties, const vk::PhysicalDeviceLimits& limits, vk::DeviceSize blockSize)
+	: mDevice(device),
+	mMemoryProperties(memoryProperties),
+	mMaxAllocationCount(limits.maxMemoryAllocationCount)
+{
+	mBlockSize = MEMORY_MINIMUM_ALLOCATION;
+	mOrderCount = 1;
+	while (mBlockSize < blockSize)
+	{
+		mBlockSize <<= 1;
+		mOrderCount++;
+	}
+
+	BOOST_LOG_TRIVIAL(info) << "MemoryAllocator::MemoryAllocator using " << mBlockSize << " byte blocks with a limit of " << mMaxAllocationCount << " device allocations.";
+}
+
+MemoryAllocator::~MemoryAllocator()
+{
+	LogStatistics(true);
+
+	if (mAllocationCount)
+	{
+		BOOST_LOG_TRIVIAL(warning) << "MemoryAllocator::~MemoryAllocator " << mAllocationCount << " allocation(s) were not freed.";
+	}
+
+	for (size_t i = 0; i < VK_MAX_MEMORY_TYPES; i++)
+	{
+		for (size_t j = 0; j < 2; j++)
+		{
+			for (auto& block : mPools[i][j].Blocks)
+			{
+				FreeDeviceMemory(block->Memory, block->Data);
+			}
+			mPools[i][j].Blocks.clear();
+		}
+	}
+}
+
+bool MemoryAllocator::Allocate(const vk::MemoryRequirements& memoryRequirements, vk::MemoryPropertyFlags properties, bool isLinear, MemoryAllocation& allocation)
+{
+	uint32_t memoryTypeIndex = 0;
+	if (!GetMemoryTypeFromProperties(mMemoryProperties, memoryRequirements.memoryTypeBits, properties, &memoryTypeIndex))
+	{
+		BOOST_LOG_TRIVIAL(fatal) << "MemoryAllocator::Allocate Could not find memory type from properties.";
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(mMutex);
+	auto& pool = mPools[memoryTypeIndex][isLinear];
+
+	allocation.MemoryTypeIndex = memoryTypeIndex;
+	allocation.IsLinear = isLinear;
+	allocation.Size = memoryRequirements.size;
+	allocation.Offset = 0;
+	allocation.Block = nullptr;
+
+	//Anything over half a block would waste most of it so it gets its own memory.
+	if (memoryRequirements.size > (mBlockSize >> 1) || memoryRequirements.alignment > mBlockSize)
+	{
+		if (!AllocateDeviceMemory(memoryTypeIndex, memoryRequirements.size, allocation.Memory, allocation.Data))
+		{
+			return false;
+		}
+
+		pool.DedicatedCount++;
+		pool.DedicatedSize += memoryRequirements.size;
+		mAllocationCount++;
+		mTotalAllocationCount++;
+
+		return true;
+	}
+
+	uint32_t order = 0;
+	vk::DeviceSize rangeSize = MEMORY_MINIMUM_ALLOCATION;
+	while (rangeSize < memoryRequirements.size || rangeSize < memoryRequirements.alignment)
+	{
+		rangeSize <<= 1;
+		order++;
+	}
+
+	MemoryBlock* block = nullptr;
+	vk::DeviceSize offset = 0;
+
+	for (auto& existingBlock : pool.Blocks)
+	{
+		if (AllocateFromBlock(*existingBlock, order, offset))
+		{
+			block = existingBlock.get();
+			break;
+		}
+	}
+
+	if (block == nullptr)
+	{
+		std::unique_ptr<MemoryBlock> newBlock(new MemoryBlock());
+		newBlock->Size = mBlockSize;
+		newBlock->FreeOffsets.resize(mOrderCount);
+		newBlock->FreeOffsets[mOrderCount - 1].insert(0);
+
+		if (!AllocateDeviceMemory(memoryTypeIndex, mBlockSize, newBlock->Memory, newBlock->Data))
+		{
+			return false;
+		}
+
+		block = newBlock.get();
+		pool.Blocks.push_back(std::move(newBlock));
+
+		AllocateFromBlock(*block, order, offset);
+	}
+
+	block->AllocatedSize += rangeSize;
+	block->AllocationCount++;
+
+	allocation.Memory = block->Memory;
+	allocation.Offset = offset;
+	allocation.Data = (block->Data != nullptr) ? (block->Data + offset) : nullptr;
+	allocation.Block = block;
+	allocation.Order = order;
+
+	mAllocationCount++;
+	mTotalAllocationCount++;
+
+	return true;
+}
+
+void MemoryAllocator::Free(MemoryAllocation& allocation)
+{
+	if (!allocation.Memory)
+	{
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(mMutex);
+	auto& pool = mPools[allocation.MemoryTypeIndex][allocation.IsLinear];
+
+	if (allocation.Block == nullptr)
+	{
+		FreeDeviceMemory(allocation.Memory, allocation.Data);
+		pool.DedicatedCount--;
+		pool.DedicatedSize -= allocation.Size;
+	}
+	else
+	{
+		auto& block = (*allocation.Block);
+		FreeToBlock(block, allocation.Order, allocation.Offset);
+		block.AllocatedSize -= ((vk::DeviceSize)MEMORY_MINIMUM_ALLOCATION << allocation.Order);
+		block.AllocationCount--;
+
+		//Keep one empty block around so a level load that frees everything and starts again doesn't go back to the driver.
+		if (!block.AllocationCount && pool.Blocks.size() > 1)
+		{
+			for (auto it = pool.Blocks.begin(); it != pool.Blocks.end(); ++it)
+			{
+				if (it->get() == &block)
+				{
+					FreeDeviceMemory(block.Memory, block.Data);
+					pool.Blocks.erase(it);
+					break;
+				}
+			}
+		}
+	}
+
+	mAllocationCount--;
+	allocation = MemoryAllocation();
+}
+
+void MemoryAllocator::LogStatistics(bool force)
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+
+	if (mTotalAllocationCount == mLastLoggedCount && !force)
+	{
+		return;
+	}
+
+	auto now = std::chrono::steady_clock::now();
+	if (!force && std::chrono::duration_cast<std::chrono::seconds>(now - mLastLog).count() < 5)
+	{
+		return;
+	}
+
+	for (size_t i = 0; i < VK_MAX_MEMORY_TYPES; i++)
+	{
+		for (size_t j = 0; j < 2; j++)
+		{
+			auto& pool = mPools[i][j];
+			if (pool.Blocks.empty() && !pool.DedicatedCount)
+			{
+				continue;
+			}
+
+			vk::DeviceSize reservedSize = 0;
+			vk::DeviceSize allocatedSize = 0;
+			vk::DeviceSize largestFreeSize = 0;
+			size_t allocationCount = 0;
+
+			for (auto& block : pool.Blocks)
+			{
+				reservedSize += block->Size;
+				allocatedSize += block->AllocatedSize;
+				allocationCount += block->AllocationCount;
+
+				for (uint32_t order = mOrderCount; order > 0; order--)
+				{
+					if (!block->FreeOffsets[order - 1].empty())
+					{
+						vk::DeviceSize freeSize = ((vk::DeviceSize)MEMORY_MINIMUM_ALLOCATION << (order - 1));
+						if (freeSize > largestFreeSize)
+						{
+							largestFreeSize = freeSize;
+						}
+						break;
+					}
+				}
+			}
+
+			//How much of the free space can't be handed out as one range. (0% means all of it can)
+			vk::DeviceSize freeSize = reservedSize - allocatedSize;
+			uint64_t fragmentation = freeSize ? (100 - ((largestFreeSize * 100) / freeSize)) : 0;
+
+			BOOST_LOG_TRIVIAL(info) << "MemoryAllocator::LogStatistics memory type " << i << (j ? " linear" : " optimal")
+				<< " blocks " << pool.Blocks.size()
+				<< " used " << allocatedSize << "/" << reservedSize
+				<< " allocations " << allocationCount
+				<< " largest free " << largestFreeSize
+				<< " fragmentation " << fragmentation << "%"
+				<< " dedicated " << pool.DedicatedCount << " (" << pool.DedicatedSize << " bytes)";
+		}
+	}
+
+	BOOST_LOG_TRIVIAL(info) << "MemoryAllocator::LogStatistics allocations " << mAllocationCount
+		<< " device allocations " << mDeviceAllocationCount
+		<< " max device allocations " << mMaxDeviceAllocationCount << "/" << mMaxAllocationCount;
+
+	mLastLoggedCount = mTotalAllocationCount;
+	mLastLog = now;
+}
+
+bool MemoryAllocator::AllocateDeviceMemory(uint32_t memoryTypeIndex, vk::DeviceSize size, vk::DeviceMemory& memory, char*& data)
+{
+	if (mMaxAllocationCount && mDeviceAllocationCount >= mMaxAllocationCount)
+	{
+		BOOST_LOG_TRIVIAL(fatal) << "MemoryAllocator::AllocateDeviceMemory maxMemoryAllocationCount of " << mMaxAllocationCount << " reached.";
+		return false;
+	}
+
+	vk::MemoryAllocateInfo memoryAllocateInfo;
+	memoryAllocateInfo.allocationSize = size;
+	memoryAllocateInfo.memoryTypeIndex = memoryTypeIndex;
+
+	vk::Result result = mDevice.allocateMemory(&memoryAllocateInfo, nullptr, &memory);
+	if (result != vk::Result::eSuccess)
+	{
+		BOOST_LOG_TRIVIAL(fatal) << "MemoryAllocator::AllocateDeviceMemory vkAllocateMemory failed with return code of " << GetResultString((VkResult)result);
+		return false;
+	}
+
+	data = nullptr;
+	if (mMemoryProperties.memoryTypes[memoryTypeIndex].propertyFlags & vk::MemoryPropertyFlagBits::eHostVisible)
+	{
+		void* mappedData = nullptr;
+		result = mDevice.mapMemory(memory, 0, VK_WHOLE_SIZE, vk::MemoryMapFlags(), &mappedData);
+		if (result != vk::Result::eSuccess)
+		{
+			BOOST_LOG_TRIVIAL(fatal) << "MemoryAllocator::AllocateDeviceMemory vkMapMemory failed with return code of " << GetResultString((VkResult)result);
+			mDevice.freeMemory(memory, nullptr);
+			memory = nullptr;
+			return false;
+		}
+		data = (char*)mappedData;
+	}
+
+	mDeviceAllocationCount++;
+	if (mDeviceAllocationCount > mMaxDeviceAllocationCount)
+	{
+		mMaxDeviceAllocationCount = mDeviceAllocationCount;
+	}
+
+	return true;
+}
+
+void MemoryAllocator::FreeDeviceMemory(vk::DeviceMemory& memory, char* data)
+{
+	if (data != nullptr)
+	{
+		mDevice.unmapMemory(memory);
+	}
+
+	mDevice.freeMemory(memory, nullptr);
+	memory = nullptr;
+	mDeviceAllocationCount--;
+}
+
+bool MemoryAllocator::AllocateFromBlock(MemoryBlock& block, uint32_t order, vk::DeviceSize& offset)
+{
+	uint32_t freeOrder = order;
+	while (freeOrder < mOrderCount && block.FreeOffsets[freeOrder].empty())
+	{
+		freeOrder++;
+	}
+
+	if (freeOrder == mOrderCount)
+	{
+		return false;
+	}
+
+	//Taking the lowest offset keeps allocations packed towards the start of the block.
+	auto& freeOffsets = block.FreeOffsets[freeOrder];
+	offset = (*freeOffsets.begin());
+	freeOffsets.erase(freeOffsets.begin());
+
+	//Split the range in half until it is the size requested, the upper halves become free ranges.
+	while (freeOrder > order)
+	{
+		freeOrder--;
+		block.FreeOffsets[freeOrder].insert(offset + ((vk::DeviceSize)MEMORY_MINIMUM_ALLOCATION << freeOrder));
+	}
+
+	return true;
+}
+
+void MemoryAllocator::FreeToBlock(MemoryBlock& block, uint32_t order, vk::DeviceSize offset)
+{
+	//Merge with the other half of the parent range for as long as it is also free.
+	while (order + 1 < mOrderCount)
+	{
+		vk::DeviceSize buddyOffset = offset ^ ((vk::DeviceSize)MEMORY_MINIMUM_ALLOCATION << order);
+		auto& freeOffsets = block.FreeOffsets[order];
+		auto it = freeOffsets.find(buddyOffset);
+		if (it == freeOffsets.end())
+		{
+			break;
+		}
+
+		freeOffsets.erase(it);
+		if (buddyOffset < offset)
+		{
+			offset = buddyOffset;
+		}
+		order++;
+	}
+
+	block.FreeOffsets[order].insert(offset);
+}
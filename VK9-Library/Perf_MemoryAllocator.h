@@ -0,0 +1,101 @@
+/*
+Copyright(c) 2018 Christopher Joseph Dean Schaefer
+
+This software is provided 'as-is', without any express or implied
+warranty.In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions :
+
+1. The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software.If you use this software
+in a product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include <memory>
+#include <vector>
+#include <chrono>
+#include <mutex>
+#include <boost/container/flat_set.hpp>
+#include <vulkan/vulkan.hpp>
+
+#ifndef MEMORYALLOCATOR_H
+#define MEMORYALLOCATOR_H
+
+#define MEMORY_MINIMUM_ALLOCATION 256
+
+/*
+One vkAllocateMemory call split up with a buddy allocator.
+Every free range is a power of two in size and aligned to its size so any alignment up to the block size comes for free.
+*/
+struct MemoryBlock
+{
+	vk::DeviceMemory Memory;
+	char* Data = nullptr; //Mapped for the life of the block if the memory is host visible.
+	vk::DeviceSize Size = 0;
+	vk::DeviceSize AllocatedSize = 0;
+	size_t AllocationCount = 0;
+	std::vector< boost::container::flat_set<vk::DeviceSize> > FreeOffsets; //Indexed by order. (range size is MEMORY_MINIMUM_ALLOCATION << order)
+};
+
+/*
+Blocks for one memory type. Linear and optimal resources get separate pools so bufferImageGranularity never has to be considered.
+*/
+struct MemoryPool
+{
+	std::vector< std::unique_ptr<MemoryBlock> > Blocks;
+	vk::DeviceSize DedicatedSize = 0;
+	size_t DedicatedCount = 0;
+};
+
+struct MemoryAllocation
+{
+	vk::DeviceMemory Memory;
+	vk::DeviceSize Offset = 0;
+	vk::DeviceSize Size = 0;
+	char* Data = nullptr; //Null unless the memory is host visible.
+	MemoryBlock* Block = nullptr; //Null for dedicated allocations.
+	uint32_t Order = 0;
+	uint32_t MemoryTypeIndex = 0;
+	bool IsLinear = true;
+};
+
+struct MemoryAllocator
+{
+	vk::Device mDevice;
+	vk::PhysicalDeviceMemoryProperties mMemoryProperties;
+	vk::DeviceSize mBlockSize = 0; //Always a power of two.
+	uint32_t mOrderCount = 0;
+	uint32_t mMaxAllocationCount = 0;
+
+	std::mutex mMutex;
+	MemoryPool mPools[VK_MAX_MEMORY_TYPES][2]; //Optimal & linear.
+
+	//Counters guarded by mMutex.
+	size_t mDeviceAllocationCount = 0; //Live vkAllocateMemory calls.
+	size_t mMaxDeviceAllocationCount = 0;
+	size_t mAllocationCount = 0;
+	size_t mTotalAllocationCount = 0;
+	size_t mLastLoggedCount = 0;
+	std::chrono::steady_clock::time_point mLastLog = std::chrono::steady_clock::now();
+
+	MemoryAllocator(vk::Device& device, const vk::PhysicalDeviceMemoryProperties& memoryProperties, const vk::PhysicalDeviceLimits& limits, vk::DeviceSize blockSize);
+	~MemoryAllocator();
+
+	bool Allocate(const vk::MemoryRequirements& memoryRequirements, vk::MemoryPropertyFlags properties, bool isLinear, MemoryAllocation& allocation);
+	void Free(MemoryAllocation& allocation);
+	void LogStatistics(bool force = false);
+
+	bool AllocateDeviceMemory(uint32_t memoryTypeIndex, vk::DeviceSize size, vk::DeviceMemory& memory, char*& data);
+	void FreeDeviceMemory(vk::DeviceMemory& memory, char* data);
+	bool AllocateFromBlock(MemoryBlock& block, uint32_t order, vk::DeviceSize& offset);
+	void FreeToBlock(MemoryBlock& block, uint32_t order, vk::DeviceSize offset);
+};
+
+#endif // MEMORYALLOCATOR_H
@@ -0,0 +1,776 @@
+/*
+Copyright(c) 2018 Christopher Joseph Dean Schaefer
+
+This software is provided 'as-is', without any express or implied
+warranty.In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions :
+
+1. The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software.If you use this software
+in a product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include "Perf_PipelineCompiler.h"
+#include "Perf_StateManager.h"
+
+#include <boost/log/core.hpp>
+#include <boost/log/trivial.hpp>
+
+#include "Utilities.h"
+
+PipelineCompilePolicy ConvertPipelineCompilePolicy(const std::string& policy)
+{
+	if (policy == "Wait")
+	{
+		return PipelineCompilePolicy_Wait;
+	}
+	else if (policy == "Skip")
+	{
+		return PipelineCompilePolicy_Skip;
+	}
+	else if (policy == "Fallback")
+	{
+		return PipelineCompilePolicy_Fallback;
+	}
+
+	BOOST_LOG_TRIVIAL(warning) << "ConvertPipelineCompilePolicy unknown policy " << policy << " using Wait instead.";
+	return PipelineCompilePolicy_Wait;
+}
+
+static bool IsDynamic(const vk::PipelineDynamicStateCreateInfo& pipelineDynamicStateCreateInfo, VkDynamicState state)
+{
+	for (uint32_t i = 0; i < pipelineDynamicStateCreateInfo.dynamicStateCount; i++)
+	{
+		if ((VkDynamicState)pipelineDynamicStateCreateInfo.pDynamicStates[i] == state)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void PipelineLibraryKey::Add(uint64_t value)
+{
+	Hash = HashCombine(Hash, value);
+	State.push_back(value);
+}
+
+void PipelineLibraryKey::AddFloat(float value)
+{
+	uint32_t word;
+	memcpy(&word, &value, sizeof(uint32_t));
+	Add(word);
+}
+
+static void AddShaderStage(PipelineLibraryKey& key, const PipelineCompileJob& job, vk::ShaderStageFlagBits stage)
+{
+	for (uint32_t i = 0; i < job.GraphicsPipelineCreateInfo.stageCount; i++)
+	{
+		const auto& pipelineShaderStageCreateInfo = job.PipelineShaderStageCreateInfo[i];
+		if (pipelineShaderStageCreateInfo.stage != stage)
+		{
+			continue;
+		}
+
+		/*
+		A module handle can be reused once the shader is destroyed so converted shaders are keyed by their disk key as well. (fixed function modules live as long as the window)
+		Libraries are evicted when their shader is destroyed so among the rest the handle tells apart two live shaders whose disk keys collide.
+		*/
+		key.Add(job.Context->ShaderKeys[(stage == vk::ShaderStageFlagBits::eVertex) ? 0 : 1]);
+		key.Add((uint64_t)(VkShaderModule)pipelineShaderStageCreateInfo.module);
+
+		const auto specializationInfo = pipelineShaderStageCreateInfo.pSpecializationInfo;
+		if (specializationInfo != nullptr && specializationInfo->dataSize)
+		{
+			key.Add(specializationInfo->mapEntryCount);
+			key.Add(specializationInfo->dataSize);
+
+			const char* data = (const char*)specializationInfo->pData;
+			for (size_t offset = 0; offset < specializationInfo->dataSize; offset += sizeof(uint64_t))
+			{
+				uint64_t word = 0;
+				memcpy(&word, data + offset, min(sizeof(uint64_t), specializationInfo->dataSize - offset));
+				key.Add(word);
+			}
+		}
+	}
+}
+
+static void AddDescriptorLayout(PipelineLibraryKey& key, const PipelineCompileJob& job)
+{
+	key.Add(job.Context->DescriptorLayout.size());
+	for (auto word : job.Context->DescriptorLayout)
+	{
+		key.Add(word);
+	}
+}
+
+/*
+Links the job's libraries into a complete pipeline. Without any flags this is the fast link that skips most of the driver's optimizations.
+*/
+static VkResult LinkLibraries(vk::Device& device, vk::PipelineCache& pipelineCache, PipelineCompileJob& job, VkPipelineCreateFlags flags, VkPipeline& pipeline)
+{
+	VkPipelineLibraryCreateInfoKHR pipelineLibraryCreateInfo = {};
+	pipelineLibraryCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LIBRARY_CREATE_INFO_KHR;
+	pipelineLibraryCreateInfo.libraryCount = PipelineLibraryType_Count;
+	pipelineLibraryCreateInfo.pLibraries = (const VkPipeline*)job.Libraries;
+
+	VkGraphicsPipelineCreateInfo graphicsPipelineCreateInfo = {};
+	graphicsPipelineCreateInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+	graphicsPipelineCreateInfo.pNext = &pipelineLibraryCreateInfo;
+	graphicsPipelineCreateInfo.flags = flags;
+	graphicsPipelineCreateInfo.layout = (VkPipelineLayout)job.GraphicsPipelineCreateInfo.layout;
+
+	return vkCreateGraphicsPipelines((VkDevice)device, (VkPipelineCache)pipelineCache, 1, &graphicsPipelineCreateInfo, nullptr, &pipeline);
+}
+
+PipelineCompileJob::PipelineCompileJob(std::shared_ptr<DrawContext>& context, const vk::GraphicsPipelineCreateInfo& graphicsPipelineCreateInfo)
+	: Context(context),
+	QueuedAt(std::chrono::steady_clock::now()),
+	GraphicsPipelineCreateInfo(graphicsPipelineCreateInfo)
+{
+	/*
+	The window reuses its create info structures for every pipeline so anything that can change between draws is copied here.
+	Specialization data lives in the draw context and map entries / dynamic states never change so those pointers can be kept as is.
+	*/
+	for (uint32_t i = 0; i < graphicsPipelineCreateInfo.stageCount; i++)
+	{
+		PipelineShaderStageCreateInfo[i] = graphicsPipelineCreateInfo.pStages[i];
+		if (PipelineShaderStageCreateInfo[i].pSpecializationInfo != nullptr)
+		{
+			SpecializationInfo[i] = (*PipelineShaderStageCreateInfo[i].pSpecializationInfo);
+			PipelineShaderStageCreateInfo[i].pSpecializationInfo = &SpecializationInfo[i];
+		}
+	}
+	GraphicsPipelineCreateInfo.pStages = PipelineShaderStageCreateInfo;
+
+	PipelineVertexInputStateCreateInfo = (*graphicsPipelineCreateInfo.pVertexInputState);
+	memcpy(VertexInputBindingDescription, PipelineVertexInputStateCreateInfo.pVertexBindingDescriptions, sizeof(vk::VertexInputBindingDescription) * PipelineVertexInputStateCreateInfo.vertexBindingDescriptionCount);
+	memcpy(VertexInputAttributeDescription, PipelineVertexInputStateCreateInfo.pVertexAttributeDescriptions, sizeof(vk::VertexInputAttributeDescription) * PipelineVertexInputStateCreateInfo.vertexAttributeDescriptionCount);
+	PipelineVertexInputStateCreateInfo.pVertexBindingDescriptions = VertexInputBindingDescription;
+	PipelineVertexInputStateCreateInfo.pVertexAttributeDescriptions = VertexInputAttributeDescription;
+	GraphicsPipelineCreateInfo.pVertexInputState = &PipelineVertexInputStateCreateInfo;
+
+	PipelineInputAssemblyStateCreateInfo = (*graphicsPipelineCreateInfo.pInputAssemblyState);
+	GraphicsPipelineCreateInfo.pInputAssemblyState = &PipelineInputAssemblyStateCreateInfo;
+
+	PipelineViewportStateCreateInfo = (*graphicsPipelineCreateInfo.pViewportState);
+	GraphicsPipelineCreateInfo.pViewportState = &PipelineViewportStateCreateInfo;
+
+	PipelineRasterizationStateCreateInfo = (*graphicsPipelineCreateInfo.pRasterizationState);
+	GraphicsPipelineCreateInfo.pRasterizationState = &PipelineRasterizationStateCreateInfo;
+
+	PipelineMultisampleStateCreateInfo = (*graphicsPipelineCreateInfo.pMultisampleState);
+	GraphicsPipelineCreateInfo.pMultisampleState = &PipelineMultisampleStateCreateInfo;
+
+	PipelineDepthStencilStateCreateInfo = (*graphicsPipelineCreateInfo.pDepthStencilState);
+	GraphicsPipelineCreateInfo.pDepthStencilState = &PipelineDepthStencilStateCreateInfo;
+
+	PipelineColorBlendStateCreateInfo = (*graphicsPipelineCreateInfo.pColorBlendState);
+	PipelineColorBlendAttachmentState[0] = PipelineColorBlendStateCreateInfo.pAttachments[0];
+	PipelineColorBlendStateCreateInfo.pAttachments = PipelineColorBlendAttachmentState;
+	GraphicsPipelineCreateInfo.pColorBlendState = &PipelineColorBlendStateCreateInfo;
+
+	PipelineDynamicStateCreateInfo = (*graphicsPipelineCreateInfo.pDynamicState);
+	GraphicsPipelineCreateInfo.pDynamicState = &PipelineDynamicStateCreateInfo;
+}
+
+PipelineCompiler::PipelineCompiler(vk::Device& device, vk::PipelineCache& pipelineCache, uint32_t threadCount, PipelineCompilePolicy policy)
+	: mDevice(device),
+	mPipelineCache(pipelineCache),
+	mPolicy(policy)
+{
+	for (uint32_t i = 0; i < threadCount; i++)
+	{
+		mThreads.push_back(std::thread(&PipelineCompiler::Run, this));
+	}
+
+	BOOST_LOG_TRIVIAL(info) << "PipelineCompiler::PipelineCompiler using " << threadCount << " compile thread(s).";
+}
+
+PipelineCompiler::~PipelineCompiler()
+{
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mIsRunning = false;
+	}
+	mJobQueued.notify_all();
+
+	//The threads finish whatever is queued before exiting so no pipeline is left half built. (optimizations that haven't started are dropped)
+	for (auto& thread : mThreads)
+	{
+		thread.join();
+	}
+	mOptimizeJobs.clear();
+
+	LogStatistics();
+
+	for (auto& libraries : mLibraries)
+	{
+		for (auto& library : libraries)
+		{
+			mDevice.destroyPipeline(library.second.Pipeline, nullptr);
+		}
+		libraries.clear();
+	}
+
+	for (auto& library : mRetiredLibraries)
+	{
+		mDevice.destroyPipeline(library, nullptr);
+	}
+	mRetiredLibraries.clear();
+}
+
+void PipelineCompiler::Compile(std::shared_ptr<DrawContext>& context, const vk::GraphicsPipelineCreateInfo& graphicsPipelineCreateInfo)
+{
+	if (mThreads.empty())
+	{
+		PipelineCompileJob job(context, graphicsPipelineCreateInfo);
+		Execute(job);
+		return;
+	}
+
+	context->IsCompiling = true;
+	std::unique_ptr<PipelineCompileJob> job(new PipelineCompileJob(context, graphicsPipelineCreateInfo));
+
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mJobs.push_back(std::move(job));
+
+		size_t queueDepth = mJobs.size() + mActiveJobs;
+		if (queueDepth > mMaxQueueDepth)
+		{
+			mMaxQueueDepth = queueDepth;
+		}
+	}
+	mJobQueued.notify_one();
+}
+
+void PipelineCompiler::Wait(DrawContext& context)
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	mJobFinished.wait(lock, [&context] { return !context.IsCompiling; });
+}
+
+void PipelineCompiler::WaitIdle()
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	mJobFinished.wait(lock, [this] { return mJobs.empty() && !mActiveJobs; });
+}
+
+void PipelineCompiler::LogStatistics()
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+
+	if (mCompiledCount == mLastLoggedCount)
+	{
+		return;
+	}
+
+	auto now = std::chrono::steady_clock::now();
+	if (mIsRunning && std::chrono::duration_cast<std::chrono::seconds>(now - mLastLog).count() < 5)
+	{
+		return;
+	}
+
+	BOOST_LOG_TRIVIAL(info) << "PipelineCompiler::LogStatistics compiled " << mCompiledCount
+		<< " average latency " << (mTotalLatency / mCompiledCount) << "us"
+		<< " max latency " << mMaxLatency << "us"
+		<< " max queue depth " << mMaxQueueDepth
+		<< " waits " << mWaitCount
+		<< " skips " << mSkipCount
+		<< " fallbacks " << mFallbackCount
+		<< " libraries " << mLibraryCount
+		<< " linked " << mLinkedCount
+		<< " optimized " << mOptimizedCount;
+
+	mLastLoggedCount = mCompiledCount;
+	mLastLog = now;
+}
+
+void PipelineCompiler::Run()
+{
+	for (;;)
+	{
+		std::unique_ptr<PipelineCompileJob> job;
+		bool isOptimizing = false;
+
+		{
+			std::unique_lock<std::mutex> lock(mMutex);
+			mJobQueued.wait(lock, [this] { return !mIsRunning || !mJobs.empty() || !mOptimizeJobs.empty(); });
+
+			if (!mJobs.empty())
+			{
+				job = std::move(mJobs.front());
+				mJobs.pop_front();
+			}
+			else if (mIsRunning && !mOptimizeJobs.empty())
+			{
+				job = std::move(mOptimizeJobs.front());
+				mOptimizeJobs.pop_front();
+				isOptimizing = true;
+			}
+			else
+			{
+				return;
+			}
+
+			mActiveJobs++;
+		}
+
+		if (isOptimizing)
+		{
+			Optimize(*job);
+		}
+		else
+		{
+			Execute(*job);
+
+			//The linked pipeline is already in use so the optimized one waits until nothing new needs building.
+			if (mOptimizeLinkedPipelines && job->Libraries[0] != vk::Pipeline())
+			{
+				{
+					std::lock_guard<std::mutex> lock(mMutex);
+					mOptimizeJobs.push_back(std::move(job));
+				}
+				mJobQueued.notify_one();
+			}
+		}
+
+		job.reset(); //May release the last reference to the context so do it before the window thinks we are idle.
+
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mActiveJobs--;
+		}
+		mJobFinished.notify_all();
+	}
+}
+
+void PipelineCompiler::Execute(PipelineCompileJob& job)
+{
+	//Linking only compiles the libraries that haven't been seen before so the full compile is only used when that fails.
+	if (!mUsePipelineLibraries || !Link(job))
+	{
+		vk::Result result = mDevice.createGraphicsPipelines(mPipelineCache, 1, &job.GraphicsPipelineCreateInfo, nullptr, &job.Context->Pipeline);
+		if (result != vk::Result::eSuccess)
+		{
+			BOOST_LOG_TRIVIAL(fatal) << "PipelineCompiler::Execute vkCreateGraphicsPipelines failed with return code of " << GetResultString((VkResult)result);
+		}
+	}
+
+	uint64_t latency = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - job.QueuedAt).count();
+
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mCompiledCount++;
+		mTotalLatency += latency;
+		if (latency > mMaxLatency)
+		{
+			mMaxLatency = latency;
+		}
+		job.Context->IsCompiling = false;
+	}
+	mJobFinished.notify_all();
+}
+
+bool PipelineCompiler::Link(PipelineCompileJob& job)
+{
+	for (size_t i = 0; i < PipelineLibraryType_Count; i++)
+	{
+		job.Libraries[i] = GetLibrary(job, (PipelineLibraryType)i);
+		if (job.Libraries[i] == vk::Pipeline())
+		{
+			job.Libraries[0] = vk::Pipeline();
+			return false;
+		}
+	}
+
+	VkPipeline pipeline = VK_NULL_HANDLE;
+	VkResult result = LinkLibraries(mDevice, mPipelineCache, job, 0, pipeline);
+	if (result != VK_SUCCESS)
+	{
+		BOOST_LOG_TRIVIAL(warning) << "PipelineCompiler::Link vkCreateGraphicsPipelines failed with return code of " << GetResultString(result);
+		job.Libraries[0] = vk::Pipeline();
+		return false;
+	}
+
+	job.Context->Pipeline = vk::Pipeline(pipeline);
+
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mLinkedCount++;
+	}
+
+	return true;
+}
+
+void PipelineCompiler::Optimize(PipelineCompileJob& job)
+{
+	VkPipeline pipeline = VK_NULL_HANDLE;
+	VkResult result = LinkLibraries(mDevice, mPipelineCache, job, VK_PIPELINE_CREATE_LINK_TIME_OPTIMIZATION_BIT_EXT, pipeline);
+	if (result != VK_SUCCESS)
+	{
+		//The linked pipeline keeps being used so this isn't fatal.
+		BOOST_LOG_TRIVIAL(warning) << "PipelineCompiler::Optimize vkCreateGraphicsPipelines failed with return code of " << GetResultString(result);
+		return;
+	}
+
+	job.Context->OptimizedPipeline = vk::Pipeline(pipeline);
+	job.Context->IsOptimized = true;
+
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mOptimizedCount++;
+	}
+}
+
+vk::Pipeline PipelineCompiler::GetLibrary(PipelineCompileJob& job, PipelineLibraryType type)
+{
+	PipelineLibraryKey key = GetLibraryKey(job, type);
+	auto& libraries = mLibraries[type];
+
+	{
+		std::lock_guard<std::mutex> lock(mLibraryMutex);
+		auto range = libraries.equal_range(key.Hash);
+		for (auto library = range.first; library != range.second; ++library)
+		{
+			if (library->second.State == key.State)
+			{
+				return library->second.Pipeline;
+			}
+		}
+	}
+
+	VkGraphicsPipelineLibraryCreateInfoEXT graphicsPipelineLibraryCreateInfo = {};
+	graphicsPipelineLibraryCreateInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_LIBRARY_CREATE_INFO_EXT;
+
+	VkGraphicsPipelineCreateInfo graphicsPipelineCreateInfo = {};
+	graphicsPipelineCreateInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+	graphicsPipelineCreateInfo.pNext = &graphicsPipelineLibraryCreateInfo;
+	graphicsPipelineCreateInfo.flags = VK_PIPELINE_CREATE_LIBRARY_BIT_KHR;
+	graphicsPipelineCreateInfo.pDynamicState = reinterpret_cast<const VkPipelineDynamicStateCreateInfo*>(&job.PipelineDynamicStateCreateInfo);
+
+	//The optimized link needs what the driver would otherwise throw away after building the library.
+	if (mOptimizeLinkedPipelines)
+	{
+		graphicsPipelineCreateInfo.flags |= VK_PIPELINE_CREATE_RETAIN_LINK_TIME_OPTIMIZATION_INFO_BIT_EXT;
+	}
+
+	vk::ShaderStageFlagBits stage = (type == PipelineLibraryType_PreRasterization) ? vk::ShaderStageFlagBits::eVertex : vk::ShaderStageFlagBits::eFragment;
+	for (uint32_t i = 0; i < job.GraphicsPipelineCreateInfo.stageCount; i++)
+	{
+		if (job.PipelineShaderStageCreateInfo[i].stage == stage)
+		{
+			graphicsPipelineCreateInfo.stageCount = 1;
+			graphicsPipelineCreateInfo.pStages = reinterpret_cast<const VkPipelineShaderStageCreateInfo*>(&job.PipelineShaderStageCreateInfo[i]);
+		}
+	}
+
+	switch (type)
+	{
+	case PipelineLibraryType_VertexInput:
+		graphicsPipelineLibraryCreateInfo.flags = VK_GRAPHICS_PIPELINE_LIBRARY_VERTEX_INPUT_INTERFACE_BIT_EXT;
+		graphicsPipelineCreateInfo.stageCount = 0;
+		graphicsPipelineCreateInfo.pStages = nullptr;
+		graphicsPipelineCreateInfo.pVertexInputState = reinterpret_cast<const VkPipelineVertexInputStateCreateInfo*>(&job.PipelineVertexInputStateCreateInfo);
+		graphicsPipelineCreateInfo.pInputAssemblyState = reinterpret_cast<const VkPipelineInputAssemblyStateCreateInfo*>(&job.PipelineInputAssemblyStateCreateInfo);
+		break;
+	case PipelineLibraryType_PreRasterization:
+		graphicsPipelineLibraryCreateInfo.flags = VK_GRAPHICS_PIPELINE_LIBRARY_PRE_RASTERIZATION_SHADERS_BIT_EXT;
+		graphicsPipelineCreateInfo.pViewportState = reinterpret_cast<const VkPipelineViewportStateCreateInfo*>(&job.PipelineViewportStateCreateInfo);
+		graphicsPipelineCreateInfo.pRasterizationState = reinterpret_cast<const VkPipelineRasterizationStateCreateInfo*>(&job.PipelineRasterizationStateCreateInfo);
+		graphicsPipelineCreateInfo.layout = (VkPipelineLayout)job.GraphicsPipelineCreateInfo.layout;
+		graphicsPipelineCreateInfo.renderPass = (VkRenderPass)job.GraphicsPipelineCreateInfo.renderPass;
+		graphicsPipelineCreateInfo.subpass = job.GraphicsPipelineCreateInfo.subpass;
+		break;
+	case PipelineLibraryType_FragmentShader:
+		graphicsPipelineLibraryCreateInfo.flags = VK_GRAPHICS_PIPELINE_LIBRARY_FRAGMENT_SHADER_BIT_EXT;
+		graphicsPipelineCreateInfo.pDepthStencilState = reinterpret_cast<const VkPipelineDepthStencilStateCreateInfo*>(&job.PipelineDepthStencilStateCreateInfo);
+		graphicsPipelineCreateInfo.pMultisampleState = reinterpret_cast<const VkPipelineMultisampleStateCreateInfo*>(&job.PipelineMultisampleStateCreateInfo);
+		graphicsPipelineCreateInfo.layout = (VkPipelineLayout)job.GraphicsPipelineCreateInfo.layout;
+		graphicsPipelineCreateInfo.renderPass = (VkRenderPass)job.GraphicsPipelineCreateInfo.renderPass;
+		graphicsPipelineCreateInfo.subpass = job.GraphicsPipelineCreateInfo.subpass;
+		break;
+	case PipelineLibraryType_FragmentOutput:
+		graphicsPipelineLibraryCreateInfo.flags = VK_GRAPHICS_PIPELINE_LIBRARY_FRAGMENT_OUTPUT_INTERFACE_BIT_EXT;
+		graphicsPipelineCreateInfo.stageCount = 0;
+		graphicsPipelineCreateInfo.pStages = nullptr;
+		graphicsPipelineCreateInfo.pColorBlendState = reinterpret_cast<const VkPipelineColorBlendStateCreateInfo*>(&job.PipelineColorBlendStateCreateInfo);
+		graphicsPipelineCreateInfo.pMultisampleState = reinterpret_cast<const VkPipelineMultisampleStateCreateInfo*>(&job.PipelineMultisampleStateCreateInfo);
+		graphicsPipelineCreateInfo.renderPass = (VkRenderPass)job.GraphicsPipelineCreateInfo.renderPass;
+		graphicsPipelineCreateInfo.subpass = job.GraphicsPipelineCreateInfo.subpass;
+		break;
+	default:
+		return vk::Pipeline();
+	}
+
+	VkPipeline pipeline = VK_NULL_HANDLE;
+	VkResult result = vkCreateGraphicsPipelines((VkDevice)mDevice, (VkPipelineCache)mPipelineCache, 1, &graphicsPipelineCreateInfo, nullptr, &pipeline);
+	if (result != VK_SUCCESS)
+	{
+		BOOST_LOG_TRIVIAL(warning) << "PipelineCompiler::GetLibrary vkCreateGraphicsPipelines failed with return code of " << GetResultString(result);
+		return vk::Pipeline();
+	}
+
+	PipelineLibrary entry;
+	entry.State = key.State;
+	entry.Pipeline = vk::Pipeline(pipeline);
+	entry.Layout = vk::PipelineLayout(graphicsPipelineCreateInfo.layout);
+	if (graphicsPipelineCreateInfo.stageCount)
+	{
+		entry.ShaderKey = job.Context->ShaderKeys[(type == PipelineLibraryType_PreRasterization) ? 0 : 1];
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mLibraryMutex);
+
+		//Another thread may have built the same library in the meantime.
+		auto range = libraries.equal_range(key.Hash);
+		for (auto library = range.first; library != range.second; ++library)
+		{
+			if (library->second.State == key.State)
+			{
+				mDevice.destroyPipeline(vk::Pipeline(pipeline), nullptr);
+				return library->second.Pipeline;
+			}
+		}
+
+		libraries.emplace(key.Hash, entry);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mLibraryCount++;
+	}
+
+	return vk::Pipeline(pipeline);
+}
+
+void PipelineCompiler::EvictLibraries(vk::PipelineLayout layout)
+{
+	std::lock_guard<std::mutex> lock(mLibraryMutex);
+
+	for (auto& libraries : mLibraries)
+	{
+		for (auto library = libraries.begin(); library != libraries.end();)
+		{
+			if (library->second.Layout == layout)
+			{
+				mRetiredLibraries.push_back(library->second.Pipeline);
+				library = libraries.erase(library);
+			}
+			else
+			{
+				++library;
+			}
+		}
+	}
+}
+
+void PipelineCompiler::EvictShaderLibraries(uint64_t shaderKey)
+{
+	std::lock_guard<std::mutex> lock(mLibraryMutex);
+
+	for (auto& libraries : mLibraries)
+	{
+		for (auto library = libraries.begin(); library != libraries.end();)
+		{
+			if (library->second.ShaderKey == shaderKey)
+			{
+				mRetiredLibraries.push_back(library->second.Pipeline);
+				library = libraries.erase(library);
+			}
+			else
+			{
+				++library;
+			}
+		}
+	}
+}
+
+/*
+Linked pipelines don't need their libraries anymore but a job may still be linking or optimizing with an evicted one.
+Jobs are only queued by the command stream thread so nothing can pick up a retired library while the compiler is idle.
+*/
+void PipelineCompiler::DestroyRetiredLibraries()
+{
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		if (!mJobs.empty() || !mOptimizeJobs.empty() || mActiveJobs)
+		{
+			return;
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(mLibraryMutex);
+
+	for (auto& library : mRetiredLibraries)
+	{
+		mDevice.destroyPipeline(library, nullptr);
+	}
+	mRetiredLibraries.clear();
+}
+
+/*
+Only the state that goes into a library picks it so pipelines that share a shader or vertex layout share the library.
+Dynamic states are left out because the value in the create info is ignored.
+*/
+PipelineLibraryKey PipelineCompiler::GetLibraryKey(PipelineCompileJob& job, PipelineLibraryType type)
+{
+	const auto& dynamicState = job.PipelineDynamicStateCreateInfo;
+	PipelineLibraryKey key;
+	key.Add(type);
+
+	switch (type)
+	{
+	case PipelineLibraryType_VertexInput:
+	{
+		const auto& vertexInput = job.PipelineVertexInputStateCreateInfo;
+		for (uint32_t i = 0; i < vertexInput.vertexBindingDescriptionCount; i++)
+		{
+			const auto& binding = vertexInput.pVertexBindingDescriptions[i];
+			key.Add((((uint64_t)binding.binding) << 32) | binding.stride);
+			key.Add((uint64_t)binding.inputRate);
+		}
+
+		for (uint32_t i = 0; i < vertexInput.vertexAttributeDescriptionCount; i++)
+		{
+			const auto& attribute = vertexInput.pVertexAttributeDescriptions[i];
+			key.Add((((uint64_t)attribute.location) << 32) | attribute.binding);
+			key.Add((((uint64_t)attribute.format) << 32) | attribute.offset);
+		}
+
+		//Even with a dynamic topology the class of the topology has to match so it stays in the key.
+		key.Add((uint64_t)job.PipelineInputAssemblyStateCreateInfo.topology);
+		key.Add(job.PipelineInputAssemblyStateCreateInfo.primitiveRestartEnable);
+	}
+	break;
+	case PipelineLibraryType_PreRasterization:
+	{
+		const auto& rasterization = job.PipelineRasterizationStateCreateInfo;
+		AddShaderStage(key, job, vk::ShaderStageFlagBits::eVertex);
+		AddDescriptorLayout(key, job);
+		key.Add((((uint64_t)job.PipelineViewportStateCreateInfo.viewportCount) << 32) | job.PipelineViewportStateCreateInfo.scissorCount);
+		key.Add((((uint64_t)rasterization.depthClampEnable) << 32) | rasterization.rasterizerDiscardEnable);
+		key.Add((uint64_t)rasterization.polygonMode);
+		key.AddFloat(rasterization.lineWidth);
+
+		if (!IsDynamic(dynamicState, VK_DYNAMIC_STATE_CULL_MODE_EXT))
+		{
+			key.Add((uint64_t)(VkCullModeFlags)rasterization.cullMode);
+		}
+
+		if (!IsDynamic(dynamicState, VK_DYNAMIC_STATE_FRONT_FACE_EXT))
+		{
+			key.Add((uint64_t)rasterization.frontFace);
+		}
+
+		if (!IsDynamic(dynamicState, VK_DYNAMIC_STATE_DEPTH_BIAS_ENABLE_EXT))
+		{
+			key.Add(rasterization.depthBiasEnable);
+		}
+
+		if (!IsDynamic(dynamicState, VK_DYNAMIC_STATE_DEPTH_BIAS))
+		{
+			key.AddFloat(rasterization.depthBiasConstantFactor);
+			key.AddFloat(rasterization.depthBiasClamp);
+			key.AddFloat(rasterization.depthBiasSlopeFactor);
+		}
+	}
+	break;
+	case PipelineLibraryType_FragmentShader:
+	{
+		const auto& depthStencil = job.PipelineDepthStencilStateCreateInfo;
+		AddShaderStage(key, job, vk::ShaderStageFlagBits::eFragment);
+		AddDescriptorLayout(key, job);
+		key.Add((uint64_t)job.PipelineMultisampleStateCreateInfo.rasterizationSamples);
+		key.Add(depthStencil.depthBoundsTestEnable);
+		key.AddFloat(depthStencil.minDepthBounds);
+		key.AddFloat(depthStencil.maxDepthBounds);
+
+		if (!IsDynamic(dynamicState, VK_DYNAMIC_STATE_DEPTH_TEST_ENABLE_EXT))
+		{
+			key.Add(depthStencil.depthTestEnable);
+		}
+
+		if (!IsDynamic(dynamicState, VK_DYNAMIC_STATE_DEPTH_WRITE_ENABLE_EXT))
+		{
+			key.Add(depthStencil.depthWriteEnable);
+		}
+
+		if (!IsDynamic(dynamicState, VK_DYNAMIC_STATE_DEPTH_COMPARE_OP_EXT))
+		{
+			key.Add((uint64_t)depthStencil.depthCompareOp);
+		}
+
+		if (!IsDynamic(dynamicState, VK_DYNAMIC_STATE_STENCIL_TEST_ENABLE_EXT))
+		{
+			key.Add(depthStencil.stencilTestEnable);
+		}
+
+		const vk::StencilOpState* faces[2] = { &depthStencil.front, &depthStencil.back };
+		for (auto face : faces)
+		{
+			if (!IsDynamic(dynamicState, VK_DYNAMIC_STATE_STENCIL_OP_EXT))
+			{
+				key.Add((((uint64_t)face->failOp) << 32) | (uint32_t)face->passOp);
+				key.Add((((uint64_t)face->depthFailOp) << 32) | (uint32_t)face->compareOp);
+			}
+
+			if (!IsDynamic(dynamicState, VK_DYNAMIC_STATE_STENCIL_COMPARE_MASK))
+			{
+				key.Add(face->compareMask);
+			}
+
+			if (!IsDynamic(dynamicState, VK_DYNAMIC_STATE_STENCIL_WRITE_MASK))
+			{
+				key.Add(face->writeMask);
+			}
+
+			if (!IsDynamic(dynamicState, VK_DYNAMIC_STATE_STENCIL_REFERENCE))
+			{
+				key.Add(face->reference);
+			}
+		}
+	}
+	break;
+	case PipelineLibraryType_FragmentOutput:
+	{
+		const auto& colorBlend = job.PipelineColorBlendStateCreateInfo;
+		key.Add((uint64_t)job.PipelineMultisampleStateCreateInfo.rasterizationSamples);
+		key.Add((((uint64_t)colorBlend.logicOpEnable) << 32) | (uint32_t)colorBlend.logicOp);
+
+		for (uint32_t i = 0; i < colorBlend.attachmentCount; i++)
+		{
+			const auto& attachment = colorBlend.pAttachments[i];
+			key.Add((((uint64_t)attachment.blendEnable) << 32) | (uint32_t)(VkColorComponentFlags)attachment.colorWriteMask);
+			key.Add((((uint64_t)attachment.srcColorBlendFactor) << 32) | (uint32_t)attachment.dstColorBlendFactor);
+			key.Add((((uint64_t)attachment.srcAlphaBlendFactor) << 32) | (uint32_t)attachment.dstAlphaBlendFactor);
+			key.Add((((uint64_t)attachment.colorBlendOp) << 32) | (uint32_t)attachment.alphaBlendOp);
+		}
+
+		if (!IsDynamic(dynamicState, VK_DYNAMIC_STATE_BLEND_CONSTANTS))
+		{
+			for (size_t i = 0; i < 4; i++)
+			{
+				key.AddFloat(colorBlend.blendConstants[i]);
+			}
+		}
+	}
+	break;
+	default:
+		break;
+	}
+
+	return key;
+}
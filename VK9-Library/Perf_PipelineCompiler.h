@@ -0,0 +1,169 @@
+/*
+Copyright(c) 2018 Christopher Joseph Dean Schaefer
+
+This software is provided 'as-is', without any express or implied
+warranty.In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions :
+
+1. The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software.If you use this software
+in a product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include <memory>
+#include <vector>
+#include <deque>
+#include <string>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <vulkan/vulkan.hpp>
+
+#ifndef PIPELINECOMPILER_H
+#define PIPELINECOMPILER_H
+
+struct DrawContext;
+
+/*
+What a draw does when the pipeline it needs is still being compiled.
+*/
+enum PipelineCompilePolicy
+{
+	PipelineCompilePolicy_Wait, //Block the command stream until the pipeline is ready. (same result as compiling inline)
+	PipelineCompilePolicy_Skip, //Drop the draw.
+	PipelineCompilePolicy_Fallback //Draw with the last pipeline built for the same shaders & vertex layout, otherwise wait.
+};
+
+PipelineCompilePolicy ConvertPipelineCompilePolicy(const std::string& policy);
+
+/*
+The pieces a pipeline is linked from when VK_EXT_graphics_pipeline_library is enabled.
+*/
+enum PipelineLibraryType
+{
+	PipelineLibraryType_VertexInput, //Vertex layout & topology.
+	PipelineLibraryType_PreRasterization, //Vertex shader & rasterization state.
+	PipelineLibraryType_FragmentShader, //Pixel shader & depth stencil state.
+	PipelineLibraryType_FragmentOutput, //Blend state.
+	PipelineLibraryType_Count
+};
+
+/*
+A private copy of everything vk::GraphicsPipelineCreateInfo points at so the window can move on to the next draw while this one compiles.
+*/
+struct PipelineCompileJob
+{
+	std::shared_ptr<DrawContext> Context;
+	std::chrono::steady_clock::time_point QueuedAt;
+
+	vk::GraphicsPipelineCreateInfo GraphicsPipelineCreateInfo;
+	vk::PipelineShaderStageCreateInfo PipelineShaderStageCreateInfo[2];
+	vk::SpecializationInfo SpecializationInfo[2];
+	vk::PipelineVertexInputStateCreateInfo PipelineVertexInputStateCreateInfo;
+	vk::VertexInputBindingDescription VertexInputBindingDescription[16];
+	vk::VertexInputAttributeDescription VertexInputAttributeDescription[32];
+	vk::PipelineInputAssemblyStateCreateInfo PipelineInputAssemblyStateCreateInfo;
+	vk::PipelineViewportStateCreateInfo PipelineViewportStateCreateInfo;
+	vk::PipelineRasterizationStateCreateInfo PipelineRasterizationStateCreateInfo;
+	vk::PipelineMultisampleStateCreateInfo PipelineMultisampleStateCreateInfo;
+	vk::PipelineDepthStencilStateCreateInfo PipelineDepthStencilStateCreateInfo;
+	vk::PipelineColorBlendStateCreateInfo PipelineColorBlendStateCreateInfo;
+	vk::PipelineColorBlendAttachmentState PipelineColorBlendAttachmentState[1];
+	vk::PipelineDynamicStateCreateInfo PipelineDynamicStateCreateInfo;
+
+	vk::Pipeline Libraries[PipelineLibraryType_Count]; //Set once the pipeline has been linked.
+
+	PipelineCompileJob(std::shared_ptr<DrawContext>& context, const vk::GraphicsPipelineCreateInfo& graphicsPipelineCreateInfo);
+};
+
+/*
+Every word of state that goes into a library. The hash picks the bucket and the words are compared so a collision can't hand out a library built from different state.
+*/
+struct PipelineLibraryKey
+{
+	uint64_t Hash = 0;
+	std::vector<uint64_t> State;
+
+	void Add(uint64_t value);
+	void AddFloat(float value);
+};
+
+struct PipelineLibrary
+{
+	std::vector<uint64_t> State; //What the library was built from. (see PipelineLibraryKey)
+	vk::Pipeline Pipeline;
+	vk::PipelineLayout Layout; //Layout the library was built with. (null for the vertex input & fragment output libraries)
+	uint64_t ShaderKey = 0; //Disk key of the converted shader in the library. (0 for fixed function & shaderless libraries)
+};
+
+struct PipelineCompiler
+{
+	vk::Device mDevice;
+	vk::PipelineCache mPipelineCache; //Pipeline caches are internally synchronized so every thread can share the window's cache.
+	PipelineCompilePolicy mPolicy = PipelineCompilePolicy_Wait;
+
+	std::vector<std::thread> mThreads;
+	std::mutex mMutex;
+	std::condition_variable mJobQueued;
+	std::condition_variable mJobFinished;
+	std::deque< std::unique_ptr<PipelineCompileJob> > mJobs;
+	std::deque< std::unique_ptr<PipelineCompileJob> > mOptimizeJobs; //Only picked up when there are no pipelines waiting to be built.
+	size_t mActiveJobs = 0;
+	bool mIsRunning = true;
+
+	/*
+	Pipeline libraries are shared by every pipeline of the window.
+	A library is evicted once its shader is destroyed or the layout it was built with is retired.
+	Evicted libraries may still be used by a job so they are only destroyed once the compiler is idle.
+	*/
+	bool mUsePipelineLibraries = false;
+	bool mOptimizeLinkedPipelines = false;
+	std::mutex mLibraryMutex;
+	std::unordered_multimap<uint64_t, PipelineLibrary> mLibraries[PipelineLibraryType_Count];
+	std::vector<vk::Pipeline> mRetiredLibraries; //Guarded by mLibraryMutex.
+
+	//Counters guarded by mMutex. (latency is measured from the draw that queued the pipeline to the pipeline being ready.)
+	size_t mCompiledCount = 0;
+	size_t mMaxQueueDepth = 0;
+	uint64_t mTotalLatency = 0; //Microseconds
+	uint64_t mMaxLatency = 0; //Microseconds
+	size_t mLibraryCount = 0;
+	size_t mLinkedCount = 0;
+	size_t mOptimizedCount = 0;
+
+	//Counters only touched by the command stream thread.
+	size_t mWaitCount = 0;
+	size_t mSkipCount = 0;
+	size_t mFallbackCount = 0;
+	size_t mLastLoggedCount = 0;
+	std::chrono::steady_clock::time_point mLastLog = std::chrono::steady_clock::now();
+
+	PipelineCompiler(vk::Device& device, vk::PipelineCache& pipelineCache, uint32_t threadCount, PipelineCompilePolicy policy);
+	~PipelineCompiler();
+
+	void Compile(std::shared_ptr<DrawContext>& context, const vk::GraphicsPipelineCreateInfo& graphicsPipelineCreateInfo);
+	void Wait(DrawContext& context);
+	void WaitIdle();
+	void LogStatistics();
+	void Run();
+	void Execute(PipelineCompileJob& job);
+	bool Link(PipelineCompileJob& job);
+	void Optimize(PipelineCompileJob& job);
+	vk::Pipeline GetLibrary(PipelineCompileJob& job, PipelineLibraryType type);
+	PipelineLibraryKey GetLibraryKey(PipelineCompileJob& job, PipelineLibraryType type);
+	void EvictLibraries(vk::PipelineLayout layout);
+	void EvictShaderLibraries(uint64_t shaderKey);
+	void DestroyRetiredLibraries();
+};
+
+#endif // PIPELINECOMPILER_H
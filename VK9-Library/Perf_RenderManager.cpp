@@ -46,6 +46,79 @@ misrepresented as being the original software.
 #include "CPixelShader9.h"
 #include "CVertexShader9.h"
 
+#define STATE_WORD(field) (offsetof(SpecializationConstants, field) / sizeof(uint32_t))
+
+/*
+Render states that are set at draw time so they don't pick the pipeline.
+The core ones are dynamic everywhere and the rest only when VK_EXT_extended_dynamic_state is enabled.
+*/
+static const size_t gDynamicStateWords[] =
+{
+	STATE_WORD(stencilReference), STATE_WORD(stencilMask), STATE_WORD(stencilWriteMask), STATE_WORD(blendFactor)
+};
+
+static const size_t gExtendedDynamicStateWords[] =
+{
+	STATE_WORD(cullMode), STATE_WORD(zEnable), STATE_WORD(zWriteEnable), STATE_WORD(zFunction),
+	STATE_WORD(stencilEnable), STATE_WORD(stencilFail), STATE_WORD(stencilZFail), STATE_WORD(stencilPass), STATE_WORD(stencilFunction),
+	STATE_WORD(twoSidedStencilMode), STATE_WORD(ccwStencilFail), STATE_WORD(ccwStencilZFail), STATE_WORD(ccwStencilPass), STATE_WORD(ccwStencilFunction)
+};
+
+/*
+Pipelines are looked up by a 64bit hash so a hit is only used once the full state it was built from matches.
+States set at draw time are allowed to differ.
+*/
+static bool IsSamePipelineState(const DrawContext& cachedContext, const DrawContext& context, const DeviceState& deviceState, bool hasExtendedDynamicState, bool compareConstantSlots)
+{
+	if ((hasExtendedDynamicState ? GetPrimitiveTypeClass(cachedContext.PrimitiveType) != GetPrimitiveTypeClass(context.PrimitiveType) : cachedContext.PrimitiveType != context.PrimitiveType)
+		|| cachedContext.StreamCount != context.StreamCount
+		|| cachedContext.VertexShader != context.VertexShader
+		|| cachedContext.PixelShader != context.PixelShader
+		|| cachedContext.FVF != context.FVF
+		|| cachedContext.VertexDeclaration != context.VertexDeclaration
+		|| memcmp(&cachedContext.Bindings, &context.Bindings, 64 * sizeof(UINT)))
+	{
+		return false;
+	}
+
+	SpecializationConstants comparedConstants = deviceState.mSpecializationConstants;
+	uint32_t* comparedWords = (uint32_t*)&comparedConstants;
+	const uint32_t* cachedWords = (const uint32_t*)&cachedContext.mSpecializationConstants;
+
+	for (auto word : gDynamicStateWords)
+	{
+		comparedWords[word] = cachedWords[word];
+	}
+
+	if (hasExtendedDynamicState)
+	{
+		for (auto word : gExtendedDynamicStateWords)
+		{
+			comparedWords[word] = cachedWords[word];
+		}
+	}
+
+	if (memcmp(&cachedContext.mSpecializationConstants, &comparedConstants, sizeof(SpecializationConstants)))
+	{
+		return false;
+	}
+
+	if (compareConstantSlots)
+	{
+		if (context.VertexShader != nullptr && memcmp(&cachedContext.mVertexShaderConstantSlots, &deviceState.mVertexShaderConstantSlots, sizeof(ShaderConstantSlots)))
+		{
+			return false;
+		}
+
+		if (context.PixelShader != nullptr && memcmp(&cachedContext.mPixelShaderConstantSlots, &deviceState.mPixelShaderConstantSlots, sizeof(ShaderConstantSlots)))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
 RenderManager::RenderManager()
 {
 
@@ -55,23 +128,70 @@ RenderManager::~RenderManager()
 {
 }
 
-void RenderManager::UpdateBuffer(RealWindow& realWindow)
-{ //Vulkan doesn't allow vkCmdUpdateBuffer inside of a render pass.
-
-	auto& device = realWindow.mRealDevice->mDevice;
+bool RenderManager::UpdateBuffer(RealWindow& realWindow)
+{
+	auto& deviceState = realWindow.mDeviceState;
 
-	//The dirty flag for lights can be set by enable light or set light.
-	if (realWindow.mDeviceState.mAreLightsDirty)
+	if (!deviceState.mAreLightsDirty && !deviceState.mIsMaterialDirty && !deviceState.mIsRenderStateDirty)
 	{
-		realWindow.mSwapchainBuffers[realWindow.mCurrentSwapchainBuffer].updateBuffer(realWindow.mLightBuffer, 0, sizeof(Light)*realWindow.mDeviceState.mLights.size(), realWindow.mDeviceState.mLights.data()); //context->mSpecializationConstants.lightCount
-		realWindow.mDeviceState.mAreLightsDirty = false;
+		return true;
 	}
 
-	if (realWindow.mDeviceState.mIsMaterialDirty)
+	vk::DeviceSize alignment = realWindow.mRealDevice->mPhysicalDeviceProperties.limits.minUniformBufferOffsetAlignment;
+	vk::DeviceSize frameOffset = (vk::DeviceSize)realWindow.mCurrentFrame * realWindow.mFixedFunctionArenaSize;
+
+	//The dirty flag for lights can be set by enable light or set light.
+	BOOL* isDirty[3] = { &deviceState.mAreLightsDirty, &deviceState.mIsMaterialDirty, &deviceState.mIsRenderStateDirty };
+	const void* blocks[3] = { deviceState.mLights.data(), &deviceState.mMaterial, &deviceState.mRenderStateConstants };
+	vk::DeviceSize sizes[3] = { sizeof(Light) * deviceState.mLights.size(), sizeof(D3DMATERIAL9), sizeof(RenderStateConstants) };
+	vk::DescriptorBufferInfo* targets[3] = { &realWindow.mLightBufferInfo, &realWindow.mMaterialBufferInfo, &realWindow.mRenderStateBufferInfo };
+
+	/*
+	Blocks already read by a recorded draw can't be touched until the frame is done so a changed block is always appended to the arena.
+	The draw only has to point its descriptors at the new offset which is cheap enough to do inside of a render pass.
+	*/
+	for (size_t i = 0; i < 3; i++)
 	{
-		realWindow.mSwapchainBuffers[realWindow.mCurrentSwapchainBuffer].updateBuffer(realWindow.mMaterialBuffer, 0, sizeof(D3DMATERIAL9), &realWindow.mDeviceState.mMaterial);
-		realWindow.mDeviceState.mIsMaterialDirty = false;
+		if (!(*isDirty[i]))
+		{
+			continue;
+		}
+
+		//An empty light array still needs a valid range so a single disabled light is written instead.
+		vk::DeviceSize range = sizes[i] ? sizes[i] : sizeof(Light);
+		vk::DeviceSize offset = ((realWindow.mFixedFunctionArenaHead + alignment - 1) / alignment) * alignment;
+
+		if (offset + range > realWindow.mFixedFunctionArenaSize)
+		{
+			if (!realWindow.GrowFixedFunctionArena(range))
+			{
+				BOOST_LOG_TRIVIAL(error) << "RenderManager::UpdateBuffer failed to grow the fixed function arena, skipping draw.";
+				return false;
+			}
+
+			frameOffset = (vk::DeviceSize)realWindow.mCurrentFrame * realWindow.mFixedFunctionArenaSize;
+			offset = 0;
+		}
+
+		char* data = realWindow.mFixedFunctionBufferData + frameOffset + offset;
+		if (sizes[i])
+		{
+			memcpy(data, blocks[i], sizes[i]);
+		}
+		else
+		{
+			memset(data, 0, range);
+		}
+
+		targets[i]->buffer = realWindow.mFixedFunctionBuffer;
+		targets[i]->offset = frameOffset + offset;
+		targets[i]->range = range;
+
+		realWindow.mFixedFunctionArenaHead = offset + range;
+		(*isDirty[i]) = false;
 	}
+
+	return true;
 }
 
 void RenderManager::StartScene(RealWindow& realWindow, bool clear)
@@ -81,17 +201,51 @@ void RenderManager::StartScene(RealWindow& realWindow, bool clear)
 	vk::Result result;
 	auto& device = realWindow.mRealDevice->mDevice;
 
-	result = device.acquireNextImageKHR(realWindow.mSwapchain, UINT64_MAX, realWindow.mPresentCompleteSemaphore, nullptr, &realWindow.mCurrentSwapchainBuffer);
+	/*
+	Only the frame slot we are about to reuse has to be finished. Everything submitted after it can keep running on the GPU while we record.
+	*/
+	result = device.waitForFences(1, &realWindow.mFrameFences[realWindow.mCurrentFrame], VK_TRUE, UINT64_MAX);
+	if (result != vk::Result::eSuccess)
+	{
+		BOOST_LOG_TRIVIAL(fatal) << "RenderManager::StartScene vkWaitForFences failed with return code of " << GetResultString((VkResult)result);
+		return;
+	}
+
+	//The fence belongs to the frame that used this slot last which means it and everything before it is done.
+	if (realWindow.mFrameNumber > realWindow.mFrameCount && realWindow.mFrameNumber - realWindow.mFrameCount > realWindow.mCompletedFrameNumber)
+	{
+		realWindow.mCompletedFrameNumber = realWindow.mFrameNumber - realWindow.mFrameCount;
+	}
+
+	realWindow.FreeRetiredBuffers();
+
+	result = device.acquireNextImageKHR(realWindow.mSwapchain, UINT64_MAX, realWindow.mImageAvailableSemaphores[realWindow.mCurrentFrame], nullptr, &realWindow.mCurrentSwapchainBuffer);
 	if (result != vk::Result::eSuccess)
 	{
 		BOOST_LOG_TRIVIAL(fatal) << "RenderManager::StartScene vkAcquireNextImageKHR failed with return code of " << GetResultString((VkResult)result);
 		return;
 	}
 
+	realWindow.mFrameCommandBuffers[realWindow.mCurrentFrame].reset(vk::CommandBufferResetFlagBits::eReleaseResources);
+
+	//Nothing is bound in a fresh command buffer. This also makes the first draw of each frame stamp every buffer & sampler it uses.
+	realWindow.mBindings.Reset();
+
+	//This frame's constant slots are free again so the first shader draw has to upload both blocks.
+	realWindow.mNextShaderConstantSlot = 0;
+	realWindow.mDeviceState.mAreVertexShaderConstantsDirty = true;
+	realWindow.mDeviceState.mArePixelShaderConstantsDirty = true;
+
+	//Same for the light, material & render state blocks in this frame's part of the fixed function arena.
+	realWindow.mFixedFunctionArenaHead = 0;
+	realWindow.mDeviceState.mAreLightsDirty = true;
+	realWindow.mDeviceState.mIsMaterialDirty = true;
+	realWindow.mDeviceState.mIsRenderStateDirty = true;
+
 	//maybe add back later
 	//SetImageLayout(mSwapchainImages[mCurrentBuffer], VK_IMAGE_ASPECT_COLOR_BIT, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR); //VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL
 
-	result = realWindow.mSwapchainBuffers[realWindow.mCurrentSwapchainBuffer].begin(&realWindow.mCommandBufferBeginInfo);
+	result = realWindow.mFrameCommandBuffers[realWindow.mCurrentFrame].begin(&realWindow.mCommandBufferBeginInfo);
 	if (result != vk::Result::eSuccess)
 	{
 		BOOST_LOG_TRIVIAL(fatal) << "RenderManager::StartScene vkBeginCommandBuffer failed with return code of " << GetResultString((VkResult)result);
@@ -107,14 +261,7 @@ void RenderManager::StartScene(RealWindow& realWindow, bool clear)
 	realWindow.mImageMemoryBarrier.image = realWindow.mSwapchainImages[realWindow.mCurrentSwapchainBuffer];
 	realWindow.mImageMemoryBarrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
 
-	realWindow.mSwapchainBuffers[realWindow.mCurrentSwapchainBuffer].pipelineBarrier(vk::PipelineStageFlagBits::eAllCommands, vk::PipelineStageFlagBits::eBottomOfPipe, vk::DependencyFlags(), 0, nullptr, 0, nullptr, 1, &realWindow.mImageMemoryBarrier);
-
-	/*
-	The Vulkan spec doesn't allow updating buffers inside of a render pass so we need to put as much buffer update logic into this method to reduce violations.
-	The previous UBO implementation was updating inside of a render pass and it seemed to work on Desktop but that may vary from driver to driver.
-	In addition performance is not guaranteed in case of spec violation.
-	*/
-	UpdateBuffer(realWindow);
+	realWindow.mFrameCommandBuffers[realWindow.mCurrentFrame].pipelineBarrier(vk::PipelineStageFlagBits::eAllCommands, vk::PipelineStageFlagBits::eBottomOfPipe, vk::DependencyFlags(), 0, nullptr, 0, nullptr, 1, &realWindow.mImageMemoryBarrier);
 
 	realWindow.mClearValues[0].color = realWindow.mClearColorValue;
 	realWindow.mClearValues[1].depthStencil = { 1.0f, 0 };
@@ -135,12 +282,10 @@ void RenderManager::StartScene(RealWindow& realWindow, bool clear)
 	realWindow.mRenderPassBeginInfo.clearValueCount = 2;
 	realWindow.mRenderPassBeginInfo.pClearValues = realWindow.mClearValues;
 
-	realWindow.mSwapchainBuffers[realWindow.mCurrentSwapchainBuffer].beginRenderPass(&realWindow.mRenderPassBeginInfo, vk::SubpassContents::eInline);
+	realWindow.mFrameCommandBuffers[realWindow.mCurrentFrame].beginRenderPass(&realWindow.mRenderPassBeginInfo, vk::SubpassContents::eInline);
 
 	//Set the pass back to store so draw calls won't be lost if they require stop/start of render pass.
 	realWindow.mRenderPassBeginInfo.renderPass = realWindow.mStoreRenderPass;
-	realWindow.mSwapchainBuffers[realWindow.mCurrentSwapchainBuffer].setViewport(0, 1, &realWindow.mDeviceState.mViewport);
-	realWindow.mSwapchainBuffers[realWindow.mCurrentSwapchainBuffer].setScissor(0, 1, &realWindow.mDeviceState.mScissor);
 }
 
 void RenderManager::StopScene(RealWindow& realWindow)
@@ -151,14 +296,14 @@ void RenderManager::StopScene(RealWindow& realWindow)
 	realWindow.mPipeStageFlags = vk::PipelineStageFlagBits::eBottomOfPipe; //VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
 
 	realWindow.mSubmitInfo.waitSemaphoreCount = 1;
-	realWindow.mSubmitInfo.pWaitSemaphores = &realWindow.mPresentCompleteSemaphore;
+	realWindow.mSubmitInfo.pWaitSemaphores = &realWindow.mImageAvailableSemaphores[realWindow.mCurrentFrame];
 	realWindow.mSubmitInfo.pWaitDstStageMask = &realWindow.mPipeStageFlags;
 	realWindow.mSubmitInfo.commandBufferCount = 1;
-	realWindow.mSubmitInfo.pCommandBuffers = &realWindow.mSwapchainBuffers[realWindow.mCurrentSwapchainBuffer];
-	realWindow.mSubmitInfo.signalSemaphoreCount = 0;
-	realWindow.mSubmitInfo.pSignalSemaphores = nullptr;
+	realWindow.mSubmitInfo.pCommandBuffers = &realWindow.mFrameCommandBuffers[realWindow.mCurrentFrame];
+	realWindow.mSubmitInfo.signalSemaphoreCount = 1;
+	realWindow.mSubmitInfo.pSignalSemaphores = &realWindow.mRenderFinishedSemaphores[realWindow.mCurrentFrame];
 
-	realWindow.mSwapchainBuffers[realWindow.mCurrentSwapchainBuffer].endRenderPass();
+	realWindow.mFrameCommandBuffers[realWindow.mCurrentFrame].endRenderPass();
 
 	realWindow.mPrePresentBarrier.srcAccessMask = vk::AccessFlagBits::eMemoryRead; //VK_ACCESS_MEMORY_READ_BIT;
 	realWindow.mPrePresentBarrier.dstAccessMask = vk::AccessFlagBits::eMemoryRead; //VK_ACCESS_MEMORY_READ_BIT;
@@ -170,80 +315,36 @@ void RenderManager::StopScene(RealWindow& realWindow)
 
 	realWindow.mPrePresentBarrier.image = realWindow.mSwapchainImages[realWindow.mCurrentSwapchainBuffer];
 	vk::ImageMemoryBarrier* memoryBarrier = &realWindow.mPrePresentBarrier;
-	realWindow.mSwapchainBuffers[realWindow.mCurrentSwapchainBuffer].pipelineBarrier(vk::PipelineStageFlagBits::eAllCommands, vk::PipelineStageFlagBits::eBottomOfPipe, vk::DependencyFlags(), 0, nullptr, 0, nullptr, 1, memoryBarrier);
+	realWindow.mFrameCommandBuffers[realWindow.mCurrentFrame].pipelineBarrier(vk::PipelineStageFlagBits::eAllCommands, vk::PipelineStageFlagBits::eBottomOfPipe, vk::DependencyFlags(), 0, nullptr, 0, nullptr, 1, memoryBarrier);
 
-	realWindow.mSwapchainBuffers[realWindow.mCurrentSwapchainBuffer].end();
+	realWindow.mFrameCommandBuffers[realWindow.mCurrentFrame].end();
 
-	result = realWindow.mQueue.submit(1, &realWindow.mSubmitInfo, realWindow.mNullFence);
-	if (result != vk::Result::eSuccess)
-	{
-		BOOST_LOG_TRIVIAL(fatal) << "RenderManager::EndScene vkQueueSubmit failed with return code of " << GetResultString((VkResult)result);
-		return;
-	}
-
-}
-
-void RenderManager::CopyImage(RealWindow& realWindow, vk::Image srcImage, vk::Image dstImage, int32_t x, int32_t y, uint32_t width, uint32_t height, uint32_t srcMip, uint32_t dstMip)
-{
-	vk::Result result;
-	vk::CommandBuffer commandBuffer;
-	auto& device = realWindow.mRealDevice->mDevice;
+	//Uploads recorded since the last frame go first so the draws in this one see them.
+	realWindow.mUploadManager->Submit();
 
-	vk::CommandBufferAllocateInfo commandBufferInfo;
-	commandBufferInfo.commandPool = realWindow.mCommandPool;
-	commandBufferInfo.level = vk::CommandBufferLevel::ePrimary;
-	commandBufferInfo.commandBufferCount = 1;
-
-	result = device.allocateCommandBuffers(&commandBufferInfo, &commandBuffer);
+	/*
+	The fence is reset as late as possible so anything waiting on all frames (buffer locks, shutdown) never waits on a frame that hasn't been submitted.
+	*/
+	result = realWindow.mRealDevice->mDevice.resetFences(1, &realWindow.mFrameFences[realWindow.mCurrentFrame]);
 	if (result != vk::Result::eSuccess)
 	{
-		BOOST_LOG_TRIVIAL(fatal) << "RenderManager::CopyImage vkAllocateCommandBuffers failed with return code of " << GetResultString((VkResult)result);
+		BOOST_LOG_TRIVIAL(fatal) << "RenderManager::EndScene vkResetFences failed with return code of " << GetResultString((VkResult)result);
 		return;
 	}
 
-	vk::CommandBufferInheritanceInfo commandBufferInheritanceInfo;
-	commandBufferInheritanceInfo.renderPass = nullptr;
-	commandBufferInheritanceInfo.subpass = 0;
-	commandBufferInheritanceInfo.framebuffer = nullptr;
-	commandBufferInheritanceInfo.occlusionQueryEnable = VK_FALSE;
-	//commandBufferInheritanceInfo.queryFlags = 0;
-	//commandBufferInheritanceInfo.pipelineStatistics = 0;
-
-	vk::CommandBufferBeginInfo commandBufferBeginInfo;
-	//commandBufferBeginInfo.flags = 0;
-	commandBufferBeginInfo.pInheritanceInfo = &commandBufferInheritanceInfo;
-
-	result = commandBuffer.begin(&commandBufferBeginInfo);
+	result = realWindow.mQueue.submit(1, &realWindow.mSubmitInfo, realWindow.mFrameFences[realWindow.mCurrentFrame]);
 	if (result != vk::Result::eSuccess)
 	{
-		BOOST_LOG_TRIVIAL(fatal) << "RenderManager::CopyImage vkBeginCommandBuffer failed with return code of " << GetResultString((VkResult)result);
+		BOOST_LOG_TRIVIAL(fatal) << "RenderManager::EndScene vkQueueSubmit failed with return code of " << GetResultString((VkResult)result);
 		return;
 	}
 
-	ReallyCopyImage(commandBuffer, srcImage, dstImage, x, y, width, height, srcMip, dstMip, 0, 0);
-
-	commandBuffer.end();
-
-	vk::CommandBuffer commandBuffers[] = { commandBuffer };
-	vk::Fence nullFence;
-	vk::SubmitInfo submitInfo;
-	submitInfo.waitSemaphoreCount = 0;
-	submitInfo.pWaitSemaphores = nullptr;
-	submitInfo.pWaitDstStageMask = nullptr;
-	submitInfo.commandBufferCount = 1;
-	submitInfo.pCommandBuffers = commandBuffers;
-	submitInfo.signalSemaphoreCount = 0;
-	submitInfo.pSignalSemaphores = nullptr;
-
-	result = realWindow.mQueue.submit(1, &submitInfo, nullFence);
-	if (result != vk::Result::eSuccess)
-	{
-		BOOST_LOG_TRIVIAL(fatal) << "RenderManager::CopyImage vkQueueSubmit failed with return code of " << GetResultString((VkResult)result);
-		return;
-	}
+}
 
-	realWindow.mQueue.waitIdle();
-	device.freeCommandBuffers(realWindow.mCommandPool, 1, commandBuffers);
+void RenderManager::CopyImage(RealWindow& realWindow, vk::Image srcImage, vk::Image dstImage, int32_t x, int32_t y, uint32_t width, uint32_t height, uint32_t srcMip, uint32_t dstMip)
+{
+	//Recorded with the other uploads so it runs ahead of the next frame instead of draining the queue.
+	ReallyCopyImage(realWindow.mUploadManager->GetCommandBuffer(), srcImage, dstImage, x, y, width, height, srcMip, dstMip, 0, 0);
 }
 
 void RenderManager::Clear(RealWindow& realWindow, DWORD Count, const D3DRECT *pRects, DWORD Flags, D3DCOLOR Color, float Z, DWORD Stencil)
@@ -273,9 +374,9 @@ void RenderManager::Clear(RealWindow& realWindow, DWORD Count, const D3DRECT *pR
 
 	if (realWindow.mIsSceneStarted)
 	{
-		realWindow.mSwapchainBuffers[realWindow.mCurrentSwapchainBuffer].endRenderPass();
-		realWindow.mSwapchainBuffers[realWindow.mCurrentSwapchainBuffer].clearColorImage(realWindow.mSwapchainImages[realWindow.mCurrentSwapchainBuffer], vk::ImageLayout::eTransferDstOptimal, &realWindow.mClearColorValue, 1, &subResourceRange);
-		realWindow.mSwapchainBuffers[realWindow.mCurrentSwapchainBuffer].beginRenderPass(&realWindow.mRenderPassBeginInfo, vk::SubpassContents::eInline);
+		realWindow.mFrameCommandBuffers[realWindow.mCurrentFrame].endRenderPass();
+		realWindow.mFrameCommandBuffers[realWindow.mCurrentFrame].clearColorImage(realWindow.mSwapchainImages[realWindow.mCurrentSwapchainBuffer], vk::ImageLayout::eTransferDstOptimal, &realWindow.mClearColorValue, 1, &subResourceRange);
+		realWindow.mFrameCommandBuffers[realWindow.mCurrentFrame].beginRenderPass(&realWindow.mRenderPassBeginInfo, vk::SubpassContents::eInline);
 	}
 	else
 	{
@@ -294,19 +395,37 @@ void RenderManager::Present(RealWindow& realWindow, const RECT *pSourceRect, con
 	vk::Result result;
 
 	realWindow.mPresentInfo.pImageIndices = &realWindow.mCurrentSwapchainBuffer;
+	realWindow.mPresentInfo.waitSemaphoreCount = 1;
+	realWindow.mPresentInfo.pWaitSemaphores = &realWindow.mRenderFinishedSemaphores[realWindow.mCurrentFrame];
 
 	result = realWindow.mQueue.presentKHR(&realWindow.mPresentInfo);
+
+	//Move on to the next frame slot even if present failed so the fence/semaphore pairing stays consistent.
+	realWindow.mCurrentFrame = (realWindow.mCurrentFrame + 1) % realWindow.mFrameCount;
+	realWindow.mFrameNumber++;
+
 	if (result != vk::Result::eSuccess)
 	{
 		BOOST_LOG_TRIVIAL(fatal) << "RenderManager::Present vkQueuePresentKHR failed with return code of " << GetResultString((VkResult)result);
 		return;
 	}
 
-	realWindow.mQueue.waitIdle();
-	realWindow.mSwapchainBuffers[realWindow.mCurrentSwapchainBuffer].reset(vk::CommandBufferResetFlagBits::eReleaseResources);
-
 	//Clean up pipes.
 	FlushDrawBufffer(realWindow);
+	realWindow.mPipelineCompiler->LogStatistics();
+	realWindow.mRealDevice->mMemoryAllocator->LogStatistics();
+	realWindow.mUploadManager->LogStatistics();
+	realWindow.mBindings.LogStatistics();
+
+	//Save new pipelines every so often so a crash doesn't lose the whole session.
+	if (realWindow.mPipelinesSinceCacheSave && realWindow.mPipelineCacheSaveInterval)
+	{
+		auto now = std::chrono::steady_clock::now();
+		if (std::chrono::duration_cast<std::chrono::seconds>(now - realWindow.mLastPipelineCacheSave).count() >= realWindow.mPipelineCacheSaveInterval)
+		{
+			realWindow.SavePipelineCache();
+		}
+	}
 
 	//Clean up unreferenced resources.
 	//mGarbageManager.DestroyHandles();
@@ -330,13 +449,16 @@ void RenderManager::DrawIndexedPrimitive(RealWindow& realWindow, D3DPRIMITIVETYP
 	std::shared_ptr<DrawContext> context = std::make_shared<DrawContext>(&realWindow);
 	std::shared_ptr<ResourceContext> resourceContext = std::make_shared<ResourceContext>(&realWindow);
 
-	BeginDraw(realWindow,context, resourceContext, Type);
+	if (!BeginDraw(realWindow,context, resourceContext, Type))
+	{
+		return; //Skipped while the pipeline compiles.
+	}
 
 	/*
 	https://msdn.microsoft.com/en-us/library/windows/desktop/bb174369(v=vs.85).aspx
 	https://www.khronos.org/registry/vulkan/specs/1.0/man/html/vkCmdDrawIndexed.html
 	*/
-	realWindow.mSwapchainBuffers[realWindow.mCurrentSwapchainBuffer].drawIndexed(min(realWindow.mDeviceState.mIndexBuffer->mSize, ConvertPrimitiveCountToVertexCount(Type, PrimitiveCount)), 1, StartIndex, BaseVertexIndex, 0);
+	realWindow.mFrameCommandBuffers[realWindow.mCurrentFrame].drawIndexed(min(realWindow.mDeviceState.mIndexBuffer->mSize, ConvertPrimitiveCountToVertexCount(Type, PrimitiveCount)), 1, StartIndex, BaseVertexIndex, 0);
 }
 
 void RenderManager::DrawPrimitive(RealWindow& realWindow, D3DPRIMITIVETYPE PrimitiveType, UINT StartVertex, UINT PrimitiveCount)
@@ -349,9 +471,12 @@ void RenderManager::DrawPrimitive(RealWindow& realWindow, D3DPRIMITIVETYPE Primi
 	std::shared_ptr<DrawContext> context = std::make_shared<DrawContext>(&realWindow);
 	std::shared_ptr<ResourceContext> resourceContext = std::make_shared<ResourceContext>(&realWindow);
 
-	BeginDraw(realWindow,context, resourceContext, PrimitiveType);
+	if (!BeginDraw(realWindow,context, resourceContext, PrimitiveType))
+	{
+		return; //Skipped while the pipeline compiles.
+	}
 
-	realWindow.mSwapchainBuffers[realWindow.mCurrentSwapchainBuffer].draw(min(realWindow.mVertexCount, ConvertPrimitiveCountToVertexCount(PrimitiveType, PrimitiveCount)), 1, StartVertex, 0);
+	realWindow.mFrameCommandBuffers[realWindow.mCurrentFrame].draw(min(realWindow.mVertexCount, ConvertPrimitiveCountToVertexCount(PrimitiveType, PrimitiveCount)), 1, StartVertex, 0);
 }
 
 void RenderManager::UpdateTexture(RealWindow& realWindow, IDirect3DBaseTexture9* pSourceTexture, IDirect3DBaseTexture9* pDestinationTexture)
@@ -361,39 +486,8 @@ void RenderManager::UpdateTexture(RealWindow& realWindow, IDirect3DBaseTexture9*
 		return;
 	}
 
-	vk::CommandBuffer commandBuffer;
-	vk::Result result;
-
-	vk::CommandBufferAllocateInfo commandBufferInfo = {};
-	commandBufferInfo.commandPool = realWindow.mCommandPool;
-	commandBufferInfo.level = vk::CommandBufferLevel::ePrimary;
-	commandBufferInfo.commandBufferCount = 1;
-
-	result = realWindow.mRealDevice->mDevice.allocateCommandBuffers(&commandBufferInfo, &commandBuffer);
-	if (result != vk::Result::eSuccess)
-	{
-		BOOST_LOG_TRIVIAL(fatal) << "RenderManager::UpdateTexture vkAllocateCommandBuffers failed with return code of " << GetResultString((VkResult)result);
-		return;
-	}
-
-	vk::CommandBufferInheritanceInfo commandBufferInheritanceInfo;
-	commandBufferInheritanceInfo.renderPass = VK_NULL_HANDLE;
-	commandBufferInheritanceInfo.subpass = 0;
-	commandBufferInheritanceInfo.framebuffer = VK_NULL_HANDLE;
-	commandBufferInheritanceInfo.occlusionQueryEnable = VK_FALSE;
-	//commandBufferInheritanceInfo.queryFlags = 0;
-	//commandBufferInheritanceInfo.pipelineStatistics = 0;
-
-	vk::CommandBufferBeginInfo commandBufferBeginInfo;
-	//commandBufferBeginInfo.flags = 0;
-	commandBufferBeginInfo.pInheritanceInfo = &commandBufferInheritanceInfo;
-
-	result = commandBuffer.begin(&commandBufferBeginInfo);
-	if (result != vk::Result::eSuccess)
-	{
-		BOOST_LOG_TRIVIAL(fatal) << "RenderManager::UpdateTexture vkBeginCommandBuffer failed with return code of " << GetResultString((VkResult)result);
-		return;
-	}
+	//Recorded with the other uploads so it runs ahead of the next frame instead of draining the queue.
+	vk::CommandBuffer commandBuffer = realWindow.mUploadManager->GetCommandBuffer();
 
 	//TODO: Handle dirty regions and multiple mip levels.
 
@@ -443,122 +537,127 @@ void RenderManager::UpdateTexture(RealWindow& realWindow, IDirect3DBaseTexture9*
 		ReallySetImageLayout(commandBuffer, target->mImage, vk::ImageAspectFlags(), vk::ImageLayout::eTransferDstOptimal, vk::ImageLayout::eShaderReadOnlyOptimal, 1, 0, 6);
 	}
 
-	commandBuffer.end();
-
-	vk::CommandBuffer commandBuffers[] = { commandBuffer };
-	vk::Fence nullFence;
-
-	vk::SubmitInfo submitInfo;
-	submitInfo.waitSemaphoreCount = 0;
-	submitInfo.pWaitSemaphores = NULL;
-	submitInfo.pWaitDstStageMask = NULL;
-	submitInfo.commandBufferCount = 1;
-	submitInfo.pCommandBuffers = commandBuffers;
-	submitInfo.signalSemaphoreCount = 0;
-	submitInfo.pSignalSemaphores = NULL;
-
-	result = realWindow.mQueue.submit(1, &submitInfo, nullFence);
-	if (result != vk::Result::eSuccess)
-	{
-		BOOST_LOG_TRIVIAL(fatal) << "RenderManager::UpdateTexture vkQueueSubmit failed with return code of " << GetResultString((VkResult)result);
-		return;
-	}
-
-	realWindow.mQueue.waitIdle();
-	realWindow.mRealDevice->mDevice.freeCommandBuffers(realWindow.mCommandPool, 1, commandBuffers);
+	source->mUploadSerial = realWindow.mUploadManager->mSerial;
+	target->mUploadSerial = realWindow.mUploadManager->mSerial;
 }
 
-void RenderManager::BeginDraw(RealWindow& realWindow, std::shared_ptr<DrawContext> context, std::shared_ptr<ResourceContext> resourceContext, D3DPRIMITIVETYPE type)
+bool RenderManager::BeginDraw(RealWindow& realWindow, std::shared_ptr<DrawContext> context, std::shared_ptr<ResourceContext> resourceContext, D3DPRIMITIVETYPE type)
 {
 	VkResult result = VK_SUCCESS;
 	boost::container::flat_map<D3DRENDERSTATETYPE, DWORD>::const_iterator searchResult;
 
-	auto& currentSwapChainBuffer = realWindow.mSwapchainBuffers[realWindow.mCurrentSwapchainBuffer];
+	auto& currentSwapChainBuffer = realWindow.mFrameCommandBuffers[realWindow.mCurrentFrame];
+
+	auto& deviceState = realWindow.mDeviceState;
+	auto& samplerStates = deviceState.mSamplerStates;
+
+	auto& bindings = realWindow.mBindings;
 
 	/**********************************************
-	* Update the stuff that need to be done outside of a render pass.
+	* Copy changed lights, material & render state into the fixed function arena.
 	**********************************************/
-	if (realWindow.mDeviceState.mAreLightsDirty || realWindow.mDeviceState.mIsMaterialDirty)
+	const bool isFixedFunction = (!deviceState.mHasVertexShader || deviceState.mVertexShader == nullptr); //The context isn't filled in yet.
+	if (isFixedFunction && (deviceState.mAreLightsDirty || deviceState.mIsMaterialDirty || deviceState.mIsRenderStateDirty))
 	{
-		currentSwapChainBuffer.endRenderPass();
-		UpdateBuffer(realWindow);
-		currentSwapChainBuffer.beginRenderPass(&realWindow.mRenderPassBeginInfo, vk::SubpassContents::eInline);
+		if (!UpdateBuffer(realWindow))
+		{
+			return false;
+		}
+		bindings.DirtyFlags |= BINDING_FLAG(BindingType_Descriptors);
 	}
 
 	/**********************************************
 	* Update the textures that are currently mapped.
 	**********************************************/
-	auto& deviceState = realWindow.mDeviceState;
-	auto& samplerStates = deviceState.mSamplerStates;
 
-	BOOST_FOREACH(const auto& pair1, deviceState.mTextures)
+	if (bindings.DirtyFlags & BINDING_FLAG(BindingType_Descriptors))
 	{
-		vk::DescriptorImageInfo& targetSampler = deviceState.mDescriptorImageInfo[pair1.first];
-
-		if (pair1.second != nullptr)
+		BOOST_FOREACH(const auto& pair1, deviceState.mTextures)
 		{
-			std::shared_ptr<SamplerRequest> request = std::make_shared<SamplerRequest>(&realWindow);
-			auto& currentSampler = samplerStates[request->SamplerIndex];
+			vk::DescriptorImageInfo& targetSampler = deviceState.mDescriptorImageInfo[pair1.first];
 
-			if (pair1.second->GetType() == D3DRTYPE_CUBETEXTURE)
+			if (pair1.second != nullptr)
 			{
-				CCubeTexture9* texture9 = (CCubeTexture9*)pair1.second;
-				auto& texture = mStateManager.mTextures[texture9->mId];
+				DWORD levels = 0;
 
-				request->MaxLod = texture9->mLevels;
-				targetSampler.imageView = texture->mImageView;
-			}
-			else
-			{
-				CTexture9* texture9 = (CTexture9*)pair1.second;
-				auto& texture = mStateManager.mTextures[texture9->mId];
+				if (pair1.second->GetType() == D3DRTYPE_CUBETEXTURE)
+				{
+					CCubeTexture9* texture9 = (CCubeTexture9*)pair1.second;
+					auto& texture = mStateManager.mTextures[texture9->mId];
 
-				request->MaxLod = texture9->mLevels;
-				targetSampler.imageView = texture->mImageView;
-			}
+					levels = texture9->mLevels;
+					targetSampler.imageView = texture->mImageView;
+				}
+				else
+				{
+					CTexture9* texture9 = (CTexture9*)pair1.second;
+					auto& texture = mStateManager.mTextures[texture9->mId];
 
-			request->MagFilter = (D3DTEXTUREFILTERTYPE)currentSampler[D3DSAMP_MAGFILTER];
-			request->MinFilter = (D3DTEXTUREFILTERTYPE)currentSampler[D3DSAMP_MINFILTER];
-			request->AddressModeU = (D3DTEXTUREADDRESS)currentSampler[D3DSAMP_ADDRESSU];
-			request->AddressModeV = (D3DTEXTUREADDRESS)currentSampler[D3DSAMP_ADDRESSV];
-			request->AddressModeW = (D3DTEXTUREADDRESS)currentSampler[D3DSAMP_ADDRESSW];
-			request->MaxAnisotropy = currentSampler[D3DSAMP_MAXANISOTROPY];
-			request->MipmapMode = (D3DTEXTUREFILTERTYPE)currentSampler[D3DSAMP_MIPFILTER];
-			request->MipLodBias = currentSampler[D3DSAMP_MIPMAPLODBIAS]; //bit_cast();
+					levels = texture9->mLevels;
+					targetSampler.imageView = texture->mImageView;
+				}
 
+				//The packed sampler state is only rebuilt when SetSamplerState or a state block touched the stage.
+				uint64_t stateKey;
+				if (pair1.first < 16)
+				{
+					if (deviceState.mSamplerStateDirtyMask & (1 << pair1.first))
+					{
+						deviceState.mSamplerStateKeys[pair1.first] = SamplerRequest::GetStateKey(samplerStates[pair1.first]);
+						deviceState.mSamplerStateDirtyMask &= ~(1 << pair1.first);
+					}
+					stateKey = deviceState.mSamplerStateKeys[pair1.first];
+				}
+				else
+				{
+					stateKey = SamplerRequest::GetStateKey(samplerStates[pair1.first]);
+				}
 
-			for (size_t i = 0; i < realWindow.mSamplerRequests.size(); i++)
-			{
-				auto& storedRequest = realWindow.mSamplerRequests[i];
-				if (request->MagFilter == storedRequest->MagFilter
-					&& request->MinFilter == storedRequest->MinFilter
-					&& request->AddressModeU == storedRequest->AddressModeU
-					&& request->AddressModeV == storedRequest->AddressModeV
-					&& request->AddressModeW == storedRequest->AddressModeW
-					&& request->MaxAnisotropy == storedRequest->MaxAnisotropy
-					&& request->MipmapMode == storedRequest->MipmapMode
-					&& request->MipLodBias == storedRequest->MipLodBias
-					&& request->MaxLod == storedRequest->MaxLod)
+				uint64_t key = SamplerRequest::GetKey(stateKey, levels);
+
+				SamplerRequest* request = nullptr;
+				auto samplerResult = realWindow.mSamplers.find(key);
+				if (samplerResult != realWindow.mSamplers.end())
 				{
-					request->Sampler = storedRequest->Sampler;
-					request->mRealWindow = nullptr; //Not owner.
-					storedRequest->LastUsed = std::chrono::steady_clock::now();
+					request = samplerResult->second.get();
 				}
-			}
+				else
+				{
+					std::shared_ptr<SamplerRequest> newRequest = std::make_shared<SamplerRequest>(&realWindow, key);
+					CreateSampler(realWindow, newRequest);
+					request = newRequest.get();
+				}
+
+				request->LastUsedFrame = realWindow.mFrameNumber;
 
-			if (request->Sampler == nullptr)
+				targetSampler.sampler = request->Sampler;
+				targetSampler.imageLayout = vk::ImageLayout::eShaderReadOnlyOptimal;
+			}
+			else
 			{
-				CreateSampler(realWindow,request);
+				targetSampler.sampler = realWindow.mSampler;
+				targetSampler.imageView = realWindow.mImageView;
+				targetSampler.imageLayout = vk::ImageLayout::eShaderReadOnlyOptimal;
 			}
-
-			targetSampler.sampler = request->Sampler;
-			targetSampler.imageLayout = vk::ImageLayout::eShaderReadOnlyOptimal;
 		}
-		else
+
+		//Templates push every binding in the layout so stages without a texture get the default one instead of whatever was there last.
+		if (realWindow.mRealDevice->mHasDescriptorUpdateTemplate)
 		{
-			targetSampler.sampler = realWindow.mSampler;
-			targetSampler.imageView = realWindow.mImageView;
-			targetSampler.imageLayout = vk::ImageLayout::eShaderReadOnlyOptimal;
+			for (DWORD i = 0; i < 16; i++)
+			{
+				auto& imageInfo = realWindow.mDescriptorPushData.ImageInfo[i];
+				if (deviceState.mTextures.count(i))
+				{
+					imageInfo = deviceState.mDescriptorImageInfo[i];
+				}
+				else
+				{
+					imageInfo.sampler = realWindow.mSampler;
+					imageInfo.imageView = realWindow.mImageView;
+					imageInfo.imageLayout = vk::ImageLayout::eShaderReadOnlyOptimal;
+				}
+			}
 		}
 	}
 
@@ -588,29 +687,65 @@ void RenderManager::BeginDraw(RealWindow& realWindow, std::shared_ptr<DrawContex
 		context->PixelShader = deviceState.mPixelShader; //pixel		
 	}
 
-	if (deviceState.mVertexShader != nullptr)
+	/*
+	A shader's def constants share the slots with the ones the game sets so they are written again whenever a different shader is bound.
+	Otherwise the draw would upload whatever the previous shader or a Set*ShaderConstant call left in those registers.
+	*/
+	const ShaderConverter* boundConverters[2] =
 	{
-		context->mVertexShaderConstantSlots = deviceState.mVertexShaderConstantSlots;
-		resourceContext->WasShader = true;
+		(context->VertexShader != nullptr) ? mStateManager.mShaderConverters[context->VertexShader->mId].get() : nullptr,
+		(context->PixelShader != nullptr) ? mStateManager.mShaderConverters[context->PixelShader->mId].get() : nullptr
+	};
+	ShaderConstantSlots* definedSlots[2] = { &deviceState.mVertexShaderConstantSlots, &deviceState.mPixelShaderConstantSlots };
+	BOOL* definedDirty[2] = { &deviceState.mAreVertexShaderConstantsDirty, &deviceState.mArePixelShaderConstantsDirty };
+	uint32_t* definedSizes[2] = { &deviceState.mVertexShaderConstantsSize, &deviceState.mPixelShaderConstantsSize };
+
+	for (size_t i = 0; i < 2; i++)
+	{
+		if (boundConverters[i] == realWindow.mConstantDefinitionConverters[i])
+		{
+			continue;
+		}
+
+		realWindow.mConstantDefinitionConverters[i] = boundConverters[i];
+		if (boundConverters[i] != nullptr && !boundConverters[i]->mConstantDefinitions.empty())
+		{
+			boundConverters[i]->ApplyConstantDefinitions((*definedSlots[i]));
+			(*definedDirty[i]) = true;
+			(*definedSizes[i]) = sizeof(ShaderConstantSlots);
+			deviceState.mArePipelineHashesDirty = true;
+		}
 	}
 
-	if (deviceState.mPixelShader != nullptr)
+	if (deviceState.mArePipelineHashesDirty)
 	{
-		context->mPixelShaderConstantSlots = deviceState.mPixelShaderConstantSlots;
+		deviceState.mSpecializationConstantsHash = HashStateWords(&deviceState.mSpecializationConstants, sizeof(SpecializationConstants));
+		deviceState.mVertexShaderConstantSlotsHash = HashStateWords(&deviceState.mVertexShaderConstantSlots, sizeof(ShaderConstantSlots));
+		deviceState.mPixelShaderConstantSlotsHash = HashStateWords(&deviceState.mPixelShaderConstantSlots, sizeof(ShaderConstantSlots));
+		deviceState.mArePipelineHashesDirty = false;
 	}
 
-	context->StreamCount = deviceState.mStreamSources.size();
-	context->mSpecializationConstants = deviceState.mSpecializationConstants;
+	SetSpecializationConstant(deviceState, deviceState.mSpecializationConstants.lightCount, (int)deviceState.mLights.size());
+	SetSpecializationConstant(deviceState, deviceState.mSpecializationConstants.textureCount, (int)deviceState.mTextures.size());
 
-	SpecializationConstants& constants = context->mSpecializationConstants;
-	ShaderConstantSlots& vertexSlots = context->mVertexShaderConstantSlots;
-	ShaderConstantSlots& pixelSlots = context->mPixelShaderConstantSlots;
+	/*
+	The layout key covers the shaders and vertex layout which decide the descriptor set & pipeline layouts.
+	The full key adds the render states on top of that.
+	*/
+	const bool hasExtendedDynamicState = realWindow.mRealDevice->mHasExtendedDynamicState;
+	uint64_t layoutKey = (uint64_t)(hasExtendedDynamicState ? GetPrimitiveTypeClass(context->PrimitiveType) : context->PrimitiveType);
+	layoutKey = HashCombine(layoutKey, (uint64_t)context->FVF);
+	layoutKey = HashCombine(layoutKey, (uint64_t)context->VertexDeclaration);
+	layoutKey = HashCombine(layoutKey, (uint64_t)context->VertexShader);
+	layoutKey = HashCombine(layoutKey, (uint64_t)context->PixelShader);
 
-	constants.lightCount = deviceState.mLights.size();
-	constants.textureCount = deviceState.mTextures.size();
+	if (deviceState.mVertexShader != nullptr)
+	{
+		resourceContext->WasShader = true;
+	}
 
-	deviceState.mSpecializationConstants.lightCount = constants.lightCount;
-	deviceState.mSpecializationConstants.textureCount = constants.textureCount;
+	context->StreamCount = deviceState.mStreamSources.size();
+	layoutKey = HashCombine(layoutKey, (uint64_t)context->StreamCount);
 
 	int i = 0;
 	BOOST_FOREACH(auto& source, deviceState.mStreamSources)
@@ -620,46 +755,180 @@ void RenderManager::BeginDraw(RealWindow& realWindow, std::shared_ptr<DrawContex
 		realWindow.mVertexInputBindingDescription[i].inputRate = vk::VertexInputRate::eVertex;
 
 		context->Bindings[source.first] = source.second.Stride;
+		layoutKey = HashCombine(layoutKey, (((uint64_t)source.first) << 32) | source.second.Stride);
 
 		i++;
 	}
 
+	/*
+	The state hash is an xor of every word so the dynamic states are taken back out with another xor.
+	*/
+	SpecializationConstants& constants = deviceState.mSpecializationConstants;
+	const uint32_t* constantWords = (const uint32_t*)&constants;
+	uint64_t constantsHash = deviceState.mSpecializationConstantsHash;
+
+	for (auto word : gDynamicStateWords)
+	{
+		constantsHash ^= HashStateWord(word, constantWords[word]);
+	}
+
+	if (hasExtendedDynamicState)
+	{
+		for (auto word : gExtendedDynamicStateWords)
+		{
+			constantsHash ^= HashStateWord(word, constantWords[word]);
+		}
+	}
+
+	uint64_t key = HashCombine(layoutKey, constantsHash);
+
+	//Constants read from the constant ring aren't part of the pipeline.
+	if (!mStateManager.mUseShaderConstantBuffer)
+	{
+		if (deviceState.mVertexShader != nullptr)
+		{
+			key = HashCombine(key, deviceState.mVertexShaderConstantSlotsHash);
+		}
+
+		if (deviceState.mPixelShader != nullptr)
+		{
+			key = HashCombine(key, deviceState.mPixelShaderConstantSlotsHash);
+		}
+	}
+
+	context->Key = key;
+	context->LayoutKey = layoutKey;
+
 	/**********************************************
 	* Check for existing pipeline. Create one if there isn't a matching one.
 	**********************************************/
 
-	for (size_t i = 0; i < realWindow.mDrawBuffer.size(); i++)
+	std::shared_ptr<DrawContext> pipe;
+	auto& pipelineCompiler = (*realWindow.mPipelineCompiler);
+	context->mRealWindow = nullptr; //The draw never owns the pipeline.
+
+	auto range = realWindow.mDrawBuffer.equal_range(key);
+	for (auto drawBuffer = range.first; drawBuffer != range.second; ++drawBuffer)
 	{
-		auto& drawBuffer = (*realWindow.mDrawBuffer[i]);
+		if (IsSamePipelineState((*drawBuffer->second), (*context), deviceState, hasExtendedDynamicState, !mStateManager.mUseShaderConstantBuffer))
+		{
+			pipe = drawBuffer->second;
+			break;
+		}
 
-		if (drawBuffer.PrimitiveType == context->PrimitiveType
-			&& drawBuffer.StreamCount == context->StreamCount
+		//Colliding pipelines are kept side by side under the same key.
+		BOOST_LOG_TRIVIAL(warning) << "RenderManager::BeginDraw pipeline key collision " << key;
+	}
 
-			&& drawBuffer.VertexShader == context->VertexShader
-			&& drawBuffer.PixelShader == context->PixelShader
+	if (pipe != nullptr)
+	{
+		pipe->LastUsed = std::chrono::steady_clock::now();
+	}
+	else
+	{
+		/*
+		The pipeline gets its own context because it may still be compiling after this draw is recorded.
+		Only a pipeline that is about to be created needs the full copy of the state.
+		*/
+		pipe = std::make_shared<DrawContext>(&realWindow);
+		pipe->PrimitiveType = context->PrimitiveType;
+		pipe->FVF = context->FVF;
+		pipe->VertexDeclaration = context->VertexDeclaration;
+		pipe->VertexShader = context->VertexShader;
+		pipe->PixelShader = context->PixelShader;
+		pipe->StreamCount = context->StreamCount;
+		memcpy(&pipe->Bindings, &context->Bindings, 64 * sizeof(UINT));
+		pipe->Key = key;
+		pipe->LayoutKey = layoutKey;
+		pipe->mSpecializationConstants = deviceState.mSpecializationConstants;
+
+		if (!mStateManager.mUseShaderConstantBuffer)
+		{
+			if (deviceState.mVertexShader != nullptr)
+			{
+				pipe->mVertexShaderConstantSlots = deviceState.mVertexShaderConstantSlots;
+			}
 
-			&& drawBuffer.FVF == context->FVF
-			&& drawBuffer.VertexDeclaration == context->VertexDeclaration
+			if (deviceState.mPixelShader != nullptr)
+			{
+				pipe->mPixelShaderConstantSlots = deviceState.mPixelShaderConstantSlots;
+			}
+		}
 
-			&& !memcmp(&drawBuffer.mSpecializationConstants, &constants, sizeof(SpecializationConstants))
-			&& !memcmp(&drawBuffer.mVertexShaderConstantSlots, &vertexSlots, sizeof(ShaderConstantSlots))
-			&& !memcmp(&drawBuffer.mPixelShaderConstantSlots, &pixelSlots, sizeof(ShaderConstantSlots))
-			)
+		CreatePipe(realWindow, pipe); //If we didn't find a matching pipeline then create a new one.
+	}
+
+	/*
+	A pipeline that is still compiling is handled according to the configured policy instead of stalling every time.
+	*/
+	if (pipe->IsCompiling)
+	{
+		std::shared_ptr<DrawContext> fallback;
+
+		switch (pipelineCompiler.mPolicy)
+		{
+		case PipelineCompilePolicy_Skip:
+			pipelineCompiler.mSkipCount++;
+			return false;
+		case PipelineCompilePolicy_Fallback:
 		{
-			if (!memcmp(&drawBuffer.Bindings, &context->Bindings, 64 * sizeof(UINT)))
+			auto fallbackPipeline = realWindow.mFallbackPipelines.find(layoutKey);
+			if (fallbackPipeline != realWindow.mFallbackPipelines.end() && fallbackPipeline->second->Pipeline != VK_NULL_HANDLE)
 			{
-				context->Pipeline = drawBuffer.Pipeline;
-				context->PipelineLayout = drawBuffer.PipelineLayout;
-				context->DescriptorSetLayout = drawBuffer.DescriptorSetLayout;
-				context->mRealWindow = nullptr; //Not owner.
-				drawBuffer.LastUsed = std::chrono::steady_clock::now();
+				fallback = fallbackPipeline->second;
 			}
 		}
+		break;
+		default:
+			break;
+		}
+
+		if (fallback != nullptr)
+		{
+			pipelineCompiler.mFallbackCount++;
+			pipe = fallback;
+			pipe->LastUsed = std::chrono::steady_clock::now();
+		}
+		else
+		{
+			pipelineCompiler.mWaitCount++;
+			pipelineCompiler.Wait(*pipe);
+		}
 	}
 
-	if (context->Pipeline == nullptr)
+	if (pipelineCompiler.mPolicy == PipelineCompilePolicy_Fallback && !pipe->IsFallback)
 	{
-		CreatePipe(realWindow,context); //If we didn't find a matching pipeline then create a new one.	
+		realWindow.mFallbackPipelines[pipe->LayoutKey] = pipe;
+		pipe->IsFallback = true;
+	}
+
+	pipe->LastUsedFrame = realWindow.mFrameNumber;
+
+	//Once the optimized pipeline is ready it replaces the fast linked one for every later draw.
+	context->Pipeline = pipe->IsOptimized ? pipe->OptimizedPipeline : pipe->Pipeline;
+	context->PipelineLayout = pipe->PipelineLayout;
+	context->DescriptorSetLayout = pipe->DescriptorSetLayout;
+	context->DescriptorUpdateTemplate = pipe->DescriptorUpdateTemplate;
+
+	/**********************************************
+	* Bind the pipeline if it isn't already.
+	**********************************************/
+	if (bindings.Pipeline != context->Pipeline)
+	{
+		currentSwapChainBuffer.bindPipeline(vk::PipelineBindPoint::eGraphics, context->Pipeline);
+		bindings.Pipeline = context->Pipeline;
+		bindings.BindCounts[BindingType_Pipeline]++;
+	}
+	else
+	{
+		bindings.SkipCounts[BindingType_Pipeline]++;
+	}
+
+	//Every pipeline has its own layout so anything pushed or bound through the previous one has to be recorded again.
+	if (bindings.PipelineLayout != context->PipelineLayout)
+	{
+		bindings.PipelineLayout = context->PipelineLayout;
+		bindings.DirtyFlags |= BINDING_FLAG(BindingType_Descriptors) | BINDING_FLAG(BindingType_PushConstants) | BINDING_FLAG(BindingType_ShaderConstants);
 	}
 
 	/*
@@ -667,25 +936,91 @@ void RenderManager::BeginDraw(RealWindow& realWindow, std::shared_ptr<DrawContex
 	The units for the D3DRS_DEPTHBIAS and D3DRS_SLOPESCALEDEPTHBIAS render states depend on whether z-buffering or w-buffering is enabled.
 	The bias is not applied to any line and point primitive.
 	*/
+	float depthBias = 0.0f;
+	float slopeScaleDepthBias = 0.0f;
 	if (constants.zEnable != D3DZB_FALSE && type > 3)
 	{
-		currentSwapChainBuffer.setDepthBias(constants.depthBias, 0.0f, constants.slopeScaleDepthBias);
+		depthBias = deviceState.mRenderStateConstants.depthBias;
+		slopeScaleDepthBias = deviceState.mRenderStateConstants.slopeScaleDepthBias;
+	}
+
+	const bool isDepthBiasBound = (bindings.BoundFlags & BINDING_FLAG(BindingType_DepthBias)) != 0;
+	if (!isDepthBiasBound || bindings.DepthBias[0] != depthBias || bindings.DepthBias[1] != slopeScaleDepthBias)
+	{
+		currentSwapChainBuffer.setDepthBias(depthBias, 0.0f, slopeScaleDepthBias);
+		bindings.DepthBias[0] = depthBias;
+		bindings.DepthBias[1] = slopeScaleDepthBias;
+		bindings.BoundFlags |= BINDING_FLAG(BindingType_DepthBias);
+		bindings.BindCounts[BindingType_DepthBias]++;
+	}
+	else
+	{
+		bindings.SkipCounts[BindingType_DepthBias]++;
+	}
+
+	//With the second extension the bias is switched off instead of being applied as zero.
+	if (realWindow.mRealDevice->mHasExtendedDynamicState2)
+	{
+		VkBool32 depthBiasEnable = (depthBias != 0.0f || slopeScaleDepthBias != 0.0f) ? VK_TRUE : VK_FALSE;
+		if (!isDepthBiasBound || bindings.DepthBiasEnable != depthBiasEnable)
+		{
+			vkCmdSetDepthBiasEnableEXT((VkCommandBuffer)currentSwapChainBuffer, depthBiasEnable);
+			bindings.DepthBiasEnable = depthBiasEnable;
+		}
+	}
+
+	UpdateDynamicState(realWindow, context);
+
+	if ((bindings.DirtyFlags & BINDING_FLAG(BindingType_Viewport)) && (!(bindings.BoundFlags & BINDING_FLAG(BindingType_Viewport)) || bindings.Viewport != deviceState.mViewport))
+	{
+		currentSwapChainBuffer.setViewport(0, 1, &deviceState.mViewport);
+		bindings.Viewport = deviceState.mViewport;
+		bindings.BoundFlags |= BINDING_FLAG(BindingType_Viewport);
+		bindings.BindCounts[BindingType_Viewport]++;
+	}
+	else
+	{
+		bindings.SkipCounts[BindingType_Viewport]++;
+	}
+
+	if ((bindings.DirtyFlags & BINDING_FLAG(BindingType_Scissor)) && (!(bindings.BoundFlags & BINDING_FLAG(BindingType_Scissor)) || bindings.Scissor != deviceState.mScissor))
+	{
+		currentSwapChainBuffer.setScissor(0, 1, &deviceState.mScissor);
+		bindings.Scissor = deviceState.mScissor;
+		bindings.BoundFlags |= BINDING_FLAG(BindingType_Scissor);
+		bindings.BindCounts[BindingType_Scissor]++;
 	}
 	else
 	{
-		currentSwapChainBuffer.setDepthBias(0.0f, 0.0f, 0.0f);
+		bindings.SkipCounts[BindingType_Scissor]++;
 	}
 
 	/**********************************************
 	* Update transformation structure.
 	**********************************************/
-	if (context->VertexShader == nullptr)
+	if (bindings.DirtyFlags & BINDING_FLAG(BindingType_PushConstants))
 	{
-		UpdatePushConstants(realWindow,context);
+		if (context->VertexShader == nullptr)
+		{
+			UpdatePushConstants(realWindow, context);
+		}
+		else
+		{
+			currentSwapChainBuffer.pushConstants(context->PipelineLayout, vk::ShaderStageFlagBits::eAllGraphics, 0, UBO_SIZE * 2, &deviceState.mPushConstants);
+		}
+		bindings.BindCounts[BindingType_PushConstants]++;
 	}
 	else
 	{
-		currentSwapChainBuffer.pushConstants(context->PipelineLayout, vk::ShaderStageFlagBits::eAllGraphics, 0, UBO_SIZE * 2, &deviceState.mPushConstants);
+		bindings.SkipCounts[BindingType_PushConstants]++;
+	}
+
+	if (context->VertexShader != nullptr && mStateManager.mUseShaderConstantBuffer)
+	{
+		if (!UpdateShaderConstants(realWindow, context))
+		{
+			return false;
+		}
 	}
 
 	/**********************************************
@@ -694,48 +1029,69 @@ void RenderManager::BeginDraw(RealWindow& realWindow, std::shared_ptr<DrawContex
 
 	if (context->DescriptorSetLayout != VK_NULL_HANDLE)
 	{
-		std::copy(std::begin(deviceState.mDescriptorImageInfo), std::end(deviceState.mDescriptorImageInfo), std::begin(resourceContext->DescriptorImageInfo));
-
-		if (context->VertexShader == nullptr)
+		if (bindings.DirtyFlags & BINDING_FLAG(BindingType_Descriptors))
 		{
-			realWindow.mDescriptorBufferInfo[0].buffer = realWindow.mLightBuffer;
-			realWindow.mDescriptorBufferInfo[0].offset = 0;
-			realWindow.mDescriptorBufferInfo[0].range = sizeof(Light) * deviceState.mLights.size(); //4; 
-
-			realWindow.mDescriptorBufferInfo[1].buffer = realWindow.mMaterialBuffer;
-			realWindow.mDescriptorBufferInfo[1].offset = 0;
-			realWindow.mDescriptorBufferInfo[1].range = sizeof(D3DMATERIAL9);
-
-			realWindow.mWriteDescriptorSet[0].descriptorType = vk::DescriptorType::eUniformBuffer;
-			realWindow.mWriteDescriptorSet[0].dstSet = resourceContext->DescriptorSet;
-			realWindow.mWriteDescriptorSet[0].descriptorCount = 1;
-			realWindow.mWriteDescriptorSet[0].pBufferInfo = &realWindow.mDescriptorBufferInfo[0];
-
-			realWindow.mWriteDescriptorSet[1].dstSet = resourceContext->DescriptorSet;
-			realWindow.mWriteDescriptorSet[1].descriptorCount = 1;
-			realWindow.mWriteDescriptorSet[1].pBufferInfo = &realWindow.mDescriptorBufferInfo[1];
-
-			realWindow.mWriteDescriptorSet[2].dstSet = resourceContext->DescriptorSet;
-			realWindow.mWriteDescriptorSet[2].descriptorCount = deviceState.mTextures.size();
-			realWindow.mWriteDescriptorSet[2].pImageInfo = resourceContext->DescriptorImageInfo;
-
-			if (deviceState.mTextures.size())
+			if (context->DescriptorUpdateTemplate != vk::DescriptorUpdateTemplateKHR())
 			{
-				currentSwapChainBuffer.pushDescriptorSetKHR(vk::PipelineBindPoint::eGraphics, context->PipelineLayout, 0, 3, realWindow.mWriteDescriptorSet);
+				//The template reads the image infos straight out of the packed struct so there are no writes to fill in.
+				if (context->VertexShader == nullptr)
+				{
+					realWindow.mDescriptorPushData.BufferInfo[0] = realWindow.mLightBufferInfo;
+					realWindow.mDescriptorPushData.BufferInfo[1] = realWindow.mMaterialBufferInfo;
+					realWindow.mDescriptorPushData.BufferInfo[3] = realWindow.mRenderStateBufferInfo;
+				}
+
+				currentSwapChainBuffer.pushDescriptorSetWithTemplateKHR(context->DescriptorUpdateTemplate, context->PipelineLayout, 0, &realWindow.mDescriptorPushData);
 			}
 			else
 			{
-				currentSwapChainBuffer.pushDescriptorSetKHR(vk::PipelineBindPoint::eGraphics, context->PipelineLayout, 0, 2, realWindow.mWriteDescriptorSet);
+				std::copy(std::begin(deviceState.mDescriptorImageInfo), std::end(deviceState.mDescriptorImageInfo), std::begin(resourceContext->DescriptorImageInfo));
+
+				if (context->VertexShader == nullptr)
+				{
+					realWindow.mDescriptorBufferInfo[0] = realWindow.mLightBufferInfo;
+					realWindow.mDescriptorBufferInfo[1] = realWindow.mMaterialBufferInfo;
+					realWindow.mDescriptorBufferInfo[3] = realWindow.mRenderStateBufferInfo;
+
+					realWindow.mWriteDescriptorSet[0].descriptorType = vk::DescriptorType::eUniformBuffer;
+					realWindow.mWriteDescriptorSet[0].dstSet = resourceContext->DescriptorSet;
+					realWindow.mWriteDescriptorSet[0].descriptorCount = 1;
+					realWindow.mWriteDescriptorSet[0].pBufferInfo = &realWindow.mDescriptorBufferInfo[0];
+
+					realWindow.mWriteDescriptorSet[1].dstSet = resourceContext->DescriptorSet;
+					realWindow.mWriteDescriptorSet[1].descriptorCount = 1;
+					realWindow.mWriteDescriptorSet[1].pBufferInfo = &realWindow.mDescriptorBufferInfo[1];
+
+					realWindow.mWriteDescriptorSet[2].dstSet = resourceContext->DescriptorSet;
+
+					realWindow.mWriteDescriptorSet[3].dstSet = resourceContext->DescriptorSet;
+					realWindow.mWriteDescriptorSet[3].descriptorCount = deviceState.mTextures.size();
+					realWindow.mWriteDescriptorSet[3].pImageInfo = resourceContext->DescriptorImageInfo;
+
+					if (deviceState.mTextures.size())
+					{
+						currentSwapChainBuffer.pushDescriptorSetKHR(vk::PipelineBindPoint::eGraphics, context->PipelineLayout, 0, 4, realWindow.mWriteDescriptorSet);
+					}
+					else
+					{
+						currentSwapChainBuffer.pushDescriptorSetKHR(vk::PipelineBindPoint::eGraphics, context->PipelineLayout, 0, 3, realWindow.mWriteDescriptorSet);
+					}
+				}
+				else
+				{
+					realWindow.mWriteDescriptorSet[0].descriptorType = vk::DescriptorType::eCombinedImageSampler;
+					realWindow.mWriteDescriptorSet[0].dstSet = resourceContext->DescriptorSet;
+					realWindow.mWriteDescriptorSet[0].descriptorCount = deviceState.mTextures.size(); //Revisit
+					realWindow.mWriteDescriptorSet[0].pImageInfo = resourceContext->DescriptorImageInfo;
+
+					currentSwapChainBuffer.pushDescriptorSetKHR(vk::PipelineBindPoint::eGraphics, context->PipelineLayout, 0, 1, realWindow.mWriteDescriptorSet);
+				}
 			}
+			bindings.BindCounts[BindingType_Descriptors]++;
 		}
 		else
 		{
-			realWindow.mWriteDescriptorSet[0].descriptorType = vk::DescriptorType::eCombinedImageSampler;
-			realWindow.mWriteDescriptorSet[0].dstSet = resourceContext->DescriptorSet;
-			realWindow.mWriteDescriptorSet[0].descriptorCount = deviceState.mTextures.size(); //Revisit
-			realWindow.mWriteDescriptorSet[0].pImageInfo = resourceContext->DescriptorImageInfo;
-
-			currentSwapChainBuffer.pushDescriptorSetKHR(vk::PipelineBindPoint::eGraphics, context->PipelineLayout, 0, 1, realWindow.mWriteDescriptorSet);
+			bindings.SkipCounts[BindingType_Descriptors]++;
 		}
 	}
 
@@ -743,29 +1099,67 @@ void RenderManager::BeginDraw(RealWindow& realWindow, std::shared_ptr<DrawContex
 	* Setup bindings
 	**********************************************/
 
-	//TODO: I need to find a way to prevent binding on every draw call.
-
-	//if (!mIsDirty || mLastVkPipeline != context->Pipeline)
-	//{
-	currentSwapChainBuffer.bindPipeline(vk::PipelineBindPoint::eGraphics, context->Pipeline);
-	//	mLastVkPipeline = context->Pipeline;
-	//}
-
-	realWindow.mVertexCount = 0;
-
-	if (deviceState.mIndexBuffer != nullptr)
+	/*
+	Buffers are only looked at when a set handler, a state block or a rename touched them.
+	Every frame starts dirty so the first draw stamps each buffer with the frame that uses it.
+	*/
+	if (bindings.DirtyFlags & BINDING_FLAG(BindingType_IndexBuffer))
+	{
+		if (deviceState.mIndexBuffer != nullptr)
+		{
+			if (bindings.IndexBuffer != deviceState.mIndexBuffer->mBuffer || bindings.IndexType != deviceState.mIndexBuffer->mIndexType)
+			{
+				currentSwapChainBuffer.bindIndexBuffer(deviceState.mIndexBuffer->mBuffer, 0, deviceState.mIndexBuffer->mIndexType);
+				bindings.IndexBuffer = deviceState.mIndexBuffer->mBuffer;
+				bindings.IndexType = deviceState.mIndexBuffer->mIndexType;
+				bindings.BindCounts[BindingType_IndexBuffer]++;
+			}
+			else
+			{
+				bindings.SkipCounts[BindingType_IndexBuffer]++;
+			}
+			deviceState.mIndexBuffer->mLastUsedFrame = realWindow.mFrameNumber;
+		}
+	}
+	else if (deviceState.mIndexBuffer != nullptr)
 	{
-		currentSwapChainBuffer.bindIndexBuffer(deviceState.mIndexBuffer->mBuffer, 0, deviceState.mIndexBuffer->mIndexType);
+		bindings.SkipCounts[BindingType_IndexBuffer]++;
 	}
 
-	BOOST_FOREACH(auto& source, deviceState.mStreamSources)
+	if (bindings.DirtyFlags & BINDING_FLAG(BindingType_VertexBuffers))
+	{
+		realWindow.mVertexCount = 0;
+
+		BOOST_FOREACH(auto& source, deviceState.mStreamSources)
+		{
+			auto& buffer = mStateManager.mVertexBuffers[source.second.StreamData->mId];
+			if (source.first >= BINDING_MAX_STREAMS || bindings.VertexBuffers[source.first] != buffer->mBuffer || bindings.VertexBufferOffsets[source.first] != source.second.OffsetInBytes)
+			{
+				currentSwapChainBuffer.bindVertexBuffers(source.first, 1, &buffer->mBuffer, &source.second.OffsetInBytes);
+				if (source.first < BINDING_MAX_STREAMS)
+				{
+					bindings.VertexBuffers[source.first] = buffer->mBuffer;
+					bindings.VertexBufferOffsets[source.first] = source.second.OffsetInBytes;
+				}
+				bindings.BindCounts[BindingType_VertexBuffers]++;
+			}
+			else
+			{
+				bindings.SkipCounts[BindingType_VertexBuffers]++;
+			}
+			buffer->mLastUsedFrame = realWindow.mFrameNumber;
+			realWindow.mVertexCount += source.second.StreamData->mSize;
+		}
+	}
+	else
 	{
-		auto& buffer = mStateManager.mVertexBuffers[source.second.StreamData->mId];
-		currentSwapChainBuffer.bindVertexBuffers(source.first, 1, &buffer->mBuffer, &source.second.OffsetInBytes);
-		realWindow.mVertexCount += source.second.StreamData->mSize;
+		bindings.SkipCounts[BindingType_VertexBuffers] += deviceState.mStreamSources.size();
 	}
 
+	bindings.DirtyFlags = 0;
 	realWindow.mIsDirty = false;
+
+	return true;
 }
 
 void RenderManager::CreatePipe(RealWindow& realWindow, std::shared_ptr<DrawContext> context)
@@ -773,6 +1167,7 @@ void RenderManager::CreatePipe(RealWindow& realWindow, std::shared_ptr<DrawConte
 	vk::Result result;
 	auto& deviceState = realWindow.mDeviceState;
 	auto& device = realWindow.mRealDevice->mDevice;
+	vk::DescriptorSetLayout setLayouts[2];
 
 	/**********************************************
 	* Figure out flags
@@ -862,26 +1257,7 @@ void RenderManager::CreatePipe(RealWindow& realWindow, std::shared_ptr<DrawConte
 	//realWindow.mPipelineDepthStencilStateCreateInfo.depthBoundsTestEnable = constants.bound
 	realWindow.mPipelineDepthStencilStateCreateInfo.stencilTestEnable = constants.stencilEnable; //VK_FALSE;
 
-	if (constants.cullMode != D3DCULL_CCW)
-	{
-		realWindow.mPipelineDepthStencilStateCreateInfo.back.failOp = ConvertStencilOperation(constants.ccwStencilFail);
-		realWindow.mPipelineDepthStencilStateCreateInfo.back.passOp = ConvertStencilOperation(constants.ccwStencilPass);
-		realWindow.mPipelineDepthStencilStateCreateInfo.back.compareOp = ConvertCompareOperation(constants.ccwStencilFunction);
-
-		realWindow.mPipelineDepthStencilStateCreateInfo.front.failOp = ConvertStencilOperation(constants.stencilFail);
-		realWindow.mPipelineDepthStencilStateCreateInfo.front.passOp = ConvertStencilOperation(constants.stencilPass);
-		realWindow.mPipelineDepthStencilStateCreateInfo.front.compareOp = ConvertCompareOperation(constants.stencilFunction);
-	}
-	else
-	{
-		realWindow.mPipelineDepthStencilStateCreateInfo.back.failOp = ConvertStencilOperation(constants.stencilFail);
-		realWindow.mPipelineDepthStencilStateCreateInfo.back.passOp = ConvertStencilOperation(constants.stencilPass);
-		realWindow.mPipelineDepthStencilStateCreateInfo.back.compareOp = ConvertCompareOperation(constants.stencilFunction);
-
-		realWindow.mPipelineDepthStencilStateCreateInfo.front.failOp = ConvertStencilOperation(constants.ccwStencilFail);
-		realWindow.mPipelineDepthStencilStateCreateInfo.front.passOp = ConvertStencilOperation(constants.ccwStencilPass);
-		realWindow.mPipelineDepthStencilStateCreateInfo.front.compareOp = ConvertCompareOperation(constants.ccwStencilFunction);
-	}
+	SetStencilOperations(realWindow.mPipelineDepthStencilStateCreateInfo.front, realWindow.mPipelineDepthStencilStateCreateInfo.back, constants);
 
 
 	//mPipelineDepthStencilStateCreateInfo.minDepthBounds = 0.0f;
@@ -892,8 +1268,32 @@ void RenderManager::CreatePipe(RealWindow& realWindow, std::shared_ptr<DrawConte
 	**********************************************/
 	if (context->VertexShader != nullptr)
 	{
-		realWindow.mPipelineShaderStageCreateInfo[0].module = mStateManager.mShaderConverters[context->VertexShader->mId]->mConvertedShader.ShaderModule;
-		realWindow.mPipelineShaderStageCreateInfo[1].module = mStateManager.mShaderConverters[context->PixelShader->mId]->mConvertedShader.ShaderModule;
+		//Only a pipeline that needs a shader still being translated has to wait for it.
+		auto& vertexShaderConverter = mStateManager.mShaderConverters[context->VertexShader->mId];
+		if (vertexShaderConverter != nullptr)
+		{
+			mStateManager.mShaderTranslator->Wait(*vertexShaderConverter);
+			realWindow.mPipelineShaderStageCreateInfo[0].module = vertexShaderConverter->mConvertedShader.ShaderModule;
+			context->ShaderConverters[0] = vertexShaderConverter;
+			context->ShaderKeys[0] = vertexShaderConverter->mDiskKey;
+		}
+		else
+		{
+			BOOST_LOG_TRIVIAL(error) << "RenderManager::CreatePipe vertex shader " << context->VertexShader->mId << " has no converter.";
+		}
+
+		if (context->PixelShader != nullptr && mStateManager.mShaderConverters[context->PixelShader->mId] != nullptr)
+		{
+			auto& pixelShaderConverter = mStateManager.mShaderConverters[context->PixelShader->mId];
+			mStateManager.mShaderTranslator->Wait(*pixelShaderConverter);
+			realWindow.mPipelineShaderStageCreateInfo[1].module = pixelShaderConverter->mConvertedShader.ShaderModule;
+			context->ShaderConverters[1] = pixelShaderConverter;
+			context->ShaderKeys[1] = pixelShaderConverter->mDiskKey;
+		}
+		else
+		{
+			BOOST_LOG_TRIVIAL(warning) << "RenderManager::CreatePipe a vertex shader without a pixel shader is not implemented!";
+		}
 	}
 	else
 	{
@@ -1122,8 +1522,11 @@ void RenderManager::CreatePipe(RealWindow& realWindow, std::shared_ptr<DrawConte
 
 	if (context->VertexShader != nullptr)
 	{
-		auto& convertedVertexShader = mStateManager.mShaderConverters[context->VertexShader->mId]->mConvertedShader;
-		auto& convertedPixelShader = mStateManager.mShaderConverters[context->PixelShader->mId]->mConvertedShader;
+		//Either converter can be missing (see above) so an empty shader stands in for it.
+		static const ConvertedShader emptyShader = {};
+		auto& vertexShaderConverter = mStateManager.mShaderConverters[context->VertexShader->mId];
+		auto& convertedVertexShader = (vertexShaderConverter != nullptr) ? vertexShaderConverter->mConvertedShader : emptyShader;
+		auto& convertedPixelShader = (context->PixelShader != nullptr && mStateManager.mShaderConverters[context->PixelShader->mId] != nullptr) ? mStateManager.mShaderConverters[context->PixelShader->mId]->mConvertedShader : emptyShader;
 
 		realWindow.mPipelineVertexInputStateCreateInfo.vertexBindingDescriptionCount = context->StreamCount;
 		realWindow.mPipelineVertexInputStateCreateInfo.vertexAttributeDescriptionCount = attributeCount;
@@ -1134,17 +1537,39 @@ void RenderManager::CreatePipe(RealWindow& realWindow, std::shared_ptr<DrawConte
 		realWindow.mPipelineLayoutCreateInfo.pSetLayouts = &context->DescriptorSetLayout;
 
 		realWindow.mDescriptorSetLayoutCreateInfo.bindingCount = convertedPixelShader.mDescriptorSetLayoutBindingCount;
-		realWindow.mPipelineLayoutCreateInfo.setLayoutCount = 1;
 
-		realWindow.mVertexSpecializationInfo.pData = &context->mVertexShaderConstantSlots;
-		realWindow.mVertexSpecializationInfo.dataSize = sizeof(ShaderConstantSlots);
-		realWindow.mVertexSpecializationInfo.pMapEntries = realWindow.mSlotMapEntries;
-		realWindow.mVertexSpecializationInfo.mapEntryCount = 1024;
+		if (mStateManager.mUseShaderConstantBuffer)
+		{
+			//Set 0 is the pushed samplers and set 1 is the constant ring so the shaders don't need any specialization.
+			setLayouts[1] = realWindow.mShaderConstantDescriptorSetLayout;
+			realWindow.mPipelineLayoutCreateInfo.pSetLayouts = setLayouts;
+			realWindow.mPipelineLayoutCreateInfo.setLayoutCount = 2;
+
+			realWindow.mVertexSpecializationInfo.pData = nullptr;
+			realWindow.mVertexSpecializationInfo.dataSize = 0;
+			realWindow.mVertexSpecializationInfo.pMapEntries = nullptr;
+			realWindow.mVertexSpecializationInfo.mapEntryCount = 0;
+
+			realWindow.mPixelSpecializationInfo.pData = nullptr;
+			realWindow.mPixelSpecializationInfo.dataSize = 0;
+			realWindow.mPixelSpecializationInfo.pMapEntries = nullptr;
+			realWindow.mPixelSpecializationInfo.mapEntryCount = 0;
+		}
+		else
+		{
+			realWindow.mPipelineLayoutCreateInfo.setLayoutCount = 1;
 
-		realWindow.mPixelSpecializationInfo.pData = &context->mPixelShaderConstantSlots;
-		realWindow.mPixelSpecializationInfo.dataSize = sizeof(ShaderConstantSlots);
-		realWindow.mPixelSpecializationInfo.pMapEntries = realWindow.mSlotMapEntries;
-		realWindow.mPixelSpecializationInfo.mapEntryCount = 1024;
+			//Only the registers each shader reads are specialized. The entries live in the converters which outlive any pipeline built from them.
+			realWindow.mVertexSpecializationInfo.pData = &context->mVertexShaderConstantSlots;
+			realWindow.mVertexSpecializationInfo.dataSize = sizeof(ShaderConstantSlots);
+			realWindow.mVertexSpecializationInfo.pMapEntries = convertedVertexShader.mSpecializationMapEntries.data();
+			realWindow.mVertexSpecializationInfo.mapEntryCount = (uint32_t)convertedVertexShader.mSpecializationMapEntries.size();
+
+			realWindow.mPixelSpecializationInfo.pData = &context->mPixelShaderConstantSlots;
+			realWindow.mPixelSpecializationInfo.dataSize = sizeof(ShaderConstantSlots);
+			realWindow.mPixelSpecializationInfo.pMapEntries = convertedPixelShader.mSpecializationMapEntries.data();
+			realWindow.mPixelSpecializationInfo.mapEntryCount = (uint32_t)convertedPixelShader.mSpecializationMapEntries.size();
+		}
 	}
 	else
 	{
@@ -1163,35 +1588,42 @@ void RenderManager::CreatePipe(RealWindow& realWindow, std::shared_ptr<DrawConte
 		realWindow.mDescriptorSetLayoutBinding[1].stageFlags = vk::ShaderStageFlagBits::eAllGraphics;
 		realWindow.mDescriptorSetLayoutBinding[1].pImmutableSamplers = nullptr;
 
-		realWindow.mDescriptorSetLayoutBinding[2].binding = 2;
-		realWindow.mDescriptorSetLayoutBinding[2].descriptorType = vk::DescriptorType::eCombinedImageSampler; //VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER'
-		realWindow.mDescriptorSetLayoutBinding[2].descriptorCount = textureCount; //Update to use mapped texture.
-		realWindow.mDescriptorSetLayoutBinding[2].stageFlags = vk::ShaderStageFlagBits::eFragment;
+		//Render state that isn't part of the pipeline.
+		realWindow.mDescriptorSetLayoutBinding[2].binding = 3;
+		realWindow.mDescriptorSetLayoutBinding[2].descriptorType = vk::DescriptorType::eUniformBuffer;
+		realWindow.mDescriptorSetLayoutBinding[2].descriptorCount = 1;
+		realWindow.mDescriptorSetLayoutBinding[2].stageFlags = vk::ShaderStageFlagBits::eAllGraphics;
 		realWindow.mDescriptorSetLayoutBinding[2].pImmutableSamplers = nullptr;
 
+		realWindow.mDescriptorSetLayoutBinding[3].binding = 2;
+		realWindow.mDescriptorSetLayoutBinding[3].descriptorType = vk::DescriptorType::eCombinedImageSampler; //VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER'
+		realWindow.mDescriptorSetLayoutBinding[3].descriptorCount = textureCount; //Update to use mapped texture.
+		realWindow.mDescriptorSetLayoutBinding[3].stageFlags = vk::ShaderStageFlagBits::eFragment;
+		realWindow.mDescriptorSetLayoutBinding[3].pImmutableSamplers = nullptr;
+
 		realWindow.mDescriptorSetLayoutCreateInfo.pBindings = realWindow.mDescriptorSetLayoutBinding;
 		realWindow.mPipelineLayoutCreateInfo.pSetLayouts = &context->DescriptorSetLayout;
 
 		if (textureCount)
 		{
-			realWindow.mDescriptorSetLayoutCreateInfo.bindingCount = 3; //The number of elements in pBindings.	
+			realWindow.mDescriptorSetLayoutCreateInfo.bindingCount = 4; //The number of elements in pBindings.	
 			realWindow.mPipelineLayoutCreateInfo.setLayoutCount = 1;
 		}
 		else
 		{
-			realWindow.mDescriptorSetLayoutCreateInfo.bindingCount = 2; //The number of elements in pBindings.	
+			realWindow.mDescriptorSetLayoutCreateInfo.bindingCount = 3; //The number of elements in pBindings.	
 			realWindow.mPipelineLayoutCreateInfo.setLayoutCount = 1;
 		}
 
-		realWindow.mVertexSpecializationInfo.pData = &deviceState.mSpecializationConstants;
+		realWindow.mVertexSpecializationInfo.pData = &context->mSpecializationConstants;
 		realWindow.mVertexSpecializationInfo.dataSize = sizeof(SpecializationConstants);
 		realWindow.mVertexSpecializationInfo.pMapEntries = realWindow.mSlotMapEntries;
-		realWindow.mVertexSpecializationInfo.mapEntryCount = 251;
+		realWindow.mVertexSpecializationInfo.mapEntryCount = sizeof(SpecializationConstants) / sizeof(uint32_t);
 
-		realWindow.mPixelSpecializationInfo.pData = &deviceState.mSpecializationConstants;
+		realWindow.mPixelSpecializationInfo.pData = &context->mSpecializationConstants;
 		realWindow.mPixelSpecializationInfo.dataSize = sizeof(SpecializationConstants);
 		realWindow.mPixelSpecializationInfo.pMapEntries = realWindow.mSlotMapEntries;
-		realWindow.mPixelSpecializationInfo.mapEntryCount = 251;
+		realWindow.mPixelSpecializationInfo.mapEntryCount = sizeof(SpecializationConstants) / sizeof(uint32_t);
 	}
 
 	result = device.createDescriptorSetLayout(&realWindow.mDescriptorSetLayoutCreateInfo, nullptr, &context->DescriptorSetLayout);
@@ -1201,6 +1633,8 @@ void RenderManager::CreatePipe(RealWindow& realWindow, std::shared_ptr<DrawConte
 		return;
 	}
 
+	setLayouts[0] = context->DescriptorSetLayout;
+
 	/**********************************************
 	* Create pipeline & descriptor set layout.
 	**********************************************/
@@ -1214,14 +1648,92 @@ void RenderManager::CreatePipe(RealWindow& realWindow, std::shared_ptr<DrawConte
 
 	realWindow.mGraphicsPipelineCreateInfo.layout = context->PipelineLayout;
 
-	result = device.createGraphicsPipelines(realWindow.mPipelineCache, 1, &realWindow.mGraphicsPipelineCreateInfo, nullptr, &context->Pipeline);
-	//result = vkCreateGraphicsPipelines(mDevice->mDevice, VK_NULL_HANDLE, 1, &mGraphicsPipelineCreateInfo, nullptr, &context.Pipeline);
-	if (result != vk::Result::eSuccess)
+	/**********************************************
+	* Create the push descriptor template.
+	**********************************************/
+	if (realWindow.mRealDevice->mHasDescriptorUpdateTemplate)
+	{
+		vk::DescriptorUpdateTemplateEntryKHR descriptorUpdateTemplateEntries[16];
+		uint32_t entryCount = 0;
+
+		for (size_t i = 0; i < realWindow.mDescriptorSetLayoutCreateInfo.bindingCount && entryCount < 16; i++)
+		{
+			const auto& binding = realWindow.mDescriptorSetLayoutBinding[i];
+			auto& entry = descriptorUpdateTemplateEntries[entryCount];
+
+			entry.dstBinding = binding.binding;
+			entry.dstArrayElement = 0;
+			entry.descriptorCount = binding.descriptorCount;
+			entry.descriptorType = binding.descriptorType;
+
+			if (binding.descriptorType == vk::DescriptorType::eUniformBuffer && binding.binding < 4)
+			{
+				entry.offset = offsetof(DescriptorPushData, BufferInfo) + binding.binding * sizeof(vk::DescriptorBufferInfo);
+				entry.stride = sizeof(vk::DescriptorBufferInfo);
+			}
+			else if (binding.descriptorType == vk::DescriptorType::eCombinedImageSampler)
+			{
+				//Fixed function puts every stage in one array binding but shaders get a binding per sampler register.
+				uint32_t firstStage = (context->VertexShader == nullptr) ? 0 : binding.binding;
+				if (firstStage + binding.descriptorCount > 16)
+				{
+					break;
+				}
+
+				entry.offset = offsetof(DescriptorPushData, ImageInfo) + firstStage * sizeof(vk::DescriptorImageInfo);
+				entry.stride = sizeof(vk::DescriptorImageInfo);
+			}
+			else
+			{
+				break;
+			}
+
+			entryCount++;
+		}
+
+		//Anything the template can't describe is pushed the old way.
+		if (entryCount == realWindow.mDescriptorSetLayoutCreateInfo.bindingCount)
+		{
+			vk::DescriptorUpdateTemplateCreateInfoKHR descriptorUpdateTemplateCreateInfo;
+			descriptorUpdateTemplateCreateInfo.descriptorUpdateEntryCount = entryCount;
+			descriptorUpdateTemplateCreateInfo.pDescriptorUpdateEntries = descriptorUpdateTemplateEntries;
+			descriptorUpdateTemplateCreateInfo.templateType = vk::DescriptorUpdateTemplateTypeKHR::ePushDescriptorsKHR;
+			descriptorUpdateTemplateCreateInfo.descriptorSetLayout = context->DescriptorSetLayout;
+			descriptorUpdateTemplateCreateInfo.pipelineBindPoint = vk::PipelineBindPoint::eGraphics;
+			descriptorUpdateTemplateCreateInfo.pipelineLayout = context->PipelineLayout;
+			descriptorUpdateTemplateCreateInfo.set = 0;
+
+			result = device.createDescriptorUpdateTemplateKHR(&descriptorUpdateTemplateCreateInfo, nullptr, &context->DescriptorUpdateTemplate);
+			if (result != vk::Result::eSuccess)
+			{
+				BOOST_LOG_TRIVIAL(warning) << "RenderManager::CreatePipe vkCreateDescriptorUpdateTemplateKHR failed with return code of " << GetResultString((VkResult)result);
+				context->DescriptorUpdateTemplate = vk::DescriptorUpdateTemplateKHR();
+			}
+		}
+	}
+
+	//Pipeline libraries are shared between pipelines so they are keyed by what the layout contains rather than the handle.
+	auto& descriptorLayout = context->DescriptorLayout;
+	descriptorLayout.clear();
+	descriptorLayout.push_back((((uint64_t)realWindow.mPipelineLayoutCreateInfo.setLayoutCount) << 32) | realWindow.mPipelineLayoutCreateInfo.pushConstantRangeCount);
+	for (uint32_t i = 0; i < realWindow.mPipelineLayoutCreateInfo.pushConstantRangeCount; i++)
+	{
+		const auto& pushConstantRange = realWindow.mPipelineLayoutCreateInfo.pPushConstantRanges[i];
+		descriptorLayout.push_back((uint64_t)(VkShaderStageFlags)pushConstantRange.stageFlags);
+		descriptorLayout.push_back((((uint64_t)pushConstantRange.offset) << 32) | pushConstantRange.size);
+	}
+	for (uint32_t i = 0; i < realWindow.mDescriptorSetLayoutCreateInfo.bindingCount; i++)
 	{
-		BOOST_LOG_TRIVIAL(fatal) << "RenderManager::BeginDraw vkCreateGraphicsPipelines failed with return code of " << GetResultString((VkResult)result);
+		const auto& binding = realWindow.mDescriptorSetLayoutCreateInfo.pBindings[i];
+		descriptorLayout.push_back((((uint64_t)binding.binding) << 32) | (uint32_t)binding.descriptorType);
+		descriptorLayout.push_back((((uint64_t)binding.descriptorCount) << 32) | (uint32_t)(VkShaderStageFlags)binding.stageFlags);
 	}
 
-	realWindow.mDrawBuffer.push_back(context);
+	//The layouts are cheap so only the pipeline itself is handed off to the compile threads.
+	realWindow.mPipelineCompiler->Compile(context, realWindow.mGraphicsPipelineCreateInfo);
+	realWindow.mPipelinesSinceCacheSave++;
+
+	realWindow.mDrawBuffer.emplace(context->Key, context);
 }
 
 void RenderManager::CreateSampler(RealWindow& realWindow, std::shared_ptr<SamplerRequest> request)
@@ -1286,90 +1798,317 @@ void RenderManager::CreateSampler(RealWindow& realWindow, std::shared_ptr<Sample
 		return;
 	}
 
-	realWindow.mSamplerRequests.push_back(request);
+	realWindow.mSamplers[request->Key] = request;
 }
 
-void RenderManager::UpdatePushConstants(RealWindow& realWindow, std::shared_ptr<DrawContext> context)
+void RenderManager::UpdateDynamicState(RealWindow& realWindow, std::shared_ptr<DrawContext> context)
 {
-	//vk::Result result;
 	auto& deviceState = realWindow.mDeviceState;
-	//auto& device = realWindow.mRealDevice.mDevice;
-	auto& currentSwapChainBuffer = realWindow.mSwapchainBuffers[realWindow.mCurrentSwapchainBuffer];
-	void* data = nullptr;
+	auto& currentSwapChainBuffer = realWindow.mFrameCommandBuffers[realWindow.mCurrentFrame];
+	auto& bindings = realWindow.mBindings;
+	const SpecializationConstants& constants = deviceState.mSpecializationConstants;
 
-	//if (!mDevice->mDeviceState.mHasTransformsChanged)
-	//{
-	//	return;
-	//}
+	/*
+	The stencil reference & masks and the blend factor are dynamic on every device.
+	*/
+	const uint32_t stencil[3] = { (uint32_t)constants.stencilReference, constants.stencilMask, constants.stencilWriteMask };
+	const bool isStencilBound = (bindings.BoundFlags & BINDING_FLAG(BindingType_Stencil)) != 0;
+	if (!isStencilBound || memcmp(bindings.Stencil, stencil, sizeof(stencil)))
+	{
+		if (!isStencilBound || bindings.Stencil[0] != stencil[0])
+		{
+			currentSwapChainBuffer.setStencilReference(vk::StencilFaceFlagBits::eFront | vk::StencilFaceFlagBits::eBack, stencil[0]);
+		}
+
+		if (!isStencilBound || bindings.Stencil[1] != stencil[1])
+		{
+			currentSwapChainBuffer.setStencilCompareMask(vk::StencilFaceFlagBits::eFront | vk::StencilFaceFlagBits::eBack, stencil[1]);
+		}
+
+		if (!isStencilBound || bindings.Stencil[2] != stencil[2])
+		{
+			currentSwapChainBuffer.setStencilWriteMask(vk::StencilFaceFlagBits::eFront | vk::StencilFaceFlagBits::eBack, stencil[2]);
+		}
+
+		memcpy(bindings.Stencil, stencil, sizeof(stencil));
+		bindings.BoundFlags |= BINDING_FLAG(BindingType_Stencil);
+		bindings.BindCounts[BindingType_Stencil]++;
+	}
+	else
+	{
+		bindings.SkipCounts[BindingType_Stencil]++;
+	}
+
+	if (!(bindings.BoundFlags & BINDING_FLAG(BindingType_BlendConstants)) || bindings.BlendFactor != constants.blendFactor)
+	{
+		//D3DCOLOR is ARGB.
+		const float blendConstants[4] =
+		{
+			((constants.blendFactor >> 16) & 0xFF) / 255.0f,
+			((constants.blendFactor >> 8) & 0xFF) / 255.0f,
+			(constants.blendFactor & 0xFF) / 255.0f,
+			((constants.blendFactor >> 24) & 0xFF) / 255.0f
+		};
+
+		currentSwapChainBuffer.setBlendConstants(blendConstants);
+		bindings.BlendFactor = constants.blendFactor;
+		bindings.BoundFlags |= BINDING_FLAG(BindingType_BlendConstants);
+		bindings.BindCounts[BindingType_BlendConstants]++;
+	}
+	else
+	{
+		bindings.SkipCounts[BindingType_BlendConstants]++;
+	}
+
+	if (!realWindow.mRealDevice->mHasExtendedDynamicState)
+	{
+		return;
+	}
+
+	/*
+	Everything else the pipeline would have baked in is recorded only when it differs from what the command buffer already has.
+	*/
+	vk::PipelineRasterizationStateCreateInfo rasterization;
+	SetCulling(rasterization, (D3DCULL)constants.cullMode);
+
+	DynamicRasterState state;
+	state.CullMode = rasterization.cullMode;
+	state.FrontFace = rasterization.frontFace;
+	state.PrimitiveTopology = ConvertPrimitiveType(context->PrimitiveType);
+	state.DepthTestEnable = (constants.zEnable != D3DZB_FALSE) ? VK_TRUE : VK_FALSE;
+	state.DepthWriteEnable = constants.zWriteEnable ? VK_TRUE : VK_FALSE;
+	state.DepthCompareOp = ConvertCompareOperation(constants.zFunction);
+	state.StencilTestEnable = constants.stencilEnable ? VK_TRUE : VK_FALSE;
+	SetStencilOperations(state.Front, state.Back, constants);
+
+	auto& bound = bindings.RasterState;
+	const bool isBound = (bindings.BoundFlags & BINDING_FLAG(BindingType_RasterState)) != 0;
+	VkCommandBuffer commandBuffer = (VkCommandBuffer)currentSwapChainBuffer;
+	bool isRecorded = false;
+
+	if (!isBound || bound.CullMode != state.CullMode)
+	{
+		vkCmdSetCullModeEXT(commandBuffer, (VkCullModeFlags)state.CullMode);
+		isRecorded = true;
+	}
+
+	if (!isBound || bound.FrontFace != state.FrontFace)
+	{
+		vkCmdSetFrontFaceEXT(commandBuffer, (VkFrontFace)state.FrontFace);
+		isRecorded = true;
+	}
+
+	if (!isBound || bound.PrimitiveTopology != state.PrimitiveTopology)
+	{
+		vkCmdSetPrimitiveTopologyEXT(commandBuffer, (VkPrimitiveTopology)state.PrimitiveTopology);
+		isRecorded = true;
+	}
 
-	realWindow.mTransformations.mModel <<
-		1, 0, 0, 0,
-		0, 1, 0, 0,
-		0, 0, 1, 0,
-		0, 0, 0, 1;
+	if (!isBound || bound.DepthTestEnable != state.DepthTestEnable)
+	{
+		vkCmdSetDepthTestEnableEXT(commandBuffer, state.DepthTestEnable);
+		isRecorded = true;
+	}
+
+	if (!isBound || bound.DepthWriteEnable != state.DepthWriteEnable)
+	{
+		vkCmdSetDepthWriteEnableEXT(commandBuffer, state.DepthWriteEnable);
+		isRecorded = true;
+	}
+
+	if (!isBound || bound.DepthCompareOp != state.DepthCompareOp)
+	{
+		vkCmdSetDepthCompareOpEXT(commandBuffer, (VkCompareOp)state.DepthCompareOp);
+		isRecorded = true;
+	}
+
+	if (!isBound || bound.StencilTestEnable != state.StencilTestEnable)
+	{
+		vkCmdSetStencilTestEnableEXT(commandBuffer, state.StencilTestEnable);
+		isRecorded = true;
+	}
+
+	if (!isBound || bound.Front != state.Front)
+	{
+		vkCmdSetStencilOpEXT(commandBuffer, VK_STENCIL_FACE_FRONT_BIT, (VkStencilOp)state.Front.failOp, (VkStencilOp)state.Front.passOp, (VkStencilOp)state.Front.depthFailOp, (VkCompareOp)state.Front.compareOp);
+		isRecorded = true;
+	}
+
+	if (!isBound || bound.Back != state.Back)
+	{
+		vkCmdSetStencilOpEXT(commandBuffer, VK_STENCIL_FACE_BACK_BIT, (VkStencilOp)state.Back.failOp, (VkStencilOp)state.Back.passOp, (VkStencilOp)state.Back.depthFailOp, (VkCompareOp)state.Back.compareOp);
+		isRecorded = true;
+	}
 
-	realWindow.mTransformations.mView <<
-		1, 0, 0, 0,
-		0, 1, 0, 0,
-		0, 0, 1, 0,
-		0, 0, 0, 1;
+	if (isRecorded)
+	{
+		bound = state;
+		bindings.BoundFlags |= BINDING_FLAG(BindingType_RasterState);
+		bindings.BindCounts[BindingType_RasterState]++;
+	}
+	else
+	{
+		bindings.SkipCounts[BindingType_RasterState]++;
+	}
+}
 
-	realWindow.mTransformations.mProjection <<
-		1, 0, 0, 0,
-		0, 1, 0, 0,
-		0, 0, 1, 0,
-		0, 0, 0, 1;
+void RenderManager::UpdatePushConstants(RealWindow& realWindow, std::shared_ptr<DrawContext> context)
+{
+	//vk::Result result;
+	auto& deviceState = realWindow.mDeviceState;
+	//auto& device = realWindow.mRealDevice.mDevice;
+	auto& currentSwapChainBuffer = realWindow.mFrameCommandBuffers[realWindow.mCurrentFrame];
 
-	BOOST_FOREACH(const auto& pair1, deviceState.mTransforms)
+	/*
+	The matrices are kept between draws and only the ones a SetTransform or state block touched are reloaded.
+	D3D9 matrices are row major so reading one as column major gives the transpose the shaders expect.
+	*/
+	if (deviceState.mChangedTransforms)
 	{
-		switch (pair1.first)
+		const D3DTRANSFORMSTATETYPE states[3] = { D3DTS_WORLD, D3DTS_VIEW, D3DTS_PROJECTION };
+		Eigen::Matrix<float, 4, 4, Eigen::DontAlign>* targets[3] = { &realWindow.mTransformations.mModel, &realWindow.mTransformations.mView, &realWindow.mTransformations.mProjection };
+
+		for (size_t i = 0; i < 3; i++)
 		{
-		case D3DTS_WORLD:
+			if (!(deviceState.mChangedTransforms & (1 << i)))
+			{
+				continue;
+			}
 
-			realWindow.mTransformations.mModel <<
-				pair1.second.m[0][0], pair1.second.m[1][0], pair1.second.m[2][0], pair1.second.m[3][0],
-				pair1.second.m[0][1], pair1.second.m[1][1], pair1.second.m[2][1], pair1.second.m[3][1],
-				pair1.second.m[0][2], pair1.second.m[1][2], pair1.second.m[2][2], pair1.second.m[3][2],
-				pair1.second.m[0][3], pair1.second.m[1][3], pair1.second.m[2][3], pair1.second.m[3][3];
+			if (deviceState.mHasTransforms[states[i]])
+			{
+				(*targets[i]) = Eigen::Map<const Eigen::Matrix<float, 4, 4, Eigen::ColMajor> >(&deviceState.mTransforms[states[i]].m[0][0]);
+			}
+			else
+			{
+				targets[i]->setIdentity();
+			}
+		}
 
-			break;
-		case D3DTS_VIEW:
+		realWindow.mTransformations.mTotalTransformation = realWindow.mTransformations.mProjection * realWindow.mTransformations.mView * realWindow.mTransformations.mModel;
+		deviceState.mChangedTransforms = 0;
+	}
 
-			realWindow.mTransformations.mView <<
-				pair1.second.m[0][0], pair1.second.m[1][0], pair1.second.m[2][0], pair1.second.m[3][0],
-				pair1.second.m[0][1], pair1.second.m[1][1], pair1.second.m[2][1], pair1.second.m[3][1],
-				pair1.second.m[0][2], pair1.second.m[1][2], pair1.second.m[2][2], pair1.second.m[3][2],
-				pair1.second.m[0][3], pair1.second.m[1][3], pair1.second.m[2][3], pair1.second.m[3][3];
+	currentSwapChainBuffer.pushConstants(context->PipelineLayout, vk::ShaderStageFlagBits::eAllGraphics, 0, UBO_SIZE * 2, &realWindow.mTransformations);
+}
 
-			break;
-		case D3DTS_PROJECTION:
+bool RenderManager::UpdateShaderConstants(RealWindow& realWindow, std::shared_ptr<DrawContext> context)
+{
+	auto& deviceState = realWindow.mDeviceState;
+	auto& currentSwapChainBuffer = realWindow.mFrameCommandBuffers[realWindow.mCurrentFrame];
 
-			realWindow.mTransformations.mProjection <<
-				pair1.second.m[0][0], pair1.second.m[1][0], pair1.second.m[2][0], pair1.second.m[3][0],
-				pair1.second.m[0][1], pair1.second.m[1][1], pair1.second.m[2][1], pair1.second.m[3][1],
-				pair1.second.m[0][2], pair1.second.m[1][2], pair1.second.m[2][2], pair1.second.m[3][2],
-				pair1.second.m[0][3], pair1.second.m[1][3], pair1.second.m[2][3], pair1.second.m[3][3];
+	BOOL* isDirty[2] = { &deviceState.mAreVertexShaderConstantsDirty, &deviceState.mArePixelShaderConstantsDirty };
+	uint32_t sizes[2] = { deviceState.mVertexShaderConstantsSize, deviceState.mPixelShaderConstantsSize };
+	ShaderConstantSlots* slots[2] = { &deviceState.mVertexShaderConstantSlots, &deviceState.mPixelShaderConstantSlots };
 
-			break;
-		default:
-			BOOST_LOG_TRIVIAL(warning) << "RenderManager::UpdateUniformBuffer The following state type was ignored. " << pair1.first;
-			break;
+	/*
+	Slots already used by a recorded draw can't be touched until the frame is done so a changed block always goes into a fresh slot.
+	If nothing changed the draw keeps the offset of the previous one.
+	*/
+	uint32_t dirtyCount = ((*isDirty[0]) ? 1 : 0) + ((*isDirty[1]) ? 1 : 0);
+	if (realWindow.mNextShaderConstantSlot + dirtyCount > realWindow.mShaderConstantSlotCount)
+	{
+		if (!realWindow.GrowShaderConstantRing())
+		{
+			BOOST_LOG_TRIVIAL(error) << "RenderManager::UpdateShaderConstants failed to grow the shader constant ring, skipping draw.";
+			return false;
 		}
+
+		//The other stage's offset points into the old ring so both blocks go into the new one.
+		(*isDirty[0]) = true;
+		(*isDirty[1]) = true;
+		sizes[0] = sizeof(ShaderConstantSlots);
+		sizes[1] = sizeof(ShaderConstantSlots);
+		realWindow.mBindings.DirtyFlags |= BINDING_FLAG(BindingType_ShaderConstants);
 	}
 
-	realWindow.mTransformations.mTotalTransformation = realWindow.mTransformations.mProjection * realWindow.mTransformations.mView * realWindow.mTransformations.mModel;
-	//mTotalTransformation = mModel * mView * mProjection;
+	for (size_t i = 0; i < 2; i++)
+	{
+		if (!(*isDirty[i]))
+		{
+			continue;
+		}
+
+		vk::DeviceSize offset = ((vk::DeviceSize)realWindow.mCurrentFrame * realWindow.mShaderConstantSlotCount + realWindow.mNextShaderConstantSlot) * realWindow.mShaderConstantSlotSize;
+		memcpy(realWindow.mShaderConstantBufferData + offset, slots[i], sizes[i]);
 
-	currentSwapChainBuffer.pushConstants(context->PipelineLayout, vk::ShaderStageFlagBits::eAllGraphics, 0, UBO_SIZE * 2, &realWindow.mTransformations);
+		realWindow.mShaderConstantOffsets[i] = (uint32_t)offset;
+		realWindow.mNextShaderConstantSlot++;
+		(*isDirty[i]) = false;
+	}
+
+	//Every pipeline has its own layout so the set is bound again when the layout or either offset changes.
+	auto& bindings = realWindow.mBindings;
+	if ((bindings.DirtyFlags & BINDING_FLAG(BindingType_ShaderConstants)) || bindings.ShaderConstantOffsets[0] != realWindow.mShaderConstantOffsets[0] || bindings.ShaderConstantOffsets[1] != realWindow.mShaderConstantOffsets[1])
+	{
+		currentSwapChainBuffer.bindDescriptorSets(vk::PipelineBindPoint::eGraphics, context->PipelineLayout, 1, 1, &realWindow.mShaderConstantDescriptorSet, 2, realWindow.mShaderConstantOffsets);
+		bindings.ShaderConstantOffsets[0] = realWindow.mShaderConstantOffsets[0];
+		bindings.ShaderConstantOffsets[1] = realWindow.mShaderConstantOffsets[1];
+		bindings.BindCounts[BindingType_ShaderConstants]++;
+	}
+	else
+	{
+		bindings.SkipCounts[BindingType_ShaderConstants]++;
+	}
+
+	return true;
 }
 
 void RenderManager::FlushDrawBufffer(RealWindow& realWindow)
 {
 	/*
-	Uses remove_if and chrono to remove elements that have not been used in over a second.
+	Removes cached pipelines that have not been used in over a second.
+	The pipeline, layout & update template are destroyed with the context so it has to wait until the last frame that drew with it has finished.
+	*/
+	auto now = std::chrono::steady_clock::now();
+	for (auto it = realWindow.mDrawBuffer.begin(); it != realWindow.mDrawBuffer.end();)
+	{
+		if (std::chrono::duration_cast<std::chrono::seconds>(now - it->second->LastUsed).count() > CACHE_SECONDS && it->second->LastUsedFrame <= realWindow.mCompletedFrameNumber)
+		{
+			it = realWindow.mDrawBuffer.erase(it);
+		}
+		else
+		{
+			++it;
+		}
+	}
+
+	for (auto it = realWindow.mFallbackPipelines.begin(); it != realWindow.mFallbackPipelines.end();)
+	{
+		if (std::chrono::duration_cast<std::chrono::seconds>(now - it->second->LastUsed).count() > CACHE_SECONDS && it->second->LastUsedFrame <= realWindow.mCompletedFrameNumber)
+		{
+			it = realWindow.mFallbackPipelines.erase(it);
+		}
+		else
+		{
+			++it;
+		}
+	}
+
+	/*
+	Samplers are only evicted once there are too many of them and never while a frame that might use one is still on the GPU.
 	*/
-	realWindow.mDrawBuffer.erase(std::remove_if(realWindow.mDrawBuffer.begin(), realWindow.mDrawBuffer.end(), [](const std::shared_ptr<DrawContext> & o) { return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - o->LastUsed).count() > CACHE_SECONDS; }), realWindow.mDrawBuffer.end());
-	realWindow.mSamplerRequests.erase(std::remove_if(realWindow.mSamplerRequests.begin(), realWindow.mSamplerRequests.end(), [](const std::shared_ptr<SamplerRequest> & o) { return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - o->LastUsed).count() > CACHE_SECONDS; }), realWindow.mSamplerRequests.end());
+	if (realWindow.mSamplers.size() > realWindow.mSamplerCacheSize)
+	{
+		std::vector< std::pair<uint64_t, uint64_t> > candidates; //Last used frame & key.
+		for (const auto& pair : realWindow.mSamplers)
+		{
+			if (pair.second->LastUsedFrame <= realWindow.mCompletedFrameNumber)
+			{
+				candidates.push_back(std::make_pair(pair.second->LastUsedFrame, pair.first));
+			}
+		}
+
+		std::sort(candidates.begin(), candidates.end());
+
+		for (size_t i = 0; i < candidates.size() && realWindow.mSamplers.size() > realWindow.mSamplerCacheSize; i++)
+		{
+			realWindow.mSamplers.erase(candidates[i].second);
+		}
+	}
+
+	//Libraries evicted along with the pipelines above are destroyed once no compile job can be using them.
+	realWindow.mPipelineCompiler->DestroyRetiredLibraries();
 
 	realWindow.mIsDirty = true;
 }
\ No newline at end of file
@@ -35,7 +35,7 @@ struct RenderManager
 	RenderManager();
 	~RenderManager();
 
-	void UpdateBuffer(RealWindow& realWindow);
+	bool UpdateBuffer(RealWindow& realWindow);
 	void StartScene(RealWindow& realWindow,bool clear = false);
 	void StopScene(RealWindow& realWindow);
 	void CopyImage(RealWindow& realWindow, vk::Image srcImage, vk::Image dstImage, int32_t x, int32_t y, uint32_t width, uint32_t height, uint32_t srcMip, uint32_t dstMip);
@@ -45,10 +45,12 @@ struct RenderManager
 	void DrawPrimitive(RealWindow& realWindow, D3DPRIMITIVETYPE PrimitiveType, UINT StartVertex, UINT PrimitiveCount);
 	void UpdateTexture(RealWindow& realWindow, IDirect3DBaseTexture9* pSourceTexture, IDirect3DBaseTexture9* pDestinationTexture);
 
-	void BeginDraw(RealWindow& realWindow, std::shared_ptr<DrawContext> context, std::shared_ptr<ResourceContext> resourceContext, D3DPRIMITIVETYPE type);
+	bool BeginDraw(RealWindow& realWindow, std::shared_ptr<DrawContext> context, std::shared_ptr<ResourceContext> resourceContext, D3DPRIMITIVETYPE type);
 	void CreatePipe(RealWindow& realWindow, std::shared_ptr<DrawContext> context);
 	void CreateSampler(RealWindow& realWindow, std::shared_ptr<SamplerRequest> request);
+	void UpdateDynamicState(RealWindow& realWindow, std::shared_ptr<DrawContext> context);
 	void UpdatePushConstants(RealWindow& realWindow, std::shared_ptr<DrawContext> context);
+	bool UpdateShaderConstants(RealWindow& realWindow, std::shared_ptr<DrawContext> context);
 	void FlushDrawBufffer(RealWindow& realWindow);
 };
 
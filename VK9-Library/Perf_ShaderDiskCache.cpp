@@ -0,0 +1,397 @@
+/*
+Copyright(c) 2018 Christopher Joseph Dean Schaefer
+
+This software is provided 'as-is', without any express or implied
+warranty.In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions :
+
+1. The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software.If you use this software
+in a product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include "Perf_ShaderDiskCache.h"
+
+#include <algorithm>
+#include <boost/log/core.hpp>
+#include <boost/log/trivial.hpp>
+
+#include "Utilities.h"
+
+//Entries start on 8 byte boundaries so the mapped index & headers can be read in place.
+static uint64_t AlignEntrySize(uint64_t size)
+{
+	return (size + 7) & ~7ULL;
+}
+
+ShaderDiskCache::ShaderDiskCache(const std::string& path, uint64_t maxSize)
+	: mPath(path),
+	mMaxSize(maxSize)
+{
+	Open();
+}
+
+ShaderDiskCache::~ShaderDiskCache()
+{
+	Save();
+	Close();
+
+	BOOST_LOG_TRIVIAL(info) << "ShaderDiskCache::~ShaderDiskCache hits " << mHitCount << " misses " << mMissCount;
+}
+
+void ShaderDiskCache::Open()
+{
+	if (mPath.empty())
+	{
+		return;
+	}
+
+	mFile = CreateFileA(mPath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (mFile == INVALID_HANDLE_VALUE)
+	{
+		return; //Nothing has been saved yet.
+	}
+
+	LARGE_INTEGER fileSize = {};
+	if (!GetFileSizeEx(mFile, &fileSize) || (uint64_t)fileSize.QuadPart < sizeof(ShaderCacheHeader))
+	{
+		BOOST_LOG_TRIVIAL(warning) << "ShaderDiskCache::Open " << mPath << " is truncated and will be replaced.";
+		Close();
+		return;
+	}
+
+	mMapping = CreateFileMappingA(mFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mMapping != nullptr)
+	{
+		mView = (const uint8_t*)MapViewOfFile(mMapping, FILE_MAP_READ, 0, 0, 0);
+	}
+
+	if (mView == nullptr)
+	{
+		BOOST_LOG_TRIVIAL(error) << "ShaderDiskCache::Open failed to map " << mPath << " with error code " << GetLastError();
+		Close();
+		return;
+	}
+
+	mViewSize = (uint64_t)fileSize.QuadPart;
+
+	ShaderCacheHeader header;
+	memcpy(&header, mView, sizeof(ShaderCacheHeader));
+
+	if (header.Magic != SHADER_CACHE_MAGIC
+		|| header.Version != SHADER_CACHE_VERSION
+		|| header.ConverterVersion != SHADER_CONVERTER_VERSION)
+	{
+		BOOST_LOG_TRIVIAL(info) << "ShaderDiskCache::Open " << mPath << " is from a different version and will be replaced.";
+		Close();
+		return;
+	}
+
+	uint64_t indexEnd = sizeof(ShaderCacheHeader) + (uint64_t)header.EntryCount * sizeof(ShaderCacheIndexEntry);
+	if (indexEnd > mViewSize)
+	{
+		BOOST_LOG_TRIVIAL(warning) << "ShaderDiskCache::Open " << mPath << " is truncated and will be replaced.";
+		Close();
+		return;
+	}
+
+	const ShaderCacheIndexEntry* index = (const ShaderCacheIndexEntry*)(mView + sizeof(ShaderCacheHeader));
+	if (HashBytes(index, (size_t)(indexEnd - sizeof(ShaderCacheHeader))) != header.IndexHash)
+	{
+		BOOST_LOG_TRIVIAL(warning) << "ShaderDiskCache::Open " << mPath << " is corrupt and will be replaced.";
+		Close();
+		return;
+	}
+
+	for (uint32_t i = 0; i < header.EntryCount; i++)
+	{
+		const auto& entry = index[i];
+		if (entry.Offset < indexEnd || entry.Size > mViewSize || entry.Offset > mViewSize - entry.Size)
+		{
+			BOOST_LOG_TRIVIAL(warning) << "ShaderDiskCache::Open " << mPath << " is corrupt and will be replaced.";
+			Close();
+			return;
+		}
+
+		mIndex[entry.Key] = entry;
+	}
+
+	if (header.Clock > mClock)
+	{
+		mClock = header.Clock;
+	}
+
+	BOOST_LOG_TRIVIAL(info) << "ShaderDiskCache::Open found " << mIndex.size() << " shaders in " << mPath;
+}
+
+void ShaderDiskCache::Close()
+{
+	mIndex.clear();
+
+	if (mView != nullptr)
+	{
+		UnmapViewOfFile(mView);
+		mView = nullptr;
+	}
+	mViewSize = 0;
+
+	if (mMapping != nullptr)
+	{
+		CloseHandle(mMapping);
+		mMapping = nullptr;
+	}
+
+	if (mFile != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(mFile);
+		mFile = INVALID_HANDLE_VALUE;
+	}
+}
+
+bool ShaderDiskCache::Load(uint64_t key, const uint32_t* tokens, size_t tokenCount, ShaderConverter& converter)
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+
+	const uint8_t* data = nullptr;
+	uint64_t size = 0;
+	uint64_t* lastUsed = nullptr;
+
+	auto pending = mPending.find(key);
+	if (pending != mPending.end())
+	{
+		data = pending->second.second.data();
+		size = pending->second.second.size();
+		lastUsed = &pending->second.first;
+	}
+	else
+	{
+		auto entry = mIndex.find(key);
+		if (entry != mIndex.end())
+		{
+			data = mView + entry->second.Offset;
+			size = entry->second.Size;
+			lastUsed = &entry->second.LastUsed;
+
+			//Checked here rather than at startup so a large cache doesn't have to be read in full.
+			if (HashBytes(data, (size_t)size) != entry->second.Hash)
+			{
+				BOOST_LOG_TRIVIAL(warning) << "ShaderDiskCache::Load entry " << key << " in " << mPath << " is corrupt and will be dropped.";
+				mIndex.erase(entry);
+				mIsDirty = true;
+				data = nullptr;
+			}
+		}
+	}
+
+	ShaderCacheEntryHeader header;
+	if (data == nullptr || size < sizeof(ShaderCacheEntryHeader))
+	{
+		mMissCount++;
+		return false;
+	}
+	memcpy(&header, data, sizeof(ShaderCacheEntryHeader));
+
+	uint64_t expectedSize = sizeof(ShaderCacheEntryHeader)
+		+ (uint64_t)header.TokenCount * sizeof(uint32_t)
+		+ (uint64_t)header.InstructionCount * sizeof(uint32_t)
+		+ (uint64_t)header.VertexInputAttributeDescriptionCount * sizeof(vk::VertexInputAttributeDescription)
+		+ (uint64_t)header.DescriptorSetLayoutBindingCount * sizeof(ShaderCacheDescriptorBinding);
+
+	//A different shader with the same key is just a miss, the new conversion replaces the entry.
+	const uint8_t* position = data + sizeof(ShaderCacheEntryHeader);
+	if (header.TokenCount != tokenCount
+		|| expectedSize != size
+		|| header.VertexInputAttributeDescriptionCount > 32
+		|| header.DescriptorSetLayoutBindingCount > 16
+		|| memcmp(position, tokens, tokenCount * sizeof(uint32_t)))
+	{
+		mMissCount++;
+		return false;
+	}
+	position += tokenCount * sizeof(uint32_t);
+
+	converter.mInstructions.resize(header.InstructionCount);
+	memcpy(converter.mInstructions.data(), position, header.InstructionCount * sizeof(uint32_t));
+	position += header.InstructionCount * sizeof(uint32_t);
+
+	auto& convertedShader = converter.mConvertedShader;
+	convertedShader.mVertexInputAttributeDescriptionCount = header.VertexInputAttributeDescriptionCount;
+	memcpy(convertedShader.mVertexInputAttributeDescription, position, header.VertexInputAttributeDescriptionCount * sizeof(vk::VertexInputAttributeDescription));
+	position += header.VertexInputAttributeDescriptionCount * sizeof(vk::VertexInputAttributeDescription);
+
+	convertedShader.mDescriptorSetLayoutBindingCount = header.DescriptorSetLayoutBindingCount;
+	for (uint32_t i = 0; i < header.DescriptorSetLayoutBindingCount; i++)
+	{
+		ShaderCacheDescriptorBinding binding;
+		memcpy(&binding, position, sizeof(ShaderCacheDescriptorBinding));
+		position += sizeof(ShaderCacheDescriptorBinding);
+
+		convertedShader.mDescriptorSetLayoutBinding[i].binding = binding.Binding;
+		convertedShader.mDescriptorSetLayoutBinding[i].descriptorType = (vk::DescriptorType)binding.DescriptorType;
+		convertedShader.mDescriptorSetLayoutBinding[i].descriptorCount = binding.DescriptorCount;
+		convertedShader.mDescriptorSetLayoutBinding[i].stageFlags = (vk::ShaderStageFlags)binding.StageFlags;
+		convertedShader.mDescriptorSetLayoutBinding[i].pImmutableSamplers = nullptr;
+	}
+
+	(*lastUsed) = ++mClock;
+	mIsDirty = true;
+	mHitCount++;
+
+	return true;
+}
+
+void ShaderDiskCache::Store(uint64_t key, const uint32_t* tokens, size_t tokenCount, const ShaderConverter& converter)
+{
+	const auto& convertedShader = converter.mConvertedShader;
+
+	if (mPath.empty() || convertedShader.ShaderModule == vk::ShaderModule())
+	{
+		return; //Failed conversions are tried again next time.
+	}
+
+	ShaderCacheEntryHeader header;
+	header.TokenCount = (uint32_t)tokenCount;
+	header.InstructionCount = (uint32_t)converter.mInstructions.size();
+	header.VertexInputAttributeDescriptionCount = convertedShader.mVertexInputAttributeDescriptionCount;
+	header.DescriptorSetLayoutBindingCount = convertedShader.mDescriptorSetLayoutBindingCount;
+
+	std::vector<uint8_t> data;
+	auto append = [&data](const void* source, size_t size)
+	{
+		const uint8_t* bytes = (const uint8_t*)source;
+		data.insert(data.end(), bytes, bytes + size);
+	};
+
+	append(&header, sizeof(ShaderCacheEntryHeader));
+	append(tokens, tokenCount * sizeof(uint32_t));
+	append(converter.mInstructions.data(), converter.mInstructions.size() * sizeof(uint32_t));
+	append(convertedShader.mVertexInputAttributeDescription, convertedShader.mVertexInputAttributeDescriptionCount * sizeof(vk::VertexInputAttributeDescription));
+
+	for (uint32_t i = 0; i < convertedShader.mDescriptorSetLayoutBindingCount; i++)
+	{
+		const auto& source = convertedShader.mDescriptorSetLayoutBinding[i];
+
+		ShaderCacheDescriptorBinding binding;
+		binding.Binding = source.binding;
+		binding.DescriptorType = (uint32_t)source.descriptorType;
+		binding.DescriptorCount = source.descriptorCount;
+		binding.StageFlags = (uint32_t)(VkShaderStageFlags)source.stageFlags;
+		append(&binding, sizeof(ShaderCacheDescriptorBinding));
+	}
+
+	std::lock_guard<std::mutex> lock(mMutex);
+	mPending[key] = std::make_pair(++mClock, std::move(data));
+	mIsDirty = true;
+}
+
+void ShaderDiskCache::Save()
+{
+	struct SaveEntry
+	{
+		uint64_t Key;
+		uint64_t LastUsed;
+		const uint8_t* Data;
+		uint64_t Size;
+		uint64_t Hash;
+	};
+
+	std::lock_guard<std::mutex> lock(mMutex);
+
+	if (mPath.empty() || !mIsDirty)
+	{
+		return;
+	}
+
+	std::vector<SaveEntry> entries;
+	entries.reserve(mIndex.size() + mPending.size());
+
+	for (const auto& entry : mIndex)
+	{
+		if (mPending.find(entry.first) == mPending.end())
+		{
+			//The stored hash is carried over so an entry that was never checked can't be laundered into a valid one.
+			entries.push_back({ entry.first, entry.second.LastUsed, mView + entry.second.Offset, entry.second.Size, entry.second.Hash });
+		}
+	}
+
+	for (const auto& entry : mPending)
+	{
+		const auto& data = entry.second.second;
+		entries.push_back({ entry.first, entry.second.first, data.data(), data.size(), HashBytes(data.data(), data.size()) });
+	}
+
+	//Most recently used first so trimming to the size cap drops the least recently used entries.
+	std::sort(entries.begin(), entries.end(), [](const SaveEntry& a, const SaveEntry& b) { return a.LastUsed > b.LastUsed; });
+
+	uint64_t totalSize = sizeof(ShaderCacheHeader);
+	size_t count = 0;
+	for (; count < entries.size(); count++)
+	{
+		uint64_t entrySize = sizeof(ShaderCacheIndexEntry) + AlignEntrySize(entries[count].Size);
+		if (totalSize + entrySize > mMaxSize)
+		{
+			break;
+		}
+		totalSize += entrySize;
+	}
+
+	if (count < entries.size())
+	{
+		BOOST_LOG_TRIVIAL(info) << "ShaderDiskCache::Save trimmed " << (entries.size() - count) << " least recently used shaders from " << mPath;
+		entries.resize(count);
+	}
+
+	std::vector<ShaderCacheIndexEntry> index(count);
+	uint64_t offset = sizeof(ShaderCacheHeader) + count * sizeof(ShaderCacheIndexEntry);
+	for (size_t i = 0; i < count; i++)
+	{
+		index[i].Key = entries[i].Key;
+		index[i].LastUsed = entries[i].LastUsed;
+		index[i].Offset = offset;
+		index[i].Size = entries[i].Size;
+		index[i].Hash = entries[i].Hash;
+		offset += AlignEntrySize(entries[i].Size);
+	}
+
+	ShaderCacheHeader header;
+	header.EntryCount = (uint32_t)count;
+	header.Clock = mClock;
+	header.IndexHash = HashBytes(index.data(), index.size() * sizeof(ShaderCacheIndexEntry));
+
+	static const char padding[8] = {};
+	std::vector<std::pair<const void*, size_t>> chunks;
+	chunks.reserve(2 + count * 2);
+	chunks.emplace_back(&header, sizeof(ShaderCacheHeader));
+	chunks.emplace_back(index.data(), index.size() * sizeof(ShaderCacheIndexEntry));
+	for (const auto& entry : entries)
+	{
+		chunks.emplace_back(entry.Data, (size_t)entry.Size);
+		chunks.emplace_back(padding, (size_t)(AlignEntrySize(entry.Size) - entry.Size));
+	}
+
+	//Entries still point into the old file so it can only be let go once they have been written out.
+	bool isClosed = false;
+	bool isSaved = WriteFileAtomically(mPath, chunks, [this, &isClosed]() { Close(); isClosed = true; });
+	if (!isSaved)
+	{
+		BOOST_LOG_TRIVIAL(error) << "ShaderDiskCache::Save failed to save " << mPath;
+		if (isClosed)
+		{
+			Open();
+		}
+		return;
+	}
+
+	mPending.clear();
+	mIsDirty = false;
+
+	Open();
+}
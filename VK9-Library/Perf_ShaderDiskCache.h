@@ -0,0 +1,114 @@
+/*
+Copyright(c) 2018 Christopher Joseph Dean Schaefer
+
+This software is provided 'as-is', without any express or implied
+warranty.In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions :
+
+1. The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software.If you use this software
+in a product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include <windows.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+
+#include "ShaderConverter.h"
+
+#ifndef SHADERDISKCACHE_H
+#define SHADERDISKCACHE_H
+
+#define SHADER_CACHE_MAGIC 0x53394B56 //VK9S
+#define SHADER_CACHE_VERSION 2
+
+/*
+The file is a header, an index of every entry, and then the entries themselves.
+Only the index is read up front, entries are read out of the mapped file the first time a shader asks for them.
+*/
+struct ShaderCacheHeader
+{
+	uint32_t Magic = SHADER_CACHE_MAGIC;
+	uint32_t Version = SHADER_CACHE_VERSION;
+	uint32_t ConverterVersion = SHADER_CONVERTER_VERSION;
+	uint32_t EntryCount = 0;
+	uint64_t Clock = 0; //The last LastUsed handed out so stamps keep increasing across runs.
+	uint64_t IndexHash = 0;
+};
+
+struct ShaderCacheIndexEntry
+{
+	uint64_t Key = 0;
+	uint64_t LastUsed = 0;
+	uint64_t Offset = 0;
+	uint64_t Size = 0;
+	uint64_t Hash = 0;
+};
+
+/*
+Written in front of each entry's arrays. (D3D9 tokens, SPIR-V words, vertex attributes, then descriptor bindings)
+*/
+struct ShaderCacheEntryHeader
+{
+	uint32_t TokenCount = 0;
+	uint32_t InstructionCount = 0;
+	uint32_t VertexInputAttributeDescriptionCount = 0;
+	uint32_t DescriptorSetLayoutBindingCount = 0;
+};
+
+/*
+vk::DescriptorSetLayoutBinding without the immutable sampler pointer.
+*/
+struct ShaderCacheDescriptorBinding
+{
+	uint32_t Binding = 0;
+	uint32_t DescriptorType = 0;
+	uint32_t DescriptorCount = 0;
+	uint32_t StageFlags = 0;
+};
+
+/*
+Keeps ShaderConverter output between runs. Conversion only depends on the bytecode and the converter so the result can be reused as long as SHADER_CONVERTER_VERSION is bumped whenever the output changes.
+*/
+struct ShaderDiskCache
+{
+	std::mutex mMutex; //Shaders are loaded & stored from the translation threads.
+	std::string mPath;
+	uint64_t mMaxSize = 0; //Bytes, least recently used entries are dropped past this when saving.
+
+	HANDLE mFile = INVALID_HANDLE_VALUE;
+	HANDLE mMapping = nullptr;
+	const uint8_t* mView = nullptr;
+	uint64_t mViewSize = 0;
+
+	std::unordered_map<uint64_t, ShaderCacheIndexEntry> mIndex; //Entries in the mapped file.
+	std::unordered_map<uint64_t, std::pair<uint64_t, std::vector<uint8_t> > > mPending; //Entries converted this run with their LastUsed.
+	uint64_t mClock = 0;
+	bool mIsDirty = false;
+
+	size_t mHitCount = 0;
+	size_t mMissCount = 0;
+
+	ShaderDiskCache(const std::string& path, uint64_t maxSize);
+	~ShaderDiskCache();
+
+	bool Load(uint64_t key, const uint32_t* tokens, size_t tokenCount, ShaderConverter& converter);
+	void Store(uint64_t key, const uint32_t* tokens, size_t tokenCount, const ShaderConverter& converter);
+	void Save();
+
+	void Open();
+	void Close();
+};
+
+#endif // SHADERDISKCACHE_H
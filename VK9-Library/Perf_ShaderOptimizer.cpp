@@ -0,0 +1,895 @@
+/*
+Copyright(c) 2018 Christopher Joseph Dean Schaefer
+
+This software is provided 'as-is', without any express or implied
+warranty.In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions :
+
+1. The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software.If you use this software
+in a product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include "Perf_ShaderOptimizer.h"
+
+#include <string.h>
+#include <string>
+#include <unordered_map>
+#include <GLSL.std.450.h>
+
+#include "Utilities.h"
+
+#define SPIRV_NO_DEFINITION SIZE_MAX
+#define SPIRV_MAX_SHUFFLE_DEPTH 8
+
+/*
+Fills in whether the opcode has a result type & result id and the fewest words it can have.
+Returns false for anything the passes don't know the operands of.
+*/
+static bool GetInstructionLayout(uint32_t opcode, bool& hasType, bool& hasResult, uint32_t& minimumWordCount)
+{
+	hasType = false;
+	hasResult = false;
+	minimumWordCount = 1;
+
+	switch (opcode)
+	{
+	case spv::OpNop:
+	case spv::OpReturn:
+	case spv::OpFunctionEnd:
+	case spv::OpKill:
+	case spv::OpUnreachable:
+		return true;
+	case spv::OpCapability:
+	case spv::OpSourceExtension:
+	case spv::OpBranch:
+		minimumWordCount = 2;
+		return true;
+	case spv::OpMemoryModel:
+	case spv::OpSource:
+	case spv::OpName:
+	case spv::OpExecutionMode:
+	case spv::OpDecorate:
+	case spv::OpStore:
+		minimumWordCount = 3;
+		return true;
+	case spv::OpEntryPoint:
+	case spv::OpMemberName:
+	case spv::OpMemberDecorate:
+	case spv::OpBranchConditional:
+		minimumWordCount = 4;
+		return true;
+	case spv::OpExtInstImport:
+	case spv::OpLabel:
+	case spv::OpTypeVoid:
+	case spv::OpTypeBool:
+	case spv::OpTypeSampler:
+	case spv::OpTypeStruct:
+	case spv::OpTypeFunction:
+		hasResult = true;
+		minimumWordCount = 2;
+		return true;
+	case spv::OpTypeFloat:
+	case spv::OpTypeSampledImage:
+		hasResult = true;
+		minimumWordCount = 3;
+		return true;
+	case spv::OpTypeInt:
+	case spv::OpTypeVector:
+	case spv::OpTypeMatrix:
+	case spv::OpTypeArray:
+	case spv::OpTypePointer:
+		hasResult = true;
+		minimumWordCount = 4;
+		return true;
+	case spv::OpTypeImage:
+		hasResult = true;
+		minimumWordCount = 9;
+		return true;
+	case spv::OpConstantTrue:
+	case spv::OpConstantFalse:
+	case spv::OpConstantNull:
+	case spv::OpSpecConstantTrue:
+	case spv::OpSpecConstantFalse:
+	case spv::OpConstantComposite:
+	case spv::OpSpecConstantComposite:
+	case spv::OpCompositeConstruct:
+		hasType = true;
+		hasResult = true;
+		minimumWordCount = 3;
+		return true;
+	case spv::OpConstant:
+	case spv::OpSpecConstant:
+	case spv::OpVariable:
+	case spv::OpLoad:
+	case spv::OpAccessChain:
+	case spv::OpInBoundsAccessChain:
+	case spv::OpCopyObject:
+	case spv::OpCompositeExtract:
+	case spv::OpSNegate:
+	case spv::OpFNegate:
+	case spv::OpTranspose:
+	case spv::OpConvertFToU:
+	case spv::OpConvertFToS:
+	case spv::OpConvertSToF:
+	case spv::OpConvertUToF:
+	case spv::OpUConvert:
+	case spv::OpSConvert:
+	case spv::OpFConvert:
+	case spv::OpBitcast:
+	case spv::OpAny:
+	case spv::OpAll:
+	case spv::OpIsNan:
+	case spv::OpIsInf:
+	case spv::OpLogicalNot:
+	case spv::OpNot:
+	case spv::OpDPdx:
+	case spv::OpDPdy:
+	case spv::OpFwidth:
+		hasType = true;
+		hasResult = true;
+		minimumWordCount = 4;
+		return true;
+	case spv::OpFunction:
+	case spv::OpVectorShuffle:
+	case spv::OpCompositeInsert:
+	case spv::OpExtInst:
+	case spv::OpSampledImage:
+	case spv::OpImageSampleImplicitLod:
+	case spv::OpImageSampleProjImplicitLod:
+	case spv::OpIAdd:
+	case spv::OpFAdd:
+	case spv::OpISub:
+	case spv::OpFSub:
+	case spv::OpIMul:
+	case spv::OpFMul:
+	case spv::OpUDiv:
+	case spv::OpSDiv:
+	case spv::OpFDiv:
+	case spv::OpUMod:
+	case spv::OpSRem:
+	case spv::OpSMod:
+	case spv::OpFRem:
+	case spv::OpFMod:
+	case spv::OpVectorTimesScalar:
+	case spv::OpMatrixTimesScalar:
+	case spv::OpVectorTimesMatrix:
+	case spv::OpMatrixTimesVector:
+	case spv::OpMatrixTimesMatrix:
+	case spv::OpOuterProduct:
+	case spv::OpDot:
+	case spv::OpIEqual:
+	case spv::OpINotEqual:
+	case spv::OpUGreaterThan:
+	case spv::OpSGreaterThan:
+	case spv::OpUGreaterThanEqual:
+	case spv::OpSGreaterThanEqual:
+	case spv::OpULessThan:
+	case spv::OpSLessThan:
+	case spv::OpULessThanEqual:
+	case spv::OpSLessThanEqual:
+	case spv::OpFOrdEqual:
+	case spv::OpFUnordEqual:
+	case spv::OpFOrdNotEqual:
+	case spv::OpFUnordNotEqual:
+	case spv::OpFOrdLessThan:
+	case spv::OpFUnordLessThan:
+	case spv::OpFOrdGreaterThan:
+	case spv::OpFUnordGreaterThan:
+	case spv::OpFOrdLessThanEqual:
+	case spv::OpFUnordLessThanEqual:
+	case spv::OpFOrdGreaterThanEqual:
+	case spv::OpFUnordGreaterThanEqual:
+	case spv::OpLogicalEqual:
+	case spv::OpLogicalNotEqual:
+	case spv::OpLogicalOr:
+	case spv::OpLogicalAnd:
+	case spv::OpShiftRightLogical:
+	case spv::OpShiftRightArithmetic:
+	case spv::OpShiftLeftLogical:
+	case spv::OpBitwiseOr:
+	case spv::OpBitwiseXor:
+	case spv::OpBitwiseAnd:
+		hasType = true;
+		hasResult = true;
+		minimumWordCount = 5;
+		return true;
+	case spv::OpSelect:
+	case spv::OpImageSampleExplicitLod:
+	case spv::OpImageSampleProjExplicitLod:
+	case spv::OpImageSampleDrefImplicitLod:
+	case spv::OpImageSampleProjDrefImplicitLod:
+		hasType = true;
+		hasResult = true;
+		minimumWordCount = 6;
+		return true;
+	case spv::OpImageSampleDrefExplicitLod:
+	case spv::OpImageSampleProjDrefExplicitLod:
+		hasType = true;
+		hasResult = true;
+		minimumWordCount = 7;
+		return true;
+	default:
+		return false;
+	}
+}
+
+static bool IsAnnotation(uint32_t opcode)
+{
+	return (opcode == spv::OpName || opcode == spv::OpMemberName || opcode == spv::OpDecorate || opcode == spv::OpMemberDecorate);
+}
+
+static bool IsConstant(uint32_t opcode)
+{
+	return (opcode == spv::OpConstant || opcode == spv::OpConstantTrue || opcode == spv::OpConstantFalse || opcode == spv::OpConstantNull || opcode == spv::OpConstantComposite);
+}
+
+static bool IsSpecConstant(uint32_t opcode)
+{
+	return (opcode == spv::OpSpecConstant || opcode == spv::OpSpecConstantTrue || opcode == spv::OpSpecConstantFalse || opcode == spv::OpSpecConstantComposite);
+}
+
+static bool IsImageSample(uint32_t opcode)
+{
+	return (opcode >= spv::OpImageSampleImplicitLod && opcode <= spv::OpImageSampleProjDrefExplicitLod);
+}
+
+size_t ShaderOptimizer::Optimize(std::vector<uint32_t>& words)
+{
+	mWords.swap(words);
+
+	if (!Parse())
+	{
+		mWords.swap(words);
+		return 0;
+	}
+
+	//Each pass can open up more work for the others. (a forwarded load can make two shuffles identical)
+	for (size_t i = 0; i < 4; i++)
+	{
+		size_t removedCount = mRemovedCount;
+
+		SimplifyShuffles();
+		EliminateCommonSubexpressions();
+		ForwardLoads();
+
+		if (mRemovedCount == removedCount)
+		{
+			break;
+		}
+	}
+
+	EliminateDeadCode();
+
+	Write(words);
+
+	return mRemovedCount;
+}
+
+bool ShaderOptimizer::Parse()
+{
+	if (mWords.size() < 5 || mWords[0] != spv::MagicNumber)
+	{
+		BOOST_LOG_TRIVIAL(warning) << "ShaderOptimizer::Parse skipping module without a SPIR-V header.";
+		return false;
+	}
+
+	const uint32_t bound = mWords[3];
+	mDefinitions.assign(bound, SPIRV_NO_DEFINITION);
+	mReplacements.assign(bound, 0);
+	mIsDecorated.assign(bound, false);
+	mInstructions.clear();
+	mRemovedCount = 0;
+
+	size_t offset = 5;
+	while (offset < mWords.size())
+	{
+		SpirVInstruction instruction;
+		bool hasType = false;
+		bool hasResult = false;
+		uint32_t minimumWordCount = 0;
+
+		instruction.Offset = offset;
+		instruction.Opcode = mWords[offset] & spv::OpCodeMask;
+		instruction.WordCount = mWords[offset] >> spv::WordCountShift;
+
+		if (!GetInstructionLayout(instruction.Opcode, hasType, hasResult, minimumWordCount))
+		{
+			BOOST_LOG_TRIVIAL(warning) << "ShaderOptimizer::Parse skipping module with unknown opcode " << instruction.Opcode << " at word " << offset;
+			return false;
+		}
+
+		if (instruction.WordCount < minimumWordCount || offset + instruction.WordCount > mWords.size())
+		{
+			BOOST_LOG_TRIVIAL(warning) << "ShaderOptimizer::Parse skipping module with bad word count " << instruction.WordCount << " for opcode " << instruction.Opcode << " at word " << offset;
+			return false;
+		}
+
+		if (hasType)
+		{
+			instruction.TypeId = mWords[offset + 1];
+		}
+
+		if (hasResult)
+		{
+			instruction.ResultId = mWords[offset + (hasType ? 2 : 1)];
+			if (!instruction.ResultId || instruction.ResultId >= bound)
+			{
+				BOOST_LOG_TRIVIAL(warning) << "ShaderOptimizer::Parse skipping module with result id " << instruction.ResultId << " outside of bound " << bound;
+				return false;
+			}
+			mDefinitions[instruction.ResultId] = mInstructions.size();
+		}
+
+		bool isValid = true;
+		ForEachIdOperand(instruction, [&isValid, bound](uint32_t& id)
+		{
+			if (id >= bound)
+			{
+				isValid = false;
+			}
+		});
+
+		if (!isValid)
+		{
+			BOOST_LOG_TRIVIAL(warning) << "ShaderOptimizer::Parse skipping module with an operand outside of bound " << bound << " for opcode " << instruction.Opcode << " at word " << offset;
+			return false;
+		}
+
+		if (instruction.Opcode == spv::OpDecorate || instruction.Opcode == spv::OpMemberDecorate)
+		{
+			mIsDecorated[mWords[offset + 1]] = true;
+		}
+		else if (instruction.Opcode == spv::OpExtInstImport && !mGlslExtensionId)
+		{
+			std::string name((const char*)&mWords[offset + 2], (instruction.WordCount - 2) * sizeof(uint32_t));
+			if (!strcmp(name.c_str(), "GLSL.std.450"))
+			{
+				mGlslExtensionId = instruction.ResultId;
+			}
+		}
+
+		mInstructions.push_back(instruction);
+		offset += instruction.WordCount;
+	}
+
+	return true;
+}
+
+void ShaderOptimizer::Write(std::vector<uint32_t>& words)
+{
+	words.clear();
+	words.reserve(mWords.size());
+	words.insert(words.end(), mWords.begin(), mWords.begin() + 5); //The header keeps the old bound which is still valid.
+
+	for (const auto& instruction : mInstructions)
+	{
+		if (instruction.IsRemoved)
+		{
+			continue;
+		}
+
+		//Names & decorations of removed ids go with them.
+		if (IsAnnotation(instruction.Opcode))
+		{
+			const SpirVInstruction* target = GetDefinition(mWords[instruction.Offset + 1]);
+			if (target != nullptr && target->IsRemoved)
+			{
+				continue;
+			}
+		}
+
+		words.insert(words.end(), mWords.begin() + instruction.Offset, mWords.begin() + instruction.Offset + instruction.WordCount);
+	}
+}
+
+/*
+Reuses what an earlier load or store in the same block already put in a register instead of going back to the variable.
+A store through one pointer forgets everything loaded from the same variable since access chains into it can overlap.
+*/
+void ShaderOptimizer::ForwardLoads()
+{
+	std::unordered_map<uint32_t, uint32_t> values; //Value by pointer.
+
+	for (auto& instruction : mInstructions)
+	{
+		if (instruction.IsRemoved)
+		{
+			continue;
+		}
+
+		ResolveOperands(instruction);
+		uint32_t* words = &mWords[instruction.Offset];
+
+		switch (instruction.Opcode)
+		{
+		case spv::OpLabel:
+		case spv::OpFunction:
+		case spv::OpFunctionEnd:
+			values.clear();
+			break;
+		case spv::OpLoad:
+		{
+			if (instruction.WordCount > 4)
+			{
+				break; //Memory access flags. (volatile and such)
+			}
+
+			auto value = values.find(words[3]);
+			if (value != values.end())
+			{
+				const SpirVInstruction* definition = GetDefinition(value->second);
+				if (definition != nullptr && definition->TypeId == instruction.TypeId && Replace(instruction, value->second))
+				{
+					break;
+				}
+			}
+
+			values[words[3]] = instruction.ResultId;
+		}
+		break;
+		case spv::OpStore:
+		{
+			uint32_t root = GetRootPointer(words[1]);
+			for (auto value = values.begin(); value != values.end();)
+			{
+				if (GetRootPointer(value->first) == root)
+				{
+					value = values.erase(value);
+				}
+				else
+				{
+					++value;
+				}
+			}
+
+			if (instruction.WordCount == 3)
+			{
+				values[words[1]] = words[2];
+			}
+		}
+		break;
+		default:
+			if (WritesMemory(instruction))
+			{
+				values.clear();
+			}
+			break;
+		}
+	}
+}
+
+/*
+Swizzles and write masks turn into chains of OpVectorShuffle. Each component is traced back through the chain so the shuffle reads the original vectors directly.
+A shuffle that ends up returning a vector unchanged is dropped as is OpCopyObject.
+*/
+void ShaderOptimizer::SimplifyShuffles()
+{
+	for (auto& instruction : mInstructions)
+	{
+		if (instruction.IsRemoved)
+		{
+			continue;
+		}
+
+		ResolveOperands(instruction);
+		uint32_t* words = &mWords[instruction.Offset];
+
+		switch (instruction.Opcode)
+		{
+		case spv::OpCopyObject:
+			Replace(instruction, words[3]);
+			break;
+		case spv::OpVectorShuffle:
+		{
+			uint32_t componentCount = instruction.WordCount - 5;
+			uint32_t sources[4];
+			uint32_t indices[4];
+			uint32_t distinctSources[2] = {};
+			uint32_t distinctSourceCount = 0;
+			bool isValid = (componentCount <= 4);
+
+			for (uint32_t i = 0; isValid && i < componentCount; i++)
+			{
+				uint32_t source = 0;
+				uint32_t index = 0;
+				const SpirVInstruction* shuffle = &instruction;
+
+				//Follow the component until it comes from something other than a shuffle.
+				for (uint32_t depth = 0; shuffle != nullptr && depth < SPIRV_MAX_SHUFFLE_DEPTH; depth++)
+				{
+					uint32_t component = mWords[shuffle->Offset + 5 + (depth ? index : i)];
+					uint32_t vector1 = Resolve(mWords[shuffle->Offset + 3]);
+					uint32_t vector2 = Resolve(mWords[shuffle->Offset + 4]);
+					uint32_t vector1Size = GetVectorSize(vector1);
+
+					if (component == 0xFFFFFFFF || !vector1Size || !GetVectorSize(vector2))
+					{
+						isValid = (depth > 0); //Undefined components or unknown sizes stop the trace where it is.
+						break;
+					}
+
+					if (component < vector1Size)
+					{
+						source = vector1;
+						index = component;
+					}
+					else
+					{
+						source = vector2;
+						index = component - vector1Size;
+					}
+
+					shuffle = GetDefinition(source);
+					if (shuffle != nullptr && (shuffle->IsRemoved || shuffle->Opcode != spv::OpVectorShuffle))
+					{
+						shuffle = nullptr;
+					}
+				}
+
+				sources[i] = source;
+				indices[i] = index;
+
+				if (isValid && source != distinctSources[0] && source != distinctSources[1])
+				{
+					if (distinctSourceCount == 2)
+					{
+						isValid = false;
+					}
+					else
+					{
+						distinctSources[distinctSourceCount++] = source;
+					}
+				}
+			}
+
+			if (!isValid || !distinctSourceCount)
+			{
+				break;
+			}
+
+			//Every component in order from one vector of the same type is just that vector.
+			const SpirVInstruction* source = GetDefinition(distinctSources[0]);
+			if (distinctSourceCount == 1 && source != nullptr && source->TypeId == instruction.TypeId && GetVectorSize(distinctSources[0]) == componentCount)
+			{
+				bool isIdentity = true;
+				for (uint32_t i = 0; i < componentCount; i++)
+				{
+					isIdentity = isIdentity && (indices[i] == i);
+				}
+
+				if (isIdentity && Replace(instruction, distinctSources[0]))
+				{
+					break;
+				}
+			}
+
+			uint32_t vector1 = distinctSources[0];
+			uint32_t vector2 = (distinctSourceCount == 2) ? distinctSources[1] : distinctSources[0];
+			uint32_t vector1Size = GetVectorSize(vector1);
+
+			words[3] = vector1;
+			words[4] = vector2;
+			for (uint32_t i = 0; i < componentCount; i++)
+			{
+				words[5 + i] = (sources[i] == vector1) ? indices[i] : vector1Size + indices[i];
+			}
+		}
+		break;
+		case spv::OpCompositeExtract:
+		{
+			if (instruction.WordCount != 5)
+			{
+				break;
+			}
+
+			//Pull a single component straight out of the vector a shuffle read it from.
+			for (uint32_t depth = 0; depth < SPIRV_MAX_SHUFFLE_DEPTH; depth++)
+			{
+				const SpirVInstruction* shuffle = GetDefinition(words[3]);
+				if (shuffle == nullptr || shuffle->IsRemoved || shuffle->Opcode != spv::OpVectorShuffle || words[4] >= shuffle->WordCount - 5)
+				{
+					break;
+				}
+
+				uint32_t component = mWords[shuffle->Offset + 5 + words[4]];
+				uint32_t vector1 = Resolve(mWords[shuffle->Offset + 3]);
+				uint32_t vector2 = Resolve(mWords[shuffle->Offset + 4]);
+				uint32_t vector1Size = GetVectorSize(vector1);
+
+				if (component == 0xFFFFFFFF || !vector1Size || !GetVectorSize(vector2))
+				{
+					break;
+				}
+
+				if (component < vector1Size)
+				{
+					words[3] = vector1;
+					words[4] = component;
+				}
+				else
+				{
+					words[3] = vector2;
+					words[4] = component - vector1Size;
+				}
+			}
+
+			const SpirVInstruction* composite = GetDefinition(words[3]);
+			if (composite != nullptr && !composite->IsRemoved && composite->Opcode == spv::OpCompositeConstruct && words[4] < composite->WordCount - 3 && composite->WordCount - 3 == GetVectorSize(words[3]))
+			{
+				uint32_t constituent = Resolve(mWords[composite->Offset + 3 + words[4]]);
+				const SpirVInstruction* definition = GetDefinition(constituent);
+				if (definition != nullptr && definition->TypeId == instruction.TypeId)
+				{
+					Replace(instruction, constituent);
+				}
+			}
+		}
+		break;
+		default:
+			break;
+		}
+	}
+}
+
+/*
+Identical pure instructions in the same block and identical constants anywhere in the module are folded into the first one.
+Loads are left to ForwardLoads and samples are left alone.
+*/
+void ShaderOptimizer::EliminateCommonSubexpressions()
+{
+	std::unordered_multimap<uint64_t, size_t> available;
+	std::unordered_multimap<uint64_t, size_t> constants;
+	bool isInFunction = false;
+
+	for (size_t i = 0; i < mInstructions.size(); i++)
+	{
+		auto& instruction = mInstructions[i];
+		if (instruction.IsRemoved)
+		{
+			continue;
+		}
+
+		ResolveOperands(instruction);
+
+		std::unordered_multimap<uint64_t, size_t>* table = nullptr;
+		switch (instruction.Opcode)
+		{
+		case spv::OpFunction:
+			isInFunction = true;
+			available.clear();
+			break;
+		case spv::OpFunctionEnd:
+			isInFunction = false;
+			available.clear();
+			break;
+		case spv::OpLabel:
+			available.clear();
+			break;
+		default:
+			if (!isInFunction && IsConstant(instruction.Opcode))
+			{
+				table = &constants;
+			}
+			else if (isInFunction && instruction.Opcode != spv::OpLoad && !IsImageSample(instruction.Opcode) && IsPure(instruction))
+			{
+				table = &available;
+			}
+			break;
+		}
+
+		if (table == nullptr || mIsDecorated[instruction.ResultId])
+		{
+			continue;
+		}
+
+		//Everything but the result id has to match.
+		const uint32_t* words = &mWords[instruction.Offset];
+		const uint32_t operandCount = instruction.WordCount - 3;
+		uint64_t hash = HashCombine(HashBytes(words + 3, operandCount * sizeof(uint32_t)), (((uint64_t)words[0]) << 32) | instruction.TypeId);
+
+		bool isReplaced = false;
+		auto range = table->equal_range(hash);
+		for (auto entry = range.first; entry != range.second; ++entry)
+		{
+			const auto& other = mInstructions[entry->second];
+			const uint32_t* otherWords = &mWords[other.Offset];
+
+			if (otherWords[0] == words[0] && other.TypeId == instruction.TypeId && !memcmp(otherWords + 3, words + 3, operandCount * sizeof(uint32_t)))
+			{
+				isReplaced = Replace(instruction, other.ResultId);
+				break;
+			}
+		}
+
+		if (!isReplaced)
+		{
+			table->emplace(hash, i);
+		}
+	}
+}
+
+/*
+Drops pure instructions and constants nothing reads anymore, which takes care of the loads & shuffles the other passes bypassed.
+Names and decorations don't keep an id alive.
+*/
+void ShaderOptimizer::EliminateDeadCode()
+{
+	mUseCounts.assign(mDefinitions.size(), 0);
+
+	for (auto& instruction : mInstructions)
+	{
+		if (instruction.IsRemoved)
+		{
+			continue;
+		}
+
+		ResolveOperands(instruction);
+
+		if (!IsAnnotation(instruction.Opcode))
+		{
+			ForEachIdOperand(instruction, [this](uint32_t& id)
+			{
+				mUseCounts[id]++;
+			});
+		}
+	}
+
+	auto isRemovable = [this](const SpirVInstruction& instruction)
+	{
+		return (!instruction.IsRemoved && instruction.ResultId && (IsPure(instruction) || IsConstant(instruction.Opcode) || IsSpecConstant(instruction.Opcode)));
+	};
+
+	std::vector<size_t> unusedInstructions;
+	for (size_t i = 0; i < mInstructions.size(); i++)
+	{
+		if (isRemovable(mInstructions[i]) && !mUseCounts[mInstructions[i].ResultId])
+		{
+			unusedInstructions.push_back(i);
+		}
+	}
+
+	while (!unusedInstructions.empty())
+	{
+		auto& instruction = mInstructions[unusedInstructions.back()];
+		unusedInstructions.pop_back();
+
+		if (instruction.IsRemoved)
+		{
+			continue;
+		}
+
+		instruction.IsRemoved = true;
+		mRemovedCount++;
+
+		ForEachIdOperand(instruction, [this, &unusedInstructions, &isRemovable](uint32_t& id)
+		{
+			if (--mUseCounts[id] == 0 && mDefinitions[id] != SPIRV_NO_DEFINITION && isRemovable(mInstructions[mDefinitions[id]]))
+			{
+				unusedInstructions.push_back(mDefinitions[id]);
+			}
+		});
+	}
+}
+
+/*
+True if the instruction has no side effects so it can be dropped when unused.
+*/
+bool ShaderOptimizer::IsPure(const SpirVInstruction& instruction) const
+{
+	switch (instruction.Opcode)
+	{
+	case spv::OpFunction:
+	case spv::OpVariable:
+		return false;
+	case spv::OpExtInst:
+	{
+		if (mWords[instruction.Offset + 3] != mGlslExtensionId)
+		{
+			return false;
+		}
+
+		uint32_t extendedInstruction = mWords[instruction.Offset + 4];
+		return (extendedInstruction != GLSLstd450::GLSLstd450Modf
+			&& extendedInstruction != GLSLstd450::GLSLstd450Frexp
+			&& extendedInstruction != GLSLstd450::GLSLstd450InterpolateAtCentroid
+			&& extendedInstruction != GLSLstd450::GLSLstd450InterpolateAtSample
+			&& extendedInstruction != GLSLstd450::GLSLstd450InterpolateAtOffset);
+	}
+	default:
+		//Only instructions with a result type are values. Constants have no side effects either but they don't run so they aren't counted here.
+		return (instruction.TypeId && !IsConstant(instruction.Opcode) && !IsSpecConstant(instruction.Opcode));
+	}
+}
+
+bool ShaderOptimizer::WritesMemory(const SpirVInstruction& instruction) const
+{
+	return (instruction.Opcode == spv::OpStore || (instruction.Opcode == spv::OpExtInst && !IsPure(instruction)));
+}
+
+uint32_t ShaderOptimizer::Resolve(uint32_t id) const
+{
+	while (id < mReplacements.size() && mReplacements[id])
+	{
+		id = mReplacements[id];
+	}
+	return id;
+}
+
+/*
+Removes the instruction and points everything that read its result at the id instead.
+Decorated results are kept since the decoration could change what the value means.
+*/
+bool ShaderOptimizer::Replace(SpirVInstruction& instruction, uint32_t id)
+{
+	id = Resolve(id);
+
+	if (id == instruction.ResultId || mIsDecorated[instruction.ResultId])
+	{
+		return false;
+	}
+
+	mReplacements[instruction.ResultId] = id;
+	instruction.IsRemoved = true;
+	mRemovedCount++;
+
+	return true;
+}
+
+void ShaderOptimizer::ResolveOperands(SpirVInstruction& instruction)
+{
+	if (IsAnnotation(instruction.Opcode))
+	{
+		return; //These stay on the original id and are dropped with it.
+	}
+
+	ForEachIdOperand(instruction, [this](uint32_t& id)
+	{
+		id = Resolve(id);
+	});
+}
+
+const SpirVInstruction* ShaderOptimizer::GetDefinition(uint32_t id) const
+{
+	if (id >= mDefinitions.size() || mDefinitions[id] == SPIRV_NO_DEFINITION)
+	{
+		return nullptr;
+	}
+	return &mInstructions[mDefinitions[id]];
+}
+
+uint32_t ShaderOptimizer::GetVectorSize(uint32_t id) const
+{
+	const SpirVInstruction* definition = GetDefinition(id);
+	if (definition == nullptr)
+	{
+		return 0;
+	}
+
+	const SpirVInstruction* type = GetDefinition(definition->TypeId);
+	if (type == nullptr || type->Opcode != spv::OpTypeVector)
+	{
+		return 0;
+	}
+
+	return mWords[type->Offset + 3];
+}
+
+uint32_t ShaderOptimizer::GetRootPointer(uint32_t id) const
+{
+	const SpirVInstruction* definition = GetDefinition(id);
+	while (definition != nullptr && (definition->Opcode == spv::OpAccessChain || definition->Opcode == spv::OpInBoundsAccessChain))
+	{
+		id = mWords[definition->Offset + 3];
+		definition = GetDefinition(id);
+	}
+	return id;
+}
@@ -0,0 +1,241 @@
+/*
+Copyright(c) 2018 Christopher Joseph Dean Schaefer
+
+This software is provided 'as-is', without any express or implied
+warranty.In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions :
+
+1. The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software.If you use this software
+in a product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include <spirv.hpp>
+
+#ifndef SHADEROPTIMIZER_H
+#define SHADEROPTIMIZER_H
+
+struct SpirVInstruction
+{
+	size_t Offset = 0; //Into ShaderOptimizer::mWords.
+	uint32_t Opcode = 0;
+	uint32_t WordCount = 0;
+	uint32_t TypeId = 0;
+	uint32_t ResultId = 0;
+	bool IsRemoved = false;
+};
+
+/*
+Peephole passes over the module ShaderConverter generates. The converter emits an instruction or two for every swizzle, register read and write mask which leaves a lot for the driver to clean up.
+Everything works inside of a block because the converter only produces simple if/else chains so nothing needs a dominator tree.
+A module with an opcode the optimizer doesn't know the operands of is left alone rather than risk rewriting a literal.
+*/
+struct ShaderOptimizer
+{
+	std::vector<uint32_t> mWords;
+	std::vector<SpirVInstruction> mInstructions;
+	std::vector<size_t> mDefinitions; //Instruction index by result id.
+	std::vector<uint32_t> mReplacements; //Id to use instead by result id, 0 if the id is kept.
+	std::vector<uint32_t> mUseCounts;
+	std::vector<bool> mIsDecorated;
+	uint32_t mGlslExtensionId = 0;
+	size_t mRemovedCount = 0;
+
+	size_t Optimize(std::vector<uint32_t>& words); //Returns the number of instructions removed.
+
+	bool Parse();
+	void Write(std::vector<uint32_t>& words);
+
+	void ForwardLoads();
+	void SimplifyShuffles();
+	void EliminateCommonSubexpressions();
+	void EliminateDeadCode();
+
+	bool IsPure(const SpirVInstruction& instruction) const;
+	bool WritesMemory(const SpirVInstruction& instruction) const;
+	uint32_t Resolve(uint32_t id) const;
+	bool Replace(SpirVInstruction& instruction, uint32_t id);
+	void ResolveOperands(SpirVInstruction& instruction);
+	const SpirVInstruction* GetDefinition(uint32_t id) const;
+	uint32_t GetVectorSize(uint32_t id) const;
+	uint32_t GetRootPointer(uint32_t id) const;
+
+	template<typename Function>
+	void ForEachIdOperand(const SpirVInstruction& instruction, Function function);
+};
+
+/*
+Calls the function with a reference to every id the instruction reads. (including the result type but not the result)
+*/
+template<typename Function>
+void ShaderOptimizer::ForEachIdOperand(const SpirVInstruction& instruction, Function function)
+{
+	uint32_t* words = &mWords[instruction.Offset];
+	uint32_t wordCount = instruction.WordCount;
+	uint32_t first = 1;
+
+	if (instruction.TypeId)
+	{
+		function(words[1]);
+		first++;
+	}
+
+	if (instruction.ResultId)
+	{
+		first++;
+	}
+
+	switch (instruction.Opcode)
+	{
+	case spv::OpCapability:
+	case spv::OpExtInstImport:
+	case spv::OpMemoryModel:
+	case spv::OpSourceExtension:
+	case spv::OpNop:
+	case spv::OpReturn:
+	case spv::OpFunctionEnd:
+	case spv::OpLabel:
+	case spv::OpKill:
+	case spv::OpUnreachable:
+	case spv::OpTypeVoid:
+	case spv::OpTypeBool:
+	case spv::OpTypeInt:
+	case spv::OpTypeFloat:
+	case spv::OpTypeSampler:
+	case spv::OpConstant:
+	case spv::OpConstantTrue:
+	case spv::OpConstantFalse:
+	case spv::OpConstantNull:
+	case spv::OpSpecConstant:
+	case spv::OpSpecConstantTrue:
+	case spv::OpSpecConstantFalse:
+		break;
+	case spv::OpSource:
+		if (wordCount > 3)
+		{
+			function(words[3]); //File
+		}
+		break;
+	case spv::OpName:
+	case spv::OpMemberName:
+	case spv::OpDecorate:
+	case spv::OpMemberDecorate:
+	case spv::OpExecutionMode:
+	case spv::OpBranch:
+		function(words[1]);
+		break;
+	case spv::OpEntryPoint:
+	{
+		function(words[2]); //Entry Point
+		uint32_t i = 3;
+		while (i < wordCount)
+		{
+			uint32_t word = words[i++];
+			if (!(word & 0xFF) || !(word & 0xFF00) || !(word & 0xFF0000) || !(word & 0xFF000000))
+			{
+				break; //The name ends with the word holding the null terminator.
+			}
+		}
+		for (; i < wordCount; i++)
+		{
+			function(words[i]); //Interface
+		}
+	}
+	break;
+	case spv::OpBranchConditional:
+		function(words[1]);
+		function(words[2]);
+		function(words[3]);
+		break;
+	case spv::OpTypeVector:
+	case spv::OpTypeMatrix:
+	case spv::OpTypeImage:
+	case spv::OpTypeSampledImage:
+		function(words[2]);
+		break;
+	case spv::OpTypeArray:
+		function(words[2]);
+		function(words[3]);
+		break;
+	case spv::OpTypePointer:
+		function(words[3]);
+		break;
+	case spv::OpVariable:
+		if (wordCount > 4)
+		{
+			function(words[4]); //Initializer
+		}
+		break;
+	case spv::OpFunction:
+		function(words[4]); //Function Type
+		break;
+	case spv::OpLoad:
+		function(words[3]);
+		break;
+	case spv::OpStore:
+		function(words[1]);
+		function(words[2]);
+		break;
+	case spv::OpVectorShuffle:
+		function(words[3]);
+		function(words[4]);
+		break;
+	case spv::OpCompositeExtract:
+		function(words[3]);
+		break;
+	case spv::OpCompositeInsert:
+		function(words[3]);
+		function(words[4]);
+		break;
+	case spv::OpExtInst:
+		function(words[3]); //Set
+		for (uint32_t i = 5; i < wordCount; i++)
+		{
+			function(words[i]);
+		}
+		break;
+	case spv::OpImageSampleImplicitLod:
+	case spv::OpImageSampleExplicitLod:
+	case spv::OpImageSampleProjImplicitLod:
+	case spv::OpImageSampleProjExplicitLod:
+		function(words[3]);
+		function(words[4]);
+		for (uint32_t i = 6; i < wordCount; i++)
+		{
+			function(words[i]); //Image Operands after the mask.
+		}
+		break;
+	case spv::OpImageSampleDrefImplicitLod:
+	case spv::OpImageSampleDrefExplicitLod:
+	case spv::OpImageSampleProjDrefImplicitLod:
+	case spv::OpImageSampleProjDrefExplicitLod:
+		function(words[3]);
+		function(words[4]);
+		function(words[5]);
+		for (uint32_t i = 7; i < wordCount; i++)
+		{
+			function(words[i]); //Image Operands after the mask.
+		}
+		break;
+	default:
+		//Every other opcode Parse accepts only has ids after the result.
+		for (uint32_t i = first; i < wordCount; i++)
+		{
+			function(words[i]);
+		}
+		break;
+	}
+}
+
+#endif // SHADEROPTIMIZER_H
@@ -0,0 +1,155 @@
+/*
+Copyright(c) 2018 Christopher Joseph Dean Schaefer
+
+This software is provided 'as-is', without any express or implied
+warranty.In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions :
+
+1. The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software.If you use this software
+in a product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include "Perf_ShaderTranslator.h"
+
+#include <boost/log/core.hpp>
+#include <boost/log/trivial.hpp>
+
+#include "Utilities.h"
+
+ShaderTranslator::ShaderTranslator(uint32_t threadCount, ShaderDiskCache* diskCache)
+	: mDiskCache(diskCache)
+{
+	for (uint32_t i = 0; i < threadCount; i++)
+	{
+		mThreads.push_back(std::thread(&ShaderTranslator::Run, this));
+	}
+
+	BOOST_LOG_TRIVIAL(info) << "ShaderTranslator::ShaderTranslator using " << threadCount << " translation thread(s).";
+}
+
+ShaderTranslator::~ShaderTranslator()
+{
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mIsRunning = false;
+	}
+	mJobQueued.notify_all();
+
+	//The threads finish whatever is queued before exiting so no shader is left half converted.
+	for (auto& thread : mThreads)
+	{
+		thread.join();
+	}
+
+	BOOST_LOG_TRIVIAL(info) << "ShaderTranslator::~ShaderTranslator translated " << mTranslatedCount
+		<< " max queue depth " << mMaxQueueDepth
+		<< " waits " << mWaitCount;
+}
+
+void ShaderTranslator::Translate(std::shared_ptr<ShaderConverter>& converter)
+{
+	if (mThreads.empty())
+	{
+		Execute(*converter);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mJobs.push_back(converter);
+
+		size_t queueDepth = mJobs.size() + mActiveJobs;
+		if (queueDepth > mMaxQueueDepth)
+		{
+			mMaxQueueDepth = queueDepth;
+		}
+	}
+	mJobQueued.notify_one();
+}
+
+void ShaderTranslator::Wait(ShaderConverter& converter)
+{
+	if (converter.mIsReady)
+	{
+		return;
+	}
+
+	mWaitCount++;
+
+	std::unique_lock<std::mutex> lock(mMutex);
+	mJobFinished.wait(lock, [&converter] { return (bool)converter.mIsReady; });
+}
+
+void ShaderTranslator::WaitIdle()
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	mJobFinished.wait(lock, [this] { return mJobs.empty() && !mActiveJobs; });
+}
+
+void ShaderTranslator::Run()
+{
+	while (true)
+	{
+		std::shared_ptr<ShaderConverter> converter;
+
+		{
+			std::unique_lock<std::mutex> lock(mMutex);
+			mJobQueued.wait(lock, [this] { return !mIsRunning || !mJobs.empty(); });
+
+			if (mJobs.empty())
+			{
+				return;
+			}
+
+			converter = std::move(mJobs.front());
+			mJobs.pop_front();
+			mActiveJobs++;
+		}
+
+		Execute(*converter);
+		converter.reset(); //May be the last reference if the shader was destroyed while converting.
+
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mActiveJobs--;
+		}
+		mJobFinished.notify_all();
+	}
+}
+
+void ShaderTranslator::Execute(ShaderConverter& converter)
+{
+	const uint32_t* tokens = converter.mTokens.data();
+	size_t tokenCount = converter.mTokens.size();
+
+	if (mDiskCache != nullptr && mDiskCache->Load(converter.mDiskKey, tokens, tokenCount, converter))
+	{
+		converter.FindConstantUsage(tokens); //Cheap enough to redo instead of storing the map entries.
+		converter.CreateSpirVModule();
+	}
+	else
+	{
+		converter.Convert((uint32_t*)tokens);
+
+		if (mDiskCache != nullptr)
+		{
+			mDiskCache->Store(converter.mDiskKey, tokens, tokenCount, converter);
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		converter.mIsReady = true;
+		mTranslatedCount++;
+	}
+	mJobFinished.notify_all();
+}
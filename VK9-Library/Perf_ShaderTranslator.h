@@ -0,0 +1,66 @@
+/*
+Copyright(c) 2018 Christopher Joseph Dean Schaefer
+
+This software is provided 'as-is', without any express or implied
+warranty.In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions :
+
+1. The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software.If you use this software
+in a product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include <memory>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "ShaderConverter.h"
+#include "Perf_ShaderDiskCache.h"
+
+#ifndef SHADERTRANSLATOR_H
+#define SHADERTRANSLATOR_H
+
+/*
+Converts D3D9 bytecode to SPIR-V on a pool of threads so shader creation doesn't hold up the command stream.
+Each converter is independent so load screens that create hundreds of shaders keep every thread busy.
+*/
+struct ShaderTranslator
+{
+	ShaderDiskCache* mDiskCache = nullptr; //Owned by StateManager.
+	std::vector<std::thread> mThreads;
+	std::mutex mMutex;
+	std::condition_variable mJobQueued;
+	std::condition_variable mJobFinished;
+	std::deque< std::shared_ptr<ShaderConverter> > mJobs;
+	size_t mActiveJobs = 0;
+	bool mIsRunning = true;
+
+	//Counters guarded by mMutex.
+	size_t mTranslatedCount = 0;
+	size_t mMaxQueueDepth = 0;
+
+	//Counters only touched by the command stream thread.
+	size_t mWaitCount = 0;
+
+	ShaderTranslator(uint32_t threadCount, ShaderDiskCache* diskCache);
+	~ShaderTranslator();
+
+	void Translate(std::shared_ptr<ShaderConverter>& converter);
+	void Wait(ShaderConverter& converter);
+	void WaitIdle();
+	void Run();
+	void Execute(ShaderConverter& converter);
+};
+
+#endif // SHADERTRANSLATOR_H
@@ -39,6 +39,8 @@ misrepresented as being the original software.
 #include <boost/log/sources/record_ostream.hpp>
 #include <boost/format.hpp>
 
+#include <fstream>
+
 typedef boost::container::flat_map<UINT, StreamSource> map_type;
 
 VKAPI_ATTR VkBool32 VKAPI_CALL DebugReportCallback(VkDebugReportFlagsEXT flags, VkDebugReportObjectTypeEXT objectType, uint64_t object, size_t location, int32_t messageCode, const char* layerPrefix, const char* message, void* userData)
@@ -86,6 +88,156 @@ VKAPI_ATTR void VKAPI_CALL vkCmdPushDescriptorSetKHR(
 	);
 }
 
+VKAPI_ATTR void VKAPI_CALL vkCmdPushDescriptorSetWithTemplateKHR(
+	VkCommandBuffer                             commandBuffer,
+	VkDescriptorUpdateTemplateKHR               descriptorUpdateTemplate,
+	VkPipelineLayout                            layout,
+	uint32_t                                    set,
+	const void*                                 pData)
+{
+	pfn_vkCmdPushDescriptorSetWithTemplateKHR(
+		commandBuffer,
+		descriptorUpdateTemplate,
+		layout,
+		set,
+		pData
+	);
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL vkCreateDescriptorUpdateTemplateKHR(
+	VkDevice                                    device,
+	const VkDescriptorUpdateTemplateCreateInfoKHR* pCreateInfo,
+	const VkAllocationCallbacks*                pAllocator,
+	VkDescriptorUpdateTemplateKHR*              pDescriptorUpdateTemplate)
+{
+	return pfn_vkCreateDescriptorUpdateTemplateKHR(
+		device,
+		pCreateInfo,
+		pAllocator,
+		pDescriptorUpdateTemplate
+	);
+}
+
+VKAPI_ATTR void VKAPI_CALL vkDestroyDescriptorUpdateTemplateKHR(
+	VkDevice                                    device,
+	VkDescriptorUpdateTemplateKHR               descriptorUpdateTemplate,
+	const VkAllocationCallbacks*                pAllocator)
+{
+	pfn_vkDestroyDescriptorUpdateTemplateKHR(
+		device,
+		descriptorUpdateTemplate,
+		pAllocator
+	);
+}
+
+VKAPI_ATTR void VKAPI_CALL vkGetPhysicalDeviceFeatures2KHR(
+	VkPhysicalDevice                            physicalDevice,
+	VkPhysicalDeviceFeatures2KHR*               pFeatures)
+{
+	pfn_vkGetPhysicalDeviceFeatures2KHR(
+		physicalDevice,
+		pFeatures
+	);
+}
+
+VKAPI_ATTR void VKAPI_CALL vkCmdSetCullModeEXT(
+	VkCommandBuffer                             commandBuffer,
+	VkCullModeFlags                             cullMode)
+{
+	pfn_vkCmdSetCullModeEXT(
+		commandBuffer,
+		cullMode
+	);
+}
+
+VKAPI_ATTR void VKAPI_CALL vkCmdSetFrontFaceEXT(
+	VkCommandBuffer                             commandBuffer,
+	VkFrontFace                                 frontFace)
+{
+	pfn_vkCmdSetFrontFaceEXT(
+		commandBuffer,
+		frontFace
+	);
+}
+
+VKAPI_ATTR void VKAPI_CALL vkCmdSetPrimitiveTopologyEXT(
+	VkCommandBuffer                             commandBuffer,
+	VkPrimitiveTopology                         primitiveTopology)
+{
+	pfn_vkCmdSetPrimitiveTopologyEXT(
+		commandBuffer,
+		primitiveTopology
+	);
+}
+
+VKAPI_ATTR void VKAPI_CALL vkCmdSetDepthTestEnableEXT(
+	VkCommandBuffer                             commandBuffer,
+	VkBool32                                    depthTestEnable)
+{
+	pfn_vkCmdSetDepthTestEnableEXT(
+		commandBuffer,
+		depthTestEnable
+	);
+}
+
+VKAPI_ATTR void VKAPI_CALL vkCmdSetDepthWriteEnableEXT(
+	VkCommandBuffer                             commandBuffer,
+	VkBool32                                    depthWriteEnable)
+{
+	pfn_vkCmdSetDepthWriteEnableEXT(
+		commandBuffer,
+		depthWriteEnable
+	);
+}
+
+VKAPI_ATTR void VKAPI_CALL vkCmdSetDepthCompareOpEXT(
+	VkCommandBuffer                             commandBuffer,
+	VkCompareOp                                 depthCompareOp)
+{
+	pfn_vkCmdSetDepthCompareOpEXT(
+		commandBuffer,
+		depthCompareOp
+	);
+}
+
+VKAPI_ATTR void VKAPI_CALL vkCmdSetStencilTestEnableEXT(
+	VkCommandBuffer                             commandBuffer,
+	VkBool32                                    stencilTestEnable)
+{
+	pfn_vkCmdSetStencilTestEnableEXT(
+		commandBuffer,
+		stencilTestEnable
+	);
+}
+
+VKAPI_ATTR void VKAPI_CALL vkCmdSetStencilOpEXT(
+	VkCommandBuffer                             commandBuffer,
+	VkStencilFaceFlags                          faceMask,
+	VkStencilOp                                 failOp,
+	VkStencilOp                                 passOp,
+	VkStencilOp                                 depthFailOp,
+	VkCompareOp                                 compareOp)
+{
+	pfn_vkCmdSetStencilOpEXT(
+		commandBuffer,
+		faceMask,
+		failOp,
+		passOp,
+		depthFailOp,
+		compareOp
+	);
+}
+
+VKAPI_ATTR void VKAPI_CALL vkCmdSetDepthBiasEnableEXT(
+	VkCommandBuffer                             commandBuffer,
+	VkBool32                                    depthBiasEnable)
+{
+	pfn_vkCmdSetDepthBiasEnableEXT(
+		commandBuffer,
+		depthBiasEnable
+	);
+}
+
 VKAPI_ATTR VkResult VKAPI_CALL vkCreateDebugReportCallbackEXT(
 	VkInstance                                  instance,
 	const VkDebugReportCallbackCreateInfoEXT*   pCreateInfo,
@@ -134,6 +286,51 @@ VKAPI_ATTR void VKAPI_CALL vkDebugReportMessageEXT(
 	);
 }
 
+void BindingTracker::Reset()
+{
+	DirtyFlags = BINDING_FLAG_ALL;
+	BoundFlags = 0;
+
+	Pipeline = vk::Pipeline();
+	PipelineLayout = vk::PipelineLayout();
+	IndexBuffer = vk::Buffer();
+	for (size_t i = 0; i < BINDING_MAX_STREAMS; i++)
+	{
+		VertexBuffers[i] = vk::Buffer();
+		VertexBufferOffsets[i] = 0;
+	}
+}
+
+void BindingTracker::LogStatistics(bool force)
+{
+	size_t count = 0;
+	for (size_t i = 0; i < BindingType_Count; i++)
+	{
+		count += BindCounts[i] + SkipCounts[i];
+	}
+
+	if (count == LastLoggedCount && !force)
+	{
+		return;
+	}
+
+	auto now = std::chrono::steady_clock::now();
+	if (!force && std::chrono::duration_cast<std::chrono::seconds>(now - LastLog).count() < 5)
+	{
+		return;
+	}
+
+	static const char* names[BindingType_Count] = { "pipeline", "vertex buffers", "index buffer", "descriptors", "push constants", "shader constants", "depth bias", "viewport", "scissor", "stencil", "blend constants", "raster state" };
+
+	for (size_t i = 0; i < BindingType_Count; i++)
+	{
+		BOOST_LOG_TRIVIAL(info) << "BindingTracker::LogStatistics " << names[i] << " bound " << BindCounts[i] << " skipped " << SkipCounts[i];
+	}
+
+	LastLoggedCount = count;
+	LastLog = now;
+}
+
 RealWindow::RealWindow(std::shared_ptr<RealInstance>& realInstance, std::shared_ptr<RealDevice>& realDevice)
 	: mRealInstance(realInstance)
 	, mRealDevice(realDevice)
@@ -145,22 +342,50 @@ RealWindow::~RealWindow()
 {
 	BOOST_LOG_TRIVIAL(info) << "RealWindow::~RealWindow";
 
+	//Nothing can be destroyed while a frame is still in flight.
+	WaitForFrames();
+
+	//Let queued pipelines finish since they reference shader modules and the pipeline cache.
+	mPipelineCompiler.reset();
+
+	//Pending uploads are submitted and waited on since they reference the window's images and command pool.
+	mUploadManager.reset();
+
+	mBindings.LogStatistics(true);
+
+	BOOST_LOG_TRIVIAL(info) << "RealWindow::~RealWindow shader cache hits " << mShaderCacheHits << " misses " << mShaderCacheMisses;
+
 	//Empty cached objects. (a destructor should take care of their resources.)
+	mFallbackPipelines.clear();
+	mShaderCache.clear();
 	mDrawBuffer.clear();
-	mSamplerRequests.clear();
+	mSamplers.clear();
 
 	//Clean up the rest of the window state handles.
 	auto& device = mRealDevice->mDevice;
 	auto& instance = mRealInstance->mInstance;
 
+	auto& memoryAllocator = (*mRealDevice->mMemoryAllocator);
+
 	device.freeCommandBuffers(mCommandPool, 1, &mCommandBuffer);
-	device.destroyBuffer(mLightBuffer, nullptr);
-	device.freeMemory(mLightBufferMemory, nullptr);
-	device.destroyBuffer(mMaterialBuffer, nullptr);
-	device.freeMemory(mMaterialBufferMemory, nullptr);
+	device.destroyBuffer(mFixedFunctionBuffer, nullptr);
+	memoryAllocator.Free(mFixedFunctionBufferAllocation);
+
+	//Every frame has finished by now so nothing reads the retired buffers or resources anymore.
+	mCompletedFrameNumber = mFrameNumber;
+	FreeRetiredBuffers();
+
+	if (mShaderConstantBuffer != VK_NULL_HANDLE)
+	{
+		device.freeDescriptorSets(mRealDevice->mDescriptorPool, 1, &mShaderConstantDescriptorSet);
+		device.destroyDescriptorSetLayout(mShaderConstantDescriptorSetLayout, nullptr);
+		device.destroyBuffer(mShaderConstantBuffer, nullptr);
+		memoryAllocator.Free(mShaderConstantBufferAllocation);
+	}
+
 	device.destroyImageView(mImageView, nullptr);
 	device.destroyImage(mImage, nullptr);
-	device.freeMemory(mDeviceMemory, nullptr);
+	memoryAllocator.Free(mImageAllocation);
 	device.destroySampler(mSampler, nullptr);
 	device.destroyShaderModule(mVertShaderModule_XYZ_DIFFUSE, nullptr);
 	device.destroyShaderModule(mFragShaderModule_XYZ_DIFFUSE, nullptr);
@@ -180,9 +405,27 @@ RealWindow::~RealWindow()
 	device.destroyShaderModule(mFragShaderModule_XYZ_NORMAL_DIFFUSE, nullptr);
 	device.destroyShaderModule(mVertShaderModule_XYZ_NORMAL_DIFFUSE_TEX2, nullptr);
 	device.destroyShaderModule(mFragShaderModule_XYZ_NORMAL_DIFFUSE_TEX2, nullptr);
+	SavePipelineCache();
 	device.destroyPipelineCache(mPipelineCache, nullptr);
 
-	device.destroySemaphore(mPresentCompleteSemaphore, nullptr);
+	for (size_t i = 0; i < mFrameCount; i++)
+	{
+		if (mFrameFences != nullptr)
+		{
+			device.destroyFence(mFrameFences[i], nullptr);
+		}
+		if (mImageAvailableSemaphores != nullptr)
+		{
+			device.destroySemaphore(mImageAvailableSemaphores[i], nullptr);
+		}
+		if (mRenderFinishedSemaphores != nullptr)
+		{
+			device.destroySemaphore(mRenderFinishedSemaphores[i], nullptr);
+		}
+	}
+	delete[] mFrameFences;
+	delete[] mImageAvailableSemaphores;
+	delete[] mRenderFinishedSemaphores;
 
 	if (mFramebuffers != nullptr)
 	{
@@ -198,11 +441,14 @@ RealWindow::~RealWindow()
 
 	device.destroyRenderPass(mStoreRenderPass, nullptr);
 	device.destroyRenderPass(mClearRenderPass, nullptr);
-	device.freeCommandBuffers(mCommandPool, mSwapchainImageCount, mSwapchainBuffers);
-	delete[] mSwapchainBuffers;
+	if (mFrameCommandBuffers != nullptr)
+	{
+		device.freeCommandBuffers(mCommandPool, mFrameCount, mFrameCommandBuffers);
+		delete[] mFrameCommandBuffers;
+	}
 	device.destroyImageView(mDepthView, nullptr);
 	device.destroyImage(mDepthImage, nullptr);
-	device.freeMemory(mDepthDeviceMemory, nullptr);
+	memoryAllocator.Free(mDepthAllocation);
 	device.destroyCommandPool(mCommandPool, nullptr);
 	device.destroySwapchainKHR(mSwapchain, nullptr);
 
@@ -237,69 +483,211 @@ RealWindow::~RealWindow()
 	delete[] mSurfaceFormats;
 }
 
-void RealWindow::SetImageLayout(vk::Image image, vk::ImageAspectFlags aspectMask, vk::ImageLayout oldImageLayout, vk::ImageLayout newImageLayout, uint32_t levelCount, uint32_t mipIndex, uint32_t layerCount)
+void RealWindow::WaitForFrames()
 {
 	/*
-	This is just a helper method to reduce repeat code.
+	Blocks until every submitted frame has finished on the GPU.
+	The fences are created signaled and only reset right before submit so waiting on the frame currently being recorded is safe.
 	*/
+	if (mFrameFences == nullptr)
+	{
+		return;
+	}
+
+	vk::Result result = mRealDevice->mDevice.waitForFences(mFrameCount, mFrameFences, VK_TRUE, UINT64_MAX);
+	if (result != vk::Result::eSuccess)
+	{
+		BOOST_LOG_TRIVIAL(fatal) << "RealWindow::WaitForFrames vkWaitForFences failed with return code of " << GetResultString((VkResult)result);
+		return;
+	}
+
+	mCompletedFrameNumber = mFrameNumber - 1;
+}
+
+bool RealWindow::ReadPipelineCache(std::vector<char>& data)
+{
+	auto& properties = mRealDevice->mPhysicalDeviceProperties;
+
+	data.clear();
+
+	std::ifstream file(mPipelineCachePath, std::ios::binary | std::ios::ate);
+	if (!file)
+	{
+		return false;
+	}
+
+	uint64_t fileSize = (uint64_t)file.tellg();
+	PipelineCacheHeader header;
+
+	file.seekg(0, std::ios::beg);
+	file.read((char*)&header, sizeof(PipelineCacheHeader));
+
+	if (!file
+		|| header.Magic != PIPELINE_CACHE_MAGIC
+		|| header.Version != PIPELINE_CACHE_VERSION
+		|| header.VendorId != properties.vendorID
+		|| header.DeviceId != properties.deviceID
+		|| header.DriverVersion != properties.driverVersion
+		|| memcmp(header.PipelineCacheUUID, &properties.pipelineCacheUUID[0], VK_UUID_SIZE))
+	{
+		BOOST_LOG_TRIVIAL(info) << "RealWindow::ReadPipelineCache " << mPipelineCachePath << " is from a different device or driver and will be replaced.";
+		return false;
+	}
+
+	if (header.DataSize != fileSize - sizeof(PipelineCacheHeader))
+	{
+		BOOST_LOG_TRIVIAL(warning) << "RealWindow::ReadPipelineCache " << mPipelineCachePath << " is truncated and will be replaced.";
+		return false;
+	}
+
+	data.resize((size_t)header.DataSize);
+	file.read(data.data(), data.size());
+
+	if (!file || HashBytes(data.data(), data.size()) != header.DataHash)
+	{
+		BOOST_LOG_TRIVIAL(warning) << "RealWindow::ReadPipelineCache " << mPipelineCachePath << " is corrupt and will be replaced.";
+		data.clear();
+		return false;
+	}
+
+	return true;
+}
+
+void RealWindow::LoadPipelineCache()
+{
 	vk::Result result;
-	vk::CommandBuffer commandBuffer;
+	auto& device = mRealDevice->mDevice;
+	std::vector<char> data;
 
-	if (aspectMask == vk::ImageAspectFlags())
+	if (!mPipelineCachePath.empty())
 	{
-		aspectMask = vk::ImageAspectFlagBits::eColor;
+		ReadPipelineCache(data);
 	}
 
-	vk::CommandBufferAllocateInfo commandBufferInfo = {};
-	commandBufferInfo.commandPool = mCommandPool;
-	commandBufferInfo.level = vk::CommandBufferLevel::ePrimary;
-	commandBufferInfo.commandBufferCount = 1;
+	mPipelineCacheCreateInfo.initialDataSize = data.size();
+	mPipelineCacheCreateInfo.pInitialData = data.empty() ? nullptr : data.data();
+
+	result = device.createPipelineCache(&mPipelineCacheCreateInfo, nullptr, &mPipelineCache);
+	if (result != vk::Result::eSuccess && !data.empty())
+	{
+		//The driver gets the final say so start over with an empty cache if it doesn't like the data.
+		BOOST_LOG_TRIVIAL(warning) << "RealWindow::LoadPipelineCache vkCreatePipelineCache rejected the saved data with return code of " << GetResultString((VkResult)result);
+
+		mPipelineCacheCreateInfo.initialDataSize = 0;
+		mPipelineCacheCreateInfo.pInitialData = nullptr;
+		result = device.createPipelineCache(&mPipelineCacheCreateInfo, nullptr, &mPipelineCache);
+	}
+
+	mPipelineCacheCreateInfo.initialDataSize = 0;
+	mPipelineCacheCreateInfo.pInitialData = nullptr;
 
-	result = mRealDevice->mDevice.allocateCommandBuffers(&commandBufferInfo, &commandBuffer);
 	if (result != vk::Result::eSuccess)
 	{
-		BOOST_LOG_TRIVIAL(fatal) << "RealWindow::SetImageLayout vkAllocateCommandBuffers failed with return code of " << GetResultString((VkResult)result);
+		BOOST_LOG_TRIVIAL(fatal) << "RealWindow::LoadPipelineCache vkCreatePipelineCache failed with return code of " << GetResultString((VkResult)result);
 		return;
 	}
 
-	vk::CommandBufferInheritanceInfo commandBufferInheritanceInfo;
-	commandBufferInheritanceInfo.subpass = 0;
-	commandBufferInheritanceInfo.occlusionQueryEnable = VK_FALSE;
+	if (!data.empty())
+	{
+		BOOST_LOG_TRIVIAL(info) << "RealWindow::LoadPipelineCache loaded " << data.size() << " bytes from " << mPipelineCachePath;
+	}
 
-	vk::CommandBufferBeginInfo commandBufferBeginInfo;
-	commandBufferBeginInfo.pInheritanceInfo = &commandBufferInheritanceInfo;
+	mLastPipelineCacheSave = std::chrono::steady_clock::now();
+}
+
+void RealWindow::SavePipelineCache()
+{
+	vk::Result result;
+	auto& device = mRealDevice->mDevice;
+	auto& properties = mRealDevice->mPhysicalDeviceProperties;
+	size_t dataSize = 0;
+
+	if (mPipelineCachePath.empty() || mPipelineCache == VK_NULL_HANDLE)
+	{
+		return;
+	}
+
+	/*
+	Compile jobs write into mPipelineCache from the compiler's threads and the destination of a merge has to be externally synchronized.
+	So the live cache is merged into a temporary one that only this thread touches and that is what gets written out.
+	Every window on the same GPU shares the file so the temporary cache starts from whatever another window saved since this one loaded.
+	*/
+	std::vector<char> data;
+	vk::PipelineCacheCreateInfo pipelineCacheCreateInfo;
+	if (ReadPipelineCache(data))
+	{
+		pipelineCacheCreateInfo.initialDataSize = data.size();
+		pipelineCacheCreateInfo.pInitialData = data.data();
+	}
+
+	vk::PipelineCache mergedPipelineCache;
+	result = device.createPipelineCache(&pipelineCacheCreateInfo, nullptr, &mergedPipelineCache);
+	if (result != vk::Result::eSuccess && pipelineCacheCreateInfo.initialDataSize)
+	{
+		pipelineCacheCreateInfo.initialDataSize = 0;
+		pipelineCacheCreateInfo.pInitialData = nullptr;
+		result = device.createPipelineCache(&pipelineCacheCreateInfo, nullptr, &mergedPipelineCache);
+	}
 
-	result = commandBuffer.begin(&commandBufferBeginInfo);
 	if (result != vk::Result::eSuccess)
 	{
-		BOOST_LOG_TRIVIAL(fatal) << "RealWindow::SetImageLayout vkBeginCommandBuffer failed with return code of " << GetResultString((VkResult)result);
+		BOOST_LOG_TRIVIAL(fatal) << "RealWindow::SavePipelineCache vkCreatePipelineCache failed with return code of " << GetResultString((VkResult)result);
 		return;
 	}
 
-	ReallySetImageLayout(commandBuffer, image, aspectMask, oldImageLayout, newImageLayout, levelCount, mipIndex, layerCount);
+	result = device.mergePipelineCaches(mergedPipelineCache, 1, &mPipelineCache);
+	if (result == vk::Result::eSuccess)
+	{
+		result = device.getPipelineCacheData(mergedPipelineCache, &dataSize, nullptr);
+	}
 
-	commandBuffer.end();
+	if (result == vk::Result::eSuccess)
+	{
+		data.resize(dataSize);
+		result = device.getPipelineCacheData(mergedPipelineCache, &dataSize, data.data());
+	}
 
-	vk::CommandBuffer commandBuffers[] = { commandBuffer };
-	vk::Fence nullFence;
-	vk::SubmitInfo submitInfo;
-	submitInfo.waitSemaphoreCount = 0;
-	submitInfo.commandBufferCount = 1;
-	submitInfo.pCommandBuffers = commandBuffers;
-	submitInfo.signalSemaphoreCount = 0;
+	device.destroyPipelineCache(mergedPipelineCache, nullptr);
 
-	result = mQueue.submit(1, &submitInfo, nullFence);
 	if (result != vk::Result::eSuccess)
 	{
-		BOOST_LOG_TRIVIAL(fatal) << "RealWindow::SetImageLayout vkQueueSubmit failed with return code of " << GetResultString((VkResult)result);
+		BOOST_LOG_TRIVIAL(fatal) << "RealWindow::SavePipelineCache failed to gather the pipeline cache data with return code of " << GetResultString((VkResult)result);
 		return;
 	}
 
-	mQueue.waitIdle();
-	mRealDevice->mDevice.freeCommandBuffers(mCommandPool, 1, commandBuffers);
+	PipelineCacheHeader header;
+	header.VendorId = properties.vendorID;
+	header.DeviceId = properties.deviceID;
+	header.DriverVersion = properties.driverVersion;
+	memcpy(header.PipelineCacheUUID, &properties.pipelineCacheUUID[0], VK_UUID_SIZE);
+	header.DataSize = dataSize;
+	header.DataHash = HashBytes(data.data(), dataSize);
+
+	if (!WriteFileAtomically(mPipelineCachePath, { { &header, sizeof(PipelineCacheHeader) }, { data.data(), dataSize } }))
+	{
+		BOOST_LOG_TRIVIAL(error) << "RealWindow::SavePipelineCache failed to save " << mPipelineCachePath;
+		return;
+	}
+
+	mPipelinesSinceCacheSave = 0;
+	mLastPipelineCacheSave = std::chrono::steady_clock::now();
 }
 
-void RealWindow::CreateBuffer(vk::DeviceSize size, vk::BufferUsageFlags usage, vk::MemoryPropertyFlagBits properties, vk::Buffer& buffer, vk::DeviceMemory& deviceMemory)
+void RealWindow::SetImageLayout(vk::Image image, vk::ImageAspectFlags aspectMask, vk::ImageLayout oldImageLayout, vk::ImageLayout newImageLayout, uint32_t levelCount, uint32_t mipIndex, uint32_t layerCount)
+{
+	/*
+	This is just a helper method to reduce repeat code.
+	The transition is batched with the other uploads so it runs ahead of the next frame instead of draining the queue.
+	*/
+	if (aspectMask == vk::ImageAspectFlags())
+	{
+		aspectMask = vk::ImageAspectFlagBits::eColor;
+	}
+
+	ReallySetImageLayout(mUploadManager->GetCommandBuffer(), image, aspectMask, oldImageLayout, newImageLayout, levelCount, mipIndex, layerCount);
+}
+
+void RealWindow::CreateBuffer(vk::DeviceSize size, vk::BufferUsageFlags usage, vk::MemoryPropertyFlagBits properties, vk::Buffer& buffer, MemoryAllocation& allocation)
 {
 	vk::Result result; // = VK_SUCCESS
 
@@ -318,24 +706,57 @@ void RealWindow::CreateBuffer(vk::DeviceSize size, vk::BufferUsageFlags usage, v
 	vk::MemoryRequirements memoryRequirements;
 	mRealDevice->mDevice.getBufferMemoryRequirements(buffer, &memoryRequirements);
 
-	vk::MemoryAllocateInfo allocInfo;
-	allocInfo.allocationSize = memoryRequirements.size;
-	//allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits, properties);
-
-	if (!GetMemoryTypeFromProperties(mRealDevice->mPhysicalDeviceMemoryProperties, memoryRequirements.memoryTypeBits, properties, &allocInfo.memoryTypeIndex))
+	if (!mRealDevice->mMemoryAllocator->Allocate(memoryRequirements, properties, true, allocation))
 	{
-		BOOST_LOG_TRIVIAL(fatal) << "Memory type index not found!";
+		BOOST_LOG_TRIVIAL(fatal) << "RealWindow::CreateBuffer failed to allocate memory.";
 		return;
 	}
 
-	result = mRealDevice->mDevice.allocateMemory(&allocInfo, nullptr, &deviceMemory);
-	if (result != vk::Result::eSuccess)
+	mRealDevice->mDevice.bindBufferMemory(buffer, allocation.Memory, allocation.Offset);
+}
+
+bool RealWindow::RenameBuffer(const vk::BufferCreateInfo& bufferCreateInfo, vk::Buffer& buffer, MemoryAllocation& allocation, uint64_t& lastUsedFrame, std::deque<BufferVersion>& retiredVersions)
+{
+	BufferVersion version;
+
+	//Versions are retired in order so if the oldest one is still in use the rest are too.
+	if (!retiredVersions.empty() && retiredVersions.front().LastUsedFrame <= mCompletedFrameNumber)
 	{
-		BOOST_LOG_TRIVIAL(fatal) << "RealWindow::CreateBuffer vkCreateBuffer failed with return code of " << GetResultString((VkResult)result);
-		return;
+		version = retiredVersions.front();
+		retiredVersions.pop_front();
+	}
+	else
+	{
+		vk::Result result = mRealDevice->mDevice.createBuffer(&bufferCreateInfo, nullptr, &version.Buffer);
+		if (result != vk::Result::eSuccess)
+		{
+			BOOST_LOG_TRIVIAL(fatal) << "RealWindow::RenameBuffer vkCreateBuffer failed with return code of " << GetResultString((VkResult)result);
+			return false;
+		}
+
+		vk::MemoryRequirements memoryRequirements = mRealDevice->mDevice.getBufferMemoryRequirements(version.Buffer);
+
+		if (!mRealDevice->mMemoryAllocator->Allocate(memoryRequirements, (vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent), true, version.Allocation))
+		{
+			BOOST_LOG_TRIVIAL(fatal) << "RealWindow::RenameBuffer failed to allocate memory.";
+			mRealDevice->mDevice.destroyBuffer(version.Buffer, nullptr);
+			return false;
+		}
+
+		mRealDevice->mDevice.bindBufferMemory(version.Buffer, version.Allocation.Memory, version.Allocation.Offset);
 	}
 
-	mRealDevice->mDevice.bindBufferMemory(buffer, deviceMemory, 0);
+	BufferVersion retiredVersion;
+	retiredVersion.Buffer = buffer;
+	retiredVersion.Allocation = allocation;
+	retiredVersion.LastUsedFrame = lastUsedFrame;
+	retiredVersions.push_back(retiredVersion);
+
+	buffer = version.Buffer;
+	allocation = version.Allocation;
+	lastUsedFrame = 0;
+
+	return true;
 }
 
 void RealWindow::CopyBuffer(vk::Buffer srcBuffer, vk::Buffer dstBuffer, vk::DeviceSize size)
@@ -351,6 +772,204 @@ void RealWindow::CopyBuffer(vk::Buffer srcBuffer, vk::Buffer dstBuffer, vk::Devi
 	mCommandBuffer.reset(vk::CommandBufferResetFlagBits::eReleaseResources); //So far resetting a command buffer is about 10 times faster than allocating a new one.
 }
 
+bool RealWindow::CreateFrameRing(vk::DeviceSize frameSize, vk::Buffer& buffer, MemoryAllocation& allocation)
+{
+	auto& device = mRealDevice->mDevice;
+
+	vk::BufferCreateInfo bufferCreateInfo;
+	bufferCreateInfo.size = frameSize * mFrameCount;
+	bufferCreateInfo.usage = vk::BufferUsageFlagBits::eUniformBuffer;
+	bufferCreateInfo.sharingMode = vk::SharingMode::eExclusive;
+
+	vk::Result result = device.createBuffer(&bufferCreateInfo, nullptr, &buffer);
+	if (result != vk::Result::eSuccess)
+	{
+		BOOST_LOG_TRIVIAL(fatal) << "RealWindow::CreateFrameRing vkCreateBuffer failed with return code of " << GetResultString((VkResult)result);
+		buffer = VK_NULL_HANDLE;
+		return false;
+	}
+
+	vk::MemoryRequirements memoryRequirements = device.getBufferMemoryRequirements(buffer);
+
+	if (!mRealDevice->mMemoryAllocator->Allocate(memoryRequirements, (vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent), true, allocation))
+	{
+		BOOST_LOG_TRIVIAL(fatal) << "RealWindow::CreateFrameRing failed to allocate memory.";
+		device.destroyBuffer(buffer, nullptr);
+		buffer = VK_NULL_HANDLE;
+		return false;
+	}
+
+	device.bindBufferMemory(buffer, allocation.Memory, allocation.Offset);
+
+	return true;
+}
+
+bool RealWindow::GrowFrameRing(vk::DeviceSize frameSize, const char* optionName, vk::Buffer& buffer, MemoryAllocation& allocation, char*& data, std::deque<BufferVersion>& retiredVersions)
+{
+	//Space handed out earlier in the frame is still read by recorded draws so a full ring can't wrap. The old buffer lives on until this frame has finished.
+	BufferVersion version;
+	if (!CreateFrameRing(frameSize, version.Buffer, version.Allocation))
+	{
+		return false;
+	}
+
+	BufferVersion retiredVersion;
+	retiredVersion.Buffer = buffer;
+	retiredVersion.Allocation = allocation;
+	retiredVersion.LastUsedFrame = mFrameNumber;
+	retiredVersions.push_back(retiredVersion);
+
+	buffer = version.Buffer;
+	allocation = version.Allocation;
+	data = version.Allocation.Data;
+
+	BOOST_LOG_TRIVIAL(warning) << "RealWindow::GrowFrameRing ran out of space for this frame, the buffer now has " << frameSize << " bytes per frame. (raise " << optionName << " to avoid this)";
+
+	return true;
+}
+
+bool RealWindow::AllocateShaderConstantDescriptorSet(vk::DescriptorSet& descriptorSet)
+{
+	vk::DescriptorSetAllocateInfo constantSetAllocateInfo;
+	constantSetAllocateInfo.descriptorPool = mRealDevice->mDescriptorPool;
+	constantSetAllocateInfo.descriptorSetCount = 1;
+	constantSetAllocateInfo.pSetLayouts = &mShaderConstantDescriptorSetLayout;
+
+	vk::Result result = mRealDevice->mDevice.allocateDescriptorSets(&constantSetAllocateInfo, &descriptorSet);
+	if (result != vk::Result::eSuccess)
+	{
+		BOOST_LOG_TRIVIAL(fatal) << "RealWindow::AllocateShaderConstantDescriptorSet vkAllocateDescriptorSets failed with return code of " << GetResultString((VkResult)result);
+		return false;
+	}
+
+	return true;
+}
+
+void RealWindow::UpdateShaderConstantDescriptorSet()
+{
+	//The descriptors only change when the ring grows, otherwise just the dynamic offsets do.
+	vk::DescriptorBufferInfo constantBufferInfo[2];
+	vk::WriteDescriptorSet constantWrites[2];
+	for (uint32_t i = 0; i < 2; i++)
+	{
+		constantBufferInfo[i].buffer = mShaderConstantBuffer;
+		constantBufferInfo[i].offset = 0;
+		constantBufferInfo[i].range = sizeof(ShaderConstantSlots);
+
+		constantWrites[i].dstSet = mShaderConstantDescriptorSet;
+		constantWrites[i].dstBinding = i;
+		constantWrites[i].descriptorCount = 1;
+		constantWrites[i].descriptorType = vk::DescriptorType::eUniformBufferDynamic;
+		constantWrites[i].pBufferInfo = &constantBufferInfo[i];
+	}
+
+	mRealDevice->mDevice.updateDescriptorSets(2, constantWrites, 0, nullptr);
+}
+
+bool RealWindow::CreateShaderConstantRing()
+{
+	if (!CreateFrameRing(mShaderConstantSlotSize * mShaderConstantSlotCount, mShaderConstantBuffer, mShaderConstantBufferAllocation))
+	{
+		return false;
+	}
+
+	mShaderConstantBufferData = mShaderConstantBufferAllocation.Data;
+
+	if (!AllocateShaderConstantDescriptorSet(mShaderConstantDescriptorSet))
+	{
+		mRealDevice->mDevice.destroyBuffer(mShaderConstantBuffer, nullptr);
+		mRealDevice->mMemoryAllocator->Free(mShaderConstantBufferAllocation);
+		mShaderConstantBuffer = VK_NULL_HANDLE;
+		return false;
+	}
+
+	UpdateShaderConstantDescriptorSet();
+
+	return true;
+}
+
+bool RealWindow::GrowShaderConstantRing()
+{
+	//The new set is allocated first so a failure leaves the current ring untouched.
+	vk::DescriptorSet descriptorSet;
+	if (!AllocateShaderConstantDescriptorSet(descriptorSet))
+	{
+		return false;
+	}
+
+	if (!GrowFrameRing(mShaderConstantSlotSize * mShaderConstantSlotCount * 2, "ShaderConstantRingSize", mShaderConstantBuffer, mShaderConstantBufferAllocation, mShaderConstantBufferData, mRetiredShaderConstantBuffers))
+	{
+		mRealDevice->mDevice.freeDescriptorSets(mRealDevice->mDescriptorPool, 1, &descriptorSet);
+		return false;
+	}
+
+	//Draws recorded before the switch still bind the old set.
+	mRetiredShaderConstantBuffers.back().DescriptorSet = mShaderConstantDescriptorSet;
+	mShaderConstantDescriptorSet = descriptorSet;
+	UpdateShaderConstantDescriptorSet();
+
+	mShaderConstantSlotCount *= 2;
+	mNextShaderConstantSlot = 0;
+
+	return true;
+}
+
+bool RealWindow::GrowFixedFunctionArena(vk::DeviceSize minimumSize)
+{
+	vk::DeviceSize alignment = mRealDevice->mPhysicalDeviceProperties.limits.minUniformBufferOffsetAlignment;
+	vk::DeviceSize arenaSize = mFixedFunctionArenaSize * 2;
+	while (arenaSize < minimumSize)
+	{
+		arenaSize *= 2;
+	}
+	arenaSize = ((arenaSize + alignment - 1) / alignment) * alignment;
+
+	if (!GrowFrameRing(arenaSize, "FixedFunctionArenaSize", mFixedFunctionBuffer, mFixedFunctionBufferAllocation, mFixedFunctionBufferData, mRetiredFixedFunctionBuffers))
+	{
+		return false;
+	}
+
+	//Blocks that weren't rewritten keep pointing at the old buffer for the rest of the frame which is fine since it is still alive.
+	mFixedFunctionArenaSize = arenaSize;
+	mFixedFunctionArenaHead = 0;
+
+	return true;
+}
+
+void RealWindow::RetireResource(std::shared_ptr<void> resource)
+{
+	RetiredResource retiredResource;
+	retiredResource.Resource = resource;
+	retiredResource.LastUsedFrame = mFrameNumber; //The frame being recorded may already reference it.
+	mRetiredResources.push_back(retiredResource);
+}
+
+void RealWindow::FreeRetiredBuffers()
+{
+	auto& device = mRealDevice->mDevice;
+
+	//Buffers are retired in order so if the oldest one is still in use the rest are too.
+	for (auto retiredVersions : { &mRetiredShaderConstantBuffers, &mRetiredFixedFunctionBuffers })
+	{
+		while (!retiredVersions->empty() && retiredVersions->front().LastUsedFrame <= mCompletedFrameNumber)
+		{
+			auto& version = retiredVersions->front();
+			if (version.DescriptorSet != VK_NULL_HANDLE)
+			{
+				device.freeDescriptorSets(mRealDevice->mDescriptorPool, 1, &version.DescriptorSet);
+			}
+			device.destroyBuffer(version.Buffer, nullptr);
+			mRealDevice->mMemoryAllocator->Free(version.Allocation);
+			retiredVersions->pop_front();
+		}
+	}
+
+	while (!mRetiredResources.empty() && mRetiredResources.front().LastUsedFrame <= mCompletedFrameNumber)
+	{
+		mRetiredResources.pop_front();
+	}
+}
+
 RealDevice::RealDevice()
 {
 	BOOST_LOG_TRIVIAL(info) << "RealDevice::RealDevice";
@@ -364,6 +983,7 @@ RealDevice::~RealDevice()
 	{
 		return;
 	}
+	mMemoryAllocator.reset();
 	mDevice.destroyDescriptorPool(mDescriptorPool, nullptr);
 	mDevice.destroy();
 }
@@ -395,10 +1015,17 @@ RealTexture::~RealTexture()
 	if (mRealWindow != nullptr)
 	{
 		auto& device = mRealWindow->mRealDevice->mDevice;
+
+		//The image can't go away while an upload batch still references it.
+		if (mRealWindow->mUploadManager != nullptr)
+		{
+			mRealWindow->mUploadManager->Wait(mUploadSerial);
+		}
+
 		device.destroyImageView(mImageView, nullptr);
 		device.destroySampler(mSampler, nullptr);
 		device.destroyImage(mImage, nullptr);
-		device.freeMemory(mDeviceMemory, nullptr);
+		mRealWindow->mRealDevice->mMemoryAllocator->Free(mAllocation);
 	}
 
 }
@@ -416,7 +1043,7 @@ RealSurface::~RealSurface()
 	{
 		auto& device = mRealWindow->mRealDevice->mDevice;
 		device.destroyImage(mStagingImage, nullptr);
-		device.freeMemory(mStagingDeviceMemory, nullptr);
+		mRealWindow->mRealDevice->mMemoryAllocator->Free(mStagingAllocation);
 	}
 }
 
@@ -433,7 +1060,13 @@ RealVertexBuffer::~RealVertexBuffer()
 	{
 		auto& device = mRealWindow->mRealDevice->mDevice;
 		device.destroyBuffer(mBuffer, nullptr);
-		device.freeMemory(mMemory, nullptr);
+		mRealWindow->mRealDevice->mMemoryAllocator->Free(mAllocation);
+
+		for (auto& version : mRetiredVersions)
+		{
+			device.destroyBuffer(version.Buffer, nullptr);
+			mRealWindow->mRealDevice->mMemoryAllocator->Free(version.Allocation);
+		}
 	}
 }
 
@@ -450,10 +1083,80 @@ RealIndexBuffer::~RealIndexBuffer()
 	{
 		auto& device = mRealWindow->mRealDevice->mDevice;
 		device.destroyBuffer(mBuffer, nullptr);
-		device.freeMemory(mMemory, nullptr);
+		mRealWindow->mRealDevice->mMemoryAllocator->Free(mAllocation);
+
+		for (auto& version : mRetiredVersions)
+		{
+			device.destroyBuffer(version.Buffer, nullptr);
+			mRealWindow->mRealDevice->mMemoryAllocator->Free(version.Allocation);
+		}
 	}
 }
 
+SamplerRequest::SamplerRequest(RealWindow* realWindow, uint64_t key)
+	: Key(key),
+	mRealWindow(realWindow)
+{
+	uint32_t lodBias = (uint32_t)(key & 0xFFFFFFFF);
+	MipLodBias = bit_cast<float>(lodBias);
+	MagFilter = (D3DTEXTUREFILTERTYPE)((key >> 32) & 0xF);
+	MinFilter = (D3DTEXTUREFILTERTYPE)((key >> 36) & 0xF);
+	MipmapMode = (D3DTEXTUREFILTERTYPE)((key >> 40) & 0xF);
+	AddressModeU = (D3DTEXTUREADDRESS)((key >> 44) & 0x7);
+	AddressModeV = (D3DTEXTUREADDRESS)((key >> 47) & 0x7);
+	AddressModeW = (D3DTEXTUREADDRESS)((key >> 50) & 0x7);
+	MaxAnisotropy = (DWORD)((key >> 53) & 0x1F);
+	MaxLod = (float)((key >> 58) & 0x1F);
+}
+
+uint64_t SamplerRequest::GetStateKey(const boost::container::flat_map<D3DSAMPLERSTATETYPE, DWORD>& samplerStates)
+{
+	uint64_t key = 0;
+
+	for (const auto& pair : samplerStates)
+	{
+		uint64_t value = pair.second;
+		switch (pair.first)
+		{
+		case D3DSAMP_MIPMAPLODBIAS:
+			key |= (value & 0xFFFFFFFF); //The float bits as is.
+			break;
+		case D3DSAMP_MAGFILTER:
+			key |= ((value & 0xF) << 32);
+			break;
+		case D3DSAMP_MINFILTER:
+			key |= ((value & 0xF) << 36);
+			break;
+		case D3DSAMP_MIPFILTER:
+			key |= ((value & 0xF) << 40);
+			break;
+		case D3DSAMP_ADDRESSU:
+			key |= ((value & 0x7) << 44);
+			break;
+		case D3DSAMP_ADDRESSV:
+			key |= ((value & 0x7) << 47);
+			break;
+		case D3DSAMP_ADDRESSW:
+			key |= ((value & 0x7) << 50);
+			break;
+		case D3DSAMP_MAXANISOTROPY:
+			//No device goes past 16 so anything higher gets clamped by CreateSampler anyway.
+			key |= (((value > 0x1F) ? 0x1F : value) << 53);
+			break;
+		default:
+			break;
+		}
+	}
+
+	return key;
+}
+
+uint64_t SamplerRequest::GetKey(uint64_t stateKey, DWORD levels)
+{
+	uint64_t maxLod = (levels > 0x1F) ? 0x1F : levels;
+	return stateKey | (maxLod << 58);
+}
+
 SamplerRequest::~SamplerRequest()
 {
 	if (mRealWindow != nullptr)
@@ -478,6 +1181,17 @@ DrawContext::~DrawContext()
 	{
 		auto& device = mRealWindow->mRealDevice->mDevice;
 		device.destroyPipeline(Pipeline, nullptr);
+		device.destroyPipeline(OptimizedPipeline, nullptr);
+		if (DescriptorUpdateTemplate != vk::DescriptorUpdateTemplateKHR())
+		{
+			device.destroyDescriptorUpdateTemplateKHR(DescriptorUpdateTemplate, nullptr);
+		}
+
+		//Libraries built with the layout can't be linked into new pipelines once it is gone.
+		if (mRealWindow->mPipelineCompiler != nullptr)
+		{
+			mRealWindow->mPipelineCompiler->EvictLibraries(PipelineLayout);
+		}
 		device.destroyPipelineLayout(PipelineLayout, nullptr);
 		device.destroyDescriptorSetLayout(DescriptorSetLayout, nullptr);
 	}
@@ -495,7 +1209,18 @@ StateManager::~StateManager()
 
 void StateManager::DestroyWindow(size_t id)
 {
+	//Shaders still being converted use the window's device.
+	if (mShaderTranslator != nullptr)
+	{
+		mShaderTranslator->WaitIdle();
+	}
+
 	mWindows[id].reset();
+
+	if (mShaderDiskCache != nullptr)
+	{
+		mShaderDiskCache->Save();
+	}
 }
 
 void StateManager::CreateWindow1(size_t id, void* argument1, void* argument2)
@@ -727,7 +1452,6 @@ void StateManager::CreateWindow1(size_t id, void* argument1, void* argument2)
 
 	ptr->mSwapchainImages = new vk::Image[ptr->mSwapchainImageCount];
 	ptr->mSwapchainViews = new vk::ImageView[ptr->mSwapchainImageCount];
-	ptr->mSwapchainBuffers = new vk::CommandBuffer[ptr->mSwapchainImageCount];
 
 	result = device->mDevice.getSwapchainImagesKHR(ptr->mSwapchain, &ptr->mSwapchainImageCount, ptr->mSwapchainImages);
 	if (result != vk::Result::eSuccess)
@@ -736,41 +1460,104 @@ void StateManager::CreateWindow1(size_t id, void* argument1, void* argument2)
 		return;
 	}
 
-	for (size_t i = 0; i < ptr->mSwapchainImageCount; i++)
-	{
-		vk::ImageViewCreateInfo color_image_view;
-		color_image_view.format = ptr->mFormat;
-		color_image_view.components.r = vk::ComponentSwizzle::eIdentity;
-		color_image_view.components.g = vk::ComponentSwizzle::eIdentity;
-		color_image_view.components.b = vk::ComponentSwizzle::eIdentity;
-		color_image_view.components.a = vk::ComponentSwizzle::eIdentity;
-		color_image_view.subresourceRange.aspectMask = vk::ImageAspectFlagBits::eColor;
-		color_image_view.subresourceRange.baseMipLevel = 0;
-		color_image_view.subresourceRange.levelCount = 1;
-		color_image_view.subresourceRange.baseArrayLayer = 0;
-		color_image_view.subresourceRange.layerCount = 1;
-		color_image_view.viewType = vk::ImageViewType::e2D;
-		color_image_view.image = ptr->mSwapchainImages[i];
+	for (size_t i = 0; i < ptr->mSwapchainImageCount; i++)
+	{
+		vk::ImageViewCreateInfo color_image_view;
+		color_image_view.format = ptr->mFormat;
+		color_image_view.components.r = vk::ComponentSwizzle::eIdentity;
+		color_image_view.components.g = vk::ComponentSwizzle::eIdentity;
+		color_image_view.components.b = vk::ComponentSwizzle::eIdentity;
+		color_image_view.components.a = vk::ComponentSwizzle::eIdentity;
+		color_image_view.subresourceRange.aspectMask = vk::ImageAspectFlagBits::eColor;
+		color_image_view.subresourceRange.baseMipLevel = 0;
+		color_image_view.subresourceRange.levelCount = 1;
+		color_image_view.subresourceRange.baseArrayLayer = 0;
+		color_image_view.subresourceRange.layerCount = 1;
+		color_image_view.viewType = vk::ImageViewType::e2D;
+		color_image_view.image = ptr->mSwapchainImages[i];
+
+		result = device->mDevice.createImageView(&color_image_view, nullptr, &ptr->mSwapchainViews[i]);
+		if (result != vk::Result::eSuccess)
+		{
+			BOOST_LOG_TRIVIAL(fatal) << "CDevice9::CDevice9 vkCreateImageView failed with return code of " << GetResultString((VkResult)result);
+			return;
+		}
+	} //for
+
+	/*
+	Setup frames in flight.
+	The frame count is independent of the swapchain image count. Each frame gets its own command buffer and sync objects so recording frame N+1 only has to wait on the fence from the last time that frame slot was used.
+	*/
+	if (mOptions != nullptr && mOptions->count("FramesInFlight"))
+	{
+		ptr->mFrameCount = mOptions->at("FramesInFlight").as<uint32_t>();
+	}
+
+	if (ptr->mFrameCount < 1)
+	{
+		ptr->mFrameCount = 1;
+	}
+
+	if (mOptions != nullptr && mOptions->count("SamplerCacheSize"))
+	{
+		ptr->mSamplerCacheSize = mOptions->at("SamplerCacheSize").as<uint32_t>();
+	}
+
+	ptr->mFrameCommandBuffers = new vk::CommandBuffer[ptr->mFrameCount];
+	ptr->mFrameFences = new vk::Fence[ptr->mFrameCount];
+	ptr->mImageAvailableSemaphores = new vk::Semaphore[ptr->mFrameCount];
+	ptr->mRenderFinishedSemaphores = new vk::Semaphore[ptr->mFrameCount];
+
+	vk::CommandBufferAllocateInfo commandBufferInfo;
+	commandBufferInfo.commandPool = ptr->mCommandPool;
+	commandBufferInfo.level = vk::CommandBufferLevel::ePrimary;
+	commandBufferInfo.commandBufferCount = ptr->mFrameCount;
+
+	result = device->mDevice.allocateCommandBuffers(&commandBufferInfo, ptr->mFrameCommandBuffers);
+	if (result != vk::Result::eSuccess)
+	{
+		BOOST_LOG_TRIVIAL(fatal) << "StateManager::CreateWindow1 vkAllocateCommandBuffers failed with return code of " << GetResultString((VkResult)result);
+		return;
+	}
+
+	vk::FenceCreateInfo fenceCreateInfo;
+	fenceCreateInfo.flags = vk::FenceCreateFlagBits::eSignaled; //The first use of each frame shouldn't block.
 
-		result = device->mDevice.createImageView(&color_image_view, nullptr, &ptr->mSwapchainViews[i]);
+	for (size_t i = 0; i < ptr->mFrameCount; i++)
+	{
+		result = device->mDevice.createFence(&fenceCreateInfo, nullptr, &ptr->mFrameFences[i]);
 		if (result != vk::Result::eSuccess)
 		{
-			BOOST_LOG_TRIVIAL(fatal) << "CDevice9::CDevice9 vkCreateImageView failed with return code of " << GetResultString((VkResult)result);
+			BOOST_LOG_TRIVIAL(fatal) << "StateManager::CreateWindow1 vkCreateFence failed with return code of " << GetResultString((VkResult)result);
 			return;
 		}
 
-		vk::CommandBufferAllocateInfo commandBufferInfo;
-		commandBufferInfo.commandPool = ptr->mCommandPool;
-		commandBufferInfo.level = vk::CommandBufferLevel::ePrimary;
-		commandBufferInfo.commandBufferCount = 1;
+		result = device->mDevice.createSemaphore(&ptr->mPresentCompleteSemaphoreCreateInfo, nullptr, &ptr->mImageAvailableSemaphores[i]);
+		if (result != vk::Result::eSuccess)
+		{
+			BOOST_LOG_TRIVIAL(fatal) << "StateManager::CreateWindow1 vkCreateSemaphore failed with return code of " << GetResultString((VkResult)result);
+			return;
+		}
 
-		result = device->mDevice.allocateCommandBuffers(&commandBufferInfo, &ptr->mSwapchainBuffers[i]);
+		result = device->mDevice.createSemaphore(&ptr->mPresentCompleteSemaphoreCreateInfo, nullptr, &ptr->mRenderFinishedSemaphores[i]);
 		if (result != vk::Result::eSuccess)
 		{
-			BOOST_LOG_TRIVIAL(fatal) << "CDevice9::CDevice9 vkAllocateCommandBuffers failed with return code of " << GetResultString((VkResult)result);
+			BOOST_LOG_TRIVIAL(fatal) << "StateManager::CreateWindow1 vkCreateSemaphore failed with return code of " << GetResultString((VkResult)result);
 			return;
 		}
-	} //for
+	}
+
+	/*
+	Texture uploads and layout transitions are recorded into batches submitted ahead of each frame.
+	One more batch than frames in flight lets the CPU keep recording while the GPU works.
+	*/
+	uint32_t uploadRingSize = 16777216;
+	if (mOptions != nullptr && mOptions->count("UploadRingSize"))
+	{
+		uploadRingSize = mOptions->at("UploadRingSize").as<uint32_t>();
+	}
+
+	ptr->mUploadManager.reset(new UploadManager(ptr->mRealDevice->mDevice, ptr->mQueue, ptr->mCommandPool, (*ptr->mRealDevice->mMemoryAllocator), uploadRingSize, ptr->mFrameCount + 1));
 
 	/*
 	Setup Depth stuff.
@@ -796,21 +1583,14 @@ void StateManager::CreateWindow1(size_t id, void* argument1, void* argument2)
 	vk::MemoryRequirements memoryRequirements;
 	device->mDevice.getImageMemoryRequirements(ptr->mDepthImage, &memoryRequirements);
 
-	vk::MemoryAllocateInfo depthMemoryAllocateInfo;
-	depthMemoryAllocateInfo.memoryTypeIndex = 0;
-	depthMemoryAllocateInfo.allocationSize = memoryRequirements.size;
-
-	GetMemoryTypeFromProperties(device->mPhysicalDeviceMemoryProperties, memoryRequirements.memoryTypeBits, 0, &depthMemoryAllocateInfo.memoryTypeIndex);
-
-	result = device->mDevice.allocateMemory(&depthMemoryAllocateInfo, nullptr, &ptr->mDepthDeviceMemory);
-	if (result != vk::Result::eSuccess)
+	if (!device->mMemoryAllocator->Allocate(memoryRequirements, vk::MemoryPropertyFlags(), false, ptr->mDepthAllocation))
 	{
-		BOOST_LOG_TRIVIAL(fatal) << "StateManager::CreateWindow1 vkAllocateMemory failed with return code of " << GetResultString((VkResult)result);
+		BOOST_LOG_TRIVIAL(fatal) << "StateManager::CreateWindow1 failed to allocate depth buffer memory.";
 		return;
 	}
 
 	//c++ version doesn't return a result code.... I don't think I like that.
-	device->mDevice.bindImageMemory(ptr->mDepthImage, ptr->mDepthDeviceMemory, 0);
+	device->mDevice.bindImageMemory(ptr->mDepthImage, ptr->mDepthAllocation.Memory, ptr->mDepthAllocation.Offset);
 
 	ptr->SetImageLayout(ptr->mDepthImage, vk::ImageAspectFlagBits::eDepth, vk::ImageLayout::eUndefined, vk::ImageLayout::eDepthStencilAttachmentOptimal);
 
@@ -923,44 +1703,13 @@ void StateManager::CreateWindow1(size_t id, void* argument1, void* argument2)
 		}
 	}
 
-	result = device->mDevice.createSemaphore(&ptr->mPresentCompleteSemaphoreCreateInfo, nullptr, &ptr->mPresentCompleteSemaphore);
-	if (result != vk::Result::eSuccess)
-	{
-		BOOST_LOG_TRIVIAL(fatal) << "StateManager::CreateWindow1 vkCreateSemaphore failed with return code of " << GetResultString((VkResult)result);
-		return;
-	}
-
 	ptr->mPresentInfo.swapchainCount = 1;
 	ptr->mPresentInfo.pSwapchains = &ptr->mSwapchain;
 	ptr->mCommandBufferInheritanceInfo.subpass = 0;
 	ptr->mCommandBufferInheritanceInfo.occlusionQueryEnable = VK_FALSE;
 	ptr->mCommandBufferBeginInfo.pInheritanceInfo = &ptr->mCommandBufferInheritanceInfo;
 
-	for (int32_t i = 0; i < 16; i++)
-	{
-		ptr->mDeviceState.mSamplerStates[i][D3DSAMP_ADDRESSU] = D3DTADDRESS_WRAP;
-		ptr->mDeviceState.mSamplerStates[i][D3DSAMP_ADDRESSV] = D3DTADDRESS_WRAP;
-		ptr->mDeviceState.mSamplerStates[i][D3DSAMP_ADDRESSW] = D3DTADDRESS_WRAP;
-		ptr->mDeviceState.mSamplerStates[i][D3DSAMP_BORDERCOLOR] = 0;
-		ptr->mDeviceState.mSamplerStates[i][D3DSAMP_MAGFILTER] = D3DTEXF_POINT;
-		ptr->mDeviceState.mSamplerStates[i][D3DSAMP_MINFILTER] = D3DTEXF_POINT;
-		ptr->mDeviceState.mSamplerStates[i][D3DSAMP_MIPFILTER] = D3DTEXF_NONE;
-		ptr->mDeviceState.mSamplerStates[i][D3DSAMP_MIPMAPLODBIAS] = 0;
-		ptr->mDeviceState.mSamplerStates[i][D3DSAMP_MAXMIPLEVEL] = 0;
-		ptr->mDeviceState.mSamplerStates[i][D3DSAMP_MAXANISOTROPY] = 1;
-		ptr->mDeviceState.mSamplerStates[i][D3DSAMP_SRGBTEXTURE] = 0;
-		ptr->mDeviceState.mSamplerStates[i][D3DSAMP_ELEMENTINDEX] = 0;
-		ptr->mDeviceState.mSamplerStates[i][D3DSAMP_DMAPOFFSET] = 0;
-	}
-
-	//Changed default state because -1 is used to indicate that it has not been set but actual state should be defaulted.
-	ptr->mDeviceState.mFVF = D3DFVF_XYZ | D3DFVF_DIFFUSE;
-
-	Light light = {};
-	ptr->mDeviceState.mLights.push_back(light);
-	//mDeviceState.mLights.push_back(light);
-	//mDeviceState.mLights.push_back(light);
-	//mDeviceState.mLights.push_back(light);
+	ptr->mDeviceState.SetDefaults();
 
 	//Load fixed function shaders.
 	ptr->mVertShaderModule_XYZ_DIFFUSE = LoadShaderFromFile(device->mDevice, "VertexBuffer_XYZ_DIFFUSE.vert.spv");
@@ -1009,6 +1758,28 @@ void StateManager::CreateWindow1(size_t id, void* argument1, void* argument2)
 	ptr->mDynamicStateEnables[ptr->mPipelineDynamicStateCreateInfo.dynamicStateCount++] = vk::DynamicState::eViewport;
 	ptr->mDynamicStateEnables[ptr->mPipelineDynamicStateCreateInfo.dynamicStateCount++] = vk::DynamicState::eScissor;
 	ptr->mDynamicStateEnables[ptr->mPipelineDynamicStateCreateInfo.dynamicStateCount++] = vk::DynamicState::eDepthBias;
+	ptr->mDynamicStateEnables[ptr->mPipelineDynamicStateCreateInfo.dynamicStateCount++] = vk::DynamicState::eBlendConstants;
+	ptr->mDynamicStateEnables[ptr->mPipelineDynamicStateCreateInfo.dynamicStateCount++] = vk::DynamicState::eStencilCompareMask;
+	ptr->mDynamicStateEnables[ptr->mPipelineDynamicStateCreateInfo.dynamicStateCount++] = vk::DynamicState::eStencilWriteMask;
+	ptr->mDynamicStateEnables[ptr->mPipelineDynamicStateCreateInfo.dynamicStateCount++] = vk::DynamicState::eStencilReference;
+
+	//Without the extensions these stay in the pipeline and in the pipeline key.
+	if (device->mHasExtendedDynamicState)
+	{
+		ptr->mDynamicStateEnables[ptr->mPipelineDynamicStateCreateInfo.dynamicStateCount++] = (vk::DynamicState)VK_DYNAMIC_STATE_CULL_MODE_EXT;
+		ptr->mDynamicStateEnables[ptr->mPipelineDynamicStateCreateInfo.dynamicStateCount++] = (vk::DynamicState)VK_DYNAMIC_STATE_FRONT_FACE_EXT;
+		ptr->mDynamicStateEnables[ptr->mPipelineDynamicStateCreateInfo.dynamicStateCount++] = (vk::DynamicState)VK_DYNAMIC_STATE_PRIMITIVE_TOPOLOGY_EXT;
+		ptr->mDynamicStateEnables[ptr->mPipelineDynamicStateCreateInfo.dynamicStateCount++] = (vk::DynamicState)VK_DYNAMIC_STATE_DEPTH_TEST_ENABLE_EXT;
+		ptr->mDynamicStateEnables[ptr->mPipelineDynamicStateCreateInfo.dynamicStateCount++] = (vk::DynamicState)VK_DYNAMIC_STATE_DEPTH_WRITE_ENABLE_EXT;
+		ptr->mDynamicStateEnables[ptr->mPipelineDynamicStateCreateInfo.dynamicStateCount++] = (vk::DynamicState)VK_DYNAMIC_STATE_DEPTH_COMPARE_OP_EXT;
+		ptr->mDynamicStateEnables[ptr->mPipelineDynamicStateCreateInfo.dynamicStateCount++] = (vk::DynamicState)VK_DYNAMIC_STATE_STENCIL_TEST_ENABLE_EXT;
+		ptr->mDynamicStateEnables[ptr->mPipelineDynamicStateCreateInfo.dynamicStateCount++] = (vk::DynamicState)VK_DYNAMIC_STATE_STENCIL_OP_EXT;
+	}
+
+	if (device->mHasExtendedDynamicState2)
+	{
+		ptr->mDynamicStateEnables[ptr->mPipelineDynamicStateCreateInfo.dynamicStateCount++] = (vk::DynamicState)VK_DYNAMIC_STATE_DEPTH_BIAS_ENABLE_EXT;
+	}
 	ptr->mPipelineDynamicStateCreateInfo.pDynamicStates = ptr->mDynamicStateEnables;
 
 	ptr->mPipelineRasterizationStateCreateInfo.polygonMode = vk::PolygonMode::eFill;
@@ -1092,13 +1863,66 @@ void StateManager::CreateWindow1(size_t id, void* argument1, void* argument2)
 	ptr->mGraphicsPipelineCreateInfo.pDynamicState = &ptr->mPipelineDynamicStateCreateInfo;
 	ptr->mGraphicsPipelineCreateInfo.stageCount = 2;
 
-	result = device->mDevice.createPipelineCache(&ptr->mPipelineCacheCreateInfo, nullptr, &ptr->mPipelineCache);
-	if (result != vk::Result::eSuccess)
+	//Pipelines from previous runs are loaded up front so they don't have to be compiled again.
+	if (mOptions != nullptr && mOptions->count("PipelineCacheFile"))
+	{
+		ptr->mPipelineCachePath = mOptions->at("PipelineCacheFile").as<std::string>();
+	}
+
+	//Each GPU gets its own file so a machine with more than one doesn't keep replacing the other's cache. (VK9.cache becomes VK9.10de-1b80.cache)
+	if (!ptr->mPipelineCachePath.empty())
+	{
+		auto& properties = device->mPhysicalDeviceProperties;
+		std::string deviceSuffix = (boost::format(".%04x-%04x") % properties.vendorID % properties.deviceID).str();
+
+		size_t extension = ptr->mPipelineCachePath.find_last_of('.');
+		size_t directory = ptr->mPipelineCachePath.find_last_of("/\\");
+		if (extension == std::string::npos || (directory != std::string::npos && extension < directory))
+		{
+			extension = ptr->mPipelineCachePath.size();
+		}
+
+		ptr->mPipelineCachePath.insert(extension, deviceSuffix);
+	}
+
+	if (mOptions != nullptr && mOptions->count("PipelineCacheSaveInterval"))
+	{
+		ptr->mPipelineCacheSaveInterval = mOptions->at("PipelineCacheSaveInterval").as<uint32_t>();
+	}
+
+	ptr->LoadPipelineCache();
+	if (ptr->mPipelineCache == VK_NULL_HANDLE)
 	{
-		BOOST_LOG_TRIVIAL(fatal) << "StateManager::CreateWindow1 vkCreatePipelineCache failed with return code of " << GetResultString((VkResult)result);
 		return;
 	}
 
+	//Pipelines are compiled off of the command stream thread so a new state combination doesn't stall every draw behind it.
+	uint32_t pipelineCompileThreads = 0;
+	PipelineCompilePolicy pipelineCompilePolicy = PipelineCompilePolicy_Wait;
+
+	if (mOptions != nullptr && mOptions->count("PipelineCompileThreads"))
+	{
+		pipelineCompileThreads = mOptions->at("PipelineCompileThreads").as<uint32_t>();
+	}
+
+	if (mOptions != nullptr && mOptions->count("PipelineCompilePolicy"))
+	{
+		pipelineCompilePolicy = ConvertPipelineCompilePolicy(mOptions->at("PipelineCompilePolicy").as<std::string>());
+	}
+
+	ptr->mPipelineCompiler.reset(new PipelineCompiler(ptr->mRealDevice->mDevice, ptr->mPipelineCache, pipelineCompileThreads, pipelineCompilePolicy));
+
+	//Linked pipelines are only worth optimizing when there is a thread to do it on.
+	if (ptr->mRealDevice->mHasGraphicsPipelineLibrary)
+	{
+		ptr->mPipelineCompiler->mUsePipelineLibraries = true;
+
+		if (mOptions != nullptr && mOptions->count("OptimizeLinkedPipelines"))
+		{
+			ptr->mPipelineCompiler->mOptimizeLinkedPipelines = (mOptions->at("OptimizeLinkedPipelines").as<bool>() && pipelineCompileThreads > 0);
+		}
+	}
+
 	/*
 	Setup the texture to be written into the descriptor set.
 	*/
@@ -1122,10 +1946,6 @@ void StateManager::CreateWindow1(size_t id, void* argument1, void* argument2)
 	//imageCreateInfo2.flags = 0;
 	imageCreateInfo2.initialLayout = vk::ImageLayout::ePreinitialized;
 
-	vk::MemoryAllocateInfo memoryAllocateInfo;
-	memoryAllocateInfo.allocationSize = 0;
-	memoryAllocateInfo.memoryTypeIndex = 0;
-
 	vk::MemoryRequirements memoryRequirements2;
 
 	result = device->mDevice.createImage(&imageCreateInfo2, nullptr, &ptr->mImage);
@@ -1136,17 +1956,14 @@ void StateManager::CreateWindow1(size_t id, void* argument1, void* argument2)
 	}
 
 	device->mDevice.getImageMemoryRequirements(ptr->mImage, &memoryRequirements2);
-	memoryAllocateInfo.allocationSize = memoryRequirements2.size;
-	GetMemoryTypeFromProperties(device->mPhysicalDeviceMemoryProperties, memoryRequirements2.memoryTypeBits, vk::MemoryPropertyFlagBits::eHostVisible, &memoryAllocateInfo.memoryTypeIndex);
 
-	result = device->mDevice.allocateMemory(&memoryAllocateInfo, nullptr, &ptr->mDeviceMemory);
-	if (result != vk::Result::eSuccess)
+	if (!device->mMemoryAllocator->Allocate(memoryRequirements2, vk::MemoryPropertyFlagBits::eHostVisible, true, ptr->mImageAllocation))
 	{
-		BOOST_LOG_TRIVIAL(fatal) << "StateManager::CreateWindow1 vkAllocateMemory failed with return code of " << GetResultString((VkResult)result);
+		BOOST_LOG_TRIVIAL(fatal) << "StateManager::CreateWindow1 failed to allocate image memory.";
 		return;
 	}
 
-	device->mDevice.bindImageMemory(ptr->mImage, ptr->mDeviceMemory, 0);
+	device->mDevice.bindImageMemory(ptr->mImage, ptr->mImageAllocation.Memory, ptr->mImageAllocation.Offset);
 
 	vk::ImageSubresource imageSubresource;
 	imageSubresource.aspectMask = vk::ImageAspectFlagBits::eColor;
@@ -1160,10 +1977,10 @@ void StateManager::CreateWindow1(size_t id, void* argument1, void* argument2)
 
 	device->mDevice.getImageSubresourceLayout(ptr->mImage, &imageSubresource, &subresourceLayout);
 
-	data = device->mDevice.mapMemory(ptr->mDeviceMemory, 0, memoryAllocateInfo.allocationSize, vk::MemoryMapFlags()).value;
+	data = ptr->mImageAllocation.Data;
 	if (data == nullptr)
 	{
-		BOOST_LOG_TRIVIAL(fatal) << "StateManager::CreateWindow1 vkMapMemory failed.";
+		BOOST_LOG_TRIVIAL(fatal) << "StateManager::CreateWindow1 image memory is not mapped.";
 		return;
 	}
 
@@ -1176,7 +1993,6 @@ void StateManager::CreateWindow1(size_t id, void* argument1, void* argument2)
 		}
 	}
 
-	device->mDevice.unmapMemory(ptr->mDeviceMemory);
 	ptr->mImageLayout = vk::ImageLayout::eShaderReadOnlyOptimal;
 	ptr->SetImageLayout(ptr->mImage, vk::ImageAspectFlagBits::eColor, vk::ImageLayout::ePreinitialized, ptr->mImageLayout);
 
@@ -1243,12 +2059,19 @@ void StateManager::CreateWindow1(size_t id, void* argument1, void* argument2)
 	ptr->mWriteDescriptorSet[1].descriptorCount = 1;
 	ptr->mWriteDescriptorSet[1].pBufferInfo = &ptr->mDescriptorBufferInfo[1];
 
-	//mWriteDescriptorSet[2].dstSet = descriptorSet;
-	ptr->mWriteDescriptorSet[2].dstBinding = 2;
+	//The render state block comes before the textures so it is still pushed when there aren't any.
+	ptr->mWriteDescriptorSet[2].dstBinding = 3;
 	ptr->mWriteDescriptorSet[2].dstArrayElement = 0;
-	ptr->mWriteDescriptorSet[2].descriptorType = vk::DescriptorType::eCombinedImageSampler;
+	ptr->mWriteDescriptorSet[2].descriptorType = vk::DescriptorType::eUniformBuffer;
 	ptr->mWriteDescriptorSet[2].descriptorCount = 1;
-	ptr->mWriteDescriptorSet[2].pImageInfo = ptr->mDeviceState.mDescriptorImageInfo;
+	ptr->mWriteDescriptorSet[2].pBufferInfo = &ptr->mDescriptorBufferInfo[3];
+
+	//mWriteDescriptorSet[3].dstSet = descriptorSet;
+	ptr->mWriteDescriptorSet[3].dstBinding = 2;
+	ptr->mWriteDescriptorSet[3].dstArrayElement = 0;
+	ptr->mWriteDescriptorSet[3].descriptorType = vk::DescriptorType::eCombinedImageSampler;
+	ptr->mWriteDescriptorSet[3].descriptorCount = 1;
+	ptr->mWriteDescriptorSet[3].pImageInfo = ptr->mDeviceState.mDescriptorImageInfo;
 
 	ptr->mCommandBufferAllocateInfo.level = vk::CommandBufferLevel::ePrimary;
 	ptr->mCommandBufferAllocateInfo.commandPool = ptr->mCommandPool;
@@ -1261,9 +2084,90 @@ void StateManager::CreateWindow1(size_t id, void* argument1, void* argument2)
 	ptr->mSubmitInfo.commandBufferCount = 1;
 	ptr->mSubmitInfo.pCommandBuffers = &ptr->mCommandBuffer;
 
-	//revisit - light should be sized dynamically. Really more that 4 lights is stupid but this limit isn't correct behavior.
-	ptr->CreateBuffer(sizeof(Light) * 4, vk::BufferUsageFlagBits::eTransferDst | vk::BufferUsageFlagBits::eUniformBuffer, vk::MemoryPropertyFlagBits::eDeviceLocal, ptr->mLightBuffer, ptr->mLightBufferMemory);
-	ptr->CreateBuffer(sizeof(D3DMATERIAL9), vk::BufferUsageFlagBits::eTransferDst | vk::BufferUsageFlagBits::eUniformBuffer, vk::MemoryPropertyFlagBits::eDeviceLocal, ptr->mMaterialBuffer, ptr->mMaterialBufferMemory);
+	/*
+	Setup the fixed function arena.
+	Light & material blocks are copied into the current frame's region by the CPU so changing them between draws never has to leave the render pass.
+	The frame fence guarantees the GPU is done with a frame's region before StartScene rewinds it.
+	*/
+	{
+		ptr->mFixedFunctionArenaSize = 262144;
+		if (mOptions != nullptr && mOptions->count("FixedFunctionArenaSize"))
+		{
+			ptr->mFixedFunctionArenaSize = mOptions->at("FixedFunctionArenaSize").as<uint32_t>();
+		}
+
+		//There has to be room for at least one light array, material & render state block or nothing could be drawn.
+		vk::DeviceSize alignment = device->mPhysicalDeviceProperties.limits.minUniformBufferOffsetAlignment;
+		vk::DeviceSize minimumSize = ((sizeof(Light) * 8 + alignment - 1) / alignment) * alignment + ((sizeof(D3DMATERIAL9) + alignment - 1) / alignment) * alignment + ((sizeof(RenderStateConstants) + alignment - 1) / alignment) * alignment;
+		if (ptr->mFixedFunctionArenaSize < minimumSize)
+		{
+			ptr->mFixedFunctionArenaSize = minimumSize;
+		}
+		ptr->mFixedFunctionArenaSize = ((ptr->mFixedFunctionArenaSize + alignment - 1) / alignment) * alignment;
+
+		if (!ptr->CreateFrameRing(ptr->mFixedFunctionArenaSize, ptr->mFixedFunctionBuffer, ptr->mFixedFunctionBufferAllocation))
+		{
+			return;
+		}
+
+		ptr->mFixedFunctionBufferData = ptr->mFixedFunctionBufferAllocation.Data;
+		ptr->mLightBufferInfo.buffer = ptr->mFixedFunctionBuffer;
+		ptr->mMaterialBufferInfo.buffer = ptr->mFixedFunctionBuffer;
+		ptr->mRenderStateBufferInfo.buffer = ptr->mFixedFunctionBuffer;
+	}
+
+	/*
+	Setup the shader constant ring.
+	Each draw that changes shader constants copies the block into the next slot of the current frame and binds it with a dynamic offset.
+	The frame fence guarantees the GPU is done with a frame's slots before StartScene hands them out again.
+	*/
+	if (mUseShaderConstantBuffer)
+	{
+		vk::DeviceSize alignment = device->mPhysicalDeviceProperties.limits.minUniformBufferOffsetAlignment;
+
+		ptr->mShaderConstantSlotSize = ((sizeof(ShaderConstantSlots) + alignment - 1) / alignment) * alignment;
+		ptr->mShaderConstantSlotCount = 1024;
+		if (mOptions != nullptr && mOptions->count("ShaderConstantRingSize"))
+		{
+			ptr->mShaderConstantSlotCount = mOptions->at("ShaderConstantRingSize").as<uint32_t>();
+		}
+
+		//A draw can need a slot for both stages at once.
+		if (ptr->mShaderConstantSlotCount < 2)
+		{
+			ptr->mShaderConstantSlotCount = 2;
+		}
+
+		//Set 1 holds the vertex constants at binding 0 and the pixel constants at binding 1.
+		vk::DescriptorSetLayoutBinding constantBindings[2];
+		constantBindings[0].binding = 0;
+		constantBindings[0].descriptorType = vk::DescriptorType::eUniformBufferDynamic;
+		constantBindings[0].descriptorCount = 1;
+		constantBindings[0].stageFlags = vk::ShaderStageFlagBits::eVertex;
+		constantBindings[0].pImmutableSamplers = nullptr;
+
+		constantBindings[1].binding = 1;
+		constantBindings[1].descriptorType = vk::DescriptorType::eUniformBufferDynamic;
+		constantBindings[1].descriptorCount = 1;
+		constantBindings[1].stageFlags = vk::ShaderStageFlagBits::eFragment;
+		constantBindings[1].pImmutableSamplers = nullptr;
+
+		vk::DescriptorSetLayoutCreateInfo constantLayoutCreateInfo;
+		constantLayoutCreateInfo.bindingCount = 2;
+		constantLayoutCreateInfo.pBindings = constantBindings;
+
+		result = device->mDevice.createDescriptorSetLayout(&constantLayoutCreateInfo, nullptr, &ptr->mShaderConstantDescriptorSetLayout);
+		if (result != vk::Result::eSuccess)
+		{
+			BOOST_LOG_TRIVIAL(fatal) << "StateManager::CreateWindow1 vkCreateDescriptorSetLayout failed with return code of " << GetResultString((VkResult)result);
+			return;
+		}
+
+		if (!ptr->CreateShaderConstantRing())
+		{
+			return;
+		}
+	}
 }
 
 void StateManager::DestroyInstance(size_t id)
@@ -1275,6 +2179,37 @@ void StateManager::CreateInstance()
 {
 	auto ptr = std::make_shared<RealInstance>();
 
+	//Only the index is read here, shaders converted by previous runs are read as the game creates them.
+	if (mShaderDiskCache == nullptr)
+	{
+		std::string shaderCachePath = "VK9.shaders";
+		uint64_t shaderCacheSize = 67108864;
+
+		if (mOptions != nullptr && mOptions->count("ShaderCacheFile"))
+		{
+			shaderCachePath = mOptions->at("ShaderCacheFile").as<std::string>();
+		}
+
+		if (mOptions != nullptr && mOptions->count("ShaderCacheSize"))
+		{
+			shaderCacheSize = mOptions->at("ShaderCacheSize").as<uint32_t>();
+		}
+
+		mShaderDiskCache.reset(new ShaderDiskCache(shaderCachePath, shaderCacheSize));
+	}
+
+	if (mShaderTranslator == nullptr)
+	{
+		uint32_t shaderTranslationThreads = 4;
+
+		if (mOptions != nullptr && mOptions->count("ShaderTranslationThreads"))
+		{
+			shaderTranslationThreads = mOptions->at("ShaderTranslationThreads").as<uint32_t>();
+		}
+
+		mShaderTranslator.reset(new ShaderTranslator(shaderTranslationThreads, mShaderDiskCache.get()));
+	}
+
 	boost::container::small_vector<char*, 16> extensionNames;
 	boost::container::small_vector<char*, 16> layerNames;
 
@@ -1326,6 +2261,7 @@ void StateManager::CreateInstance()
 		pfn_vkCreateDebugReportCallbackEXT = reinterpret_cast<PFN_vkCreateDebugReportCallbackEXT>(ptr->mInstance.getProcAddr("vkCreateDebugReportCallbackEXT"));
 		pfn_vkDebugReportMessageEXT = reinterpret_cast<PFN_vkDebugReportMessageEXT>(ptr->mInstance.getProcAddr("vkDebugReportMessageEXT"));
 		pfn_vkDestroyDebugReportCallbackEXT = reinterpret_cast<PFN_vkDestroyDebugReportCallbackEXT>(ptr->mInstance.getProcAddr("vkDestroyDebugReportCallbackEXT"));
+		pfn_vkGetPhysicalDeviceFeatures2KHR = reinterpret_cast<PFN_vkGetPhysicalDeviceFeatures2KHR>(ptr->mInstance.getProcAddr("vkGetPhysicalDeviceFeatures2KHR"));
 
 #ifdef _DEBUG
 		vk::DebugReportCallbackCreateInfoEXT callbackCreateInfo = {};
@@ -1352,6 +2288,18 @@ void StateManager::CreateInstance()
 			ptr->mPhysicalDevices = new vk::PhysicalDevice[ptr->mPhysicalDeviceCount];
 			ptr->mInstance.enumeratePhysicalDevices(&ptr->mPhysicalDeviceCount, ptr->mPhysicalDevices);
 
+			vk::DeviceSize memoryBlockSize = 67108864;
+			if (mOptions != nullptr && mOptions->count("MemoryBlockSize"))
+			{
+				memoryBlockSize = mOptions->at("MemoryBlockSize").as<uint32_t>();
+			}
+
+			bool usePipelineLibraries = true;
+			if (mOptions != nullptr && mOptions->count("PipelineLibraries"))
+			{
+				usePipelineLibraries = mOptions->at("PipelineLibraries").as<bool>();
+			}
+
 			for (size_t i = 0; i < ptr->mPhysicalDeviceCount; i++)
 			{
 				auto& physicalDevice = ptr->mPhysicalDevices[i];
@@ -1378,6 +2326,101 @@ void StateManager::CreateInstance()
 				extensionNames.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
 				//extensionNames.push_back("VK_KHR_maintenance1");
 				extensionNames.push_back("VK_KHR_push_descriptor");
+
+				//Pushing descriptors with a template is optional so only ask for it if the driver has it.
+				uint32_t extensionPropertyCount = 0;
+				physicalDevice.enumerateDeviceExtensionProperties(nullptr, &extensionPropertyCount, nullptr);
+				std::vector<vk::ExtensionProperties> extensionProperties(extensionPropertyCount);
+				physicalDevice.enumerateDeviceExtensionProperties(nullptr, &extensionPropertyCount, extensionProperties.data());
+				bool hasPipelineLibrary = false;
+				for (const auto& extensionProperty : extensionProperties)
+				{
+					if (std::string(extensionProperty.extensionName) == "VK_KHR_descriptor_update_template")
+					{
+						extensionNames.push_back("VK_KHR_descriptor_update_template");
+						device->mHasDescriptorUpdateTemplate = true;
+					}
+					else if (std::string(extensionProperty.extensionName) == VK_EXT_EXTENDED_DYNAMIC_STATE_EXTENSION_NAME)
+					{
+						device->mHasExtendedDynamicState = true;
+					}
+					else if (std::string(extensionProperty.extensionName) == VK_EXT_EXTENDED_DYNAMIC_STATE_2_EXTENSION_NAME)
+					{
+						device->mHasExtendedDynamicState2 = true;
+					}
+					else if (std::string(extensionProperty.extensionName) == VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME)
+					{
+						hasPipelineLibrary = true;
+					}
+					else if (std::string(extensionProperty.extensionName) == VK_EXT_GRAPHICS_PIPELINE_LIBRARY_EXTENSION_NAME)
+					{
+						device->mHasGraphicsPipelineLibrary = true;
+					}
+				}
+
+				/*
+				Having the extended dynamic state & pipeline library extensions isn't enough, the features have to be there too.
+				The second dynamic state extension is only used on top of the first one.
+				*/
+				VkPhysicalDeviceExtendedDynamicStateFeaturesEXT extendedDynamicStateFeatures = {};
+				extendedDynamicStateFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTENDED_DYNAMIC_STATE_FEATURES_EXT;
+
+				VkPhysicalDeviceExtendedDynamicState2FeaturesEXT extendedDynamicState2Features = {};
+				extendedDynamicState2Features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTENDED_DYNAMIC_STATE_2_FEATURES_EXT;
+
+				VkPhysicalDeviceGraphicsPipelineLibraryFeaturesEXT graphicsPipelineLibraryFeatures = {};
+				graphicsPipelineLibraryFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_GRAPHICS_PIPELINE_LIBRARY_FEATURES_EXT;
+
+				if (!usePipelineLibraries)
+				{
+					device->mHasGraphicsPipelineLibrary = false;
+				}
+
+				if (pfn_vkGetPhysicalDeviceFeatures2KHR != nullptr)
+				{
+					VkPhysicalDeviceFeatures2KHR physicalDeviceFeatures2 = {};
+					physicalDeviceFeatures2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2_KHR;
+					physicalDeviceFeatures2.pNext = &extendedDynamicStateFeatures;
+					extendedDynamicStateFeatures.pNext = &extendedDynamicState2Features;
+					extendedDynamicState2Features.pNext = &graphicsPipelineLibraryFeatures;
+
+					//Drivers only fill in the structures of extensions they have so the rest stay zeroed.
+					vkGetPhysicalDeviceFeatures2KHR((VkPhysicalDevice)physicalDevice, &physicalDeviceFeatures2);
+				}
+
+				device->mHasExtendedDynamicState = (i == 0 && device->mHasExtendedDynamicState && extendedDynamicStateFeatures.extendedDynamicState == VK_TRUE); //The function pointers are only loaded for the first device.
+				device->mHasExtendedDynamicState2 = (device->mHasExtendedDynamicState && device->mHasExtendedDynamicState2 && extendedDynamicState2Features.extendedDynamicState2 == VK_TRUE);
+				device->mHasGraphicsPipelineLibrary = (device->mHasGraphicsPipelineLibrary && hasPipelineLibrary && graphicsPipelineLibraryFeatures.graphicsPipelineLibrary == VK_TRUE);
+
+				//Only the features that are used get enabled.
+				void* enabledFeatures = nullptr;
+				extendedDynamicStateFeatures.pNext = nullptr;
+				extendedDynamicState2Features.pNext = nullptr;
+				extendedDynamicState2Features.extendedDynamicState2LogicOp = VK_FALSE;
+				extendedDynamicState2Features.extendedDynamicState2PatchControlPoints = VK_FALSE;
+				graphicsPipelineLibraryFeatures.pNext = nullptr;
+
+				if (device->mHasGraphicsPipelineLibrary)
+				{
+					extensionNames.push_back(VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME);
+					extensionNames.push_back(VK_EXT_GRAPHICS_PIPELINE_LIBRARY_EXTENSION_NAME);
+					graphicsPipelineLibraryFeatures.pNext = enabledFeatures;
+					enabledFeatures = &graphicsPipelineLibraryFeatures;
+				}
+
+				if (device->mHasExtendedDynamicState2)
+				{
+					extensionNames.push_back(VK_EXT_EXTENDED_DYNAMIC_STATE_2_EXTENSION_NAME);
+					extendedDynamicState2Features.pNext = enabledFeatures;
+					enabledFeatures = &extendedDynamicState2Features;
+				}
+
+				if (device->mHasExtendedDynamicState)
+				{
+					extensionNames.push_back(VK_EXT_EXTENDED_DYNAMIC_STATE_EXTENSION_NAME);
+					extendedDynamicStateFeatures.pNext = enabledFeatures;
+					enabledFeatures = &extendedDynamicStateFeatures;
+				}
 				//extensionNames.push_back("VK_KHR_sampler_mirror_clamp_to_edge");
 #ifdef _DEBUG
 				layerNames.push_back("VK_LAYER_LUNARG_standard_validation");
@@ -1396,15 +2439,64 @@ void StateManager::CreateInstance()
 				device_info.enabledLayerCount = layerNames.size();
 				device_info.ppEnabledLayerNames = layerNames.data();
 				device_info.pEnabledFeatures = &device->mPhysicalDeviceFeatures; //Enable all available because we don't know ahead of time what features will be used.
+				device_info.pNext = enabledFeatures;
 
 				result = physicalDevice.createDevice(&device_info, nullptr, &device->mDevice);
 				if (result == vk::Result::eSuccess)
 				{
+					device->mMemoryAllocator.reset(new MemoryAllocator(device->mDevice, device->mPhysicalDeviceMemoryProperties, device->mPhysicalDeviceProperties.limits, memoryBlockSize));
+
 					if (!i)
 					{
 						pfn_vkCmdPushDescriptorSetKHR = reinterpret_cast<PFN_vkCmdPushDescriptorSetKHR>(device->mDevice.getProcAddr("vkCmdPushDescriptorSetKHR"));
+
+						if (device->mHasDescriptorUpdateTemplate)
+						{
+							pfn_vkCmdPushDescriptorSetWithTemplateKHR = reinterpret_cast<PFN_vkCmdPushDescriptorSetWithTemplateKHR>(device->mDevice.getProcAddr("vkCmdPushDescriptorSetWithTemplateKHR"));
+							pfn_vkCreateDescriptorUpdateTemplateKHR = reinterpret_cast<PFN_vkCreateDescriptorUpdateTemplateKHR>(device->mDevice.getProcAddr("vkCreateDescriptorUpdateTemplateKHR"));
+							pfn_vkDestroyDescriptorUpdateTemplateKHR = reinterpret_cast<PFN_vkDestroyDescriptorUpdateTemplateKHR>(device->mDevice.getProcAddr("vkDestroyDescriptorUpdateTemplateKHR"));
+						}
+					}
+
+					//The function pointers are only loaded for the first device so the others keep using the write path.
+					if (i || pfn_vkCmdPushDescriptorSetWithTemplateKHR == nullptr || pfn_vkCreateDescriptorUpdateTemplateKHR == nullptr || pfn_vkDestroyDescriptorUpdateTemplateKHR == nullptr)
+					{
+						device->mHasDescriptorUpdateTemplate = false;
+					}
+
+					if (device->mHasExtendedDynamicState)
+					{
+						pfn_vkCmdSetCullModeEXT = reinterpret_cast<PFN_vkCmdSetCullModeEXT>(device->mDevice.getProcAddr("vkCmdSetCullModeEXT"));
+						pfn_vkCmdSetFrontFaceEXT = reinterpret_cast<PFN_vkCmdSetFrontFaceEXT>(device->mDevice.getProcAddr("vkCmdSetFrontFaceEXT"));
+						pfn_vkCmdSetPrimitiveTopologyEXT = reinterpret_cast<PFN_vkCmdSetPrimitiveTopologyEXT>(device->mDevice.getProcAddr("vkCmdSetPrimitiveTopologyEXT"));
+						pfn_vkCmdSetDepthTestEnableEXT = reinterpret_cast<PFN_vkCmdSetDepthTestEnableEXT>(device->mDevice.getProcAddr("vkCmdSetDepthTestEnableEXT"));
+						pfn_vkCmdSetDepthWriteEnableEXT = reinterpret_cast<PFN_vkCmdSetDepthWriteEnableEXT>(device->mDevice.getProcAddr("vkCmdSetDepthWriteEnableEXT"));
+						pfn_vkCmdSetDepthCompareOpEXT = reinterpret_cast<PFN_vkCmdSetDepthCompareOpEXT>(device->mDevice.getProcAddr("vkCmdSetDepthCompareOpEXT"));
+						pfn_vkCmdSetStencilTestEnableEXT = reinterpret_cast<PFN_vkCmdSetStencilTestEnableEXT>(device->mDevice.getProcAddr("vkCmdSetStencilTestEnableEXT"));
+						pfn_vkCmdSetStencilOpEXT = reinterpret_cast<PFN_vkCmdSetStencilOpEXT>(device->mDevice.getProcAddr("vkCmdSetStencilOpEXT"));
+
+						if (pfn_vkCmdSetCullModeEXT == nullptr || pfn_vkCmdSetFrontFaceEXT == nullptr || pfn_vkCmdSetPrimitiveTopologyEXT == nullptr || pfn_vkCmdSetDepthTestEnableEXT == nullptr
+							|| pfn_vkCmdSetDepthWriteEnableEXT == nullptr || pfn_vkCmdSetDepthCompareOpEXT == nullptr || pfn_vkCmdSetStencilTestEnableEXT == nullptr || pfn_vkCmdSetStencilOpEXT == nullptr)
+						{
+							device->mHasExtendedDynamicState = false;
+							device->mHasExtendedDynamicState2 = false;
+						}
+					}
+
+					if (device->mHasExtendedDynamicState2)
+					{
+						pfn_vkCmdSetDepthBiasEnableEXT = reinterpret_cast<PFN_vkCmdSetDepthBiasEnableEXT>(device->mDevice.getProcAddr("vkCmdSetDepthBiasEnableEXT"));
+
+						if (pfn_vkCmdSetDepthBiasEnableEXT == nullptr)
+						{
+							device->mHasExtendedDynamicState2 = false;
+						}
 					}
 
+					BOOST_LOG_TRIVIAL(info) << "StateManager::CreateInstance descriptor update templates " << (device->mHasDescriptorUpdateTemplate ? "enabled" : "not available") << " for device " << i;
+					BOOST_LOG_TRIVIAL(info) << "StateManager::CreateInstance extended dynamic state " << (device->mHasExtendedDynamicState ? "enabled" : "not available") << (device->mHasExtendedDynamicState2 ? " (with depth bias enable)" : "") << " for device " << i;
+					BOOST_LOG_TRIVIAL(info) << "StateManager::CreateInstance graphics pipeline libraries " << (device->mHasGraphicsPipelineLibrary ? "enabled" : (usePipelineLibraries ? "not available" : "disabled")) << " for device " << i;
+
 					vk::DescriptorPoolSize descriptorPoolSizes[11] = {};
 					descriptorPoolSizes[0].type = vk::DescriptorType::eSampler; //VK_DESCRIPTOR_TYPE_SAMPLER;
 					descriptorPoolSizes[0].descriptorCount = min((uint32_t)MAX_DESCRIPTOR, device->mPhysicalDeviceProperties.limits.maxDescriptorSetSamplers);
@@ -1464,9 +2556,22 @@ void StateManager::CreateInstance()
 	}
 }
 
+/*
+Frames that are still on the GPU may read the resource so the window that owns it holds on to it until they finish.
+*/
+template<typename ResourceType>
+static void ReleaseResource(std::shared_ptr<ResourceType>& resource)
+{
+	if (resource != nullptr && resource->mRealWindow != nullptr)
+	{
+		resource->mRealWindow->RetireResource(resource);
+	}
+	resource.reset();
+}
+
 void StateManager::DestroyVertexBuffer(size_t id)
 {
-	mVertexBuffers[id].reset();
+	ReleaseResource(mVertexBuffers[id]);
 }
 
 void StateManager::CreateVertexBuffer(size_t id, void* argument1)
@@ -1481,9 +2586,7 @@ void StateManager::CreateVertexBuffer(size_t id, void* argument1)
 	bufferCreateInfo.usage = vk::BufferUsageFlagBits::eVertexBuffer;
 	//bufferCreateInfo.flags = 0;
 
-	vk::MemoryAllocateInfo memoryAllocateInfo;
-	memoryAllocateInfo.allocationSize = 0;
-	memoryAllocateInfo.memoryTypeIndex = 0;
+	ptr->mBufferCreateInfo = bufferCreateInfo;
 
 	result = window->mRealDevice->mDevice.createBuffer(&bufferCreateInfo, nullptr, &ptr->mBuffer);
 	if (result != vk::Result::eSuccess)
@@ -1494,18 +2597,13 @@ void StateManager::CreateVertexBuffer(size_t id, void* argument1)
 
 	ptr->mMemoryRequirements = window->mRealDevice->mDevice.getBufferMemoryRequirements(ptr->mBuffer);
 
-	memoryAllocateInfo.allocationSize = ptr->mMemoryRequirements.size;
-
-	GetMemoryTypeFromProperties(window->mRealDevice->mPhysicalDeviceMemoryProperties, ptr->mMemoryRequirements.memoryTypeBits, (vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent), &memoryAllocateInfo.memoryTypeIndex);
-
-	result = window->mRealDevice->mDevice.allocateMemory(&memoryAllocateInfo, nullptr, &ptr->mMemory);
-	if (result != vk::Result::eSuccess)
+	if (!window->mRealDevice->mMemoryAllocator->Allocate(ptr->mMemoryRequirements, (vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent), true, ptr->mAllocation))
 	{
-		BOOST_LOG_TRIVIAL(fatal) << "StateManager::CreateVertexBuffer vkAllocateMemory failed with return code of " << GetResultString((VkResult)result);
+		BOOST_LOG_TRIVIAL(fatal) << "StateManager::CreateVertexBuffer failed to allocate memory.";
 		return;
 	}
 
-	window->mRealDevice->mDevice.bindBufferMemory(ptr->mBuffer, ptr->mMemory, 0);
+	window->mRealDevice->mDevice.bindBufferMemory(ptr->mBuffer, ptr->mAllocation.Memory, ptr->mAllocation.Offset);
 
 	uint32_t attributeStride = 0;
 
@@ -1576,7 +2674,7 @@ void StateManager::CreateVertexBuffer(size_t id, void* argument1)
 
 void StateManager::DestroyIndexBuffer(size_t id)
 {
-	mIndexBuffers[id].reset();
+	ReleaseResource(mIndexBuffers[id]);
 }
 
 void StateManager::CreateIndexBuffer(size_t id, void* argument1)
@@ -1591,9 +2689,7 @@ void StateManager::CreateIndexBuffer(size_t id, void* argument1)
 	bufferCreateInfo.usage = vk::BufferUsageFlagBits::eIndexBuffer;
 	//bufferCreateInfo.flags = 0;
 
-	vk::MemoryAllocateInfo memoryAllocateInfo;
-	memoryAllocateInfo.allocationSize = 0;
-	memoryAllocateInfo.memoryTypeIndex = 0;
+	ptr->mBufferCreateInfo = bufferCreateInfo;
 
 	result = window->mRealDevice->mDevice.createBuffer(&bufferCreateInfo, nullptr, &ptr->mBuffer);
 	if (result != vk::Result::eSuccess)
@@ -1604,18 +2700,13 @@ void StateManager::CreateIndexBuffer(size_t id, void* argument1)
 
 	ptr->mMemoryRequirements = window->mRealDevice->mDevice.getBufferMemoryRequirements(ptr->mBuffer);
 
-	memoryAllocateInfo.allocationSize = ptr->mMemoryRequirements.size;
-
-	GetMemoryTypeFromProperties(window->mRealDevice->mPhysicalDeviceMemoryProperties, ptr->mMemoryRequirements.memoryTypeBits, (vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent), &memoryAllocateInfo.memoryTypeIndex);
-
-	result = window->mRealDevice->mDevice.allocateMemory(&memoryAllocateInfo, nullptr, &ptr->mMemory);
-	if (result != vk::Result::eSuccess)
+	if (!window->mRealDevice->mMemoryAllocator->Allocate(ptr->mMemoryRequirements, (vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent), true, ptr->mAllocation))
 	{
-		BOOST_LOG_TRIVIAL(fatal) << "StateManager::CreateIndexBuffer vkAllocateMemory failed with return code of " << GetResultString((VkResult)result);
+		BOOST_LOG_TRIVIAL(fatal) << "StateManager::CreateIndexBuffer failed to allocate memory.";
 		return;
 	}
 
-	window->mRealDevice->mDevice.bindBufferMemory(ptr->mBuffer, ptr->mMemory, 0);
+	window->mRealDevice->mDevice.bindBufferMemory(ptr->mBuffer, ptr->mAllocation.Memory, ptr->mAllocation.Offset);
 
 	switch (indexBuffer9->mFormat)
 	{
@@ -1639,7 +2730,7 @@ void StateManager::CreateIndexBuffer(size_t id, void* argument1)
 
 void StateManager::DestroyTexture(size_t id)
 {
-	mTextures[id].reset();
+	ReleaseResource(mTextures[id]);
 }
 
 void StateManager::CreateTexture(size_t id, void* argument1)
@@ -1679,24 +2770,13 @@ void StateManager::CreateTexture(size_t id, void* argument1)
 	vk::MemoryRequirements memoryRequirements;
 	device.getImageMemoryRequirements(ptr->mImage, &memoryRequirements);
 
-	//mMemoryAllocateInfo.allocationSize = 0;
-	ptr->mMemoryAllocateInfo.memoryTypeIndex = 0;
-	ptr->mMemoryAllocateInfo.allocationSize = memoryRequirements.size;
-
-	if (!GetMemoryTypeFromProperties(window->mRealDevice->mPhysicalDeviceMemoryProperties, memoryRequirements.memoryTypeBits, vk::MemoryPropertyFlagBits::eDeviceLocal, &ptr->mMemoryAllocateInfo.memoryTypeIndex))
-	{
-		BOOST_LOG_TRIVIAL(fatal) << "StateManager::CreateTexture Could not find memory type from properties.";
-		return;
-	}
-
-	result = device.allocateMemory(&ptr->mMemoryAllocateInfo, nullptr, &ptr->mDeviceMemory);
-	if (result != vk::Result::eSuccess)
+	if (!window->mRealDevice->mMemoryAllocator->Allocate(memoryRequirements, vk::MemoryPropertyFlagBits::eDeviceLocal, false, ptr->mAllocation))
 	{
-		BOOST_LOG_TRIVIAL(fatal) << "StateManager::CreateTexture vkAllocateMemory failed with return code of " << GetResultString((VkResult)result);
+		BOOST_LOG_TRIVIAL(fatal) << "StateManager::CreateTexture failed to allocate memory.";
 		return;
 	}
 
-	device.bindImageMemory(ptr->mImage, ptr->mDeviceMemory, 0);
+	device.bindImageMemory(ptr->mImage, ptr->mAllocation.Memory, ptr->mAllocation.Offset);
 
 	vk::ImageViewCreateInfo imageViewCreateInfo;
 	imageViewCreateInfo.image = ptr->mImage;
@@ -1737,7 +2817,7 @@ void StateManager::CreateTexture(size_t id, void* argument1)
 
 void StateManager::DestroyCubeTexture(size_t id)
 {
-	mTextures[id].reset();
+	ReleaseResource(mTextures[id]);
 }
 
 void StateManager::CreateCubeTexture(size_t id, void* argument1)
@@ -1783,24 +2863,13 @@ void StateManager::CreateCubeTexture(size_t id, void* argument1)
 	vk::MemoryRequirements memoryRequirements;
 	window->mRealDevice->mDevice.getImageMemoryRequirements(ptr->mImage, &memoryRequirements);
 
-	//mMemoryAllocateInfo.allocationSize = 0;
-	ptr->mMemoryAllocateInfo.memoryTypeIndex = 0;
-	ptr->mMemoryAllocateInfo.allocationSize = memoryRequirements.size;
-
-	if (!GetMemoryTypeFromProperties(window->mRealDevice->mPhysicalDeviceMemoryProperties, memoryRequirements.memoryTypeBits, vk::MemoryPropertyFlagBits::eDeviceLocal, &ptr->mMemoryAllocateInfo.memoryTypeIndex))
-	{
-		BOOST_LOG_TRIVIAL(fatal) << "StateManager::CreateCubeTexture Could not find memory type from properties.";
-		return;
-	}
-
-	result = device.allocateMemory(&ptr->mMemoryAllocateInfo, nullptr, &ptr->mDeviceMemory);
-	if (result != vk::Result::eSuccess)
+	if (!window->mRealDevice->mMemoryAllocator->Allocate(memoryRequirements, vk::MemoryPropertyFlagBits::eDeviceLocal, false, ptr->mAllocation))
 	{
-		BOOST_LOG_TRIVIAL(fatal) << "StateManager::CreateCubeTexture vkAllocateMemory failed with return code of " << GetResultString((VkResult)result);
+		BOOST_LOG_TRIVIAL(fatal) << "StateManager::CreateCubeTexture failed to allocate memory.";
 		return;
 	}
 
-	device.bindImageMemory(ptr->mImage, ptr->mDeviceMemory, 0);
+	device.bindImageMemory(ptr->mImage, ptr->mAllocation.Memory, ptr->mAllocation.Offset);
 
 	vk::ImageViewCreateInfo imageViewCreateInfo;
 	imageViewCreateInfo.image = ptr->mImage;
@@ -1840,7 +2909,7 @@ void StateManager::CreateCubeTexture(size_t id, void* argument1)
 
 void StateManager::DestroySurface(size_t id)
 {
-	mSurfaces[id].reset();
+	ReleaseResource(mSurfaces[id]);
 }
 
 void StateManager::CreateSurface(size_t id, void* argument1)
@@ -1905,24 +2974,13 @@ void StateManager::CreateSurface(size_t id, void* argument1)
 	vk::MemoryRequirements memoryRequirements;
 	window->mRealDevice->mDevice.getImageMemoryRequirements(ptr->mStagingImage, &memoryRequirements);
 
-	//mMemoryAllocateInfo.allocationSize = 0;
-	ptr->mMemoryAllocateInfo.memoryTypeIndex = 0;
-	ptr->mMemoryAllocateInfo.allocationSize = memoryRequirements.size;
-
-	if (!GetMemoryTypeFromProperties(window->mRealDevice->mPhysicalDeviceMemoryProperties, memoryRequirements.memoryTypeBits, vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent, &ptr->mMemoryAllocateInfo.memoryTypeIndex))
+	if (!window->mRealDevice->mMemoryAllocator->Allocate(memoryRequirements, vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent, true, ptr->mStagingAllocation))
 	{
-		BOOST_LOG_TRIVIAL(fatal) << "StateManager::CreateSurface Could not find memory type from properties.";
+		BOOST_LOG_TRIVIAL(fatal) << "StateManager::CreateSurface failed to allocate memory.";
 		return;
 	}
 
-	result = window->mRealDevice->mDevice.allocateMemory(&ptr->mMemoryAllocateInfo, nullptr, &ptr->mStagingDeviceMemory);
-	if (result != vk::Result::eSuccess)
-	{
-		BOOST_LOG_TRIVIAL(fatal) << "StateManager::CreateSurface vkAllocateMemory failed with return code of " << GetResultString((VkResult)result);
-		return;
-	}
-
-	window->mRealDevice->mDevice.bindImageMemory(ptr->mStagingImage, ptr->mStagingDeviceMemory, 0);
+	window->mRealDevice->mDevice.bindImageMemory(ptr->mStagingImage, ptr->mStagingAllocation.Memory, ptr->mStagingAllocation.Offset);
 
 	ptr->mSubresource.mipLevel = 0;
 	ptr->mSubresource.aspectMask = vk::ImageAspectFlagBits::eColor;
@@ -1933,9 +2991,50 @@ void StateManager::CreateSurface(size_t id, void* argument1)
 	mSurfaces.push_back(ptr);
 }
 
+/*
+Draw contexts hold on to their converters so a module stays alive while a pipeline using it is compiled and nothing has to wait here.
+*/
 void StateManager::DestroyShader(size_t id)
 {
-	mShaderConverters[id].reset();
+	auto& converter = mShaderConverters[id];
+	if (converter == nullptr)
+	{
+		return;
+	}
+
+	uint64_t hash = converter->mHash;
+	uint64_t diskKey = converter->mDiskKey;
+	std::weak_ptr<ShaderConverter> lastReference = converter;
+	converter.reset();
+
+	//Once the last shader & draw context sharing the converter are gone the module is destroyed with it so the cache entry is dead.
+	for (auto& window : mWindows)
+	{
+		if (window == nullptr)
+		{
+			continue;
+		}
+
+		//A new shader with the same key would build the same libraries but there is no telling if it ever comes back.
+		//While draw contexts still hold the converter its libraries are evicted along with the layouts they were built with.
+		if (lastReference.expired() && window->mPipelineCompiler != nullptr)
+		{
+			window->mPipelineCompiler->EvictShaderLibraries(diskKey);
+		}
+
+		auto range = window->mShaderCache.equal_range(hash);
+		for (auto entry = range.first; entry != range.second;)
+		{
+			if (entry->second.expired())
+			{
+				entry = window->mShaderCache.erase(entry);
+			}
+			else
+			{
+				++entry;
+			}
+		}
+	}
 }
 
 void StateManager::CreateShader(size_t id, void* argument1, void* argument2, void* argument3)
@@ -1944,21 +3043,62 @@ void StateManager::CreateShader(size_t id, void* argument1, void* argument2, voi
 	auto window = mWindows[id];
 	DWORD* pFunction = (DWORD*)(argument1);
 	bool isVertex = (bool)(argument2);
-	size_t* size = (size_t*)(argument3);
+	size_t tokenCount = ((size_t)(argument3)) / sizeof(DWORD);
+	auto& deviceState = window->mDeviceState;
 
-	if (isVertex)
+	//The definitions are written straight into the slots so the incremental hash and the upload size have to be redone.
+	auto applyConstantDefinitions = [&deviceState, isVertex](const ShaderConverter& converter)
 	{
-		std::shared_ptr<ShaderConverter> ptr = std::make_shared<ShaderConverter>(window->mRealDevice->mDevice, window->mDeviceState.mVertexShaderConstantSlots);
-		ptr->Convert((uint32_t*)pFunction);
-		(*size) = ptr->mConvertedShader.Size;
-		mShaderConverters.push_back(ptr);
-	}
-	else
+		if (converter.mConstantDefinitions.empty())
+		{
+			return;
+		}
+
+		if (isVertex)
+		{
+			converter.ApplyConstantDefinitions(deviceState.mVertexShaderConstantSlots);
+			deviceState.mAreVertexShaderConstantsDirty = true;
+			deviceState.mVertexShaderConstantsSize = sizeof(ShaderConstantSlots);
+		}
+		else
+		{
+			converter.ApplyConstantDefinitions(deviceState.mPixelShaderConstantSlots);
+			deviceState.mArePixelShaderConstantsDirty = true;
+			deviceState.mPixelShaderConstantsSize = sizeof(ShaderConstantSlots);
+		}
+		deviceState.mArePipelineHashesDirty = true;
+	};
+
+	//Games tend to create the same bytecode once per material so identical shaders share one converter & module.
+	uint64_t hash = HashBytes(pFunction, tokenCount * sizeof(DWORD));
+
+	auto range = window->mShaderCache.equal_range(hash);
+	for (auto entry = range.first; entry != range.second; ++entry)
 	{
-		std::shared_ptr<ShaderConverter> ptr = std::make_shared<ShaderConverter>(window->mRealDevice->mDevice, window->mDeviceState.mPixelShaderConstantSlots);
-		ptr->Convert((uint32_t*)pFunction);
-		(*size) = ptr->mConvertedShader.Size;
-		mShaderConverters.push_back(ptr);
+		std::shared_ptr<ShaderConverter> ptr = entry->second.lock();
+		if (ptr != nullptr && ptr->mTokens.size() == tokenCount && !memcmp(ptr->mTokens.data(), pFunction, tokenCount * sizeof(DWORD)))
+		{
+			applyConstantDefinitions(*ptr);
+			mShaderConverters.push_back(ptr);
+			window->mShaderCacheHits++;
+			return;
+		}
 	}
 
+	std::shared_ptr<ShaderConverter> ptr = std::make_shared<ShaderConverter>(window->mRealDevice->mDevice, mUseShaderConstantBuffer, mOptimizeShaders);
+	ptr->mHash = hash;
+	ptr->mDiskKey = HashCombine(hash, (mUseShaderConstantBuffer ? 1 : 0) | (mOptimizeShaders ? 2 : 0)); //Both options change the generated code so they are part of the key on disk.
+	ptr->mTokens.assign((uint32_t*)pFunction, (uint32_t*)pFunction + tokenCount);
+
+	//The shader's own constants are written now rather than by the translation threads so they land in command order.
+	GetConstantDefinitions(ptr->mTokens.data(), ptr->mConstantDefinitions);
+	applyConstantDefinitions(*ptr);
+
+	mShaderConverters.push_back(ptr);
+
+	window->mShaderCache.emplace(hash, ptr);
+	window->mShaderCacheMisses++;
+
+	//Draws only wait for the conversion if they end up building a pipeline with this shader before it's done.
+	mShaderTranslator->Translate(ptr);
 }
\ No newline at end of file
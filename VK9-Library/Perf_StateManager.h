@@ -21,7 +21,9 @@ misrepresented as being the original software.
 #include <atomic>
 #include <memory>
 #include <vector>
+#include <deque>
 #include <chrono>
+#include <unordered_map>
 #include <boost/container/flat_map.hpp>
 #include <boost/container/small_vector.hpp>
 #include <vulkan/vulkan.hpp>
@@ -32,6 +34,11 @@ misrepresented as being the original software.
 #include "CTypes.h"
 
 #include "ShaderConverter.h"
+#include "Perf_PipelineCompiler.h"
+#include "Perf_UploadManager.h"
+#include "Perf_MemoryAllocator.h"
+#include "Perf_ShaderDiskCache.h"
+#include "Perf_ShaderTranslator.h"
 
 #ifdef _DEBUG
 #include "renderdoc_app.h"
@@ -41,6 +48,24 @@ misrepresented as being the original software.
 #define STATEMANAGER_H
 
 #define CACHE_SECONDS 1
+#define PIPELINE_CACHE_MAGIC 0x50394B56 //VK9P
+#define PIPELINE_CACHE_VERSION 1
+
+/*
+Written in front of the driver's pipeline cache data on disk.
+The driver checks its own header but that doesn't include the driver version so the file is validated here before the data is handed over.
+*/
+struct PipelineCacheHeader
+{
+	uint32_t Magic = PIPELINE_CACHE_MAGIC;
+	uint32_t Version = PIPELINE_CACHE_VERSION;
+	uint32_t VendorId = 0;
+	uint32_t DeviceId = 0;
+	uint32_t DriverVersion = 0;
+	uint8_t PipelineCacheUUID[VK_UUID_SIZE] = {};
+	uint64_t DataSize = 0;
+	uint64_t DataHash = 0;
+};
 
 VKAPI_ATTR VkBool32 VKAPI_CALL DebugReportCallback(VkDebugReportFlagsEXT flags, VkDebugReportObjectTypeEXT objectType, uint64_t object, size_t location, int32_t messageCode, const char* layerPrefix, const char* message, void* userData);
 
@@ -53,6 +78,171 @@ VKAPI_ATTR void VKAPI_CALL vkCmdPushDescriptorSetKHR(
 	uint32_t                                    descriptorWriteCount,
 	const VkWriteDescriptorSet*                 pDescriptorWrites);
 
+static PFN_vkCmdPushDescriptorSetWithTemplateKHR pfn_vkCmdPushDescriptorSetWithTemplateKHR;
+VKAPI_ATTR void VKAPI_CALL vkCmdPushDescriptorSetWithTemplateKHR(
+	VkCommandBuffer                             commandBuffer,
+	VkDescriptorUpdateTemplateKHR               descriptorUpdateTemplate,
+	VkPipelineLayout                            layout,
+	uint32_t                                    set,
+	const void*                                 pData);
+
+static PFN_vkCreateDescriptorUpdateTemplateKHR pfn_vkCreateDescriptorUpdateTemplateKHR;
+VKAPI_ATTR VkResult VKAPI_CALL vkCreateDescriptorUpdateTemplateKHR(
+	VkDevice                                    device,
+	const VkDescriptorUpdateTemplateCreateInfoKHR* pCreateInfo,
+	const VkAllocationCallbacks*                pAllocator,
+	VkDescriptorUpdateTemplateKHR*              pDescriptorUpdateTemplate);
+
+static PFN_vkDestroyDescriptorUpdateTemplateKHR pfn_vkDestroyDescriptorUpdateTemplateKHR;
+VKAPI_ATTR void VKAPI_CALL vkDestroyDescriptorUpdateTemplateKHR(
+	VkDevice                                    device,
+	VkDescriptorUpdateTemplateKHR               descriptorUpdateTemplate,
+	const VkAllocationCallbacks*                pAllocator);
+
+/*
+Older SDK headers don't know about the extended dynamic state extensions so the bits that are used are declared here.
+*/
+#ifndef VK_EXT_extended_dynamic_state
+#define VK_EXT_extended_dynamic_state 1
+#define VK_EXT_EXTENDED_DYNAMIC_STATE_EXTENSION_NAME "VK_EXT_extended_dynamic_state"
+#define VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTENDED_DYNAMIC_STATE_FEATURES_EXT ((VkStructureType)1000267000)
+#define VK_DYNAMIC_STATE_CULL_MODE_EXT ((VkDynamicState)1000267000)
+#define VK_DYNAMIC_STATE_FRONT_FACE_EXT ((VkDynamicState)1000267001)
+#define VK_DYNAMIC_STATE_PRIMITIVE_TOPOLOGY_EXT ((VkDynamicState)1000267002)
+#define VK_DYNAMIC_STATE_DEPTH_TEST_ENABLE_EXT ((VkDynamicState)1000267006)
+#define VK_DYNAMIC_STATE_DEPTH_WRITE_ENABLE_EXT ((VkDynamicState)1000267007)
+#define VK_DYNAMIC_STATE_DEPTH_COMPARE_OP_EXT ((VkDynamicState)1000267008)
+#define VK_DYNAMIC_STATE_STENCIL_TEST_ENABLE_EXT ((VkDynamicState)1000267010)
+#define VK_DYNAMIC_STATE_STENCIL_OP_EXT ((VkDynamicState)1000267011)
+
+typedef struct VkPhysicalDeviceExtendedDynamicStateFeaturesEXT {
+	VkStructureType    sType;
+	void*              pNext;
+	VkBool32           extendedDynamicState;
+} VkPhysicalDeviceExtendedDynamicStateFeaturesEXT;
+
+typedef void (VKAPI_PTR *PFN_vkCmdSetCullModeEXT)(VkCommandBuffer commandBuffer, VkCullModeFlags cullMode);
+typedef void (VKAPI_PTR *PFN_vkCmdSetFrontFaceEXT)(VkCommandBuffer commandBuffer, VkFrontFace frontFace);
+typedef void (VKAPI_PTR *PFN_vkCmdSetPrimitiveTopologyEXT)(VkCommandBuffer commandBuffer, VkPrimitiveTopology primitiveTopology);
+typedef void (VKAPI_PTR *PFN_vkCmdSetDepthTestEnableEXT)(VkCommandBuffer commandBuffer, VkBool32 depthTestEnable);
+typedef void (VKAPI_PTR *PFN_vkCmdSetDepthWriteEnableEXT)(VkCommandBuffer commandBuffer, VkBool32 depthWriteEnable);
+typedef void (VKAPI_PTR *PFN_vkCmdSetDepthCompareOpEXT)(VkCommandBuffer commandBuffer, VkCompareOp depthCompareOp);
+typedef void (VKAPI_PTR *PFN_vkCmdSetStencilTestEnableEXT)(VkCommandBuffer commandBuffer, VkBool32 stencilTestEnable);
+typedef void (VKAPI_PTR *PFN_vkCmdSetStencilOpEXT)(VkCommandBuffer commandBuffer, VkStencilFaceFlags faceMask, VkStencilOp failOp, VkStencilOp passOp, VkStencilOp depthFailOp, VkCompareOp compareOp);
+#endif // VK_EXT_extended_dynamic_state
+
+#ifndef VK_EXT_extended_dynamic_state2
+#define VK_EXT_extended_dynamic_state2 1
+#define VK_EXT_EXTENDED_DYNAMIC_STATE_2_EXTENSION_NAME "VK_EXT_extended_dynamic_state2"
+#define VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTENDED_DYNAMIC_STATE_2_FEATURES_EXT ((VkStructureType)1000377000)
+#define VK_DYNAMIC_STATE_DEPTH_BIAS_ENABLE_EXT ((VkDynamicState)1000377002)
+
+typedef struct VkPhysicalDeviceExtendedDynamicState2FeaturesEXT {
+	VkStructureType    sType;
+	void*              pNext;
+	VkBool32           extendedDynamicState2;
+	VkBool32           extendedDynamicState2LogicOp;
+	VkBool32           extendedDynamicState2PatchControlPoints;
+} VkPhysicalDeviceExtendedDynamicState2FeaturesEXT;
+
+typedef void (VKAPI_PTR *PFN_vkCmdSetDepthBiasEnableEXT)(VkCommandBuffer commandBuffer, VkBool32 depthBiasEnable);
+#endif // VK_EXT_extended_dynamic_state2
+
+#ifndef VK_KHR_pipeline_library
+#define VK_KHR_pipeline_library 1
+#define VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME "VK_KHR_pipeline_library"
+#define VK_STRUCTURE_TYPE_PIPELINE_LIBRARY_CREATE_INFO_KHR ((VkStructureType)1000290000)
+#define VK_PIPELINE_CREATE_LIBRARY_BIT_KHR 0x00000800
+
+typedef struct VkPipelineLibraryCreateInfoKHR {
+	VkStructureType    sType;
+	const void*        pNext;
+	uint32_t           libraryCount;
+	const VkPipeline*  pLibraries;
+} VkPipelineLibraryCreateInfoKHR;
+#endif // VK_KHR_pipeline_library
+
+#ifndef VK_EXT_graphics_pipeline_library
+#define VK_EXT_graphics_pipeline_library 1
+#define VK_EXT_GRAPHICS_PIPELINE_LIBRARY_EXTENSION_NAME "VK_EXT_graphics_pipeline_library"
+#define VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_GRAPHICS_PIPELINE_LIBRARY_FEATURES_EXT ((VkStructureType)1000320000)
+#define VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_LIBRARY_CREATE_INFO_EXT ((VkStructureType)1000320002)
+#define VK_PIPELINE_CREATE_LINK_TIME_OPTIMIZATION_BIT_EXT 0x00000400
+#define VK_PIPELINE_CREATE_RETAIN_LINK_TIME_OPTIMIZATION_INFO_BIT_EXT 0x00800000
+#define VK_GRAPHICS_PIPELINE_LIBRARY_VERTEX_INPUT_INTERFACE_BIT_EXT 0x00000001
+#define VK_GRAPHICS_PIPELINE_LIBRARY_PRE_RASTERIZATION_SHADERS_BIT_EXT 0x00000002
+#define VK_GRAPHICS_PIPELINE_LIBRARY_FRAGMENT_SHADER_BIT_EXT 0x00000004
+#define VK_GRAPHICS_PIPELINE_LIBRARY_FRAGMENT_OUTPUT_INTERFACE_BIT_EXT 0x00000008
+
+typedef VkFlags VkGraphicsPipelineLibraryFlagsEXT;
+
+typedef struct VkPhysicalDeviceGraphicsPipelineLibraryFeaturesEXT {
+	VkStructureType    sType;
+	void*              pNext;
+	VkBool32           graphicsPipelineLibrary;
+} VkPhysicalDeviceGraphicsPipelineLibraryFeaturesEXT;
+
+typedef struct VkGraphicsPipelineLibraryCreateInfoEXT {
+	VkStructureType                      sType;
+	void*                                pNext;
+	VkGraphicsPipelineLibraryFlagsEXT    flags;
+} VkGraphicsPipelineLibraryCreateInfoEXT;
+#endif // VK_EXT_graphics_pipeline_library
+
+static PFN_vkGetPhysicalDeviceFeatures2KHR pfn_vkGetPhysicalDeviceFeatures2KHR;
+VKAPI_ATTR void VKAPI_CALL vkGetPhysicalDeviceFeatures2KHR(
+	VkPhysicalDevice                            physicalDevice,
+	VkPhysicalDeviceFeatures2KHR*               pFeatures);
+
+static PFN_vkCmdSetCullModeEXT pfn_vkCmdSetCullModeEXT;
+VKAPI_ATTR void VKAPI_CALL vkCmdSetCullModeEXT(
+	VkCommandBuffer                             commandBuffer,
+	VkCullModeFlags                             cullMode);
+
+static PFN_vkCmdSetFrontFaceEXT pfn_vkCmdSetFrontFaceEXT;
+VKAPI_ATTR void VKAPI_CALL vkCmdSetFrontFaceEXT(
+	VkCommandBuffer                             commandBuffer,
+	VkFrontFace                                 frontFace);
+
+static PFN_vkCmdSetPrimitiveTopologyEXT pfn_vkCmdSetPrimitiveTopologyEXT;
+VKAPI_ATTR void VKAPI_CALL vkCmdSetPrimitiveTopologyEXT(
+	VkCommandBuffer                             commandBuffer,
+	VkPrimitiveTopology                         primitiveTopology);
+
+static PFN_vkCmdSetDepthTestEnableEXT pfn_vkCmdSetDepthTestEnableEXT;
+VKAPI_ATTR void VKAPI_CALL vkCmdSetDepthTestEnableEXT(
+	VkCommandBuffer                             commandBuffer,
+	VkBool32                                    depthTestEnable);
+
+static PFN_vkCmdSetDepthWriteEnableEXT pfn_vkCmdSetDepthWriteEnableEXT;
+VKAPI_ATTR void VKAPI_CALL vkCmdSetDepthWriteEnableEXT(
+	VkCommandBuffer                             commandBuffer,
+	VkBool32                                    depthWriteEnable);
+
+static PFN_vkCmdSetDepthCompareOpEXT pfn_vkCmdSetDepthCompareOpEXT;
+VKAPI_ATTR void VKAPI_CALL vkCmdSetDepthCompareOpEXT(
+	VkCommandBuffer                             commandBuffer,
+	VkCompareOp                                 depthCompareOp);
+
+static PFN_vkCmdSetStencilTestEnableEXT pfn_vkCmdSetStencilTestEnableEXT;
+VKAPI_ATTR void VKAPI_CALL vkCmdSetStencilTestEnableEXT(
+	VkCommandBuffer                             commandBuffer,
+	VkBool32                                    stencilTestEnable);
+
+static PFN_vkCmdSetStencilOpEXT pfn_vkCmdSetStencilOpEXT;
+VKAPI_ATTR void VKAPI_CALL vkCmdSetStencilOpEXT(
+	VkCommandBuffer                             commandBuffer,
+	VkStencilFaceFlags                          faceMask,
+	VkStencilOp                                 failOp,
+	VkStencilOp                                 passOp,
+	VkStencilOp                                 depthFailOp,
+	VkCompareOp                                 compareOp);
+
+static PFN_vkCmdSetDepthBiasEnableEXT pfn_vkCmdSetDepthBiasEnableEXT;
+VKAPI_ATTR void VKAPI_CALL vkCmdSetDepthBiasEnableEXT(
+	VkCommandBuffer                             commandBuffer,
+	VkBool32                                    depthBiasEnable);
+
 static PFN_vkCreateDebugReportCallbackEXT pfn_vkCreateDebugReportCallbackEXT;
 VKAPI_ATTR VkResult VKAPI_CALL vkCreateDebugReportCallbackEXT(
 	VkInstance                                  instance,
@@ -91,6 +281,11 @@ struct RealDevice
 	//Stuff that does things.
 	vk::Device mDevice;
 	vk::DescriptorPool mDescriptorPool;
+	std::unique_ptr<MemoryAllocator> mMemoryAllocator; //Every resource allocation made for this device comes from here.
+	bool mHasDescriptorUpdateTemplate = false; //VK_KHR_descriptor_update_template is enabled so descriptors can be pushed with a template.
+	bool mHasExtendedDynamicState = false; //VK_EXT_extended_dynamic_state is enabled so cull, depth, stencil & topology are set at draw time.
+	bool mHasExtendedDynamicState2 = false; //VK_EXT_extended_dynamic_state2 is enabled so depth bias is switched on & off at draw time.
+	bool mHasGraphicsPipelineLibrary = false; //VK_EXT_graphics_pipeline_library is enabled so pipelines are linked from shared libraries.
 
 	RealDevice();
 	~RealDevice();
@@ -116,6 +311,110 @@ struct RealInstance
 struct SamplerRequest;
 struct DrawContext;
 
+/*
+A backing store a dynamic buffer was moved off of by a discard lock, or a frame ring that was replaced by a bigger one in the middle of a frame.
+It is handed out again or freed once the GPU is done with the last frame that used it.
+*/
+struct BufferVersion
+{
+	vk::Buffer Buffer;
+	MemoryAllocation Allocation;
+	vk::DescriptorSet DescriptorSet; //Only set for a retired shader constant ring.
+	uint64_t LastUsedFrame = 0;
+};
+
+/*
+A texture, surface or buffer the application released while a frame that may use it is still on the GPU.
+Holding the last reference keeps its destructor from running until that frame has finished.
+*/
+struct RetiredResource
+{
+	std::shared_ptr<void> Resource;
+	uint64_t LastUsedFrame = 0;
+};
+
+/*
+Everything a push descriptor update template reads from. Each pipeline's template points its bindings at the matching members.
+Image infos are indexed by sampler stage and unbound stages hold the window's default texture so a template can always push every binding in its layout.
+*/
+struct DescriptorPushData
+{
+	vk::DescriptorBufferInfo BufferInfo[4]; //Indexed by binding. (fixed function only, 0 is lights, 1 is material & 3 is render state)
+	vk::DescriptorImageInfo ImageInfo[16];
+};
+
+enum BindingType
+{
+	BindingType_Pipeline,
+	BindingType_VertexBuffers,
+	BindingType_IndexBuffer,
+	BindingType_Descriptors, //Textures, samplers and the light & material buffers.
+	BindingType_PushConstants,
+	BindingType_ShaderConstants,
+	BindingType_DepthBias,
+	BindingType_Viewport,
+	BindingType_Scissor,
+	BindingType_Stencil, //Reference & masks.
+	BindingType_BlendConstants,
+	BindingType_RasterState, //Cull, depth, stencil & topology when they are dynamic.
+	BindingType_Count
+};
+
+#define BINDING_FLAG(type) (1 << (type))
+#define BINDING_FLAG_ALL ((1 << BindingType_Count) - 1)
+#define BINDING_MAX_STREAMS 16
+
+/*
+Render states that are set with VK_EXT_extended_dynamic_state instead of being baked into the pipeline.
+*/
+struct DynamicRasterState
+{
+	vk::CullModeFlags CullMode;
+	vk::FrontFace FrontFace = vk::FrontFace::eClockwise;
+	vk::PrimitiveTopology PrimitiveTopology = vk::PrimitiveTopology::eTriangleList;
+	VkBool32 DepthTestEnable = VK_FALSE;
+	VkBool32 DepthWriteEnable = VK_FALSE;
+	vk::CompareOp DepthCompareOp = vk::CompareOp::eNever;
+	VkBool32 StencilTestEnable = VK_FALSE;
+	vk::StencilOpState Front;
+	vk::StencilOpState Back;
+};
+
+/*
+What has been recorded into the current frame's command buffer so a draw only records the binds that changed since the last one.
+The command stream handlers set a dirty bit when the application changes the matching state and the draw compares against what was bound before recording anything.
+Everything is forgotten when the command buffer is reset at the start of a scene.
+*/
+struct BindingTracker
+{
+	uint32_t DirtyFlags = BINDING_FLAG_ALL; //State the application may have changed since the last draw.
+	uint32_t BoundFlags = 0; //Dynamic state that has been recorded at least once and can be compared against.
+
+	vk::Pipeline Pipeline;
+	vk::PipelineLayout PipelineLayout;
+	vk::Buffer IndexBuffer;
+	vk::IndexType IndexType = vk::IndexType::eUint16;
+	vk::Buffer VertexBuffers[BINDING_MAX_STREAMS];
+	vk::DeviceSize VertexBufferOffsets[BINDING_MAX_STREAMS] = {};
+	uint32_t ShaderConstantOffsets[2] = {};
+	float DepthBias[2] = {}; //Constant & slope.
+	vk::Viewport Viewport;
+	vk::Rect2D Scissor;
+	VkBool32 DepthBiasEnable = VK_TRUE;
+	uint32_t Stencil[3] = {}; //Reference, compare mask & write mask.
+	uint32_t BlendFactor = 0;
+	DynamicRasterState RasterState;
+
+	//Counters only touched by the command stream thread.
+	size_t BindCounts[BindingType_Count] = {};
+	size_t SkipCounts[BindingType_Count] = {};
+	size_t LastLoggedCount = 0;
+	std::chrono::steady_clock::time_point LastLog = std::chrono::steady_clock::now();
+
+	void Reset();
+	void LogStatistics(bool force = false);
+};
+
 struct RealWindow
 {
 	std::shared_ptr<RealInstance> mRealInstance;
@@ -124,8 +423,17 @@ struct RealWindow
 	//Command, queue, and render pass stuff
 	vk::CommandPool mCommandPool;
 	vk::Queue mQueue;
-	vk::CommandBuffer* mSwapchainBuffers;
-	uint32_t mCurrentSwapchainBuffer = 0;
+	uint32_t mCurrentSwapchainBuffer = 0; //Index of the acquired swapchain image.
+
+	//Frames in flight (each frame owns its command buffer, fence, and semaphores so the CPU can record while the GPU works on the previous frames.)
+	uint32_t mFrameCount = 2;
+	uint32_t mCurrentFrame = 0;
+	uint64_t mFrameNumber = 1; //Frame being recorded, advanced on present. (starts at 1 so a last used frame of 0 means never used)
+	uint64_t mCompletedFrameNumber = 0; //Every frame up to and including this one has finished on the GPU.
+	vk::CommandBuffer* mFrameCommandBuffers = nullptr;
+	vk::Fence* mFrameFences = nullptr;
+	vk::Semaphore* mImageAvailableSemaphores = nullptr;
+	vk::Semaphore* mRenderFinishedSemaphores = nullptr;
 	vk::AttachmentDescription mRenderAttachments[2];
 	vk::RenderPass mStoreRenderPass;
 	vk::RenderPass mClearRenderPass;
@@ -154,7 +462,6 @@ struct RealWindow
 	uint32_t mPresentationModeCount;
 	vk::PresentModeKHR* mPresentationModes;
 	vk::SemaphoreCreateInfo mPresentCompleteSemaphoreCreateInfo;
-	vk::Semaphore mPresentCompleteSemaphore;
 	vk::PresentInfoKHR mPresentInfo;
 	vk::ImageMemoryBarrier mPrePresentBarrier;
 	vk::Format mFormat;
@@ -166,7 +473,7 @@ struct RealWindow
 	vk::Image* mSwapchainImages;
 	vk::ImageView* mSwapchainViews;
 	vk::Image mDepthImage;
-	vk::DeviceMemory mDepthDeviceMemory;
+	MemoryAllocation mDepthAllocation;
 	vk::ImageView mDepthView;
 
 	//Misc Handles
@@ -175,8 +482,14 @@ struct RealWindow
 
 	//Misc State
 	DeviceState mDeviceState = {};
-	boost::container::small_vector< std::shared_ptr<SamplerRequest>, 16> mSamplerRequests;
-	boost::container::small_vector< std::shared_ptr<DrawContext>, 16> mDrawBuffer;
+	std::unordered_map<uint64_t, std::shared_ptr<SamplerRequest> > mSamplers; //Keyed by SamplerRequest::Key
+	uint32_t mSamplerCacheSize = 256; //Samplers unused by any frame still in flight are evicted oldest first past this count.
+	std::unordered_multimap<uint64_t, std::shared_ptr<DrawContext> > mDrawBuffer; //Keyed by DrawContext::Key, a hit still has to match the full state.
+	std::unordered_map<uint64_t, std::shared_ptr<DrawContext> > mFallbackPipelines; //Keyed by DrawContext::LayoutKey
+	std::unordered_multimap<uint64_t, std::weak_ptr<ShaderConverter> > mShaderCache; //Keyed by ShaderConverter::mHash, the shader ids & draw contexts own the converters.
+	size_t mShaderCacheHits = 0;
+	size_t mShaderCacheMisses = 0;
+	BindingTracker mBindings;
 	Transformations mTransformations;
 	bool mIsDirty = true;
 
@@ -1241,7 +1554,7 @@ struct RealWindow
 
 	vk::SpecializationInfo mVertexSpecializationInfo =
 	{
-		251,                                           // mapEntryCount
+		sizeof(SpecializationConstants) / sizeof(uint32_t), // mapEntryCount
 		mSlotMapEntries,							   // pMapEntries
 		sizeof(SpecializationConstants),               // dataSize
 		nullptr,// pData
@@ -1249,7 +1562,7 @@ struct RealWindow
 
 	vk::SpecializationInfo mPixelSpecializationInfo =
 	{
-		251,                                           // mapEntryCount
+		sizeof(SpecializationConstants) / sizeof(uint32_t), // mapEntryCount
 		mSlotMapEntries,                               // pMapEntries
 		sizeof(SpecializationConstants),               // dataSize
 		nullptr,// pData
@@ -1260,7 +1573,7 @@ struct RealWindow
 	vk::VertexInputAttributeDescription mVertexInputAttributeDescription[32];
 	vk::PipelineVertexInputStateCreateInfo mPipelineVertexInputStateCreateInfo;
 	vk::PipelineDynamicStateCreateInfo mPipelineDynamicStateCreateInfo;
-	vk::DynamicState mDynamicStateEnables[VK_DYNAMIC_STATE_RANGE_SIZE];
+	vk::DynamicState mDynamicStateEnables[32]; //The core states plus the extended ones.
 	vk::PipelineRasterizationStateCreateInfo mPipelineRasterizationStateCreateInfo;
 	vk::PipelineInputAssemblyStateCreateInfo mPipelineInputAssemblyStateCreateInfo;
 	vk::PipelineColorBlendAttachmentState mPipelineColorBlendAttachmentState[1];
@@ -1276,29 +1589,71 @@ struct RealWindow
 	vk::GraphicsPipelineCreateInfo mGraphicsPipelineCreateInfo;
 	vk::PipelineCacheCreateInfo mPipelineCacheCreateInfo;
 	vk::PipelineCache mPipelineCache;
+	std::string mPipelineCachePath; //Empty if the cache isn't persisted.
+	uint32_t mPipelineCacheSaveInterval = 0; //Seconds between saves while running. (0 only saves on shutdown)
+	uint32_t mPipelinesSinceCacheSave = 0;
+	std::chrono::steady_clock::time_point mLastPipelineCacheSave = std::chrono::steady_clock::now();
+	std::unique_ptr<PipelineCompiler> mPipelineCompiler; //Created after mPipelineCache and drained before anything it references is destroyed.
+	std::unique_ptr<UploadManager> mUploadManager; //Created after mCommandPool and drained before anything it references is destroyed.
 	vk::Image mImage;
-	vk::DeviceMemory mDeviceMemory;
+	MemoryAllocation mImageAllocation;
 	vk::ImageLayout mImageLayout;
 	vk::Sampler mSampler;
 	vk::ImageView mImageView;
-	vk::DescriptorBufferInfo mDescriptorBufferInfo[2];
-	vk::WriteDescriptorSet mWriteDescriptorSet[3];
+	vk::DescriptorBufferInfo mDescriptorBufferInfo[4];
+	vk::WriteDescriptorSet mWriteDescriptorSet[4];
+	DescriptorPushData mDescriptorPushData; //Only used when the device supports descriptor update templates.
 	vk::CommandBufferAllocateInfo mCommandBufferAllocateInfo;
 	vk::CommandBuffer mCommandBuffer = VK_NULL_HANDLE;
 	vk::CommandBufferBeginInfo mBeginInfo;
 	vk::BufferCopy mCopyRegion;
-	vk::Buffer mLightBuffer;
-	vk::DeviceMemory mLightBufferMemory;
-	vk::Buffer mMaterialBuffer;
-	vk::DeviceMemory mMaterialBufferMemory;
 	int32_t mVertexCount = 0;
 
+	//Fixed function arena (each frame in flight owns mFixedFunctionArenaSize bytes that changed light & material blocks are appended to.)
+	vk::Buffer mFixedFunctionBuffer;
+	MemoryAllocation mFixedFunctionBufferAllocation;
+	char* mFixedFunctionBufferData = nullptr; //Stays mapped for the life of the window.
+	vk::DeviceSize mFixedFunctionArenaSize = 0;
+	vk::DeviceSize mFixedFunctionArenaHead = 0; //Relative to the start of the current frame's region.
+	vk::DescriptorBufferInfo mLightBufferInfo; //Where the latest light, material & render state blocks were written.
+	vk::DescriptorBufferInfo mMaterialBufferInfo;
+	vk::DescriptorBufferInfo mRenderStateBufferInfo;
+	std::deque<BufferVersion> mRetiredFixedFunctionBuffers; //Oldest first.
+
+	//Shader constant ring (each frame in flight owns mShaderConstantSlotCount blocks which are bound with dynamic offsets.)
+	vk::Buffer mShaderConstantBuffer;
+	MemoryAllocation mShaderConstantBufferAllocation;
+	char* mShaderConstantBufferData = nullptr; //Stays mapped for the life of the window.
+	vk::DeviceSize mShaderConstantSlotSize = 0; //sizeof(ShaderConstantSlots) rounded up to minUniformBufferOffsetAlignment.
+	uint32_t mShaderConstantSlotCount = 0;
+	uint32_t mNextShaderConstantSlot = 0;
+	uint32_t mShaderConstantOffsets[2] = {}; //Vertex & pixel dynamic offsets.
+	vk::DescriptorSetLayout mShaderConstantDescriptorSetLayout;
+	vk::DescriptorSet mShaderConstantDescriptorSet;
+	std::deque<BufferVersion> mRetiredShaderConstantBuffers; //Oldest first.
+	std::deque<RetiredResource> mRetiredResources; //Oldest first.
+	const ShaderConverter* mConstantDefinitionConverters[2] = {}; //Vertex & pixel shaders whose def constants were last written into the slots.
+
 	RealWindow(std::shared_ptr<RealInstance>& realInstance, std::shared_ptr<RealDevice>& realDevice);
 	~RealWindow();
 
+	void WaitForFrames();
+	bool ReadPipelineCache(std::vector<char>& data);
+	void LoadPipelineCache();
+	void SavePipelineCache();
 	void SetImageLayout(vk::Image image, vk::ImageAspectFlags aspectMask, vk::ImageLayout oldImageLayout, vk::ImageLayout newImageLayout, uint32_t levelCount = 1, uint32_t mipIndex = 0, uint32_t layerCount = 1);
-	void CreateBuffer(vk::DeviceSize size, vk::BufferUsageFlags usage, vk::MemoryPropertyFlagBits properties, vk::Buffer& buffer, vk::DeviceMemory& deviceMemory);
+	void CreateBuffer(vk::DeviceSize size, vk::BufferUsageFlags usage, vk::MemoryPropertyFlagBits properties, vk::Buffer& buffer, MemoryAllocation& allocation);
+	bool RenameBuffer(const vk::BufferCreateInfo& bufferCreateInfo, vk::Buffer& buffer, MemoryAllocation& allocation, uint64_t& lastUsedFrame, std::deque<BufferVersion>& retiredVersions);
 	void CopyBuffer(vk::Buffer srcBuffer, vk::Buffer dstBuffer, vk::DeviceSize size);
+	bool CreateFrameRing(vk::DeviceSize frameSize, vk::Buffer& buffer, MemoryAllocation& allocation);
+	bool GrowFrameRing(vk::DeviceSize frameSize, const char* optionName, vk::Buffer& buffer, MemoryAllocation& allocation, char*& data, std::deque<BufferVersion>& retiredVersions);
+	bool AllocateShaderConstantDescriptorSet(vk::DescriptorSet& descriptorSet);
+	void UpdateShaderConstantDescriptorSet();
+	bool CreateShaderConstantRing();
+	bool GrowShaderConstantRing();
+	bool GrowFixedFunctionArena(vk::DeviceSize minimumSize);
+	void RetireResource(std::shared_ptr<void> resource);
+	void FreeRetiredBuffers();
 };
 
 struct RealTexture
@@ -1307,11 +1662,11 @@ struct RealTexture
 	int32_t mSize;
 
 	vk::Format mRealFormat;
-	vk::MemoryAllocateInfo mMemoryAllocateInfo;
 	vk::Image mImage;
-	vk::DeviceMemory mDeviceMemory;
+	MemoryAllocation mAllocation;
 	vk::Sampler mSampler;
 	vk::ImageView mImageView;
+	uint64_t mUploadSerial = 0; //Last upload batch that touched the image.
 
 	RealWindow* mRealWindow = nullptr; //null if not owner.
 	RealTexture(RealWindow* realWindow);
@@ -1323,10 +1678,9 @@ struct RealSurface
 	BOOL mIsFlushed = false;
 	void* mData = nullptr;
 	vk::Image mStagingImage;
-	vk::DeviceMemory mStagingDeviceMemory;
+	MemoryAllocation mStagingAllocation; //Staging memory is host visible so it stays mapped.
 
 	vk::Format mRealFormat = vk::Format::eR8G8B8A8Unorm;
-	vk::MemoryAllocateInfo mMemoryAllocateInfo;
 	vk::ImageLayout mImageLayout = vk::ImageLayout::eGeneral;
 	vk::SubresourceLayout mLayouts[1] = {};
 	vk::ImageSubresource mSubresource;
@@ -1339,8 +1693,11 @@ struct RealSurface
 struct RealVertexBuffer
 {
 	vk::MemoryRequirements mMemoryRequirements;
+	vk::BufferCreateInfo mBufferCreateInfo;
 	vk::Buffer mBuffer;
-	vk::DeviceMemory mMemory;
+	MemoryAllocation mAllocation; //Host visible so it stays mapped.
+	uint64_t mLastUsedFrame = 0; //Last frame a draw bound the current backing store.
+	std::deque<BufferVersion> mRetiredVersions; //Oldest first.
 	void* mData = nullptr;
 	int32_t mSize;
 
@@ -1352,8 +1709,11 @@ struct RealVertexBuffer
 struct RealIndexBuffer
 {
 	vk::MemoryRequirements mMemoryRequirements;
+	vk::BufferCreateInfo mBufferCreateInfo;
 	vk::Buffer mBuffer;
-	vk::DeviceMemory mMemory;
+	MemoryAllocation mAllocation; //Host visible so it stays mapped.
+	uint64_t mLastUsedFrame = 0; //Last frame a draw bound the current backing store.
+	std::deque<BufferVersion> mRetiredVersions; //Oldest first.
 	vk::IndexType mIndexType;
 	void* mData = nullptr;
 	int32_t mSize;
@@ -1363,13 +1723,17 @@ struct RealIndexBuffer
 	~RealIndexBuffer();
 };
 
+/*
+The key packs everything CreateSampler looks at into 64 bits.
+Bits 0-31 are the lod bias, then 4 bits each for the mag, min & mip filters, 3 bits each for the u, v & w address modes, 5 bits for the anisotropy & 5 bits for the texture's level count.
+*/
 struct SamplerRequest
 {
 	//Vulkan State
 	vk::Sampler Sampler;
+	uint64_t Key = 0;
 
 	//D3D9 State
-	DWORD SamplerIndex = 0;
 	D3DTEXTUREFILTERTYPE MagFilter = D3DTEXF_NONE;
 	D3DTEXTUREFILTERTYPE MinFilter = D3DTEXF_NONE;
 	D3DTEXTUREADDRESS AddressModeU = D3DTADDRESS_FORCE_DWORD;
@@ -1381,10 +1745,13 @@ struct SamplerRequest
 	float MaxLod = 1.0f;
 
 	//Resource Handling.
-	std::chrono::steady_clock::time_point LastUsed = std::chrono::steady_clock::now();
+	uint64_t LastUsedFrame = 0;
 	RealWindow* mRealWindow = nullptr; //null if not owner.
-	SamplerRequest(RealWindow* realWindow) : mRealWindow(realWindow) {}
+	SamplerRequest(RealWindow* realWindow, uint64_t key);
 	~SamplerRequest();
+
+	static uint64_t GetStateKey(const boost::container::flat_map<D3DSAMPLERSTATETYPE, DWORD>& samplerStates);
+	static uint64_t GetKey(uint64_t stateKey, DWORD levels);
 };
 
 struct ResourceContext
@@ -1410,10 +1777,22 @@ struct DrawContext
 	vk::DescriptorSetLayout DescriptorSetLayout;
 	vk::Pipeline Pipeline;
 	vk::PipelineLayout PipelineLayout;
+	vk::DescriptorUpdateTemplateKHR DescriptorUpdateTemplate; //Null if the device doesn't support templates.
+	vk::Pipeline OptimizedPipeline; //Link time optimized copy of a pipeline linked from libraries.
 
 	//Misc
 	//boost::container::flat_map<UINT, UINT> Bindings;
 	UINT Bindings[64] = {};
+	uint64_t Key = 0;
+	uint64_t LayoutKey = 0; //Key without the render states. Pipelines with the same layout key can stand in for each other.
+	std::vector<uint64_t> DescriptorLayout; //The descriptor set & pipeline layout definition. Libraries built against the same one can be linked together.
+	std::shared_ptr<ShaderConverter> ShaderConverters[2]; //Keeps the modules & specialization map entries alive while a compile job or library still uses them.
+	uint64_t ShaderKeys[2] = {}; //Disk keys of the converted vertex & pixel shader. (0 for fixed function) Module handles can be reused so libraries are keyed by these.
+
+	//Background compilation
+	std::atomic_bool IsCompiling = false; //Pipeline is written by a PipelineCompiler thread until this is cleared.
+	std::atomic_bool IsOptimized = false; //OptimizedPipeline is ready and replaces Pipeline.
+	bool IsFallback = false; //Registered in RealWindow::mFallbackPipelines.
 
 	//D3D9 State - Pipe
 	D3DPRIMITIVETYPE PrimitiveType = D3DPT_FORCE_DWORD;
@@ -1432,6 +1811,7 @@ struct DrawContext
 
 	//Resource Handling.
 	std::chrono::steady_clock::time_point LastUsed = std::chrono::steady_clock::now();
+	uint64_t LastUsedFrame = 0; //Last frame that drew with this pipeline. It isn't destroyed before that frame has finished.
 	RealWindow* mRealWindow = nullptr; //null if not owner.
 	DrawContext(RealWindow* realWindow) : mRealWindow(realWindow) {}
 	~DrawContext();
@@ -1459,6 +1839,12 @@ struct StateManager
 
 	std::vector< std::shared_ptr<ShaderConverter> > mShaderConverters;
 	std::atomic_size_t mShaderConverterKey = 0;
+	std::unique_ptr<ShaderDiskCache> mShaderDiskCache; //Shared by every device since SPIR-V doesn't depend on the device.
+	std::unique_ptr<ShaderTranslator> mShaderTranslator; //Declared after the disk cache so its threads stop before the cache is saved.
+
+	boost::program_options::variables_map* mOptions = nullptr; //Owned by CommandStreamManager.
+	bool mUseShaderConstantBuffer = false;
+	bool mOptimizeShaders = false;
 
 	StateManager();
 	~StateManager();
@@ -0,0 +1,343 @@
+/*
+Copyright(c) 2018 Christopher Joseph Dean Schaefer
+
+This software is provided 'as-is', without any express or implied
+warranty.In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions :
+
+1. The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software.If you use this software
+in a product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include "Perf_UploadManager.h"
+
+#include <boost/log/core.hpp>
+#include <boost/log/trivial.hpp>
+
+#include "Utilities.h"
+
+UploadManager::UploadManager(vk::Device& device, vk::Queue& queue, vk::CommandPool& commandPool, MemoryAllocator& memoryAllocator, vk::DeviceSize ringSize, uint32_t batchCount)
+	: mDevice(device),
+	mQueue(queue),
+	mCommandPool(commandPool),
+	mMemoryAllocator(memoryAllocator)
+{
+	vk::Result result;
+
+	if (batchCount < 2)
+	{
+		batchCount = 2;
+	}
+
+	mBatches.resize(batchCount);
+
+	vk::CommandBufferAllocateInfo commandBufferInfo;
+	commandBufferInfo.commandPool = mCommandPool;
+	commandBufferInfo.level = vk::CommandBufferLevel::ePrimary;
+	commandBufferInfo.commandBufferCount = 1;
+
+	vk::FenceCreateInfo fenceCreateInfo;
+
+	for (auto& batch : mBatches)
+	{
+		result = mDevice.allocateCommandBuffers(&commandBufferInfo, &batch.CommandBuffer);
+		if (result != vk::Result::eSuccess)
+		{
+			BOOST_LOG_TRIVIAL(fatal) << "UploadManager::UploadManager vkAllocateCommandBuffers failed with return code of " << GetResultString((VkResult)result);
+			return;
+		}
+
+		result = mDevice.createFence(&fenceCreateInfo, nullptr, &batch.Fence);
+		if (result != vk::Result::eSuccess)
+		{
+			BOOST_LOG_TRIVIAL(fatal) << "UploadManager::UploadManager vkCreateFence failed with return code of " << GetResultString((VkResult)result);
+			return;
+		}
+	}
+
+	char* data = AllocateBuffer(ringSize, mRingBuffer, mRingAllocation);
+	if (data == nullptr)
+	{
+		return;
+	}
+
+	mRingSize = ringSize;
+
+	BOOST_LOG_TRIVIAL(info) << "UploadManager::UploadManager using a " << mRingSize << " byte staging ring and " << batchCount << " batches.";
+}
+
+UploadManager::~UploadManager()
+{
+	WaitIdle();
+	LogStatistics(true);
+
+	for (auto& batch : mBatches)
+	{
+		if (batch.CommandBuffer != vk::CommandBuffer())
+		{
+			mDevice.freeCommandBuffers(mCommandPool, 1, &batch.CommandBuffer);
+		}
+		mDevice.destroyFence(batch.Fence, nullptr);
+	}
+
+	mDevice.destroyBuffer(mRingBuffer, nullptr);
+	mMemoryAllocator.Free(mRingAllocation);
+}
+
+char* UploadManager::Allocate(vk::DeviceSize size, vk::DeviceSize alignment, vk::Buffer& buffer, vk::DeviceSize& offset)
+{
+	mUploadCount++;
+	mUploadBytes += size;
+
+	//Anything this big would keep flushing the ring so it gets a buffer of its own.
+	if (size > mRingSize / 2)
+	{
+		mOversizedCount++;
+
+		UploadBuffer uploadBuffer;
+		char* data = AllocateBuffer(size, uploadBuffer.Buffer, uploadBuffer.Allocation);
+		if (data == nullptr)
+		{
+			return nullptr;
+		}
+
+		GetCommandBuffer();
+		mBatches[mCurrentBatch].Buffers.push_back(uploadBuffer);
+
+		buffer = uploadBuffer.Buffer;
+		offset = 0;
+		return data;
+	}
+
+	for (;;)
+	{
+		vk::DeviceSize position = mRingHead % mRingSize;
+		vk::DeviceSize start = ((position + alignment - 1) / alignment) * alignment;
+		uint64_t head = mRingHead + (start - position) + size;
+
+		//Ranges never wrap so the rest of the ring is skipped when the upload doesn't fit before the end.
+		if (start + size > mRingSize)
+		{
+			start = 0;
+			head = mRingHead + (mRingSize - position) + size;
+		}
+
+		if (head - mRingTail <= mRingSize)
+		{
+			mRingHead = head;
+			buffer = mRingBuffer;
+			offset = start;
+			return mRingAllocation.Data + start;
+		}
+
+		/*
+		Out of space so hand what has been recorded to the GPU and wait for the oldest batch to give some back.
+		*/
+		mStallCount++;
+		Submit();
+
+		bool isRetired = false;
+		for (size_t i = 0; i < mBatches.size(); i++)
+		{
+			auto& batch = mBatches[(mCurrentBatch + i) % mBatches.size()];
+			if (batch.IsSubmitted)
+			{
+				Retire(batch);
+				isRetired = true;
+				break;
+			}
+		}
+
+		if (!isRetired)
+		{
+			BOOST_LOG_TRIVIAL(fatal) << "UploadManager::Allocate unable to find " << size << " bytes in the staging ring.";
+			return nullptr;
+		}
+	}
+}
+
+vk::CommandBuffer UploadManager::GetCommandBuffer()
+{
+	auto& batch = mBatches[mCurrentBatch];
+
+	if (!batch.IsRecording)
+	{
+		//Batches are used in order so this is the oldest one and waiting on it never skips ahead of the ring.
+		Retire(batch);
+
+		vk::CommandBufferBeginInfo commandBufferBeginInfo;
+		commandBufferBeginInfo.flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit;
+
+		vk::Result result = batch.CommandBuffer.begin(&commandBufferBeginInfo);
+		if (result != vk::Result::eSuccess)
+		{
+			BOOST_LOG_TRIVIAL(fatal) << "UploadManager::GetCommandBuffer vkBeginCommandBuffer failed with return code of " << GetResultString((VkResult)result);
+		}
+
+		batch.IsRecording = true;
+	}
+
+	return batch.CommandBuffer;
+}
+
+void UploadManager::Submit()
+{
+	auto& batch = mBatches[mCurrentBatch];
+
+	if (!batch.IsRecording)
+	{
+		return;
+	}
+
+	//Make every copy & layout transition in the batch visible to whatever is submitted after it.
+	vk::MemoryBarrier memoryBarrier;
+	memoryBarrier.srcAccessMask = vk::AccessFlagBits::eTransferWrite | vk::AccessFlagBits::eMemoryWrite;
+	memoryBarrier.dstAccessMask = vk::AccessFlagBits::eMemoryRead | vk::AccessFlagBits::eMemoryWrite;
+	batch.CommandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eAllCommands, vk::PipelineStageFlagBits::eAllCommands, vk::DependencyFlags(), 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+
+	batch.CommandBuffer.end();
+	batch.IsRecording = false;
+	batch.Serial = mSerial++;
+	batch.RingPosition = mRingHead;
+
+	mCurrentBatch = (mCurrentBatch + 1) % mBatches.size();
+
+	vk::Result result = mDevice.resetFences(1, &batch.Fence);
+	if (result != vk::Result::eSuccess)
+	{
+		BOOST_LOG_TRIVIAL(fatal) << "UploadManager::Submit vkResetFences failed with return code of " << GetResultString((VkResult)result);
+		return;
+	}
+
+	vk::SubmitInfo submitInfo;
+	submitInfo.commandBufferCount = 1;
+	submitInfo.pCommandBuffers = &batch.CommandBuffer;
+
+	result = mQueue.submit(1, &submitInfo, batch.Fence);
+	if (result != vk::Result::eSuccess)
+	{
+		BOOST_LOG_TRIVIAL(fatal) << "UploadManager::Submit vkQueueSubmit failed with return code of " << GetResultString((VkResult)result);
+		return;
+	}
+
+	batch.IsSubmitted = true;
+	mSubmitCount++;
+}
+
+void UploadManager::Wait(uint64_t serial)
+{
+	if (serial <= mCompletedSerial)
+	{
+		return;
+	}
+
+	if (serial >= mSerial)
+	{
+		Submit();
+	}
+
+	for (size_t i = 0; i < mBatches.size() && mCompletedSerial < serial; i++)
+	{
+		Retire(mBatches[(mCurrentBatch + i) % mBatches.size()]);
+	}
+}
+
+void UploadManager::WaitIdle()
+{
+	Wait(mSerial);
+}
+
+void UploadManager::LogStatistics(bool force)
+{
+	if (mUploadCount == mLastLoggedCount && !force)
+	{
+		return;
+	}
+
+	auto now = std::chrono::steady_clock::now();
+	if (!force && std::chrono::duration_cast<std::chrono::seconds>(now - mLastLog).count() < 5)
+	{
+		return;
+	}
+
+	BOOST_LOG_TRIVIAL(info) << "UploadManager::LogStatistics uploaded " << mUploadCount << " times (" << mUploadBytes << " bytes)"
+		<< " in " << mSubmitCount << " batches"
+		<< " full ring stalls " << mStallCount
+		<< " oversized uploads " << mOversizedCount;
+
+	mLastLoggedCount = mUploadCount;
+	mLastLog = now;
+}
+
+void UploadManager::Retire(UploadBatch& batch)
+{
+	if (batch.IsRecording)
+	{
+		return;
+	}
+
+	if (batch.IsSubmitted)
+	{
+		vk::Result result = mDevice.waitForFences(1, &batch.Fence, VK_TRUE, UINT64_MAX);
+		if (result != vk::Result::eSuccess)
+		{
+			BOOST_LOG_TRIVIAL(fatal) << "UploadManager::Retire vkWaitForFences failed with return code of " << GetResultString((VkResult)result);
+		}
+
+		batch.IsSubmitted = false;
+	}
+
+	if (batch.Serial > mCompletedSerial)
+	{
+		mCompletedSerial = batch.Serial;
+	}
+
+	if (batch.RingPosition > mRingTail)
+	{
+		mRingTail = batch.RingPosition;
+	}
+
+	for (auto& uploadBuffer : batch.Buffers)
+	{
+		mDevice.destroyBuffer(uploadBuffer.Buffer, nullptr);
+		mMemoryAllocator.Free(uploadBuffer.Allocation);
+	}
+	batch.Buffers.clear();
+}
+
+char* UploadManager::AllocateBuffer(vk::DeviceSize size, vk::Buffer& buffer, MemoryAllocation& allocation)
+{
+	vk::BufferCreateInfo bufferCreateInfo;
+	bufferCreateInfo.size = size;
+	bufferCreateInfo.usage = vk::BufferUsageFlagBits::eTransferSrc;
+
+	vk::Result result = mDevice.createBuffer(&bufferCreateInfo, nullptr, &buffer);
+	if (result != vk::Result::eSuccess)
+	{
+		BOOST_LOG_TRIVIAL(fatal) << "UploadManager::AllocateBuffer vkCreateBuffer failed with return code of " << GetResultString((VkResult)result);
+		return nullptr;
+	}
+
+	vk::MemoryRequirements memoryRequirements = mDevice.getBufferMemoryRequirements(buffer);
+
+	if (!mMemoryAllocator.Allocate(memoryRequirements, (vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent), true, allocation))
+	{
+		BOOST_LOG_TRIVIAL(fatal) << "UploadManager::AllocateBuffer failed to allocate " << size << " bytes.";
+		mDevice.destroyBuffer(buffer, nullptr);
+		buffer = vk::Buffer();
+		return nullptr;
+	}
+
+	mDevice.bindBufferMemory(buffer, allocation.Memory, allocation.Offset);
+
+	return allocation.Data;
+}
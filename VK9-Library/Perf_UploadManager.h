@@ -0,0 +1,101 @@
+/*
+Copyright(c) 2018 Christopher Joseph Dean Schaefer
+
+This software is provided 'as-is', without any express or implied
+warranty.In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions :
+
+1. The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software.If you use this software
+in a product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include <memory>
+#include <vector>
+#include <chrono>
+#include <vulkan/vulkan.hpp>
+
+#include "Perf_MemoryAllocator.h"
+
+#ifndef UPLOADMANAGER_H
+#define UPLOADMANAGER_H
+
+/*
+A staging buffer too big for the ring. It lives until the batch that copies out of it has finished.
+*/
+struct UploadBuffer
+{
+	vk::Buffer Buffer;
+	MemoryAllocation Allocation;
+};
+
+/*
+One transfer command buffer worth of copies, barriers & blits.
+The ring position is where the ring head was when the batch was submitted so everything before it can be reused once the fence signals.
+*/
+struct UploadBatch
+{
+	vk::CommandBuffer CommandBuffer;
+	vk::Fence Fence;
+	uint64_t Serial = 0;
+	uint64_t RingPosition = 0;
+	bool IsRecording = false;
+	bool IsSubmitted = false;
+	std::vector<UploadBuffer> Buffers;
+};
+
+/*
+Collects texture uploads and other transfer work for a window into one command buffer that is submitted ahead of the next frame instead of draining the queue for every upload.
+Upload data is written into a persistently mapped staging ring and the space is handed back when the batch that read it has finished on the GPU.
+Everything here runs on the command stream thread.
+*/
+struct UploadManager
+{
+	vk::Device mDevice;
+	vk::Queue mQueue;
+	vk::CommandPool mCommandPool;
+	MemoryAllocator& mMemoryAllocator;
+
+	vk::Buffer mRingBuffer;
+	MemoryAllocation mRingAllocation;
+	vk::DeviceSize mRingSize = 0;
+	uint64_t mRingHead = 0; //Both positions only ever grow.
+	uint64_t mRingTail = 0;
+
+	std::vector<UploadBatch> mBatches;
+	size_t mCurrentBatch = 0;
+	uint64_t mSerial = 1; //Serial of the batch being recorded.
+	uint64_t mCompletedSerial = 0; //Every batch up to and including this one has finished on the GPU.
+
+	//Counters only touched by the command stream thread.
+	size_t mUploadCount = 0;
+	uint64_t mUploadBytes = 0;
+	size_t mSubmitCount = 0;
+	size_t mStallCount = 0;
+	size_t mOversizedCount = 0;
+	size_t mLastLoggedCount = 0;
+	std::chrono::steady_clock::time_point mLastLog = std::chrono::steady_clock::now();
+
+	UploadManager(vk::Device& device, vk::Queue& queue, vk::CommandPool& commandPool, MemoryAllocator& memoryAllocator, vk::DeviceSize ringSize, uint32_t batchCount);
+	~UploadManager();
+
+	char* Allocate(vk::DeviceSize size, vk::DeviceSize alignment, vk::Buffer& buffer, vk::DeviceSize& offset);
+	vk::CommandBuffer GetCommandBuffer();
+	void Submit();
+	void Wait(uint64_t serial);
+	void WaitIdle();
+	void LogStatistics(bool force = false);
+
+	void Retire(UploadBatch& batch);
+	char* AllocateBuffer(vk::DeviceSize size, vk::Buffer& buffer, MemoryAllocation& allocation);
+};
+
+#endif // UPLOADMANAGER_H
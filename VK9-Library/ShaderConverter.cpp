@@ -28,6 +28,7 @@ misrepresented as being the original software.
 
 #include "CDevice9.h"
 #include "Utilities.h"
+#include "Perf_ShaderOptimizer.h"
 
 /*
 http://timjones.io/blog/archive/2015/09/02/parsing-direct3d-shader-bytecode
@@ -49,15 +50,35 @@ const uint16_t mShaderTypeVertex = 0xFFFE;
     ((uint32_t)(uint8_t)(c3)))
 
 /*
-Generators magic number. It is associated with the tool that generated
+Generator�s magic number. It is associated with the tool that generated
 the module. Its value does not affect any semantics, and is allowed to be 0.
 Using a non-0 value is encouraged, and can be registered with
 Khronos at https://www.khronos.org/registry/spir-v/api/spir-v.xml.
 */
 #define SPIR_V_GENERATORS_NUMBER 0x00000000
 
-ShaderConverter::ShaderConverter(vk::Device& device, ShaderConstantSlots& shaderConstantSlots)
-	: mDevice(device), mShaderConstantSlots(shaderConstantSlots)
+size_t TypeDescriptionHasher::operator()(const TypeDescription& value) const
+{
+	uint64_t hash = HashStateWord(0, value.PrimaryType) ^ HashStateWord(1, value.SecondaryType) ^ HashStateWord(2, value.TernaryType) ^ HashStateWord(3, value.StorageClass) ^ HashStateWord(4, value.ComponentCount);
+	for (size_t i = 0; i < value.Arguments.size(); i++)
+	{
+		hash ^= HashStateWord(5 + i, value.Arguments[i]);
+	}
+	return (size_t)hash;
+}
+
+size_t ConstantDescriptionHasher::operator()(const ConstantDescription& value) const
+{
+	uint64_t hash = HashStateWord(0, value.Opcode) ^ HashStateWord(1, value.TypeId);
+	for (size_t i = 0; i < value.Values.size(); i++)
+	{
+		hash ^= HashStateWord(2 + i, value.Values[i]);
+	}
+	return (size_t)hash;
+}
+
+ShaderConverter::ShaderConverter(vk::Device& device, bool useConstantBuffer, bool optimize)
+	: mDevice(device), mUseConstantBuffer(useConstantBuffer), mOptimize(optimize)
 {
 
 }
@@ -150,12 +171,12 @@ uint32_t ShaderConverter::GetSpirVTypeId(TypeDescription& registerType, uint32_t
 	uint32_t sampledTypeId = 0;
 	uint32_t id2 = 0;
 
-	for (const auto& type : mTypeIdPairs)
+	const TypeDescription type = GetCanonicalType(registerType);
+
+	auto it = mTypeIdPairs.find(type);
+	if (it != mTypeIdPairs.end())
 	{
-		if (type.first == registerType)
-		{
-			return type.second;
-		}
+		return it->second;
 	}
 
 	if (id == UINT_MAX)
@@ -163,53 +184,46 @@ uint32_t ShaderConverter::GetSpirVTypeId(TypeDescription& registerType, uint32_t
 		id = GetNextId();
 	}
 
-	mTypeIdPairs[registerType] = id;
+	mTypeIdPairs[type] = id;
 	mIdTypePairs[id] = registerType;
 
-	switch (registerType.PrimaryType)
+	switch (type.PrimaryType)
 	{
 	case spv::OpTypeBool:
-		mTypeInstructions.push_back(Pack(2, registerType.PrimaryType)); //size,Type
+		mTypeInstructions.push_back(Pack(2, type.PrimaryType)); //size,Type
 		mTypeInstructions.push_back(id); //Id
 		break;
 	case spv::OpTypeInt:
-		mTypeInstructions.push_back(Pack(4, registerType.PrimaryType)); //size,Type
+		mTypeInstructions.push_back(Pack(4, type.PrimaryType)); //size,Type
 		mTypeInstructions.push_back(id); //Id
 		mTypeInstructions.push_back(32); //Number of bits.
 		mTypeInstructions.push_back(0); //Signedness (0 = unsigned,1 = signed)
 		break;
 	case spv::OpTypeFloat:
-		mTypeInstructions.push_back(Pack(3, registerType.PrimaryType)); //size,Type
+		mTypeInstructions.push_back(Pack(3, type.PrimaryType)); //size,Type
 		mTypeInstructions.push_back(id); //Id
 		mTypeInstructions.push_back(32); //Number of bits.
 		break;
 	case spv::OpTypeVector:
 		//Matrix and Vector type opcodes are laid out the same but exchange component for column.
 	case spv::OpTypeMatrix:
-		columnTypeId = GetSpirVTypeId(registerType.SecondaryType);
+		columnTypeId = GetSpirVTypeId(type.SecondaryType);
 
-		mTypeInstructions.push_back(Pack(4, registerType.PrimaryType)); //size,Type
+		mTypeInstructions.push_back(Pack(4, type.PrimaryType)); //size,Type
 		mTypeInstructions.push_back(id); //Id
 		mTypeInstructions.push_back(columnTypeId); //Component/Column Type
-		mTypeInstructions.push_back(registerType.ComponentCount);
+		mTypeInstructions.push_back(type.ComponentCount);
 		break;
 	case spv::OpTypePointer:
-		pointerTypeId = GetSpirVTypeId(registerType.SecondaryType, registerType.TernaryType, registerType.ComponentCount);
+		pointerTypeId = GetSpirVTypeId(type.SecondaryType, type.TernaryType, type.ComponentCount);
 
-		mTypeInstructions.push_back(Pack(4, registerType.PrimaryType)); //size,Type
+		mTypeInstructions.push_back(Pack(4, type.PrimaryType)); //size,Type
 		mTypeInstructions.push_back(id); //Id
-		if (registerType.SecondaryType == spv::OpTypeSampledImage || registerType.SecondaryType == spv::OpTypeImage)
-		{
-			mTypeInstructions.push_back(spv::StorageClassUniformConstant); //Storage Class
-		}
-		else
-		{
-			mTypeInstructions.push_back(registerType.StorageClass); //Storage Class
-		}
+		mTypeInstructions.push_back(type.StorageClass); //Storage Class (GetCanonicalType uses UniformConstant for images)
 		mTypeInstructions.push_back(pointerTypeId); // Type
 		break;
 	case spv::OpTypeSampler:
-		mTypeInstructions.push_back(Pack(2, registerType.PrimaryType)); //size,Type
+		mTypeInstructions.push_back(Pack(2, type.PrimaryType)); //size,Type
 		mTypeInstructions.push_back(id); //Id
 		break;
 	case spv::OpTypeSampledImage:
@@ -234,34 +248,79 @@ uint32_t ShaderConverter::GetSpirVTypeId(TypeDescription& registerType, uint32_t
 		break;
 	case spv::OpTypeFunction:
 	{
-		returnTypeId = GetSpirVTypeId(registerType.SecondaryType);
+		returnTypeId = GetSpirVTypeId(type.SecondaryType);
 
-		mTypeInstructions.push_back(Pack(3 + registerType.Arguments.size(), registerType.PrimaryType)); //size,Type
+		mTypeInstructions.push_back(Pack(3 + type.Arguments.size(), type.PrimaryType)); //size,Type
 		mTypeInstructions.push_back(id); //Id
 		mTypeInstructions.push_back(returnTypeId); //Return Type (Id)
 
-		//Right now there is no comparison on arguments so we are assuming that functions with the same return type are the same. This will need to be expanded later when we're using functions other than the default entry point.
-		for (size_t i = 0; i < registerType.Arguments.size(); i++)
+		for (size_t i = 0; i < type.Arguments.size(); i++)
 		{
-			mTypeInstructions.push_back(registerType.Arguments[i]); //Argument Id
+			mTypeInstructions.push_back(type.Arguments[i]); //Argument Id
 		}
 	}
 	break;
 	case spv::OpTypeVoid:
-		mTypeInstructions.push_back(Pack(2, registerType.PrimaryType)); //size,Type
+		mTypeInstructions.push_back(Pack(2, type.PrimaryType)); //size,Type
 		mTypeInstructions.push_back(id); //Id		
 		break;
 	default:
-		BOOST_LOG_TRIVIAL(warning) << "GetSpirVTypeId - Unsupported data type " << registerType.PrimaryType;
+		BOOST_LOG_TRIVIAL(warning) << "GetSpirVTypeId - Unsupported data type " << type.PrimaryType;
 		break;
 	}
 
-	mTypeIdPairs[registerType] = id;
+	mTypeIdPairs[type] = id; //Images hand back the sampled image rather than the id reserved above.
 	mIdTypePairs[id] = registerType;
 
 	return id;
 }
 
+uint32_t ShaderConverter::GetConstantId(uint32_t typeId, uint32_t value)
+{
+	ConstantDescription constant;
+
+	constant.Opcode = spv::OpConstant;
+	constant.TypeId = typeId;
+	constant.Values.push_back(value);
+
+	return GetConstantId(constant);
+}
+
+uint32_t ShaderConverter::GetConstantCompositeId(uint32_t typeId, uint32_t constituentId, uint32_t count)
+{
+	ConstantDescription constant;
+
+	constant.Opcode = spv::OpConstantComposite;
+	constant.TypeId = typeId;
+	constant.Values.assign(count, constituentId);
+
+	return GetConstantId(constant);
+}
+
+/*
+Constants are hash-consed like types so every value is only declared once no matter how many generators ask for it.
+Specialization constants aren't handled here because each one needs its own SpecId.
+*/
+uint32_t ShaderConverter::GetConstantId(const ConstantDescription& constant)
+{
+	auto it = mConstantIdPairs.find(constant);
+	if (it != mConstantIdPairs.end())
+	{
+		return it->second;
+	}
+
+	uint32_t id = GetNextId();
+
+	mTypeInstructions.push_back(Pack(3 + constant.Values.size(), constant.Opcode)); //size,Type
+	mTypeInstructions.push_back(constant.TypeId); //Result Type (Id)
+	mTypeInstructions.push_back(id); //Result (Id)
+	mTypeInstructions.insert(mTypeInstructions.end(), constant.Values.begin(), constant.Values.end()); //Literal Value or Constituents (Id)
+
+	mConstantIdPairs[constant] = id;
+
+	return id;
+}
+
 /*
 SPIR-V is SSA so this method will generate a new id with the type of the old one when a new "register" is needed.
 To handle this result registers will get a new Id each type. The result Id can be used as an input to other operations so this will work fine.
@@ -1523,11 +1582,7 @@ void ShaderConverter::GenerateYFlip()
 
 	uint32_t typeId = GetSpirVTypeId(spv::OpTypeFloat);
 
-	uint32_t negativeId = GetNextId();
-	mTypeInstructions.push_back(Pack(3 + 1, spv::OpConstant)); //size,Type
-	mTypeInstructions.push_back(typeId); //Result Type (Id)
-	mTypeInstructions.push_back(negativeId); //Result (Id)
-	mTypeInstructions.push_back(bit_cast(-1.0f)); //Literal Value
+	uint32_t negativeId = GetConstantId(typeId, bit_cast(-1.0f));
 
 	uint32_t positionYId = GetNextId();
 	mFunctionDefinitionInstructions.push_back(Pack(4, spv::OpLoad)); //size,Type
@@ -1756,15 +1811,10 @@ void ShaderConverter::GeneratePostition()
 	std::string registerName;
 	uint32_t stringWordSize = 0;
 
-	m0Id = GetNextId();
-	m1Id = GetNextId();
-	m2Id = GetNextId();
-	m3Id = GetNextId();
-
-	mTypeInstructions.push_back(Pack(3 + 1, spv::OpConstant)); //size,Type
-	mTypeInstructions.push_back(intTypeId); //Result Type (Id)
-	mTypeInstructions.push_back(m0Id); //Result (Id)
-	mTypeInstructions.push_back(0); //Literal Value
+	m0Id = GetConstantId(intTypeId, 0);
+	m1Id = GetConstantId(intTypeId, 1);
+	m2Id = GetConstantId(intTypeId, 2);
+	m3Id = GetConstantId(intTypeId, 3);
 
 	registerName = "int_0";
 	stringWordSize = 3 + (registerName.length() / 4);
@@ -1772,33 +1822,18 @@ void ShaderConverter::GeneratePostition()
 	mNameInstructions.push_back(m0Id); //target (Id)
 	PutStringInVector(registerName, mNameInstructions); //Literal
 
-	mTypeInstructions.push_back(Pack(3 + 1, spv::OpConstant)); //size,Type
-	mTypeInstructions.push_back(intTypeId); //Result Type (Id)
-	mTypeInstructions.push_back(m1Id); //Result (Id)
-	mTypeInstructions.push_back(1); //Literal Value
-
 	registerName = "int_1";
 	stringWordSize = 3 + (registerName.length() / 4);
 	mNameInstructions.push_back(Pack(stringWordSize, spv::OpName));
 	mNameInstructions.push_back(m1Id); //target (Id)
 	PutStringInVector(registerName, mNameInstructions); //Literal
 
-	mTypeInstructions.push_back(Pack(3 + 1, spv::OpConstant)); //size,Type
-	mTypeInstructions.push_back(intTypeId); //Result Type (Id)
-	mTypeInstructions.push_back(m2Id); //Result (Id)
-	mTypeInstructions.push_back(2); //Literal Value
-
 	registerName = "int_2";
 	stringWordSize = 3 + (registerName.length() / 4);
 	mNameInstructions.push_back(Pack(stringWordSize, spv::OpName));
 	mNameInstructions.push_back(m2Id); //target (Id)
 	PutStringInVector(registerName, mNameInstructions); //Literal
 
-	mTypeInstructions.push_back(Pack(3 + 1, spv::OpConstant)); //size,Type
-	mTypeInstructions.push_back(intTypeId); //Result Type (Id)
-	mTypeInstructions.push_back(m3Id); //Result (Id)
-	mTypeInstructions.push_back(3); //Literal Value
-
 	registerName = "int_3";
 	stringWordSize = 3 + (registerName.length() / 4);
 	mNameInstructions.push_back(Pack(stringWordSize, spv::OpName));
@@ -2009,31 +2044,19 @@ void ShaderConverter::GenerateDecoration(uint32_t registerNumber, uint32_t input
 
 void ShaderConverter::Generate255Constants()
 {
-	uint32_t compositeTypeId = 0;
-	uint32_t typeId = 0;
-	uint32_t compositeId = GetNextId();
-	uint32_t id = GetNextId();
-
-	compositeTypeId = GetSpirVTypeId(spv::OpTypeVector, spv::OpTypeFloat, 4);
-	typeId = GetSpirVTypeId(spv::OpTypeFloat);
-
-	mTypeInstructions.push_back(Pack(3 + 1, spv::OpConstant)); //size,Type
-	mTypeInstructions.push_back(typeId); //Result Type (Id)
-	mTypeInstructions.push_back(id); //Result (Id)
-	mTypeInstructions.push_back(bit_cast(255.0f)); //Literal Value
-
-	mTypeInstructions.push_back(Pack(3 + 4, spv::OpConstantComposite)); //size,Type
-	mTypeInstructions.push_back(compositeTypeId); //Result Type (Id)
-	mTypeInstructions.push_back(compositeId); //Result (Id)
-	mTypeInstructions.push_back(id); // Value (Id)
-	mTypeInstructions.push_back(id); // Value (Id)
-	mTypeInstructions.push_back(id); // Value (Id)
-	mTypeInstructions.push_back(id); // Value (Id)
+	uint32_t compositeTypeId = GetSpirVTypeId(spv::OpTypeVector, spv::OpTypeFloat, 4);
+	uint32_t typeId = GetSpirVTypeId(spv::OpTypeFloat);
+	uint32_t id = GetConstantId(typeId, bit_cast(255.0f));
+	uint32_t compositeId = GetConstantCompositeId(compositeTypeId, id, 4);
 
 	m255FloatId = id;
 	m255VectorId = compositeId;
 }
 
+/*
+Declares the constant registers found by FindConstantUsage as specialization constants.
+Registers the shader never reads are left out and their spec ids are skipped so the ids still line up with ShaderConstantSlots.
+*/
 void ShaderConverter::GenerateConstantBlock()
 {
 	TypeDescription typeDescription; //OpTypeVoid isn't 0 so ={} borks things.
@@ -2058,6 +2081,12 @@ void ShaderConverter::GenerateConstantBlock()
 		uint32_t id;
 		uint32_t ids[4];
 
+		if (!mConstantUsage.Integer[i])
+		{
+			specId += 4;
+			continue;
+		}
+
 		id = GetNextId();
 		for (size_t j = 0; j < 4; j++)
 		{
@@ -2105,6 +2134,12 @@ void ShaderConverter::GenerateConstantBlock()
 	{
 		uint32_t id;
 
+		if (!mConstantUsage.Boolean[i])
+		{
+			specId++;
+			continue;
+		}
+
 		id = GetNextId();
 
 		mTypeInstructions.push_back(Pack(3 + 1, spv::OpSpecConstant)); //size,Type
@@ -2147,6 +2182,12 @@ void ShaderConverter::GenerateConstantBlock()
 		uint32_t id;
 		uint32_t ids[4];
 
+		if (!mConstantUsage.Float[i])
+		{
+			specId += 4;
+			continue;
+		}
+
 		id = GetNextId();
 		for (size_t j = 0; j < 4; j++)
 		{
@@ -2186,6 +2227,245 @@ void ShaderConverter::GenerateConstantBlock()
 	}
 }
 
+/*
+Declares the constant registers as a uniform block instead of specialization constants so changing a constant doesn't require a new pipeline.
+The block has the same layout as ShaderConstantSlots. (set 1, binding 0 for vertex shaders and binding 1 for pixel shaders)
+Only the registers found by FindConstantUsage are loaded at the top of the entry point so a shader doesn't carry hundreds of dead loads.
+*/
+void ShaderConverter::GenerateConstantBuffer()
+{
+	TypeDescription pointerType;
+	std::string registerName;
+	uint32_t stringWordSize = 0;
+
+	uint32_t intTypeId = GetSpirVTypeId(spv::OpTypeInt);
+	uint32_t integerVectorTypeId = GetSpirVTypeId(spv::OpTypeVector, spv::OpTypeInt, 4);
+	uint32_t floatVectorTypeId = GetSpirVTypeId(spv::OpTypeVector, spv::OpTypeFloat, 4);
+
+	pointerType.PrimaryType = spv::OpTypePointer;
+	pointerType.SecondaryType = spv::OpTypeInt;
+	pointerType.StorageClass = spv::StorageClassUniform;
+	uint32_t intPointerTypeId = GetSpirVTypeId(pointerType);
+
+	pointerType.SecondaryType = spv::OpTypeVector;
+	pointerType.TernaryType = spv::OpTypeInt;
+	pointerType.ComponentCount = 4;
+	uint32_t integerVectorPointerTypeId = GetSpirVTypeId(pointerType);
+
+	pointerType.TernaryType = spv::OpTypeFloat;
+	uint32_t floatVectorPointerTypeId = GetSpirVTypeId(pointerType);
+
+	//Indexes used for array lengths and access chains. The rest are declared as the used registers need them.
+	uint32_t indexIds[5];
+	for (uint32_t i = 0; i < 5; i++)
+	{
+		indexIds[i] = GetConstantId(intTypeId, i);
+	}
+	uint32_t lengthIds[2] = { GetConstantId(intTypeId, 16), GetConstantId(intTypeId, 256) };
+
+	//The bools are packed 4 to a vector to keep the std140 array stride from padding them.
+	uint32_t integerArrayTypeId = GetNextId();
+	uint32_t booleanArrayTypeId = GetNextId();
+	uint32_t floatArrayTypeId = GetNextId();
+	uint32_t constantBufferTypeId = GetNextId();
+	uint32_t constantBufferPointerTypeId = GetNextId();
+	uint32_t constantBufferId = GetNextId();
+
+	mTypeInstructions.push_back(Pack(4, spv::OpTypeArray)); //size,Type
+	mTypeInstructions.push_back(integerArrayTypeId); //Result (Id)
+	mTypeInstructions.push_back(integerVectorTypeId); //Element Type (Id)
+	mTypeInstructions.push_back(lengthIds[0]); //Length (Id)
+
+	mTypeInstructions.push_back(Pack(4, spv::OpTypeArray)); //size,Type
+	mTypeInstructions.push_back(booleanArrayTypeId); //Result (Id)
+	mTypeInstructions.push_back(integerVectorTypeId); //Element Type (Id)
+	mTypeInstructions.push_back(indexIds[4]); //Length (Id)
+
+	mTypeInstructions.push_back(Pack(4, spv::OpTypeArray)); //size,Type
+	mTypeInstructions.push_back(floatArrayTypeId); //Result (Id)
+	mTypeInstructions.push_back(floatVectorTypeId); //Element Type (Id)
+	mTypeInstructions.push_back(lengthIds[1]); //Length (Id)
+
+	mTypeInstructions.push_back(Pack(2 + 3, spv::OpTypeStruct)); //size,Type
+	mTypeInstructions.push_back(constantBufferTypeId); //Result (Id)
+	mTypeInstructions.push_back(integerArrayTypeId); //Member 0 type (Id)
+	mTypeInstructions.push_back(booleanArrayTypeId); //Member 1 type (Id)
+	mTypeInstructions.push_back(floatArrayTypeId); //Member 2 type (Id)
+
+	mDecorateInstructions.push_back(Pack(3 + 1, spv::OpDecorate)); //size,Type
+	mDecorateInstructions.push_back(integerArrayTypeId); //target (Id)
+	mDecorateInstructions.push_back(spv::DecorationArrayStride); //Decoration Type (Id)
+	mDecorateInstructions.push_back(sizeof(uint32_t) * 4);
+
+	mDecorateInstructions.push_back(Pack(3 + 1, spv::OpDecorate)); //size,Type
+	mDecorateInstructions.push_back(booleanArrayTypeId); //target (Id)
+	mDecorateInstructions.push_back(spv::DecorationArrayStride); //Decoration Type (Id)
+	mDecorateInstructions.push_back(sizeof(BOOL) * 4);
+
+	mDecorateInstructions.push_back(Pack(3 + 1, spv::OpDecorate)); //size,Type
+	mDecorateInstructions.push_back(floatArrayTypeId); //target (Id)
+	mDecorateInstructions.push_back(spv::DecorationArrayStride); //Decoration Type (Id)
+	mDecorateInstructions.push_back(sizeof(float) * 4);
+
+	mDecorateInstructions.push_back(Pack(3, spv::OpDecorate)); //size,Type
+	mDecorateInstructions.push_back(constantBufferTypeId); //target (Id)
+	mDecorateInstructions.push_back(spv::DecorationBlock); //Decoration Type (Id)
+
+	//Set member offsets
+	mDecorateInstructions.push_back(Pack(4 + 1, spv::OpMemberDecorate)); //size,Type
+	mDecorateInstructions.push_back(constantBufferTypeId); //target (Id)
+	mDecorateInstructions.push_back(0); //Member (Literal)
+	mDecorateInstructions.push_back(spv::DecorationOffset); //Decoration Type (Id)
+	mDecorateInstructions.push_back(offsetof(ShaderConstantSlots, IntegerConstants));
+
+	mDecorateInstructions.push_back(Pack(4 + 1, spv::OpMemberDecorate)); //size,Type
+	mDecorateInstructions.push_back(constantBufferTypeId); //target (Id)
+	mDecorateInstructions.push_back(1); //Member (Literal)
+	mDecorateInstructions.push_back(spv::DecorationOffset); //Decoration Type (Id)
+	mDecorateInstructions.push_back(offsetof(ShaderConstantSlots, BooleanConstants));
+
+	mDecorateInstructions.push_back(Pack(4 + 1, spv::OpMemberDecorate)); //size,Type
+	mDecorateInstructions.push_back(constantBufferTypeId); //target (Id)
+	mDecorateInstructions.push_back(2); //Member (Literal)
+	mDecorateInstructions.push_back(spv::DecorationOffset); //Decoration Type (Id)
+	mDecorateInstructions.push_back(offsetof(ShaderConstantSlots, FloatConstants));
+
+	registerName = "ShaderConstants";
+	stringWordSize = 3 + (registerName.length() / 4);
+	mNameInstructions.push_back(Pack(stringWordSize, spv::OpName));
+	mNameInstructions.push_back(constantBufferTypeId); //target (Id)
+	PutStringInVector(registerName, mNameInstructions); //Literal
+
+	//Create Pointer type and variable
+	mTypeInstructions.push_back(Pack(4, spv::OpTypePointer)); //size,Type
+	mTypeInstructions.push_back(constantBufferPointerTypeId); //Result (Id)
+	mTypeInstructions.push_back(spv::StorageClassUniform); //Storage Class
+	mTypeInstructions.push_back(constantBufferTypeId); //type (Id)
+
+	mTypeInstructions.push_back(Pack(4, spv::OpVariable)); //size,Type
+	mTypeInstructions.push_back(constantBufferPointerTypeId); //ResultType (Id) Must be OpTypePointer with the pointer's type being what you care about.
+	mTypeInstructions.push_back(constantBufferId); //Result (Id)
+	mTypeInstructions.push_back(spv::StorageClassUniform); //Storage Class
+
+	mDecorateInstructions.push_back(Pack(3 + 1, spv::OpDecorate)); //size,Type
+	mDecorateInstructions.push_back(constantBufferId); //target (Id)
+	mDecorateInstructions.push_back(spv::DecorationDescriptorSet); //Decoration Type (Id)
+	mDecorateInstructions.push_back(1);
+
+	mDecorateInstructions.push_back(Pack(3 + 1, spv::OpDecorate)); //size,Type
+	mDecorateInstructions.push_back(constantBufferId); //target (Id)
+	mDecorateInstructions.push_back(spv::DecorationBinding); //Decoration Type (Id)
+	mDecorateInstructions.push_back(mIsVertexShader ? 0 : 1);
+
+	registerName = "SC";
+	stringWordSize = 3 + (registerName.length() / 4);
+	mNameInstructions.push_back(Pack(stringWordSize, spv::OpName));
+	mNameInstructions.push_back(constantBufferId); //target (Id)
+	PutStringInVector(registerName, mNameInstructions); //Literal
+
+	//--------------Integer-----------------------------
+	for (uint32_t i = 0; i < 16; i++)
+	{
+		if (!mConstantUsage.Integer[i])
+		{
+			continue;
+		}
+
+		uint32_t indexId = GetConstantId(intTypeId, i);
+		uint32_t pointerId = GetNextId();
+		uint32_t id = GetNextId();
+
+		mFunctionDefinitionInstructions.push_back(Pack(4 + 2, spv::OpAccessChain)); //size,Type
+		mFunctionDefinitionInstructions.push_back(integerVectorPointerTypeId); //Result Type (Id)
+		mFunctionDefinitionInstructions.push_back(pointerId); //Result (Id)
+		mFunctionDefinitionInstructions.push_back(constantBufferId); //Base (Id)
+		mFunctionDefinitionInstructions.push_back(indexIds[0]); //Indexes (Id)
+		mFunctionDefinitionInstructions.push_back(indexId); //Indexes (Id)
+
+		mFunctionDefinitionInstructions.push_back(Pack(4, spv::OpLoad)); //size,Type
+		mFunctionDefinitionInstructions.push_back(integerVectorTypeId); //Result Type (Id)
+		mFunctionDefinitionInstructions.push_back(id); //result (Id)
+		mFunctionDefinitionInstructions.push_back(pointerId); //pointer (Id)
+
+		registerName = "i" + std::to_string(i);
+		stringWordSize = 3 + (registerName.length() / 4);
+		mNameInstructions.push_back(Pack(stringWordSize, spv::OpName));
+		mNameInstructions.push_back(id); //target (Id)
+		PutStringInVector(registerName, mNameInstructions); //Literal
+
+		mIdsByRegister[D3DSPR_CONSTINT][i] = id;
+		mRegistersById[D3DSPR_CONSTINT][id] = i;
+	}
+
+	//---------------Boolean------------------------------------
+	for (uint32_t i = 0; i < 16; i++)
+	{
+		if (!mConstantUsage.Boolean[i])
+		{
+			continue;
+		}
+
+		uint32_t pointerId = GetNextId();
+		uint32_t id = GetNextId();
+
+		mFunctionDefinitionInstructions.push_back(Pack(4 + 3, spv::OpAccessChain)); //size,Type
+		mFunctionDefinitionInstructions.push_back(intPointerTypeId); //Result Type (Id)
+		mFunctionDefinitionInstructions.push_back(pointerId); //Result (Id)
+		mFunctionDefinitionInstructions.push_back(constantBufferId); //Base (Id)
+		mFunctionDefinitionInstructions.push_back(indexIds[1]); //Indexes (Id)
+		mFunctionDefinitionInstructions.push_back(indexIds[i / 4]); //Indexes (Id)
+		mFunctionDefinitionInstructions.push_back(indexIds[i % 4]); //Indexes (Id)
+
+		mFunctionDefinitionInstructions.push_back(Pack(4, spv::OpLoad)); //size,Type
+		mFunctionDefinitionInstructions.push_back(intTypeId); //Result Type (Id)
+		mFunctionDefinitionInstructions.push_back(id); //result (Id)
+		mFunctionDefinitionInstructions.push_back(pointerId); //pointer (Id)
+
+		registerName = "b" + std::to_string(i);
+		stringWordSize = 3 + (registerName.length() / 4);
+		mNameInstructions.push_back(Pack(stringWordSize, spv::OpName));
+		mNameInstructions.push_back(id); //target (Id)
+		PutStringInVector(registerName, mNameInstructions); //Literal
+
+		mIdsByRegister[D3DSPR_CONSTBOOL][i] = id;
+		mRegistersById[D3DSPR_CONSTBOOL][id] = i;
+	}
+
+	//--------------Float-----------------------------
+	for (uint32_t i = 0; i < 256; i++)
+	{
+		if (!mConstantUsage.Float[i])
+		{
+			continue;
+		}
+
+		uint32_t indexId = GetConstantId(intTypeId, i);
+		uint32_t pointerId = GetNextId();
+		uint32_t id = GetNextId();
+
+		mFunctionDefinitionInstructions.push_back(Pack(4 + 2, spv::OpAccessChain)); //size,Type
+		mFunctionDefinitionInstructions.push_back(floatVectorPointerTypeId); //Result Type (Id)
+		mFunctionDefinitionInstructions.push_back(pointerId); //Result (Id)
+		mFunctionDefinitionInstructions.push_back(constantBufferId); //Base (Id)
+		mFunctionDefinitionInstructions.push_back(indexIds[2]); //Indexes (Id)
+		mFunctionDefinitionInstructions.push_back(indexId); //Indexes (Id)
+
+		mFunctionDefinitionInstructions.push_back(Pack(4, spv::OpLoad)); //size,Type
+		mFunctionDefinitionInstructions.push_back(floatVectorTypeId); //Result Type (Id)
+		mFunctionDefinitionInstructions.push_back(id); //result (Id)
+		mFunctionDefinitionInstructions.push_back(pointerId); //pointer (Id)
+
+		registerName = "c" + std::to_string(i);
+		stringWordSize = 3 + (registerName.length() / 4);
+		mNameInstructions.push_back(Pack(stringWordSize, spv::OpName));
+		mNameInstructions.push_back(id); //target (Id)
+		PutStringInVector(registerName, mNameInstructions); //Literal
+
+		mIdsByRegister[D3DSPR_CONST][i] = id;
+		mRegistersById[D3DSPR_CONST][id] = i;
+	}
+}
+
 void ShaderConverter::CombineSpirVOpCodes()
 {
 	mInstructions.insert(std::end(mInstructions), std::begin(mCapabilityInstructions), std::end(mCapabilityInstructions));
@@ -2268,6 +2548,83 @@ void ShaderConverter::CreateSpirVModule()
 	}
 }
 
+void ShaderConverter::ApplyConstantDefinitions(ShaderConstantSlots& shaderConstantSlots) const
+{
+	for (const auto& definition : mConstantDefinitions)
+	{
+		switch (definition.Opcode)
+		{
+		case D3DSIO_DEF:
+			for (size_t i = 0; i < 4; i++)
+			{
+				shaderConstantSlots.FloatConstants[definition.Register * 4 + i] = bit_cast(definition.Values[i]);
+			}
+			break;
+		case D3DSIO_DEFI:
+			for (size_t i = 0; i < 4; i++)
+			{
+				shaderConstantSlots.IntegerConstants[definition.Register * 4 + i] = definition.Values[i];
+			}
+			break;
+		case D3DSIO_DEFB:
+			shaderConstantSlots.BooleanConstants[definition.Register] = definition.Values[0];
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+/*
+Finds the constant registers the shader reads and the specialization map entries for them.
+The spec ids match the layout of ShaderConstantSlots so a register keeps its id whether or not its neighbours are declared.
+*/
+void ShaderConverter::FindConstantUsage(const uint32_t* shader)
+{
+	mConstantUsage = {};
+	GetConstantUsage(shader, mConstantUsage);
+
+	auto& mapEntries = mConvertedShader.mSpecializationMapEntries;
+	mapEntries.clear();
+
+	if (mUseConstantBuffer)
+	{
+		return; //The registers come from the constant ring so nothing is specialized.
+	}
+
+	mapEntries.reserve((mConstantUsage.Integer.count() + mConstantUsage.Float.count()) * 4 + mConstantUsage.Boolean.count());
+
+	for (uint32_t i = 0; i < 16; i++)
+	{
+		if (mConstantUsage.Integer[i])
+		{
+			for (uint32_t j = 0; j < 4; j++)
+			{
+				mapEntries.push_back(vk::SpecializationMapEntry(i * 4 + j, (uint32_t)offsetof(ShaderConstantSlots, IntegerConstants) + (i * 4 + j) * sizeof(uint32_t), sizeof(uint32_t)));
+			}
+		}
+	}
+
+	for (uint32_t i = 0; i < 16; i++)
+	{
+		if (mConstantUsage.Boolean[i])
+		{
+			mapEntries.push_back(vk::SpecializationMapEntry(64 + i, (uint32_t)offsetof(ShaderConstantSlots, BooleanConstants) + i * sizeof(BOOL), sizeof(BOOL)));
+		}
+	}
+
+	for (uint32_t i = 0; i < 256; i++)
+	{
+		if (mConstantUsage.Float[i])
+		{
+			for (uint32_t j = 0; j < 4; j++)
+			{
+				mapEntries.push_back(vk::SpecializationMapEntry(80 + i * 4 + j, (uint32_t)offsetof(ShaderConstantSlots, FloatConstants) + (i * 4 + j) * sizeof(float), sizeof(float)));
+			}
+		}
+	}
+}
+
 void ShaderConverter::Process_DCL_Pixel()
 {
 	Token token = GetNextToken();
@@ -2714,15 +3071,14 @@ void ShaderConverter::Process_DCL()
 
 void ShaderConverter::Process_DEF()
 {
-	DWORD literalValue;
 	Token token = GetNextToken();
 	_D3DSHADER_PARAM_REGISTER_TYPE registerType = GetRegisterType(token.i);
 	DestinationParameterToken  destinationParameterToken = token.DestinationParameterToken;
 
+	//The literals are written to the constant slots by whoever creates the shader so conversion doesn't touch device state.
 	for (size_t i = 0; i < 4; i++)
 	{
-		literalValue = GetNextToken().i;
-		mShaderConstantSlots.FloatConstants[token.DestinationParameterToken.RegisterNumber * 4 + i] = bit_cast(literalValue);
+		GetNextToken();
 	}
 
 	PrintTokenInformation("DEF", token, token, token);
@@ -2730,15 +3086,13 @@ void ShaderConverter::Process_DEF()
 
 void ShaderConverter::Process_DEFI()
 {
-	DWORD literalValue;
 	Token token = GetNextToken();
 	_D3DSHADER_PARAM_REGISTER_TYPE registerType = GetRegisterType(token.i);
 	DestinationParameterToken  destinationParameterToken = token.DestinationParameterToken;
 
 	for (size_t i = 0; i < 4; i++)
 	{
-		literalValue = GetNextToken().i;
-		mShaderConstantSlots.IntegerConstants[token.DestinationParameterToken.RegisterNumber * 4 + i] = literalValue;
+		GetNextToken();
 	}
 
 	PrintTokenInformation("DEFI", token, token, token);
@@ -2746,13 +3100,11 @@ void ShaderConverter::Process_DEFI()
 
 void ShaderConverter::Process_DEFB()
 {
-	DWORD literalValue;
 	Token token = GetNextToken();
 	_D3DSHADER_PARAM_REGISTER_TYPE registerType = GetRegisterType(token.i);
 	DestinationParameterToken  destinationParameterToken = token.DestinationParameterToken;
 
-	literalValue = GetNextToken().i;
-	mShaderConstantSlots.BooleanConstants[token.DestinationParameterToken.RegisterNumber * 4] = literalValue;
+	GetNextToken();
 
 	PrintTokenInformation("DEFB", token, token, token);
 }
@@ -4694,7 +5046,12 @@ ConvertedShader ShaderConverter::Convert(uint32_t* shader)
 	mSourceExtensionInstructions.push_back(Pack(stringWordSize, spv::OpSourceExtension)); //size,Type
 	PutStringInVector(sourceExtension4, mSourceExtensionInstructions);
 
-	GenerateConstantBlock();
+	//Both the specialization constants and the constant buffer loads are limited to the registers the shader reads.
+	FindConstantUsage(shader);
+	if (!mUseConstantBuffer)
+	{
+		GenerateConstantBlock();
+	}
 
 	//Start of entry point
 	mEntryPointTypeId = GetNextId();
@@ -4716,6 +5073,11 @@ ConvertedShader ShaderConverter::Convert(uint32_t* shader)
 
 	Generate255Constants();
 
+	if (mUseConstantBuffer)
+	{
+		GenerateConstantBuffer(); //The loads have to be inside of the function so this goes after the label.
+	}
+
 	if (mIsVertexShader)
 	{
 		GeneratePushConstant();
@@ -5065,6 +5427,12 @@ ConvertedShader ShaderConverter::Convert(uint32_t* shader)
 	//Dump other opcodes into instruction collection is required order.
 	CombineSpirVOpCodes();
 
+	if (mOptimize)
+	{
+		ShaderOptimizer optimizer;
+		optimizer.Optimize(mInstructions);
+	}
+
 	//Pass the word blob to Vulkan to generate a module.
 	CreateSpirVModule();
 
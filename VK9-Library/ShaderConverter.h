@@ -26,6 +26,9 @@ misrepresented as being the original software.
 #include <vulkan/vulkan.hpp>
 #include <vector>
 #include <stack>
+#include <atomic>
+#include <bitset>
+#include <unordered_map>
 #include <boost/log/trivial.hpp>
 #include <boost/container/flat_map.hpp>
 #include <spirv.hpp>
@@ -40,6 +43,9 @@ https://msdn.microsoft.com/en-us/library/windows/hardware/ff552891(v=vs.85).aspx
 https://github.com/ValveSoftware/ToGL
 */
 
+//Bump whenever the generated SPIR-V or ConvertedShader changes so shaders cached on disk are converted again.
+#define SHADER_CONVERTER_VERSION 4
+
 #define PACK(c0, c1, c2, c3) \
     (((uint32_t)(uint8_t)(c0) << 24) | \
     ((uint32_t)(uint8_t)(c1) << 16) | \
@@ -54,6 +60,7 @@ struct ConvertedShader
 	vk::VertexInputAttributeDescription mVertexInputAttributeDescription[32];
 	uint32_t mDescriptorSetLayoutBindingCount = 0;
 	vk::DescriptorSetLayoutBinding mDescriptorSetLayoutBinding[16];
+	std::vector<vk::SpecializationMapEntry> mSpecializationMapEntries; //Only the constant registers the shader reads, offsets are into ShaderConstantSlots.
 
 	//Actual Payload
 	UINT Size = 0;
@@ -117,87 +124,91 @@ struct TypeDescription
 
 	bool operator ==(const TypeDescription &value) const
 	{
-		switch (this->PrimaryType)
-		{
-		case spv::OpTypeBool:
-		case spv::OpTypeInt:
-		case spv::OpTypeFloat:
-		case spv::OpTypeSampler:
-		case spv::OpTypeImage:
-		case spv::OpTypeVoid:
-			return this->PrimaryType == value.PrimaryType;
-		case spv::OpTypeVector:
-		case spv::OpTypeMatrix:
-			return this->PrimaryType == value.PrimaryType && this->SecondaryType == value.SecondaryType && this->ComponentCount == value.ComponentCount;
-		case spv::OpTypePointer:
-			return this->PrimaryType == value.PrimaryType && this->SecondaryType == value.SecondaryType && this->TernaryType == value.TernaryType && this->ComponentCount == value.ComponentCount && this->StorageClass == value.StorageClass;
-		case spv::OpTypeFunction:
-			return this->PrimaryType == value.PrimaryType && this->SecondaryType == value.SecondaryType && this->TernaryType == value.TernaryType;
-		default:
-			BOOST_LOG_TRIVIAL(warning) << "operator == - Unsupported data type " << this->PrimaryType;
-			return false;
-			break;
-		}
+		return this->PrimaryType == value.PrimaryType && this->SecondaryType == value.SecondaryType && this->TernaryType == value.TernaryType && this->StorageClass == value.StorageClass && this->ComponentCount == value.ComponentCount && this->Arguments == value.Arguments;
 	}
 
 	bool operator !=(const TypeDescription &value) const
 	{
-		switch (this->PrimaryType)
-		{
-		case spv::OpTypeBool:
-		case spv::OpTypeInt:
-		case spv::OpTypeFloat:
-		case spv::OpTypeSampler:
-		case spv::OpTypeImage:
-		case spv::OpTypeVoid:
-			return this->PrimaryType != value.PrimaryType;
-		case spv::OpTypeVector:
-		case spv::OpTypeMatrix:
-			return this->PrimaryType != value.PrimaryType || this->SecondaryType != value.SecondaryType || this->ComponentCount != value.ComponentCount;
-		case spv::OpTypePointer:
-			return this->PrimaryType != value.PrimaryType || this->SecondaryType != value.SecondaryType || this->TernaryType != value.TernaryType || this->ComponentCount != value.ComponentCount || this->StorageClass != value.StorageClass;
-		case spv::OpTypeFunction:
-			return this->PrimaryType != value.PrimaryType || this->SecondaryType != value.SecondaryType || this->TernaryType != value.TernaryType;
-		default:
-			BOOST_LOG_TRIVIAL(warning) << "operator != - Unsupported data type " << this->PrimaryType;
-			return false;
-			break;
-		}
+		return !(*this == value);
 	}
+};
+
+/*
+Callers leave whatever they like in the fields a type doesn't use so only the fields that end up in the declaration are kept.
+That way descriptions for the same SPIR-V type compare equal and hash the same.
+*/
+inline TypeDescription GetCanonicalType(const TypeDescription& type)
+{
+	TypeDescription result;
+	TypeDescription pointee;
 
-	bool operator <(const TypeDescription &value) const
+	result.PrimaryType = type.PrimaryType;
+
+	switch (type.PrimaryType)
 	{
-		switch (this->PrimaryType)
-		{
-		case spv::OpTypeBool:
-		case spv::OpTypeInt:
-		case spv::OpTypeFloat:
-		case spv::OpTypeSampler:
-		case spv::OpTypeImage:
-		case spv::OpTypeVoid:
-			return this->PrimaryType < value.PrimaryType;
-		case spv::OpTypeVector:
-		case spv::OpTypeMatrix:
-			return this->PrimaryType < value.PrimaryType || this->SecondaryType < value.SecondaryType || this->ComponentCount < value.ComponentCount;
-		case spv::OpTypePointer:
-			return this->PrimaryType < value.PrimaryType || this->SecondaryType < value.SecondaryType || this->TernaryType < value.TernaryType || this->ComponentCount < value.ComponentCount || this->StorageClass < value.StorageClass;
-		case spv::OpTypeFunction:
-			return this->PrimaryType < value.PrimaryType || this->SecondaryType < value.SecondaryType || this->TernaryType < value.TernaryType;
-		default:
-			BOOST_LOG_TRIVIAL(warning) << "operator < - Unsupported data type " << this->PrimaryType;
-			return false;
-		}
+	case spv::OpTypeBool:
+	case spv::OpTypeInt:
+	case spv::OpTypeFloat:
+	case spv::OpTypeSampler:
+	case spv::OpTypeImage:
+	case spv::OpTypeVoid:
+		break;
+	case spv::OpTypeSampledImage:
+		result.PrimaryType = spv::OpTypeImage; //Both declare the image & sampled image pair and return the sampled image.
+		break;
+	case spv::OpTypeVector:
+	case spv::OpTypeMatrix:
+		result.SecondaryType = type.SecondaryType;
+		result.ComponentCount = type.ComponentCount;
+		break;
+	case spv::OpTypePointer:
+		pointee.PrimaryType = type.SecondaryType;
+		pointee.SecondaryType = type.TernaryType;
+		pointee.ComponentCount = type.ComponentCount;
+		pointee = GetCanonicalType(pointee);
+
+		result.SecondaryType = pointee.PrimaryType;
+		result.TernaryType = pointee.SecondaryType;
+		result.ComponentCount = pointee.ComponentCount;
+		result.StorageClass = (pointee.PrimaryType == spv::OpTypeImage) ? spv::StorageClassUniformConstant : type.StorageClass;
+		break;
+	case spv::OpTypeFunction:
+		result.SecondaryType = type.SecondaryType;
+		result.Arguments = type.Arguments;
+		break;
+	default:
+		result = type;
+		break;
 	}
+
+	return result;
+}
+
+struct TypeDescriptionHasher
+{
+	size_t operator()(const TypeDescription& value) const;
 };
 
-struct TypeDescriptionComparator
+/*
+Key for the constant table. Values holds the literal words for OpConstant and the constituent ids for OpConstantComposite.
+*/
+struct ConstantDescription
 {
-	bool operator()(const TypeDescription& a, const TypeDescription& b) const
+	spv::Op Opcode = spv::OpConstant;
+	uint32_t TypeId = 0;
+	std::vector<uint32_t> Values;
+
+	bool operator ==(const ConstantDescription &value) const
 	{
-		return a < b;
+		return this->Opcode == value.Opcode && this->TypeId == value.TypeId && this->Values == value.Values;
 	}
 };
 
+struct ConstantDescriptionHasher
+{
+	size_t operator()(const ConstantDescription& value) const;
+};
+
 template<typename ...ArgumentType> inline void Pack(std::vector<uint32_t> instructions, ArgumentType... arguments)
 {
 	const size_t size = sizeof...(arguments);
@@ -358,6 +369,55 @@ inline uint32_t GetOpcodeData(uint32_t token)
 	return ((token & D3DSP_OPCODESPECIFICCONTROL_MASK) >> D3DSP_OPCODESPECIFICCONTROL_SHIFT);
 }
 
+/*
+Calls the function with the opcode token of every instruction and returns the number of DWORDs in the shader including the version & end tokens.
+D3D9 doesn't pass the size in so it has to be found by walking the instructions.
+*/
+template<typename Function>
+inline size_t ForEachInstruction(const uint32_t* shader, Function function)
+{
+	const uint32_t* token = shader;
+	uint32_t majorVersion = D3DSHADER_VERSION_MAJOR(*token);
+	token++;
+
+	while ((*token) != D3DPS_END())
+	{
+		uint32_t opcode = GetOpcode(*token);
+		if (opcode == D3DSIO_COMMENT)
+		{
+			token += (((*token) & D3DSI_COMMENTSIZE_MASK) >> D3DSI_COMMENTSIZE_SHIFT) + 1;
+			continue;
+		}
+
+		function(token);
+
+		if (majorVersion >= 2)
+		{
+			token += (((*token) & D3DSI_INSTLENGTH_MASK) >> D3DSI_INSTLENGTH_SHIFT) + 1;
+		}
+		else if (opcode == D3DSIO_DEF)
+		{
+			token += 6; //Opcode, destination, and 4 literals.
+		}
+		else
+		{
+			//Shader model 1 doesn't store lengths but parameter tokens always have the high bit set so they can be skipped until the next instruction.
+			token++;
+			while ((*token) & 0x80000000)
+			{
+				token++;
+			}
+		}
+	}
+
+	return (token - shader) + 1;
+}
+
+inline size_t GetTokenCount(const uint32_t* shader)
+{
+	return ForEachInstruction(shader, [](const uint32_t*) {});
+}
+
 inline uint32_t GetTextureType(uint32_t token)
 {
 	return (token & D3DSP_TEXTURETYPE_MASK); // Note this one doesn't shift due to weird D3DSAMPLER_TEXTURE_TYPE enum
@@ -417,19 +477,134 @@ inline void PrintTokenInformation(const char* tokenName, Token result, Token arg
 
 class CDevice9;
 
+/*
+A constant defined by the shader itself. These are written to the device's constant slots every time the bytecode is created.
+*/
+struct ShaderConstantDefinition
+{
+	uint32_t Opcode = D3DSIO_DEF; //D3DSIO_DEF, D3DSIO_DEFI, or D3DSIO_DEFB
+	uint32_t Register = 0;
+	DWORD Values[4] = {};
+};
+
+/*
+Pulls the def, defi, and defb instructions out without converting anything so they can be applied before translation finishes.
+*/
+inline void GetConstantDefinitions(const uint32_t* shader, std::vector<ShaderConstantDefinition>& definitions)
+{
+	ForEachInstruction(shader, [&definitions](const uint32_t* token)
+	{
+		uint32_t opcode = GetOpcode(*token);
+		if (opcode != D3DSIO_DEF && opcode != D3DSIO_DEFI && opcode != D3DSIO_DEFB)
+		{
+			return;
+		}
+
+		ShaderConstantDefinition definition;
+		definition.Opcode = opcode;
+		definition.Register = token[1] & D3DSP_REGNUM_MASK;
+		definition.Values[0] = token[2];
+		if (opcode != D3DSIO_DEFB)
+		{
+			definition.Values[1] = token[3];
+			definition.Values[2] = token[4];
+			definition.Values[3] = token[5];
+		}
+
+		definitions.push_back(definition);
+	});
+}
+
+/*
+The constant registers a shader reads. A register read with relative addressing could be any register of that type so the whole type is marked.
+*/
+struct ShaderConstantUsage
+{
+	std::bitset<16> Integer;
+	std::bitset<16> Boolean;
+	std::bitset<256> Float;
+};
+
+inline void GetConstantUsage(const uint32_t* shader, ShaderConstantUsage& usage)
+{
+	ForEachInstruction(shader, [&usage](const uint32_t* token)
+	{
+		uint32_t opcode = GetOpcode(*token);
+		if (opcode == D3DSIO_DEF || opcode == D3DSIO_DEFI || opcode == D3DSIO_DEFB || opcode == D3DSIO_DCL)
+		{
+			return; //A definition on its own doesn't need the register, an instruction still has to read it.
+		}
+
+		for (token++; (*token) & 0x80000000; token++)
+		{
+			uint32_t registerNumber = (*token) & D3DSP_REGNUM_MASK;
+			bool isRelative = (((*token) & D3DSHADER_ADDRESSMODE_MASK) == D3DSHADER_ADDRMODE_RELATIVE);
+
+			switch (GetRegisterType(*token))
+			{
+			case D3DSPR_CONST:
+				if (isRelative)
+				{
+					usage.Float.set();
+				}
+				else if (registerNumber < usage.Float.size())
+				{
+					usage.Float.set(registerNumber);
+				}
+				break;
+			case D3DSPR_CONSTINT:
+				if (isRelative)
+				{
+					usage.Integer.set();
+				}
+				else if (registerNumber < usage.Integer.size())
+				{
+					usage.Integer.set(registerNumber);
+				}
+				break;
+			case D3DSPR_CONSTBOOL:
+				if (isRelative)
+				{
+					usage.Boolean.set();
+				}
+				else if (registerNumber < usage.Boolean.size())
+				{
+					usage.Boolean.set(registerNumber);
+				}
+				break;
+			default:
+				break;
+			}
+		}
+	});
+}
+
 class ShaderConverter
 {
 protected:
 	vk::Device& mDevice;
-	ShaderConstantSlots& mShaderConstantSlots;
+	bool mUseConstantBuffer; //Read constant registers from the constant ring instead of specialization constants.
+	bool mOptimize; //Run ShaderOptimizer over the module before it is handed to the driver.
 public:
-	ShaderConverter(vk::Device& device, ShaderConstantSlots& shaderConstantSlots);
+	ShaderConverter(vk::Device& device, bool useConstantBuffer = false, bool optimize = false);
 	~ShaderConverter();
 
 	ConvertedShader Convert(uint32_t* shader);
+	void ApplyConstantDefinitions(ShaderConstantSlots& shaderConstantSlots) const;
+	void FindConstantUsage(const uint32_t* shader);
 	ConvertedShader mConvertedShader = {};
-private:
+
+	//Cache bookkeeping set by whoever owns the converter.
+	uint64_t mHash = 0;
+	uint64_t mDiskKey = 0;
+	std::vector<uint32_t> mTokens; //The D3D9 bytecode this was converted from so a hash collision can't hand out the wrong module.
+	std::vector<ShaderConstantDefinition> mConstantDefinitions;
+	ShaderConstantUsage mConstantUsage;
+	std::atomic_bool mIsReady = false; //Set once mConvertedShader & the module can be used, conversion may be running on another thread until then.
+
 	std::vector<uint32_t> mInstructions; //used to store the combined instructions for creating a module.
+	void CreateSpirVModule();
+protected: //VK9-Tests derives from the converter to check the type & constant tables.
 
 	boost::container::flat_map<D3DSHADER_PARAM_REGISTER_TYPE, boost::container::flat_map<uint32_t, uint32_t> > mRegistersById;
 	boost::container::flat_map<D3DSHADER_PARAM_REGISTER_TYPE, boost::container::flat_map<uint32_t, uint32_t> > mIdsByRegister;
@@ -438,7 +613,8 @@ private:
 	std::vector<uint32_t> mOutputRegisters;
 	boost::container::flat_map<_D3DDECLUSAGE, uint32_t> mOutputRegisterUsages;
 
-	boost::container::flat_map<TypeDescription, uint32_t> mTypeIdPairs;
+	std::unordered_map<TypeDescription, uint32_t, TypeDescriptionHasher> mTypeIdPairs; //Keyed by GetCanonicalType so every type is declared once.
+	std::unordered_map<ConstantDescription, uint32_t, ConstantDescriptionHasher> mConstantIdPairs;
 	boost::container::flat_map<uint32_t, TypeDescription> mIdTypePairs;
 
 	std::vector<uint32_t> mCapabilityInstructions;
@@ -516,6 +692,9 @@ private:
 	uint32_t GetSpirVTypeId(spv::Op registerType1, spv::Op registerType2, uint32_t componentCount);
 	uint32_t GetSpirVTypeId(spv::Op registerType1, spv::Op registerType2, spv::Op registerType3, uint32_t componentCount);
 	uint32_t GetSpirVTypeId(TypeDescription& registerType, uint32_t id = UINT_MAX);
+	uint32_t GetConstantId(uint32_t typeId, uint32_t value);
+	uint32_t GetConstantCompositeId(uint32_t typeId, uint32_t constituentId, uint32_t count);
+	uint32_t GetConstantId(const ConstantDescription& constant);
 	uint32_t GetNextVersionId(const Token& token);
 	uint32_t GetIdByRegister(const Token& token, _D3DSHADER_PARAM_REGISTER_TYPE type = D3DSPR_FORCE_DWORD, _D3DDECLUSAGE usage = D3DDECLUSAGE_TEXCOORD);
 	void SetIdByRegister(const Token& token, uint32_t id);
@@ -529,8 +708,8 @@ private:
 	void GenerateDecoration(uint32_t registerNumber, uint32_t inputId, _D3DDECLUSAGE usage, bool isInput);
 	void Generate255Constants();
 	void GenerateConstantBlock();
+	void GenerateConstantBuffer();
 	void CombineSpirVOpCodes();
-	void CreateSpirVModule();
 
 	//declare
 	void Process_DCL_Pixel();
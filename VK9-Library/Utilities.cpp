@@ -128,25 +128,25 @@ void MergeState(const DeviceState& sourceState, DeviceState& targetState, D3DSTA
 			targetState.hasCullMode = true;  targetState.mSpecializationConstants.cullMode = sourceState.mSpecializationConstants.cullMode;
 		}
 		if (sourceState.hasFogColor && (targetState.hasFogColor || !onlyIfExists)) {
-			targetState.hasFogColor = true;  targetState.mSpecializationConstants.fogColor = sourceState.mSpecializationConstants.fogColor;
+			targetState.hasFogColor = true;  targetState.mRenderStateConstants.fogColor = sourceState.mRenderStateConstants.fogColor;
 		}
 		if (sourceState.hasFogTableMode && (targetState.hasFogTableMode || !onlyIfExists)) {
 			targetState.hasFogTableMode = true; targetState.mSpecializationConstants.fogTableMode = sourceState.mSpecializationConstants.fogTableMode;
 		}
 		if (sourceState.hasFogStart && (targetState.hasFogStart || !onlyIfExists)) {
-			targetState.hasFogStart = true; targetState.mSpecializationConstants.fogStart = sourceState.mSpecializationConstants.fogStart;
+			targetState.hasFogStart = true; targetState.mRenderStateConstants.fogStart = sourceState.mRenderStateConstants.fogStart;
 		}
 		if (sourceState.hasFogEnd && (targetState.hasFogEnd || !onlyIfExists)) {
-			targetState.hasFogEnd = true;  targetState.mSpecializationConstants.fogEnd = sourceState.mSpecializationConstants.fogEnd;
+			targetState.hasFogEnd = true;  targetState.mRenderStateConstants.fogEnd = sourceState.mRenderStateConstants.fogEnd;
 		}
 		if (sourceState.hasFogDensity && (targetState.hasFogDensity || !onlyIfExists)) {
-			targetState.hasFogDensity = true; targetState.mSpecializationConstants.fogDensity = sourceState.mSpecializationConstants.fogDensity;
+			targetState.hasFogDensity = true; targetState.mRenderStateConstants.fogDensity = sourceState.mRenderStateConstants.fogDensity;
 		}
 		if (sourceState.hasRangeFogEnable && (targetState.hasRangeFogEnable || !onlyIfExists)) {
 			targetState.hasRangeFogEnable = true; targetState.mSpecializationConstants.rangeFogEnable = sourceState.mSpecializationConstants.rangeFogEnable;
 		}
 		if (sourceState.hasAmbient && (targetState.hasAmbient || !onlyIfExists)) {
-			targetState.hasAmbient = true;  targetState.mSpecializationConstants.ambient = sourceState.mSpecializationConstants.ambient;
+			targetState.hasAmbient = true;  targetState.mRenderStateConstants.ambient = sourceState.mRenderStateConstants.ambient;
 		}
 		if (sourceState.hasColorVertex && (targetState.hasColorVertex || !onlyIfExists)) {
 			targetState.hasColorVertex = true; targetState.mSpecializationConstants.colorVertex = sourceState.mSpecializationConstants.colorVertex;
@@ -182,10 +182,10 @@ void MergeState(const DeviceState& sourceState, DeviceState& targetState, D3DSTA
 			targetState.hasClipPlaneEnable = true;  targetState.mSpecializationConstants.clipPlaneEnable = sourceState.mSpecializationConstants.clipPlaneEnable;
 		}
 		if (sourceState.hasPointSize && (targetState.hasPointSize || !onlyIfExists)) {
-			targetState.hasPointSize = true;  targetState.mSpecializationConstants.pointSize = sourceState.mSpecializationConstants.pointSize;
+			targetState.hasPointSize = true;  targetState.mRenderStateConstants.pointSize = sourceState.mRenderStateConstants.pointSize;
 		}
 		if (sourceState.hasPointSizeMinimum && (targetState.hasPointSizeMinimum || !onlyIfExists)) {
-			targetState.hasPointSizeMinimum = true;  targetState.mSpecializationConstants.pointSizeMinimum = sourceState.mSpecializationConstants.pointSizeMinimum;
+			targetState.hasPointSizeMinimum = true;  targetState.mRenderStateConstants.pointSizeMinimum = sourceState.mRenderStateConstants.pointSizeMinimum;
 		}
 		if (sourceState.hasPointSpriteEnable && (targetState.hasPointSpriteEnable || !onlyIfExists)) {
 			targetState.hasPointSpriteEnable = true;  targetState.mSpecializationConstants.pointSpriteEnable = sourceState.mSpecializationConstants.pointSpriteEnable;
@@ -194,13 +194,13 @@ void MergeState(const DeviceState& sourceState, DeviceState& targetState, D3DSTA
 			targetState.hasPointScaleEnable = true; targetState.mSpecializationConstants.pointScaleEnable = sourceState.mSpecializationConstants.pointScaleEnable;
 		}
 		if (sourceState.hasPointScaleA && (targetState.hasPointScaleA || !onlyIfExists)) {
-			targetState.hasPointScaleA = true; targetState.mSpecializationConstants.pointScaleA = sourceState.mSpecializationConstants.pointScaleA;
+			targetState.hasPointScaleA = true; targetState.mRenderStateConstants.pointScaleA = sourceState.mRenderStateConstants.pointScaleA;
 		}
 		if (sourceState.hasPointScaleB && (targetState.hasPointScaleB || !onlyIfExists)) {
-			targetState.hasPointScaleB = true; targetState.mSpecializationConstants.pointScaleB = sourceState.mSpecializationConstants.pointScaleB;
+			targetState.hasPointScaleB = true; targetState.mRenderStateConstants.pointScaleB = sourceState.mRenderStateConstants.pointScaleB;
 		}
 		if (sourceState.hasPointScaleC && (targetState.hasPointScaleC || !onlyIfExists)) {
-			targetState.hasPointScaleC = true; targetState.mSpecializationConstants.pointScaleC = sourceState.mSpecializationConstants.pointScaleC;
+			targetState.hasPointScaleC = true; targetState.mRenderStateConstants.pointScaleC = sourceState.mRenderStateConstants.pointScaleC;
 		}
 		if (sourceState.hasMultisampleAntiAlias && (targetState.hasMultisampleAntiAlias || !onlyIfExists)) {
 			targetState.hasMultisampleAntiAlias = true; targetState.mSpecializationConstants.multisampleAntiAlias = sourceState.mSpecializationConstants.multisampleAntiAlias;
@@ -212,13 +212,13 @@ void MergeState(const DeviceState& sourceState, DeviceState& targetState, D3DSTA
 			targetState.hasPatchEdgeStyle = true;  targetState.mSpecializationConstants.patchEdgeStyle = sourceState.mSpecializationConstants.patchEdgeStyle;
 		}
 		if (sourceState.hasPointSizeMaximum && (targetState.hasPointSizeMaximum || !onlyIfExists)) {
-			targetState.hasPointSizeMaximum = true; targetState.mSpecializationConstants.pointSizeMaximum = sourceState.mSpecializationConstants.pointSizeMaximum;
+			targetState.hasPointSizeMaximum = true; targetState.mRenderStateConstants.pointSizeMaximum = sourceState.mRenderStateConstants.pointSizeMaximum;
 		}
 		if (sourceState.hasIndexedVertexBlendEnable && (targetState.hasIndexedVertexBlendEnable || !onlyIfExists)) {
 			targetState.hasIndexedVertexBlendEnable = true; targetState.mSpecializationConstants.indexedVertexBlendEnable = sourceState.mSpecializationConstants.indexedVertexBlendEnable;
 		}
 		if (sourceState.hasTweenFactor && (targetState.hasTweenFactor || !onlyIfExists)) {
-			targetState.hasTweenFactor = true;  targetState.mSpecializationConstants.tweenFactor = sourceState.mSpecializationConstants.tweenFactor;
+			targetState.hasTweenFactor = true;  targetState.mRenderStateConstants.tweenFactor = sourceState.mRenderStateConstants.tweenFactor;
 		}
 		if (sourceState.hasPositionDegree && (targetState.hasPositionDegree || !onlyIfExists)) {
 			targetState.hasPositionDegree = true; targetState.mSpecializationConstants.positionDegree = sourceState.mSpecializationConstants.positionDegree;
@@ -282,7 +282,7 @@ void MergeState(const DeviceState& sourceState, DeviceState& targetState, D3DSTA
 			targetState.hasZFunction = true; targetState.mSpecializationConstants.zFunction = sourceState.mSpecializationConstants.zFunction;
 		}
 		if (sourceState.hasAlphaReference && (targetState.hasAlphaReference || !onlyIfExists)) {
-			targetState.hasAlphaReference = true;  targetState.mSpecializationConstants.alphaReference = sourceState.mSpecializationConstants.alphaReference;
+			targetState.hasAlphaReference = true;  targetState.mRenderStateConstants.alphaReference = sourceState.mRenderStateConstants.alphaReference;
 		}
 		if (sourceState.hasAlphaFunction && (targetState.hasAlphaFunction || !onlyIfExists)) {
 			targetState.hasAlphaFunction = true;  targetState.mSpecializationConstants.alphaFunction = sourceState.mSpecializationConstants.alphaFunction;
@@ -291,19 +291,19 @@ void MergeState(const DeviceState& sourceState, DeviceState& targetState, D3DSTA
 			targetState.hasDitherEnable = true;  targetState.mSpecializationConstants.ditherEnable = sourceState.mSpecializationConstants.ditherEnable;
 		}
 		if (sourceState.hasFogStart && (targetState.hasFogStart || !onlyIfExists)) {
-			targetState.hasFogStart = true; targetState.mSpecializationConstants.fogStart = sourceState.mSpecializationConstants.fogStart;
+			targetState.hasFogStart = true; targetState.mRenderStateConstants.fogStart = sourceState.mRenderStateConstants.fogStart;
 		}
 		if (sourceState.hasFogEnd && (targetState.hasFogEnd || !onlyIfExists)) {
-			targetState.hasFogEnd = true;  targetState.mSpecializationConstants.fogEnd = sourceState.mSpecializationConstants.fogEnd;
+			targetState.hasFogEnd = true;  targetState.mRenderStateConstants.fogEnd = sourceState.mRenderStateConstants.fogEnd;
 		}
 		if (sourceState.hasFogDensity && (targetState.hasFogDensity || !onlyIfExists)) {
-			targetState.hasFogDensity = true; targetState.mSpecializationConstants.fogDensity = sourceState.mSpecializationConstants.fogDensity;
+			targetState.hasFogDensity = true; targetState.mRenderStateConstants.fogDensity = sourceState.mRenderStateConstants.fogDensity;
 		}
 		if (sourceState.hasAlphaBlendEnable && (targetState.hasAlphaBlendEnable || !onlyIfExists)) {
 			targetState.hasAlphaBlendEnable = true;  targetState.mSpecializationConstants.alphaBlendEnable = sourceState.mSpecializationConstants.alphaBlendEnable;
 		}
 		if (sourceState.hasDepthBias && (targetState.hasDepthBias || !onlyIfExists)) {
-			targetState.hasDepthBias = true;  targetState.mSpecializationConstants.depthBias = sourceState.mSpecializationConstants.depthBias;
+			targetState.hasDepthBias = true;  targetState.mRenderStateConstants.depthBias = sourceState.mRenderStateConstants.depthBias;
 		}
 		if (sourceState.hasStencilEnable && (targetState.hasStencilEnable || !onlyIfExists)) {
 			targetState.hasStencilEnable = true;  targetState.mSpecializationConstants.stencilEnable = sourceState.mSpecializationConstants.stencilEnable;
@@ -330,7 +330,7 @@ void MergeState(const DeviceState& sourceState, DeviceState& targetState, D3DSTA
 			targetState.hasStencilWriteMask = true; targetState.mSpecializationConstants.stencilWriteMask = sourceState.mSpecializationConstants.stencilWriteMask;
 		}
 		if (sourceState.hasTextureFactor && (targetState.hasTextureFactor || !onlyIfExists)) {
-			targetState.hasTextureFactor = true;  targetState.mSpecializationConstants.textureFactor = sourceState.mSpecializationConstants.textureFactor;
+			targetState.hasTextureFactor = true;  targetState.mRenderStateConstants.textureFactor = sourceState.mRenderStateConstants.textureFactor;
 		}
 		if (sourceState.hasWrap0 && (targetState.hasWrap0 || !onlyIfExists)) {
 			targetState.hasWrap0 = true;  targetState.mSpecializationConstants.wrap0 = sourceState.mSpecializationConstants.wrap0;
@@ -405,7 +405,7 @@ void MergeState(const DeviceState& sourceState, DeviceState& targetState, D3DSTA
 			targetState.hasScissorTestEnable = true; targetState.mSpecializationConstants.scissorTestEnable = sourceState.mSpecializationConstants.scissorTestEnable;
 		}
 		if (sourceState.hasSlopeScaleDepthBias && (targetState.hasSlopeScaleDepthBias || !onlyIfExists)) {
-			targetState.hasSlopeScaleDepthBias = true;  targetState.mSpecializationConstants.slopeScaleDepthBias = sourceState.mSpecializationConstants.slopeScaleDepthBias;
+			targetState.hasSlopeScaleDepthBias = true;  targetState.mRenderStateConstants.slopeScaleDepthBias = sourceState.mRenderStateConstants.slopeScaleDepthBias;
 		}
 		if (sourceState.hasAntiAliasedLineEnable && (targetState.hasAntiAliasedLineEnable || !onlyIfExists)) {
 			targetState.hasAntiAliasedLineEnable = true;  targetState.mSpecializationConstants.antiAliasedLineEnable = sourceState.mSpecializationConstants.antiAliasedLineEnable;
@@ -489,6 +489,11 @@ void MergeState(const DeviceState& sourceState, DeviceState& targetState, D3DSTA
 							)
 					{
 						targetState.mSamplerStates[pair1.first][pair2.first] = pair2.second;
+
+						if (pair1.first < 32)
+						{
+							targetState.mSamplerStateDirtyMask |= (1 << pair1.first);
+						}
 					}
 				}
 			}
@@ -612,41 +617,41 @@ void MergeState(const DeviceState& sourceState, DeviceState& targetState, D3DSTA
 		targetState.mSpecializationConstants.alphaArgument2_6 = sourceState.mSpecializationConstants.alphaArgument2_6;
 		targetState.mSpecializationConstants.alphaArgument2_7 = sourceState.mSpecializationConstants.alphaArgument2_7;
 
-		targetState.mSpecializationConstants.bumpMapMatrix00_0 = sourceState.mSpecializationConstants.bumpMapMatrix00_0;
-		targetState.mSpecializationConstants.bumpMapMatrix00_1 = sourceState.mSpecializationConstants.bumpMapMatrix00_1;
-		targetState.mSpecializationConstants.bumpMapMatrix00_2 = sourceState.mSpecializationConstants.bumpMapMatrix00_2;
-		targetState.mSpecializationConstants.bumpMapMatrix00_3 = sourceState.mSpecializationConstants.bumpMapMatrix00_3;
-		targetState.mSpecializationConstants.bumpMapMatrix00_4 = sourceState.mSpecializationConstants.bumpMapMatrix00_4;
-		targetState.mSpecializationConstants.bumpMapMatrix00_5 = sourceState.mSpecializationConstants.bumpMapMatrix00_5;
-		targetState.mSpecializationConstants.bumpMapMatrix00_6 = sourceState.mSpecializationConstants.bumpMapMatrix00_6;
-		targetState.mSpecializationConstants.bumpMapMatrix00_7 = sourceState.mSpecializationConstants.bumpMapMatrix00_7;
-
-		targetState.mSpecializationConstants.bumpMapMatrix01_0 = sourceState.mSpecializationConstants.bumpMapMatrix01_0;
-		targetState.mSpecializationConstants.bumpMapMatrix01_1 = sourceState.mSpecializationConstants.bumpMapMatrix01_1;
-		targetState.mSpecializationConstants.bumpMapMatrix01_2 = sourceState.mSpecializationConstants.bumpMapMatrix01_2;
-		targetState.mSpecializationConstants.bumpMapMatrix01_3 = sourceState.mSpecializationConstants.bumpMapMatrix01_3;
-		targetState.mSpecializationConstants.bumpMapMatrix01_4 = sourceState.mSpecializationConstants.bumpMapMatrix01_4;
-		targetState.mSpecializationConstants.bumpMapMatrix01_5 = sourceState.mSpecializationConstants.bumpMapMatrix01_5;
-		targetState.mSpecializationConstants.bumpMapMatrix01_6 = sourceState.mSpecializationConstants.bumpMapMatrix01_6;
-		targetState.mSpecializationConstants.bumpMapMatrix01_7 = sourceState.mSpecializationConstants.bumpMapMatrix01_7;
-
-		targetState.mSpecializationConstants.bumpMapMatrix10_0 = sourceState.mSpecializationConstants.bumpMapMatrix10_0;
-		targetState.mSpecializationConstants.bumpMapMatrix10_1 = sourceState.mSpecializationConstants.bumpMapMatrix10_1;
-		targetState.mSpecializationConstants.bumpMapMatrix10_2 = sourceState.mSpecializationConstants.bumpMapMatrix10_2;
-		targetState.mSpecializationConstants.bumpMapMatrix10_3 = sourceState.mSpecializationConstants.bumpMapMatrix10_3;
-		targetState.mSpecializationConstants.bumpMapMatrix10_4 = sourceState.mSpecializationConstants.bumpMapMatrix10_4;
-		targetState.mSpecializationConstants.bumpMapMatrix10_5 = sourceState.mSpecializationConstants.bumpMapMatrix10_5;
-		targetState.mSpecializationConstants.bumpMapMatrix10_6 = sourceState.mSpecializationConstants.bumpMapMatrix10_6;
-		targetState.mSpecializationConstants.bumpMapMatrix10_7 = sourceState.mSpecializationConstants.bumpMapMatrix10_7;
-
-		targetState.mSpecializationConstants.bumpMapMatrix11_0 = sourceState.mSpecializationConstants.bumpMapMatrix11_0;
-		targetState.mSpecializationConstants.bumpMapMatrix11_1 = sourceState.mSpecializationConstants.bumpMapMatrix11_1;
-		targetState.mSpecializationConstants.bumpMapMatrix11_2 = sourceState.mSpecializationConstants.bumpMapMatrix11_2;
-		targetState.mSpecializationConstants.bumpMapMatrix11_3 = sourceState.mSpecializationConstants.bumpMapMatrix11_3;
-		targetState.mSpecializationConstants.bumpMapMatrix11_4 = sourceState.mSpecializationConstants.bumpMapMatrix11_4;
-		targetState.mSpecializationConstants.bumpMapMatrix11_5 = sourceState.mSpecializationConstants.bumpMapMatrix11_5;
-		targetState.mSpecializationConstants.bumpMapMatrix11_6 = sourceState.mSpecializationConstants.bumpMapMatrix11_6;
-		targetState.mSpecializationConstants.bumpMapMatrix11_7 = sourceState.mSpecializationConstants.bumpMapMatrix11_7;
+		targetState.mRenderStateConstants.bumpMapMatrix00_0 = sourceState.mRenderStateConstants.bumpMapMatrix00_0;
+		targetState.mRenderStateConstants.bumpMapMatrix00_1 = sourceState.mRenderStateConstants.bumpMapMatrix00_1;
+		targetState.mRenderStateConstants.bumpMapMatrix00_2 = sourceState.mRenderStateConstants.bumpMapMatrix00_2;
+		targetState.mRenderStateConstants.bumpMapMatrix00_3 = sourceState.mRenderStateConstants.bumpMapMatrix00_3;
+		targetState.mRenderStateConstants.bumpMapMatrix00_4 = sourceState.mRenderStateConstants.bumpMapMatrix00_4;
+		targetState.mRenderStateConstants.bumpMapMatrix00_5 = sourceState.mRenderStateConstants.bumpMapMatrix00_5;
+		targetState.mRenderStateConstants.bumpMapMatrix00_6 = sourceState.mRenderStateConstants.bumpMapMatrix00_6;
+		targetState.mRenderStateConstants.bumpMapMatrix00_7 = sourceState.mRenderStateConstants.bumpMapMatrix00_7;
+
+		targetState.mRenderStateConstants.bumpMapMatrix01_0 = sourceState.mRenderStateConstants.bumpMapMatrix01_0;
+		targetState.mRenderStateConstants.bumpMapMatrix01_1 = sourceState.mRenderStateConstants.bumpMapMatrix01_1;
+		targetState.mRenderStateConstants.bumpMapMatrix01_2 = sourceState.mRenderStateConstants.bumpMapMatrix01_2;
+		targetState.mRenderStateConstants.bumpMapMatrix01_3 = sourceState.mRenderStateConstants.bumpMapMatrix01_3;
+		targetState.mRenderStateConstants.bumpMapMatrix01_4 = sourceState.mRenderStateConstants.bumpMapMatrix01_4;
+		targetState.mRenderStateConstants.bumpMapMatrix01_5 = sourceState.mRenderStateConstants.bumpMapMatrix01_5;
+		targetState.mRenderStateConstants.bumpMapMatrix01_6 = sourceState.mRenderStateConstants.bumpMapMatrix01_6;
+		targetState.mRenderStateConstants.bumpMapMatrix01_7 = sourceState.mRenderStateConstants.bumpMapMatrix01_7;
+
+		targetState.mRenderStateConstants.bumpMapMatrix10_0 = sourceState.mRenderStateConstants.bumpMapMatrix10_0;
+		targetState.mRenderStateConstants.bumpMapMatrix10_1 = sourceState.mRenderStateConstants.bumpMapMatrix10_1;
+		targetState.mRenderStateConstants.bumpMapMatrix10_2 = sourceState.mRenderStateConstants.bumpMapMatrix10_2;
+		targetState.mRenderStateConstants.bumpMapMatrix10_3 = sourceState.mRenderStateConstants.bumpMapMatrix10_3;
+		targetState.mRenderStateConstants.bumpMapMatrix10_4 = sourceState.mRenderStateConstants.bumpMapMatrix10_4;
+		targetState.mRenderStateConstants.bumpMapMatrix10_5 = sourceState.mRenderStateConstants.bumpMapMatrix10_5;
+		targetState.mRenderStateConstants.bumpMapMatrix10_6 = sourceState.mRenderStateConstants.bumpMapMatrix10_6;
+		targetState.mRenderStateConstants.bumpMapMatrix10_7 = sourceState.mRenderStateConstants.bumpMapMatrix10_7;
+
+		targetState.mRenderStateConstants.bumpMapMatrix11_0 = sourceState.mRenderStateConstants.bumpMapMatrix11_0;
+		targetState.mRenderStateConstants.bumpMapMatrix11_1 = sourceState.mRenderStateConstants.bumpMapMatrix11_1;
+		targetState.mRenderStateConstants.bumpMapMatrix11_2 = sourceState.mRenderStateConstants.bumpMapMatrix11_2;
+		targetState.mRenderStateConstants.bumpMapMatrix11_3 = sourceState.mRenderStateConstants.bumpMapMatrix11_3;
+		targetState.mRenderStateConstants.bumpMapMatrix11_4 = sourceState.mRenderStateConstants.bumpMapMatrix11_4;
+		targetState.mRenderStateConstants.bumpMapMatrix11_5 = sourceState.mRenderStateConstants.bumpMapMatrix11_5;
+		targetState.mRenderStateConstants.bumpMapMatrix11_6 = sourceState.mRenderStateConstants.bumpMapMatrix11_6;
+		targetState.mRenderStateConstants.bumpMapMatrix11_7 = sourceState.mRenderStateConstants.bumpMapMatrix11_7;
 
 		targetState.mSpecializationConstants.texureCoordinateIndex_0 = sourceState.mSpecializationConstants.texureCoordinateIndex_0;
 		targetState.mSpecializationConstants.texureCoordinateIndex_1 = sourceState.mSpecializationConstants.texureCoordinateIndex_1;
@@ -657,23 +662,23 @@ void MergeState(const DeviceState& sourceState, DeviceState& targetState, D3DSTA
 		targetState.mSpecializationConstants.texureCoordinateIndex_6 = sourceState.mSpecializationConstants.texureCoordinateIndex_6;
 		targetState.mSpecializationConstants.texureCoordinateIndex_7 = sourceState.mSpecializationConstants.texureCoordinateIndex_7;
 
-		targetState.mSpecializationConstants.bumpMapScale_0 = sourceState.mSpecializationConstants.bumpMapScale_0;
-		targetState.mSpecializationConstants.bumpMapScale_1 = sourceState.mSpecializationConstants.bumpMapScale_1;
-		targetState.mSpecializationConstants.bumpMapScale_2 = sourceState.mSpecializationConstants.bumpMapScale_2;
-		targetState.mSpecializationConstants.bumpMapScale_3 = sourceState.mSpecializationConstants.bumpMapScale_3;
-		targetState.mSpecializationConstants.bumpMapScale_4 = sourceState.mSpecializationConstants.bumpMapScale_4;
-		targetState.mSpecializationConstants.bumpMapScale_5 = sourceState.mSpecializationConstants.bumpMapScale_5;
-		targetState.mSpecializationConstants.bumpMapScale_6 = sourceState.mSpecializationConstants.bumpMapScale_6;
-		targetState.mSpecializationConstants.bumpMapScale_7 = sourceState.mSpecializationConstants.bumpMapScale_7;
-
-		targetState.mSpecializationConstants.bumpMapOffset_0 = sourceState.mSpecializationConstants.bumpMapOffset_0;
-		targetState.mSpecializationConstants.bumpMapOffset_1 = sourceState.mSpecializationConstants.bumpMapOffset_1;
-		targetState.mSpecializationConstants.bumpMapOffset_2 = sourceState.mSpecializationConstants.bumpMapOffset_2;
-		targetState.mSpecializationConstants.bumpMapOffset_3 = sourceState.mSpecializationConstants.bumpMapOffset_3;
-		targetState.mSpecializationConstants.bumpMapOffset_4 = sourceState.mSpecializationConstants.bumpMapOffset_4;
-		targetState.mSpecializationConstants.bumpMapOffset_5 = sourceState.mSpecializationConstants.bumpMapOffset_5;
-		targetState.mSpecializationConstants.bumpMapOffset_6 = sourceState.mSpecializationConstants.bumpMapOffset_6;
-		targetState.mSpecializationConstants.bumpMapOffset_7 = sourceState.mSpecializationConstants.bumpMapOffset_7;
+		targetState.mRenderStateConstants.bumpMapScale_0 = sourceState.mRenderStateConstants.bumpMapScale_0;
+		targetState.mRenderStateConstants.bumpMapScale_1 = sourceState.mRenderStateConstants.bumpMapScale_1;
+		targetState.mRenderStateConstants.bumpMapScale_2 = sourceState.mRenderStateConstants.bumpMapScale_2;
+		targetState.mRenderStateConstants.bumpMapScale_3 = sourceState.mRenderStateConstants.bumpMapScale_3;
+		targetState.mRenderStateConstants.bumpMapScale_4 = sourceState.mRenderStateConstants.bumpMapScale_4;
+		targetState.mRenderStateConstants.bumpMapScale_5 = sourceState.mRenderStateConstants.bumpMapScale_5;
+		targetState.mRenderStateConstants.bumpMapScale_6 = sourceState.mRenderStateConstants.bumpMapScale_6;
+		targetState.mRenderStateConstants.bumpMapScale_7 = sourceState.mRenderStateConstants.bumpMapScale_7;
+
+		targetState.mRenderStateConstants.bumpMapOffset_0 = sourceState.mRenderStateConstants.bumpMapOffset_0;
+		targetState.mRenderStateConstants.bumpMapOffset_1 = sourceState.mRenderStateConstants.bumpMapOffset_1;
+		targetState.mRenderStateConstants.bumpMapOffset_2 = sourceState.mRenderStateConstants.bumpMapOffset_2;
+		targetState.mRenderStateConstants.bumpMapOffset_3 = sourceState.mRenderStateConstants.bumpMapOffset_3;
+		targetState.mRenderStateConstants.bumpMapOffset_4 = sourceState.mRenderStateConstants.bumpMapOffset_4;
+		targetState.mRenderStateConstants.bumpMapOffset_5 = sourceState.mRenderStateConstants.bumpMapOffset_5;
+		targetState.mRenderStateConstants.bumpMapOffset_6 = sourceState.mRenderStateConstants.bumpMapOffset_6;
+		targetState.mRenderStateConstants.bumpMapOffset_7 = sourceState.mRenderStateConstants.bumpMapOffset_7;
 
 		targetState.mSpecializationConstants.textureTransformationFlags_0 = sourceState.mSpecializationConstants.textureTransformationFlags_0;
 		targetState.mSpecializationConstants.textureTransformationFlags_1 = sourceState.mSpecializationConstants.textureTransformationFlags_1;
@@ -715,13 +720,15 @@ void MergeState(const DeviceState& sourceState, DeviceState& targetState, D3DSTA
 	//IDirect3DDevice9::SetTransform
 	if (type == D3DSBT_ALL)
 	{
-		BOOST_FOREACH(const auto& pair1, sourceState.mTransforms)
+		for (size_t i = 0; i < TRANSFORM_COUNT; i++)
 		{
-			if (!onlyIfExists || targetState.mTransforms.count(pair1.first) > 0)
+			if (sourceState.mHasTransforms[i] && (!onlyIfExists || targetState.mHasTransforms[i]))
 			{
-				targetState.mTransforms[pair1.first] = pair1.second;
+				targetState.mTransforms[i] = sourceState.mTransforms[i];
+				targetState.mHasTransforms[i] = true;
 			}
 		}
+		targetState.mChangedTransforms = TRANSFORM_CHANGED_ALL;
 	}
 
 	//IDirect3DDevice9::SetViewport
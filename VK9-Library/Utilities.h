@@ -47,6 +47,10 @@ misrepresented as being the original software.
 #include <memory>
 #include <cstring>
 #include <fstream>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
 
 #define D3DCOLOR_A(dw) (((float)(((dw) >> 24) & 0xFF)) / 255.0f)
 #define D3DCOLOR_R(dw) (((float)(((dw) >> 16) & 0xFF)) / 255.0f)
@@ -450,6 +454,23 @@ inline vk::PrimitiveTopology ConvertPrimitiveType(D3DPRIMITIVETYPE input) noexce
 	return output;
 }
 
+/*
+Pipelines created with a dynamic topology can be used for any topology of the same class.
+*/
+inline D3DPRIMITIVETYPE GetPrimitiveTypeClass(D3DPRIMITIVETYPE input) noexcept
+{
+	switch (input)
+	{
+	case D3DPT_POINTLIST:
+		return D3DPT_POINTLIST;
+	case D3DPT_LINELIST:
+	case D3DPT_LINESTRIP:
+		return D3DPT_LINELIST;
+	default:
+		return D3DPT_TRIANGLELIST;
+	}
+}
+
 inline bool GetMemoryTypeFromProperties(const vk::PhysicalDeviceMemoryProperties& deviceMemoryProperties, uint32_t typeBits, vk::MemoryPropertyFlagBits requirements_mask, uint32_t *typeIndex)
 {
 	// Search memtypes to find first index with those properties
@@ -638,6 +659,49 @@ inline vk::Format ConvertFormat(D3DFORMAT format) noexcept
 	}
 }
 
+/*
+The number of bytes in one texel of the formats ConvertFormat can return. (0 for anything else)
+*/
+inline uint32_t GetFormatSize(vk::Format format) noexcept
+{
+	switch ((VkFormat)format)
+	{
+	case VK_FORMAT_R8_UNORM:
+		return 1;
+	case VK_FORMAT_B5G6R5_UNORM_PACK16:
+	case VK_FORMAT_B5G5R5A1_UNORM_PACK16:
+	case VK_FORMAT_B4G4R4A4_UNORM_PACK16:
+	case VK_FORMAT_R8G8_UNORM:
+	case VK_FORMAT_R8G8_SNORM:
+	case VK_FORMAT_R16_UINT:
+	case VK_FORMAT_R16_SFLOAT:
+	case VK_FORMAT_D16_UNORM:
+		return 2;
+	case VK_FORMAT_R8G8B8_UNORM:
+		return 3;
+	case VK_FORMAT_B8G8R8A8_UNORM:
+	case VK_FORMAT_R8G8B8A8_UNORM:
+	case VK_FORMAT_R8G8B8A8_SNORM:
+	case VK_FORMAT_R16G16_UNORM:
+	case VK_FORMAT_R16G16_SNORM:
+	case VK_FORMAT_R16G16_SFLOAT:
+	case VK_FORMAT_R32_UINT:
+	case VK_FORMAT_R32_SFLOAT:
+	case VK_FORMAT_D24_UNORM_S8_UINT:
+	case VK_FORMAT_D32_SFLOAT:
+		return 4;
+	case VK_FORMAT_R16G16B16A16_UNORM:
+	case VK_FORMAT_R16G16B16A16_SNORM:
+	case VK_FORMAT_R16G16B16A16_SFLOAT:
+	case VK_FORMAT_R32G32_SFLOAT:
+		return 8;
+	case VK_FORMAT_R32G32B32A32_SFLOAT:
+		return 16;
+	default:
+		return 0;
+	}
+}
+
 inline D3DFORMAT ConvertFormat(vk::Format format) noexcept
 {
 	/*
@@ -956,6 +1020,25 @@ inline vk::CompareOp ConvertCompareOperation(DWORD input) noexcept
 	return ConvertCompareOperation((D3DCMPFUNC)input);
 }
 
+/*
+The counter clockwise stencil states apply to the back face unless culling flips which face is in front.
+*/
+inline void SetStencilOperations(vk::StencilOpState& front, vk::StencilOpState& back, const SpecializationConstants& constants) noexcept
+{
+	vk::StencilOpState& clockwise = (constants.cullMode != D3DCULL_CCW) ? front : back;
+	vk::StencilOpState& counterClockwise = (constants.cullMode != D3DCULL_CCW) ? back : front;
+
+	clockwise.failOp = ConvertStencilOperation(constants.stencilFail);
+	clockwise.passOp = ConvertStencilOperation(constants.stencilPass);
+	clockwise.depthFailOp = ConvertStencilOperation(constants.stencilZFail);
+	clockwise.compareOp = ConvertCompareOperation(constants.stencilFunction);
+
+	counterClockwise.failOp = ConvertStencilOperation(constants.ccwStencilFail);
+	counterClockwise.passOp = ConvertStencilOperation(constants.ccwStencilPass);
+	counterClockwise.depthFailOp = ConvertStencilOperation(constants.ccwStencilZFail);
+	counterClockwise.compareOp = ConvertCompareOperation(constants.ccwStencilFunction);
+}
+
 inline uint32_t ConvertFormat(DWORD fvf) noexcept
 {
 	//TODO: This should be able to be simplified by bitwise operators.
@@ -1102,6 +1185,148 @@ inline float bit_cast(const DWORD& source) noexcept
 	return returnValue;
 }
 
+/*
+The pipeline state hashes are an xor of one mixed value per 32bit word. That way a single word can be swapped out of the hash without touching the rest of the structure.
+The mixing is the splitmix64 finalizer so the word index and value both end up spread over all 64 bits.
+*/
+
+inline uint64_t HashStateWord(size_t index, uint32_t value) noexcept
+{
+	uint64_t x = (((uint64_t)index) << 32) | value;
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x;
+}
+
+inline uint64_t HashStateWords(const void* data, size_t size) noexcept
+{
+	const uint32_t* words = (const uint32_t*)data;
+	uint64_t hash = 0;
+	for (size_t i = 0; i < size / sizeof(uint32_t); i++)
+	{
+		hash ^= HashStateWord(i, words[i]);
+	}
+	return hash;
+}
+
+inline uint64_t HashCombine(uint64_t hash, uint64_t value) noexcept
+{
+	return hash ^ (HashStateWord(0, (uint32_t)value) + HashStateWord(1, (uint32_t)(value >> 32)) + 0x9e3779b97f4a7c15ULL + (hash << 6) + (hash >> 2));
+}
+
+//FNV-1a for blobs that aren't word sized. (cache files and such)
+inline uint64_t HashBytes(const void* data, size_t size) noexcept
+{
+	const unsigned char* bytes = (const unsigned char*)data;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/*
+Writes the chunks to a temporary file and swaps it in for path so a crash part way through the write leaves the old file alone.
+The data has to be on disk before the rename or a power loss can leave the new name pointing at an empty file.
+beforeReplace runs once the temporary file is complete, for callers that still have the old file open.
+*/
+inline bool WriteFileAtomically(const std::string& path, const std::vector<std::pair<const void*, size_t>>& chunks, const std::function<void()>& beforeReplace = nullptr)
+{
+	std::string temporaryPath = path + ".tmp";
+
+	HANDLE file = CreateFileA(temporaryPath.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_WRITE_THROUGH, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		BOOST_LOG_TRIVIAL(error) << "WriteFileAtomically failed to create " << temporaryPath << " with error code " << GetLastError();
+		return false;
+	}
+
+	BOOL isWritten = TRUE;
+	for (const auto& chunk : chunks)
+	{
+		DWORD written = 0;
+		if (!WriteFile(file, chunk.first, (DWORD)chunk.second, &written, nullptr) || written != chunk.second)
+		{
+			isWritten = FALSE;
+			break;
+		}
+	}
+	isWritten = isWritten && FlushFileBuffers(file);
+
+	CloseHandle(file);
+
+	if (!isWritten)
+	{
+		BOOST_LOG_TRIVIAL(error) << "WriteFileAtomically failed to write " << temporaryPath;
+		return false;
+	}
+
+	if (beforeReplace)
+	{
+		beforeReplace();
+	}
+
+	if (!MoveFileExA(temporaryPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+	{
+		BOOST_LOG_TRIVIAL(error) << "WriteFileAtomically failed to replace " << path << " with error code " << GetLastError();
+		return false;
+	}
+
+	return true;
+}
+
+template <class FieldType, class ValueType>
+inline void SetHashedState(uint64_t& hash, const void* base, FieldType& field, const ValueType& value) noexcept
+{
+	static_assert(sizeof(FieldType) == sizeof(uint32_t), "Hashed state is tracked one 32bit word at a time.");
+	const size_t index = ((const char*)&field - (const char*)base) / sizeof(uint32_t);
+	uint32_t word;
+
+	memcpy(&word, &field, sizeof(uint32_t));
+	hash ^= HashStateWord(index, word);
+
+	field = value;
+
+	memcpy(&word, &field, sizeof(uint32_t));
+	hash ^= HashStateWord(index, word);
+}
+
+template <class FieldType, class ValueType>
+inline void SetSpecializationConstant(DeviceState& state, FieldType& field, const ValueType& value) noexcept
+{
+	SetHashedState(state.mSpecializationConstantsHash, &state.mSpecializationConstants, field, value);
+}
+
+/*
+Render state constants aren't part of the pipeline so setting one only flags the render state block for upload.
+*/
+template <class FieldType, class ValueType>
+inline void SetRenderStateConstant(DeviceState& state, FieldType& field, const ValueType& value) noexcept
+{
+	field = value;
+	state.mIsRenderStateDirty = true;
+}
+
+/*
+Flags a shader constant block for upload and grows the written size to cover everything up to end. (one past the last field that was set)
+*/
+template <class FieldType>
+inline void MarkShaderConstantsDirty(BOOL& isDirty, uint32_t& size, const ShaderConstantSlots& slots, const FieldType* end) noexcept
+{
+	const uint32_t writtenSize = (uint32_t)((const char*)end - (const char*)&slots);
+
+	isDirty = true;
+	if (writtenSize > size)
+	{
+		size = writtenSize;
+	}
+}
+
 const std::string mResultStrings[] =
 {
 	"Unknown",
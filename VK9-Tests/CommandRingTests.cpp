@@ -0,0 +1,273 @@
+/*
+Copyright(c) 2018 Christopher Joseph Dean Schaefer
+
+This software is provided 'as-is', without any express or implied
+warranty.In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions :
+
+1. The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software.If you use this software
+in a product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include <string.h>
+#include <stdint.h>
+#include <vector>
+#include <thread>
+#include <mutex>
+
+#include "UnitTests.h"
+#include "../VK9-Library/Perf_CommandRing.h"
+
+/*
+Fills the ring until a command no longer fits at the end so the producer has to pad to the start.
+*/
+static void TestCommandRingWrap()
+{
+	CommandRing ring;
+	ring.Allocate(0); //Rounded up to the smallest ring.
+	UNIT_TEST_CHECK(ring.mSize == 65536);
+
+	const size_t payloadSize = 1100; //Doesn't divide the ring so the last command can't fit at the end.
+	const size_t commandSize = ring.GetCommandSize(payloadSize);
+	UNIT_TEST_CHECK(commandSize % alignof(CommandHeader) == 0);
+	UNIT_TEST_CHECK(commandSize >= sizeof(CommandHeader) + payloadSize);
+
+	//Fill the ring, the last command that doesn't fit has to fail instead of overwriting the start.
+	size_t count = 0;
+	for (;;)
+	{
+		uint32_t* payload = (uint32_t*)ring.Reserve(payloadSize);
+		if (payload == nullptr)
+		{
+			break;
+		}
+		payload[0] = (uint32_t)count++;
+	}
+	UNIT_TEST_CHECK(count == ring.mSize / commandSize);
+	UNIT_TEST_CHECK(ring.Publish());
+	UNIT_TEST_CHECK(!ring.Publish()); //Nothing new to publish.
+
+	//Drain half of it so there is room at the start but not at the end.
+	for (size_t i = 0; i < count / 2; i++)
+	{
+		uint32_t* payload = (uint32_t*)ring.Peek();
+		UNIT_TEST_CHECK(payload != nullptr && payload[0] == i);
+		ring.Pop();
+	}
+
+	size_t endOffset = ring.mWritePosition & ring.mMask;
+	UNIT_TEST_CHECK(endOffset + commandSize > ring.mSize);
+
+	uint32_t* wrapped = (uint32_t*)ring.Reserve(payloadSize);
+	UNIT_TEST_CHECK(wrapped != nullptr);
+	UNIT_TEST_CHECK((char*)wrapped == ring.mBuffer + sizeof(CommandHeader)); //Written at the start of the buffer.
+	UNIT_TEST_CHECK(ring.mWritePosition == count * commandSize + (ring.mSize - endOffset) + commandSize);
+
+	//The tail of the buffer is a padding command the consumer skips.
+	CommandHeader* padding = (CommandHeader*)(ring.mBuffer + endOffset);
+	UNIT_TEST_CHECK(padding->IsPadding == 1);
+	UNIT_TEST_CHECK(padding->Size == ring.mSize - endOffset);
+
+	if (wrapped != nullptr)
+	{
+		wrapped[0] = 0xFFFFFFFF;
+	}
+	UNIT_TEST_CHECK(ring.Publish());
+
+	//The consumer sees the rest of the old commands, skips the padding, then sees the wrapped command.
+	for (size_t i = count / 2; i < count; i++)
+	{
+		uint32_t* payload = (uint32_t*)ring.Peek();
+		UNIT_TEST_CHECK(payload != nullptr && payload[0] == i);
+		ring.Pop();
+	}
+
+	uint32_t* payload = (uint32_t*)ring.Peek();
+	UNIT_TEST_CHECK(payload == wrapped);
+	UNIT_TEST_CHECK(payload != nullptr && payload[0] == 0xFFFFFFFF);
+	ring.Pop();
+
+	UNIT_TEST_CHECK(ring.IsEmpty());
+	UNIT_TEST_CHECK(ring.Peek() == nullptr);
+	UNIT_TEST_CHECK(ring.mReadPosition.load() == ring.mWritePosition);
+}
+
+/*
+A command that needs the whole ring only fits once the consumer has caught up.
+*/
+static void TestCommandRingFull()
+{
+	CommandRing ring;
+	ring.Allocate(0);
+
+	const size_t payloadSize = ring.mSize - sizeof(CommandHeader);
+	UNIT_TEST_CHECK(ring.GetCommandSize(payloadSize) == ring.mSize);
+
+	void* first = ring.Reserve(payloadSize);
+	UNIT_TEST_CHECK(first != nullptr);
+	UNIT_TEST_CHECK(ring.Reserve(1) == nullptr);
+	ring.Publish();
+
+	UNIT_TEST_CHECK(ring.Peek() == first);
+	ring.Pop();
+
+	void* second = ring.Reserve(payloadSize);
+	UNIT_TEST_CHECK(second == first);
+	ring.Publish();
+	UNIT_TEST_CHECK(ring.Peek() == second);
+	ring.Pop();
+	UNIT_TEST_CHECK(ring.IsEmpty());
+}
+
+/*
+Anything up to half the ring has to fit once the ring drains no matter where the write position ends up.
+Bigger commands can be pushed past the end by the padding and never fit, GetWorkItem moves their payload to the heap.
+*/
+static void TestCommandRingOversized()
+{
+	CommandRing ring;
+	ring.Allocate(0);
+
+	const size_t largestPayloadSize = ring.mSize / 2 - sizeof(CommandHeader);
+	UNIT_TEST_CHECK(!ring.IsOversized(largestPayloadSize));
+	UNIT_TEST_CHECK(ring.IsOversized(largestPayloadSize + 1));
+	UNIT_TEST_CHECK(!ring.IsOversized(0));
+
+	//Walk the write position across the whole ring and check the largest command fits at each step once the consumer catches up.
+	const size_t stepPayloadSize = 4096 - sizeof(CommandHeader);
+	for (size_t step = 0; step < ring.mSize / 4096; step++)
+	{
+		void* command = ring.Reserve(largestPayloadSize);
+		UNIT_TEST_CHECK(command != nullptr);
+		UNIT_TEST_CHECK(ring.Reserve(stepPayloadSize) != nullptr);
+		ring.Publish();
+
+		while (ring.Peek() != nullptr)
+		{
+			ring.Pop();
+		}
+		UNIT_TEST_CHECK(ring.IsEmpty());
+	}
+
+	//Half way through an empty ring a command bigger than the half left at the end still doesn't fit.
+	CommandRing halfRing;
+	halfRing.Allocate(0);
+	UNIT_TEST_CHECK(halfRing.Reserve(largestPayloadSize) != nullptr);
+	halfRing.Publish();
+	UNIT_TEST_CHECK(halfRing.Peek() != nullptr);
+	halfRing.Pop();
+	UNIT_TEST_CHECK(halfRing.IsEmpty());
+	UNIT_TEST_CHECK((halfRing.mWritePosition & halfRing.mMask) == halfRing.mSize / 2);
+	UNIT_TEST_CHECK(halfRing.IsOversized(halfRing.mSize / 2 + halfRing.mSize / 4));
+	UNIT_TEST_CHECK(halfRing.Reserve(halfRing.mSize / 2 + halfRing.mSize / 4) == nullptr);
+	UNIT_TEST_CHECK(halfRing.Reserve(largestPayloadSize) != nullptr);
+}
+
+/*
+Several threads record into one ring the way app threads share the command stream.
+Each holds the producer mutex from Reserve to Publish and the consumer checks nothing was torn, lost or reordered within a thread.
+*/
+static void TestCommandRingProducers()
+{
+	CommandRing ring;
+	ring.Allocate(0);
+
+	const uint32_t producerCount = 4;
+	const uint32_t commandCount = 2000;
+
+	auto produce = [&ring](uint32_t producer)
+	{
+		for (uint32_t sequence = 0; sequence < commandCount; sequence++)
+		{
+			uint32_t wordCount = 3 + ((sequence * 37 + producer * 11) % 700);
+
+			std::lock_guard<std::recursive_mutex> lock(ring.mProducerMutex);
+
+			uint32_t* payload = nullptr;
+			while ((payload = (uint32_t*)ring.Reserve(wordCount * sizeof(uint32_t))) == nullptr)
+			{
+				std::this_thread::yield();
+			}
+
+			payload[0] = producer;
+			payload[1] = sequence;
+			payload[2] = wordCount;
+			for (uint32_t i = 3; i < wordCount; i++)
+			{
+				payload[i] = producer ^ (sequence << 8) ^ (i << 20);
+			}
+
+			ring.Publish();
+		}
+	};
+
+	std::vector<std::thread> producers;
+	for (uint32_t producer = 0; producer < producerCount; producer++)
+	{
+		producers.emplace_back(produce, producer);
+	}
+
+	std::vector<uint32_t> nextSequences(producerCount, 0);
+	size_t received = 0;
+	size_t badCommands = 0;
+	while (received < producerCount * commandCount)
+	{
+		uint32_t* payload = (uint32_t*)ring.Peek();
+		if (payload == nullptr)
+		{
+			std::this_thread::yield();
+			continue;
+		}
+
+		uint32_t producer = payload[0];
+		uint32_t sequence = payload[1];
+		uint32_t wordCount = payload[2];
+		bool isValid = producer < producerCount && sequence == nextSequences[producer] && wordCount == 3 + ((sequence * 37 + producer * 11) % 700);
+		for (uint32_t i = 3; isValid && i < wordCount; i++)
+		{
+			isValid = (payload[i] == (producer ^ (sequence << 8) ^ (i << 20)));
+		}
+
+		if (isValid)
+		{
+			nextSequences[producer]++;
+		}
+		else
+		{
+			badCommands++;
+		}
+
+		ring.Pop();
+		received++;
+	}
+
+	for (auto& producer : producers)
+	{
+		producer.join();
+	}
+
+	UNIT_TEST_CHECK(badCommands == 0);
+	for (uint32_t producer = 0; producer < producerCount; producer++)
+	{
+		UNIT_TEST_CHECK(nextSequences[producer] == commandCount);
+	}
+	UNIT_TEST_CHECK(ring.IsEmpty());
+	UNIT_TEST_CHECK(ring.Peek() == nullptr);
+}
+
+void RunCommandRingTests()
+{
+	TestCommandRingWrap();
+	TestCommandRingFull();
+	TestCommandRingOversized();
+	TestCommandRingProducers();
+}
@@ -24,7 +24,9 @@
 #include <windows.h>
 #include <d3d9.h>
 #include <d3dx9.h>
+#include <string.h>
 #include "resource.h"
+#include "UnitTests.h"
 
 //-----------------------------------------------------------------------------
 // GLOBALS
@@ -93,6 +95,12 @@ int WINAPI WinMain(HINSTANCE hInstance,
 	WNDCLASSEX winClass;
 	MSG        uMsg;
 
+	//Run the library's unit tests instead of the sample.
+	if (strstr(lpCmdLine, "-unittests") != NULL)
+	{
+		return RunUnitTests();
+	}
+
 	memset(&uMsg, 0, sizeof(uMsg));
 
 	winClass.lpszClassName = "MY_WINDOWS_CLASS";
@@ -0,0 +1,143 @@
+/*
+Copyright(c) 2018 Christopher Joseph Dean Schaefer
+
+This software is provided 'as-is', without any express or implied
+warranty.In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions :
+
+1. The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software.If you use this software
+in a product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include "UnitTests.h"
+#include "../VK9-Library/Perf_MemoryAllocator.h"
+
+/*
+Only the buddy bookkeeping is tested so the allocator is never given a real device.
+*/
+static bool IsFree(const MemoryBlock& block, uint32_t order, vk::DeviceSize offset)
+{
+	return block.FreeOffsets[order].find(offset) != block.FreeOffsets[order].end();
+}
+
+static size_t GetFreeCount(const MemoryBlock& block)
+{
+	size_t count = 0;
+	for (const auto& freeOffsets : block.FreeOffsets)
+	{
+		count += freeOffsets.size();
+	}
+	return count;
+}
+
+static void TestMemoryAllocatorSplit()
+{
+	vk::Device device;
+	vk::PhysicalDeviceMemoryProperties memoryProperties;
+	vk::PhysicalDeviceLimits limits;
+	MemoryAllocator allocator(device, memoryProperties, limits, 4000); //Rounded up to 4096.
+
+	UNIT_TEST_CHECK(allocator.mBlockSize == 4096);
+	UNIT_TEST_CHECK(allocator.mOrderCount == 5); //256, 512, 1024, 2048 & 4096
+
+	MemoryBlock block;
+	block.FreeOffsets.resize(allocator.mOrderCount);
+	block.FreeOffsets[allocator.mOrderCount - 1].insert(0);
+
+	//The first allocation splits the whole block leaving one free range of every smaller size.
+	vk::DeviceSize offset = 1;
+	UNIT_TEST_CHECK(allocator.AllocateFromBlock(block, 0, offset));
+	UNIT_TEST_CHECK(offset == 0);
+	UNIT_TEST_CHECK(IsFree(block, 0, 256));
+	UNIT_TEST_CHECK(IsFree(block, 1, 512));
+	UNIT_TEST_CHECK(IsFree(block, 2, 1024));
+	UNIT_TEST_CHECK(IsFree(block, 3, 2048));
+	UNIT_TEST_CHECK(block.FreeOffsets[4].empty());
+	UNIT_TEST_CHECK(GetFreeCount(block) == 4);
+
+	//Each range that is asked for is handed out without any more splitting and is aligned to its size.
+	vk::DeviceSize offsets[4] = {};
+	uint32_t orders[4] = { 0, 1, 3, 2 };
+	vk::DeviceSize expectedOffsets[4] = { 256, 512, 2048, 1024 };
+	for (size_t i = 0; i < 4; i++)
+	{
+		UNIT_TEST_CHECK(allocator.AllocateFromBlock(block, orders[i], offsets[i]));
+		UNIT_TEST_CHECK(offsets[i] == expectedOffsets[i]);
+		UNIT_TEST_CHECK(offsets[i] % ((vk::DeviceSize)MEMORY_MINIMUM_ALLOCATION << orders[i]) == 0);
+	}
+	UNIT_TEST_CHECK(GetFreeCount(block) == 0);
+	UNIT_TEST_CHECK(!allocator.AllocateFromBlock(block, 0, offset));
+
+	//Freeing in an order where the buddy is still in use leaves the range on its own.
+	allocator.FreeToBlock(block, 0, 256);
+	UNIT_TEST_CHECK(IsFree(block, 0, 256));
+
+	//Merges only go up while the buddy is free.
+	allocator.FreeToBlock(block, 0, 0);
+	UNIT_TEST_CHECK(block.FreeOffsets[0].empty());
+	UNIT_TEST_CHECK(IsFree(block, 1, 0));
+
+	allocator.FreeToBlock(block, 1, 512);
+	UNIT_TEST_CHECK(block.FreeOffsets[1].empty());
+	UNIT_TEST_CHECK(IsFree(block, 2, 0));
+
+	allocator.FreeToBlock(block, 3, 2048);
+	UNIT_TEST_CHECK(IsFree(block, 3, 2048));
+
+	//The last free merges all of the way back to the whole block.
+	allocator.FreeToBlock(block, 2, 1024);
+	UNIT_TEST_CHECK(IsFree(block, 4, 0));
+	UNIT_TEST_CHECK(GetFreeCount(block) == 1);
+}
+
+/*
+Ranges that are next to each other but not buddies must not be merged.
+*/
+static void TestMemoryAllocatorMerge()
+{
+	vk::Device device;
+	vk::PhysicalDeviceMemoryProperties memoryProperties;
+	vk::PhysicalDeviceLimits limits;
+	MemoryAllocator allocator(device, memoryProperties, limits, 1024);
+
+	MemoryBlock block;
+	block.FreeOffsets.resize(allocator.mOrderCount);
+	block.FreeOffsets[allocator.mOrderCount - 1].insert(0);
+
+	vk::DeviceSize offsets[4] = {};
+	for (size_t i = 0; i < 4; i++)
+	{
+		UNIT_TEST_CHECK(allocator.AllocateFromBlock(block, 0, offsets[i]));
+		UNIT_TEST_CHECK(offsets[i] == i * MEMORY_MINIMUM_ALLOCATION);
+	}
+
+	//256 & 512 are next to each other but belong to different parents.
+	allocator.FreeToBlock(block, 0, 256);
+	allocator.FreeToBlock(block, 0, 512);
+	UNIT_TEST_CHECK(IsFree(block, 0, 256));
+	UNIT_TEST_CHECK(IsFree(block, 0, 512));
+	UNIT_TEST_CHECK(block.FreeOffsets[1].empty());
+
+	allocator.FreeToBlock(block, 0, 768);
+	UNIT_TEST_CHECK(IsFree(block, 1, 512));
+	UNIT_TEST_CHECK(IsFree(block, 0, 256));
+
+	allocator.FreeToBlock(block, 0, 0);
+	UNIT_TEST_CHECK(IsFree(block, 2, 0));
+	UNIT_TEST_CHECK(GetFreeCount(block) == 1);
+}
+
+void RunMemoryAllocatorTests()
+{
+	TestMemoryAllocatorSplit();
+	TestMemoryAllocatorMerge();
+}
@@ -0,0 +1,191 @@
+/*
+Copyright(c) 2018 Christopher Joseph Dean Schaefer
+
+This software is provided 'as-is', without any express or implied
+warranty.In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions :
+
+1. The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software.If you use this software
+in a product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include <set>
+
+#include "UnitTests.h"
+#include "../VK9-Library/ShaderConverter.h"
+
+/*
+Opens up the type & constant helpers so they can be called without converting a whole shader.
+Nothing here touches the device so a null handle is fine.
+*/
+class InterningShaderConverter : public ShaderConverter
+{
+public:
+	InterningShaderConverter(vk::Device& device)
+		: ShaderConverter(device)
+	{
+	}
+
+	using ShaderConverter::GetSpirVTypeId;
+	using ShaderConverter::GetConstantId;
+	using ShaderConverter::GetConstantCompositeId;
+	using ShaderConverter::mTypeInstructions;
+};
+
+static uint32_t FloatBits(float value)
+{
+	uint32_t bits = 0;
+	memcpy(&bits, &value, sizeof(bits));
+	return bits;
+}
+
+/*
+Every type & constant the converter declares has to have its own result id and no two declarations may be the same apart from that id.
+*/
+static bool HasUniqueDeclarations(const std::vector<uint32_t>& words)
+{
+	std::set<uint32_t> resultIds;
+	std::set<std::vector<uint32_t> > declarations;
+
+	for (size_t offset = 0; offset < words.size();)
+	{
+		uint32_t wordCount = words[offset] >> spv::WordCountShift;
+		spv::Op opcode = (spv::Op)(words[offset] & spv::OpCodeMask);
+		if (!wordCount || offset + wordCount > words.size())
+		{
+			return false;
+		}
+
+		//Types put the result id first & constants put it after their type.
+		size_t resultOffset = (opcode == spv::OpConstant || opcode == spv::OpConstantComposite) ? 2 : 1;
+		if (wordCount <= resultOffset || !resultIds.insert(words[offset + resultOffset]).second)
+		{
+			return false;
+		}
+
+		std::vector<uint32_t> declaration(words.begin() + offset, words.begin() + offset + wordCount);
+		declaration.erase(declaration.begin() + resultOffset);
+		if (!declarations.insert(declaration).second)
+		{
+			return false;
+		}
+
+		offset += wordCount;
+	}
+
+	return true;
+}
+
+static void TestShaderConverterTypeInterning()
+{
+	vk::Device device;
+	InterningShaderConverter converter(device);
+
+	uint32_t floatTypeId = converter.GetSpirVTypeId(spv::OpTypeFloat);
+	uint32_t intTypeId = converter.GetSpirVTypeId(spv::OpTypeInt);
+	uint32_t boolTypeId = converter.GetSpirVTypeId(spv::OpTypeBool);
+	UNIT_TEST_CHECK(converter.GetSpirVTypeId(spv::OpTypeFloat) == floatTypeId);
+	UNIT_TEST_CHECK(floatTypeId != intTypeId);
+	UNIT_TEST_CHECK(floatTypeId != boolTypeId);
+	UNIT_TEST_CHECK(intTypeId != boolTypeId);
+
+	//Fields a type doesn't use don't change which id it gets.
+	uint32_t vectorTypeId = converter.GetSpirVTypeId(spv::OpTypeVector, spv::OpTypeFloat, 4);
+	TypeDescription vectorType;
+	vectorType.PrimaryType = spv::OpTypeVector;
+	vectorType.SecondaryType = spv::OpTypeFloat;
+	vectorType.TernaryType = spv::OpTypeInt;
+	vectorType.ComponentCount = 4;
+	vectorType.StorageClass = spv::StorageClassUniform;
+	UNIT_TEST_CHECK(converter.GetSpirVTypeId(vectorType) == vectorTypeId);
+	UNIT_TEST_CHECK(converter.GetSpirVTypeId(spv::OpTypeVector, spv::OpTypeFloat, 3) != vectorTypeId);
+	UNIT_TEST_CHECK(converter.GetSpirVTypeId(spv::OpTypeVector, spv::OpTypeInt, 4) != vectorTypeId);
+
+	//Pointers are keyed by storage class as well as what they point at.
+	uint32_t inputPointerTypeId = converter.GetSpirVTypeId(spv::OpTypePointer, spv::OpTypeVector, spv::OpTypeFloat, 4);
+	TypeDescription outputPointerType;
+	outputPointerType.PrimaryType = spv::OpTypePointer;
+	outputPointerType.SecondaryType = spv::OpTypeVector;
+	outputPointerType.TernaryType = spv::OpTypeFloat;
+	outputPointerType.ComponentCount = 4;
+	outputPointerType.StorageClass = spv::StorageClassOutput;
+	uint32_t outputPointerTypeId = converter.GetSpirVTypeId(outputPointerType);
+	UNIT_TEST_CHECK(inputPointerTypeId != outputPointerTypeId);
+	UNIT_TEST_CHECK(converter.GetSpirVTypeId(spv::OpTypePointer, spv::OpTypeVector, spv::OpTypeFloat, 4) == inputPointerTypeId);
+	UNIT_TEST_CHECK(converter.GetSpirVTypeId(outputPointerType) == outputPointerTypeId);
+
+	//Images & sampled images are declared as one pair and image pointers always end up UniformConstant.
+	uint32_t imageTypeId = converter.GetSpirVTypeId(spv::OpTypeImage);
+	UNIT_TEST_CHECK(converter.GetSpirVTypeId(spv::OpTypeSampledImage) == imageTypeId);
+	uint32_t imagePointerTypeId = converter.GetSpirVTypeId(spv::OpTypePointer, spv::OpTypeSampledImage);
+	TypeDescription imagePointerType;
+	imagePointerType.PrimaryType = spv::OpTypePointer;
+	imagePointerType.SecondaryType = spv::OpTypeImage;
+	imagePointerType.ComponentCount = 4;
+	imagePointerType.StorageClass = spv::StorageClassOutput;
+	UNIT_TEST_CHECK(converter.GetSpirVTypeId(imagePointerType) == imagePointerTypeId);
+
+	//Function types include their arguments.
+	uint32_t functionTypeId = converter.GetSpirVTypeId(spv::OpTypeFunction, spv::OpTypeVoid);
+	TypeDescription functionType;
+	functionType.PrimaryType = spv::OpTypeFunction;
+	functionType.SecondaryType = spv::OpTypeVoid;
+	functionType.Arguments.push_back(inputPointerTypeId);
+	uint32_t argumentFunctionTypeId = converter.GetSpirVTypeId(functionType);
+	UNIT_TEST_CHECK(functionTypeId != argumentFunctionTypeId);
+	UNIT_TEST_CHECK(converter.GetSpirVTypeId(functionType) == argumentFunctionTypeId);
+
+	UNIT_TEST_CHECK(HasUniqueDeclarations(converter.mTypeInstructions));
+}
+
+static void TestShaderConverterConstantInterning()
+{
+	vk::Device device;
+	InterningShaderConverter converter(device);
+
+	uint32_t floatTypeId = converter.GetSpirVTypeId(spv::OpTypeFloat);
+	uint32_t intTypeId = converter.GetSpirVTypeId(spv::OpTypeInt);
+	uint32_t vectorTypeId = converter.GetSpirVTypeId(spv::OpTypeVector, spv::OpTypeFloat, 4);
+
+	uint32_t oneId = converter.GetConstantId(floatTypeId, FloatBits(1.0f));
+	UNIT_TEST_CHECK(converter.GetConstantId(floatTypeId, FloatBits(1.0f)) == oneId);
+	UNIT_TEST_CHECK(converter.GetConstantId(floatTypeId, FloatBits(0.0f)) != oneId);
+	UNIT_TEST_CHECK(converter.GetConstantId(floatTypeId, FloatBits(-0.0f)) != converter.GetConstantId(floatTypeId, FloatBits(0.0f))); //Compared as bits not as floats.
+
+	//The same bits with another type are another constant.
+	uint32_t intOneId = converter.GetConstantId(intTypeId, FloatBits(1.0f));
+	UNIT_TEST_CHECK(intOneId != oneId);
+	UNIT_TEST_CHECK(converter.GetConstantId(intTypeId, FloatBits(1.0f)) == intOneId);
+
+	//Composites share the table with scalar constants.
+	uint32_t compositeId = converter.GetConstantCompositeId(vectorTypeId, oneId, 4);
+	UNIT_TEST_CHECK(compositeId != oneId);
+	UNIT_TEST_CHECK(converter.GetConstantCompositeId(vectorTypeId, oneId, 4) == compositeId);
+	UNIT_TEST_CHECK(converter.GetConstantCompositeId(vectorTypeId, converter.GetConstantId(floatTypeId, FloatBits(0.0f)), 4) != compositeId);
+
+	ConstantDescription composite;
+	composite.Opcode = spv::OpConstantComposite;
+	composite.TypeId = vectorTypeId;
+	composite.Values.assign(4, oneId);
+	UNIT_TEST_CHECK(converter.GetConstantId(composite) == compositeId);
+
+	UNIT_TEST_CHECK(HasUniqueDeclarations(converter.mTypeInstructions));
+}
+
+void RunShaderConverterTests()
+{
+	TestShaderConverterTypeInterning();
+	TestShaderConverterConstantInterning();
+}
@@ -0,0 +1,211 @@
+/*
+Copyright(c) 2018 Christopher Joseph Dean Schaefer
+
+This software is provided 'as-is', without any express or implied
+warranty.In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions :
+
+1. The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software.If you use this software
+in a product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#define WIN32_LEAN_AND_MEAN
+
+#include <windows.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <fstream>
+
+#include "UnitTests.h"
+#include "../VK9-Library/Perf_ShaderDiskCache.h"
+
+/*
+The cache only looks at the converter's words & tables so a converter that was never run stands in for a converted shader.
+Store skips failed conversions so the module handle is faked and cleared again before the converter is destroyed.
+*/
+static void StoreShader(ShaderDiskCache& cache, uint64_t key, uint32_t seed)
+{
+	vk::Device device;
+	ShaderConverter converter(device);
+
+	uint32_t tokens[4] = { 0xFFFE0200, seed, seed + 1, 0x0000FFFF };
+	converter.mInstructions.assign(8, seed * 2);
+	converter.mConvertedShader.ShaderModule = vk::ShaderModule((VkShaderModule)1);
+
+	cache.Store(key, tokens, 4, converter);
+
+	converter.mConvertedShader.ShaderModule = vk::ShaderModule();
+}
+
+static bool LoadShader(ShaderDiskCache& cache, uint64_t key, uint32_t seed)
+{
+	vk::Device device;
+	ShaderConverter converter(device);
+
+	uint32_t tokens[4] = { 0xFFFE0200, seed, seed + 1, 0x0000FFFF };
+	if (!cache.Load(key, tokens, 4, converter))
+	{
+		return false;
+	}
+
+	return converter.mInstructions == std::vector<uint32_t>(8, seed * 2);
+}
+
+static std::string GetCachePath()
+{
+	char path[MAX_PATH] = {};
+	GetTempPathA(MAX_PATH, path);
+	return std::string(path) + "VK9-Tests.shaders";
+}
+
+static void TestShaderDiskCacheRoundTrip()
+{
+	std::string path = GetCachePath();
+	DeleteFileA(path.c_str());
+
+	{
+		ShaderDiskCache cache(path, 1024 * 1024);
+		UNIT_TEST_CHECK(!LoadShader(cache, 1, 10));
+		StoreShader(cache, 1, 10);
+		UNIT_TEST_CHECK(LoadShader(cache, 1, 10)); //Pending entries are found before they are saved.
+	}
+
+	{
+		ShaderDiskCache cache(path, 1024 * 1024);
+		UNIT_TEST_CHECK(cache.mIndex.size() == 1);
+		UNIT_TEST_CHECK(LoadShader(cache, 1, 10));
+		UNIT_TEST_CHECK(!LoadShader(cache, 1, 11)); //Same key with different bytecode is a miss.
+	}
+
+	DeleteFileA(path.c_str());
+}
+
+/*
+A damaged entry is only noticed when it is loaded. It has to miss and be dropped without taking the rest of the file with it.
+*/
+static void TestShaderDiskCacheCorruptEntry()
+{
+	std::string path = GetCachePath();
+	DeleteFileA(path.c_str());
+
+	{
+		ShaderDiskCache cache(path, 1024 * 1024);
+		StoreShader(cache, 1, 10);
+		StoreShader(cache, 2, 20);
+	}
+
+	//Flip a byte in the middle of the first entry's SPIR-V words.
+	{
+		std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+		ShaderCacheHeader header;
+		ShaderCacheIndexEntry entry;
+		file.read((char*)&header, sizeof(ShaderCacheHeader));
+		file.read((char*)&entry, sizeof(ShaderCacheIndexEntry));
+		UNIT_TEST_CHECK(header.EntryCount == 2);
+
+		uint64_t position = entry.Offset + entry.Size - 4;
+		char value = 0;
+		file.seekg(position);
+		file.read(&value, 1);
+		value = ~value;
+		file.seekp(position);
+		file.write(&value, 1);
+		UNIT_TEST_CHECK((bool)file);
+
+		uint64_t corruptKey = entry.Key;
+		uint64_t validKey = (corruptKey == 1) ? 2 : 1;
+		file.close();
+
+		ShaderDiskCache cache(path, 1024 * 1024);
+		UNIT_TEST_CHECK(cache.mIndex.size() == 2); //The index itself is still good.
+		UNIT_TEST_CHECK(!LoadShader(cache, corruptKey, (uint32_t)corruptKey * 10));
+		UNIT_TEST_CHECK(cache.mIndex.find(corruptKey) == cache.mIndex.end());
+		UNIT_TEST_CHECK(cache.mIsDirty);
+		UNIT_TEST_CHECK(LoadShader(cache, validKey, (uint32_t)validKey * 10));
+
+		//The shader is converted again and replaces the entry.
+		StoreShader(cache, corruptKey, (uint32_t)corruptKey * 10);
+	}
+
+	{
+		ShaderDiskCache cache(path, 1024 * 1024);
+		UNIT_TEST_CHECK(cache.mIndex.size() == 2);
+		UNIT_TEST_CHECK(LoadShader(cache, 1, 10));
+		UNIT_TEST_CHECK(LoadShader(cache, 2, 20));
+	}
+
+	//A damaged index replaces the whole file.
+	{
+		std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+		char value = 0x55;
+		file.seekp(sizeof(ShaderCacheHeader) + 1);
+		file.write(&value, 1);
+	}
+
+	{
+		ShaderDiskCache cache(path, 1024 * 1024);
+		UNIT_TEST_CHECK(cache.mIndex.empty());
+		UNIT_TEST_CHECK(!LoadShader(cache, 1, 10));
+	}
+
+	DeleteFileA(path.c_str());
+}
+
+/*
+Past the size cap the least recently used entries are the ones left out of the file.
+*/
+static void TestShaderDiskCacheTrim()
+{
+	std::string path = GetCachePath();
+	DeleteFileA(path.c_str());
+
+	//Each entry is an entry header, 4 tokens & 8 words.
+	const uint64_t entrySize = sizeof(ShaderCacheIndexEntry) + sizeof(ShaderCacheEntryHeader) + 4 * sizeof(uint32_t) + 8 * sizeof(uint32_t);
+	const uint64_t maxSize = sizeof(ShaderCacheHeader) + entrySize * 2 + entrySize / 2; //Room for two.
+
+	{
+		ShaderDiskCache cache(path, maxSize);
+		StoreShader(cache, 1, 10);
+		StoreShader(cache, 2, 20);
+		StoreShader(cache, 3, 30);
+		UNIT_TEST_CHECK(LoadShader(cache, 1, 10)); //1 is now the most recently used and 2 the least.
+	}
+
+	{
+		ShaderDiskCache cache(path, maxSize);
+		UNIT_TEST_CHECK(cache.mIndex.size() == 2);
+		UNIT_TEST_CHECK(!LoadShader(cache, 2, 20));
+		UNIT_TEST_CHECK(LoadShader(cache, 3, 30));
+		UNIT_TEST_CHECK(LoadShader(cache, 1, 10));
+
+		//Use stamps carry over between runs so storing 2 again leaves 3 as the least recently used.
+		StoreShader(cache, 2, 20);
+	}
+
+	{
+		ShaderDiskCache cache(path, maxSize);
+		UNIT_TEST_CHECK(cache.mIndex.size() == 2);
+		UNIT_TEST_CHECK(LoadShader(cache, 2, 20));
+		UNIT_TEST_CHECK(LoadShader(cache, 1, 10));
+		UNIT_TEST_CHECK(!LoadShader(cache, 3, 30));
+	}
+
+	DeleteFileA(path.c_str());
+}
+
+void RunShaderDiskCacheTests()
+{
+	TestShaderDiskCacheRoundTrip();
+	TestShaderDiskCacheCorruptEntry();
+	TestShaderDiskCacheTrim();
+}
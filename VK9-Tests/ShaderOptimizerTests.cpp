@@ -0,0 +1,296 @@
+/*
+Copyright(c) 2018 Christopher Joseph Dean Schaefer
+
+This software is provided 'as-is', without any express or implied
+warranty.In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions :
+
+1. The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software.If you use this software
+in a product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#include "UnitTests.h"
+#include "../VK9-Library/Perf_ShaderOptimizer.h"
+
+/*
+Builds a module one instruction at a time. The header's bound is filled in by the caller.
+*/
+struct SpirVModuleBuilder
+{
+	std::vector<uint32_t> mWords;
+
+	SpirVModuleBuilder(uint32_t bound)
+	{
+		mWords = { spv::MagicNumber, 0x00010000, 0, bound, 0 };
+	}
+
+	void Add(spv::Op opcode, std::vector<uint32_t> operands)
+	{
+		mWords.push_back((((uint32_t)operands.size() + 1) << spv::WordCountShift) | opcode);
+		mWords.insert(mWords.end(), operands.begin(), operands.end());
+	}
+
+	void Add(spv::Op opcode, std::vector<uint32_t> operands, const char* name, std::vector<uint32_t> tail = {})
+	{
+		size_t length = strlen(name) + 1;
+		for (size_t i = 0; i < length; i += 4)
+		{
+			uint32_t word = 0;
+			memcpy(&word, name + i, (length - i < 4) ? (length - i) : 4);
+			operands.push_back(word);
+		}
+		operands.insert(operands.end(), tail.begin(), tail.end());
+		Add(opcode, operands);
+	}
+};
+
+static size_t CountInstructions(const std::vector<uint32_t>& words, spv::Op opcode)
+{
+	size_t count = 0;
+	for (size_t offset = 5; offset < words.size(); offset += (words[offset] >> spv::WordCountShift))
+	{
+		if ((words[offset] & spv::OpCodeMask) == opcode)
+		{
+			count++;
+		}
+
+		if (!(words[offset] >> spv::WordCountShift))
+		{
+			break;
+		}
+	}
+	return count;
+}
+
+/*
+Returns the offset of the last instruction with the opcode or 0 if there isn't one.
+*/
+static size_t FindLastInstruction(const std::vector<uint32_t>& words, spv::Op opcode)
+{
+	size_t result = 0;
+	for (size_t offset = 5; offset < words.size() && (words[offset] >> spv::WordCountShift); offset += (words[offset] >> spv::WordCountShift))
+	{
+		if ((words[offset] & spv::OpCodeMask) == opcode)
+		{
+			result = offset;
+		}
+	}
+	return result;
+}
+
+/*
+The optimizer's own parser checks the opcodes, word counts & ids are in range.
+On top of that every id that is read has to be defined exactly once.
+*/
+static bool IsValidModule(const std::vector<uint32_t>& words)
+{
+	ShaderOptimizer parser;
+	parser.mWords = words;
+	if (!parser.Parse())
+	{
+		return false;
+	}
+
+	std::vector<uint32_t> definitionCounts(words[3], 0);
+	for (const auto& instruction : parser.mInstructions)
+	{
+		if (instruction.ResultId)
+		{
+			definitionCounts[instruction.ResultId]++;
+		}
+	}
+
+	bool isValid = true;
+	for (const auto& instruction : parser.mInstructions)
+	{
+		if (instruction.ResultId && definitionCounts[instruction.ResultId] != 1)
+		{
+			isValid = false;
+		}
+
+		parser.ForEachIdOperand(instruction, [&isValid, &definitionCounts](uint32_t& id)
+		{
+			if (!definitionCounts[id])
+			{
+				isValid = false;
+			}
+		});
+	}
+
+	return isValid;
+}
+
+/*
+The shape ShaderConverter produces for a register read with a swizzle and a masked write.
+*/
+static std::vector<uint32_t> BuildConverterLikeModule()
+{
+	SpirVModuleBuilder module(100);
+
+	module.Add(spv::OpCapability, { spv::CapabilityShader });
+	module.Add(spv::OpExtInstImport, { 2 }, "GLSL.std.450");
+	module.Add(spv::OpMemoryModel, { spv::AddressingModelLogical, spv::MemoryModelGLSL450 });
+	module.Add(spv::OpEntryPoint, { spv::ExecutionModelVertex, 3 }, "main", { 20, 21 });
+	module.Add(spv::OpName, { 40 }, "unused");
+	module.Add(spv::OpDecorate, { 20, spv::DecorationLocation, 0 });
+	module.Add(spv::OpDecorate, { 50, spv::DecorationSpecId, 7 });
+
+	module.Add(spv::OpTypeVoid, { 5 });
+	module.Add(spv::OpTypeFunction, { 6, 5 });
+	module.Add(spv::OpTypeFloat, { 7, 32 });
+	module.Add(spv::OpTypeVector, { 8, 7, 4 });
+	module.Add(spv::OpTypePointer, { 9, spv::StorageClassInput, 8 });
+	module.Add(spv::OpTypePointer, { 10, spv::StorageClassOutput, 8 });
+	module.Add(spv::OpConstant, { 7, 11, 0x3f800000 });
+	module.Add(spv::OpConstant, { 7, 12, 0x3f800000 }); //Same value as 11.
+	module.Add(spv::OpConstantComposite, { 8, 13, 11, 11, 11, 11 });
+	module.Add(spv::OpConstantComposite, { 8, 14, 12, 12, 12, 12 });
+	module.Add(spv::OpSpecConstant, { 7, 50, 0 });
+	module.Add(spv::OpVariable, { 9, 20, spv::StorageClassInput });
+	module.Add(spv::OpVariable, { 10, 21, spv::StorageClassOutput });
+
+	module.Add(spv::OpFunction, { 5, 3, spv::FunctionControlMaskNone, 6 });
+	module.Add(spv::OpLabel, { 22 });
+	module.Add(spv::OpLoad, { 8, 30, 20 });
+	module.Add(spv::OpLoad, { 8, 31, 20 }); //Same pointer with no store in between.
+	module.Add(spv::OpVectorShuffle, { 8, 32, 30, 30, 0, 1, 2, 3 }); //Identity .xyzw
+	module.Add(spv::OpVectorShuffle, { 8, 33, 31, 31, 3, 2, 1, 0 });
+	module.Add(spv::OpVectorShuffle, { 8, 34, 33, 33, 3, 2, 1, 0 }); //Undoes the one before it.
+	module.Add(spv::OpFAdd, { 8, 35, 32, 34 });
+	module.Add(spv::OpFAdd, { 8, 36, 30, 31 });
+	module.Add(spv::OpFMul, { 8, 37, 35, 36 });
+	module.Add(spv::OpFMul, { 8, 38, 37, 14 });
+	module.Add(spv::OpStore, { 21, 38 });
+	module.Add(spv::OpFMul, { 8, 40, 37, 37 }); //Never used.
+	module.Add(spv::OpLoad, { 8, 41, 21 }); //Reads back what was just stored.
+	module.Add(spv::OpVectorShuffle, { 8, 42, 41, 13, 4, 1, 6, 3 }); //Write mask merging the old value with a new one.
+	module.Add(spv::OpCompositeExtract, { 7, 43, 42, 2 });
+	module.Add(spv::OpCompositeConstruct, { 8, 44, 43, 43, 43, 43 });
+	module.Add(spv::OpStore, { 21, 44 });
+	module.Add(spv::OpReturn, {});
+	module.Add(spv::OpFunctionEnd, {});
+
+	return module.mWords;
+}
+
+static void TestShaderOptimizerOutput()
+{
+	std::vector<uint32_t> words = BuildConverterLikeModule();
+	UNIT_TEST_CHECK(IsValidModule(words));
+
+	size_t loadCount = CountInstructions(words, spv::OpLoad);
+	size_t shuffleCount = CountInstructions(words, spv::OpVectorShuffle);
+
+	ShaderOptimizer optimizer;
+	size_t removedCount = optimizer.Optimize(words);
+
+	UNIT_TEST_CHECK(removedCount > 0);
+	UNIT_TEST_CHECK(IsValidModule(words));
+	UNIT_TEST_CHECK(words[3] == 100); //The bound is left alone.
+
+	//Loads are forwarded & identity shuffles dropped but memory writes stay.
+	UNIT_TEST_CHECK(CountInstructions(words, spv::OpLoad) < loadCount);
+	UNIT_TEST_CHECK(CountInstructions(words, spv::OpVectorShuffle) < shuffleCount);
+	UNIT_TEST_CHECK(CountInstructions(words, spv::OpStore) == 2);
+	UNIT_TEST_CHECK(CountInstructions(words, spv::OpFunction) == 1);
+
+	//An unread spec constant goes with its decoration. (a map entry for a missing SpecId is ignored by the driver)
+	UNIT_TEST_CHECK(CountInstructions(words, spv::OpSpecConstant) == 0);
+	UNIT_TEST_CHECK(CountInstructions(words, spv::OpDecorate) == 1);
+
+	//Running it again shouldn't find anything more to do.
+	std::vector<uint32_t> optimizedWords = words;
+	ShaderOptimizer secondOptimizer;
+	secondOptimizer.Optimize(words);
+	UNIT_TEST_CHECK(words == optimizedWords);
+}
+
+/*
+A store has to stop a later load of the same pointer from reusing the value loaded before it.
+*/
+static void TestShaderOptimizerStore()
+{
+	SpirVModuleBuilder module(60);
+
+	module.Add(spv::OpCapability, { spv::CapabilityShader });
+	module.Add(spv::OpMemoryModel, { spv::AddressingModelLogical, spv::MemoryModelGLSL450 });
+	module.Add(spv::OpEntryPoint, { spv::ExecutionModelVertex, 3 }, "main", { 21 });
+	module.Add(spv::OpTypeVoid, { 5 });
+	module.Add(spv::OpTypeFunction, { 6, 5 });
+	module.Add(spv::OpTypeFloat, { 7, 32 });
+	module.Add(spv::OpTypeVector, { 8, 7, 4 });
+	module.Add(spv::OpTypePointer, { 9, spv::StorageClassFunction, 8 });
+	module.Add(spv::OpTypePointer, { 10, spv::StorageClassOutput, 8 });
+	module.Add(spv::OpConstant, { 7, 11, 0x40000000 });
+	module.Add(spv::OpConstantComposite, { 8, 13, 11, 11, 11, 11 });
+	module.Add(spv::OpVariable, { 10, 21, spv::StorageClassOutput });
+
+	module.Add(spv::OpFunction, { 5, 3, spv::FunctionControlMaskNone, 6 });
+	module.Add(spv::OpLabel, { 22 });
+	module.Add(spv::OpVariable, { 9, 20, spv::StorageClassFunction });
+	module.Add(spv::OpLoad, { 8, 30, 20 });
+	module.Add(spv::OpFAdd, { 8, 31, 30, 30 });
+	module.Add(spv::OpStore, { 20, 31 });
+	module.Add(spv::OpLoad, { 8, 32, 20 });
+	module.Add(spv::OpStore, { 21, 32 });
+	module.Add(spv::OpReturn, {});
+	module.Add(spv::OpFunctionEnd, {});
+
+	std::vector<uint32_t> words = module.mWords;
+	ShaderOptimizer optimizer;
+	optimizer.Optimize(words);
+	UNIT_TEST_CHECK(IsValidModule(words));
+
+	//The output gets the sum (or a load of it) but never the value from before the store.
+	size_t store = FindLastInstruction(words, spv::OpStore);
+	UNIT_TEST_CHECK(store != 0);
+	if (store != 0)
+	{
+		UNIT_TEST_CHECK(words[store + 1] == 21);
+		UNIT_TEST_CHECK(words[store + 2] != 30);
+	}
+}
+
+/*
+A module with an opcode the optimizer doesn't know has to come back untouched.
+*/
+static void TestShaderOptimizerUnknownOpcode()
+{
+	std::vector<uint32_t> words = BuildConverterLikeModule();
+
+	//Swap the return for a phi the parser has no layout for. (the module doesn't have to make sense past that)
+	size_t returnOffset = FindLastInstruction(words, spv::OpReturn);
+	UNIT_TEST_CHECK(returnOffset != 0);
+	words.insert(words.begin() + returnOffset, { (5u << spv::WordCountShift) | spv::OpPhi, 8, 45, 30, 22 });
+
+	std::vector<uint32_t> originalWords = words;
+	ShaderOptimizer optimizer;
+	UNIT_TEST_CHECK(optimizer.Optimize(words) == 0);
+	UNIT_TEST_CHECK(words == originalWords);
+
+	//So does something that isn't SPIR-V at all.
+	std::vector<uint32_t> garbage = { 0xFFFE0300, 0x0000FFFF };
+	std::vector<uint32_t> originalGarbage = garbage;
+	UNIT_TEST_CHECK(optimizer.Optimize(garbage) == 0);
+	UNIT_TEST_CHECK(garbage == originalGarbage);
+}
+
+void RunShaderOptimizerTests()
+{
+	TestShaderOptimizerOutput();
+	TestShaderOptimizerStore();
+	TestShaderOptimizerUnknownOpcode();
+}
@@ -0,0 +1,75 @@
+/*
+Copyright(c) 2018 Christopher Joseph Dean Schaefer
+
+This software is provided 'as-is', without any express or implied
+warranty.In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions :
+
+1. The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software.If you use this software
+in a product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#define WIN32_LEAN_AND_MEAN
+
+#include <windows.h>
+#include <stdio.h>
+
+#include "UnitTests.h"
+
+static FILE* gLogFile = NULL;
+static int gCheckCount = 0;
+static int gFailureCount = 0;
+
+void UnitTestCheck(bool result, const char* expression, const char* file, int line)
+{
+	char message[1024];
+
+	gCheckCount++;
+
+	if (result)
+	{
+		return;
+	}
+
+	gFailureCount++;
+
+	_snprintf_s(message, sizeof(message), _TRUNCATE, "%s(%d): check failed: %s\n", file, line, expression);
+	OutputDebugStringA(message);
+	if (gLogFile != NULL)
+	{
+		fputs(message, gLogFile);
+	}
+}
+
+int RunUnitTests()
+{
+	char message[256];
+
+	gLogFile = fopen("UnitTests.log", "w");
+
+	RunCommandRingTests();
+	RunMemoryAllocatorTests();
+	RunShaderDiskCacheTests();
+	RunShaderOptimizerTests();
+	RunShaderConverterTests();
+
+	_snprintf_s(message, sizeof(message), _TRUNCATE, "%d of %d checks failed.\n", gFailureCount, gCheckCount);
+	OutputDebugStringA(message);
+	if (gLogFile != NULL)
+	{
+		fputs(message, gLogFile);
+		fclose(gLogFile);
+		gLogFile = NULL;
+	}
+
+	return gFailureCount;
+}
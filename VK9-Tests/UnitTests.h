@@ -0,0 +1,38 @@
+/*
+Copyright(c) 2018 Christopher Joseph Dean Schaefer
+
+This software is provided 'as-is', without any express or implied
+warranty.In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions :
+
+1. The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software.If you use this software
+in a product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+#pragma once
+
+/*
+A small assertion harness for the parts of the library that don't need a device.
+Running VK9-Tests with -unittests runs them instead of the sample and the exit code is the number of failed checks.
+Failures are written to UnitTests.log and the debugger output.
+*/
+
+#define UNIT_TEST_CHECK(expression) UnitTestCheck((expression), #expression, __FILE__, __LINE__)
+
+void UnitTestCheck(bool result, const char* expression, const char* file, int line);
+int RunUnitTests();
+
+//Tests
+void RunCommandRingTests();
+void RunMemoryAllocatorTests();
+void RunShaderDiskCacheTests();
+void RunShaderOptimizerTests();
+void RunShaderConverterTests();